@@ -0,0 +1,175 @@
+/* -------------------------------------------------------------------------- *
+ *                             OpenMM Laboratory                              *
+ *                             =================                              *
+ *                                                                            *
+ * A plugin for testing low-level code implementation for OpenMM.             *
+ *                                                                            *
+ * Copyright (c) 2023 Charlles Abreu                                          *
+ * https://github.com/craabreu/openmm-lab                                     *
+ * -------------------------------------------------------------------------- */
+
+/**
+ * This program measures the latency of the operations of CustomSummation for increasing
+ * numbers of terms, on every requested platform and on the native backend.  The results
+ * are written in JSON, as an array with one object per combination of backend and number
+ * of terms, and all times are in seconds.  Run it with --help=1 to see the options.
+ *
+ * Every evaluation is made with different arguments, so that no result comes from the
+ * cache of the summation, except for the one labeled "cachedEvaluate".
+ */
+
+#include "BenchmarkUtilities.h"
+#include "CustomSummation.h"
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+
+using namespace OpenMMLab;
+using namespace OpenMM;
+using namespace std;
+
+struct Backend {
+    string name, platformName;
+    map<string, string> properties;
+};
+
+static map<string, double> runBenchmark(const Backend& backend, int numTerms, int numEvaluations) {
+    // The terms are Gaussians centered at random points of a three-dimensional space.
+
+    OpenMM_SFMT::SFMT sfmt;
+    init_gen_rand(0, sfmt);
+    vector<double> parameters(3*numTerms);
+    for (double& value : parameters)
+        value = 10*genrand_real2(sfmt);
+    map<string, double> results;
+    Timer timer;
+    CustomSummation summation(
+        3,
+        "exp(-((x1-mux)^2+(y1-muy)^2+(z1-muz)^2)/(2*sigma^2))",
+        map<string, double>{{"sigma", 1.0}},
+        vector<string>{"mux", "muy", "muz"},
+        Platform::getPlatformByName(backend.platformName),
+        backend.properties
+    );
+    results["create"] = timer.elapsed();
+    summation.setTerms(parameters.data(), numTerms);
+    timer.start();
+    summation.update();
+    results["initialUpdate"] = timer.elapsed();
+
+    // The first evaluation is not timed, since it may include the compilation of kernels.
+
+    vector<double> arguments = {5.0, 5.0, 5.0};
+    summation.evaluate(arguments);
+    timer.start();
+    for (int i = 0; i < numEvaluations; i++) {
+        arguments[0] += 1e-6;
+        summation.evaluate(arguments);
+    }
+    results["evaluate"] = timer.elapsed()/numEvaluations;
+    timer.start();
+    for (int i = 0; i < numEvaluations; i++) {
+        arguments[0] += 1e-6;
+        summation.evaluateDerivative(arguments, 0);
+    }
+    results["evaluateDerivative"] = timer.elapsed()/numEvaluations;
+    timer.start();
+    for (int i = 0; i < numEvaluations; i++)
+        summation.evaluate(arguments);
+    results["cachedEvaluate"] = timer.elapsed()/numEvaluations;
+
+    // Measure updates of a single term and of all terms.
+
+    timer.start();
+    for (int i = 0; i < numEvaluations; i++) {
+        parameters[0] += 1e-6;
+        summation.setTerm(0, vector<double>(parameters.begin(), parameters.begin()+3));
+        summation.update();
+    }
+    results["singleTermUpdate"] = timer.elapsed()/numEvaluations;
+    for (double& value : parameters)
+        value += 1e-6;
+    timer.start();
+    summation.setTerms(parameters.data(), numTerms);
+    summation.update();
+    results["allTermsUpdate"] = timer.elapsed();
+
+    // Measure clones, including their destruction.
+
+    timer.start();
+    for (int i = 0; i < numEvaluations; i++)
+        delete summation.clone();
+    results["clone"] = timer.elapsed()/numEvaluations;
+    return results;
+}
+
+int main(int argc, char* argv[]) {
+    try {
+        map<string, string> defaults = {
+            {"platforms", "Reference,CPU,CUDA,OpenCL"},
+            {"precision", "mixed"},
+            {"native", "1"},
+            {"terms", "1,10,100,1k,10k,100k,1M"},
+            {"evaluations", "20"},
+            {"output", "-"},
+            {"help", "0"}
+        };
+        map<string, string> options = parseOptions(argc, argv, defaults);
+        if (options["help"] != "0") {
+            cout << "Usage: " << argv[0] << " [--name=value ...]" << endl << "Options and defaults:" << endl;
+            for (auto& option : defaults)
+                cout << "    --" << option.first << "=" << option.second << endl;
+            cout << "Set --output to a file name to write the results there instead of the standard output." << endl;
+            return 0;
+        }
+        loadPlugins();
+
+        // Platforms that are not available are skipped.  The native backend ignores the
+        // platform, so the Reference platform is passed to it.
+
+        vector<Backend> backends;
+        for (const string& name : splitList(options["platforms"])) {
+            try {
+                Platform::getPlatformByName(name);
+            }
+            catch (const OpenMMException& e) {
+                cerr << "Skipping unavailable platform " << name << endl;
+                continue;
+            }
+            backends.push_back({name, name, precisionProperties(name, name == "CPU" ? "" : options["precision"])});
+        }
+        if (options["native"] != "0") {
+            backends.push_back({"Native", "Reference", {{"Backend", "Native"}}});
+            backends.push_back({"NativeSIMD", "Reference", {{"Backend", "Native"}, {"Precision", "mixed"}}});
+        }
+        ofstream file;
+        if (options["output"] != "-")
+            file.open(options["output"]);
+        ostream& output = (options["output"] != "-" ? file : cout);
+        int numEvaluations = atoi(options["evaluations"].c_str());
+        output << "[";
+        bool first = true;
+        for (const Backend& backend : backends)
+            for (const string& terms : splitList(options["terms"])) {
+                int numTerms = parseSize(terms);
+                map<string, double> results = runBenchmark(backend, numTerms, numEvaluations);
+                output << (first ? "\n" : ",\n") << "  {\"backend\": \"" << backend.name << "\"";
+                for (auto& property : backend.properties)
+                    output << ", \"" << property.first << "\": \"" << property.second << "\"";
+                output << ", \"terms\": " << numTerms;
+                for (auto& result : results)
+                    output << ", \"" << result.first << "\": " << result.second;
+                output << "}" << flush;
+                first = false;
+            }
+        output << "\n]" << endl;
+    }
+    catch(const exception& e) {
+        cerr << "exception: " << e.what() << endl;
+        return 1;
+    }
+    return 0;
+}
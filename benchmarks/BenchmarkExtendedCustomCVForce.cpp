@@ -0,0 +1,223 @@
+/* -------------------------------------------------------------------------- *
+ *                             OpenMM Laboratory                              *
+ *                             =================                              *
+ *                                                                            *
+ * A plugin for testing low-level code implementation for OpenMM.             *
+ *                                                                            *
+ * Copyright (c) 2023 Charlles Abreu                                          *
+ * https://github.com/craabreu/openmm-lab                                     *
+ * -------------------------------------------------------------------------- */
+
+/**
+ * This program measures the overhead of ExtendedCustomCVForce in boxes of water.  The
+ * same collective variables are added to the System in three ways: directly, as bare
+ * forces, through OpenMM's CustomCVForce, and through ExtendedCustomCVForce.  For every
+ * system size, number of variables and number of atoms per variable, it reports the time
+ * per step of each version and splits the time of an ExtendedCustomCVForce evaluation
+ * into its parts.  Run it with --help=1 to see the options.
+ *
+ * The parts cannot be timed inside the kernel, so they are obtained from force
+ * evaluations that each include a known subset of the work:
+ *
+ * <ul>
+ * <li>inner CVs: the evaluation of each variable in the inner Context</li>
+ * <li>copyState: an evaluation of the force minus its other parts</li>
+ * <li>expression: an energy-only evaluation in which every variable is held from a
+ * previous evaluation, so that only the energy expression is computed</li>
+ * <li>addForces: the same with forces, which adds the derivatives of the expression and
+ * the accumulation of the forces of the variables, minus the expression part</li>
+ * </ul>
+ *
+ * The cost of starting an evaluation and downloading its results, obtained from an
+ * evaluation of no force groups, is subtracted from every part.
+ */
+
+#include "BenchmarkUtilities.h"
+#include "ExtendedCustomCVForce.h"
+#include "openmm/Context.h"
+#include "openmm/CustomCVForce.h"
+#include "openmm/CustomExternalForce.h"
+#include "openmm/LocalEnergyMinimizer.h"
+#include "openmm/State.h"
+#include "openmm/VerletIntegrator.h"
+#include <algorithm>
+#include <cstdio>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+
+using namespace OpenMMLab;
+using namespace OpenMM;
+using namespace std;
+
+enum Variant {Base, Bare, CustomCV, Extended};
+
+static const double StepSize = 0.002;
+
+/**
+ * Create a collective variable given by the sum of the x coordinates of a group of
+ * consecutive atoms.
+ */
+static CustomExternalForce* createVariable(int index, int atomsPerCV, int numAtoms, double scale) {
+    CustomExternalForce* variable = new CustomExternalForce(to_string(scale)+"*x");
+    int first = (index*atomsPerCV)%numAtoms;
+    for (int i = 0; i < atomsPerCV; i++)
+        variable->addParticle((first+i)%numAtoms);
+    return variable;
+}
+
+/**
+ * Create a box of water with the collective variables added in one of the ways being
+ * compared.  The variables are in force group 1 and everything else in force group 0.
+ */
+static void createSystem(Variant variant, int numAtoms, int numCVs, int atomsPerCV, System& system, vector<Vec3>& positions) {
+    NonbondedForce* nonbonded = createWaterBox(numAtoms, NonbondedForce::PME, system, positions);
+    system.addForce(nonbonded);
+    numAtoms = system.getNumParticles();
+    atomsPerCV = (atomsPerCV <= 0 ? numAtoms : min(atomsPerCV, numAtoms));
+    const double scale = 0.001;
+    string expression;
+    for (int i = 0; i < numCVs; i++)
+        expression += (i == 0 ? "" : "+") + string("v")+to_string(i);
+    expression = to_string(scale)+"*("+expression+")";
+    if (variant == Bare)
+        for (int i = 0; i < numCVs; i++) {
+            CustomExternalForce* variable = createVariable(i, atomsPerCV, numAtoms, scale);
+            variable->setForceGroup(1);
+            system.addForce(variable);
+        }
+    else if (variant == CustomCV) {
+        CustomCVForce* force = new CustomCVForce(expression);
+        for (int i = 0; i < numCVs; i++)
+            force->addCollectiveVariable("v"+to_string(i), createVariable(i, atomsPerCV, numAtoms, 1.0));
+        force->setForceGroup(1);
+        system.addForce(force);
+    }
+    else if (variant == Extended) {
+        ExtendedCustomCVForce* force = new ExtendedCustomCVForce(expression);
+        for (int i = 0; i < numCVs; i++)
+            force->addCollectiveVariable("v"+to_string(i), createVariable(i, atomsPerCV, numAtoms, 1.0));
+        force->setForceGroup(1);
+        system.addForce(force);
+    }
+}
+
+/**
+ * Get the average time taken by a call to getState(), after a first call that is not timed.
+ */
+static double timeState(Context& context, int types, int groups, int numEvaluations) {
+    context.getState(types, false, groups);
+    Timer timer;
+    for (int i = 0; i < numEvaluations; i++)
+        context.getState(types, false, groups);
+    return timer.elapsed()/numEvaluations;
+}
+
+/**
+ * Get the average time taken by a step of a simulation.
+ */
+static double timeSteps(Context& context, int numSteps) {
+    context.getIntegrator().step(10);
+    context.getState(State::Energy);
+    Timer timer;
+    context.getIntegrator().step(numSteps);
+    context.getState(State::Energy);
+    return timer.elapsed()/numSteps;
+}
+
+int main(int argc, char* argv[]) {
+    try {
+        map<string, string> defaults = {
+            {"platform", "CUDA"},
+            {"precision", "mixed"},
+            {"atoms", "23k,100k"},
+            {"cvs", "1,4,16"},
+            {"atomsPerCV", "10,1000,all"},
+            {"steps", "500"},
+            {"evaluations", "50"},
+            {"help", "0"}
+        };
+        map<string, string> options = parseOptions(argc, argv, defaults);
+        if (options["help"] != "0") {
+            cout << "Usage: " << argv[0] << " [--name=value ...]" << endl << "Options and defaults:" << endl;
+            for (auto& option : defaults)
+                cout << "    --" << option.first << "=" << option.second << endl;
+            return 0;
+        }
+        loadPlugins();
+        Platform& platform = Platform::getPlatformByName(options["platform"]);
+        map<string, string> properties = precisionProperties(options["platform"], options["precision"]);
+        int numSteps = atoi(options["steps"].c_str());
+        int numEvaluations = atoi(options["evaluations"].c_str());
+        cout << "# Platform: " << platform.getName() << ", precision: " << options["precision"] << endl;
+        cout << "# Step times in ms: base has no CVs, bare adds them as forces, custom uses CustomCVForce, extended uses ExtendedCustomCVForce" << endl;
+        cout << "# Parts of an ExtendedCustomCVForce evaluation in ms: see the comments in the source for how they are obtained" << endl;
+        printf("%10s %4s %10s | %8s %8s %8s %8s | %9s %9s %10s %9s\n", "# atoms", "CVs", "atoms/CV",
+               "base", "bare", "custom", "extended", "copyState", "inner CVs", "expression", "addForces");
+        for (const string& size : splitList(options["atoms"])) {
+            // Minimize the box once and use the same positions for every variant.
+
+            vector<Vec3> minimized;
+            {
+                System system;
+                createSystem(Base, parseSize(size), 0, 0, system, minimized);
+                VerletIntegrator integrator(StepSize);
+                Context context(system, integrator, platform, properties);
+                context.setPositions(minimized);
+                LocalEnergyMinimizer::minimize(context, 100.0, 200);
+                minimized = context.getState(State::Positions).getPositions();
+            }
+            int numAtoms = minimized.size();
+            for (const string& cvs : splitList(options["cvs"]))
+                for (const string& perCV : splitList(options["atomsPerCV"])) {
+                    int numCVs = atoi(cvs.c_str());
+                    if (numCVs < 1 || numCVs > 31)
+                        throw OpenMMException("The number of collective variables must be between 1 and 31");
+                    int atomsPerCV = (perCV == "all" ? numAtoms : min(parseSize(perCV), numAtoms));
+                    double stepTimes[4];
+                    double copyState, innerCVs, expression, addForces;
+                    for (int variant = Base; variant <= Extended; variant++) {
+                        System system;
+                        vector<Vec3> positions;
+                        createSystem((Variant) variant, numAtoms, numCVs, atomsPerCV, system, positions);
+                        VerletIntegrator integrator(StepSize);
+                        Context context(system, integrator, platform, properties);
+                        context.setPositions(minimized);
+                        context.setVelocitiesToTemperature(300.0);
+                        stepTimes[variant] = timeSteps(context, numSteps);
+                        if (variant != Extended)
+                            continue;
+
+                        // Split the evaluation of the ExtendedCustomCVForce into its parts.
+
+                        ExtendedCustomCVForce& force = dynamic_cast<ExtendedCustomCVForce&>(system.getForce(1));
+                        Context& innerContext = force.getInnerContext(context);
+                        double overhead = timeState(context, State::Forces, 0, numEvaluations);
+                        double total = timeState(context, State::Forces, 1<<1, numEvaluations)-overhead;
+                        double innerOverhead = timeState(innerContext, State::Forces, 0, numEvaluations);
+                        innerCVs = 0.0;
+                        for (int i = 0; i < numCVs; i++)
+                            innerCVs += timeState(innerContext, State::Forces, 1<<i, numEvaluations)-innerOverhead;
+                        for (int i = 0; i < numCVs; i++)
+                            force.setCollectiveVariableInterval(i, 1000000000);
+                        force.updateParametersInContext(context);
+                        double energyOverhead = timeState(context, State::Energy, 0, numEvaluations);
+                        expression = timeState(context, State::Energy, 1<<1, numEvaluations)-energyOverhead;
+                        double held = timeState(context, State::Forces, 1<<1, numEvaluations)-overhead;
+                        addForces = held-expression;
+                        copyState = total-held-innerCVs;
+                    }
+                    printf("%10d %4d %10d | %8.3f %8.3f %8.3f %8.3f | %9.3f %9.3f %10.3f %9.3f\n", numAtoms, numCVs, atomsPerCV,
+                           1e3*stepTimes[Base], 1e3*stepTimes[Bare], 1e3*stepTimes[CustomCV], 1e3*stepTimes[Extended],
+                           1e3*copyState, 1e3*innerCVs, 1e3*expression, 1e3*addForces);
+                    fflush(stdout);
+                }
+        }
+    }
+    catch(const exception& e) {
+        cout << "exception: " << e.what() << endl;
+        return 1;
+    }
+    return 0;
+}
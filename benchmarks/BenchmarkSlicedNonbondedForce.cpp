@@ -0,0 +1,178 @@
+/* -------------------------------------------------------------------------- *
+ *                             OpenMM Laboratory                              *
+ *                             =================                              *
+ *                                                                            *
+ * A plugin for testing low-level code implementation for OpenMM.             *
+ *                                                                            *
+ * Copyright (c) 2023 Charlles Abreu                                          *
+ * https://github.com/craabreu/openmm-lab                                     *
+ * -------------------------------------------------------------------------- */
+
+/**
+ * This program measures the performance of SlicedNonbondedForce in boxes of water,
+ * comparing it with that of NonbondedForce in the same systems.  For every system size,
+ * nonbonded method and number of subsets, it reports the simulation speed and the time
+ * taken by each evaluation of the direct and reciprocal space forces.  Run it with
+ * --help=1 to see the options.
+ */
+
+#include "BenchmarkUtilities.h"
+#include "SlicedNonbondedForce.h"
+#include "openmm/Context.h"
+#include "openmm/LocalEnergyMinimizer.h"
+#include "openmm/State.h"
+#include "openmm/VerletIntegrator.h"
+#include <cstdio>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+
+using namespace OpenMMLab;
+using namespace OpenMM;
+using namespace std;
+
+struct Result {
+    double nsPerDay, directTime, reciprocalTime;
+};
+
+static Result runBenchmark(System& system, const vector<Vec3>& positions, Platform& platform, const map<string, string>& properties,
+                           int numSteps, int numEvaluations, bool hasReciprocalSpace) {
+    const double stepSize = 0.002;
+    VerletIntegrator integrator(stepSize);
+    Context context(system, integrator, platform, properties);
+    context.setPositions(positions);
+    context.setVelocitiesToTemperature(300.0);
+    Result result;
+
+    // Time every part of the force separately.  The first evaluation is not timed, since
+    // it includes the compilation of kernels and other initializations.
+
+    context.getState(State::Forces);
+    Timer timer;
+    for (int i = 0; i < numEvaluations; i++)
+        context.getState(State::Forces, false, 1<<0);
+    result.directTime = timer.elapsed()/numEvaluations;
+    result.reciprocalTime = 0.0;
+    if (hasReciprocalSpace) {
+        timer.start();
+        for (int i = 0; i < numEvaluations; i++)
+            context.getState(State::Forces, false, 1<<1);
+        result.reciprocalTime = timer.elapsed()/numEvaluations;
+    }
+
+    // Time a simulation, making sure that all steps have completed before stopping.
+
+    integrator.step(10);
+    context.getState(State::Energy);
+    timer.start();
+    integrator.step(numSteps);
+    context.getState(State::Energy);
+    result.nsPerDay = 86400.0*numSteps*stepSize*1e-3/timer.elapsed();
+    return result;
+}
+
+static void printResult(int numAtoms, const string& method, const string& force, int numSubsets, const Result& result, double baseline) {
+    printf("%10d %-15s %-22s %7d %10.2f %12.3f %12.3f %8.3f\n", numAtoms, method.c_str(), force.c_str(), numSubsets,
+           result.nsPerDay, 1e3*result.directTime, 1e3*result.reciprocalTime, result.nsPerDay/baseline);
+    fflush(stdout);
+}
+
+int main(int argc, char* argv[]) {
+    try {
+        map<string, string> defaults = {
+            {"platform", "CUDA"},
+            {"precision", "mixed"},
+            {"atoms", "23k,100k,1M"},
+            {"methods", "CutoffPeriodic,PME,LJPME"},
+            {"subsets", "1,2,4"},
+            {"steps", "500"},
+            {"evaluations", "50"},
+            {"help", "0"}
+        };
+        map<string, string> options = parseOptions(argc, argv, defaults);
+        if (options["help"] != "0") {
+            cout << "Usage: " << argv[0] << " [--name=value ...]" << endl << "Options and defaults:" << endl;
+            for (auto& option : defaults)
+                cout << "    --" << option.first << "=" << option.second << endl;
+            return 0;
+        }
+        map<string, NonbondedForce::NonbondedMethod> methods = {
+            {"CutoffPeriodic", NonbondedForce::CutoffPeriodic},
+            {"Ewald", NonbondedForce::Ewald},
+            {"PME", NonbondedForce::PME},
+            {"LJPME", NonbondedForce::LJPME}
+        };
+        loadPlugins();
+        Platform& platform = Platform::getPlatformByName(options["platform"]);
+        map<string, string> properties = precisionProperties(options["platform"], options["precision"]);
+        int numSteps = atoi(options["steps"].c_str());
+        int numEvaluations = atoi(options["evaluations"].c_str());
+        cout << "# Platform: " << platform.getName() << ", precision: " << options["precision"] << endl;
+        cout << "# Times are per force evaluation.  The speedup is relative to NonbondedForce." << endl;
+        printf("%10s %-15s %-22s %7s %10s %12s %12s %8s\n", "# atoms", "method", "force", "subsets", "ns/day", "direct (ms)", "recip (ms)", "speedup");
+        for (const string& size : splitList(options["atoms"]))
+            for (const string& methodName : splitList(options["methods"])) {
+                if (methods.find(methodName) == methods.end())
+                    throw OpenMMException("Unknown nonbonded method '"+methodName+"'");
+                NonbondedForce::NonbondedMethod method = methods[methodName];
+                bool hasReciprocalSpace = (method != NonbondedForce::CutoffPeriodic);
+
+                // Simulate the box with a NonbondedForce, starting from a minimized structure.
+
+                System system;
+                vector<Vec3> positions;
+                NonbondedForce* nonbonded = createWaterBox(parseSize(size), method, system, positions);
+                nonbonded->setReciprocalSpaceForceGroup(1);
+                system.addForce(nonbonded);
+                {
+                    VerletIntegrator integrator(0.002);
+                    Context context(system, integrator, platform, properties);
+                    context.setPositions(positions);
+                    LocalEnergyMinimizer::minimize(context, 100.0, 200);
+                    positions = context.getState(State::Positions).getPositions();
+                }
+                int numAtoms = system.getNumParticles();
+                Result baseline = runBenchmark(system, positions, platform, properties, numSteps, numEvaluations, hasReciprocalSpace);
+                printResult(numAtoms, methodName, "NonbondedForce", 1, baseline, baseline.nsPerDay);
+
+                // Replace it with SlicedNonbondedForces.  Molecules are assigned to the subsets
+                // in turn, so that every slice contains many pairs, and every slice between
+                // subset 0 and another subset is scaled by a global parameter.
+
+                for (const string& subsets : splitList(options["subsets"])) {
+                    int numSubsets = atoi(subsets.c_str());
+                    SlicedNonbondedForce* sliced = new SlicedNonbondedForce(*nonbonded, numSubsets);
+                    vector<int> particleSubsets(numAtoms);
+                    for (int i = 0; i < numAtoms; i++)
+                        particleSubsets[i] = (i/3)%numSubsets;
+                    sliced->setParticleSubsets(particleSubsets);
+                    for (int i = 1; i < numSubsets; i++) {
+                        string parameter = "lambda"+to_string(i);
+                        sliced->addGlobalParameter(parameter, 1.0);
+                        sliced->addScalingParameter(parameter, 0, i, true, true);
+                    }
+                    System slicedSystem;
+                    for (int i = 0; i < numAtoms; i++)
+                        slicedSystem.addParticle(system.getParticleMass(i));
+                    for (int i = 0; i < system.getNumConstraints(); i++) {
+                        int particle1, particle2;
+                        double distance;
+                        system.getConstraintParameters(i, particle1, particle2, distance);
+                        slicedSystem.addConstraint(particle1, particle2, distance);
+                    }
+                    Vec3 a, b, c;
+                    system.getDefaultPeriodicBoxVectors(a, b, c);
+                    slicedSystem.setDefaultPeriodicBoxVectors(a, b, c);
+                    slicedSystem.addForce(sliced);
+                    Result result = runBenchmark(slicedSystem, positions, platform, properties, numSteps, numEvaluations, hasReciprocalSpace);
+                    printResult(numAtoms, methodName, "SlicedNonbondedForce", numSubsets, result, baseline.nsPerDay);
+                }
+            }
+    }
+    catch(const exception& e) {
+        cout << "exception: " << e.what() << endl;
+        return 1;
+    }
+    return 0;
+}
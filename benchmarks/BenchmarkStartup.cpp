@@ -0,0 +1,281 @@
+/* -------------------------------------------------------------------------- *
+ *                             OpenMM Laboratory                              *
+ *                             =================                              *
+ *                                                                            *
+ * A plugin for testing low-level code implementation for OpenMM.             *
+ *                                                                            *
+ * Copyright (c) 2023 Charlles Abreu                                          *
+ * https://github.com/craabreu/openmm-lab                                     *
+ * -------------------------------------------------------------------------- */
+
+/**
+ * This program measures the cost of setting up the features of the plugin, rather than
+ * that of running them: the time taken to create a Context and to evaluate it for the
+ * first time, and the memory they take.  Run it with --help=1 to see the options.
+ *
+ * The features are SlicedNonbondedForce with PME in boxes of water, for every number of
+ * subsets, ExtendedCustomCVForce in the same boxes, for every number of collective
+ * variables, and CustomSummation with the Context and Kernel backends, for every number of
+ * terms.  Profiling is enabled, so that the creation times are split into the parts
+ * reported by getStageTimesInContext() whose names start with "init:", such as the
+ * creation of the inner Context, of the FFT plans, the computation of the dispersion
+ * correction, and the compilation of the reciprocal space kernels.
+ *
+ * The device memory of a feature is the decrease of the free memory of the device while
+ * the feature exists, after its first evaluation.  It is only measured on the CUDA
+ * platform, when the program is built with the CUDA toolkit.  The host memory is the
+ * increase of the resident set size of the process, which is only measured on Linux.
+ */
+
+#include "BenchmarkUtilities.h"
+#include "CustomSummation.h"
+#include "ExtendedCustomCVForce.h"
+#include "SlicedNonbondedForce.h"
+#include "openmm/Context.h"
+#include "openmm/CustomExternalForce.h"
+#include "openmm/State.h"
+#include "openmm/VerletIntegrator.h"
+#ifdef OPENMMLAB_BENCHMARK_CUDA
+#include <cuda.h>
+#endif
+#ifdef __linux__
+#include <unistd.h>
+#endif
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using namespace OpenMMLab;
+using namespace OpenMM;
+using namespace std;
+
+/**
+ * Reads the memory in use on the device and on the host.
+ */
+class MemoryProbe {
+public:
+    MemoryProbe(const string& platformName, int deviceIndex) : hasDevice(false) {
+#ifdef OPENMMLAB_BENCHMARK_CUDA
+        // The free memory is queried in a context of our own, which is created before any
+        // measurement, so that its memory is not attributed to any feature.
+
+        if (platformName == "CUDA" && cuInit(0) == CUDA_SUCCESS && cuDeviceGet(&device, deviceIndex) == CUDA_SUCCESS &&
+                cuDevicePrimaryCtxRetain(&context, device) == CUDA_SUCCESS)
+            hasDevice = true;
+#endif
+    }
+    ~MemoryProbe() {
+#ifdef OPENMMLAB_BENCHMARK_CUDA
+        if (hasDevice)
+            cuDevicePrimaryCtxRelease(device);
+#endif
+    }
+    bool measuresDevice() const {
+        return hasDevice;
+    }
+    /**
+     * Get the memory in use on the device, in bytes.
+     */
+    double getDeviceMemory() {
+#ifdef OPENMMLAB_BENCHMARK_CUDA
+        if (hasDevice) {
+            size_t free, total;
+            cuCtxPushCurrent(context);
+            cuMemGetInfo(&free, &total);
+            cuCtxPopCurrent(NULL);
+            return (double) (total-free);
+        }
+#endif
+        return 0.0;
+    }
+    /**
+     * Get the resident set size of the process, in bytes.
+     */
+    double getHostMemory() {
+#ifdef __linux__
+        ifstream statm("/proc/self/statm");
+        double size, resident;
+        if (statm >> size >> resident)
+            return resident*sysconf(_SC_PAGESIZE);
+#endif
+        return 0.0;
+    }
+private:
+    bool hasDevice;
+#ifdef OPENMMLAB_BENCHMARK_CUDA
+    CUdevice device;
+    CUcontext context;
+#endif
+};
+
+struct Result {
+    double createTime, firstEvaluationTime, deviceMemory, hostMemory;
+    map<string, double> initTimes;
+};
+
+/**
+ * Create a Context for a System, evaluate it once, and measure the times and the memory.
+ * The feature is the force of the System whose stage times are reported.
+ */
+template <class ForceType>
+static Result measureContext(System& system, const vector<Vec3>& positions, ForceType& feature, Platform& platform,
+                             const map<string, string>& properties, MemoryProbe& probe) {
+    Result result;
+    double deviceBefore = probe.getDeviceMemory();
+    double hostBefore = probe.getHostMemory();
+    VerletIntegrator integrator(0.002);
+    Timer timer;
+    Context context(system, integrator, platform, properties);
+    result.createTime = timer.elapsed();
+    context.setPositions(positions);
+    timer.start();
+    context.getState(State::Energy | State::Forces);
+    result.firstEvaluationTime = timer.elapsed();
+    result.deviceMemory = probe.getDeviceMemory()-deviceBefore;
+    result.hostMemory = probe.getHostMemory()-hostBefore;
+    for (auto& stage : feature.getStageTimesInContext(context))
+        if (stage.first.substr(0, 5) == "init:")
+            result.initTimes[stage.first.substr(5)] = 1e-3*stage.second;
+    return result;
+}
+
+static Result measureSlicedPme(int numAtoms, int numSubsets, Platform& platform, const map<string, string>& properties, MemoryProbe& probe) {
+    System system;
+    vector<Vec3> positions;
+    unique_ptr<NonbondedForce> nonbonded(createWaterBox(numAtoms, NonbondedForce::PME, system, positions));
+    nonbonded->setUseDispersionCorrection(true);
+    SlicedNonbondedForce* sliced = new SlicedNonbondedForce(*nonbonded, numSubsets);
+    for (int i = 0; i < system.getNumParticles(); i++)
+        sliced->setParticleSubset(i, (i/3)%numSubsets);
+    for (int i = 1; i < numSubsets; i++) {
+        string parameter = "lambda"+to_string(i);
+        sliced->addGlobalParameter(parameter, 1.0);
+        sliced->addScalingParameter(parameter, 0, i, true, true);
+    }
+    system.addForce(sliced);
+    return measureContext(system, positions, *sliced, platform, properties, probe);
+}
+
+static Result measureExtendedCV(int numAtoms, int numCVs, Platform& platform, const map<string, string>& properties, MemoryProbe& probe) {
+    // Every collective variable is the sum of the x coordinates of 100 consecutive atoms.
+
+    System system;
+    vector<Vec3> positions;
+    system.addForce(createWaterBox(numAtoms, NonbondedForce::PME, system, positions));
+    numAtoms = system.getNumParticles();
+    string expression;
+    for (int i = 0; i < numCVs; i++)
+        expression += (i == 0 ? "" : "+") + string("v")+to_string(i);
+    ExtendedCustomCVForce* force = new ExtendedCustomCVForce("0.001*("+expression+")");
+    for (int i = 0; i < numCVs; i++) {
+        CustomExternalForce* variable = new CustomExternalForce("x");
+        for (int j = 0; j < 100; j++)
+            variable->addParticle((i*100+j)%numAtoms);
+        force->addCollectiveVariable("v"+to_string(i), variable);
+    }
+    system.addForce(force);
+    return measureContext(system, positions, *force, platform, properties, probe);
+}
+
+static Result measureSummation(int numTerms, const string& backend, Platform& platform, map<string, string> properties, MemoryProbe& probe) {
+    Result result;
+    properties["Backend"] = backend;
+    OpenMM_SFMT::SFMT sfmt;
+    init_gen_rand(0, sfmt);
+    vector<double> parameters(3*numTerms);
+    for (double& value : parameters)
+        value = 10*genrand_real2(sfmt);
+    double deviceBefore = probe.getDeviceMemory();
+    double hostBefore = probe.getHostMemory();
+    Timer timer;
+    CustomSummation summation(
+        3,
+        "exp(-((x1-mux)^2+(y1-muy)^2+(z1-muz)^2)/(2*sigma^2))",
+        map<string, double>{{"sigma", 1.0}},
+        vector<string>{"mux", "muy", "muz"},
+        platform,
+        properties
+    );
+    result.createTime = timer.elapsed();
+    summation.setTerms(parameters.data(), numTerms);
+    timer.start();
+    summation.update();
+    summation.evaluate(vector<double>{5.0, 5.0, 5.0});
+    result.firstEvaluationTime = timer.elapsed();
+    result.deviceMemory = probe.getDeviceMemory()-deviceBefore;
+    result.hostMemory = probe.getHostMemory()-hostBefore;
+    return result;
+}
+
+static void printResult(const string& feature, int size, const string& parameter, const Result& result, bool measuresDevice) {
+    stringstream parts;
+    for (auto& part : result.initTimes)
+        parts << " " << part.first << "=" << 1e3*part.second;
+    printf("%-24s %10d %10s %12.1f %12.1f %12s %10.1f %s\n", feature.c_str(), size, parameter.c_str(), 1e3*result.createTime,
+           1e3*result.firstEvaluationTime, measuresDevice ? to_string((int) (result.deviceMemory/(1<<20))).c_str() : "-",
+           result.hostMemory/(1<<20), parts.str().c_str());
+    fflush(stdout);
+}
+
+int main(int argc, char* argv[]) {
+    try {
+        map<string, string> defaults = {
+            {"platform", "CUDA"},
+            {"precision", "mixed"},
+            {"device", "0"},
+            {"atoms", "23k,100k,1M"},
+            {"subsets", "1,2,4,8"},
+            {"cvs", "1,4,16"},
+            {"terms", "1k,100k,1M"},
+            {"help", "0"}
+        };
+        map<string, string> options = parseOptions(argc, argv, defaults);
+        if (options["help"] != "0") {
+            cout << "Usage: " << argv[0] << " [--name=value ...]" << endl << "Options and defaults:" << endl;
+            for (auto& option : defaults)
+                cout << "    --" << option.first << "=" << option.second << endl;
+            cout << "Set a list to an empty string to skip the corresponding feature." << endl;
+            return 0;
+        }
+#ifndef _WIN32
+        setenv("OPENMMLAB_PROFILING", "1", 1);
+#endif
+        loadPlugins();
+        Platform& platform = Platform::getPlatformByName(options["platform"]);
+        map<string, string> properties = precisionProperties(options["platform"], options["precision"]);
+        if (options["platform"] == "CUDA" || options["platform"] == "OpenCL")
+            properties["DeviceIndex"] = options["device"];
+        MemoryProbe probe(options["platform"], atoi(options["device"].c_str()));
+        cout << "# Platform: " << platform.getName() << ", precision: " << options["precision"] << endl;
+        cout << "# Times in ms, memory in MiB.  The parts of the creation are those reported by the force." << endl;
+        printf("%-24s %10s %10s %12s %12s %12s %10s %s\n", "# feature", "size", "count", "create", "first eval",
+               "device mem", "host mem", "parts");
+        for (const string& size : splitList(options["atoms"])) {
+            int numAtoms = parseSize(size);
+            for (const string& subsets : splitList(options["subsets"]))
+                printResult("SlicedNonbondedForce", numAtoms, subsets+" subsets",
+                            measureSlicedPme(numAtoms, atoi(subsets.c_str()), platform, properties, probe), probe.measuresDevice());
+            for (const string& cvs : splitList(options["cvs"]))
+                printResult("ExtendedCustomCVForce", numAtoms, cvs+" CVs",
+                            measureExtendedCV(numAtoms, atoi(cvs.c_str()), platform, properties, probe), probe.measuresDevice());
+        }
+        vector<string> backends = {"Context"};
+        if (platform.supportsKernels(vector<string>{"CalcCustomSummation"}))
+            backends.push_back("Kernel");
+        for (const string& terms : splitList(options["terms"]))
+            for (const string& backend : backends)
+                printResult("CustomSummation "+backend, parseSize(terms), "1",
+                            measureSummation(parseSize(terms), backend, platform, properties, probe), probe.measuresDevice());
+    }
+    catch(const exception& e) {
+        cout << "exception: " << e.what() << endl;
+        return 1;
+    }
+    return 0;
+}
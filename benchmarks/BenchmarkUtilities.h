@@ -0,0 +1,185 @@
+#ifndef OPENMMLAB_BENCHMARKUTILITIES_H_
+#define OPENMMLAB_BENCHMARKUTILITIES_H_
+
+/* -------------------------------------------------------------------------- *
+ *                             OpenMM Laboratory                              *
+ *                             =================                              *
+ *                                                                            *
+ * A plugin for testing low-level code implementation for OpenMM.             *
+ *                                                                            *
+ * Copyright (c) 2023 Charlles Abreu                                          *
+ * https://github.com/craabreu/openmm-lab                                     *
+ * -------------------------------------------------------------------------- */
+
+#include "openmm/NonbondedForce.h"
+#include "openmm/OpenMMException.h"
+#include "openmm/Platform.h"
+#include "openmm/System.h"
+#include "openmm/Vec3.h"
+#include "sfmt/SFMT.h"
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using namespace OpenMM;
+using namespace std;
+
+/**
+ * A stopwatch that measures wall clock time in seconds.
+ */
+class Timer {
+public:
+    Timer() {
+        start();
+    }
+    void start() {
+        begin = chrono::steady_clock::now();
+    }
+    double elapsed() const {
+        return chrono::duration<double>(chrono::steady_clock::now()-begin).count();
+    }
+private:
+    chrono::steady_clock::time_point begin;
+};
+
+/**
+ * Parse the command line arguments of a benchmark, which have the form --name=value.
+ * Every option must be present in the map of defaults, so that misspelled options are
+ * reported instead of being silently ignored.
+ */
+inline map<string, string> parseOptions(int argc, char* argv[], const map<string, string>& defaults) {
+    map<string, string> options = defaults;
+    for (int i = 1; i < argc; i++) {
+        string argument = argv[i];
+        size_t equals = argument.find('=');
+        if (argument.substr(0, 2) != "--" || equals == string::npos)
+            throw OpenMMException("Invalid argument '"+argument+"'. Options have the form --name=value");
+        string name = argument.substr(2, equals-2);
+        if (defaults.find(name) == defaults.end()) {
+            stringstream message;
+            message << "Unknown option '" << name << "'. Valid options are:";
+            for (auto& option : defaults)
+                message << " --" << option.first << "=" << option.second;
+            throw OpenMMException(message.str());
+        }
+        options[name] = argument.substr(equals+1);
+    }
+    return options;
+}
+
+/**
+ * Split a comma separated list.
+ */
+inline vector<string> splitList(const string& list) {
+    vector<string> items;
+    stringstream stream(list);
+    string item;
+    while (getline(stream, item, ','))
+        if (!item.empty())
+            items.push_back(item);
+    return items;
+}
+
+/**
+ * Parse a size, which may have the suffix k (thousands) or M (millions).
+ */
+inline int parseSize(const string& size) {
+    double value = atof(size.c_str());
+    char suffix = size.back();
+    if (suffix == 'k' || suffix == 'K')
+        value *= 1e3;
+    else if (suffix == 'm' || suffix == 'M')
+        value *= 1e6;
+    return (int) value;
+}
+
+/**
+ * Load the plugins of OpenMM and of this library, so that every platform is available.
+ */
+inline void loadPlugins() {
+    Platform::loadPluginsFromDirectory(Platform::getDefaultPluginsDirectory());
+}
+
+/**
+ * Get the properties that select a precision mode, which are empty for the Reference
+ * platform.
+ */
+inline map<string, string> precisionProperties(const string& platformName, const string& precision) {
+    map<string, string> properties;
+    if (platformName != "Reference" && !precision.empty())
+        properties["Precision"] = precision;
+    return properties;
+}
+
+/**
+ * Add a box of rigid TIP3P water molecules to an empty System.  The molecules are placed
+ * on a cubic lattice at the density of liquid water, with random orientations, so the
+ * box is only suitable for timing.  The NonbondedForce is created with the parameters of
+ * TIP3P and the intramolecular pairs as exclusions, but is not added to the System.
+ *
+ * @param numAtoms    the approximate number of atoms, which is rounded to a whole number
+ *                    of lattice sites
+ * @param method      the nonbonded method
+ * @param system      the System to which the particles and constraints are added
+ * @param positions   on exit, the positions of the atoms
+ * @return            the NonbondedForce
+ */
+inline NonbondedForce* createWaterBox(int numAtoms, NonbondedForce::NonbondedMethod method, System& system, vector<Vec3>& positions) {
+    const double density = 33.4;  // molecules/nm^3
+    const double rOH = 0.09572, angleHOH = 104.52*M_PI/180;
+    int sitesPerSide = max(2, (int) ceil(cbrt(numAtoms/3.0)));
+    double spacing = 1/cbrt(density);
+    double boxSize = sitesPerSide*spacing;
+    system.setDefaultPeriodicBoxVectors(Vec3(boxSize, 0, 0), Vec3(0, boxSize, 0), Vec3(0, 0, boxSize));
+    NonbondedForce* force = new NonbondedForce();
+    force->setNonbondedMethod(method);
+    force->setCutoffDistance(min(1.0, 0.49*boxSize));
+    if (method == NonbondedForce::CutoffPeriodic || method == NonbondedForce::CutoffNonPeriodic)
+        force->setReactionFieldDielectric(78.3);
+    OpenMM_SFMT::SFMT sfmt;
+    init_gen_rand(0, sfmt);
+    positions.clear();
+    for (int i = 0; i < sitesPerSide; i++)
+        for (int j = 0; j < sitesPerSide; j++)
+            for (int k = 0; k < sitesPerSide; k++) {
+                int oxygen = system.addParticle(15.999);
+                system.addParticle(1.008);
+                system.addParticle(1.008);
+                force->addParticle(-0.834, 0.315061, 0.636386);
+                force->addParticle(0.417, 1.0, 0.0);
+                force->addParticle(0.417, 1.0, 0.0);
+                system.addConstraint(oxygen, oxygen+1, rOH);
+                system.addConstraint(oxygen, oxygen+2, rOH);
+                system.addConstraint(oxygen+1, oxygen+2, 2*rOH*sin(angleHOH/2));
+                force->addException(oxygen, oxygen+1, 0, 1, 0);
+                force->addException(oxygen, oxygen+2, 0, 1, 0);
+                force->addException(oxygen+1, oxygen+2, 0, 1, 0);
+
+                // Build the molecule in a random orientation.
+
+                Vec3 center = Vec3(i+0.5, j+0.5, k+0.5)*spacing;
+                Vec3 u, v;
+                do {
+                    u = Vec3(genrand_real2(sfmt)-0.5, genrand_real2(sfmt)-0.5, genrand_real2(sfmt)-0.5);
+                } while (u.dot(u) < 1e-4);
+                u /= sqrt(u.dot(u));
+                do {
+                    v = Vec3(genrand_real2(sfmt)-0.5, genrand_real2(sfmt)-0.5, genrand_real2(sfmt)-0.5);
+                    v -= u*u.dot(v);
+                } while (v.dot(v) < 1e-4);
+                v /= sqrt(v.dot(v));
+                Vec3 bisector = u*rOH*cos(angleHOH/2);
+                Vec3 offset = v*rOH*sin(angleHOH/2);
+                positions.push_back(center);
+                positions.push_back(center+bisector+offset);
+                positions.push_back(center+bisector-offset);
+            }
+    return force;
+}
+
+#endif /*OPENMMLAB_BENCHMARKUTILITIES_H_*/
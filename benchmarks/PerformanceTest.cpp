@@ -0,0 +1,300 @@
+/* -------------------------------------------------------------------------- *
+ *                             OpenMM Laboratory                              *
+ *                             =================                              *
+ *                                                                            *
+ * A plugin for testing low-level code implementation for OpenMM.             *
+ *                                                                            *
+ * Copyright (c) 2023 Charlles Abreu                                          *
+ * https://github.com/craabreu/openmm-lab                                     *
+ * -------------------------------------------------------------------------- */
+
+/**
+ * This program runs short timed workloads and compares their times with those stored in
+ * a table of baselines, failing if any of them is slower than its baseline by more than a
+ * threshold.  It is run by the "PerfTests" target.  Run it with --help=1 to see the options.
+ *
+ * The workloads are a step of a box of water with a SlicedNonbondedForce with PME and
+ * 3 subsets, a step of a box of water with an ExtendedCustomCVForce of 8 collective
+ * variables, and an evaluation of a CustomSummation of 10k terms with its derivatives.
+ * Every workload is timed several times and the shortest time is kept, since noise can
+ * only make a workload slower.
+ *
+ * Each line of the table of baselines has the form "<workload> <seconds> <device>", where
+ * the device is the rest of the line.  It is the value of the DeviceName property of the
+ * platform, or the name of the platform if it has no such property, so that baselines of
+ * different GPUs are kept apart.  Lines starting with # are ignored.  Workloads with no
+ * baseline for the device fail too, since a test that cannot compare anything would always
+ * pass; --missing=ignore only reports them.  With --record=1, the program prints the lines
+ * to add to the table for the device instead of comparing.
+ */
+
+#include "BenchmarkUtilities.h"
+#include "CustomSummation.h"
+#include "ExtendedCustomCVForce.h"
+#include "SlicedNonbondedForce.h"
+#include "openmm/Context.h"
+#include "openmm/CustomExternalForce.h"
+#include "openmm/LocalEnergyMinimizer.h"
+#include "openmm/State.h"
+#include "openmm/VerletIntegrator.h"
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using namespace OpenMMLab;
+using namespace OpenMM;
+using namespace std;
+
+static const double StepSize = 0.002;
+
+/**
+ * Get the name under which the baselines of the device of a Context are stored.
+ */
+static string getDeviceClass(Context& context) {
+    Platform& platform = context.getPlatform();
+    const vector<string>& names = platform.getPropertyNames();
+    if (find(names.begin(), names.end(), "DeviceName") != names.end())
+        return platform.getPropertyValue(context, "DeviceName");
+    return platform.getName();
+}
+
+/**
+ * Create a minimized box of water with PME, whose NonbondedForce is returned rather than
+ * added to the System.
+ */
+static NonbondedForce* createMinimizedBox(int numAtoms, Platform& platform, const map<string, string>& properties,
+                                          System& system, vector<Vec3>& positions) {
+    NonbondedForce* nonbonded = createWaterBox(numAtoms, NonbondedForce::PME, system, positions);
+    System copy;
+    for (int i = 0; i < system.getNumParticles(); i++)
+        copy.addParticle(system.getParticleMass(i));
+    for (int i = 0; i < system.getNumConstraints(); i++) {
+        int particle1, particle2;
+        double distance;
+        system.getConstraintParameters(i, particle1, particle2, distance);
+        copy.addConstraint(particle1, particle2, distance);
+    }
+    Vec3 a, b, c;
+    system.getDefaultPeriodicBoxVectors(a, b, c);
+    copy.setDefaultPeriodicBoxVectors(a, b, c);
+    copy.addForce(new NonbondedForce(*nonbonded));
+    VerletIntegrator integrator(StepSize);
+    Context context(copy, integrator, platform, properties);
+    context.setPositions(positions);
+    LocalEnergyMinimizer::minimize(context, 100.0, 200);
+    positions = context.getState(State::Positions).getPositions();
+    return nonbonded;
+}
+
+/**
+ * Get the shortest average time taken by a step of a simulation over several runs.
+ */
+static double timeSteps(System& system, const vector<Vec3>& positions, Platform& platform, const map<string, string>& properties,
+                        int numSteps, int numRepeats, string& deviceClass) {
+    VerletIntegrator integrator(StepSize);
+    Context context(system, integrator, platform, properties);
+    context.setPositions(positions);
+    context.setVelocitiesToTemperature(300.0);
+    deviceClass = getDeviceClass(context);
+    integrator.step(10);
+    context.getState(State::Energy);
+    double best = numeric_limits<double>::infinity();
+    for (int i = 0; i < numRepeats; i++) {
+        Timer timer;
+        integrator.step(numSteps);
+        context.getState(State::Energy);
+        best = min(best, timer.elapsed()/numSteps);
+    }
+    return best;
+}
+
+static double timeSlicedPme(Platform& platform, const map<string, string>& properties, int numAtoms, int numSteps,
+                            int numRepeats, string& deviceClass) {
+    // Molecules are assigned to the subsets in turn, and every slice between subset 0 and
+    // another subset is scaled by a global parameter.
+
+    const int numSubsets = 3;
+    System system;
+    vector<Vec3> positions;
+    NonbondedForce* nonbonded = createMinimizedBox(numAtoms, platform, properties, system, positions);
+    SlicedNonbondedForce* sliced = new SlicedNonbondedForce(*nonbonded, numSubsets);
+    delete nonbonded;
+    numAtoms = system.getNumParticles();
+    vector<int> particleSubsets(numAtoms);
+    for (int i = 0; i < numAtoms; i++)
+        particleSubsets[i] = (i/3)%numSubsets;
+    sliced->setParticleSubsets(particleSubsets);
+    for (int i = 1; i < numSubsets; i++) {
+        string parameter = "lambda"+to_string(i);
+        sliced->addGlobalParameter(parameter, 1.0);
+        sliced->addScalingParameter(parameter, 0, i, true, true);
+    }
+    system.addForce(sliced);
+    return timeSteps(system, positions, platform, properties, numSteps, numRepeats, deviceClass);
+}
+
+static double timeExtendedCV(Platform& platform, const map<string, string>& properties, int numAtoms, int numSteps,
+                             int numRepeats, string& deviceClass) {
+    // Every collective variable is the sum of the x coordinates of 100 consecutive atoms.
+
+    const int numCVs = 8, atomsPerCV = 100;
+    System system;
+    vector<Vec3> positions;
+    system.addForce(createMinimizedBox(numAtoms, platform, properties, system, positions));
+    numAtoms = system.getNumParticles();
+    string expression;
+    for (int i = 0; i < numCVs; i++)
+        expression += (i == 0 ? "" : "+") + string("v")+to_string(i);
+    ExtendedCustomCVForce* force = new ExtendedCustomCVForce("0.001*("+expression+")");
+    for (int i = 0; i < numCVs; i++) {
+        CustomExternalForce* variable = new CustomExternalForce("x");
+        for (int j = 0; j < atomsPerCV; j++)
+            variable->addParticle((i*atomsPerCV+j)%numAtoms);
+        force->addCollectiveVariable("v"+to_string(i), variable);
+    }
+    system.addForce(force);
+    return timeSteps(system, positions, platform, properties, numSteps, numRepeats, deviceClass);
+}
+
+static double timeSummation(Platform& platform, const map<string, string>& properties, int numTerms, int numEvaluations,
+                            int numRepeats) {
+    // The terms are Gaussians centered at random points of a three-dimensional space, and
+    // every evaluation has different arguments, so that none comes from the cache.
+
+    OpenMM_SFMT::SFMT sfmt;
+    init_gen_rand(0, sfmt);
+    vector<double> parameters(3*numTerms);
+    for (double& value : parameters)
+        value = 10*genrand_real2(sfmt);
+    CustomSummation summation(
+        3,
+        "exp(-((x1-mux)^2+(y1-muy)^2+(z1-muz)^2)/(2*sigma^2))",
+        map<string, double>{{"sigma", 1.0}},
+        vector<string>{"mux", "muy", "muz"},
+        platform,
+        properties
+    );
+    summation.setTerms(parameters.data(), numTerms);
+    summation.update();
+    vector<double> arguments = {5.0, 5.0, 5.0}, derivatives;
+    summation.evaluateWithDerivatives(arguments, derivatives);
+    double best = numeric_limits<double>::infinity();
+    for (int i = 0; i < numRepeats; i++) {
+        Timer timer;
+        for (int j = 0; j < numEvaluations; j++) {
+            arguments[0] += 1e-6;
+            summation.evaluateWithDerivatives(arguments, derivatives);
+        }
+        best = min(best, timer.elapsed()/numEvaluations);
+    }
+    return best;
+}
+
+/**
+ * Read the baselines of a device from a table.
+ */
+static map<string, double> readBaselines(const string& path, const string& deviceClass) {
+    ifstream file(path);
+    if (!file)
+        throw OpenMMException("Cannot open the table of baselines '"+path+"'");
+    map<string, double> baselines;
+    string line;
+    while (getline(file, line)) {
+        if (line.empty() || line[0] == '#')
+            continue;
+        stringstream stream(line);
+        string workload, device;
+        double seconds;
+        if (!(stream >> workload >> seconds))
+            throw OpenMMException("Invalid line in the table of baselines: '"+line+"'");
+        getline(stream >> ws, device);
+        if (device == deviceClass)
+            baselines[workload] = seconds;
+    }
+    return baselines;
+}
+
+int main(int argc, char* argv[]) {
+    try {
+        map<string, string> defaults = {
+            {"platform", "CUDA"},
+            {"precision", "mixed"},
+            {"baselines", "PerformanceBaselines.txt"},
+            {"threshold", "0.15"},
+            {"atoms", "6k"},
+            {"terms", "10k"},
+            {"steps", "200"},
+            {"evaluations", "100"},
+            {"repeats", "3"},
+            {"record", "0"},
+            {"missing", "fail"},
+            {"help", "0"}
+        };
+        map<string, string> options = parseOptions(argc, argv, defaults);
+        if (options["help"] != "0") {
+            cout << "Usage: " << argv[0] << " [--name=value ...]" << endl << "Options and defaults:" << endl;
+            for (auto& option : defaults)
+                cout << "    --" << option.first << "=" << option.second << endl;
+            cout << "The threshold is the largest accepted relative slowdown." << endl;
+            cout << "Workloads with no baseline for the device fail, unless --missing=ignore." << endl;
+            return 0;
+        }
+        loadPlugins();
+        Platform& platform = Platform::getPlatformByName(options["platform"]);
+        map<string, string> properties = precisionProperties(options["platform"], options["precision"]);
+        int numAtoms = parseSize(options["atoms"]);
+        int numSteps = atoi(options["steps"].c_str());
+        int numEvaluations = atoi(options["evaluations"].c_str());
+        int numRepeats = max(1, atoi(options["repeats"].c_str()));
+        double threshold = atof(options["threshold"].c_str());
+        if (options["missing"] != "fail" && options["missing"] != "ignore")
+            throw OpenMMException("The option --missing must be 'fail' or 'ignore'");
+        string deviceClass;
+        vector<pair<string, double> > times;
+        times.push_back(make_pair("slicedPME3", timeSlicedPme(platform, properties, numAtoms, numSteps, numRepeats, deviceClass)));
+        times.push_back(make_pair("extendedCV8", timeExtendedCV(platform, properties, numAtoms, numSteps, numRepeats, deviceClass)));
+        times.push_back(make_pair("summation10k", timeSummation(platform, properties, parseSize(options["terms"]), numEvaluations, numRepeats)));
+        if (options["record"] != "0") {
+            for (auto& time : times)
+                printf("%-14s %.6e %s\n", time.first.c_str(), time.second, deviceClass.c_str());
+            return 0;
+        }
+        map<string, double> baselines = readBaselines(options["baselines"], deviceClass);
+        cout << "# Device: " << deviceClass << ", precision: " << options["precision"] << endl;
+        printf("%-14s %12s %12s %8s %s\n", "# workload", "time (ms)", "base (ms)", "ratio", "status");
+        int numRegressions = 0, numMissing = 0;
+        for (auto& time : times) {
+            auto baseline = baselines.find(time.first);
+            if (baseline == baselines.end()) {
+                printf("%-14s %12.4f %12s %8s %s\n", time.first.c_str(), 1e3*time.second, "-", "-", "no baseline");
+                numMissing++;
+                continue;
+            }
+            double ratio = time.second/baseline->second;
+            bool regressed = (ratio > 1+threshold);
+            if (regressed)
+                numRegressions++;
+            printf("%-14s %12.4f %12.4f %8.3f %s\n", time.first.c_str(), 1e3*time.second, 1e3*baseline->second, ratio,
+                   regressed ? "REGRESSION" : "ok");
+        }
+        fflush(stdout);
+        if (numRegressions > 0)
+            cout << numRegressions << " workload(s) are more than " << 100*threshold << "% slower than their baselines" << endl;
+        if (numMissing > 0 && options["missing"] == "fail")
+            cout << numMissing << " workload(s) have no baseline for '" << deviceClass << "'.  Record them with --record=1 and add them to "
+                 << options["baselines"] << ", or pass --missing=ignore." << endl;
+        if (numRegressions > 0 || (numMissing > 0 && options["missing"] == "fail"))
+            return 1;
+    }
+    catch(const exception& e) {
+        cout << "exception: " << e.what() << endl;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,80 @@
+#ifndef OPENMMLAB_CONTEXTSNAPSHOT_H_
+#define OPENMMLAB_CONTEXTSNAPSHOT_H_
+
+/* -------------------------------------------------------------------------- *
+ *                             OpenMM Laboratory                              *
+ *                             =================                              *
+ *                                                                            *
+ * A plugin for testing low-level code implementation for OpenMM.             *
+ *                                                                            *
+ * Copyright (c) 2023 Charlles Abreu                                          *
+ * https://github.com/craabreu/openmm-lab                                     *
+ * -------------------------------------------------------------------------- */
+
+#include "openmm/Context.h"
+#include "internal/windowsExportOpenMMLab.h"
+
+#include <iosfwd>
+#include <string>
+
+using namespace OpenMM;
+using namespace std;
+
+namespace OpenMMLab {
+
+/**
+ * This class saves the state of a Context in a compact binary snapshot, and loads it into a
+ * Context of the same System without reinitializing it, such as when the replicas of a
+ * replica exchange simulation running on different nodes exchange their configurations.
+ *
+ * A snapshot holds the step count, the time, the periodic box vectors, the positions and
+ * velocities of the particles, and the global parameters of the Context.  It also holds
+ * the lambda state selected in each SlicedNonbondedForce (see
+ * SlicedNonbondedForce::setLambdaStateInContext()) and the values that the collective
+ * variables of each ExtendedCustomCVForce keep while their evaluation intervals have not
+ * elapsed (see ExtendedCustomCVForce::getCollectiveVariableCacheInContext()).  The inner
+ * Contexts of the ExtendedCustomCVForces are not saved, since they receive the state of the
+ * Context at their next evaluation.  The forces of the collective variables are not saved
+ * either, so a variable whose cached value is loaded is evaluated again the next time its
+ * forces are needed.
+ *
+ * Snapshots store numbers in the byte order of the machine that saves them, and can only
+ * be loaded on machines with the same byte order.
+ */
+
+class OPENMM_EXPORT_OPENMM_LAB ContextSnapshot {
+public:
+    /**
+     * Save a snapshot of a Context to a stream.
+     *
+     * @param context   the Context to save
+     * @param stream    the stream to which the snapshot is written
+     */
+    static void save(Context& context, ostream& stream);
+    /**
+     * Load a snapshot from a stream into a Context.  The Context must have been created for
+     * the same System as the one whose snapshot was saved.
+     *
+     * @param context   the Context into which the snapshot is loaded
+     * @param stream    the stream from which the snapshot is read
+     */
+    static void load(Context& context, istream& stream);
+    /**
+     * Save a snapshot of a Context to a string of bytes.
+     *
+     * @param context   the Context to save
+     * @return the snapshot
+     */
+    static string saveToString(Context& context);
+    /**
+     * Load a snapshot saved with saveToString() into a Context.
+     *
+     * @param context   the Context into which the snapshot is loaded
+     * @param snapshot  the snapshot
+     */
+    static void loadFromString(Context& context, const string& snapshot);
+};
+
+} // namespace OpenMMLab
+
+#endif /*OPENMMLAB_CONTEXTSNAPSHOT_H_*/
@@ -17,7 +17,10 @@
 #include "lepton/CustomFunction.h"
 
 #include <map>
+#include <memory>
+#include <set>
 #include <string>
+#include <thread>
 #include <vector>
 
 using namespace OpenMM;
@@ -94,6 +97,70 @@ namespace OpenMMLab {
  * This class also has the ability to compute derivatives of the sum with respect to
  * the arguments.
  *
+ * The evaluation methods can be called concurrently from multiple threads. Each thread
+ * evaluates the summation with its own workspace (and its own inner Context, if that
+ * is the case), which is created the first time the thread calls any of them. Methods
+ * that modify the summation, such as update() and setParameter(), must not be called
+ * while evaluations are taking place.
+ *
+ * Cloning is cheap. A clone shares the evaluators of the original summation (and their
+ * inner Contexts, if that is the case) until either of them is modified by update(),
+ * setParameter(), setCompactSupport(), setGaussianSupport(), setGrid(), or setCacheSize(). Only then does the modified
+ * object get evaluators of its own, which are created the first time it is evaluated.
+ *
+ * By default, the summation is evaluated in an OpenMM::Context of the specified
+ * platform. For small numbers of terms, the overhead of this approach can exceed the
+ * cost of the arithmetic itself. Passing the platform property "Backend" with value
+ * "Native" makes the summation be evaluated directly on the CPU, with the term
+ * expression and its derivatives compiled by Lepton and no Context involved. In this
+ * case, the platform argument is ignored. Subexpressions that do not depend on the
+ * per-term parameters, such as distances, angles, and dihedrals between the argument
+ * points, are then evaluated once per point rather than once per term, and those that
+ * only depend on overall parameters are evaluated only when a parameter changes.
+ *
+ * The property "Precision" selects the precision of the evaluation, and can be
+ * "single", "mixed", or "double" with every backend. The Context and Kernel backends
+ * pass it on to platforms that accept it, such as CUDA and OpenCL, and the precision
+ * of the others (double for Reference, mixed for CPU) cannot be changed. With the
+ * native backend, "single" and "mixed" make terms be evaluated several at a time with
+ * SIMD instructions in single precision, while their sum is accumulated in double
+ * precision. This is the fastest way of evaluating a summation on the CPU, when the
+ * accuracy of single precision is enough.
+ *
+ * On the CUDA and OpenCL platforms, the value "Kernel" of the property "Backend" makes
+ * the summation be evaluated by a single reduction kernel over a device array of term
+ * parameters. This avoids the force and energy buffers of the default backend, and
+ * only the terms that have been modified are uploaded in an update. Subexpressions that
+ * only depend on overall parameters are evaluated once on the host, rather than in
+ * every term. A Context of the
+ * specified platform is still created to own the device, but it has no forces.
+ * The kernel converts every term to 64 bit fixed point before adding it, as OpenMM does
+ * with forces, so that the results are bitwise reproducible regardless of how the terms
+ * are distributed among threads, and therefore across runs and devices.  The absolute
+ * resolution of the sums is 2^-32, and their magnitude must stay below 2^31.  Passing
+ * the property "Deterministic" with value "false" makes the kernel add floating point
+ * numbers instead, which removes these limits.
+ *
+ * Which backend is faster depends on the number of terms: a few hundred terms are
+ * evaluated faster on the CPU, and many thousands on a GPU. The value "Auto" of the
+ * property "Backend" makes the choice at run time. Summations with fewer than 1024
+ * terms are evaluated by the native backend. Beyond that, the native backend and a
+ * device backend of the specified platform (the Kernel backend if the platform supports
+ * it, and the Context backend otherwise) are timed by update() whenever the number of
+ * terms has doubled or halved since the previous timing, and the faster one is used
+ * until the next timing. Every thread times the backends on its own, so different
+ * threads may use different backends, but they all compute the same summation.
+ *
+ * By default, every term depends on all arguments, so its cost and the number of
+ * derivatives it contributes grow with the number of arguments. When each term only
+ * depends on a few of the argument points, as in a sum of pairwise or local interactions
+ * over a long vector of arguments, call setPointsPerTerm() before adding any terms. The
+ * expression then refers to the points of a single term, as p1, p2, etc. (and x1, y1, z1,
+ * x2, etc.), and every term is added along with the indices of the argument points that
+ * play these roles. The Native and Context backends, as well as Auto, whose device
+ * backend is then always the Context backend, support such terms. Each term is
+ * evaluated on its own points only, and its derivatives only reach their arguments.
+ *
  * Expressions may involve the operators + (add), - (subtract), * (multiply),
  * / (divide), and ^ (power), and the following functions: sqrt, exp, log, sin, cos,
  * sec, csc, tan, cot, asin, acos, atan, atan2, sinh, cosh, tanh, erf, erfc, min, max,
@@ -166,7 +233,8 @@ public:
      * @param arguments    the array of argument values
      * @param derivOrder   an array specifying the number of times the function has been differentiated
      *                     with respect to each of its arguments.  For example, the array {0, 2} indicates
-     *                     a second derivative with respect to the second argument.
+     *                     a second derivative with respect to the second argument.  Derivatives
+     *                     of up to second order are supported
      * @returns            the value of the derivative
      */
     double evaluateDerivative(const double *arguments, const int *derivOrder) const;
@@ -179,7 +247,103 @@ public:
      */
     double evaluateDerivative(const vector<double> &arguments, int which) const;
     /**
-     * Create a new duplicate of this object on the heap using the "new" operator.
+     * Evaluate all derivatives of the function with respect to its arguments. This is
+     * much cheaper than calling evaluateDerivative() once for each argument, while the
+     * value of the function remains cached for later evaluations.
+     *
+     * @param arguments    the array of argument values
+     * @param gradient     an array of size getNumArguments() which, on exit, contains
+     *                     the derivatives of the function with respect to the arguments
+     */
+    void evaluateGradient(const double *arguments, double *gradient) const;
+    /**
+     * Evaluate the function and all its derivatives in a single computation.
+     *
+     * @param arguments    a vector of argument values
+     * @param derivatives  on exit, this contains the derivatives of the function with
+     *                     respect to each of the arguments
+     * @returns            the value of the function
+     */
+    double evaluateWithDerivatives(const vector<double> &arguments, vector<double> &derivatives) const;
+    /**
+     * Evaluate the function and its derivatives at many points at once. All points
+     * are evaluated in a single computation on the platform, which amortizes the
+     * overhead of launching kernels and transferring data between host and device.
+     *
+     * @param arguments    an array of numPoints*getNumArguments() values, with the
+     *                     arguments of point k stored contiguously starting at
+     *                     index k*getNumArguments()
+     * @param numPoints    the number of points to evaluate
+     * @param values       an array of size numPoints which, on exit, contains the
+     *                     value of the function at each point
+     * @param gradients    an array of size numPoints*getNumArguments() which, on exit,
+     *                     contains the derivatives of the function with respect to the
+     *                     arguments at every point, in the same layout as arguments.
+     *                     If NULL, derivatives are not stored
+     */
+    void evaluateBatch(const double *arguments, int numPoints, double *values, double *gradients = NULL) const;
+    /**
+     * Start evaluating a batch of points in the background, and return immediately. This
+     * lets the caller prepare the next batch, or submit it, while the platform is still
+     * computing the current one. The arguments are copied when the batch is submitted, so
+     * the array can be reused right away. The results must be retrieved with collectBatch(),
+     * in the order the batches were submitted, by the same thread that submitted them.
+     *
+     * Any other evaluation by the same thread first waits for all pending batches to
+     * finish. All batches must be collected before the summation is modified.
+     *
+     * @param arguments          an array of numPoints*getNumArguments() values, laid out
+     *                           as in evaluateBatch()
+     * @param numPoints          the number of points to evaluate
+     * @param includeGradients   whether to compute the derivatives of the function with
+     *                           respect to the arguments
+     */
+    void submitBatch(const double *arguments, int numPoints, bool includeGradients = true) const;
+    /**
+     * Wait for the oldest batch submitted by this thread with submitBatch() to finish, and
+     * retrieve its results.
+     *
+     * @param values       an array of size numPoints which, on exit, contains the value
+     *                     of the function at each point of the batch
+     * @param gradients    an array of size numPoints*getNumArguments() which, on exit,
+     *                     contains the derivatives of the function, laid out as in
+     *                     evaluateBatch(). If NULL, derivatives are not stored
+     * @returns            the number of points in the batch
+     */
+    int collectBatch(double *values, double *gradients = NULL) const;
+    /**
+     * Get the number of batches submitted by this thread that have not been collected yet.
+     */
+    int getNumPendingBatches() const;
+    /**
+     * Get the number of points in the batch that the next call to collectBatch() will
+     * retrieve.
+     */
+    int getPendingBatchSize() const;
+    /**
+     * Evaluate the product of the Hessian matrix of the function and a vector, which is
+     * the directional derivative of the gradient.  With the "Native" backend, the second
+     * derivatives of the terms are computed analytically and contracted with the vector
+     * in a single pass over the terms.  The other backends take central differences of
+     * two gradients along the vector.
+     *
+     * @param arguments    a vector of argument values
+     * @param direction    the vector to be multiplied by the Hessian
+     * @param product      on exit, this contains the product of the Hessian and the vector
+     */
+    void evaluateHessianProduct(const vector<double> &arguments, const vector<double> &direction, vector<double> &product) const;
+    /**
+     * Evaluate the diagonal of the Hessian matrix of the function, that is, the second
+     * derivatives of the function with respect to each of its arguments.  With the "Native"
+     * backend, they are computed analytically in a single pass over the terms.
+     *
+     * @param arguments    a vector of argument values
+     * @param diagonal     on exit, this contains the diagonal of the Hessian
+     */
+    void evaluateHessianDiagonal(const vector<double> &arguments, vector<double> &diagonal) const;
+    /**
+     * Create a new duplicate of this object on the heap using the "new" operator. The
+     * duplicate shares the evaluators of this object, so no new Context is created.
      */
     CustomSummation *clone() const;
     /**
@@ -198,10 +362,29 @@ public:
      * Get the platform used to evaluate the summation.
     */
     Platform &getPlatform() { return *platform; }
+    /**
+     * Get the platform used to evaluate the summation.
+     */
+    const Platform &getPlatform() const { return *platform; }
     /**
      * Get the properties of the platform used to evaluate the summation.
      */
     const map<string, string> &getPlatformProperties() const { return platformProperties; }
+    /**
+     * Declare that every term depends on only some of the argument points.  This must be
+     * done before any terms are added, and cannot be combined with compact support,
+     * Gaussian bounds, or a grid.  The expression then refers to the points of a term as
+     * p1, p2, etc., up to the number of points per term.
+     *
+     * @param numPoints    the number of argument points of every term, or 0 for all of
+     *                     them, which is the default
+     */
+    void setPointsPerTerm(int numPoints);
+    /**
+     * Get the number of argument points of every term, or 0 if every term depends on all
+     * arguments.
+     */
+    int getPointsPerTerm() const { return pointsPerTerm; }
     /**
      * Add a new term to the summation.
      *
@@ -209,6 +392,38 @@ public:
      * @return              the index of the new term
      */
     int addTerm(const vector<double> &parameters);
+    /**
+     * Add a new term that depends on some of the argument points, if the number of points
+     * per term has been set with setPointsPerTerm().
+     *
+     * @param parameters    the parameters of the term
+     * @param points        the indices of the argument points of the term, starting from
+     *                      0, where point i is made of arguments 3*i, 3*i+1, and 3*i+2
+     * @return              the index of the new term
+     */
+    int addTerm(const vector<double> &parameters, const vector<int> &points);
+    /**
+     * Replace all terms of the summation at once.  This has the same effect as
+     * removing all terms and then calling addTerm() for each new one, but is much
+     * faster for large numbers of terms.
+     *
+     * @param parameters    an array of numTerms*getPerTermParameters().size() values,
+     *                      with the parameters of term k stored contiguously starting
+     *                      at index k*getPerTermParameters().size()
+     * @param numTerms      the number of terms
+     */
+    void setTerms(const double *parameters, int numTerms);
+    /**
+     * Replace all terms of a summation whose terms depend on some of the argument points.
+     *
+     * @param parameters    an array of numTerms*getPerTermParameters().size() values,
+     *                      laid out as in setTerms()
+     * @param points        an array of numTerms*getPointsPerTerm() indices, with the
+     *                      points of term k stored contiguously starting at index
+     *                      k*getPointsPerTerm()
+     * @param numTerms      the number of terms
+     */
+    void setTerms(const double *parameters, const int *points, int numTerms);
     /**
      * Get the number of terms in the summation.
      */
@@ -226,6 +441,38 @@ public:
      * @param parameters    the new parameters for the term
      */
     void setTerm(int index, const vector<double> &parameters);
+    /**
+     * Set the parameters and the argument points of a term.
+     *
+     * @param index         the index of the term
+     * @param parameters    the new parameters for the term
+     * @param points        the new indices of the argument points of the term
+     */
+    void setTerm(int index, const vector<double> &parameters, const vector<int> &points);
+    /**
+     * Get the indices of the argument points of a term, which is empty if every term
+     * depends on all arguments.
+     *
+     * @param index    the index of the term
+     */
+    const vector<int> &getTermPoints(int index) const;
+    /**
+     * Remove a term from the summation. The last term is moved into the place of the
+     * removed one, so its index changes, while those of all other terms are preserved.
+     * Like other modifications, this only takes effect when update() is called, which
+     * transfers just the moved term to the platform without reinitializing anything.
+     *
+     * @param index         the index of the term to remove
+     */
+    void removeTerm(int index);
+    /**
+     * Remove several terms from the summation, such as those that have become negligible.
+     * The terms are removed in decreasing order of index, each one as in removeTerm(), so
+     * that the remaining terms keep being stored contiguously.
+     *
+     * @param indices       the indices of the terms to remove, which must be distinct
+     */
+    void removeTerms(const vector<int> &indices);
     /**
      * Get the value of an overall parameter.
      *
@@ -242,18 +489,189 @@ public:
     void setParameter(const string &name, double value);
     /**
      * Update the custom summation after new terms have been added or
-     * parameters of existing terms have been modified.
+     * parameters of existing terms have been modified. Only the terms that
+     * have changed since the last update are transferred to the platform.
      */
     void update();
+    /**
+     * Declare that the terms of the summation have compact support, that is, each
+     * term and its derivatives are exactly zero whenever the Euclidean distance
+     * between the arguments and a per-term center exceeds a per-term radius. This is
+     * the case, for instance, of radial basis functions with a cutoff.
+     *
+     * The native backend uses this information to build a k-d tree over the term
+     * centers and evaluate only the terms near the arguments, which remains efficient
+     * with many arguments. Other backends evaluate all terms, which gives the same result.
+     *
+     * @param centerParameters   the names of the per-term parameters that contain the
+     *                           center coordinates, one for each argument
+     * @param radiusParameter    the name of the per-term parameter that contains the
+     *                           support radius
+     */
+    void setCompactSupport(const vector<string> &centerParameters, const string &radiusParameter);
+    /**
+     * Get the per-term parameters that define the compact support of the terms, if it
+     * has been declared by calling setCompactSupport().
+     *
+     * @param centerParameters   on exit, the names of the per-term parameters that
+     *                           contain the center coordinates
+     * @param radiusParameter    on exit, the name of the per-term parameter that contains
+     *                           the support radius
+     * @return                   whether compact support has been declared
+     */
+    bool getCompactSupport(vector<string> &centerParameters, string &radiusParameter) const;
+    /**
+     * Declare that the terms of the summation are bounded by Gaussians, that is, the
+     * magnitude of each term never exceeds |height|*exp(-d^2/(2*width^2)), where d is the
+     * Euclidean distance between the arguments and a per-term center. This is the case,
+     * for instance, of the hills deposited in metadynamics. It replaces any compact
+     * support declared with setCompactSupport().
+     *
+     * The native backend uses this information to evaluate the summation approximately,
+     * in the same way as for terms with compact support. Each term is skipped when its
+     * bound falls below the tolerance divided by an upper bound on the number of terms, so the error in the
+     * value of the summation never exceeds the tolerance, and the number of terms actually
+     * evaluated grows much more slowly than the total number of terms. Other backends
+     * evaluate all terms exactly.
+     *
+     * @param centerParameters   the names of the per-term parameters that contain the
+     *                           center coordinates, one for each argument
+     * @param widthParameter     the name of the per-term parameter that contains the width
+     * @param heightParameter    the name of the per-term parameter that contains the height
+     * @param tolerance          the largest error allowed in the value of the summation
+     */
+    void setGaussianSupport(const vector<string> &centerParameters, const string &widthParameter,
+                            const string &heightParameter, double tolerance);
+    /**
+     * Get the per-term parameters that define the Gaussian bounds of the terms, if they
+     * have been declared by calling setGaussianSupport().
+     *
+     * @param centerParameters   on exit, the names of the per-term parameters that
+     *                           contain the center coordinates
+     * @param widthParameter     on exit, the name of the per-term parameter that contains
+     *                           the width
+     * @param heightParameter    on exit, the name of the per-term parameter that contains
+     *                           the height
+     * @param tolerance          on exit, the largest error allowed in the value of the
+     *                           summation
+     * @return                   whether Gaussian bounds have been declared
+     */
+    bool getGaussianSupport(vector<string> &centerParameters, string &widthParameter,
+                            string &heightParameter, double &tolerance) const;
+    /**
+     * Tabulate the summation on a regular grid, which is only allowed for summations of
+     * up to three arguments. The native backend computes the value of the summation and
+     * its derivatives with respect to every subset of the arguments at each grid point,
+     * and evaluates arguments inside the grid by tensor-product cubic Hermite
+     * interpolation, at a cost that does not depend on the number of terms. An update() only adds the contributions of new and modified terms to the
+     * grid and subtracts those of removed and modified ones. Arguments outside the grid
+     * and Hessians are evaluated exactly. Other backends always evaluate the summation
+     * exactly.
+     *
+     * @param minValues   the smallest value of each argument covered by the grid
+     * @param maxValues   the largest value of each argument covered by the grid
+     * @param numPoints   the number of grid points along each argument, at least 2
+     */
+    void setGrid(const vector<double> &minValues, const vector<double> &maxValues, const vector<int> &numPoints);
+    /**
+     * Get the grid on which the summation is tabulated, if one has been set by calling
+     * setGrid().
+     *
+     * @param minValues   on exit, the smallest value of each argument covered by the grid
+     * @param maxValues   on exit, the largest value of each argument covered by the grid
+     * @param numPoints   on exit, the number of grid points along each argument
+     * @return            whether a grid has been set
+     */
+    bool getGrid(vector<double> &minValues, vector<double> &maxValues, vector<int> &numPoints) const;
+    /**
+     * Merge new terms into existing ones that only differ from them in a weight
+     * parameter, which is the case, for instance, of hills deposited repeatedly at the
+     * same point of a grid. When addTerm() or setTerms() is given a term whose other
+     * parameters (and points, if the terms have their own) match those of an existing
+     * term, the weight of the new term is added to that of the existing one instead of
+     * appending a new term, so the number of terms grows with the number of distinct
+     * terms rather than with the number of additions. This is only exact if the terms
+     * are proportional to the weight.
+     *
+     * Two parameters match when they round to the same multiple of the tolerance, or
+     * when they are equal if the tolerance is zero. Terms added before this call, or
+     * modified with setTerm(), are not merged with one another, but new terms can be
+     * merged into them.
+     *
+     * @param weightParameter    the name of the per-term parameter that is summed when
+     *                           terms are merged, or an empty string to stop merging
+     * @param tolerance          the resolution at which the other parameters are compared
+     */
+    void setCoalescing(const string &weightParameter, double tolerance = 0.0);
+    /**
+     * Get the weight parameter and the tolerance with which terms are merged, if this
+     * has been requested by calling setCoalescing().
+     *
+     * @param weightParameter    on exit, the name of the per-term parameter that is summed
+     *                           when terms are merged
+     * @param tolerance          on exit, the resolution at which the other parameters are
+     *                           compared
+     * @return                   whether terms are merged
+     */
+    bool getCoalescing(string &weightParameter, double &tolerance) const;
+    /**
+     * Set the maximum number of distinct argument vectors for which the value and
+     * derivatives of the summation are kept in cache. The least recently used entries
+     * are discarded first. The default is 8.
+     *
+     * @param size    the maximum number of cache entries
+     */
+    void setCacheSize(int size);
+    /**
+     * Get the maximum number of distinct argument vectors for which the value and
+     * derivatives of the summation are kept in cache.
+     */
+    int getCacheSize() const { return cacheSize; }
+    /**
+     * Get the number of evaluation requests that have been satisfied by the cache,
+     * summed over all threads and over the clones that share evaluators with this object.
+     */
+    long long getNumCacheHits() const;
+    /**
+     * Get the number of evaluation requests that have required a computation,
+     * summed over all threads and over the clones that share evaluators with this object.
+     */
+    long long getNumCacheMisses() const;
 private:
+    class ImplPool;
+    CustomSummation(const CustomSummation &other);
+    void detachImpls();
     int numArgs;
     string expression;
     map<string, double> overallParameters;
     vector<string> perTermParameters;
     vector<vector<double>> termParameters;
+    int pointsPerTerm;
+    vector<vector<int>> termPoints;
+    set<int> modifiedTerms;
     Platform *platform;
     map<string, string> platformProperties;
-    CustomSummationImpl *impl;
+    long long serialNumber;
+    int cacheSize;
+    vector<int> supportCenters;
+    int supportRadius, supportWidth, supportHeight;
+    double supportTolerance;
+    vector<double> gridMinValues, gridMaxValues;
+    vector<int> gridPoints;
+    vector<vector<double>> updatedTermParameters;
+    vector<vector<int>> updatedTermPoints;
+    int coalescingWeight;
+    double coalescingTolerance;
+    map<vector<double>, int> coalescingKeys;
+    bool coalescingKeysValid;
+    int getPerTermParameterIndex(const string &name) const;
+    void checkTermPoints(const vector<int> &points) const;
+    vector<double> getCoalescingKey(const vector<double> &parameters, const vector<int> &points) const;
+    int appendTerm(const vector<double> &parameters, const vector<int> &points);
+    void assignTerms(const double *parameters, int numTerms);
+    CustomSummationImpl *getImpl() const;
+    CustomSummationImpl *getIdleImpl() const;
+    shared_ptr<ImplPool> pool;
 };
 
 } // namespace OpenMMLab
@@ -0,0 +1,196 @@
+#ifndef OPENMMLAB_CUSTOMSUMMATIONGROUP_H_
+#define OPENMMLAB_CUSTOMSUMMATIONGROUP_H_
+
+/* -------------------------------------------------------------------------- *
+ *                             OpenMM Laboratory                              *
+ *                             =================                              *
+ *                                                                            *
+ * A plugin for testing low-level code implementation for OpenMM.             *
+ *                                                                            *
+ * Copyright (c) 2023 Charlles Abreu                                          *
+ * https://github.com/craabreu/openmm-lab                                     *
+ * -------------------------------------------------------------------------- */
+
+#include "internal/windowsExportOpenMMLab.h"
+#include "openmm/Platform.h"
+#include "openmm/Vec3.h"
+
+#include <map>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace OpenMM {
+    class Context;
+    class CustomCompoundBondForce;
+    class Integrator;
+    class System;
+}
+
+using namespace OpenMM;
+using namespace std;
+
+namespace OpenMMLab {
+
+/**
+ * This class evaluates a group of independent summations that have the same expression
+ * and the same parameters, but different sets of terms, such as the bias potentials of
+ * several collective variables or walkers. Each summation of the group is equivalent to
+ * a CustomSummation, and is evaluated at its own arguments.
+ *
+ * While every CustomSummation owns an inner Context, the whole group shares a single
+ * one, whose CustomCompoundBondForce contains the terms of all summations. Every term
+ * is a bond that connects the particles of its own summation, whose positions are the
+ * arguments of that summation, so all summations are evaluated in a single computation.
+ * For many summations with few terms each, this amortizes the overhead of the Context.
+ *
+ * The terms are added with addTerm() and modified with setTerm(), and neither change
+ * takes effect until update() is called. Changes to the overall parameters, which are
+ * shared by all summations, take effect immediately.
+ *
+ * Unlike CustomSummation, this class does not cache results and must not be used by
+ * several threads at the same time.
+ */
+
+class OPENMM_EXPORT_OPENMM_LAB CustomSummationGroup {
+public:
+    /**
+     * Construct a new CustomSummationGroup.
+     *
+     * @param numSummations          the number of summations in the group
+     * @param numArgs                the number of arguments of each summation
+     * @param expression             the expression for each term, as in CustomSummation
+     * @param overallParameters      the names and default values of the parameters that
+     *                               are shared by all terms of all summations
+     * @param perTermParameters      the names of the parameters that are unique to each
+     *                               term
+     * @param platform               the platform that will be used to evaluate the
+     *                               summations
+     * @param platformProperties     a set of values for platform-specific properties
+     */
+    CustomSummationGroup(
+        int numSummations,
+        int numArgs,
+        string expression,
+        map<string, double> overallParameters,
+        vector<string> perTermParameters,
+        Platform &platform,
+        map<string, string> platformProperties = map<string, string>()
+    );
+    ~CustomSummationGroup();
+    /**
+     * Get the number of summations in the group.
+     */
+    int getNumSummations() const { return numSummations; }
+    /**
+     * Get the number of arguments of each summation.
+     */
+    int getNumArguments() const { return numArgs; }
+    /**
+     * Get the expression for each term.
+     */
+    const string &getExpression() const { return expression; }
+    /**
+     * Get a map of the names to default values of the overall parameters.
+     */
+    const map<string, double> &getOverallParameters() const { return overallParameters; }
+    /**
+     * Get a vector of the names of the per-term parameters.
+     */
+    const vector<string> &getPerTermParameters() const { return perTermParameters; }
+    /**
+     * Add a new term to one of the summations.
+     *
+     * @param summation     the index of the summation
+     * @param parameters    the parameters of the term
+     * @return              the index of the new term within its summation
+     */
+    int addTerm(int summation, const vector<double> &parameters);
+    /**
+     * Get the number of terms in one of the summations.
+     *
+     * @param summation    the index of the summation
+     */
+    int getNumTerms(int summation) const;
+    /**
+     * Get the parameters of a term.
+     *
+     * @param summation    the index of the summation
+     * @param index        the index of the term within its summation
+     */
+    const vector<double> &getTerm(int summation, int index) const;
+    /**
+     * Set the parameters of a term.
+     *
+     * @param summation     the index of the summation
+     * @param index         the index of the term within its summation
+     * @param parameters    the new parameters of the term
+     */
+    void setTerm(int summation, int index, const vector<double> &parameters);
+    /**
+     * Get the value of an overall parameter.
+     *
+     * @param name    the name of the parameter
+     * @return        the value of the parameter
+     */
+    double getParameter(const string &name) const;
+    /**
+     * Set the value of an overall parameter, which is shared by all summations.
+     *
+     * @param name    the name of the parameter
+     * @param value   the value of the parameter
+     */
+    void setParameter(const string &name, double value);
+    /**
+     * Update the group after new terms have been added or parameters of existing terms
+     * have been modified. Only the terms that have changed since the last update are
+     * transferred to the platform, unless a summation has outgrown the room reserved for
+     * its terms.
+     */
+    void update();
+    /**
+     * Evaluate all summations and their derivatives in a single computation.
+     *
+     * @param arguments    an array of getNumSummations()*getNumArguments() values, with
+     *                     the arguments of summation k stored contiguously starting at
+     *                     index k*getNumArguments()
+     * @param values       an array of size getNumSummations() which, on exit, contains
+     *                     the value of each summation
+     * @param gradients    an array of the same size as arguments which, on exit, contains
+     *                     the derivatives of each summation with respect to its arguments,
+     *                     in the same layout. If NULL, derivatives are not stored
+     */
+    void evaluate(const double *arguments, double *values, double *gradients = NULL);
+    /**
+     * Evaluate all summations and their derivatives in a single computation.
+     *
+     * @param arguments    the arguments of all summations, stored as in the other version
+     *                     of this method
+     * @param values       on exit, the value of each summation
+     * @param gradients    on exit, the derivatives of each summation with respect to its
+     *                     arguments, in the same layout as arguments
+     */
+    void evaluate(const vector<double> &arguments, vector<double> &values, vector<double> &gradients);
+private:
+    vector<double> slotParameters(int summation, int slot) const;
+    vector<int> blockParticles(int summation) const;
+    int numSummations, numArgs;
+    string expression;
+    map<string, double> overallParameters;
+    vector<string> perTermParameters;
+    Platform *platform;
+    map<string, string> platformProperties;
+    vector<vector<vector<double>>> termParameters;
+    set<pair<int, int>> modifiedTerms;
+    int termCapacity, blockSize;
+    System *system;
+    Integrator *integrator;
+    Context *context;
+    CustomCompoundBondForce *force;
+    vector<Vec3> positions;
+};
+
+} // namespace OpenMMLab
+
+#endif /*OPENMMLAB_CUSTOMSUMMATIONGROUP_H_*/
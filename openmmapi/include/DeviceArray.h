@@ -0,0 +1,65 @@
+#ifndef OPENMMLAB_DEVICEARRAY_H_
+#define OPENMMLAB_DEVICEARRAY_H_
+
+/* -------------------------------------------------------------------------- *
+ *                             OpenMM Laboratory                              *
+ *                             =================                              *
+ *                                                                            *
+ * A plugin for testing low-level code implementation for OpenMM.             *
+ *                                                                            *
+ * Copyright (c) 2023 Charlles Abreu                                          *
+ * https://github.com/craabreu/openmm-lab                                     *
+ * -------------------------------------------------------------------------- */
+
+#include "internal/windowsExportOpenMMLab.h"
+#include <string>
+#include <vector>
+
+namespace OpenMMLab {
+
+/**
+ * This describes an array that resides in the memory of a GPU, so that other libraries can
+ * read it in place, without copying it to the host.  The fields follow the conventions of
+ * the CUDA array interface, which PyTorch, CuPy, Numba, and JAX accept.
+ *
+ * The array is owned by the Context it was obtained from.  It remains valid until the Context
+ * is destroyed or reinitialized, but its contents change every time the Context computes
+ * forces.  Readers must order their work after that of the Context, for instance by waiting
+ * for the stream on which the Context enqueues it.
+ */
+
+class OPENMM_EXPORT_OPENMM_LAB DeviceArray {
+public:
+    DeviceArray() : pointer(0), stream(0), device(-1), scale(1.0) {
+    }
+    /**
+     * The address of the first element in device memory, or 0 if the array does not exist.
+     */
+    long long pointer;
+    /**
+     * The type of the elements, as a NumPy type string such as "<f4" or "<i8".
+     */
+    std::string typestr;
+    /**
+     * The number of elements along each dimension, in row-major order.
+     */
+    std::vector<int> shape;
+    /**
+     * The handle of the CUDA stream on which the Context writes the array.  A value of 0
+     * means the legacy default stream.
+     */
+    long long stream;
+    /**
+     * The index of the device that holds the array.
+     */
+    int device;
+    /**
+     * The factor that converts the stored elements into standard units, which is not 1
+     * when they are stored in fixed point.
+     */
+    double scale;
+};
+
+} // namespace OpenMMLab
+
+#endif /*OPENMMLAB_DEVICEARRAY_H_*/
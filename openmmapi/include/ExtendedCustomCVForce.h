@@ -11,10 +11,14 @@
  * https://github.com/craabreu/openmm-lab                                     *
  * -------------------------------------------------------------------------- */
 
+#include "CustomSummation.h"
+#include "DeviceArray.h"
 #include "internal/windowsExportOpenMMLab.h"
 
 #include "openmm/Force.h"
 #include "openmm/TabulatedFunction.h"
+#include "openmm/VirtualSite.h"
+#include <map>
 #include <string>
 #include <vector>
 
@@ -51,10 +55,63 @@ namespace OpenMMLab {
  *
  * In addition, you can call addTabulatedFunction() to define a new function based on tabulated values.  You specify the function by
  * creating a TabulatedFunction object.  That function can then appear in the expression.
+ *
+ * Finally, you can call addRadialBasisFunction() to define a radial basis function expansion over a subset
+ * of the collective variables.  It is a sum of the form f(v) = sum_k w_k*phi(e*|v-c_k|), where v is a point
+ * in the space of the chosen collective variables, c_k and w_k are the center and weight of the k-th basis
+ * function, e is a shape parameter, and phi(s) is a Gaussian (exp(-s^2)), a multiquadric (sqrt(1+s^2)), or
+ * a thin-plate spline (s^2*log(s)).  The expansion is referred to by name in the energy expression, just
+ * like a collective variable.  Its value and gradient are evaluated on the device by platforms that support
+ * it, which is much more efficient than writing thousands of terms in the energy expression.
+ *
+ * A CustomSummation can be added with addCustomSummation() in the same way.  It is evaluated at the
+ * values of a list of collective variables, one for each of its arguments, and referred to by name in
+ * the energy expression.  Platforms that support it evaluate the terms on the device, in the Context
+ * of this force, so that the summation needs no Context of its own.
+ *
+ * Every collective variable added with addCollectiveVariable() takes a force group of the inner
+ * Context and one evaluation of its own, which limits their number to 32.  Many cheap variables
+ * of the same form, such as the entries of a contact map, can instead be added together with
+ * addCollectiveVariableBatch().  The bonds of a CustomBondForce or CustomCompoundBondForce then
+ * define one variable each, and the whole batch takes a single force group and is evaluated in
+ * at most two passes, however many variables it contains.
+ *
+ * Collective variables built from the same atoms, such as several distances from the center of
+ * a group, can share the intermediate positions they depend on.  A particle added with
+ * addSharedCentroid() or addSharedParticle() exists only in the inner Context, where it comes
+ * after the particles of the System.  Its position is computed once per evaluation, before any
+ * collective variable, and the forces on it are distributed to the particles it depends on.
+ *
+ * A collective variable may itself be an ExtendedCustomCVForce, which is how hierarchical bias
+ * potentials are built.  Unless it has radial basis functions, custom summations, or batches of
+ * collective variables, or the outer force uses it as an argument of one of these, its own
+ * collective variables are moved into the inner Context of the outer force, under the name of
+ * the nested variable followed by a dot and their own names, and its energy expression is
+ * substituted into that of the outer force.  A whole hierarchy is then evaluated with a single
+ * inner Context and a single copy of the positions, however deep it is, as long as it has no more
+ * than 32 collective variables in total.  A variable of a nested force is evaluated at the largest
+ * of its own interval and those of the variables that contain it.
  */
 
 class OPENMM_EXPORT_OPENMM_LAB ExtendedCustomCVForce : public Force {
 public:
+    /**
+     * This is an enumeration of the radial basis functions that can be used in an expansion.
+     */
+    enum RadialBasisFunctionType {
+        /**
+         * phi(s) = exp(-s^2)
+         */
+        Gaussian = 0,
+        /**
+         * phi(s) = sqrt(1+s^2)
+         */
+        Multiquadric = 1,
+        /**
+         * phi(s) = s^2*log(s), with phi(0) = 0
+         */
+        ThinPlateSpline = 2
+    };
     /**
      * Create a ExtendedCustomCVForce.
      *
@@ -69,6 +126,18 @@ public:
     int getNumCollectiveVariables() const {
         return variables.size();
     }
+    /**
+     * Get the number of batches of collective variables that the interaction depends on.
+     */
+    int getNumCollectiveVariableBatches() const {
+        return batches.size();
+    }
+    /**
+     * Get the number of particles shared by the collective variables.
+     */
+    int getNumSharedParticles() const {
+        return sharedParticles.size();
+    }
     /**
      * Get the number of global parameters that the interaction depends on.
      */
@@ -88,6 +157,18 @@ public:
     int getNumTabulatedFunctions() const {
         return functions.size();
     }
+    /**
+     * Get the number of radial basis function expansions that have been defined.
+     */
+    int getNumRadialBasisFunctions() const {
+        return radialBasisFunctions.size();
+    }
+    /**
+     * Get the number of custom summations that have been defined.
+     */
+    int getNumCustomSummations() const {
+        return summations.size();
+    }
     /**
      * Get the algebraic expression that gives the energy of the system
      */
@@ -129,6 +210,175 @@ public:
      * @return the Force object
      */
     const Force& getCollectiveVariable(int index) const;
+    /**
+     * Set the number of steps between successive evaluations of a collective variable.  This
+     * is useful for expensive variables that change slowly.  At steps at which a variable is
+     * not due for evaluation, the value and the forces computed at its latest evaluation are
+     * reused, which amounts to holding its contribution constant over the interval.
+     *
+     * @param index     the index of the collective variable
+     * @param interval  the number of steps between evaluations (1 by default, meaning that
+     *                  the variable is evaluated at every step)
+     */
+    void setCollectiveVariableInterval(int index, int interval);
+    /**
+     * Get the number of steps between successive evaluations of a collective variable.
+     *
+     * @param index     the index of the collective variable
+     * @return the number of steps between evaluations
+     */
+    int getCollectiveVariableInterval(int index) const;
+    /**
+     * Set the platform on which a collective variable is evaluated.  By default, every
+     * variable is evaluated in the inner Context, which uses the platform of the Context
+     * containing this force.  On a GPU, a cheap variable such as a distance or an angle
+     * then costs kernel launches and a synchronization that take longer than the arithmetic.
+     * A variable placed on another platform, typically "CPU", is instead evaluated in a
+     * Context of that platform, in a separate thread that runs while the inner Context
+     * evaluates the other variables.  The positions are downloaded once per evaluation for
+     * all such variables, and their forces are added to those of the Context.  Their energy
+     * parameter derivatives are not computed.
+     *
+     * @param index     the index of the collective variable
+     * @param platform  the name of the platform, or an empty string (the default) to evaluate
+     *                  the variable in the inner Context
+     */
+    void setCollectiveVariablePlatform(int index, const std::string& platform);
+    /**
+     * Get the name of the platform on which a collective variable is evaluated, or an empty
+     * string if it is evaluated in the inner Context.
+     *
+     * @param index     the index of the collective variable
+     * @return the name of the platform
+     */
+    const std::string& getCollectiveVariablePlatform(int index) const;
+    /**
+     * Set whether the forces of the collective variables are stored in compressed form.  On
+     * the CUDA and OpenCL platforms, the forces of every collective variable are kept on the
+     * device between its evaluations, as 64 bit fixed point values, and the forces of all
+     * variables are read at every step to apply the chain rule.  In compressed form, they
+     * are stored as 32 bit floating point values, which halves the memory and the bandwidth
+     * this takes.  The chain rule sums are still accumulated in fixed point, so the only loss
+     * is the rounding of every stored force to a relative precision of about 1e-7, which is
+     * usually negligible but can matter for variables whose forces span many orders of
+     * magnitude.  Other platforms ignore this setting.
+     *
+     * @param compressed    whether to store the forces in compressed form (false by default)
+     */
+    void setUseCompressedForces(bool compressed);
+    /**
+     * Get whether the forces of the collective variables are stored in compressed form.
+     */
+    bool getUseCompressedForces() const;
+    /**
+     * Set whether the derivatives of the energy with respect to global parameters are only
+     * computed on evaluations that also compute the energy, such as getState() with
+     * State::Energy or State::ParameterDerivatives.  By default, as in OpenMM, they are
+     * computed at every evaluation, which on the CUDA and OpenCL platforms evaluates their
+     * expressions and reads the derivatives of every collective variable from the inner
+     * Context at every step, even though dynamics only needs the derivatives with respect
+     * to the collective variables.  Enable this when the derivatives are only read
+     * occasionally, but not when an integrator uses them in steps that do not compute the
+     * energy.  Other platforms ignore this setting.
+     *
+     * @param onDemand    whether to compute the derivatives on demand (false by default)
+     */
+    void setUseDerivativesOnDemand(bool onDemand);
+    /**
+     * Get whether the derivatives of the energy with respect to global parameters are only
+     * computed on evaluations that also compute the energy.
+     */
+    bool getUseDerivativesOnDemand() const;
+    /**
+     * Set the number of steps whose collective variables and energy every Context records,
+     * so that they can be read in bulk with getCollectiveVariableHistory().  The first
+     * evaluation of every step is recorded, with no extra work other than evaluating the
+     * energy expression if the energy was not requested.  Once the history is full, every
+     * new step overwrites the oldest one.  Changes take effect when a Context is created or
+     * reinitialized.
+     *
+     * @param size    the number of steps to keep, or 0 to record none (the default)
+     */
+    void setCollectiveVariableHistorySize(int size);
+    /**
+     * Get the number of steps whose collective variables and energy every Context records.
+     */
+    int getCollectiveVariableHistorySize() const;
+    /**
+     * Add a batch of collective variables that the force may depend on.  Every bond of the
+     * Force defines one variable, whose value is the energy of that bond alone.  The Force
+     * should have been created on the heap with the "new" operator, and the ExtendedCustomCVForce
+     * takes over ownership of it.
+     *
+     * All variables of a batch are evaluated together at every step, regardless of the
+     * number of variables, and the batch counts as a single collective variable toward the
+     * limit of 32.  Variables of batches come after those added with addCollectiveVariable()
+     * in the values returned by getCollectiveVariableValues(), in the order of their batches.
+     *
+     * @param names      the names of the variables, one for each bond of the Force, as they
+     *                   will appear in the energy expression
+     * @param variables  a CustomBondForce or a CustomCompoundBondForce whose bonds define the
+     *                   variables
+     * @return the index of the batch that was added
+     */
+    int addCollectiveVariableBatch(const std::vector<std::string>& names, Force* variables);
+    /**
+     * Get the names of the collective variables of a batch.
+     *
+     * @param index     the index of the batch
+     * @return the names of the variables, one for each bond
+     */
+    const std::vector<std::string>& getCollectiveVariableBatchNames(int index) const;
+    /**
+     * Get a writable reference to the Force object whose bonds define a batch of collective
+     * variables.
+     *
+     * @param index     the index of the batch to get
+     * @return the Force object
+     */
+    Force& getCollectiveVariableBatch(int index);
+    /**
+     * Get a const reference to the Force object whose bonds define a batch of collective
+     * variables.
+     *
+     * @param index     the index of the batch to get
+     * @return the Force object
+     */
+    const Force& getCollectiveVariableBatch(int index) const;
+    /**
+     * Add a particle shared by the collective variables, whose position is defined by a
+     * VirtualSite in terms of the particles of the System.  The Forces of the collective
+     * variables refer to it by the index N+k, where N is the number of particles of the System
+     * and k is the index returned by this method.  A LocalCoordinatesSite, for example, can
+     * place particles along the axes of a local frame of a group of atoms.  The VirtualSite
+     * should have been created on the heap with the "new" operator, and the
+     * ExtendedCustomCVForce takes over ownership of it.
+     *
+     * @param site    the VirtualSite that defines the position of the particle.  It may only
+     *                depend on particles of the System.
+     * @return the index of the shared particle that was added
+     */
+    int addSharedParticle(VirtualSite* site);
+    /**
+     * Add a particle shared by the collective variables, at the weighted centroid of a group
+     * of particles of the System, as with addSharedParticle().  The weights are normalized to
+     * sum to 1.  A group of more than three particles is represented by a LocalCoordinatesSite,
+     * whose axes are defined by the first three particles, so these must not be collinear.
+     *
+     * @param particles   the indices of the particles of the group
+     * @param weights     the weights of the particles, or an empty vector to weight them all
+     *                    equally
+     * @return the index of the shared particle that was added
+     */
+    int addSharedCentroid(const std::vector<int>& particles, const std::vector<double>& weights=std::vector<double>());
+    /**
+     * Get the VirtualSite that defines the position of a particle shared by the collective
+     * variables.
+     *
+     * @param index     the index of the shared particle
+     * @return the VirtualSite object
+     */
+    const VirtualSite& getSharedParticle(int index) const;
     /**
      * Add a new global parameter that the interaction may depend on.  The default value provided to
      * this method is the initial value of the parameter in newly created Contexts.  You can change
@@ -214,7 +464,169 @@ public:
      */
     const std::string& getTabulatedFunctionName(int index) const;
     /**
-     * Get the current values of the collective variables in a Context.
+     * Add a radial basis function expansion that may appear in the energy expression.
+     *
+     * @param name            the name of the expansion as it appears in expressions
+     * @param type            the type of radial basis function
+     * @param shapeParameter  the shape parameter e, which multiplies the distance to each center
+     * @param variables       the names of the collective variables that define the space in
+     *                        which the expansion is evaluated
+     * @param centers         the coordinates of the centers, stored as a flattened array of
+     *                        length weights.size()*variables.size()
+     * @param weights         the weights of the basis functions
+     * @return the index of the expansion that was added
+     */
+    int addRadialBasisFunction(const std::string& name, RadialBasisFunctionType type, double shapeParameter,
+                               const std::vector<std::string>& variables, const std::vector<double>& centers,
+                               const std::vector<double>& weights);
+    /**
+     * Get the parameters of a radial basis function expansion.
+     *
+     * @param index                the index of the expansion
+     * @param[out] name            the name of the expansion as it appears in expressions
+     * @param[out] type            the type of radial basis function
+     * @param[out] shapeParameter  the shape parameter e
+     * @param[out] variables       the names of the collective variables the expansion depends on
+     * @param[out] centers         the flattened coordinates of the centers
+     * @param[out] weights         the weights of the basis functions
+     */
+    void getRadialBasisFunctionParameters(int index, std::string& name, RadialBasisFunctionType& type, double& shapeParameter,
+                                          std::vector<std::string>& variables, std::vector<double>& centers,
+                                          std::vector<double>& weights) const;
+    /**
+     * Set the parameters of a radial basis function expansion.  The name and the variables
+     * are fixed when the expansion is added, so only the remaining parameters can be changed.
+     *
+     * @param index           the index of the expansion
+     * @param type            the type of radial basis function
+     * @param shapeParameter  the shape parameter e
+     * @param centers         the flattened coordinates of the centers
+     * @param weights         the weights of the basis functions
+     */
+    void setRadialBasisFunctionParameters(int index, RadialBasisFunctionType type, double shapeParameter,
+                                          const std::vector<double>& centers, const std::vector<double>& weights);
+    /**
+     * Add a CustomSummation that may appear in the energy expression.  The terms and overall
+     * parameters it has when a Context is created are copied to that Context.  To change
+     * them later, modify the summation and then call updateParametersInContext().  Calling
+     * CustomSummation::update() is not required for this.
+     *
+     * @param name        the name of the summation as it appears in expressions
+     * @param summation   the CustomSummation.  It should have been created on the heap with the
+     *                    "new" operator.  The Force takes over ownership of it, and deletes it when
+     *                    the Force itself is deleted.
+     * @param variables   the names of the collective variables passed to the summation as
+     *                    arguments, whose number must equal that of its arguments
+     * @return the index of the summation that was added
+     */
+    int addCustomSummation(const std::string& name, CustomSummation* summation, const std::vector<std::string>& variables);
+    /**
+     * Get a const reference to a custom summation that may appear in the energy expression.
+     *
+     * @param index     the index of the summation to get
+     * @return the CustomSummation
+     */
+    const CustomSummation& getCustomSummation(int index) const;
+    /**
+     * Get a reference to a custom summation that may appear in the energy expression.
+     *
+     * @param index     the index of the summation to get
+     * @return the CustomSummation
+     */
+    CustomSummation& getCustomSummation(int index);
+    /**
+     * Get the name of a custom summation that may appear in the energy expression.
+     *
+     * @param index     the index of the summation
+     * @return the name of the summation as it appears in expressions
+     */
+    const std::string& getCustomSummationName(int index) const;
+    /**
+     * Get the names of the collective variables passed to a custom summation as arguments.
+     *
+     * @param index     the index of the summation
+     * @return the names of the collective variables
+     */
+    const std::vector<std::string>& getCustomSummationVariables(int index) const;
+    /**
+     * Make every Context deposit terms in a custom summation by itself, as metadynamics does
+     * with its hills.  At the first evaluation of a step that is a positive multiple of the
+     * interval, a term is appended to the summation, whose per-term parameters are the values
+     * of the given expressions.  These may involve the collective variables, the global
+     * parameters, the radial basis functions, and the custom summations, which take their
+     * values before the deposition.  The new term contributes from the next evaluation on.
+     *
+     * The deposited terms belong to the Context, not to the CustomSummation, and follow its
+     * own terms.  They are kept by updateParametersInContext(), and are discarded when the
+     * Context is reinitialized.  Use getCustomSummationDepositedTerms() to retrieve them.
+     * Changes to the deposition take effect when a Context is created or reinitialized.
+     *
+     * @param index        the index of the summation
+     * @param interval     the number of steps between depositions, or 0 for none
+     * @param parameters   the expressions for the per-term parameters of a deposited term, one
+     *                     for each of them and in the same order
+     */
+    void setCustomSummationDeposition(int index, int interval, const std::vector<std::string>& parameters);
+    /**
+     * Get the number of steps between the depositions of terms in a custom summation, or 0
+     * if terms are not deposited.
+     *
+     * @param index     the index of the summation
+     */
+    int getCustomSummationDepositionInterval(int index) const;
+    /**
+     * Get the expressions for the per-term parameters of the terms deposited in a custom summation.
+     *
+     * @param index     the index of the summation
+     */
+    const std::vector<std::string>& getCustomSummationDepositionParameters(int index) const;
+    /**
+     * Get the terms that a Context has deposited in a custom summation so far (see
+     * setCustomSummationDeposition()).
+     *
+     * @param context        the Context whose terms to get
+     * @param index          the index of the summation
+     * @param[out] terms     the per-term parameters of each deposited term, in the order of deposition
+     */
+    void getCustomSummationDepositedTerms(Context& context, int index, std::vector<std::vector<double> >& terms) const;
+    /**
+     * Get the values of the collective variables and the energy of the force at the steps
+     * a Context has recorded since the latest call, up to the size of the history (see
+     * setCollectiveVariableHistorySize()), and remove them from the history.  Unlike
+     * getCollectiveVariableValues(), this evaluates nothing.
+     *
+     * @param context        the Context whose history to get
+     * @param[out] steps     the step of each record, from the oldest to the newest
+     * @param[out] values    the values of the collective variables at each step, in the same
+     *                       order as in getCollectiveVariableValues()
+     * @param[out] energies  the energy of the force at each step
+     */
+    void getCollectiveVariableHistory(Context& context, std::vector<long long>& steps, std::vector<std::vector<double> >& values,
+                                      std::vector<double>& energies) const;
+    /**
+     * Evaluate the collective variables at a series of frames, such as those of a saved
+     * trajectory, without changing the state of a Context.  The positions of every frame are
+     * set directly in the inner Context and in those of the variables placed on other
+     * platforms, and every variable is evaluated regardless of its evaluation interval.  This
+     * avoids setting the positions of the Context itself, and the evaluations that would
+     * follow.  The values and forces the Context keeps for its simulation are not affected.
+     * The global parameters are those of the Context.
+     *
+     * @param context        the Context whose force to evaluate
+     * @param frames         the positions of the particles of the System at each frame
+     * @param boxVectors     the three periodic box vectors at each frame, or an empty vector to
+     *                       use those of the Context at all frames
+     * @param[out] values    the values of the collective variables at each frame, in the same
+     *                       order as in getCollectiveVariableValues()
+     */
+    void getCollectiveVariableValuesForFrames(Context& context, const std::vector<std::vector<Vec3> >& frames,
+                                              const std::vector<std::vector<Vec3> >& boxVectors,
+                                              std::vector<std::vector<double> >& values) const;
+    /**
+     * Get the current values of the collective variables in a Context.  A variable whose
+     * evaluation interval has not elapsed keeps the value of its latest evaluation, which
+     * is the one the force is using.  The others are evaluated again, all of them in a
+     * single energy-only pass over the inner Context.
      *
      * @param context        the Context for which to get the values
      * @param[out] values    the values of the collective variables are computed and
@@ -231,19 +643,140 @@ public:
      * a few cases where you need to directly access that internal Context.  For example,
      * if you want to modify one of the Forces that defines a collective variable and
      * call updateParametersInContext() on it, you need to pass that inner Context to it.
-     * This method returns a reference to it.
+     * This method returns a reference to it.  The collective variables of nested
+     * ExtendedCustomCVForces that have been merged into that of this force have no inner
+     * Context of their own.
      *
      * @param context    the Context containing the ExtendedCustomCVForce
      * @return the inner Context used to evaluate the collective variables
      */
     Context& getInnerContext(Context& context);
+    /**
+     * Get the time spent in each stage of the computation of this force in a Context, in
+     * milliseconds, accumulated since the Context was created or the times were last reset.
+     * The stages are copying the state to the inner Context ("copyState"), evaluating each
+     * collective variable ("cv:" followed by its name), evaluating the batches of collective
+     * variables ("batches"), evaluating the energy expression and its derivatives
+     * ("expression"), and applying the chain rule forces ("addForces").
+     * Profiling must be enabled by setting the environment variable OPENMMLAB_PROFILING to 1
+     * before the Context is created, and is supported by the CUDA and OpenCL platforms.
+     * On every platform, profiling also reports the times taken to create the inner Context
+     * ("init:innerContext"), to initialize the kernel ("init:kernel"), and to create the
+     * Contexts of the variables placed on other platforms ("init:placedContexts"), which
+     * overlaps the other two.  Otherwise, the returned map is empty.
+     *
+     * @param context    the Context containing the ExtendedCustomCVForce
+     * @return the accumulated time of each stage, keyed by stage name
+     */
+    std::map<std::string, double> getStageTimesInContext(Context& context);
+    /**
+     * Reset the accumulated times returned by getStageTimesInContext() to zero.
+     *
+     * @param context    the Context containing the ExtendedCustomCVForce
+     */
+    void resetStageTimesInContext(Context& context);
+    /**
+     * Get counters of the work done to evaluate this force in a Context, accumulated since
+     * the Context was created or the counters were last reset.  Dividing them by the number
+     * of evaluations gives the cost of each evaluation, which is one per step in a
+     * simulation with a single time step.  The counters are:
+     *
+     * <ul>
+     * <li>evaluations: the number of times the force was evaluated</li>
+     * <li>copyStates: the number of times the state was copied to the inner Context</li>
+     * <li>bytesCopied: the bytes moved between the Context and the inner Context, and
+     * between host and device, to evaluate the force</li>
+     * <li>innerEvaluations: the number of evaluations of collective variables by the inner
+     * Context</li>
+     * <li>expressionEvaluations: the number of evaluations of the energy expression and of
+     * its derivatives</li>
+     * <li>synchronizations: the number of times the host waited for the device, such as
+     * when reading back the value of a collective variable</li>
+     * </ul>
+     *
+     * On the CUDA and OpenCL platforms, the memory used by the force is also reported.  These
+     * entries are sizes rather than counters, so resetting the counters does not affect them:
+     *
+     * <ul>
+     * <li>deviceBytes: the bytes of device memory held by the force for its own use</li>
+     * <li>scratchBytes: the bytes of device memory in the scratch pool of the Context, which
+     * holds the temporary arrays of radial basis function expansions and custom summations
+     * and is shared by all forces of this plugin in the Context</li>
+     * </ul>
+     *
+     * @param context    the Context containing the ExtendedCustomCVForce
+     * @return the value of each counter, keyed by counter name
+     */
+    std::map<std::string, long long> getCountersInContext(Context& context);
+    /**
+     * Reset the counters returned by getCountersInContext() to zero.
+     *
+     * @param context    the Context containing the ExtendedCustomCVForce
+     */
+    void resetCountersInContext(Context& context);
+    /**
+     * Get the results that the collective variables keep in a Context between evaluations,
+     * while their evaluation intervals have not elapsed.  Together with the state of the
+     * Context, they let another Context of the same System continue from the same point
+     * without evaluating the variables again, which is what ContextSnapshot uses them for.
+     * Platforms that keep no results apart from forces return empty vectors.
+     *
+     * @param context            the Context containing the ExtendedCustomCVForce
+     * @param[out] steps         the step at which each variable was last evaluated, or -1 if
+     *                           it keeps no results
+     * @param[out] values        the value of each variable
+     * @param[out] derivatives   the derivatives of each variable with respect to the global
+     *                           parameters of the inner Context
+     */
+    void getCollectiveVariableCacheInContext(Context& context, std::vector<long long>& steps, std::vector<double>& values,
+                                             std::vector<std::vector<double> >& derivatives);
+    /**
+     * Replace the results that the collective variables keep in a Context between
+     * evaluations, such as those obtained with getCollectiveVariableCacheInContext() from
+     * another Context of the same System.  The forces of the variables are not transferred,
+     * so a variable is evaluated again the next time its forces are needed.  On platforms
+     * that return no results, the results are discarded instead.
+     *
+     * @param context       the Context containing the ExtendedCustomCVForce
+     * @param steps         the step at which each variable was evaluated, or -1 for a variable
+     *                      with no results.  If empty, all results are discarded.
+     * @param values        the value of each variable
+     * @param derivatives   the derivatives of each variable with respect to the global
+     *                      parameters of the inner Context
+     */
+    void setCollectiveVariableCacheInContext(Context& context, const std::vector<long long>& steps, const std::vector<double>& values,
+                                             const std::vector<std::vector<double> >& derivatives);
+    /**
+     * Get the device arrays that hold the forces of the collective variables in a Context, so
+     * that other libraries, such as PyTorch or JAX, can read them in place.  This is only
+     * supported by the CUDA platform.
+     *
+     * The forces array only holds the collective variables whose forces are stored for all
+     * atoms, which excludes those that only act on a few atoms and those evaluated in placed
+     * contexts.  Its shape is (variables.size(), 3, number of padded atoms), and it holds the
+     * forces computed the last time each variable was evaluated.  Multiplying them by its
+     * scale gives kJ/mol/nm.  The Context keeps the atoms in an order of its own, which changes
+     * from time to time, so position j of the last dimension holds the force on atom
+     * atomIndices[j].  The positions beyond the number of atoms are padding.
+     *
+     * The values of the collective variables are energies returned by the inner Context, so
+     * they only exist on the host.  Use getCollectiveVariableValues() to get them.
+     *
+     * @param context       the Context containing the ExtendedCustomCVForce
+     * @param forces        on exit, the forces of the collective variables
+     * @param atomIndices   on exit, the index of the atom at each position of the forces
+     * @param variables     on exit, the index of the collective variable of each row of forces
+     */
+    void getDeviceArraysInContext(Context& context, DeviceArray& forces, DeviceArray& atomIndices, std::vector<int>& variables);
     /**
      * Update the tabulated function parameters in a Context to match those stored in this Force object.  This method
      * provides an efficient method to update certain parameters in an existing Context without needing to reinitialize it.
      * Simply call getTabulatedFunction(index).setFunctionParameters() to modify this object's parameters, then call
      * updateParametersInContext() to copy them over to the Context.
      *
-     * This method is very limited.  The only information it updates is the parameters of tabulated functions.
+     * This method is very limited.  The only information it updates is the parameters of tabulated functions,
+     * the parameters of radial basis function expansions (type, shape parameter, centers, and weights; the number
+     * of centers may change), and the evaluation intervals of collective variables.
      * All other aspects of the Force (the energy expression, the set of collective variables, etc.) are unaffected and can
      * only be changed by reinitializing the Context.
      */
@@ -258,14 +791,24 @@ public:
 protected:
     ForceImpl* createImpl() const;
 private:
+    friend class ExtendedCustomCVForceImpl;
     class GlobalParameterInfo;
     class VariableInfo;
     class FunctionInfo;
+    class RadialBasisFunctionInfo;
+    class SummationInfo;
+    class BatchInfo;
     std::string energyExpression;
     std::vector<GlobalParameterInfo> globalParameters;
     std::vector<VariableInfo> variables;
     std::vector<FunctionInfo> functions;
+    std::vector<RadialBasisFunctionInfo> radialBasisFunctions;
+    std::vector<SummationInfo> summations;
+    std::vector<BatchInfo> batches;
+    std::vector<VirtualSite*> sharedParticles;
     std::vector<int> energyParameterDerivatives;
+    bool compressedForces, derivativesOnDemand;
+    int historySize;
 };
 
 /**
@@ -290,9 +833,11 @@ class ExtendedCustomCVForce::VariableInfo {
 public:
     std::string name;
     Force* variable;
+    int interval;
+    std::string platform;
     VariableInfo() {
     }
-    VariableInfo(const std::string& name, Force* variable) : name(name), variable(variable) {
+    VariableInfo(const std::string& name, Force* variable) : name(name), variable(variable), interval(1) {
     }
 };
 
@@ -310,6 +855,58 @@ public:
     }
 };
 
+/**
+ * This is an internal class used to record information about a radial basis function expansion.
+ * @private
+ */
+class ExtendedCustomCVForce::RadialBasisFunctionInfo {
+public:
+    std::string name;
+    RadialBasisFunctionType type;
+    double shapeParameter;
+    std::vector<std::string> variables;
+    std::vector<double> centers, weights;
+    RadialBasisFunctionInfo() {
+    }
+    RadialBasisFunctionInfo(const std::string& name, RadialBasisFunctionType type, double shapeParameter,
+                            const std::vector<std::string>& variables, const std::vector<double>& centers,
+                            const std::vector<double>& weights) :
+            name(name), type(type), shapeParameter(shapeParameter), variables(variables), centers(centers), weights(weights) {
+    }
+};
+
+/**
+ * This is an internal class used to record information about a custom summation.
+ * @private
+ */
+class ExtendedCustomCVForce::SummationInfo {
+public:
+    std::string name;
+    CustomSummation* summation;
+    std::vector<std::string> variables;
+    int depositionInterval;
+    std::vector<std::string> depositionParameters;
+    SummationInfo() {
+    }
+    SummationInfo(const std::string& name, CustomSummation* summation, const std::vector<std::string>& variables) :
+            name(name), summation(summation), variables(variables), depositionInterval(0) {
+    }
+};
+
+/**
+ * This is an internal class used to record information about a batch of collective variables.
+ * @private
+ */
+class ExtendedCustomCVForce::BatchInfo {
+public:
+    std::vector<std::string> names;
+    Force* variables;
+    BatchInfo() {
+    }
+    BatchInfo(const std::vector<std::string>& names, Force* variables) : names(names), variables(variables) {
+    }
+};
+
 } // namespace OpenMMLab
 
 #endif /*OPENMMLAB_EXTENDEDCUSTOMCVFORCE_H_*/
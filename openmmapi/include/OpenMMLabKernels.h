@@ -11,18 +11,40 @@
  * https://github.com/craabreu/openmm-lab                                     *
  * -------------------------------------------------------------------------- */
 
+#include "DeviceArray.h"
 #include "ExtendedCustomCVForce.h"
 #include "SlicedNonbondedForce.h"
 
 #include "openmm/KernelImpl.h"
+#include "openmm/OpenMMException.h"
 #include "openmm/Platform.h"
 #include "openmm/System.h"
+#include "openmm/Vec3.h"
+#include "lepton/ParsedExpression.h"
+#include <algorithm>
+#include <cstdlib>
+#include <future>
+#include <map>
+#include <set>
 #include <string>
+#include <vector>
 
 using namespace OpenMM;
 
 namespace OpenMMLab {
 
+/**
+ * Get whether kernels should record the time taken by each stage of their computations.
+ * Profiling is requested by setting the environment variable OPENMMLAB_PROFILING to any
+ * value other than 0 before creating a Context.  It is off by default because the timing
+ * adds events or synchronizations to every evaluation.  An environment variable is used
+ * because a plugin cannot add properties to the platforms of OpenMM.
+ */
+inline bool isProfilingEnabled() {
+    const char* value = std::getenv("OPENMMLAB_PROFILING");
+    return (value != NULL && std::string(value) != "" && std::string(value) != "0");
+}
+
 /**
  * This kernel is invoked by SlicedNonbondedForce to calculate the forces acting on the system and the energy of the system.
  */
@@ -66,6 +88,29 @@ public:
      * @param force      the SlicedNonbondedForce to copy the parameters from
      */
     virtual void copyParametersToContext(ContextImpl& context, const SlicedNonbondedForce& force) = 0;
+    /**
+     * Compute the Coulomb and Lennard-Jones energies of every slice, not multiplied by the
+     * scaling parameters.
+     *
+     * @param context            the context in which to execute this kernel
+     * @param includeDirect      true if direct space interactions should be included
+     * @param includeReciprocal  true if reciprocal space interactions should be included
+     * @param coulombEnergies    on exit, the Coulomb energy of each slice
+     * @param ljEnergies         on exit, the Lennard-Jones energy of each slice
+     */
+    virtual void getSliceEnergies(ContextImpl& context, bool includeDirect, bool includeReciprocal,
+                                  std::vector<double>& coulombEnergies, std::vector<double>& ljEnergies) = 0;
+    /**
+     * Compute the derivatives of the energy with respect to the scaling parameters for which
+     * derivatives were requested.
+     *
+     * @param context            the context in which to execute this kernel
+     * @param includeDirect      true if direct space interactions should be included
+     * @param includeReciprocal  true if reciprocal space interactions should be included
+     * @param derivatives        on exit, the derivative with respect to each parameter
+     */
+    virtual void getScalingParameterDerivatives(ContextImpl& context, bool includeDirect, bool includeReciprocal,
+                                                std::map<std::string, double>& derivatives) = 0;
     /**
      * Get the parameters being used for PME.
      *
@@ -84,6 +129,171 @@ public:
      * @param nz      the number of grid points along the Z axis
      */
     virtual void getLJPMEParameters(double& alpha, int& nx, int& ny, int& nz) const = 0;
+    /**
+     * Describe the device arrays that accumulate the reciprocal space energies of the slices.
+     * Platforms that cannot export their device memory throw an exception.
+     *
+     * @param coulombEnergies   on exit, the array of Coulomb energies
+     * @param ljEnergies        on exit, the array of Lennard-Jones energies
+     * @param slotSlices        on exit, the slice whose energy each column of the arrays holds
+     */
+    virtual void getSliceEnergyArrays(DeviceArray& coulombEnergies, DeviceArray& ljEnergies, std::vector<int>& slotSlices) {
+        throw OpenMMException("SlicedNonbondedForce: device arrays can only be exported by the CUDA platform");
+    }
+    /**
+     * Select a lambda state, which is a foreign set of scaling parameter values whose slice
+     * lambdas the kernel has precomputed, or -1 to follow the scaling parameters of the
+     * context again.  Platforms that do not precompute lambda states throw an exception.
+     *
+     * @param index    the index of the foreign set, or -1
+     */
+    virtual void setLambdaState(int index) {
+        throw OpenMMException("SlicedNonbondedForce: lambda states are only supported by the CUDA platform");
+    }
+    /**
+     * Get the selected lambda state, or -1 if the scaling parameters of the context are used.
+     */
+    virtual int getLambdaState() const {
+        return -1;
+    }
+    /**
+     * Get the time spent in each stage of the computation since the kernel was created or
+     * the times were last reset, in milliseconds.  Stages are only timed if profiling is
+     * enabled (see isProfilingEnabled()) and the platform supports it.  Otherwise, the map
+     * is left empty.
+     *
+     * @param times    on exit, the accumulated time of each stage, keyed by stage name
+     */
+    virtual void getStageTimes(std::map<std::string, double>& times) {
+        times.clear();
+    }
+    /**
+     * Reset the accumulated times of all stages to zero.
+     */
+    virtual void resetStageTimes() {
+    }
+};
+
+/**
+ * Counters of the work done by the kernels of ExtendedCustomCVForce, which are returned by
+ * ExtendedCustomCVForce::getCountersInContext().  See there for their meanings.
+ */
+struct ExtendedCustomCVForceCounters {
+    long long evaluations, copyStates, bytesCopied, innerEvaluations, expressionEvaluations, synchronizations;
+    ExtendedCustomCVForceCounters() {
+        reset();
+    }
+    void reset() {
+        evaluations = copyStates = bytesCopied = innerEvaluations = expressionEvaluations = synchronizations = 0;
+    }
+    void get(std::map<std::string, long long>& counters) const {
+        counters.clear();
+        counters["evaluations"] = evaluations;
+        counters["copyStates"] = copyStates;
+        counters["bytesCopied"] = bytesCopied;
+        counters["innerEvaluations"] = innerEvaluations;
+        counters["expressionEvaluations"] = expressionEvaluations;
+        counters["synchronizations"] = synchronizations;
+    }
+};
+
+/**
+ * The values of the collective variables and the energy of an ExtendedCustomCVForce at its
+ * latest steps, which are returned by ExtendedCustomCVForce::getCollectiveVariableHistory().
+ * It is a ring buffer: once it is full, every new step overwrites the oldest one.  Only the
+ * first evaluation of each step is recorded.
+ */
+struct CollectiveVariableHistory {
+    int capacity, numValues, start, size;
+    long long lastStep;
+    std::vector<long long> steps;
+    std::vector<double> values, energies;
+    CollectiveVariableHistory() : capacity(0), numValues(0), start(0), size(0), lastStep(-1) {
+    }
+    /**
+     * Set the number of steps the history can hold, and the number of values per step.  This
+     * discards the steps recorded so far.
+     */
+    void resize(int capacity, int numValues) {
+        this->capacity = capacity;
+        this->numValues = numValues;
+        steps.resize(capacity);
+        values.resize((long long) capacity*numValues);
+        energies.resize(capacity);
+        start = size = 0;
+    }
+    /**
+     * Get whether a step would be recorded.
+     */
+    bool isDue(long long step) const {
+        return (capacity > 0 && step != lastStep);
+    }
+    /**
+     * Record the values of the collective variables and the energy at a step, if it is due.
+     */
+    void record(long long step, const std::vector<double>& stepValues, double energy) {
+        if (!isDue(step))
+            return;
+        int slot = (start+size)%capacity;
+        if (size == capacity)
+            start = (start+1)%capacity;
+        else
+            size++;
+        steps[slot] = step;
+        std::copy(stepValues.begin(), stepValues.begin()+numValues, values.begin()+(long long) slot*numValues);
+        energies[slot] = energy;
+        lastStep = step;
+    }
+    /**
+     * Copy the recorded steps, from the oldest to the newest, and then remove them.
+     */
+    void take(std::vector<long long>& stepsOut, std::vector<std::vector<double> >& valuesOut, std::vector<double>& energiesOut) {
+        stepsOut.resize(size);
+        valuesOut.resize(size);
+        energiesOut.resize(size);
+        for (int i = 0; i < size; i++) {
+            int slot = (start+i)%capacity;
+            stepsOut[i] = steps[slot];
+            valuesOut[i].assign(values.begin()+(long long) slot*numValues, values.begin()+(long long) (slot+1)*numValues);
+            energiesOut[i] = energies[slot];
+        }
+        start = size = 0;
+    }
+};
+
+/**
+ * The collective variables of an ExtendedCustomCVForce that are evaluated on other platforms
+ * than that of the inner context (see ExtendedCustomCVForce::setCollectiveVariablePlatform()).
+ * ExtendedCustomCVForceImpl evaluates them in a separate thread, which it starts before calling
+ * the kernel.  The kernel skips them in the inner context, and it must call wait() before
+ * reading their values and forces.
+ */
+struct PlacedCollectiveVariables {
+    /**
+     * The index of each placed variable among the collective variables of the force.
+     */
+    std::vector<int> indices;
+    /**
+     * The value of each placed variable.
+     */
+    std::vector<double> values;
+    /**
+     * The forces of each placed variable, indexed by particle.  They are empty if the latest
+     * evaluation did not include forces.
+     */
+    std::vector<std::vector<Vec3> > forces;
+    /**
+     * The evaluation in progress, if any.
+     */
+    std::future<void> pending;
+    /**
+     * Wait for the evaluation in progress, if any, to finish.  An exception thrown by the
+     * evaluation is rethrown here.
+     */
+    void wait() {
+        if (pending.valid())
+            pending.get();
+    }
 };
 
 /**
@@ -102,8 +312,10 @@ public:
      * @param system     the System this kernel will be applied to
      * @param force      the ExtendedCustomCVForce this kernel will be used for
      * @param innerContext   the context created by the ExtendedCustomCVForce for computing collective variables
+     * @param placed     the collective variables evaluated on other platforms, which must outlive the kernel
      */
-    virtual void initialize(const System& system, const ExtendedCustomCVForce& force, ContextImpl& innerContext) = 0;
+    virtual void initialize(const System& system, const ExtendedCustomCVForce& force, ContextImpl& innerContext,
+                            PlacedCollectiveVariables& placed) = 0;
     /**
      * Execute the kernel to calculate the forces and/or energy.
      *
@@ -121,6 +333,17 @@ public:
      * @param innerContext   the context created by the ExtendedCustomCVForce for computing collective variables
      */
     virtual void copyState(ContextImpl& context, ContextImpl& innerContext) = 0;
+    /**
+     * Get the current values of the collective variables.  A variable whose evaluation
+     * interval has not elapsed since the latest call to execute() keeps the value computed
+     * then, which is the one the force is using.  The others are evaluated in a single
+     * energy-only pass over the inner context.
+     *
+     * @param context        the context in which to execute this kernel
+     * @param innerContext   the context created by the ExtendedCustomCVForce for computing collective variables
+     * @param values         on exit, the value of each collective variable
+     */
+    virtual void getCollectiveVariableValues(ContextImpl& context, ContextImpl& innerContext, std::vector<double>& values) = 0;
     /**
      * Copy changed parameters over to a context.
      *
@@ -128,6 +351,151 @@ public:
      * @param force      the ExtendedCustomCVForce to copy the parameters from
      */
     virtual void copyParametersToContext(ContextImpl& context, const ExtendedCustomCVForce& force) = 0;
+    /**
+     * Get the terms this kernel has deposited in a custom summation.
+     *
+     * @param index     the index of the summation
+     * @param terms     on exit, the per-term parameters of each deposited term
+     */
+    virtual void getDepositedTerms(int index, std::vector<std::vector<double> >& terms) = 0;
+    /**
+     * Evaluate the variables that are not placed on other platforms at the current state of
+     * the inner context, regardless of their evaluation intervals.  The values and forces kept
+     * for the outer context are not affected.
+     *
+     * @param innerContext   the context created by the ExtendedCustomCVForce for computing collective variables
+     * @param values         on exit, the value of each variable.  Those of the placed variables are undefined.
+     */
+    virtual void evaluateInnerVariables(ContextImpl& innerContext, std::vector<double>& values) = 0;
+    /**
+     * Get the values of the collective variables and the energies recorded at the latest
+     * steps, from the oldest to the newest, and remove them from the history.
+     *
+     * @param steps      on exit, the step of each record
+     * @param values     on exit, the values of the variables at each step
+     * @param energies   on exit, the energy at each step
+     */
+    virtual void getCollectiveVariableHistory(std::vector<long long>& steps, std::vector<std::vector<double> >& values,
+                                              std::vector<double>& energies) = 0;
+    /**
+     * Get the results that the collective variables keep between evaluations while their
+     * evaluation intervals have not elapsed.
+     *
+     * @param steps         on exit, the step at which each variable was last evaluated, or -1
+     *                      if it keeps no results
+     * @param values        on exit, the value of each variable
+     * @param derivatives   on exit, the derivatives of each variable with respect to the global
+     *                      parameters of the inner context
+     */
+    virtual void getCollectiveVariableCache(std::vector<long long>& steps, std::vector<double>& values,
+                                            std::vector<std::vector<double> >& derivatives) {
+        steps.clear();
+        values.clear();
+        derivatives.clear();
+    }
+    /**
+     * Replace the results that the collective variables keep between evaluations, such as
+     * those returned by getCollectiveVariableCache() for another context of the same System.
+     * Forces are not transferred, so a variable whose forces are needed is evaluated again.
+     * Platforms that cannot keep a value without its forces discard all results instead.
+     *
+     * @param steps         the step at which each variable was evaluated, or -1 for a variable
+     *                      with no results.  If empty, all results are discarded.
+     * @param values        the value of each variable
+     * @param derivatives   the derivatives of each variable with respect to the global parameters
+     *                      of the inner context
+     */
+    virtual void setCollectiveVariableCache(const std::vector<long long>& steps, const std::vector<double>& values,
+                                            const std::vector<std::vector<double> >& derivatives) = 0;
+    /**
+     * Get the counters of the work done by this kernel since it was created or the counters
+     * were last reset.
+     *
+     * @param counters    on exit, the value of each counter, keyed by counter name
+     */
+    virtual void getCounters(std::map<std::string, long long>& counters) {
+        counters.clear();
+    }
+    /**
+     * Reset all counters to zero.
+     */
+    virtual void resetCounters() {
+    }
+    /**
+     * Describe the device arrays that hold the forces of the collective variables.  Platforms
+     * that cannot export their device memory throw an exception.
+     *
+     * @param forces        on exit, the forces of the collective variables stored densely
+     * @param atomIndices   on exit, the index of the atom at each position of the forces
+     * @param variables     on exit, the index of the collective variable of each row of forces
+     */
+    virtual void getForceArrays(DeviceArray& forces, DeviceArray& atomIndices, std::vector<int>& variables) {
+        throw OpenMMException("ExtendedCustomCVForce: device arrays can only be exported by the CUDA platform");
+    }
+    /**
+     * Get the time spent in each stage of the computation since the kernel was created or
+     * the times were last reset, in milliseconds.  Stages are only timed if profiling is
+     * enabled (see isProfilingEnabled()) and the platform supports it.  Otherwise, the map
+     * is left empty.
+     *
+     * @param times    on exit, the accumulated time of each stage, keyed by stage name
+     */
+    virtual void getStageTimes(std::map<std::string, double>& times) {
+        times.clear();
+    }
+    /**
+     * Reset the accumulated times of all stages to zero.
+     */
+    virtual void resetStageTimes() {
+    }
+};
+
+/**
+ * This kernel is invoked by the "Kernel" backend of CustomSummation to evaluate the
+ * summation and its gradient at a set of points.
+ */
+class CalcCustomSummationKernel : public KernelImpl {
+public:
+    static std::string Name() {
+        return "CalcCustomSummation";
+    }
+    CalcCustomSummationKernel(std::string name, const Platform& platform) : KernelImpl(name, platform) {
+    }
+    /**
+     * Initialize the kernel.
+     *
+     * @param numArgs              the number of arguments of the summation
+     * @param expression           the expression of each term, with point functions already
+     *                             expanded (see CustomSummationImpl::parseExpression())
+     * @param overallParameters    the names and initial values of the overall parameters
+     * @param perTermParameters    the names of the per-term parameters
+     * @param deterministic        whether the terms must be summed in fixed point, so that
+     *                             the results do not depend on the order of the additions
+     */
+    virtual void initialize(int numArgs, const Lepton::ParsedExpression& expression, const std::map<std::string, double>& overallParameters,
+                            const std::vector<std::string>& perTermParameters, bool deterministic) = 0;
+    /**
+     * Update the terms of the summation.
+     *
+     * @param parameters      the parameters of all terms
+     * @param modifiedTerms   the indices of the terms that have been added or modified
+     *                        since the last update
+     */
+    virtual void setTerms(const std::vector<std::vector<double> >& parameters, const std::set<int>& modifiedTerms) = 0;
+    /**
+     * Set the value of an overall parameter.
+     */
+    virtual void setParameter(const std::string& name, double value) = 0;
+    /**
+     * Evaluate the summation at a set of points.
+     *
+     * @param arguments    the arguments of all points, stored consecutively
+     * @param numPoints    the number of points
+     * @param values       on exit, the value of the summation at each point
+     * @param gradients    on exit, the gradient of the summation at each point, stored
+     *                     consecutively.  If NULL, gradients are not computed.
+     */
+    virtual void evaluate(const double* arguments, int numPoints, double* values, double* gradients) = 0;
 };
 
 } // namespace OpenMMLab
@@ -0,0 +1,136 @@
+#ifndef OPENMMLAB_RADIALBASISFUNCTIONFITTER_H_
+#define OPENMMLAB_RADIALBASISFUNCTIONFITTER_H_
+
+/* -------------------------------------------------------------------------- *
+ *                             OpenMM Laboratory                              *
+ *                             =================                              *
+ *                                                                            *
+ * A plugin for testing low-level code implementation for OpenMM.             *
+ *                                                                            *
+ * Copyright (c) 2023 Charlles Abreu                                          *
+ * https://github.com/craabreu/openmm-lab                                     *
+ * -------------------------------------------------------------------------- */
+
+#include "ExtendedCustomCVForce.h"
+#include "internal/windowsExportOpenMMLab.h"
+
+#include <string>
+#include <vector>
+
+using namespace std;
+
+namespace OpenMMLab {
+
+/**
+ * This class fits the weights of a Gaussian radial basis function expansion, as defined by
+ * ExtendedCustomCVForce::addRadialBasisFunction(), so that it interpolates the values given
+ * at its centers. The weights solve (K + lambda*I)*w = y, where K is the matrix of the basis
+ * functions of every center evaluated at every other center and lambda is an optional
+ * regularization, which smooths noisy values and keeps the system well conditioned when
+ * centers are close to each other.
+ *
+ * Since K is positive definite for Gaussians, the system is solved through the Cholesky
+ * factorization K + lambda*I = L*L^T. Adding a center only appends a row to L and an entry
+ * to the solution of L*z = y, after which the weights are obtained by back substitution,
+ * so that refining a surrogate with n centers costs O(n^2) per center instead of the O(n^3)
+ * of solving the whole system again. Changing the value at a center is also O(n^2).
+ *
+ * Once fitted, the expansion is copied to an ExtendedCustomCVForce with
+ * addRadialBasisFunction() or updateRadialBasisFunction(). In the latter case, calling
+ * ExtendedCustomCVForce::updateParametersInContext() uploads the new centers and weights
+ * to the arrays the platform already holds, without reinitializing the Context.
+ */
+
+class OPENMM_EXPORT_OPENMM_LAB RadialBasisFunctionFitter {
+public:
+    /**
+     * Create a fitter with no centers.
+     *
+     * @param numVariables      the number of variables the expansion depends on
+     * @param shapeParameter    the shape parameter e of the Gaussians exp(-e^2*|v-c_k|^2)
+     * @param regularization    the value lambda added to the diagonal of the kernel matrix
+     */
+    RadialBasisFunctionFitter(int numVariables, double shapeParameter, double regularization = 0.0);
+    /**
+     * Get the number of variables the expansion depends on.
+     */
+    int getNumVariables() const { return numVariables; }
+    /**
+     * Get the shape parameter of the Gaussians.
+     */
+    double getShapeParameter() const { return shapeParameter; }
+    /**
+     * Get the value added to the diagonal of the kernel matrix.
+     */
+    double getRegularization() const { return regularization; }
+    /**
+     * Get the number of centers that have been added.
+     */
+    int getNumCenters() const { return values.size(); }
+    /**
+     * Add a center and the value the expansion must take at it, and update the weights.
+     * An exception is thrown if the kernel matrix becomes numerically singular, which
+     * happens when the new center nearly coincides with an existing one and there is no
+     * regularization.
+     *
+     * @param center    the coordinates of the center
+     * @param value     the value at the center
+     * @return the index of the center that was added
+     */
+    int addCenter(const vector<double> &center, double value);
+    /**
+     * Change the value at a center, and update the weights.
+     *
+     * @param index    the index of the center
+     * @param value    the new value at the center
+     */
+    void setValue(int index, double value);
+    /**
+     * Get the coordinates of the centers, stored as a flattened array of length
+     * getNumCenters()*getNumVariables().
+     */
+    const vector<double> &getCenters() const { return centers; }
+    /**
+     * Get the values at the centers.
+     */
+    const vector<double> &getValues() const { return values; }
+    /**
+     * Get the fitted weights of the basis functions.
+     */
+    const vector<double> &getWeights() const { return weights; }
+    /**
+     * Evaluate the fitted expansion at a point.
+     *
+     * @param point    the coordinates of the point
+     */
+    double evaluate(const vector<double> &point) const;
+    /**
+     * Add the fitted expansion to an ExtendedCustomCVForce.
+     *
+     * @param force        the force to which the expansion is added
+     * @param name         the name of the expansion as it appears in expressions
+     * @param variables    the names of the collective variables of the expansion
+     * @return the index of the expansion in the force
+     */
+    int addRadialBasisFunction(ExtendedCustomCVForce &force, const string &name, const vector<string> &variables) const;
+    /**
+     * Replace the centers and weights of an expansion of an ExtendedCustomCVForce with the
+     * fitted ones. Call ExtendedCustomCVForce::updateParametersInContext() afterward to
+     * copy them to a Context.
+     *
+     * @param force    the force that contains the expansion
+     * @param index    the index of the expansion in the force
+     */
+    void updateRadialBasisFunction(ExtendedCustomCVForce &force, int index) const;
+private:
+    double computeKernel(int center, const double *point) const;
+    void solveWeights(int firstChanged);
+    int numVariables;
+    double shapeParameter, regularization;
+    vector<double> centers, values, weights;
+    vector<double> factor, z;
+};
+
+} // namespace OpenMMLab
+
+#endif /*OPENMMLAB_RADIALBASISFUNCTIONFITTER_H_*/
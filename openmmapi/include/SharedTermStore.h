@@ -0,0 +1,99 @@
+#ifndef OPENMMLAB_SHAREDTERMSTORE_H_
+#define OPENMMLAB_SHAREDTERMSTORE_H_
+
+/* -------------------------------------------------------------------------- *
+ *                             OpenMM Laboratory                              *
+ *                             =================                              *
+ *                                                                            *
+ * A plugin for testing low-level code implementation for OpenMM.             *
+ *                                                                            *
+ * Copyright (c) 2023 Charlles Abreu                                          *
+ * https://github.com/craabreu/openmm-lab                                     *
+ * -------------------------------------------------------------------------- */
+
+#include "CustomSummation.h"
+#include "internal/windowsExportOpenMMLab.h"
+
+#include <cstdio>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+namespace OpenMMLab {
+
+/**
+ * This class stores the terms of a CustomSummation in a file that several processes can
+ * share, such as the walkers of a multiple-walker metadynamics simulation running on the
+ * same node. Every walker opens the same file, appends the terms it deposits, and
+ * periodically calls synchronize() to add to its own summation the terms that have been
+ * appended by all walkers, including itself.
+ *
+ * The store is append-only. Its version is the number of complete terms in the file,
+ * and every object remembers the version up to which it has synchronized its summation,
+ * so that each synchronization only reads and uploads the terms that are new since the
+ * previous one.
+ *
+ * Each term is appended with a single write of fixed size to a file opened in append
+ * mode, which local file systems carry out atomically. A term that is still being
+ * written is ignored until it is complete.
+ */
+
+class OPENMM_EXPORT_OPENMM_LAB SharedTermStore {
+public:
+    /**
+     * Open a store, creating the file if it does not exist yet.
+     *
+     * @param path             the path of the file
+     * @param numParameters    the number of per-term parameters, which must agree with
+     *                         that of an existing file
+     */
+    SharedTermStore(const string &path, int numParameters);
+    ~SharedTermStore();
+    /**
+     * Get the path of the file.
+     */
+    const string &getPath() const { return path; }
+    /**
+     * Get the number of per-term parameters.
+     */
+    int getNumParameters() const { return numParameters; }
+    /**
+     * Append a term to the store. It will be added to the summations of all processes
+     * when they next synchronize them.
+     *
+     * @param parameters    the parameters of the term
+     */
+    void append(const vector<double> &parameters);
+    /**
+     * Get the current version of the store, which is the number of complete terms it
+     * contains.
+     */
+    int getVersion();
+    /**
+     * Get the version up to which the summation has been synchronized.
+     */
+    int getSynchronizedVersion() const { return synchronizedVersion; }
+    /**
+     * Add to a summation the terms that have been appended to the store since the
+     * previous synchronization, and update the summation. The same summation must be
+     * passed to every call, since the terms that have already been added are not
+     * added again.
+     *
+     * @param summation    the summation to which the terms are added
+     * @return             the number of terms that have been added
+     */
+    int synchronize(CustomSummation &summation);
+private:
+    void readHeader();
+    string path;
+    int numParameters;
+    FILE *writer, *reader;
+    bool hasHeader;
+    int synchronizedVersion;
+    vector<double> buffer;
+};
+
+} // namespace OpenMMLab
+
+#endif /*OPENMMLAB_SHAREDTERMSTORE_H_*/
@@ -11,6 +11,7 @@
  * https://github.com/craabreu/openmm-lab                                     *
  * -------------------------------------------------------------------------- */
 
+#include "DeviceArray.h"
 #include "internal/windowsExportOpenMMLab.h"
 #include "openmm/NonbondedForce.h"
 #include "openmm/internal/AssertionUtilities.h"
@@ -30,6 +31,189 @@ public:
     void getPMEParametersInContext(const Context& context, double& alpha, int& nx, int& ny, int& nz) const;
     void getLJPMEParametersInContext(const Context& context, double& alpha, int& nx, int& ny, int& nz) const;
     void updateParametersInContext(Context& context);
+    /**
+     * Compute the Coulomb and Lennard-Jones energies of every slice for the current state of a
+     * Context, not multiplied by the scaling parameters.  Since the energy of this force is
+     * linear in the scaling parameters, these are all that is needed to evaluate it for any
+     * other set of parameter values, e.g. for reweighting a trajectory over a lambda window.
+     * The energy of the force is the sum of coulombEnergies[k]*lambdaCoulomb[k] +
+     * ljEnergies[k]*lambdaLJ[k] over all slices k, where each lambda is either the value of a
+     * scaling parameter or 1 if no scaling parameter applies to the slice.
+     *
+     * Self energies and dispersion corrections are included in the slices they belong to.
+     * On the Reference platform all slices are computed in a single pass.  On other platforms
+     * each slice takes one energy evaluation of the force groups of this force, except that
+     * reciprocal space slice energies are read in a single pass if they belong to a separate
+     * force group (see setReciprocalSpaceForceGroup()) and, except on the CUDA platform,
+     * there are no parameter offsets.  On the CUDA and OpenCL platforms, the reciprocal space
+     * energies of all slices without a scaling parameter are reported together, as part of the
+     * first of these slices.
+     *
+     * @param context          the Context in which to compute the energies
+     * @param coulombEnergies  on exit, the Coulomb energy of each slice
+     * @param ljEnergies       on exit, the Lennard-Jones energy of each slice
+     */
+    void getSliceEnergiesInContext(Context& context, vector<double>& coulombEnergies, vector<double>& ljEnergies);
+    /**
+     * Add a foreign set of scaling parameter values, at which getForeignEnergiesInContext()
+     * evaluates the energy of this force.  This serves, for instance, to compute the energies
+     * of all lambda windows of an expanded ensemble or MBAR analysis at every step.
+     *
+     * @param values  the values of some scaling parameters, indexed by name.  Scaling
+     *                parameters that are not in the set keep their current values in the
+     *                Context
+     * @return the index of the set that was added
+     */
+    int addForeignScalingParameterSet(const map<string, double>& values);
+    /**
+     * Get the number of foreign sets of scaling parameter values.
+     */
+    int getNumForeignScalingParameterSets() const {
+        return foreignScalingParameterSets.size();
+    }
+    /**
+     * Get a foreign set of scaling parameter values.
+     *
+     * @param index  the index of the set, between 0 and getNumForeignScalingParameterSets()
+     */
+    const map<string, double>& getForeignScalingParameterSet(int index) const;
+    /**
+     * Replace a foreign set of scaling parameter values.
+     *
+     * @param index   the index of the set, between 0 and getNumForeignScalingParameterSets()
+     * @param values  the values of some scaling parameters, indexed by name
+     */
+    void setForeignScalingParameterSet(int index, const map<string, double>& values);
+    /**
+     * Compute the energy of this force at each foreign set of scaling parameter values, for
+     * the current state of a Context.  The slice energies are computed once, as in
+     * getSliceEnergiesInContext(), and every foreign energy is obtained from them, so that
+     * the cost hardly depends on the number of sets.  The sets can be changed at any time,
+     * without reinitializing the Context.  This is not available if some slice uses a
+     * soft-core potential, whose energy is not linear in its scaling parameter.
+     *
+     * @param context   the Context in which to compute the energies
+     * @param energies  on exit, the energy at each foreign set of scaling parameter values
+     */
+    void getForeignEnergiesInContext(Context& context, vector<double>& energies);
+    /**
+     * Compute the foreign energies of several replicas of the same System, which differ only
+     * in their positions, using a single Context.  This gives the whole energy matrix of a
+     * Hamiltonian replica exchange simulation, with the foreign sets being the scaling
+     * parameter values of the replicas, without creating a Context for each replica.  This
+     * is a convenience loop that calls getForeignEnergiesInContext() once per replica, with
+     * no batching on the device.  The positions of the Context are restored afterward, also
+     * if an evaluation fails.  The box vectors of the Context are used for all replicas.
+     *
+     * @param context    the Context in which to compute the energies
+     * @param positions  the positions of the particles in each replica
+     * @param energies   on exit, energies[r][k] is the energy of replica r at foreign set k
+     */
+    void getReplicaEnergiesInContext(Context& context, const vector<vector<Vec3>>& positions, vector<vector<double>>& energies);
+    /**
+     * Compute the reduced energies of this force at every foreign set of scaling parameter
+     * values for a batch of frames, such as those of a saved trajectory to be analyzed with
+     * MBAR.  This is a convenience loop that calls getForeignEnergiesInContext() once per
+     * frame, with no batching on the device, so each frame costs the same regardless of the
+     * number of sets, and no parameter of the Context is changed.  The positions and box
+     * vectors of the Context are restored afterward, also if an evaluation fails.  The energies of the other forces of
+     * the System do not depend on the scaling parameters, so they shift the reduced energies
+     * of each frame by the same amount at every set, which does not change MBAR estimates.
+     *
+     * @param context          the Context in which to compute the energies
+     * @param frames           the positions of the particles at each frame
+     * @param boxVectors       the three periodic box vectors at each frame, or an empty vector
+     *                         to use those of the Context at all frames
+     * @param temperature      the temperature, in Kelvin, at which the energies are reduced
+     * @param reducedEnergies  on exit, reducedEnergies[k][n] is the energy of frame n at
+     *                         foreign set k divided by kT
+     */
+    void getReducedForeignEnergiesInContext(Context& context, const vector<vector<Vec3>>& frames, const vector<vector<Vec3>>& boxVectors,
+                                            double temperature, vector<vector<double>>& reducedEnergies);
+    /**
+     * Make a Context evaluate this force at one of the foreign sets of scaling parameter
+     * values, which then serves as a lambda state.  The lambdas of all slices are precomputed
+     * for every set and kept in device memory, so that switching states, as Hamiltonian
+     * replica exchange does at every exchange attempt, neither looks up parameters nor copies
+     * anything from the host.  Scaling parameters that are not in a set take their default
+     * values.
+     *
+     * While a state is selected, this force ignores the values of the scaling parameters in
+     * the Context, and selecting -1 makes it follow them again.  The states are precomputed
+     * when the Context is created and whenever updateParametersInContext() is called, so
+     * changes to the foreign sets only take effect then.  This is currently only supported
+     * by the CUDA platform.
+     *
+     * @param context  the Context in which to select the state
+     * @param index    the index of the foreign set, between 0 and getNumForeignScalingParameterSets(),
+     *                 or -1 to use the scaling parameters of the Context
+     */
+    void setLambdaStateInContext(Context& context, int index);
+    /**
+     * Get the lambda state selected in a Context by setLambdaStateInContext(), or -1 if
+     * this force uses the scaling parameters of the Context.
+     *
+     * @param context  the Context in which the force is evaluated
+     */
+    int getLambdaStateInContext(Context& context);
+    /**
+     * Compute the derivatives of the energy of this force with respect to the scaling
+     * parameters for which derivatives were requested (see addScalingParameterDerivative()),
+     * for the current state of a Context.  This is cheaper than a full evaluation, as needed
+     * for thermodynamic integration: on the CUDA and OpenCL platforms, only the slices that
+     * have a requested derivative are switched on, so the direct space kernels skip the pairs
+     * of all other slices, although reciprocal space is still computed in full.  On those
+     * platforms, derivatives with respect to the same parameters from other forces in the
+     * same force groups are included as well.
+     *
+     * @param context  the Context in which to compute the derivatives
+     * @return the derivative with respect to each parameter, indexed by name
+     */
+    map<string, double> getScalingParameterDerivativesInContext(Context& context);
+    /**
+     * Get the time spent in each stage of the computation of this force in a Context, in
+     * milliseconds, accumulated since the Context was created or the times were last reset.
+     * On the CUDA platform the stages are timed by the GPU itself, so they do not include the
+     * time of launching the kernels.  On the OpenCL platform they are timed on the host, which
+     * waits for the queue at the start and the end of every stage.  Profiling must be enabled
+     * by setting the environment variable OPENMMLAB_PROFILING to 1 before the Context is
+     * created, and is currently supported by the CUDA and OpenCL platforms.  On every platform, profiling also reports the time taken to
+     * initialize the kernel when the Context was created ("init:kernel").  On the CUDA
+     * platform, the creation of the FFT plans ("init:fft") and the computation of the
+     * dispersion correction ("init:dispersionCorrection"), which runs concurrently with
+     * the rest of the initialization, are reported separately, as is the compilation of
+     * the reciprocal space kernels in the first evaluation ("init:reciprocalKernels").
+     * Otherwise, the returned map is empty.
+     *
+     * @param context   the Context in which the force is evaluated
+     * @return the accumulated time of each stage, keyed by stage name
+     */
+    map<string, double> getStageTimesInContext(Context& context);
+    /**
+     * Reset the accumulated times returned by getStageTimesInContext() to zero.
+     *
+     * @param context   the Context in which the force is evaluated
+     */
+    void resetStageTimesInContext(Context& context);
+    /**
+     * Get the device arrays in which the reciprocal space energies of the slices are
+     * accumulated in a Context, so that other libraries, such as PyTorch or JAX, can read
+     * them in place.  This is only supported by the CUDA platform, and only with the PME and
+     * LJPME methods.  Otherwise, or for a term that is not computed in reciprocal space, the
+     * pointer of the array is 0.
+     *
+     * Each array holds partial sums in a shape (number of partial sums, slotSlices.size()).
+     * Summing over the first dimension gives the energy of slice slotSlices[k] in column k, not
+     * multiplied by its scaling parameters.  The self energies are not included.  The arrays
+     * are filled when the force group of reciprocal space is evaluated, and hold the energies
+     * of the latest such evaluation in which energies were requested.
+     *
+     * @param context           the Context in which the force is evaluated
+     * @param coulombEnergies   on exit, the array of Coulomb energies
+     * @param ljEnergies        on exit, the array of Lennard-Jones energies
+     * @param slotSlices        on exit, the slice whose energies each column holds
+     */
+    void getDeviceArraysInContext(Context& context, DeviceArray& coulombEnergies, DeviceArray& ljEnergies, vector<int>& slotSlices);
     string getNonbondedMethodName() const;
     int getNumSubsets() const {
         return numSubsets;
@@ -45,18 +229,168 @@ public:
     }
     void setParticleSubset(int index, int subset);
     int getParticleSubset(int index) const;
+    void setParticleSubsets(const vector<int>& subsets);
+    vector<int> getParticleSubsets() const;
+    /**
+     * Add offsets of the same global parameter to the parameters of many particles at once.
+     * This is equivalent to calling addParticleParameterOffset() for each particle.
+     *
+     * @param parameter      the name of the global parameter
+     * @param particles      the index of each particle whose parameters are affected
+     * @param chargeScales   the scale of the charge offset of each particle
+     * @param sigmaScales    the scale of the sigma offset of each particle
+     * @param epsilonScales  the scale of the epsilon offset of each particle
+     * @return the index of the first offset that was added.  The others follow it in order
+     */
+    int addParticleParameterOffsets(const string& parameter, const vector<int>& particles, const vector<double>& chargeScales,
+                                    const vector<double>& sigmaScales, const vector<double>& epsilonScales);
     int addScalingParameter(const string& parameter, int subset1, int subset2, bool includeCoulomb, bool includeLJ);
     void getScalingParameter(int index, string& parameter, int& subset1, int& subset2, bool& includeCoulomb, bool& includeLJ) const;
     void setScalingParameter(int index, const string& parameter, int subset1, int subset2, bool includeCoulomb, bool includeLJ);
     int addScalingParameterDerivative(const string& parameter);
     const string& getScalingParameterDerivativeName(int index) const;
     void setScalingParameterDerivative(int index, const string& parameter);
+    /**
+     * Set the soft-core parameters of the Lennard-Jones interactions between two subsets.  In a
+     * soft-core slice, the Lennard-Jones energy of a pair of particles is
+     * lambda*4*epsilon*(1/s^2 - 1/s), with s = alpha*(1-lambda)^power + (r/sigma)^6, where
+     * lambda is the Lennard-Jones scaling parameter of the slice.  This is the regular
+     * potential when lambda is 1, but remains finite at r = 0 when lambda is smaller.  Since
+     * the energy is no longer linear in lambda, getSliceEnergiesInContext() reports the
+     * Lennard-Jones energy of a soft-core slice at lambda = 1.  The Coulomb interactions, the
+     * exceptions and the dispersion correction are not affected, and soft-core slices cannot
+     * be used with LJPME.
+     *
+     * The parameters are compiled into the kernels, so changing them requires the Context to
+     * be reinitialized.  Slices without soft-core interactions, which are the default, are
+     * computed exactly as before.
+     *
+     * @param subset1  the index of a particle subset
+     * @param subset2  the index of a particle subset, which may be equal to subset1
+     * @param alpha    the soft-core coefficient, which must not be negative.  A value of zero
+     *                 switches the soft-core potential off
+     * @param power    the exponent of (1-lambda), which must be at least 1
+     */
+    void setSliceSoftCoreParameters(int subset1, int subset2, double alpha, double power);
+    /**
+     * Get the soft-core parameters of the Lennard-Jones interactions between two subsets.
+     *
+     * @param subset1  the index of a particle subset
+     * @param subset2  the index of a particle subset, which may be equal to subset1
+     * @param alpha    the soft-core coefficient, which is zero if the slice uses the regular
+     *                 potential
+     * @param power    the exponent of (1-lambda)
+     */
+    void getSliceSoftCoreParameters(int subset1, int subset2, double& alpha, double& power) const;
+    /**
+     * Get the order of the B-spline interpolation between the particles and the PME grids,
+     * which is used for both PME and LJPME.
+     */
+    int getPMEInterpolationOrder() const {
+        return pmeOrder;
+    }
+    /**
+     * Set the order of the B-spline interpolation between the particles and the PME grids,
+     * which is used for both PME and LJPME.  The default order is 5.  A lower order with a
+     * finer grid, or a higher order with a coarser grid, can reach the same accuracy at a
+     * different cost.  The grid dimensions derived from the Ewald error tolerance assume
+     * order 5, so they should be set with setPMEParameters() and setLJPMEParameters() when
+     * the order is changed.
+     *
+     * @param order  the interpolation order, which must be 4, 5 or 6
+     */
+    void setPMEInterpolationOrder(int order);
+    /**
+     * Get whether any slice uses a soft-core Lennard-Jones potential.
+     */
+    bool getUseSoftCore() const;
     bool getUseCudaFFT() const {
         return useCudaFFT;
     };
     void setUseCuFFT(bool use) {
         useCudaFFT = use;
     };
+    bool getUseFFTAutotuning() const {
+        return useFFTAutotuning;
+    };
+    void setUseFFTAutotuning(bool use) {
+        useFFTAutotuning = use;
+    };
+    bool getUseTunedPmeGridSizes() const {
+        return useTunedPmeGridSizes;
+    };
+    void setUseTunedPmeGridSizes(bool use) {
+        useTunedPmeGridSizes = use;
+    };
+    bool getUseFFTConvolution() const {
+        return useFFTConvolution;
+    };
+    void setUseFFTConvolution(bool use) {
+        useFFTConvolution = use;
+    };
+    bool getUseSinglePrecisionPmeGrids() const {
+        return useSinglePrecisionPmeGrids;
+    };
+    void setUseSinglePrecisionPmeGrids(bool use) {
+        useSinglePrecisionPmeGrids = use;
+    };
+    bool getUseCudaGraphs() const {
+        return useCudaGraphs;
+    };
+    void setUseCudaGraphs(bool use) {
+        useCudaGraphs = use;
+    };
+    bool getUseSortFreePme() const {
+        return useSortFreePme;
+    };
+    void setUseSortFreePme(bool use) {
+        useSortFreePme = use;
+    };
+    bool getUseCpuPme() const {
+        return useCpuPme;
+    };
+    void setUseCpuPme(bool use) {
+        useCpuPme = use;
+    };
+    /**
+     * Get whether the derivatives with respect to the scaling parameters are only computed
+     * on evaluations that also compute the energy, when executing in the CUDA platform.
+     */
+    bool getUseDerivativesOnDemand() const {
+        return useDerivativesOnDemand;
+    };
+    /**
+     * Set whether the derivatives with respect to the scaling parameters are only computed
+     * on evaluations that also compute the energy, such as getState() with State::Energy or
+     * getScalingParameterDerivativesInContext(), when executing in the CUDA platform.  By
+     * default, as in OpenMM, they are accumulated at every evaluation, which keeps the pairs
+     * of switched-off slices in the direct space kernel and runs the reciprocal space energy
+     * kernels at every step.  Enable this when the derivatives are only read occasionally,
+     * but not when an integrator uses them in steps that do not compute the energy.
+     */
+    void setUseDerivativesOnDemand(bool use) {
+        useDerivativesOnDemand = use;
+    };
+    /**
+     * Get whether the direct space kernel reads the particle parameters in a compact form
+     * when executing in the CUDA platform.
+     */
+    bool getUseCompactParameters() const {
+        return useCompactParameters;
+    };
+    /**
+     * Set whether the direct space kernel reads the particle parameters in a compact form
+     * when executing in the CUDA platform with single or mixed precision.  The values of
+     * sigma and epsilon derived for each particle are then stored as a pair of half precision
+     * numbers, and the subset of each particle in the lowest bits of its charge, so that every
+     * particle takes 8 bytes rather than 16.  This speeds up large systems, in which the kernel
+     * is limited by memory bandwidth, at the cost of a relative error of about 1e-3 in the
+     * Lennard-Jones interactions.  The exceptions and the reciprocal space are not affected.
+     * This choice has no effect in double precision or when using other platforms.
+     */
+    void setUseCompactParameters(bool use) {
+        useCompactParameters = use;
+    };
 protected:
     ForceImpl* createImpl() const;
 private:
@@ -64,10 +398,14 @@ private:
     int getScalingParameterIndex(const string& parameter) const;
     class ScalingParameterInfo;
     int numSubsets;
-    map<int, int> subsets;
+    vector<int> subsets;
     vector<ScalingParameterInfo> scalingParameters;
     vector<int> scalingParameterDerivatives;
-    bool useCudaFFT;
+    vector<double> softCoreAlphas, softCorePowers;
+    vector<map<string, double>> foreignScalingParameterSets;
+    int pmeOrder;
+    bool useCudaFFT, useFFTAutotuning, useTunedPmeGridSizes, useFFTConvolution, useSinglePrecisionPmeGrids, useCudaGraphs, useSortFreePme, useCpuPme, useDerivativesOnDemand,
+         useCompactParameters;
 };
 
 /**
@@ -0,0 +1,101 @@
+#ifndef OPENMMLAB_AUTOCUSTOMSUMMATIONIMPL_H_
+#define OPENMMLAB_AUTOCUSTOMSUMMATIONIMPL_H_
+
+/* -------------------------------------------------------------------------- *
+ *                             OpenMM Laboratory                              *
+ *                             =================                              *
+ *                                                                            *
+ * A plugin for testing low-level code implementation for OpenMM.             *
+ *                                                                            *
+ * Copyright (c) 2023 Charlles Abreu                                          *
+ * https://github.com/craabreu/openmm-lab                                     *
+ * -------------------------------------------------------------------------- */
+
+#include "internal/CustomSummationImpl.h"
+#include "openmm/Platform.h"
+
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+#include <vector>
+
+using namespace OpenMM;
+using namespace std;
+
+namespace OpenMMLab {
+
+/**
+ * This backend delegates the evaluation of a CustomSummation to either the native
+ * backend or a device backend of the specified platform, which is the Kernel backend
+ * if the platform supports it and the Context backend otherwise, and picks the faster
+ * of the two as the number of terms changes.
+ *
+ * Summations with fewer than minDeviceTerms terms are always evaluated natively, and
+ * the device backend is only created once this number is reached. From then on, both
+ * backends are timed whenever an update leaves the number of terms twice as large, or
+ * half as large, as it was in the latest timing, and the faster one is used until the
+ * next timing. Only the backend in use is updated right away. The other one collects
+ * the indices of the modified terms and catches up when it is timed again.
+ *
+ * Terms with their own points are not supported by the Kernel backend, so the device
+ * backend is then always the Context backend.
+ */
+
+class AutoCustomSummationImpl : public CustomSummationImpl {
+public:
+    AutoCustomSummationImpl(
+        int numArgs,
+        string expression,
+        map<string, double> overallParameters,
+        vector<string> perTermParameters,
+        Platform &platform,
+        map<string, string> platformProperties,
+        const string &precision,
+        bool deterministic,
+        int pointsPerTerm = 0
+    );
+    void evaluateBatch(const double *arguments, int numPoints, double *values, double *gradients);
+    void evaluateHessianProduct(const vector<double> &arguments, const vector<double> &direction, vector<double> &product);
+    void evaluateHessianDiagonal(const vector<double> &arguments, vector<double> &diagonal);
+    void update(const vector<vector<double>> &parameters, const set<int> &modifiedTerms);
+    void setParameter(const string &name, double value);
+    void setCompactSupport(const vector<int> &centerParameters, int radiusParameter);
+    void setGaussianSupport(const vector<int> &centerParameters, int widthParameter, int heightParameter, double tolerance);
+    void setGrid(const vector<double> &minValues, const vector<double> &maxValues, const vector<int> &numPoints);
+    static const int minDeviceTerms = 1024;
+protected:
+    void setArguments(const double *arguments);
+    double computeValue();
+    void computeDerivatives(vector<double> &derivatives);
+    double computeValueAndDerivatives(vector<double> &derivatives);
+private:
+    struct Backend {
+        unique_ptr<CustomSummationImpl> impl;
+        set<int> pendingTerms;
+    };
+    void createDevice();
+    void synchronize(Backend &backend);
+    double timeEvaluation(CustomSummationImpl &impl);
+    void selectBackend();
+    string expression;
+    map<string, double> overallParameters;
+    vector<string> perTermParameters;
+    Platform *platform;
+    map<string, string> platformProperties;
+    bool useVectors, deterministic;
+    Backend nativeBackend, deviceBackend;
+    CustomSummationImpl *active;
+    vector<vector<double>> termParameters;
+    int timedTerms;
+    vector<double> arguments;
+    vector<int> supportCenters;
+    int supportRadius, supportWidth, supportHeight;
+    double supportTolerance;
+    vector<double> gridMinValues, gridMaxValues;
+    vector<int> gridPoints;
+};
+
+} // namespace OpenMMLab
+
+#endif /*OPENMMLAB_AUTOCUSTOMSUMMATIONIMPL_H_*/
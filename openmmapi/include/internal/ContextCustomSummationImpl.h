@@ -0,0 +1,81 @@
+#ifndef OPENMMLAB_CONTEXTCUSTOMSUMMATIONIMPL_H_
+#define OPENMMLAB_CONTEXTCUSTOMSUMMATIONIMPL_H_
+
+/* -------------------------------------------------------------------------- *
+ *                             OpenMM Laboratory                              *
+ *                             =================                              *
+ *                                                                            *
+ * A plugin for testing low-level code implementation for OpenMM.             *
+ *                                                                            *
+ * Copyright (c) 2023 Charlles Abreu                                          *
+ * https://github.com/craabreu/openmm-lab                                     *
+ * -------------------------------------------------------------------------- */
+
+#include "internal/CustomSummationImpl.h"
+#include "openmm/Context.h"
+#include "openmm/CustomCompoundBondForce.h"
+#include "openmm/Platform.h"
+#include "openmm/internal/ContextImpl.h"
+
+#include <map>
+#include <string>
+#include <vector>
+
+using namespace OpenMM;
+using namespace std;
+
+namespace OpenMMLab {
+
+/**
+ * This backend evaluates a CustomSummation in an inner Context containing a single
+ * CustomCompoundBondForce, whose particle positions are the summation arguments.
+ * Every bond involves all particles, unless the terms have their own points, in which
+ * case the bond of each term only involves the particles of its points.
+ */
+
+class ContextCustomSummationImpl : public CustomSummationImpl {
+public:
+    ContextCustomSummationImpl(
+        int numArgs,
+        string expression,
+        map<string, double> overallParameters,
+        vector<string> perTermParameters,
+        Platform &platform,
+        map<string, string> platformProperties,
+        int pointsPerTerm = 0
+    );
+    ~ContextCustomSummationImpl();
+    void evaluateBatch(const double *arguments, int numPoints, double *values, double *gradients);
+    void update(const vector<vector<double>> &parameters, const set<int> &modifiedTerms);
+    void setParameter(const string &name, double value);
+protected:
+    void setArguments(const double *arguments);
+    double computeValue();
+    void computeDerivatives(vector<double> &derivatives);
+    double computeValueAndDerivatives(vector<double> &derivatives);
+private:
+    string maskedExpression() const;
+    vector<double> slotParameters(int slot) const;
+    vector<int> slotParticles(int slot) const;
+    void createBatchContext(int numPoints);
+    string expression;
+    map<string, double> overallParameters;
+    vector<string> perTermParameters;
+    vector<vector<double>> termParameters;
+    Platform *platform;
+    map<string, string> platformProperties;
+    int numTerms, termCapacity;
+    Context *context;
+    CustomCompoundBondForce *force;
+    vector<int> particles;
+    vector<Vec3> positions;
+    Context *batchContext;
+    CustomCompoundBondForce *batchForce;
+    int batchCapacity;
+    bool batchIsUpToDate;
+    vector<Vec3> batchPositions;
+};
+
+} // namespace OpenMMLab
+
+#endif /*OPENMMLAB_CONTEXTCUSTOMSUMMATIONIMPL_H_*/
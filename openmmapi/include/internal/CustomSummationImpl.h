@@ -12,12 +12,14 @@
  * -------------------------------------------------------------------------- */
 
 #include "internal/windowsExportOpenMMLab.h"
-#include "openmm/Context.h"
-#include "openmm/CustomCompoundBondForce.h"
 #include "openmm/Platform.h"
-#include "openmm/internal/ContextImpl.h"
+#include "lepton/ParsedExpression.h"
 
+#include <deque>
+#include <future>
+#include <list>
 #include <map>
+#include <set>
 #include <string>
 #include <vector>
 
@@ -26,34 +28,227 @@ using namespace std;
 
 namespace OpenMMLab {
 
-class CustomSummationImpl {
+/**
+ * This is the base class of the backends that evaluate a CustomSummation. It keeps
+ * a least-recently-used cache of the values and derivatives computed for the latest
+ * distinct arguments, so that subclasses only need to implement the actual
+ * computations.
+ */
+
+class OPENMM_EXPORT_OPENMM_LAB CustomSummationImpl {
 public:
-    CustomSummationImpl(
+    /**
+     * Create the backend selected by the "Backend" entry of the platform properties.
+     * The accepted values are "Context" (the default), which evaluates the summation
+     * in an inner Context of the specified platform, "Kernel", which evaluates it with
+     * a single reduction kernel of the specified platform, and "Native", which
+     * evaluates it on the CPU using compiled expressions, with no Context at all.
+     * The value "Auto" delegates the evaluation to either the native backend or a device
+     * backend of the platform, whichever is faster for the current number of terms.
+     *
+     * The "Deterministic" entry only affects the Kernel backend, and is never passed on
+     * to the platform.  The "Precision" entry, if present, must be "single", "mixed", or "double". It is
+     * forwarded to the inner Context only if the platform has a property of that name.
+     * The native backend evaluates terms with SIMD instructions if it is "single" or
+     * "mixed".
+     *
+     * If pointsPerTerm is positive, every term only depends on that many argument points,
+     * which are set with setTermPoints().  The Kernel backend does not support this.
+     */
+    static CustomSummationImpl *create(
         int numArgs,
         string expression,
         map<string, double> overallParameters,
         vector<string> perTermParameters,
         Platform &platform,
-        map<string, string> platformProperties
+        map<string, string> platformProperties,
+        int pointsPerTerm = 0
+    );
+    virtual ~CustomSummationImpl() {}
+    /**
+     * Parse the expression of the terms of a summation.  Calls to distance(), angle(),
+     * dihedral(), and their point counterparts are replaced by explicit expression
+     * trees, so that the result only involves the arguments and the parameters.
+     */
+    static Lepton::ParsedExpression parseExpression(const string &expression);
+    /**
+     * Hoist out of a term expression the subexpressions that take the same value in every
+     * term.  Each maximal subexpression that depends on overall parameters but neither on
+     * the arguments nor on the per-term parameters is replaced by a variable named
+     * "@parameter0", "@parameter1", etc., and appended to parameterInvariants.  If
+     * includeArguments is true, the same is done with the maximal subexpressions that
+     * depend on the arguments but not on the per-term parameters, which are named
+     * "@argument0", "@argument1", etc., and appended to argumentInvariants.  Identical
+     * subexpressions share the same variable.
+     */
+    static Lepton::ParsedExpression hoistInvariants(
+        const Lepton::ParsedExpression &expression,
+        int numArgs,
+        const vector<string> &perTermParameters,
+        bool includeArguments,
+        vector<Lepton::ParsedExpression> &argumentInvariants,
+        vector<Lepton::ParsedExpression> &parameterInvariants
     );
-    ~CustomSummationImpl();
-    double evaluate(const vector<double> &arguments);
-    vector<double> evaluateDerivatives(const vector<double> &arguments);
-    void update(const vector<vector<double>> &parameters);
-    void setParameter(const string &name, double value);
+    /**
+     * Get the name of an argument, which is x1, y1, z1, x2, etc.
+     */
+    static string getArgumentName(int index);
+    /**
+     * Get whether the "Deterministic" entry of the platform properties, which is "true"
+     * by default, requests reproducible sums.
+     */
+    static bool isDeterministic(const map<string, string> &platformProperties);
+    /**
+     * The evaluation methods take arrays of getNumArguments() values, so that callers
+     * holding raw arrays need not copy them into vectors. The derivatives are returned
+     * by reference to the cache, and remain valid until the next evaluation.
+     */
+    double evaluate(const double *arguments);
+    const vector<double> &evaluateDerivatives(const double *arguments);
+    double evaluateWithDerivatives(const double *arguments, vector<double> &derivatives);
+    virtual void evaluateBatch(const double *arguments, int numPoints, double *values, double *gradients) = 0;
+    /**
+     * Start evaluating a batch of points in a worker thread, and return immediately. The
+     * arguments are copied into a staging buffer, so the caller can prepare the next batch
+     * in the same array. Batches are evaluated one at a time, in the order they are
+     * submitted, and their results are retrieved in that order by collectBatch().
+     */
+    void submitBatch(const double *arguments, int numPoints, bool includeGradients);
+    /**
+     * Wait for the oldest pending batch, copy its results, and return its number of points.
+     * An exception thrown while evaluating the batch is rethrown here.
+     */
+    int collectBatch(double *values, double *gradients);
+    int getNumPendingBatches() const { return pendingBatches.size(); }
+    int getPendingBatchSize() const;
+    /**
+     * Wait for all pending batches to be evaluated, keeping their results until they are
+     * collected. This must be called before any other use of the backend, which would
+     * otherwise race with the worker thread.
+     */
+    void finishPendingBatches();
+    /**
+     * Compute the product of the Hessian of the summation and a vector. The default
+     * implementation takes central differences of two analytic gradients. Backends
+     * that can differentiate the terms twice override it.
+     */
+    virtual void evaluateHessianProduct(const vector<double> &arguments, const vector<double> &direction, vector<double> &product);
+    /**
+     * Compute the diagonal of the Hessian of the summation. The default implementation
+     * takes central differences of analytic gradients, two for each argument.
+     */
+    virtual void evaluateHessianDiagonal(const vector<double> &arguments, vector<double> &diagonal);
+    /**
+     * Update the terms of the summation. The number of terms can be smaller than in
+     * the previous update, in which case the extra terms have been removed.
+     *
+     * @param parameters      the parameters of all terms
+     * @param modifiedTerms   the indices of the terms that have been added or modified
+     *                        since the last update
+     */
+    virtual void update(const vector<vector<double>> &parameters, const set<int> &modifiedTerms) = 0;
+    /**
+     * Set the indices of the argument points that every term depends on, if the backend
+     * was created with a positive number of points per term.  It must be called before
+     * update(), which applies the points of the modified terms along with their parameters.
+     */
+    void setTermPoints(const vector<vector<int>> &points) { termPoints = points; }
+    int getPointsPerTerm() const { return pointsPerTerm; }
+    virtual void setParameter(const string &name, double value) = 0;
+    /**
+     * Declare that each term vanishes, along with its derivatives, whenever the
+     * distance between the arguments and a per-term center exceeds a per-term radius.
+     * Backends can use this to skip terms, but are not required to do so.
+     *
+     * @param centerParameters   the indices of the per-term parameters that contain
+     *                           the center coordinates, one for each argument
+     * @param radiusParameter    the index of the per-term parameter that contains
+     *                           the support radius
+     */
+    virtual void setCompactSupport(const vector<int> &centerParameters, int radiusParameter) {}
+    /**
+     * Declare that the magnitude of each term never exceeds |h|*exp(-d^2/(2*w^2)), where d
+     * is the distance between the arguments and a per-term center, and h and w are per-term
+     * parameters.  Backends can use this to skip the terms whose bound is so small that all
+     * the skipped terms add up to less than a tolerance, but are not required to do so.
+     *
+     * @param centerParameters   the indices of the per-term parameters that contain
+     *                           the center coordinates, one for each argument
+     * @param widthParameter     the index of the per-term parameter that contains w
+     * @param heightParameter    the index of the per-term parameter that contains h
+     * @param tolerance          the largest total magnitude of the skipped terms
+     */
+    virtual void setGaussianSupport(const vector<int> &centerParameters, int widthParameter, int heightParameter, double tolerance) {}
+    /**
+     * Request that the summation be tabulated on a regular grid and interpolated inside
+     * its bounds. Backends that do not support tabulation evaluate the summation exactly.
+     *
+     * @param minValues   the smallest value of each argument covered by the grid
+     * @param maxValues   the largest value of each argument covered by the grid
+     * @param numPoints   the number of grid points along each argument
+     */
+    virtual void setGrid(const vector<double> &minValues, const vector<double> &maxValues, const vector<int> &numPoints) {}
+    /**
+     * Set the maximum number of argument vectors whose results are kept in cache.
+     */
+    void setCacheSize(int size);
+    int getCacheSize() const { return cacheSize; }
+    long long getNumCacheHits() const { return numCacheHits; }
+    long long getNumCacheMisses() const { return numCacheMisses; }
+protected:
+    CustomSummationImpl(int numArgs, int pointsPerTerm = 0);
+    /**
+     * Discard all cached values and derivatives.
+     */
+    void invalidateCache();
+    /**
+     * Indicate that the arguments last passed to setArguments() are no longer in
+     * effect in the backend, without discarding the cached results.
+     */
+    void invalidateArguments() { backendArgumentsAreValid = false; }
+    /**
+     * Pass new arguments, an array of numArgs values, to the backend.
+     */
+    virtual void setArguments(const double *arguments) = 0;
+    /**
+     * Compute the value of the summation for the latest arguments.
+     */
+    virtual double computeValue() = 0;
+    /**
+     * Compute the derivatives of the summation for the latest arguments.
+     */
+    virtual void computeDerivatives(vector<double> &derivatives) = 0;
+    /**
+     * Compute both the value and the derivatives of the summation for the latest
+     * arguments in a single pass.
+     */
+    virtual double computeValueAndDerivatives(vector<double> &derivatives) = 0;
+    int numArgs, pointsPerTerm;
+    vector<vector<int>> termPoints;
 private:
-    void setPositions(const vector<double> &arguments);
-    int numArgs;
-    Context *context;
-    bool contextIsUnchanged;
-    CustomCompoundBondForce *force;
-    vector<int> particles;
-    vector<Vec3> positions;
-    vector<double> latestArguments;
-    double value;
-    bool valueIsDirty;
-    vector<double> derivatives;
-    bool derivativesAreDirty;
+    struct CacheEntry {
+        size_t hash;
+        vector<double> arguments;
+        double value;
+        bool hasValue;
+        vector<double> derivatives;
+        bool hasDerivatives;
+    };
+    CacheEntry &findEntry(const double *arguments);
+    void prepareBackend(const CacheEntry &entry);
+    list<CacheEntry> cache;
+    int cacheSize;
+    long long numCacheHits, numCacheMisses;
+    vector<double> backendArguments;
+    bool backendArgumentsAreValid;
+    struct PendingBatch {
+        vector<double> arguments, values, gradients;
+        int numPoints;
+        bool includeGradients;
+        shared_future<void> done;
+    };
+    deque<PendingBatch> pendingBatches;
+    vector<PendingBatch> spareBatches;
 };
 
 } // namespace OpenMMLab
@@ -12,14 +12,18 @@
  * -------------------------------------------------------------------------- */
 
 #include "ExtendedCustomCVForce.h"
+#include "OpenMMLabKernels.h"
 
 #include "openmm/internal/ForceImpl.h"
 #include "openmm/Context.h"
 #include "openmm/Kernel.h"
 #include "openmm/System.h"
 #include "openmm/VerletIntegrator.h"
+#include "lepton/CompiledExpression.h"
+#include "lepton/CustomFunction.h"
 #include <map>
 #include <string>
+#include <typeinfo>
 #include <vector>
 
 using namespace OpenMM;
@@ -28,6 +32,25 @@ namespace OpenMMLab {
 
 /**
  * This is the internal implementation of ExtendedCustomCVForce.
+ *
+ * The inner System contains the particles of the System, followed by the dummy particles of
+ * the batches of collective variables.  Each batch has an origin particle followed by one
+ * particle per variable, and its Force is turned into a CustomCompoundBondForce whose bonds
+ * also connect these two particles.  Every bond is multiplied by the x displacement of its own
+ * particle from the origin, so that a displacement of 1 makes the value of a variable equal to
+ * minus the x force on its particle, and displacements equal to the derivatives of the energy
+ * with respect to the variables make the forces on the other particles equal to those of the
+ * whole batch.  Displacements are used instead of coordinates because a platform may translate
+ * the particles of a molecule when it reorders them.
+ *
+ * When collective variables are nested ExtendedCustomCVForces that can be composed, the kernel
+ * is given a flattened copy of the owner instead, whose collective variables are the leaves of
+ * the hierarchy and whose energy expression defines every nested variable as a subexpression. *
+ * The collective variables placed on other platforms are left out of the inner System.  They
+ * are evaluated in one Context per platform, whose force groups are their indices among the
+ * variables placed there, in a thread that runs while the kernel evaluates the others.
+ * These Contexts are also created in another thread, while the inner Context and the kernel
+ * compile their own programs.
  */
 
 class OPENMM_EXPORT_OPENMM_LAB ExtendedCustomCVForceImpl : public ForceImpl {
@@ -46,14 +69,100 @@ public:
     std::vector<std::string> getKernelNames();
     std::vector<std::pair<int, int> > getBondedParticles() const;
     void getCollectiveVariableValues(ContextImpl& context, std::vector<double>& values);
+    void getCollectiveVariableValuesForFrames(ContextImpl& context, const std::vector<std::vector<Vec3> >& frames,
+                                              const std::vector<std::vector<Vec3> >& boxVectors, std::vector<std::vector<double> >& values);
+    void getCollectiveVariableHistory(ContextImpl& context, std::vector<long long>& steps, std::vector<std::vector<double> >& values,
+                                      std::vector<double>& energies);
     Context& getInnerContext();
     void updateParametersInContext(ContextImpl& context);
+    void getStageTimes(std::map<std::string, double>& times);
+    void resetStageTimes();
+    void getCounters(std::map<std::string, long long>& counters);
+    void resetCounters();
+    void getCollectiveVariableCache(std::vector<long long>& steps, std::vector<double>& values, std::vector<std::vector<double> >& derivatives);
+    void setCollectiveVariableCache(const std::vector<long long>& steps, const std::vector<double>& values,
+                                    const std::vector<std::vector<double> >& derivatives);
+    void getForceArrays(DeviceArray& forces, DeviceArray& atomIndices, std::vector<int>& variables);
+    void getDepositedTerms(int index, std::vector<std::vector<double> >& terms);
+    /**
+     * A function that creates a deep copy of a Force of one specific type.
+     */
+    typedef Force* (*CopyFunction)(const Force& force);
+    /**
+     * Register the function used to copy the collective variables of a specific type into
+     * the inner System.  Forces whose types have no registered function are cloned through
+     * XmlSerializer, which can be slow for large Forces.  Functions are already registered
+     * for SlicedNonbondedForce and for the OpenMM Forces whose copy constructors make deep
+     * copies.
+     *
+     * @param type      the exact type of the Forces the function copies
+     * @param function  the function that copies them
+     */
+    static void registerCopyFunction(const std::type_info& type, CopyFunction function);
+    /**
+     * Create a deep copy of a Force, using the function registered for its type, if any,
+     * or XmlSerializer otherwise.
+     */
+    static Force* copyForce(const Force& force);
+    /**
+     * Create the Force that evaluates a batch of collective variables in the inner System.
+     *
+     * @param variables      the Force whose bonds define the variables
+     * @param firstParticle  the index of the origin particle of the batch in the inner System,
+     *                       which is followed by the particles of the variables
+     */
+    static Force* createBatchForce(const Force& variables, int firstParticle);
+    /**
+     * Compile the expressions for the per-term parameters of the terms deposited in a custom
+     * summation, which read their variables from the given locations.  An exception is thrown
+     * if an expression involves a variable without a location.  No expressions are returned
+     * if the summation has no deposition.
+     *
+     * @param force              the force that owns the summation
+     * @param index              the index of the summation
+     * @param functions          the custom functions the expressions may call
+     * @param variableLocations  the locations of the variables the expressions may involve
+     */
+    static std::vector<Lepton::CompiledExpression> createDepositionExpressions(const ExtendedCustomCVForce& force, int index,
+            const std::map<std::string, Lepton::CustomFunction*>& functions, std::map<std::string, double*>& variableLocations);
 private:
+    const ExtendedCustomCVForce& getFlattenedForce() const {
+        return flattenedForce != NULL ? *flattenedForce : owner;
+    }
+    void flattenOwner(bool update);
+    void addNestedVariables(const ExtendedCustomCVForce& nested, const std::string& name, int interval, bool update,
+                            int& numVariables, int& numFunctions, std::vector<std::string>& definitions);
+    void addLeafVariable(const Force& variable, const std::string& name, int interval, const std::string& platform, bool update,
+                         int& numVariables);
+    void setTabulatedFunction(int index, const std::string& name, const TabulatedFunction& function, bool update);
+    void createValueExpressions();
+    void computeNestedValues(ContextImpl& context, const std::vector<double>& leafValues, std::vector<double>& values);
+    void createPlacedSystems(const ExtendedCustomCVForce& force, const System& system);
+    void createPlacedContexts();
+    void startPlacedEvaluation(ContextImpl& context, bool includeForces);
+    void evaluatePlacedVariables(const std::vector<int>& due, const std::vector<Vec3>& positions, const Vec3* box,
+                                 const std::map<std::string, double>& parameters, long long step, bool includeForces);
     const ExtendedCustomCVForce& owner;
+    ExtendedCustomCVForce* flattenedForce;
+    std::vector<const ExtendedCustomCVForce*> nestedForces;
+    std::vector<std::string> nestedDefinitions;
+    std::vector<int> valueIndices;
+    std::map<int, Lepton::CompiledExpression> valueExpressions;
+    std::map<std::string, int> flattenedIndices;
     Kernel kernel;
     System innerSystem;
     VerletIntegrator innerIntegrator;
     Context* innerContext;
+    PlacedCollectiveVariables placed;
+    std::vector<System*> placedSystems;
+    std::vector<VerletIntegrator*> placedIntegrators;
+    std::vector<Context*> placedContexts;
+    std::vector<std::string> placedPlatforms;
+    std::vector<int> placedContextIndices, placedGroups, placedIntervals;
+    std::vector<long long> placedSteps;
+    std::vector<bool> placedHasValue;
+    std::map<std::string, double> initTimes;
+    int numParticles, numSharedParticles;
     int forceGroup;  // for compatibility with OpenMM 8.0
 };
 
@@ -0,0 +1,71 @@
+#ifndef OPENMMLAB_KERNELCUSTOMSUMMATIONIMPL_H_
+#define OPENMMLAB_KERNELCUSTOMSUMMATIONIMPL_H_
+
+/* -------------------------------------------------------------------------- *
+ *                             OpenMM Laboratory                              *
+ *                             =================                              *
+ *                                                                            *
+ * A plugin for testing low-level code implementation for OpenMM.             *
+ *                                                                            *
+ * Copyright (c) 2023 Charlles Abreu                                          *
+ * https://github.com/craabreu/openmm-lab                                     *
+ * -------------------------------------------------------------------------- */
+
+#include "internal/CustomSummationImpl.h"
+#include "openmm/Context.h"
+#include "openmm/Kernel.h"
+#include "openmm/Platform.h"
+#include "openmm/System.h"
+#include "openmm/VerletIntegrator.h"
+
+#include <map>
+#include <string>
+#include <vector>
+
+using namespace OpenMM;
+using namespace std;
+
+namespace OpenMMLab {
+
+/**
+ * This backend evaluates a CustomSummation with a CalcCustomSummationKernel, which
+ * compiles the term expression into a single reduction kernel over a device array of
+ * per-term parameters. A Context is still needed to own the device, but it contains
+ * a single particle and no forces, so that no force or energy buffers, neighbor
+ * lists, or bonded kernels are created.
+ *
+ * Unless it is told otherwise, the kernel sums the terms in fixed point, so that the
+ * results are reproducible across runs and devices.
+ */
+
+class KernelCustomSummationImpl : public CustomSummationImpl {
+public:
+    KernelCustomSummationImpl(
+        int numArgs,
+        string expression,
+        map<string, double> overallParameters,
+        vector<string> perTermParameters,
+        Platform &platform,
+        map<string, string> platformProperties,
+        bool deterministic = true
+    );
+    ~KernelCustomSummationImpl();
+    void evaluateBatch(const double *arguments, int numPoints, double *values, double *gradients);
+    void update(const vector<vector<double>> &parameters, const set<int> &modifiedTerms);
+    void setParameter(const string &name, double value);
+protected:
+    void setArguments(const double *arguments);
+    double computeValue();
+    void computeDerivatives(vector<double> &derivatives);
+    double computeValueAndDerivatives(vector<double> &derivatives);
+private:
+    System system;
+    VerletIntegrator integrator;
+    Context *context;
+    Kernel kernel;
+    vector<double> arguments;
+};
+
+} // namespace OpenMMLab
+
+#endif /*OPENMMLAB_KERNELCUSTOMSUMMATIONIMPL_H_*/
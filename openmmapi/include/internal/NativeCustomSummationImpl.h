@@ -0,0 +1,151 @@
+#ifndef OPENMMLAB_NATIVECUSTOMSUMMATIONIMPL_H_
+#define OPENMMLAB_NATIVECUSTOMSUMMATIONIMPL_H_
+
+/* -------------------------------------------------------------------------- *
+ *                             OpenMM Laboratory                              *
+ *                             =================                              *
+ *                                                                            *
+ * A plugin for testing low-level code implementation for OpenMM.             *
+ *                                                                            *
+ * Copyright (c) 2023 Charlles Abreu                                          *
+ * https://github.com/craabreu/openmm-lab                                     *
+ * -------------------------------------------------------------------------- */
+
+#include "internal/CustomSummationImpl.h"
+#include "lepton/CompiledExpression.h"
+#include "lepton/CompiledVectorExpression.h"
+#include "lepton/ParsedExpression.h"
+
+#include <map>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+namespace OpenMMLab {
+
+/**
+ * This backend evaluates a CustomSummation on the CPU without creating any Context.
+ * The term expression and its derivatives are compiled once with Lepton, and the
+ * per-term parameters are stored in a structure-of-arrays layout. If vectorization
+ * is requested, the terms are evaluated in single precision, several at a time,
+ * using SIMD instructions, while the sums are accumulated in double precision.
+ *
+ * Subexpressions that do not depend on the per-term parameters are hoisted out of the
+ * terms. Those that depend on the arguments, such as the distances, angles, and dihedrals
+ * between argument points, are evaluated once per point, and the derivatives of the terms
+ * with respect to them are summed over all terms and then chained with their gradients.
+ * Those that only depend on overall parameters are evaluated when a parameter changes.
+ *
+ * If the terms have compact support, a k-d tree is built over the term centers, with
+ * every node storing the bounding box of its centers and the largest support radius
+ * among its terms. A query descends only into nodes whose box lies within that radius
+ * of the arguments, and only the terms whose support contains the arguments are actually
+ * evaluated. Unlike a uniform grid of cells, the cost of a query does not grow as 3^d
+ * with the number of arguments. Terms bounded by Gaussians are handled in the same way,
+ * with the support radius of each term being the distance beyond which its bound falls
+ * below the tolerance divided by the capacity of the tree (see below).
+ *
+ * Terms appended after the tree is built are inserted into the leaves, enlarging the
+ * boxes along the way, until their number doubles and the tree is rebuilt. Modifying
+ * or removing terms also triggers a rebuild.
+ *
+ * If a grid has been set, the value of the summation and its derivatives with respect
+ * to every subset of the arguments are tabulated at the grid points, and arguments inside
+ * the grid are handled by tensor-product cubic Hermite interpolation. Adding, modifying,
+ * or removing a term only adds or subtracts its own contribution at every grid point.
+ * Arguments outside the grid are evaluated exactly.
+ *
+ * The second derivatives of the terms are only compiled the first time a Hessian is
+ * requested, and are always evaluated in double precision and without the grid.
+ *
+ * If the terms have their own points, the expression is compiled for the coordinates of
+ * a single term, which are gathered from the arguments before each term is evaluated,
+ * and its derivatives are scattered to the arguments of its points.  The terms are then
+ * evaluated one at a time in double precision, with no hoisting of argument invariants,
+ * and Hessians are computed by finite differences.
+ */
+
+class NativeCustomSummationImpl : public CustomSummationImpl {
+public:
+    NativeCustomSummationImpl(
+        int numArgs,
+        string expression,
+        map<string, double> overallParameters,
+        vector<string> perTermParameters,
+        bool useVectors = false,
+        int pointsPerTerm = 0
+    );
+    void evaluateBatch(const double *arguments, int numPoints, double *values, double *gradients);
+    void evaluateHessianProduct(const vector<double> &arguments, const vector<double> &direction, vector<double> &product);
+    void evaluateHessianDiagonal(const vector<double> &arguments, vector<double> &diagonal);
+    void update(const vector<vector<double>> &parameters, const set<int> &modifiedTerms);
+    void setParameter(const string &name, double value);
+    void setCompactSupport(const vector<int> &centerParameters, int radiusParameter);
+    void setGaussianSupport(const vector<int> &centerParameters, int widthParameter, int heightParameter, double tolerance);
+    void setGrid(const vector<double> &minValues, const vector<double> &maxValues, const vector<int> &numPoints);
+protected:
+    void setArguments(const double *arguments);
+    double computeValue();
+    void computeDerivatives(vector<double> &derivatives);
+    double computeValueAndDerivatives(vector<double> &derivatives);
+private:
+    double computeTerms(bool includeValue, vector<double> *derivatives);
+    double computePointTerms(bool includeValue, vector<double> *derivatives);
+    struct TreeNode {
+        vector<double> lower, upper;
+        double radius, split;
+        int axis, left, right;
+        vector<int> terms;
+    };
+    double getSupportRadius(int term) const;
+    void buildTree();
+    int buildSubtree(vector<int> &terms, int start, int end);
+    void insertIntoTree(int term);
+    void findActiveTerms();
+    void addTermToGrid(int term, double scale);
+    bool interpolateGrid(double &value, vector<double> *derivatives) const;
+    vector<Lepton::CompiledExpression*> getCompiledExpressions();
+    void computeParameterInvariants();
+    void createHessianExpressions();
+    void prepareHessian(const vector<double> &arguments);
+    int numTerms, width;
+    vector<double> variables;
+    map<string, int> overallParameterIndex;
+    int firstParameterInvariant, firstInvariant, numInvariants, numTermDerivatives;
+    int firstPerTermParameter, numPerTermParameters;
+    vector<vector<double>> perTermValues;
+    Lepton::CompiledExpression valueExpression;
+    vector<Lepton::CompiledExpression> derivativeExpressions;
+    vector<Lepton::CompiledExpression> invariantExpressions, invariantGradientExpressions;
+    vector<Lepton::CompiledExpression> parameterInvariantExpressions;
+    vector<double> chainedDerivatives;
+    Lepton::ParsedExpression parsedValue;
+    vector<Lepton::ParsedExpression> parsedDerivatives;
+    vector<Lepton::CompiledExpression> hessianExpressions;
+    map<string, double*> variableLocations;
+    vector<float> vectorVariables;
+    vector<vector<float>> perTermVectorValues;
+    vector<Lepton::CompiledVectorExpression> vectorExpressions;
+    bool useCulling;
+    vector<int> centerParameters;
+    int radiusParameter, widthParameter, heightParameter;
+    double gaussianTolerance;
+    vector<double> supportRadii;
+    vector<TreeNode> treeNodes;
+    vector<int> treeStack;
+    int treeCapacity;
+    vector<int> activeTerms;
+    bool useGrid;
+    vector<double> gridOrigin, gridSpacing;
+    vector<int> gridPoints;
+    vector<double> gridValues;
+    vector<Lepton::CompiledExpression> gridExpressions;
+    vector<vector<float>> activeVectorValues;
+    vector<double> pointArguments;
+    vector<int> termPointIndices;
+};
+
+} // namespace OpenMMLab
+
+#endif /*OPENMMLAB_NATIVECUSTOMSUMMATIONIMPL_H_*/
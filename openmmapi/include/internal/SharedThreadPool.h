@@ -0,0 +1,80 @@
+#ifndef OPENMMLAB_SHAREDTHREADPOOL_H_
+#define OPENMMLAB_SHAREDTHREADPOOL_H_
+
+/* -------------------------------------------------------------------------- *
+ *                             OpenMM Laboratory                              *
+ *                             =================                              *
+ *                                                                            *
+ * A plugin for testing low-level code implementation for OpenMM.             *
+ *                                                                            *
+ * Copyright (c) 2023 Charlles Abreu                                          *
+ * https://github.com/craabreu/openmm-lab                                     *
+ * -------------------------------------------------------------------------- */
+
+#include "openmm/internal/ThreadPool.h"
+#include "internal/windowsExportOpenMMLab.h"
+#include <functional>
+#include <mutex>
+#include <vector>
+
+namespace OpenMMLab {
+
+/**
+ * The pool of threads shared by all the work the plugin does on the CPU.  There is a single
+ * pool per process, created on first use.  As on the CPU platform, the number of threads can
+ * be set with the OPENMM_CPU_THREADS environment variable, and is the number of cores by
+ * default.
+ *
+ * A task is split in as many parts as there are threads, and every part is identified by a
+ * thread index, so that callers can keep private buffers and add them up in a fixed order.
+ * The pool runs one task at a time.  If it is requested while busy, either by a nested call
+ * from one of its own tasks or by another thread, the parts are run one after the other in
+ * the calling thread, rather than starting more threads than there are cores.  Nested calls
+ * see a single thread.  The results are the same either way.
+ */
+class OPENMM_EXPORT_OPENMM_LAB SharedThreadPool {
+public:
+    /**
+     * Get the pool, creating it if necessary.
+     */
+    static SharedThreadPool& getInstance();
+    /**
+     * Get the number of parts into which a task started by the calling thread is split.  This
+     * is 1 in a nested call.
+     */
+    int getNumThreads() const;
+    /**
+     * Call task(thread) for every thread index, and wait for all of them to finish.
+     */
+    void execute(const std::function<void(int)>& task);
+    /**
+     * Split the range [0, n) in contiguous chunks, one per thread, call task(thread, start, end)
+     * for each of them, and wait for all of them to finish.
+     */
+    void parallelFor(int n, const std::function<void(int, int, int)>& task);
+    /**
+     * Split the range [0, n) in contiguous chunks, one per thread, and call
+     * task(start, end, partial) for each of them, where partial starts as a copy of zero.
+     * The partial results are then merged with combine(result, partial) in thread order,
+     * so the result does not depend on timing.
+     */
+    template <class T, class Task, class Combine>
+    T parallelReduce(int n, const T& zero, Task task, Combine combine) {
+        std::vector<T> partials(getNumThreads(), zero);
+        parallelFor(n, [&] (int thread, int start, int end) {
+            task(start, end, partials[thread]);
+        });
+        T result = zero;
+        for (const T& partial : partials)
+            combine(result, partial);
+        return result;
+    }
+private:
+    SharedThreadPool(int numThreads);
+    OpenMM::ThreadPool threads;
+    std::mutex busy;
+};
+
+} // namespace OpenMMLab
+
+#endif /*OPENMMLAB_SHAREDTHREADPOOL_H_*/
@@ -14,9 +14,12 @@
 #include "SlicedNonbondedForce.h"
 #include "openmm/internal/NonbondedForceImpl.h"
 #include "openmm/Kernel.h"
+#include <map>
 #include <utility>
 #include <set>
 #include <string>
+#include <tuple>
+#include <vector>
 
 using namespace OpenMM;
 
@@ -37,14 +40,60 @@ public:
     double calcForcesAndEnergy(ContextImpl& context, bool includeForces, bool includeEnergy, int groups);
     std::vector<std::string> getKernelNames();
     void updateParametersInContext(ContextImpl& context);
+    void getSliceEnergies(ContextImpl& context, std::vector<double>& coulombEnergies, std::vector<double>& ljEnergies);
+    void getForeignEnergies(ContextImpl& context, std::vector<double>& energies);
+    void getScalingParameterDerivatives(ContextImpl& context, std::map<std::string, double>& derivatives);
+    void getReplicaEnergies(ContextImpl& context, const std::vector<std::vector<Vec3>>& positions, std::vector<std::vector<double>>& energies);
+    void getReducedForeignEnergies(ContextImpl& context, const std::vector<std::vector<Vec3>>& frames, const std::vector<std::vector<Vec3>>& boxVectors,
+                                   double temperature, std::vector<std::vector<double>>& reducedEnergies);
     void getPMEParameters(double& alpha, int& nx, int& ny, int& nz) const;
     void getLJPMEParameters(double& alpha, int& nx, int& ny, int& nz) const;
+    void getStageTimes(std::map<std::string, double>& times);
+    void resetStageTimes();
+    void getSliceEnergyArrays(DeviceArray& coulombEnergies, DeviceArray& ljEnergies, std::vector<int>& slotSlices);
+    void setLambdaState(int index);
+    int getLambdaState() const;
     static double calcDispersionCorrection(const System& system, const SlicedNonbondedForce& force);
     static vector<double> calcDispersionCorrections(const System& system, const SlicedNonbondedForce& force);
+    /**
+     * The class of a particle for the dispersion correction, given by its sigma, its epsilon
+     * and its subset.  Sigma and epsilon include the offsets at the default values of their
+     * global parameters.
+     */
+    typedef std::tuple<double, double, int> ParticleClass;
+    /**
+     * Get the class of every particle for the dispersion correction.
+     */
+    static std::vector<ParticleClass> getParticleClasses(const SlicedNonbondedForce& force);
+    /**
+     * This class computes the dispersion correction coefficients of all slices and keeps the
+     * number of particles in each class and the sums over pairs of classes.  When the
+     * parameters change, only the particles whose class changed are moved between classes,
+     * which costs O(classes) for each of them instead of O(classes^2) for a full rebuild.
+     * Kernels keep one table per Context and update it in copyParametersToContext().
+     */
+    class OPENMM_EXPORT_OPENMM_LAB DispersionCorrectionTable {
+    public:
+        /**
+         * Update the table to match the current parameters of a force.
+         *
+         * @return the dispersion correction coefficient of every slice
+         */
+        const std::vector<double>& update(const SlicedNonbondedForce& force);
+    private:
+        void addPairTerms(const ParticleClass& class1, const ParticleClass& class2, double count);
+        void addParticle(const ParticleClass& particleClass, int delta);
+        std::vector<ParticleClass> particleClasses;
+        std::map<ParticleClass, int> classCounts;
+        std::vector<double> sum1, sum2, sum3, coefficients;
+        double cutoff, switchDistance;
+        bool useSwitch;
+    };
 private:
     static double evalIntegral(double r, double rs, double rc, double sigma);
     const SlicedNonbondedForce& owner;
     Kernel kernel;
+    std::map<std::string, double> initTimes;
 };
 
 } // namespace OpenMMLab
@@ -0,0 +1,90 @@
+#ifndef OPENMMLAB_TRACERECORDER_H_
+#define OPENMMLAB_TRACERECORDER_H_
+
+/* -------------------------------------------------------------------------- *
+ *                             OpenMM Laboratory                              *
+ *                             =================                              *
+ *                                                                            *
+ * A plugin for testing low-level code implementation for OpenMM.             *
+ *                                                                            *
+ * Copyright (c) 2023 Charlles Abreu                                          *
+ * https://github.com/craabreu/openmm-lab                                     *
+ * -------------------------------------------------------------------------- */
+
+#include "internal/windowsExportOpenMMLab.h"
+#include <chrono>
+#include <cstdio>
+#include <map>
+#include <mutex>
+#include <string>
+
+namespace OpenMMLab {
+
+/**
+ * A recorder of the timeline of the plugin in the JSON trace event format, which is read by
+ * chrome://tracing and by Perfetto.  It is enabled by setting the environment variable
+ * OPENMMLAB_TRACE_FILE to the path of the file to write, and there is a single recorder per
+ * process, created on first use.
+ *
+ * Every span is written as a complete event as soon as it ends, so the file can be inspected
+ * while a simulation runs, and its length does not limit how long a run can be traced.  Both
+ * viewers accept the file even if the process is killed before the closing bracket of the
+ * event array is written at exit.
+ *
+ * Host spans are opened and closed on the same thread, and are nested on the track of that
+ * thread.  Device spans are measured by the platforms with events and added afterward on a
+ * track of their own.  Every span carries the step of the Context that was last evaluated by
+ * the thread that records it.
+ */
+class OPENMM_EXPORT_OPENMM_LAB TraceRecorder {
+public:
+    /**
+     * Get whether the environment variable OPENMMLAB_TRACE_FILE requests a trace.
+     */
+    static bool isEnabled();
+    /**
+     * Get the recorder, creating it and its file if necessary.
+     */
+    static TraceRecorder& getInstance();
+    /**
+     * Get the time elapsed since the recorder was created, in microseconds.
+     */
+    double now() const;
+    /**
+     * Set the step attached to the spans subsequently recorded by the calling thread.
+     */
+    static void setStep(long long step);
+    static long long getStep();
+    /**
+     * Open a span on the track of the calling thread.
+     */
+    void beginSpan(const char* name);
+    /**
+     * Close the latest span opened by the calling thread and write it.
+     */
+    void endSpan();
+    /**
+     * Write a span measured elsewhere, such as on a device.
+     *
+     * @param name      the name of the span
+     * @param track     the name of the track on which the span is shown
+     * @param start     the start of the span, in microseconds on the clock of now()
+     * @param duration  the duration of the span, in microseconds
+     * @param step      the step to which the span belongs
+     */
+    void addSpan(const std::string& name, const std::string& track, double start, double duration, long long step);
+    ~TraceRecorder();
+private:
+    TraceRecorder(const std::string& path);
+    int getTrackId(const std::string& track);
+    void write(const std::string& name, int track, double start, double duration, long long step);
+    std::FILE* file;
+    std::mutex lock;
+    std::chrono::steady_clock::time_point epoch;
+    std::map<std::string, int> trackIds;
+    bool isFirstEvent;
+};
+
+} // namespace OpenMMLab
+
+#endif /*OPENMMLAB_TRACERECORDER_H_*/
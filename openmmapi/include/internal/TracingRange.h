@@ -0,0 +1,81 @@
+#ifndef OPENMMLAB_TRACINGRANGE_H_
+#define OPENMMLAB_TRACINGRANGE_H_
+
+/* -------------------------------------------------------------------------- *
+ *                             OpenMM Laboratory                              *
+ *                             =================                              *
+ *                                                                            *
+ * A plugin for testing low-level code implementation for OpenMM.             *
+ *                                                                            *
+ * Copyright (c) 2023 Charlles Abreu                                          *
+ * https://github.com/craabreu/openmm-lab                                     *
+ * -------------------------------------------------------------------------- */
+
+#include "internal/TraceRecorder.h"
+
+/**
+ * Named ranges that mark the stages of the plugin in the timelines of external profilers.
+ * Building with -DOPENMMLAB_USE_NVTX emits NVTX ranges, shown by Nsight Systems, and
+ * building with -DOPENMMLAB_USE_ROCTX emits ROCTX ranges, shown by the ROCm profilers.
+ * They are selected by the CMake options PLUGIN_ENABLE_NVTX and PLUGIN_ENABLE_ROCTX.
+ *
+ * Independently of the build, the same ranges are written as spans by the TraceRecorder
+ * when the environment variable OPENMMLAB_TRACE_FILE is set.  Otherwise, they only cost a
+ * test of a flag, and their names are not evaluated.
+ *
+ * The ranges are host-side annotations.  A range around kernel launches covers the time
+ * spent launching them, which the profilers relate to the GPU work they enqueue.
+ *
+ * OPENMMLAB_TRACE_PUSH(name) and OPENMMLAB_TRACE_POP() open and close a range, and must be
+ * balanced on the same thread.  OPENMMLAB_TRACE_RANGE(name) opens a range that is closed at
+ * the end of the enclosing scope, including when an exception is thrown.
+ * OPENMMLAB_TRACE_STEP(step) sets the step attached to the spans the thread records.
+ */
+
+#if defined(OPENMMLAB_USE_NVTX)
+    #include <nvtx3/nvToolsExt.h>
+    #define OPENMMLAB_PROFILER_PUSH(name) nvtxRangePushA(name)
+    #define OPENMMLAB_PROFILER_POP() nvtxRangePop()
+#elif defined(OPENMMLAB_USE_ROCTX)
+    #include <roctracer/roctx.h>
+    #define OPENMMLAB_PROFILER_PUSH(name) roctxRangePushA(name)
+    #define OPENMMLAB_PROFILER_POP() roctxRangePop()
+#else
+    #define OPENMMLAB_PROFILER_PUSH(name)
+    #define OPENMMLAB_PROFILER_POP()
+#endif
+
+#define OPENMMLAB_TRACE_PUSH(name) do { \
+        OPENMMLAB_PROFILER_PUSH(name); \
+        if (OpenMMLab::TraceRecorder::isEnabled()) \
+            OpenMMLab::TraceRecorder::getInstance().beginSpan(name); \
+    } while (0)
+#define OPENMMLAB_TRACE_POP() do { \
+        OPENMMLAB_PROFILER_POP(); \
+        if (OpenMMLab::TraceRecorder::isEnabled()) \
+            OpenMMLab::TraceRecorder::getInstance().endSpan(); \
+    } while (0)
+#define OPENMMLAB_TRACE_STEP(step) OpenMMLab::TraceRecorder::setStep(step)
+
+namespace OpenMMLab {
+
+/**
+ * A range that is open while the object exists.
+ */
+class TracingRange {
+public:
+    TracingRange(const char* name) {
+        OPENMMLAB_TRACE_PUSH(name);
+    }
+    ~TracingRange() {
+        OPENMMLAB_TRACE_POP();
+    }
+};
+
+} // namespace OpenMMLab
+
+#define OPENMMLAB_TRACE_CONCAT_(a, b) a##b
+#define OPENMMLAB_TRACE_CONCAT(a, b) OPENMMLAB_TRACE_CONCAT_(a, b)
+#define OPENMMLAB_TRACE_RANGE(name) OpenMMLab::TracingRange OPENMMLAB_TRACE_CONCAT(tracingRange, __LINE__)(name)
+
+#endif /*OPENMMLAB_TRACINGRANGE_H_*/
@@ -0,0 +1,221 @@
+/* -------------------------------------------------------------------------- *
+ *                             OpenMM Laboratory                              *
+ *                             =================                              *
+ *                                                                            *
+ * A plugin for testing low-level code implementation for OpenMM.             *
+ *                                                                            *
+ * Copyright (c) 2023 Charlles Abreu                                          *
+ * https://github.com/craabreu/openmm-lab                                     *
+ * -------------------------------------------------------------------------- */
+
+#include "internal/AutoCustomSummationImpl.h"
+#include "internal/ContextCustomSummationImpl.h"
+#include "internal/KernelCustomSummationImpl.h"
+#include "internal/NativeCustomSummationImpl.h"
+#include "OpenMMLabKernels.h"
+
+#include <algorithm>
+#include <chrono>
+#include <limits>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+using namespace OpenMM;
+using namespace OpenMMLab;
+using namespace std;
+
+AutoCustomSummationImpl::AutoCustomSummationImpl(
+    int numArgs,
+    string expression,
+    map<string, double> overallParameters,
+    vector<string> perTermParameters,
+    Platform &platform,
+    map<string, string> platformProperties,
+    const string &precision,
+    bool deterministic,
+    int pointsPerTerm
+) : CustomSummationImpl(numArgs, pointsPerTerm),
+    expression(expression),
+    overallParameters(overallParameters),
+    perTermParameters(perTermParameters),
+    platform(&platform),
+    platformProperties(platformProperties),
+    useVectors(precision != "double"),
+    deterministic(deterministic),
+    timedTerms(0),
+    arguments(numArgs, 0.0),
+    supportRadius(-1),
+    supportWidth(-1),
+    supportHeight(-1),
+    supportTolerance(0.0)
+{
+    nativeBackend.impl.reset(new NativeCustomSummationImpl(
+        numArgs, expression, overallParameters, perTermParameters, useVectors, pointsPerTerm
+    ));
+    nativeBackend.impl->setCacheSize(1);
+    active = nativeBackend.impl.get();
+}
+
+void AutoCustomSummationImpl::createDevice() {
+    // The device backend starts from the current state of the summation, so it has no
+    // pending terms.
+
+    CustomSummationImpl *impl;
+    if (pointsPerTerm == 0 && platform->supportsKernels(vector<string>{CalcCustomSummationKernel::Name()}))
+        impl = new KernelCustomSummationImpl(
+            numArgs, expression, overallParameters, perTermParameters, *platform, platformProperties, deterministic
+        );
+    else
+        impl = new ContextCustomSummationImpl(
+            numArgs, expression, overallParameters, perTermParameters, *platform, platformProperties, pointsPerTerm
+        );
+    deviceBackend.impl.reset(impl);
+    set<int> allTerms;
+    for (int i = 0; i < termParameters.size(); i++)
+        allTerms.insert(i);
+    impl->setTermPoints(termPoints);
+    impl->update(termParameters, allTerms);
+    impl->setCacheSize(1);
+    if (supportRadius >= 0)
+        impl->setCompactSupport(supportCenters, supportRadius);
+    if (supportWidth >= 0)
+        impl->setGaussianSupport(supportCenters, supportWidth, supportHeight, supportTolerance);
+    if (!gridPoints.empty())
+        impl->setGrid(gridMinValues, gridMaxValues, gridPoints);
+    deviceBackend.pendingTerms.clear();
+}
+
+void AutoCustomSummationImpl::synchronize(Backend &backend) {
+    if (!backend.impl)
+        return;
+    // Terms that have been removed since they were modified are not passed on.
+
+    set<int> &pending = backend.pendingTerms;
+    pending.erase(pending.lower_bound((int) termParameters.size()), pending.end());
+    backend.impl->setTermPoints(termPoints);
+    backend.impl->update(termParameters, pending);
+    pending.clear();
+}
+
+double AutoCustomSummationImpl::timeEvaluation(CustomSummationImpl &impl) {
+    // The first evaluation is not timed, since it may include the compilation of kernels
+    // or the upload of the terms. The shortest of the other evaluations is taken.
+
+    double value;
+    vector<double> gradients(numArgs);
+    impl.evaluateBatch(arguments.data(), 1, &value, gradients.data());
+    double best = numeric_limits<double>::infinity();
+    for (int i = 0; i < 3; i++) {
+        auto start = chrono::steady_clock::now();
+        impl.evaluateBatch(arguments.data(), 1, &value, gradients.data());
+        chrono::duration<double> elapsed = chrono::steady_clock::now()-start;
+        best = min(best, elapsed.count());
+    }
+    return best;
+}
+
+void AutoCustomSummationImpl::selectBackend() {
+    int numTerms = termParameters.size();
+    if (numTerms < minDeviceTerms) {
+        if (active != nativeBackend.impl.get()) {
+            synchronize(nativeBackend);
+            active = nativeBackend.impl.get();
+        }
+        timedTerms = 0;
+        return;
+    }
+    if (timedTerms > 0 && numTerms < 2*timedTerms && 2*numTerms > timedTerms)
+        return;
+    if (!deviceBackend.impl)
+        createDevice();
+    synchronize(nativeBackend);
+    synchronize(deviceBackend);
+    double nativeTime = timeEvaluation(*nativeBackend.impl);
+    double deviceTime = timeEvaluation(*deviceBackend.impl);
+    active = (deviceTime < nativeTime ? deviceBackend.impl.get() : nativeBackend.impl.get());
+    timedTerms = numTerms;
+}
+
+void AutoCustomSummationImpl::setArguments(const double *arguments) {
+    this->arguments.assign(arguments, arguments + numArgs);
+}
+
+double AutoCustomSummationImpl::computeValue() {
+    return active->evaluate(arguments.data());
+}
+
+void AutoCustomSummationImpl::computeDerivatives(vector<double> &derivatives) {
+    derivatives = active->evaluateDerivatives(arguments.data());
+}
+
+double AutoCustomSummationImpl::computeValueAndDerivatives(vector<double> &derivatives) {
+    return active->evaluateWithDerivatives(arguments.data(), derivatives);
+}
+
+void AutoCustomSummationImpl::evaluateBatch(const double *arguments, int numPoints, double *values, double *gradients) {
+    if (numPoints > 0)
+        this->arguments.assign(arguments, arguments + numArgs);
+    active->evaluateBatch(arguments, numPoints, values, gradients);
+}
+
+void AutoCustomSummationImpl::evaluateHessianProduct(const vector<double> &arguments, const vector<double> &direction, vector<double> &product) {
+    active->evaluateHessianProduct(arguments, direction, product);
+}
+
+void AutoCustomSummationImpl::evaluateHessianDiagonal(const vector<double> &arguments, vector<double> &diagonal) {
+    active->evaluateHessianDiagonal(arguments, diagonal);
+}
+
+void AutoCustomSummationImpl::update(const vector<vector<double>> &parameters, const set<int> &modifiedTerms) {
+    termParameters = parameters;
+    for (Backend *backend : {&nativeBackend, &deviceBackend})
+        if (backend->impl) {
+            backend->pendingTerms.insert(modifiedTerms.begin(), modifiedTerms.end());
+            if (backend->impl.get() == active)
+                synchronize(*backend);
+        }
+    selectBackend();
+    invalidateCache();
+}
+
+void AutoCustomSummationImpl::setParameter(const string &name, double value) {
+    overallParameters[name] = value;
+    for (Backend *backend : {&nativeBackend, &deviceBackend})
+        if (backend->impl)
+            backend->impl->setParameter(name, value);
+    invalidateCache();
+}
+
+void AutoCustomSummationImpl::setCompactSupport(const vector<int> &centerParameters, int radiusParameter) {
+    supportCenters = centerParameters;
+    supportRadius = radiusParameter;
+    supportWidth = -1;
+    for (Backend *backend : {&nativeBackend, &deviceBackend})
+        if (backend->impl)
+            backend->impl->setCompactSupport(centerParameters, radiusParameter);
+    invalidateCache();
+}
+
+void AutoCustomSummationImpl::setGaussianSupport(const vector<int> &centerParameters, int widthParameter, int heightParameter, double tolerance) {
+    supportCenters = centerParameters;
+    supportRadius = -1;
+    supportWidth = widthParameter;
+    supportHeight = heightParameter;
+    supportTolerance = tolerance;
+    for (Backend *backend : {&nativeBackend, &deviceBackend})
+        if (backend->impl)
+            backend->impl->setGaussianSupport(centerParameters, widthParameter, heightParameter, tolerance);
+    invalidateCache();
+}
+
+void AutoCustomSummationImpl::setGrid(const vector<double> &minValues, const vector<double> &maxValues, const vector<int> &numPoints) {
+    gridMinValues = minValues;
+    gridMaxValues = maxValues;
+    gridPoints = numPoints;
+    for (Backend *backend : {&nativeBackend, &deviceBackend})
+        if (backend->impl)
+            backend->impl->setGrid(minValues, maxValues, numPoints);
+    invalidateCache();
+}
@@ -0,0 +1,271 @@
+/* -------------------------------------------------------------------------- *
+ *                             OpenMM Laboratory                              *
+ *                             =================                              *
+ *                                                                            *
+ * A plugin for testing low-level code implementation for OpenMM.             *
+ *                                                                            *
+ * Copyright (c) 2023 Charlles Abreu                                          *
+ * https://github.com/craabreu/openmm-lab                                     *
+ * -------------------------------------------------------------------------- */
+
+#include "internal/ContextCustomSummationImpl.h"
+#include "openmm/Context.h"
+#include "openmm/OpenMMException.h"
+#include "openmm/Platform.h"
+#include "openmm/State.h"
+#include "openmm/System.h"
+#include "openmm/Vec3.h"
+#include "openmm/VerletIntegrator.h"
+#include "openmm/internal/AssertionUtilities.h"
+#include "openmm/internal/ContextImpl.h"
+
+#include <algorithm>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+using namespace OpenMM;
+using namespace OpenMMLab;
+using namespace std;
+
+ContextCustomSummationImpl::ContextCustomSummationImpl(
+    int numArgs,
+    string expression,
+    map<string, double> overallParameters,
+    vector<string> perTermParameters,
+    Platform &platform,
+    map<string, string> platformProperties,
+    int pointsPerTerm
+) : CustomSummationImpl(numArgs, pointsPerTerm),
+    expression(expression),
+    overallParameters(overallParameters),
+    perTermParameters(perTermParameters),
+    platform(&platform),
+    platformProperties(platformProperties),
+    numTerms(0),
+    termCapacity(0),
+    batchContext(NULL),
+    batchForce(NULL),
+    batchCapacity(0),
+    batchIsUpToDate(false)
+{
+    // Every bond of the force is a slot that can hold a term. Slots beyond the number
+    // of terms are disabled by a per-bond mask, so that terms can be appended without
+    // reinitializing the context as long as there are free slots.
+    int numParticles = (numArgs + 2) / 3;
+    int bondSize = (pointsPerTerm > 0 ? pointsPerTerm : numParticles);
+    positions.resize(numParticles, Vec3(0, 0, 0));
+    force = new CustomCompoundBondForce(bondSize, maskedExpression());
+    force->setUsesPeriodicBoundaryConditions(false);
+    for (const auto& pair : overallParameters)
+        force->addGlobalParameter(pair.first, pair.second);
+    for (const auto& name : perTermParameters)
+        force->addPerBondParameter(name);
+    force->addPerBondParameter("termMask");
+    System *system = new System();
+    for (int i = 0; i < numParticles; i++)
+        system->addParticle(1.0);
+    for (int i = 0; i < bondSize; i++)
+        particles.push_back(i);
+    system->addForce(static_cast<Force *>(force));
+    VerletIntegrator *integrator = new VerletIntegrator(0.01);
+    context = new Context(*system, *integrator, platform, platformProperties);
+};
+
+ContextCustomSummationImpl::~ContextCustomSummationImpl() {
+    delete context; // will delete the system, integrator, and force
+    if (batchContext != NULL)
+        delete batchContext;
+}
+
+string ContextCustomSummationImpl::maskedExpression() const {
+    return "select(termMask, summationTerm, 0); summationTerm=" + expression;
+}
+
+vector<double> ContextCustomSummationImpl::slotParameters(int slot) const {
+    vector<double> parameters;
+    if (slot < numTerms) {
+        parameters = termParameters[slot];
+        parameters.push_back(1.0);
+    }
+    else {
+        // Copy the parameters of an actual term to prevent the masked expression from
+        // producing non-finite values.
+        if (numTerms > 0)
+            parameters = termParameters[0];
+        else
+            parameters.resize(perTermParameters.size(), 0.0);
+        parameters.push_back(0.0);
+    }
+    return parameters;
+}
+
+vector<int> ContextCustomSummationImpl::slotParticles(int slot) const {
+    // Slots without a term keep the particles they already have, so that removing a
+    // term never changes the particles of a bond.
+    if (pointsPerTerm == 0)
+        return particles;
+    if (slot < numTerms)
+        return termPoints[slot];
+    if (slot < force->getNumBonds()) {
+        vector<int> bondParticles;
+        vector<double> bondParameters;
+        force->getBondParameters(slot, bondParticles, bondParameters);
+        return bondParticles;
+    }
+    return particles;
+}
+
+void ContextCustomSummationImpl::setArguments(const double *arguments) {
+    // OpenMM only accepts positions as Vec3, so the arguments are scattered into a
+    // persistent vector rather than a new one.
+    for (int i = 0; i < numArgs; i++)
+        positions[i / 3][i % 3] = arguments[i];
+    context->setPositions(positions);
+}
+
+double ContextCustomSummationImpl::computeValue() {
+    return context->getState(State::Energy).getPotentialEnergy();
+}
+
+void ContextCustomSummationImpl::computeDerivatives(vector<double> &derivatives) {
+    State state = context->getState(State::Forces);
+    const vector<Vec3>& forces = state.getForces();
+    for (int i = 0; i < numArgs; i++)
+        derivatives[i] = -forces[i / 3][i % 3];
+}
+
+double ContextCustomSummationImpl::computeValueAndDerivatives(vector<double> &derivatives) {
+    State state = context->getState(State::Energy | State::Forces);
+    const vector<Vec3>& forces = state.getForces();
+    for (int i = 0; i < numArgs; i++)
+        derivatives[i] = -forces[i / 3][i % 3];
+    return state.getPotentialEnergy();
+}
+
+void ContextCustomSummationImpl::createBatchContext(int numPoints) {
+    // Each point occupies a block of particles whose last one is a dummy particle
+    // located at x = 1. Multiplying every term by the x coordinate of this particle
+    // makes the value of the summation at each point available as the negative
+    // x component of the force acting on the dummy particle.
+    if (batchContext != NULL)
+        delete batchContext;
+    int numParticles = (numArgs + 2) / 3;
+    int blockSize = numParticles + 1;
+    int bondSize = force->getNumParticlesPerBond() + 1;
+    batchForce = new CustomCompoundBondForce(
+        bondSize,
+        "x" + to_string(bondSize) + "*batchTerm; batchTerm=" + maskedExpression()
+    );
+    batchForce->setUsesPeriodicBoundaryConditions(false);
+    for (const auto& pair : overallParameters)
+        batchForce->addGlobalParameter(pair.first, pair.second);
+    for (const auto& name : perTermParameters)
+        batchForce->addPerBondParameter(name);
+    batchForce->addPerBondParameter("termMask");
+    System *system = new System();
+    batchPositions.resize(numPoints * blockSize, Vec3(0, 0, 0));
+    vector<vector<int>> allSlotParticles;
+    for (int slot = 0; slot < termCapacity; slot++)
+        allSlotParticles.push_back(slotParticles(slot));
+    vector<int> bondParticles(bondSize);
+    for (int k = 0; k < numPoints; k++) {
+        for (int i = 0; i < blockSize; i++)
+            system->addParticle(1.0);
+        batchPositions[k * blockSize + numParticles] = Vec3(1, 0, 0);
+        bondParticles[bondSize - 1] = k * blockSize + numParticles;
+        for (int slot = 0; slot < termCapacity; slot++) {
+            for (int i = 0; i < bondSize - 1; i++)
+                bondParticles[i] = k * blockSize + allSlotParticles[slot][i];
+            batchForce->addBond(bondParticles, slotParameters(slot));
+        }
+    }
+    system->addForce(static_cast<Force *>(batchForce));
+    VerletIntegrator *integrator = new VerletIntegrator(0.01);
+    batchContext = new Context(*system, *integrator, *platform, platformProperties);
+    batchCapacity = numPoints;
+    batchIsUpToDate = true;
+}
+
+void ContextCustomSummationImpl::evaluateBatch(const double *arguments, int numPoints, double *values, double *gradients) {
+    if (numPoints <= 0)
+        return;
+    if (!batchIsUpToDate || numPoints > batchCapacity)
+        createBatchContext(max(numPoints, batchCapacity));
+    int numParticles = (numArgs + 2) / 3;
+    int blockSize = numParticles + 1;
+    for (int k = 0; k < numPoints; k++)
+        for (int i = 0; i < numArgs; i++)
+            batchPositions[k * blockSize + i / 3][i % 3] = arguments[k * numArgs + i];
+    batchContext->setPositions(batchPositions);
+    vector<Vec3> forces = batchContext->getState(State::Forces).getForces();
+    for (int k = 0; k < numPoints; k++) {
+        values[k] = -forces[k * blockSize + numParticles][0];
+        if (gradients != NULL)
+            for (int i = 0; i < numArgs; i++)
+                gradients[k * numArgs + i] = -forces[k * blockSize + i / 3][i % 3];
+    }
+}
+
+void ContextCustomSummationImpl::update(const vector<vector<double>> &parameters, const set<int> &terms) {
+    // Slots of terms that have been removed must be masked out as well.
+
+    set<int> modifiedTerms = terms;
+    for (int slot = parameters.size(); slot < numTerms; slot++)
+        modifiedTerms.insert(slot);
+    termParameters = parameters;
+    numTerms = parameters.size();
+    invalidateCache();
+
+    // OpenMM cannot change the particles of a bond without reinitializing the context,
+    // which is therefore needed whenever a term has moved to other points.
+
+    bool pointsChanged = false;
+    if (pointsPerTerm > 0)
+        for (int slot : modifiedTerms) {
+            if (slot >= min(numTerms, force->getNumBonds()))
+                break;
+            vector<int> bondParticles;
+            vector<double> bondParameters;
+            force->getBondParameters(slot, bondParticles, bondParameters);
+            if (bondParticles != termPoints[slot]) {
+                pointsChanged = true;
+                break;
+            }
+        }
+    if (numTerms > termCapacity || pointsChanged) {
+        // Grow the number of slots geometrically, so that reinitializations become
+        // increasingly rare as terms are appended.
+        if (numTerms > termCapacity)
+            termCapacity = max(numTerms, 2 * termCapacity);
+        for (int slot = 0; slot < force->getNumBonds(); slot++)
+            force->setBondParameters(slot, slotParticles(slot), slotParameters(slot));
+        for (int slot = force->getNumBonds(); slot < termCapacity; slot++)
+            force->addBond(slotParticles(slot), slotParameters(slot));
+        context->reinitialize();
+        batchIsUpToDate = false;
+        return;
+    }
+    for (int slot : modifiedTerms)
+        force->setBondParameters(slot, slotParticles(slot), slotParameters(slot));
+    force->updateParametersInContext(*context);
+    if (batchContext != NULL && batchIsUpToDate) {
+        for (int k = 0; k < batchCapacity; k++)
+            for (int slot : modifiedTerms) {
+                vector<int> blockParticles;
+                vector<double> oldParameters;
+                batchForce->getBondParameters(k * termCapacity + slot, blockParticles, oldParameters);
+                batchForce->setBondParameters(k * termCapacity + slot, blockParticles, slotParameters(slot));
+            }
+        batchForce->updateParametersInContext(*batchContext);
+    }
+}
+
+void ContextCustomSummationImpl::setParameter(const string &name, double value) {
+    context->setParameter(name, value);
+    invalidateCache();
+    overallParameters[name] = value;
+    if (batchContext != NULL)
+        batchContext->setParameter(name, value);
+}
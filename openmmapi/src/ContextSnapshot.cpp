@@ -0,0 +1,270 @@
+/* -------------------------------------------------------------------------- *
+ *                             OpenMM Laboratory                              *
+ *                             =================                              *
+ *                                                                            *
+ * A plugin for testing low-level code implementation for OpenMM.             *
+ *                                                                            *
+ * Copyright (c) 2023 Charlles Abreu                                          *
+ * https://github.com/craabreu/openmm-lab                                     *
+ * -------------------------------------------------------------------------- */
+
+#include "ContextSnapshot.h"
+#include "ExtendedCustomCVForce.h"
+#include "SlicedNonbondedForce.h"
+#include "internal/TracingRange.h"
+#include "openmm/OpenMMException.h"
+#include "openmm/State.h"
+#include "openmm/System.h"
+
+#include <cstdint>
+#include <cstring>
+#include <istream>
+#include <map>
+#include <ostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using namespace OpenMM;
+using namespace OpenMMLab;
+using namespace std;
+
+/**
+ * A snapshot starts with a magic string, the version of the format, a marker of the byte
+ * order, and the number of particles.  It is followed by the step count, the time, the box
+ * vectors, the positions, the velocities, and the global parameters.  Then come the lambda
+ * states of the SlicedNonbondedForces and the cached results of the collective variables of
+ * the ExtendedCustomCVForces, each preceded by the index of its force in the System.
+ */
+static const char MAGIC[8] = {'O', 'M', 'M', 'L', 'S', 'N', 'A', 'P'};
+static const int32_t FORMAT_VERSION = 1;
+static const int32_t BYTE_ORDER = 0x01020304;
+static const int32_t MAX_COUNT = 1<<24;
+
+template <class T>
+static void write(ostream& stream, const T* data, size_t count) {
+    stream.write((const char*) data, count*sizeof(T));
+}
+
+template <class T>
+static void write(ostream& stream, T value) {
+    write(stream, &value, 1);
+}
+
+template <class T>
+static void read(istream& stream, T* data, size_t count) {
+    if (count > 0 && !stream.read((char*) data, count*sizeof(T)))
+        throw OpenMMException("ContextSnapshot: the snapshot is truncated");
+}
+
+template <class T>
+static T read(istream& stream) {
+    T value;
+    read(stream, &value, 1);
+    return value;
+}
+
+static int32_t readCount(istream& stream) {
+    int32_t count = read<int32_t>(stream);
+    if (count < 0 || count > MAX_COUNT)
+        throw OpenMMException("ContextSnapshot: the snapshot is corrupted");
+    return count;
+}
+
+static int32_t readForceIndex(istream& stream, const System& system) {
+    int32_t index = read<int32_t>(stream);
+    if (index < 0 || index >= system.getNumForces())
+        throw OpenMMException("ContextSnapshot: the snapshot refers to a force that does not exist");
+    return index;
+}
+
+void ContextSnapshot::save(Context& context, ostream& stream) {
+    OPENMMLAB_TRACE_RANGE("ContextSnapshot::save");
+    const System& system = context.getSystem();
+    State state = context.getState(State::Positions | State::Velocities | State::Parameters);
+    int numParticles = system.getNumParticles();
+    write(stream, MAGIC, sizeof(MAGIC));
+    write<int32_t>(stream, FORMAT_VERSION);
+    write<int32_t>(stream, BYTE_ORDER);
+    write<int32_t>(stream, numParticles);
+    write<int64_t>(stream, state.getStepCount());
+    write<double>(stream, state.getTime());
+    Vec3 box[3];
+    state.getPeriodicBoxVectors(box[0], box[1], box[2]);
+    write(stream, &box[0][0], 9);
+    if (numParticles > 0) {
+        write(stream, &state.getPositions()[0][0], 3*numParticles);
+        write(stream, &state.getVelocities()[0][0], 3*numParticles);
+    }
+    const map<string, double>& parameters = state.getParameters();
+    write<int32_t>(stream, parameters.size());
+    for (auto& parameter : parameters) {
+        write<int32_t>(stream, parameter.first.size());
+        write(stream, parameter.first.data(), parameter.first.size());
+        write<double>(stream, parameter.second);
+    }
+
+    // Only the SlicedNonbondedForces that have selected a lambda state are recorded.
+
+    vector<pair<int, int> > lambdaStates;
+    vector<int> cvForces;
+    for (int i = 0; i < system.getNumForces(); i++) {
+        Force& force = const_cast<Force&>(system.getForce(i));
+        SlicedNonbondedForce* sliced = dynamic_cast<SlicedNonbondedForce*>(&force);
+        if (sliced != NULL) {
+            int index = sliced->getLambdaStateInContext(context);
+            if (index >= 0)
+                lambdaStates.push_back(make_pair(i, index));
+        }
+        if (dynamic_cast<ExtendedCustomCVForce*>(&force) != NULL)
+            cvForces.push_back(i);
+    }
+    write<int32_t>(stream, lambdaStates.size());
+    for (auto& lambdaState : lambdaStates) {
+        write<int32_t>(stream, lambdaState.first);
+        write<int32_t>(stream, lambdaState.second);
+    }
+    write<int32_t>(stream, cvForces.size());
+    vector<long long> steps;
+    vector<double> values;
+    vector<vector<double> > derivatives;
+    for (int index : cvForces) {
+        ExtendedCustomCVForce& force = dynamic_cast<ExtendedCustomCVForce&>(const_cast<Force&>(system.getForce(index)));
+        force.getCollectiveVariableCacheInContext(context, steps, values, derivatives);
+        write<int32_t>(stream, index);
+        write<int32_t>(stream, steps.size());
+        for (int i = 0; i < steps.size(); i++) {
+            write<int64_t>(stream, steps[i]);
+            write<double>(stream, values[i]);
+            write<int32_t>(stream, derivatives[i].size());
+            write(stream, derivatives[i].data(), derivatives[i].size());
+        }
+    }
+    if (!stream)
+        throw OpenMMException("ContextSnapshot: failed to write the snapshot");
+}
+
+void ContextSnapshot::load(Context& context, istream& stream) {
+    OPENMMLAB_TRACE_RANGE("ContextSnapshot::load");
+
+    // The whole snapshot is read and checked against the Context before the Context is
+    // modified, so that a truncated, corrupted, or mismatched snapshot leaves it as it was.
+
+    const System& system = context.getSystem();
+    char magic[sizeof(MAGIC)];
+    read(stream, magic, sizeof(MAGIC));
+    if (memcmp(magic, MAGIC, sizeof(MAGIC)) != 0 || read<int32_t>(stream) != FORMAT_VERSION)
+        throw OpenMMException("ContextSnapshot: the data is not a snapshot");
+    if (read<int32_t>(stream) != BYTE_ORDER)
+        throw OpenMMException("ContextSnapshot: the snapshot was saved on a machine with a different byte order");
+    int numParticles = read<int32_t>(stream);
+    if (numParticles != system.getNumParticles())
+        throw OpenMMException("ContextSnapshot: the snapshot has "+to_string(numParticles)+" particles, but the System has "+
+                              to_string(system.getNumParticles()));
+    long long step = read<int64_t>(stream);
+    double time = read<double>(stream);
+    Vec3 box[3];
+    read(stream, &box[0][0], 9);
+    vector<Vec3> positions(numParticles), velocities(numParticles);
+    if (numParticles > 0) {
+        read(stream, &positions[0][0], 3*numParticles);
+        read(stream, &velocities[0][0], 3*numParticles);
+    }
+    int numParameters = readCount(stream);
+    vector<pair<string, double> > parameters(numParameters);
+    for (auto& parameter : parameters) {
+        parameter.first.resize(readCount(stream));
+        read(stream, &parameter.first[0], parameter.first.size());
+        parameter.second = read<double>(stream);
+        if (context.getParameters().count(parameter.first) == 0)
+            throw OpenMMException("ContextSnapshot: the snapshot has a parameter '"+parameter.first+"' that the Context does not have");
+    }
+    map<int, int> lambdaStates;
+    int numLambdaStates = readCount(stream);
+    for (int i = 0; i < numLambdaStates; i++) {
+        int index = readForceIndex(stream, system);
+        const SlicedNonbondedForce* sliced = dynamic_cast<const SlicedNonbondedForce*>(&system.getForce(index));
+        if (sliced == NULL)
+            throw OpenMMException("ContextSnapshot: the snapshot does not match the forces of the System");
+        int state = read<int32_t>(stream);
+        if (state < 0 || state >= sliced->getNumForeignScalingParameterSets())
+            throw OpenMMException("ContextSnapshot: the snapshot has a lambda state that the force does not have");
+        lambdaStates[index] = state;
+    }
+    int numCVForces = readCount(stream);
+    vector<int> cvForces(numCVForces);
+    vector<vector<long long> > steps(numCVForces);
+    vector<vector<double> > values(numCVForces);
+    vector<vector<vector<double> > > derivatives(numCVForces);
+    for (int i = 0; i < numCVForces; i++) {
+        cvForces[i] = readForceIndex(stream, system);
+        if (dynamic_cast<const ExtendedCustomCVForce*>(&system.getForce(cvForces[i])) == NULL)
+            throw OpenMMException("ContextSnapshot: the snapshot does not match the forces of the System");
+        int numCVs = readCount(stream);
+        const ExtendedCustomCVForce& force = dynamic_cast<const ExtendedCustomCVForce&>(system.getForce(cvForces[i]));
+        if (numCVs != 0 && numCVs != force.getNumCollectiveVariables())
+            throw OpenMMException("ContextSnapshot: the snapshot does not match the forces of the System");
+        steps[i].resize(numCVs);
+        values[i].resize(numCVs);
+        derivatives[i].resize(numCVs);
+        for (int j = 0; j < numCVs; j++) {
+            steps[i][j] = read<int64_t>(stream);
+            values[i][j] = read<double>(stream);
+            derivatives[i][j].resize(readCount(stream));
+            read(stream, derivatives[i][j].data(), derivatives[i][j].size());
+        }
+    }
+
+    // Set the state of the Context.  The box comes before the positions, which are not
+    // wrapped into it.
+
+    context.setTime(time);
+    context.setStepCount(step);
+    context.setPeriodicBoxVectors(box[0], box[1], box[2]);
+    context.setPositions(positions);
+    context.setVelocities(velocities);
+    for (auto& parameter : parameters)
+        context.setParameter(parameter.first, parameter.second);
+
+    // A SlicedNonbondedForce absent from the snapshot follows the scaling parameters of the
+    // Context.  It is only switched if needed, since platforms without lambda states cannot
+    // even select -1.
+
+    for (int i = 0; i < system.getNumForces(); i++) {
+        SlicedNonbondedForce* sliced = dynamic_cast<SlicedNonbondedForce*>(&const_cast<Force&>(system.getForce(i)));
+        if (sliced == NULL)
+            continue;
+        int index = (lambdaStates.find(i) == lambdaStates.end() ? -1 : lambdaStates[i]);
+        if (sliced->getLambdaStateInContext(context) != index)
+            sliced->setLambdaStateInContext(context, index);
+    }
+
+    // The results kept by an ExtendedCustomCVForce absent from the snapshot are discarded,
+    // since they belong to the previous state of the Context.
+
+    map<int, int> cvForceSnapshots;
+    for (int i = 0; i < numCVForces; i++)
+        cvForceSnapshots[cvForces[i]] = i;
+    for (int i = 0; i < system.getNumForces(); i++) {
+        ExtendedCustomCVForce* force = dynamic_cast<ExtendedCustomCVForce*>(&const_cast<Force&>(system.getForce(i)));
+        if (force == NULL)
+            continue;
+        auto snapshot = cvForceSnapshots.find(i);
+        if (snapshot == cvForceSnapshots.end())
+            force->setCollectiveVariableCacheInContext(context, vector<long long>(), vector<double>(), vector<vector<double> >());
+        else
+            force->setCollectiveVariableCacheInContext(context, steps[snapshot->second], values[snapshot->second],
+                                                       derivatives[snapshot->second]);
+    }
+}
+
+string ContextSnapshot::saveToString(Context& context) {
+    stringstream stream;
+    save(context, stream);
+    return stream.str();
+}
+
+void ContextSnapshot::loadFromString(Context& context, const string& snapshot) {
+    stringstream stream(snapshot);
+    load(context, stream);
+}
@@ -12,15 +12,81 @@
 #include "openmm/OpenMMException.h"
 #include "openmm/Platform.h"
 #include "openmm/internal/AssertionUtilities.h"
+#include "internal/TracingRange.h"
 
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <atomic>
 #include <map>
+#include <memory>
+#include <mutex>
+#include <set>
 #include <string>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 
 using namespace OpenMM;
 using namespace OpenMMLab;
 using namespace std;
 
+static atomic<long long> nextSerialNumber(0);
+
+static const size_t MinThreadImplPruneSize = 16;
+static thread_local bool threadImplsDestroyed = false;
+
+/**
+ * The implementations used by each thread, keyed by the serial numbers of the summations,
+ * together with the pools that own them (see CustomSummation::getImpl()).  Entries whose
+ * pools were released are pruned when the table has doubled in size since the last pruning.
+ *
+ * A summation can outlive the table of a thread, if it is a static object or a thread_local
+ * object destroyed after the table.  The table then marks itself as destroyed, which is
+ * possible because the flag has no destructor, and such summations stop using it.  The raw
+ * pointers are only dereferenced by the summation whose pool owns them, so they never dangle.
+ */
+class ThreadImplTable {
+public:
+    ~ThreadImplTable() {
+        threadImplsDestroyed = true;
+    }
+    void erase(long long serialNumber) {
+        entries.erase(serialNumber);
+    }
+    void prune() {
+        if (entries.size() < pruneSize)
+            return;
+        for (auto entry = entries.begin(); entry != entries.end(); )
+            if (entry->second.first.expired())
+                entry = entries.erase(entry);
+            else
+                entry++;
+        pruneSize = max(MinThreadImplPruneSize, 2*entries.size());
+    }
+    unordered_map<long long, pair<weak_ptr<void>, CustomSummationImpl*>> entries;
+private:
+    size_t pruneSize = MinThreadImplPruneSize;
+};
+
+static thread_local ThreadImplTable threadImpls;
+
+/**
+ * The per-thread implementations of a summation, which are shared between the
+ * summation and its clones until one of them is modified.
+ */
+class CustomSummation::ImplPool {
+public:
+    ~ImplPool() {
+        for (auto& pair : impls) {
+            pair.second->finishPendingBatches();
+            delete pair.second;
+        }
+    }
+    map<thread::id, CustomSummationImpl*> impls;
+    mutex lock;
+};
+
 CustomSummation::CustomSummation(
     int numArgs,
     string expression,
@@ -32,61 +98,353 @@ CustomSummation::CustomSummation(
     expression(expression),
     overallParameters(overallParameters),
     perTermParameters(perTermParameters),
+    pointsPerTerm(0),
     platform(&platform),
-    platformProperties(platformProperties)
+    platformProperties(platformProperties),
+    serialNumber(nextSerialNumber++),
+    cacheSize(8),
+    supportRadius(-1),
+    supportWidth(-1),
+    supportHeight(-1),
+    supportTolerance(0.0),
+    coalescingWeight(-1),
+    coalescingTolerance(0.0),
+    coalescingKeysValid(false),
+    pool(make_shared<ImplPool>())
 {
-    impl = new CustomSummationImpl(
+    pool->impls[this_thread::get_id()] = CustomSummationImpl::create(
         numArgs, expression, overallParameters, perTermParameters, platform, platformProperties
     );
 }
 
+CustomSummation::CustomSummation(const CustomSummation &other) :
+    numArgs(other.numArgs),
+    expression(other.expression),
+    overallParameters(other.overallParameters),
+    perTermParameters(other.perTermParameters),
+    termParameters(other.termParameters),
+    pointsPerTerm(other.pointsPerTerm),
+    termPoints(other.termPoints),
+    platform(other.platform),
+    platformProperties(other.platformProperties),
+    serialNumber(nextSerialNumber++),
+    cacheSize(other.cacheSize),
+    supportCenters(other.supportCenters),
+    supportRadius(other.supportRadius),
+    supportWidth(other.supportWidth),
+    supportHeight(other.supportHeight),
+    supportTolerance(other.supportTolerance),
+    gridMinValues(other.gridMinValues),
+    gridMaxValues(other.gridMaxValues),
+    gridPoints(other.gridPoints),
+    updatedTermParameters(other.termParameters),
+    updatedTermPoints(other.termPoints),
+    coalescingWeight(other.coalescingWeight),
+    coalescingTolerance(other.coalescingTolerance),
+    coalescingKeysValid(false)
+{
+    // The implementations can only be shared if they are up to date with all terms,
+    // since the clone starts with no pending modifications.
+
+    if (other.modifiedTerms.empty())
+        pool = other.pool;
+    else
+        pool = make_shared<ImplPool>();
+}
+
 CustomSummation::~CustomSummation() {
-    delete impl;
+    if (!threadImplsDestroyed)
+        threadImpls.erase(serialNumber);
+}
+
+void CustomSummation::detachImpls() {
+    // A new serial number makes every thread look the implementations up again, so that
+    // none of them keeps using the ones that are still shared with other clones.
+
+    if (pool.use_count() > 1) {
+        if (!threadImplsDestroyed)
+            threadImpls.erase(serialNumber);
+        pool = make_shared<ImplPool>();
+        serialNumber = nextSerialNumber++;
+    }
+}
+
+CustomSummationImpl* CustomSummation::getImpl() const {
+    // Every thread gets its own implementation, with its own caches and workspace,
+    // so that concurrent evaluations do not interfere with each other. Each thread
+    // also keeps a private table of the implementations it uses, keyed by serial
+    // numbers that are never reused, so that the lock is only taken the first time
+    // a thread evaluates a given summation. Entries left behind by summations that were
+    // destroyed or detached in other threads are pruned lazily once their pools are released.
+    bool useTable = !threadImplsDestroyed;
+    if (useTable) {
+        auto found = threadImpls.entries.find(serialNumber);
+        if (found != threadImpls.entries.end())
+            return found->second.second;
+        threadImpls.prune();
+    }
+    lock_guard<mutex> lock(pool->lock);
+    thread::id id = this_thread::get_id();
+    auto it = pool->impls.find(id);
+    if (it != pool->impls.end()) {
+        if (useTable)
+            threadImpls.entries[serialNumber] = make_pair(weak_ptr<void>(pool), it->second);
+        return it->second;
+    }
+    CustomSummationImpl* impl = CustomSummationImpl::create(
+        numArgs, expression, overallParameters, perTermParameters, *platform, platformProperties, pointsPerTerm
+    );
+    set<int> allTerms;
+    for (int i = 0; i < updatedTermParameters.size(); i++)
+        allTerms.insert(i);
+    impl->setTermPoints(updatedTermPoints);
+    impl->update(updatedTermParameters, allTerms);
+    impl->setCacheSize(cacheSize);
+    if (supportRadius >= 0)
+        impl->setCompactSupport(supportCenters, supportRadius);
+    if (supportWidth >= 0)
+        impl->setGaussianSupport(supportCenters, supportWidth, supportHeight, supportTolerance);
+    if (!gridPoints.empty())
+        impl->setGrid(gridMinValues, gridMaxValues, gridPoints);
+    pool->impls[id] = impl;
+    if (useTable)
+        threadImpls.entries[serialNumber] = make_pair(weak_ptr<void>(pool), impl);
+    return impl;
+}
+
+CustomSummationImpl* CustomSummation::getIdleImpl() const {
+    // Batches submitted by this thread are evaluated by a worker thread, so they must
+    // finish before the implementation is used directly.
+    CustomSummationImpl* impl = getImpl();
+    impl->finishPendingBatches();
+    return impl;
 }
 
 double CustomSummation::evaluate(const double* arguments) const {
-    return impl->evaluate(vector<double>(arguments, arguments + numArgs));
+    OPENMMLAB_TRACE_RANGE("CustomSummation::evaluate");
+    return getIdleImpl()->evaluate(arguments);
 }
 
 double CustomSummation::evaluate(const vector<double> &arguments) const {
-    return impl->evaluate(arguments);
+    OPENMMLAB_TRACE_RANGE("CustomSummation::evaluate");
+    return getIdleImpl()->evaluate(arguments.data());
 }
 
 double CustomSummation::evaluateDerivative(const double* arguments, const int* derivOrder) const {
-    vector<int> order(derivOrder, derivOrder + numArgs);
-    int which;
-    int acc = 0;
+    int which[2];
+    int order = 0;
     for (int i = 0; i < numArgs; i++) {
-        int item = order[i];
-        if (item < 0 || (acc += item) > 1)
+        if (derivOrder[i] < 0 || order+derivOrder[i] > 2)
             throwException(__FILE__, __LINE__, "Invalid derivative order specification");
-        if (item == 1)
-            which = i;
+        for (int k = 0; k < derivOrder[i]; k++)
+            which[order++] = i;
+    }
+    OPENMMLAB_TRACE_RANGE("CustomSummation::evaluateDerivative");
+    if (order == 0)
+        return getIdleImpl()->evaluate(arguments);
+    if (order == 1)
+        return getIdleImpl()->evaluateDerivatives(arguments)[which[0]];
+
+    // Second derivatives are rare enough for the copies to be irrelevant.
+
+    vector<double> args(arguments, arguments + numArgs), result;
+    if (which[0] == which[1]) {
+        getIdleImpl()->evaluateHessianDiagonal(args, result);
+        return result[which[0]];
     }
-    vector<double> args(arguments, arguments + numArgs);
-    return impl->evaluateDerivatives(args)[which];
+    vector<double> direction(numArgs, 0.0);
+    direction[which[1]] = 1.0;
+    getIdleImpl()->evaluateHessianProduct(args, direction, result);
+    return result[which[0]];
 }
 
 double CustomSummation::evaluateDerivative(const vector<double> &arguments, int which) const {
-    return impl->evaluateDerivatives(arguments)[which];
+    OPENMMLAB_TRACE_RANGE("CustomSummation::evaluateDerivative");
+    return getIdleImpl()->evaluateDerivatives(arguments.data())[which];
+}
+
+void CustomSummation::evaluateGradient(const double *arguments, double *gradient) const {
+    OPENMMLAB_TRACE_RANGE("CustomSummation::evaluateGradient");
+    const vector<double>& derivatives = getIdleImpl()->evaluateDerivatives(arguments);
+    copy(derivatives.begin(), derivatives.end(), gradient);
+}
+
+double CustomSummation::evaluateWithDerivatives(const vector<double> &arguments, vector<double> &derivatives) const {
+    OPENMMLAB_TRACE_RANGE("CustomSummation::evaluateWithDerivatives");
+    return getIdleImpl()->evaluateWithDerivatives(arguments.data(), derivatives);
+}
+
+void CustomSummation::evaluateBatch(const double *arguments, int numPoints, double *values, double *gradients) const {
+    OPENMMLAB_TRACE_RANGE("CustomSummation::evaluateBatch");
+    getIdleImpl()->evaluateBatch(arguments, numPoints, values, gradients);
+}
+
+void CustomSummation::evaluateHessianProduct(const vector<double> &arguments, const vector<double> &direction, vector<double> &product) const {
+    ASSERT_EQUAL(arguments.size(), numArgs);
+    ASSERT_EQUAL(direction.size(), numArgs);
+    OPENMMLAB_TRACE_RANGE("CustomSummation::evaluateHessianProduct");
+    getIdleImpl()->evaluateHessianProduct(arguments, direction, product);
+}
+
+void CustomSummation::evaluateHessianDiagonal(const vector<double> &arguments, vector<double> &diagonal) const {
+    ASSERT_EQUAL(arguments.size(), numArgs);
+    OPENMMLAB_TRACE_RANGE("CustomSummation::evaluateHessianDiagonal");
+    getIdleImpl()->evaluateHessianDiagonal(arguments, diagonal);
+}
+
+void CustomSummation::submitBatch(const double *arguments, int numPoints, bool includeGradients) const {
+    OPENMMLAB_TRACE_RANGE("CustomSummation::submitBatch");
+    getImpl()->submitBatch(arguments, numPoints, includeGradients);
+}
+
+int CustomSummation::collectBatch(double *values, double *gradients) const {
+    OPENMMLAB_TRACE_RANGE("CustomSummation::collectBatch");
+    return getImpl()->collectBatch(values, gradients);
+}
+
+int CustomSummation::getNumPendingBatches() const {
+    return getImpl()->getNumPendingBatches();
+}
+
+int CustomSummation::getPendingBatchSize() const {
+    return getImpl()->getPendingBatchSize();
 }
 
 CustomSummation* CustomSummation::clone() const {
-    CustomSummation *copy = new CustomSummation(
-        numArgs, expression, overallParameters, perTermParameters, *platform, platformProperties
+    return new CustomSummation(*this);
+}
+
+void CustomSummation::setPointsPerTerm(int numPoints) {
+    if (numPoints < 0 || numPoints > (numArgs + 2) / 3)
+        throw OpenMMException("CustomSummation: the number of points per term must be between 0 and the number of argument points");
+    if (!termParameters.empty() || !updatedTermParameters.empty())
+        throw OpenMMException("CustomSummation: the number of points per term must be set before any terms are added");
+    if (numPoints > 0 && (supportRadius >= 0 || supportWidth >= 0 || !gridPoints.empty()))
+        throw OpenMMException("CustomSummation: terms with their own points cannot have a support or a grid");
+    if (numPoints == pointsPerTerm)
+        return;
+
+    // The backends are created for a fixed number of points per term, so new ones replace
+    // the existing ones. The one of this thread is created right away, so that a backend
+    // that does not support such terms is reported here.
+
+    pointsPerTerm = numPoints;
+    if (!threadImplsDestroyed)
+        threadImpls.erase(serialNumber);
+    pool = make_shared<ImplPool>();
+    serialNumber = nextSerialNumber++;
+    CustomSummationImpl* impl = CustomSummationImpl::create(
+        numArgs, expression, overallParameters, perTermParameters, *platform, platformProperties, pointsPerTerm
     );
-    for (int i = 0; i < getNumTerms(); i++)
-        copy->addTerm(getTerm(i));
-    copy->update();
-    return copy;
+    impl->setCacheSize(cacheSize);
+    pool->impls[this_thread::get_id()] = impl;
+}
+
+void CustomSummation::checkTermPoints(const vector<int> &points) const {
+    if (pointsPerTerm == 0)
+        throw OpenMMException("CustomSummation: the terms do not have their own points");
+    if (points.size() != pointsPerTerm)
+        throw OpenMMException("CustomSummation: every term must have " + to_string(pointsPerTerm) + " points");
+    for (int point : points)
+        if (point < 0 || point >= (numArgs + 2) / 3)
+            throw OpenMMException("CustomSummation: illegal point index " + to_string(point));
 }
 
 int CustomSummation::addTerm(const vector<double> &parameters) {
     ASSERT_EQUAL(parameters.size(), perTermParameters.size());
+    if (pointsPerTerm > 0)
+        throw OpenMMException("CustomSummation: the points of every term must be specified");
+    return appendTerm(parameters, vector<int>());
+}
+
+int CustomSummation::addTerm(const vector<double> &parameters, const vector<int> &points) {
+    ASSERT_EQUAL(parameters.size(), perTermParameters.size());
+    checkTermPoints(points);
+    return appendTerm(parameters, points);
+}
+
+vector<double> CustomSummation::getCoalescingKey(const vector<double> &parameters, const vector<int> &points) const {
+    vector<double> key;
+    key.reserve(parameters.size() + points.size());
+    for (int i = 0; i < parameters.size(); i++)
+        if (i != coalescingWeight)
+            key.push_back(coalescingTolerance > 0.0 ? round(parameters[i] / coalescingTolerance) : parameters[i]);
+    key.insert(key.end(), points.begin(), points.end());
+    return key;
+}
+
+int CustomSummation::appendTerm(const vector<double> &parameters, const vector<int> &points) {
+    if (coalescingWeight >= 0) {
+        // The keys are rebuilt after the terms have been modified in other ways, and the
+        // first of several matching terms is the one into which new terms are merged.
+
+        if (!coalescingKeysValid) {
+            coalescingKeys.clear();
+            for (int i = 0; i < termParameters.size(); i++)
+                coalescingKeys.emplace(getCoalescingKey(termParameters[i], getTermPoints(i)), i);
+            coalescingKeysValid = true;
+        }
+        auto inserted = coalescingKeys.emplace(getCoalescingKey(parameters, points), (int) termParameters.size());
+        if (!inserted.second) {
+            int index = inserted.first->second;
+            termParameters[index][coalescingWeight] += parameters[coalescingWeight];
+            modifiedTerms.insert(index);
+            return index;
+        }
+    }
     termParameters.push_back(parameters);
+    if (pointsPerTerm > 0)
+        termPoints.push_back(points);
+    modifiedTerms.insert(termParameters.size() - 1);
     return termParameters.size() - 1;
 }
 
+void CustomSummation::setTerms(const double *parameters, int numTerms) {
+    if (numTerms < 0)
+        throw OpenMMException("CustomSummation: the number of terms cannot be negative");
+    if (pointsPerTerm > 0)
+        throw OpenMMException("CustomSummation: the points of every term must be specified");
+    assignTerms(parameters, numTerms);
+}
+
+void CustomSummation::setTerms(const double *parameters, const int *points, int numTerms) {
+    if (numTerms < 0)
+        throw OpenMMException("CustomSummation: the number of terms cannot be negative");
+    if (pointsPerTerm == 0)
+        throw OpenMMException("CustomSummation: the terms do not have their own points");
+    vector<vector<int>> newPoints(numTerms);
+    for (int i = 0; i < numTerms; i++) {
+        newPoints[i].assign(points + i*pointsPerTerm, points + (i+1)*pointsPerTerm);
+        checkTermPoints(newPoints[i]);
+    }
+    termPoints.swap(newPoints);
+    assignTerms(parameters, numTerms);
+}
+
+void CustomSummation::assignTerms(const double *parameters, int numTerms) {
+    int numParams = perTermParameters.size();
+    if (coalescingWeight >= 0) {
+        // The new terms are added one by one, so that they are merged with one another.
+
+        vector<vector<int>> newPoints;
+        newPoints.swap(termPoints);
+        termParameters.clear();
+        coalescingKeys.clear();
+        coalescingKeysValid = true;
+        for (int i = 0; i < numTerms; i++)
+            appendTerm(vector<double>(parameters + i*numParams, parameters + (i+1)*numParams),
+                       pointsPerTerm > 0 ? newPoints[i] : vector<int>());
+        modifiedTerms.erase(modifiedTerms.lower_bound(termParameters.size()), modifiedTerms.end());
+        return;
+    }
+    termParameters.resize(numTerms);
+    for (int i = 0; i < numTerms; i++) {
+        termParameters[i].assign(parameters + i*numParams, parameters + (i+1)*numParams);
+        modifiedTerms.insert(modifiedTerms.end(), i);
+    }
+    modifiedTerms.erase(modifiedTerms.lower_bound(numTerms), modifiedTerms.end());
+}
+
 const vector<double> &CustomSummation::getTerm(int index) const {
     ASSERT_VALID_INDEX(index, termParameters);
     return termParameters[index];
@@ -94,7 +452,54 @@ const vector<double> &CustomSummation::getTerm(int index) const {
 
 void CustomSummation::setTerm(int index, const vector<double> &parameters) {
     ASSERT_VALID_INDEX(index, termParameters);
+    ASSERT_EQUAL(parameters.size(), perTermParameters.size());
+    termParameters[index] = parameters;
+    modifiedTerms.insert(index);
+    coalescingKeysValid = false;
+}
+
+void CustomSummation::setTerm(int index, const vector<double> &parameters, const vector<int> &points) {
+    ASSERT_VALID_INDEX(index, termParameters);
+    ASSERT_EQUAL(parameters.size(), perTermParameters.size());
+    checkTermPoints(points);
     termParameters[index] = parameters;
+    termPoints[index] = points;
+    modifiedTerms.insert(index);
+    coalescingKeysValid = false;
+}
+
+const vector<int> &CustomSummation::getTermPoints(int index) const {
+    static const vector<int> allPoints;
+    ASSERT_VALID_INDEX(index, termParameters);
+    return (pointsPerTerm > 0 ? termPoints[index] : allPoints);
+}
+
+void CustomSummation::removeTerm(int index) {
+    ASSERT_VALID_INDEX(index, termParameters);
+    int last = termParameters.size() - 1;
+    if (index != last) {
+        termParameters[index].swap(termParameters[last]);
+        if (pointsPerTerm > 0)
+            termPoints[index].swap(termPoints[last]);
+        modifiedTerms.insert(index);
+    }
+    termParameters.pop_back();
+    if (pointsPerTerm > 0)
+        termPoints.pop_back();
+    modifiedTerms.erase(last);
+    coalescingKeysValid = false;
+}
+
+void CustomSummation::removeTerms(const vector<int> &indices) {
+    vector<int> sorted(indices);
+    sort(sorted.begin(), sorted.end(), greater<int>());
+    for (int i = 0; i < sorted.size(); i++) {
+        ASSERT_VALID_INDEX(sorted[i], termParameters);
+        if (i > 0 && sorted[i] == sorted[i-1])
+            throw OpenMMException("CustomSummation: a term cannot be removed more than once");
+    }
+    for (int index : sorted)
+        removeTerm(index);
 }
 
 double CustomSummation::getParameter(const string& name) const {
@@ -109,9 +514,174 @@ void CustomSummation::setParameter(const string &name, double value) {
     if (it == overallParameters.end())
         throw OpenMMException("Unknown parameter '" + name + "'");
     it->second = value;
-    impl->setParameter(name, value);
+    detachImpls();
+    lock_guard<mutex> lock(pool->lock);
+    for (auto& pair : pool->impls) {
+        pair.second->finishPendingBatches();
+        pair.second->setParameter(name, value);
+    }
 }
 
 void CustomSummation::update() {
-    impl->update(termParameters);
+    OPENMMLAB_TRACE_RANGE("CustomSummation::update");
+    detachImpls();
+    lock_guard<mutex> lock(pool->lock);
+    for (auto& pair : pool->impls) {
+        pair.second->finishPendingBatches();
+        pair.second->setTermPoints(termPoints);
+        pair.second->update(termParameters, modifiedTerms);
+    }
+    modifiedTerms.clear();
+    updatedTermParameters = termParameters;
+    updatedTermPoints = termPoints;
+}
+
+int CustomSummation::getPerTermParameterIndex(const string &name) const {
+    auto it = find(perTermParameters.begin(), perTermParameters.end(), name);
+    if (it == perTermParameters.end())
+        throw OpenMMException("CustomSummation: unknown per-term parameter '" + name + "'");
+    return (int) (it - perTermParameters.begin());
+}
+
+void CustomSummation::setCompactSupport(const vector<string> &centerParameters, const string &radiusParameter) {
+    if (centerParameters.size() != numArgs)
+        throw OpenMMException("CustomSummation: the number of center parameters must equal the number of arguments");
+    if (pointsPerTerm > 0)
+        throw OpenMMException("CustomSummation: terms with their own points cannot have a support or a grid");
+    supportCenters.clear();
+    for (const string& name : centerParameters)
+        supportCenters.push_back(getPerTermParameterIndex(name));
+    supportRadius = getPerTermParameterIndex(radiusParameter);
+    supportWidth = -1;
+    detachImpls();
+    lock_guard<mutex> lock(pool->lock);
+    for (auto& pair : pool->impls) {
+        pair.second->finishPendingBatches();
+        pair.second->setCompactSupport(supportCenters, supportRadius);
+    }
+}
+
+bool CustomSummation::getCompactSupport(vector<string> &centerParameters, string &radiusParameter) const {
+    if (supportRadius < 0)
+        return false;
+    centerParameters.clear();
+    for (int index : supportCenters)
+        centerParameters.push_back(perTermParameters[index]);
+    radiusParameter = perTermParameters[supportRadius];
+    return true;
+}
+
+void CustomSummation::setGaussianSupport(const vector<string> &centerParameters, const string &widthParameter,
+                                         const string &heightParameter, double tolerance) {
+    if (centerParameters.size() != numArgs)
+        throw OpenMMException("CustomSummation: the number of center parameters must equal the number of arguments");
+    if (pointsPerTerm > 0)
+        throw OpenMMException("CustomSummation: terms with their own points cannot have a support or a grid");
+    if (tolerance <= 0.0)
+        throw OpenMMException("CustomSummation: the tolerance must be positive");
+    supportCenters.clear();
+    for (const string& name : centerParameters)
+        supportCenters.push_back(getPerTermParameterIndex(name));
+    supportWidth = getPerTermParameterIndex(widthParameter);
+    supportHeight = getPerTermParameterIndex(heightParameter);
+    supportTolerance = tolerance;
+    supportRadius = -1;
+    detachImpls();
+    lock_guard<mutex> lock(pool->lock);
+    for (auto& pair : pool->impls) {
+        pair.second->finishPendingBatches();
+        pair.second->setGaussianSupport(supportCenters, supportWidth, supportHeight, supportTolerance);
+    }
+}
+
+bool CustomSummation::getGaussianSupport(vector<string> &centerParameters, string &widthParameter,
+                                         string &heightParameter, double &tolerance) const {
+    if (supportWidth < 0)
+        return false;
+    centerParameters.clear();
+    for (int index : supportCenters)
+        centerParameters.push_back(perTermParameters[index]);
+    widthParameter = perTermParameters[supportWidth];
+    heightParameter = perTermParameters[supportHeight];
+    tolerance = supportTolerance;
+    return true;
+}
+
+void CustomSummation::setGrid(const vector<double> &minValues, const vector<double> &maxValues, const vector<int> &numPoints) {
+    if (numArgs > 3)
+        throw OpenMMException("CustomSummation: a grid can only be used with up to three arguments");
+    if (pointsPerTerm > 0)
+        throw OpenMMException("CustomSummation: terms with their own points cannot have a support or a grid");
+    if (minValues.size() != numArgs || maxValues.size() != numArgs || numPoints.size() != numArgs)
+        throw OpenMMException("CustomSummation: the grid must have one dimension for each argument");
+    for (int i = 0; i < numArgs; i++) {
+        if (maxValues[i] <= minValues[i])
+            throw OpenMMException("CustomSummation: the grid bounds must be increasing");
+        if (numPoints[i] < 2)
+            throw OpenMMException("CustomSummation: the grid must have at least 2 points along each argument");
+    }
+    gridMinValues = minValues;
+    gridMaxValues = maxValues;
+    gridPoints = numPoints;
+    detachImpls();
+    lock_guard<mutex> lock(pool->lock);
+    for (auto& pair : pool->impls) {
+        pair.second->finishPendingBatches();
+        pair.second->setGrid(gridMinValues, gridMaxValues, gridPoints);
+    }
+}
+
+bool CustomSummation::getGrid(vector<double> &minValues, vector<double> &maxValues, vector<int> &numPoints) const {
+    if (gridPoints.empty())
+        return false;
+    minValues = gridMinValues;
+    maxValues = gridMaxValues;
+    numPoints = gridPoints;
+    return true;
+}
+
+void CustomSummation::setCoalescing(const string &weightParameter, double tolerance) {
+    if (tolerance < 0.0)
+        throw OpenMMException("CustomSummation: the tolerance cannot be negative");
+    if (weightParameter.empty())
+        coalescingWeight = -1;
+    else {
+        coalescingWeight = getPerTermParameterIndex(weightParameter);
+    }
+    coalescingTolerance = tolerance;
+    coalescingKeysValid = false;
+}
+
+bool CustomSummation::getCoalescing(string &weightParameter, double &tolerance) const {
+    if (coalescingWeight < 0)
+        return false;
+    weightParameter = perTermParameters[coalescingWeight];
+    tolerance = coalescingTolerance;
+    return true;
+}
+
+void CustomSummation::setCacheSize(int size) {
+    detachImpls();
+    lock_guard<mutex> lock(pool->lock);
+    for (auto& pair : pool->impls) {
+        pair.second->finishPendingBatches();
+        pair.second->setCacheSize(size);
+    }
+    cacheSize = size;
+}
+
+long long CustomSummation::getNumCacheHits() const {
+    lock_guard<mutex> lock(pool->lock);
+    long long hits = 0;
+    for (auto& pair : pool->impls)
+        hits += pair.second->getNumCacheHits();
+    return hits;
+}
+
+long long CustomSummation::getNumCacheMisses() const {
+    lock_guard<mutex> lock(pool->lock);
+    long long misses = 0;
+    for (auto& pair : pool->impls)
+        misses += pair.second->getNumCacheMisses();
+    return misses;
 }
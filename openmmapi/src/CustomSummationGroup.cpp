@@ -0,0 +1,208 @@
+/* -------------------------------------------------------------------------- *
+ *                             OpenMM Laboratory                              *
+ *                             =================                              *
+ *                                                                            *
+ * A plugin for testing low-level code implementation for OpenMM.             *
+ *                                                                            *
+ * Copyright (c) 2023 Charlles Abreu                                          *
+ * https://github.com/craabreu/openmm-lab                                     *
+ * -------------------------------------------------------------------------- */
+
+#include "CustomSummationGroup.h"
+#include "internal/TracingRange.h"
+#include "openmm/Context.h"
+#include "openmm/CustomCompoundBondForce.h"
+#include "openmm/OpenMMException.h"
+#include "openmm/State.h"
+#include "openmm/System.h"
+#include "openmm/VerletIntegrator.h"
+#include "openmm/internal/AssertionUtilities.h"
+
+#include <algorithm>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+using namespace OpenMM;
+using namespace OpenMMLab;
+using namespace std;
+
+CustomSummationGroup::CustomSummationGroup(
+    int numSummations,
+    int numArgs,
+    string expression,
+    map<string, double> overallParameters,
+    vector<string> perTermParameters,
+    Platform &platform,
+    map<string, string> platformProperties
+) : numSummations(numSummations),
+    numArgs(numArgs),
+    expression(expression),
+    overallParameters(overallParameters),
+    perTermParameters(perTermParameters),
+    platform(&platform),
+    platformProperties(platformProperties),
+    termParameters(numSummations),
+    termCapacity(0)
+{
+    if (numSummations < 1)
+        throw OpenMMException("CustomSummationGroup: the number of summations must be positive");
+
+    // Each summation occupies a block of particles whose last one is a dummy particle
+    // located at x = 1. Multiplying every term by the x coordinate of this particle
+    // makes the value of each summation available as the negative x component of the
+    // force acting on the dummy particle of its block.
+    int numParticles = (numArgs + 2) / 3;
+    blockSize = numParticles + 1;
+    force = new CustomCompoundBondForce(
+        blockSize,
+        "x" + to_string(blockSize) + "*select(termMask, summationTerm, 0); summationTerm=" + expression
+    );
+    force->setUsesPeriodicBoundaryConditions(false);
+    for (const auto& pair : overallParameters)
+        force->addGlobalParameter(pair.first, pair.second);
+    for (const auto& name : perTermParameters)
+        force->addPerBondParameter(name);
+    force->addPerBondParameter("termMask");
+    system = new System();
+    positions.resize(numSummations * blockSize, Vec3(0, 0, 0));
+    for (int k = 0; k < numSummations; k++) {
+        for (int i = 0; i < blockSize; i++)
+            system->addParticle(1.0);
+        positions[k * blockSize + numParticles] = Vec3(1, 0, 0);
+    }
+    system->addForce(force);
+    integrator = new VerletIntegrator(0.01);
+    context = new Context(*system, *integrator, platform, platformProperties);
+}
+
+CustomSummationGroup::~CustomSummationGroup() {
+    delete context;
+    delete integrator;
+    delete system;
+}
+
+vector<int> CustomSummationGroup::blockParticles(int summation) const {
+    vector<int> particles(blockSize);
+    for (int i = 0; i < blockSize; i++)
+        particles[i] = summation * blockSize + i;
+    return particles;
+}
+
+vector<double> CustomSummationGroup::slotParameters(int summation, int slot) const {
+    // Free slots copy the parameters of an actual term, when there is one, to prevent
+    // the masked expression from producing non-finite values.
+    const vector<vector<double>>& terms = termParameters[summation];
+    vector<double> parameters;
+    if (slot < terms.size()) {
+        parameters = terms[slot];
+        parameters.push_back(1.0);
+    }
+    else {
+        if (terms.size() > 0)
+            parameters = terms[0];
+        else
+            parameters.resize(perTermParameters.size(), 0.0);
+        parameters.push_back(0.0);
+    }
+    return parameters;
+}
+
+int CustomSummationGroup::addTerm(int summation, const vector<double> &parameters) {
+    ASSERT_VALID_INDEX(summation, termParameters);
+    ASSERT_EQUAL(parameters.size(), perTermParameters.size());
+    vector<vector<double>>& terms = termParameters[summation];
+    terms.push_back(parameters);
+    modifiedTerms.insert(make_pair(summation, (int) terms.size() - 1));
+    return terms.size() - 1;
+}
+
+int CustomSummationGroup::getNumTerms(int summation) const {
+    ASSERT_VALID_INDEX(summation, termParameters);
+    return termParameters[summation].size();
+}
+
+const vector<double>& CustomSummationGroup::getTerm(int summation, int index) const {
+    ASSERT_VALID_INDEX(summation, termParameters);
+    ASSERT_VALID_INDEX(index, termParameters[summation]);
+    return termParameters[summation][index];
+}
+
+void CustomSummationGroup::setTerm(int summation, int index, const vector<double> &parameters) {
+    ASSERT_VALID_INDEX(summation, termParameters);
+    ASSERT_VALID_INDEX(index, termParameters[summation]);
+    ASSERT_EQUAL(parameters.size(), perTermParameters.size());
+    termParameters[summation][index] = parameters;
+    modifiedTerms.insert(make_pair(summation, index));
+}
+
+double CustomSummationGroup::getParameter(const string &name) const {
+    auto it = overallParameters.find(name);
+    if (it == overallParameters.end())
+        throw OpenMMException("CustomSummationGroup: unknown parameter '" + name + "'");
+    return it->second;
+}
+
+void CustomSummationGroup::setParameter(const string &name, double value) {
+    if (overallParameters.find(name) == overallParameters.end())
+        throw OpenMMException("CustomSummationGroup: unknown parameter '" + name + "'");
+    overallParameters[name] = value;
+    context->setParameter(name, value);
+}
+
+void CustomSummationGroup::update() {
+    OPENMMLAB_TRACE_RANGE("CustomSummationGroup::update");
+    if (modifiedTerms.empty())
+        return;
+    int maxTerms = 0;
+    for (const auto& terms : termParameters)
+        maxTerms = max(maxTerms, (int) terms.size());
+    if (maxTerms > termCapacity) {
+        // Every summation has the same number of slots, so that the bonds of summation k
+        // start at index k*termCapacity. The number of slots grows geometrically, so that
+        // reinitializations become increasingly rare as terms are appended.
+        termCapacity = max(maxTerms, 2 * termCapacity);
+        int numBonds = force->getNumBonds();
+        for (int k = 0; k < numSummations; k++) {
+            vector<int> particles = blockParticles(k);
+            for (int slot = 0; slot < termCapacity; slot++) {
+                int bond = k * termCapacity + slot;
+                if (bond < numBonds)
+                    force->setBondParameters(bond, particles, slotParameters(k, slot));
+                else
+                    force->addBond(particles, slotParameters(k, slot));
+            }
+        }
+        context->reinitialize();
+    }
+    else {
+        for (const auto& term : modifiedTerms)
+            force->setBondParameters(term.first * termCapacity + term.second, blockParticles(term.first), slotParameters(term.first, term.second));
+        force->updateParametersInContext(*context);
+    }
+    modifiedTerms.clear();
+}
+
+void CustomSummationGroup::evaluate(const double *arguments, double *values, double *gradients) {
+    OPENMMLAB_TRACE_RANGE("CustomSummationGroup::evaluate");
+    for (int k = 0; k < numSummations; k++)
+        for (int i = 0; i < numArgs; i++)
+            positions[k * blockSize + i / 3][i % 3] = arguments[k * numArgs + i];
+    context->setPositions(positions);
+    State state = context->getState(State::Forces);
+    const vector<Vec3>& forces = state.getForces();
+    for (int k = 0; k < numSummations; k++) {
+        values[k] = -forces[k * blockSize + blockSize - 1][0];
+        if (gradients != NULL)
+            for (int i = 0; i < numArgs; i++)
+                gradients[k * numArgs + i] = -forces[k * blockSize + i / 3][i % 3];
+    }
+}
+
+void CustomSummationGroup::evaluate(const vector<double> &arguments, vector<double> &values, vector<double> &gradients) {
+    ASSERT_EQUAL(arguments.size(), numSummations * numArgs);
+    values.resize(numSummations);
+    gradients.resize(numSummations * numArgs);
+    evaluate(arguments.data(), values.data(), gradients.data());
+}
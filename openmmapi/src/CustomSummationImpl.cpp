@@ -9,102 +9,534 @@
  * -------------------------------------------------------------------------- */
 
 #include "internal/CustomSummationImpl.h"
-#include "openmm/Context.h"
+#include "internal/AutoCustomSummationImpl.h"
+#include "internal/ContextCustomSummationImpl.h"
+#include "internal/KernelCustomSummationImpl.h"
+#include "internal/NativeCustomSummationImpl.h"
 #include "openmm/OpenMMException.h"
 #include "openmm/Platform.h"
-#include "openmm/State.h"
-#include "openmm/System.h"
-#include "openmm/Vec3.h"
-#include "openmm/VerletIntegrator.h"
-#include "openmm/internal/AssertionUtilities.h"
-#include "openmm/internal/ContextImpl.h"
+#include "lepton/CustomFunction.h"
+#include "lepton/ExpressionTreeNode.h"
+#include "lepton/Operation.h"
+#include "lepton/Parser.h"
 
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <functional>
+#include <future>
+#include <iterator>
+#include <limits>
+#include <list>
 #include <map>
+#include <set>
 #include <string>
 #include <vector>
 
 using namespace OpenMM;
 using namespace OpenMMLab;
+using namespace Lepton;
 using namespace std;
 
-CustomSummationImpl::CustomSummationImpl(
+/**
+ * A function that only exists while an expression is being parsed. Calls to it are
+ * replaced by explicit expression trees before anything is evaluated.
+ */
+class PlaceholderFunction : public CustomFunction {
+public:
+    PlaceholderFunction(int numArgs) : numArgs(numArgs) {
+    }
+    int getNumArguments() const {
+        return numArgs;
+    }
+    double evaluate(const double* arguments) const {
+        throw OpenMMException("CustomSummation: placeholder function cannot be evaluated");
+    }
+    double evaluateDerivative(const double* arguments, const int* derivOrder) const {
+        throw OpenMMException("CustomSummation: placeholder function cannot be evaluated");
+    }
+    CustomFunction* clone() const {
+        return new PlaceholderFunction(numArgs);
+    }
+private:
+    int numArgs;
+};
+
+static ExpressionTreeNode add(const ExpressionTreeNode& a, const ExpressionTreeNode& b) {
+    return ExpressionTreeNode(new Operation::Add(), a, b);
+}
+
+static ExpressionTreeNode subtract(const ExpressionTreeNode& a, const ExpressionTreeNode& b) {
+    return ExpressionTreeNode(new Operation::Subtract(), a, b);
+}
+
+static ExpressionTreeNode multiply(const ExpressionTreeNode& a, const ExpressionTreeNode& b) {
+    return ExpressionTreeNode(new Operation::Multiply(), a, b);
+}
+
+static vector<ExpressionTreeNode> difference(const vector<ExpressionTreeNode>& args, int i, int j) {
+    vector<ExpressionTreeNode> result;
+    for (int k = 0; k < 3; k++)
+        result.push_back(subtract(args[3*i+k], args[3*j+k]));
+    return result;
+}
+
+static ExpressionTreeNode dot(const vector<ExpressionTreeNode>& u, const vector<ExpressionTreeNode>& v) {
+    return add(add(multiply(u[0], v[0]), multiply(u[1], v[1])), multiply(u[2], v[2]));
+}
+
+static vector<ExpressionTreeNode> cross(const vector<ExpressionTreeNode>& u, const vector<ExpressionTreeNode>& v) {
+    vector<ExpressionTreeNode> result;
+    result.push_back(subtract(multiply(u[1], v[2]), multiply(u[2], v[1])));
+    result.push_back(subtract(multiply(u[2], v[0]), multiply(u[0], v[2])));
+    result.push_back(subtract(multiply(u[0], v[1]), multiply(u[1], v[0])));
+    return result;
+}
+
+/**
+ * Replace calls to pointdistance(), pointangle(), and pointdihedral() by explicit
+ * expression trees, so that they can be differentiated and compiled.
+ */
+static ExpressionTreeNode replacePointFunctions(const ExpressionTreeNode& node) {
+    vector<ExpressionTreeNode> args;
+    for (const ExpressionTreeNode& child : node.getChildren())
+        args.push_back(replacePointFunctions(child));
+    const Operation& op = node.getOperation();
+    if (op.getId() != Operation::CUSTOM)
+        return ExpressionTreeNode(op.clone(), args);
+    if (op.getName() == "pointdistance") {
+        vector<ExpressionTreeNode> r = difference(args, 0, 1);
+        return ExpressionTreeNode(new Operation::Sqrt(), dot(r, r));
+    }
+    if (op.getName() == "pointangle") {
+        vector<ExpressionTreeNode> u = difference(args, 0, 1);
+        vector<ExpressionTreeNode> v = difference(args, 2, 1);
+        ExpressionTreeNode norms = ExpressionTreeNode(new Operation::Sqrt(), multiply(dot(u, u), dot(v, v)));
+        return ExpressionTreeNode(new Operation::Acos(), ExpressionTreeNode(new Operation::Divide(), dot(u, v), norms));
+    }
+    if (op.getName() == "pointdihedral") {
+        vector<ExpressionTreeNode> b1 = difference(args, 1, 0);
+        vector<ExpressionTreeNode> b2 = difference(args, 2, 1);
+        vector<ExpressionTreeNode> b3 = difference(args, 3, 2);
+        vector<ExpressionTreeNode> n1 = cross(b1, b2);
+        vector<ExpressionTreeNode> n2 = cross(b2, b3);
+        ExpressionTreeNode y = multiply(ExpressionTreeNode(new Operation::Sqrt(), dot(b2, b2)), dot(b1, n2));
+        return ExpressionTreeNode(new Operation::Atan2(), y, dot(n1, n2));
+    }
+    throw OpenMMException("CustomSummation: unknown function '" + op.getName() + "'");
+}
+
+/**
+ * Replace every call to distance(), angle(), and dihedral() whose arguments are
+ * point names by an equivalent call to pointdistance(), pointangle(), or
+ * pointdihedral() whose arguments are the point coordinates.
+ */
+static string expandPointFunctions(const string &expression) {
+    map<string, string> replacements = {
+        {"distance", "pointdistance"}, {"angle", "pointangle"}, {"dihedral", "pointdihedral"}
+    };
+    string result;
+    int n = expression.size();
+    int pos = 0;
+    while (pos < n) {
+        char c = expression[pos];
+        if (!isalpha(c) && c != '_') {
+            result += c;
+            pos++;
+            continue;
+        }
+        int start = pos;
+        while (pos < n && (isalnum(expression[pos]) || expression[pos] == '_'))
+            pos++;
+        string name = expression.substr(start, pos - start);
+        int next = pos;
+        while (next < n && isspace(expression[next]))
+            next++;
+        if (replacements.find(name) == replacements.end() || next == n || expression[next] != '(') {
+            result += name;
+            continue;
+        }
+        size_t close = expression.find(')', next);
+        if (close == string::npos)
+            throw OpenMMException("CustomSummation: unbalanced parentheses in expression");
+        vector<string> coordinates;
+        string list = expression.substr(next + 1, close - next - 1);
+        size_t first = 0;
+        while (first <= list.size()) {
+            size_t last = list.find(',', first);
+            if (last == string::npos)
+                last = list.size();
+            string point;
+            for (size_t i = first; i < last; i++)
+                if (!isspace(list[i]))
+                    point += list[i];
+            if (point.size() < 2 || point[0] != 'p' || point.find_first_not_of("0123456789", 1) != string::npos)
+                throw OpenMMException("CustomSummation: invalid point name '" + point + "' in " + name + "()");
+            string index = point.substr(1);
+            coordinates.push_back("x" + index + ",y" + index + ",z" + index);
+            first = last + 1;
+        }
+        result += replacements[name] + "(";
+        for (int i = 0; i < coordinates.size(); i++)
+            result += (i == 0 ? "" : ",") + coordinates[i];
+        result += ")";
+        pos = close + 1;
+    }
+    return result;
+}
+
+CustomSummationImpl* CustomSummationImpl::create(
     int numArgs,
     string expression,
     map<string, double> overallParameters,
     vector<string> perTermParameters,
     Platform &platform,
-    map<string, string> platformProperties
-) : numArgs(numArgs) {
-    int numParticles = (numArgs  + 2)/ 3;
-    positions.resize(numParticles, Vec3(0, 0, 0));
-    latestArguments.resize(numArgs);
-    derivatives.resize(numArgs);
-    valueIsDirty = derivativesAreDirty = true;
-    contextIsUnchanged = false;
-    force = new CustomCompoundBondForce(numParticles, expression);
-    force->setUsesPeriodicBoundaryConditions(false);
-    for (const auto& pair : overallParameters)
-        force->addGlobalParameter(pair.first, pair.second);
-    for (const auto& name : perTermParameters)
-        force->addPerBondParameter(name);
-    System *system = new System();
-    for (int i = 0; i < numParticles; i++) {
-        particles.push_back(i);
-        system->addParticle(1.0);
-    }
-    system->addForce(static_cast<Force *>(force));
-    VerletIntegrator *integrator = new VerletIntegrator(0.01);
-    context = new Context(*system, *integrator, platform, platformProperties);
-};
+    map<string, string> platformProperties,
+    int pointsPerTerm
+) {
+    string backend = "Context";
+    auto it = platformProperties.find("Backend");
+    if (it != platformProperties.end()) {
+        backend = it->second;
+        platformProperties.erase(it);
+    }
+
+    bool deterministic = isDeterministic(platformProperties);
+    platformProperties.erase("Deterministic");
+
+    // The precision is a property of the summation itself. It is only passed on to
+    // platforms that have a property of the same name, since the others have a fixed
+    // precision and would reject it.
 
-CustomSummationImpl::~CustomSummationImpl() {
-    delete context; // will delete the system, integrator, and force
+    string precision = "double";
+    it = platformProperties.find("Precision");
+    if (it != platformProperties.end()) {
+        precision = it->second;
+        transform(precision.begin(), precision.end(), precision.begin(), ::tolower);
+        if (precision != "single" && precision != "mixed" && precision != "double")
+            throw OpenMMException("CustomSummation: illegal value for Precision: " + it->second);
+        const vector<string>& names = platform.getPropertyNames();
+        if (backend == "Native" || find(names.begin(), names.end(), "Precision") == names.end())
+            platformProperties.erase(it);
+        else
+            it->second = precision;
+    }
+    if (backend == "Context")
+        return new ContextCustomSummationImpl(
+            numArgs, expression, overallParameters, perTermParameters, platform, platformProperties, pointsPerTerm
+        );
+    if (backend == "Kernel") {
+        if (pointsPerTerm > 0)
+            throw OpenMMException("CustomSummation: the Kernel backend does not support terms with their own points");
+        return new KernelCustomSummationImpl(
+            numArgs, expression, overallParameters, perTermParameters, platform, platformProperties, deterministic
+        );
+    }
+    if (backend == "Native")
+        return new NativeCustomSummationImpl(
+            numArgs, expression, overallParameters, perTermParameters, precision != "double", pointsPerTerm
+        );
+    if (backend == "Auto")
+        return new AutoCustomSummationImpl(
+            numArgs, expression, overallParameters, perTermParameters, platform, platformProperties, precision, deterministic,
+            pointsPerTerm
+        );
+    throw OpenMMException("CustomSummation: unknown backend '" + backend + "'");
+}
+
+ParsedExpression CustomSummationImpl::parseExpression(const string &expression) {
+    map<string, CustomFunction*> functions;
+    functions["pointdistance"] = new PlaceholderFunction(6);
+    functions["pointangle"] = new PlaceholderFunction(9);
+    functions["pointdihedral"] = new PlaceholderFunction(12);
+    ParsedExpression parsed = Parser::parse(expandPointFunctions(expression), functions);
+    for (auto& function : functions)
+        delete function.second;
+    return ParsedExpression(replacePointFunctions(parsed.getRootNode()));
+}
+
+/**
+ * Check whether an expression tree contains any variable of a set, or any variable at
+ * all if the set is empty.
+ */
+static bool dependsOn(const ExpressionTreeNode& node, const set<string>& names) {
+    const Operation& op = node.getOperation();
+    if (op.getId() == Operation::VARIABLE)
+        return names.empty() || names.find(op.getName()) != names.end();
+    for (const ExpressionTreeNode& child : node.getChildren())
+        if (dependsOn(child, names))
+            return true;
+    return false;
+}
+
+static ExpressionTreeNode hoistSubtrees(const ExpressionTreeNode& node, const set<string>& arguments,
+                                        const set<string>& perTermParameters, bool includeArguments,
+                                        vector<ExpressionTreeNode>& argumentInvariants,
+                                        vector<ExpressionTreeNode>& parameterInvariants) {
+    if (node.getChildren().empty() || !dependsOn(node, set<string>()))
+        return node;
+    if (!dependsOn(node, perTermParameters)) {
+        bool usesArguments = dependsOn(node, arguments);
+        if (!usesArguments || includeArguments) {
+            vector<ExpressionTreeNode>& invariants = (usesArguments ? argumentInvariants : parameterInvariants);
+            int index = find(invariants.begin(), invariants.end(), node)-invariants.begin();
+            if (index == invariants.size())
+                invariants.push_back(node);
+            string prefix = (usesArguments ? "@argument" : "@parameter");
+            return ExpressionTreeNode(new Operation::Variable(prefix+to_string(index)));
+        }
+    }
+    vector<ExpressionTreeNode> children;
+    for (const ExpressionTreeNode& child : node.getChildren())
+        children.push_back(hoistSubtrees(child, arguments, perTermParameters, includeArguments, argumentInvariants, parameterInvariants));
+    return ExpressionTreeNode(node.getOperation().clone(), children);
+}
+
+ParsedExpression CustomSummationImpl::hoistInvariants(
+    const ParsedExpression &expression,
+    int numArgs,
+    const vector<string> &perTermParameters,
+    bool includeArguments,
+    vector<ParsedExpression> &argumentInvariants,
+    vector<ParsedExpression> &parameterInvariants
+) {
+    set<string> arguments, perTermNames(perTermParameters.begin(), perTermParameters.end());
+    for (int i = 0; i < 3*((numArgs+2)/3); i++)
+        arguments.insert(getArgumentName(i));
+    vector<ExpressionTreeNode> argumentNodes, parameterNodes;
+    ExpressionTreeNode root = hoistSubtrees(expression.getRootNode(), arguments, perTermNames, includeArguments, argumentNodes, parameterNodes);
+    argumentInvariants.clear();
+    for (const ExpressionTreeNode& node : argumentNodes)
+        argumentInvariants.push_back(ParsedExpression(node));
+    parameterInvariants.clear();
+    for (const ExpressionTreeNode& node : parameterNodes)
+        parameterInvariants.push_back(ParsedExpression(node));
+    return ParsedExpression(root);
 }
 
-void CustomSummationImpl::setPositions(const vector<double> &arguments) {
-    if (equal(arguments.begin(), arguments.end(), latestArguments.begin()) && contextIsUnchanged)
+string CustomSummationImpl::getArgumentName(int index) {
+    return string(1, "xyz"[index % 3]) + to_string(index / 3 + 1);
+}
+
+bool CustomSummationImpl::isDeterministic(const map<string, string> &platformProperties) {
+    auto it = platformProperties.find("Deterministic");
+    if (it == platformProperties.end())
+        return true;
+    string value = it->second;
+    transform(value.begin(), value.end(), value.begin(), ::tolower);
+    if (value != "true" && value != "false")
+        throw OpenMMException("CustomSummation: illegal value for Deterministic: " + it->second);
+    return value == "true";
+}
+
+CustomSummationImpl::CustomSummationImpl(int numArgs, int pointsPerTerm) : numArgs(numArgs), pointsPerTerm(pointsPerTerm) {
+    cacheSize = 8;
+    numCacheHits = numCacheMisses = 0;
+    backendArgumentsAreValid = false;
+}
+
+/**
+ * Get the step of a central difference along a direction, which balances the truncation
+ * error with the rounding error of the gradients.
+ */
+static double differenceStep(const vector<double> &arguments, const vector<double> &direction) {
+    double argumentNorm = 0.0, directionNorm = 0.0;
+    for (int i = 0; i < arguments.size(); i++) {
+        argumentNorm += arguments[i]*arguments[i];
+        directionNorm += direction[i]*direction[i];
+    }
+    return cbrt(numeric_limits<double>::epsilon())*max(1.0, sqrt(argumentNorm))/sqrt(directionNorm);
+}
+
+void CustomSummationImpl::evaluateHessianProduct(const vector<double> &arguments, const vector<double> &direction, vector<double> &product) {
+    product.assign(numArgs, 0.0);
+    bool isZero = true;
+    for (double x : direction)
+        isZero = isZero && (x == 0.0);
+    if (isZero)
         return;
+    double step = differenceStep(arguments, direction);
+    vector<double> shifted(numArgs), forward(numArgs), backward(numArgs);
+    for (int i = 0; i < numArgs; i++)
+        shifted[i] = arguments[i]+step*direction[i];
+    setArguments(shifted.data());
+    computeDerivatives(forward);
+    for (int i = 0; i < numArgs; i++)
+        shifted[i] = arguments[i]-step*direction[i];
+    setArguments(shifted.data());
+    computeDerivatives(backward);
+    invalidateArguments();
     for (int i = 0; i < numArgs; i++)
-        positions[i / 3][i % 3] = arguments[i];
-    context->setPositions(positions);
-    latestArguments = arguments;
-    valueIsDirty = derivativesAreDirty = contextIsUnchanged = true;
+        product[i] = (forward[i]-backward[i])/(2*step);
+}
+
+void CustomSummationImpl::evaluateHessianDiagonal(const vector<double> &arguments, vector<double> &diagonal) {
+    diagonal.resize(numArgs);
+    vector<double> direction(numArgs, 0.0), product;
+    for (int i = 0; i < numArgs; i++) {
+        direction[i] = 1.0;
+        evaluateHessianProduct(arguments, direction, product);
+        diagonal[i] = product[i];
+        direction[i] = 0.0;
+    }
+}
+
+void CustomSummationImpl::setCacheSize(int size) {
+    if (size < 1)
+        throw OpenMMException("CustomSummation: the cache size must be positive");
+    cacheSize = size;
+    while (cache.size() > cacheSize)
+        cache.pop_back();
+}
+
+void CustomSummationImpl::submitBatch(const double *arguments, int numPoints, bool includeGradients) {
+    if (numPoints < 0)
+        throw OpenMMException("CustomSummation: the number of points cannot be negative");
+
+    // Each batch waits for the previous one, so that the backend is never used by two
+    // threads at once.  The buffers of collected batches are reused, so that a steady
+    // stream of batches of the same size does not allocate memory.
+
+    shared_future<void> previous;
+    if (!pendingBatches.empty())
+        previous = pendingBatches.back().done;
+    pendingBatches.emplace_back();
+    PendingBatch& batch = pendingBatches.back();
+    if (!spareBatches.empty()) {
+        batch = move(spareBatches.back());
+        spareBatches.pop_back();
+    }
+    batch.arguments.assign(arguments, arguments+numPoints*numArgs);
+    batch.values.resize(numPoints);
+    batch.gradients.resize(includeGradients ? numPoints*numArgs : 0);
+    batch.numPoints = numPoints;
+    batch.includeGradients = includeGradients;
+    PendingBatch* target = &batch;
+    batch.done = async(launch::async, [this, target, previous] () {
+        if (previous.valid())
+            previous.wait();
+        double* gradients = (target->includeGradients ? target->gradients.data() : NULL);
+        evaluateBatch(target->arguments.data(), target->numPoints, target->values.data(), gradients);
+    }).share();
 }
 
-double CustomSummationImpl::evaluate(const vector<double> &arguments) {
-    setPositions(arguments);
-    if (valueIsDirty) {
-        value = context->getState(State::Energy).getPotentialEnergy();
-        valueIsDirty = false;
+int CustomSummationImpl::collectBatch(double *values, double *gradients) {
+    if (pendingBatches.empty())
+        throw OpenMMException("CustomSummation: there is no pending batch to collect");
+    PendingBatch& batch = pendingBatches.front();
+    try {
+        batch.done.get();
     }
-    return value;
+    catch (...) {
+        pendingBatches.pop_front();
+        throw;
+    }
+    if (gradients != NULL && !batch.includeGradients) {
+        pendingBatches.pop_front();
+        throw OpenMMException("CustomSummation: the gradients were not requested when the batch was submitted");
+    }
+    int numPoints = batch.numPoints;
+    copy(batch.values.begin(), batch.values.end(), values);
+    if (gradients != NULL)
+        copy(batch.gradients.begin(), batch.gradients.end(), gradients);
+    spareBatches.push_back(move(batch));
+    pendingBatches.pop_front();
+    return numPoints;
+}
+
+int CustomSummationImpl::getPendingBatchSize() const {
+    if (pendingBatches.empty())
+        throw OpenMMException("CustomSummation: there is no pending batch to collect");
+    return pendingBatches.front().numPoints;
+}
+
+void CustomSummationImpl::finishPendingBatches() {
+    if (!pendingBatches.empty())
+        pendingBatches.back().done.wait();
 }
 
-vector<double> CustomSummationImpl::evaluateDerivatives(const vector<double> &arguments) {
-    setPositions(arguments);
-    if (derivativesAreDirty) {
-        vector<Vec3> forces = context->getState(State::Forces).getForces();
-        for (int i = 0; i < numArgs; i++)
-            derivatives[i] = -forces[i / 3][i % 3];
-        derivativesAreDirty = false;
+void CustomSummationImpl::invalidateCache() {
+    // The entries are kept for their storage, but none of their results is valid.
+    for (CacheEntry& entry : cache)
+        entry.hasValue = entry.hasDerivatives = false;
+    backendArgumentsAreValid = false;
+}
+
+CustomSummationImpl::CacheEntry& CustomSummationImpl::findEntry(const double *arguments) {
+    size_t hash = 0;
+    for (int i = 0; i < numArgs; i++)
+        hash ^= std::hash<double>()(arguments[i]) + 0x9e3779b9 + (hash << 6) + (hash >> 2);
+    for (auto it = cache.begin(); it != cache.end(); ++it)
+        if (it->hash == hash && equal(it->arguments.begin(), it->arguments.end(), arguments)) {
+            if (it != cache.begin())
+                cache.splice(cache.begin(), cache, it);
+            return cache.front();
+        }
+
+    // When the cache is full, the least recently used entry is recycled along with
+    // its storage, so that a miss allocates no memory.
+
+    if (cache.size() >= cacheSize)
+        cache.splice(cache.begin(), cache, prev(cache.end()));
+    else {
+        cache.emplace_front();
+        cache.front().arguments.resize(numArgs);
+        cache.front().derivatives.resize(numArgs);
+    }
+    CacheEntry& entry = cache.front();
+    entry.hash = hash;
+    copy(arguments, arguments + numArgs, entry.arguments.begin());
+    entry.hasValue = entry.hasDerivatives = false;
+    return entry;
+}
+
+void CustomSummationImpl::prepareBackend(const CacheEntry &entry) {
+    numCacheMisses++;
+    if (backendArgumentsAreValid && backendArguments == entry.arguments)
+        return;
+    setArguments(entry.arguments.data());
+    backendArguments.assign(entry.arguments.begin(), entry.arguments.end());
+    backendArgumentsAreValid = true;
+}
+
+double CustomSummationImpl::evaluate(const double *arguments) {
+    CacheEntry& entry = findEntry(arguments);
+    if (entry.hasValue)
+        numCacheHits++;
+    else {
+        prepareBackend(entry);
+        entry.value = computeValue();
+        entry.hasValue = true;
     }
-    return derivatives;
+    return entry.value;
 }
 
-void CustomSummationImpl::update(const vector<vector<double>> &parameters) {
-    for (int i = 0; i < force->getNumBonds(); i++)
-        force->setBondParameters(i, particles, parameters[i]);
-    if (parameters.size() == force->getNumBonds())
-        force->updateParametersInContext(*context);
+const vector<double>& CustomSummationImpl::evaluateDerivatives(const double *arguments) {
+    CacheEntry& entry = findEntry(arguments);
+    if (entry.hasDerivatives)
+        numCacheHits++;
     else {
-        for (int i = force->getNumBonds(); i < parameters.size(); i++)
-            force->addBond(particles, parameters[i]);
-        context->reinitialize();
+        prepareBackend(entry);
+        if (entry.hasValue)
+            computeDerivatives(entry.derivatives);
+        else {
+            entry.value = computeValueAndDerivatives(entry.derivatives);
+            entry.hasValue = true;
+        }
+        entry.hasDerivatives = true;
     }
-    contextIsUnchanged = false;
+    return entry.derivatives;
 }
 
-void CustomSummationImpl::setParameter(const string &name, double value) {
-    context->setParameter(name, value);
-    contextIsUnchanged = false;
+double CustomSummationImpl::evaluateWithDerivatives(const double *arguments, vector<double> &derivatives) {
+    CacheEntry& entry = findEntry(arguments);
+    if (entry.hasValue && entry.hasDerivatives)
+        numCacheHits++;
+    else {
+        prepareBackend(entry);
+        entry.value = computeValueAndDerivatives(entry.derivatives);
+        entry.hasValue = entry.hasDerivatives = true;
+    }
+    derivatives = entry.derivatives;
+    return entry.value;
 }
@@ -12,6 +12,8 @@
 #include "internal/ExtendedCustomCVForceImpl.h"
 #include "OpenMMLabKernels.h"
 
+#include "openmm/CustomBondForce.h"
+#include "openmm/CustomCompoundBondForce.h"
 #include "openmm/OpenMMException.h"
 #include "openmm/internal/AssertionUtilities.h"
 #include <cmath>
@@ -23,7 +25,7 @@ using namespace OpenMMLab;
 using namespace OpenMM;
 using namespace std;
 
-ExtendedCustomCVForce::ExtendedCustomCVForce(const string& energy) : energyExpression(energy) {
+ExtendedCustomCVForce::ExtendedCustomCVForce(const string& energy) : energyExpression(energy), compressedForces(false), derivativesOnDemand(false), historySize(0) {
     this->setName("ExtendedCustomCVForce");
 }
 
@@ -32,6 +34,12 @@ ExtendedCustomCVForce::~ExtendedCustomCVForce() {
         delete variable.variable;
     for (auto function : functions)
         delete function.function;
+    for (auto summation : summations)
+        delete summation.summation;
+    for (auto batch : batches)
+        delete batch.variables;
+    for (auto site : sharedParticles)
+        delete site;
 }
 
 const string& ExtendedCustomCVForce::getEnergyFunction() const {
@@ -43,8 +51,8 @@ void ExtendedCustomCVForce::setEnergyFunction(const std::string& energy) {
 }
 
 int ExtendedCustomCVForce::addCollectiveVariable(const std::string& name, Force* variable) {
-    if (variables.size() >= 32)
-        throw OpenMMException("ExtendedCustomCVForce cannot have more than 32 collective variables");
+    if (variables.size()+batches.size() >= 32)
+        throw OpenMMException("ExtendedCustomCVForce cannot have more than 32 collective variables and batches");
     variables.push_back(VariableInfo(name, variable));
     return variables.size()-1;
 }
@@ -64,6 +72,132 @@ const Force& ExtendedCustomCVForce::getCollectiveVariable(int index) const {
     return *variables[index].variable;
 }
 
+void ExtendedCustomCVForce::setCollectiveVariableInterval(int index, int interval) {
+    ASSERT_VALID_INDEX(index, variables);
+    if (interval < 1)
+        throw OpenMMException("ExtendedCustomCVForce: the evaluation interval of a collective variable must be positive");
+    variables[index].interval = interval;
+}
+
+int ExtendedCustomCVForce::getCollectiveVariableInterval(int index) const {
+    ASSERT_VALID_INDEX(index, variables);
+    return variables[index].interval;
+}
+
+void ExtendedCustomCVForce::setCollectiveVariablePlatform(int index, const string& platform) {
+    ASSERT_VALID_INDEX(index, variables);
+    variables[index].platform = platform;
+}
+
+const string& ExtendedCustomCVForce::getCollectiveVariablePlatform(int index) const {
+    ASSERT_VALID_INDEX(index, variables);
+    return variables[index].platform;
+}
+
+void ExtendedCustomCVForce::setUseCompressedForces(bool compressed) {
+    compressedForces = compressed;
+}
+
+bool ExtendedCustomCVForce::getUseCompressedForces() const {
+    return compressedForces;
+}
+
+void ExtendedCustomCVForce::setUseDerivativesOnDemand(bool onDemand) {
+    derivativesOnDemand = onDemand;
+}
+
+bool ExtendedCustomCVForce::getUseDerivativesOnDemand() const {
+    return derivativesOnDemand;
+}
+
+void ExtendedCustomCVForce::setCollectiveVariableHistorySize(int size) {
+    if (size < 0)
+        throw OpenMMException("ExtendedCustomCVForce: the size of the history cannot be negative");
+    historySize = size;
+}
+
+int ExtendedCustomCVForce::getCollectiveVariableHistorySize() const {
+    return historySize;
+}
+
+int ExtendedCustomCVForce::addCollectiveVariableBatch(const vector<string>& names, Force* variables) {
+    if (this->variables.size()+batches.size() >= 32)
+        throw OpenMMException("ExtendedCustomCVForce cannot have more than 32 collective variables and batches");
+    int numBonds;
+    if (dynamic_cast<CustomBondForce*>(variables) != NULL)
+        numBonds = dynamic_cast<CustomBondForce*>(variables)->getNumBonds();
+    else if (dynamic_cast<CustomCompoundBondForce*>(variables) != NULL)
+        numBonds = dynamic_cast<CustomCompoundBondForce*>(variables)->getNumBonds();
+    else
+        throw OpenMMException("ExtendedCustomCVForce: a batch of collective variables must be a CustomBondForce or a CustomCompoundBondForce");
+    if (numBonds == 0)
+        throw OpenMMException("ExtendedCustomCVForce: a batch of collective variables must have at least one bond");
+    if (names.size() != numBonds)
+        throw OpenMMException("ExtendedCustomCVForce: the number of names of a batch of collective variables must equal that of its bonds");
+    batches.push_back(BatchInfo(names, variables));
+    return batches.size()-1;
+}
+
+const vector<string>& ExtendedCustomCVForce::getCollectiveVariableBatchNames(int index) const {
+    ASSERT_VALID_INDEX(index, batches);
+    return batches[index].names;
+}
+
+Force& ExtendedCustomCVForce::getCollectiveVariableBatch(int index) {
+    ASSERT_VALID_INDEX(index, batches);
+    return *batches[index].variables;
+}
+
+const Force& ExtendedCustomCVForce::getCollectiveVariableBatch(int index) const {
+    ASSERT_VALID_INDEX(index, batches);
+    return *batches[index].variables;
+}
+
+int ExtendedCustomCVForce::addSharedParticle(VirtualSite* site) {
+    for (int i = 0; i < site->getNumParticles(); i++)
+        if (site->getParticle(i) < 0)
+            throw OpenMMException("ExtendedCustomCVForce: a shared particle cannot depend on a negative particle index");
+    sharedParticles.push_back(site);
+    return sharedParticles.size()-1;
+}
+
+int ExtendedCustomCVForce::addSharedCentroid(const vector<int>& particles, const vector<double>& weights) {
+    int numParticles = particles.size();
+    if (numParticles == 0)
+        throw OpenMMException("ExtendedCustomCVForce: the group of a shared centroid must have at least one particle");
+    if (weights.size() != 0 && weights.size() != numParticles)
+        throw OpenMMException("ExtendedCustomCVForce: the weights of a shared centroid must be empty or one per particle");
+    vector<double> normalized(numParticles, 1.0/numParticles);
+    if (weights.size() > 0) {
+        double sum = 0.0;
+        for (double weight : weights)
+            sum += weight;
+        if (sum == 0.0)
+            throw OpenMMException("ExtendedCustomCVForce: the weights of a shared centroid cannot sum to zero");
+        for (int i = 0; i < numParticles; i++)
+            normalized[i] = weights[i]/sum;
+    }
+
+    // OpenMM has no weighted average of an arbitrary number of particles, but a local
+    // coordinates site placed at the origin of its frame is one.
+
+    if (numParticles == 1)
+        return addSharedParticle(new TwoParticleAverageSite(particles[0], particles[0], 1.0, 0.0));
+    if (numParticles == 2)
+        return addSharedParticle(new TwoParticleAverageSite(particles[0], particles[1], normalized[0], normalized[1]));
+    if (numParticles == 3)
+        return addSharedParticle(new ThreeParticleAverageSite(particles[0], particles[1], particles[2], normalized[0], normalized[1], normalized[2]));
+    vector<double> xWeights(numParticles, 0.0), yWeights(numParticles, 0.0);
+    xWeights[0] = yWeights[0] = -1.0;
+    xWeights[1] = yWeights[2] = 1.0;
+    return addSharedParticle(new LocalCoordinatesSite(particles, normalized, xWeights, yWeights, Vec3()));
+}
+
+const VirtualSite& ExtendedCustomCVForce::getSharedParticle(int index) const {
+    ASSERT_VALID_INDEX(index, sharedParticles);
+    return *sharedParticles[index];
+}
+
 int ExtendedCustomCVForce::addGlobalParameter(const string& name, double defaultValue) {
     globalParameters.push_back(GlobalParameterInfo(name, defaultValue));
     return globalParameters.size()-1;
@@ -123,6 +257,110 @@ const string& ExtendedCustomCVForce::getTabulatedFunctionName(int index) const {
     return functions[index].name;
 }
 
+static void checkRadialBasisFunction(int numVariables, double shapeParameter, const vector<double>& centers, const vector<double>& weights) {
+    if (numVariables == 0)
+        throw OpenMMException("ExtendedCustomCVForce: a radial basis function must depend on at least one variable");
+    if (shapeParameter <= 0.0)
+        throw OpenMMException("ExtendedCustomCVForce: the shape parameter of a radial basis function must be positive");
+    if (centers.size() != weights.size()*numVariables)
+        throw OpenMMException("ExtendedCustomCVForce: the number of center coordinates must be the number of weights times the number of variables");
+}
+
+int ExtendedCustomCVForce::addRadialBasisFunction(const string& name, RadialBasisFunctionType type, double shapeParameter,
+                                                  const vector<string>& variables, const vector<double>& centers,
+                                                  const vector<double>& weights) {
+    checkRadialBasisFunction(variables.size(), shapeParameter, centers, weights);
+    radialBasisFunctions.push_back(RadialBasisFunctionInfo(name, type, shapeParameter, variables, centers, weights));
+    return radialBasisFunctions.size()-1;
+}
+
+void ExtendedCustomCVForce::getRadialBasisFunctionParameters(int index, string& name, RadialBasisFunctionType& type, double& shapeParameter,
+                                                             vector<string>& variables, vector<double>& centers,
+                                                             vector<double>& weights) const {
+    ASSERT_VALID_INDEX(index, radialBasisFunctions);
+    const RadialBasisFunctionInfo& info = radialBasisFunctions[index];
+    name = info.name;
+    type = info.type;
+    shapeParameter = info.shapeParameter;
+    variables = info.variables;
+    centers = info.centers;
+    weights = info.weights;
+}
+
+void ExtendedCustomCVForce::setRadialBasisFunctionParameters(int index, RadialBasisFunctionType type, double shapeParameter,
+                                                             const vector<double>& centers, const vector<double>& weights) {
+    ASSERT_VALID_INDEX(index, radialBasisFunctions);
+    RadialBasisFunctionInfo& info = radialBasisFunctions[index];
+    checkRadialBasisFunction(info.variables.size(), shapeParameter, centers, weights);
+    info.type = type;
+    info.shapeParameter = shapeParameter;
+    info.centers = centers;
+    info.weights = weights;
+}
+
+int ExtendedCustomCVForce::addCustomSummation(const string& name, CustomSummation* summation, const vector<string>& variables) {
+    if (variables.size() != summation->getNumArguments())
+        throw OpenMMException("ExtendedCustomCVForce: the number of variables of a custom summation must equal that of its arguments");
+    summations.push_back(SummationInfo(name, summation, variables));
+    return summations.size()-1;
+}
+
+const CustomSummation& ExtendedCustomCVForce::getCustomSummation(int index) const {
+    ASSERT_VALID_INDEX(index, summations);
+    return *summations[index].summation;
+}
+
+CustomSummation& ExtendedCustomCVForce::getCustomSummation(int index) {
+    ASSERT_VALID_INDEX(index, summations);
+    return *summations[index].summation;
+}
+
+const string& ExtendedCustomCVForce::getCustomSummationName(int index) const {
+    ASSERT_VALID_INDEX(index, summations);
+    return summations[index].name;
+}
+
+const vector<string>& ExtendedCustomCVForce::getCustomSummationVariables(int index) const {
+    ASSERT_VALID_INDEX(index, summations);
+    return summations[index].variables;
+}
+
+void ExtendedCustomCVForce::setCustomSummationDeposition(int index, int interval, const vector<string>& parameters) {
+    ASSERT_VALID_INDEX(index, summations);
+    if (interval < 0)
+        throw OpenMMException("ExtendedCustomCVForce: the deposition interval cannot be negative");
+    if (interval > 0 && parameters.size() != summations[index].summation->getPerTermParameters().size())
+        throw OpenMMException("ExtendedCustomCVForce: the number of deposition expressions must equal that of per-term parameters");
+    summations[index].depositionInterval = interval;
+    summations[index].depositionParameters = parameters;
+}
+
+int ExtendedCustomCVForce::getCustomSummationDepositionInterval(int index) const {
+    ASSERT_VALID_INDEX(index, summations);
+    return summations[index].depositionInterval;
+}
+
+const vector<string>& ExtendedCustomCVForce::getCustomSummationDepositionParameters(int index) const {
+    ASSERT_VALID_INDEX(index, summations);
+    return summations[index].depositionParameters;
+}
+
+void ExtendedCustomCVForce::getCustomSummationDepositedTerms(Context& context, int index, vector<vector<double> >& terms) const {
+    ASSERT_VALID_INDEX(index, summations);
+    dynamic_cast<ExtendedCustomCVForceImpl&>(getImplInContext(context)).getDepositedTerms(index, terms);
+}
+
+void ExtendedCustomCVForce::getCollectiveVariableHistory(Context& context, vector<long long>& steps, vector<vector<double> >& values,
+                                                         vector<double>& energies) const {
+    dynamic_cast<ExtendedCustomCVForceImpl&>(getImplInContext(context)).getCollectiveVariableHistory(getContextImpl(context), steps, values, energies);
+}
+
+void ExtendedCustomCVForce::getCollectiveVariableValuesForFrames(Context& context, const vector<vector<Vec3> >& frames,
+                                                                 const vector<vector<Vec3> >& boxVectors, vector<vector<double> >& values) const {
+    dynamic_cast<ExtendedCustomCVForceImpl&>(getImplInContext(context)).getCollectiveVariableValuesForFrames(getContextImpl(context), frames,
+                                                                                                            boxVectors, values);
+}
+
 void ExtendedCustomCVForce::getCollectiveVariableValues(Context& context, vector<double>& values) const {
     dynamic_cast<ExtendedCustomCVForceImpl&>(getImplInContext(context)).getCollectiveVariableValues(getContextImpl(context), values);
 }
@@ -135,6 +373,40 @@ Context& ExtendedCustomCVForce::getInnerContext(Context& context) {
     return dynamic_cast<ExtendedCustomCVForceImpl&>(getImplInContext(context)).getInnerContext();
 }
 
+map<string, double> ExtendedCustomCVForce::getStageTimesInContext(Context& context) {
+    map<string, double> times;
+    dynamic_cast<ExtendedCustomCVForceImpl&>(getImplInContext(context)).getStageTimes(times);
+    return times;
+}
+
+void ExtendedCustomCVForce::resetStageTimesInContext(Context& context) {
+    dynamic_cast<ExtendedCustomCVForceImpl&>(getImplInContext(context)).resetStageTimes();
+}
+
+map<string, long long> ExtendedCustomCVForce::getCountersInContext(Context& context) {
+    map<string, long long> counters;
+    dynamic_cast<ExtendedCustomCVForceImpl&>(getImplInContext(context)).getCounters(counters);
+    return counters;
+}
+
+void ExtendedCustomCVForce::resetCountersInContext(Context& context) {
+    dynamic_cast<ExtendedCustomCVForceImpl&>(getImplInContext(context)).resetCounters();
+}
+
+void ExtendedCustomCVForce::getCollectiveVariableCacheInContext(Context& context, vector<long long>& steps, vector<double>& values,
+                                                                vector<vector<double> >& derivatives) {
+    dynamic_cast<ExtendedCustomCVForceImpl&>(getImplInContext(context)).getCollectiveVariableCache(steps, values, derivatives);
+}
+
+void ExtendedCustomCVForce::setCollectiveVariableCacheInContext(Context& context, const vector<long long>& steps, const vector<double>& values,
+                                                                const vector<vector<double> >& derivatives) {
+    dynamic_cast<ExtendedCustomCVForceImpl&>(getImplInContext(context)).setCollectiveVariableCache(steps, values, derivatives);
+}
+
+void ExtendedCustomCVForce::getDeviceArraysInContext(Context& context, DeviceArray& forces, DeviceArray& atomIndices, vector<int>& variables) {
+    dynamic_cast<ExtendedCustomCVForceImpl&>(getImplInContext(context)).getForceArrays(forces, atomIndices, variables);
+}
+
 void ExtendedCustomCVForce::updateParametersInContext(Context& context) {
     dynamic_cast<ExtendedCustomCVForceImpl&>(getImplInContext(context)).updateParametersInContext(getContextImpl(context));
 }
@@ -143,5 +415,8 @@ bool ExtendedCustomCVForce::usesPeriodicBoundaryConditions() const {
     for (auto& variable : variables)
         if (variable.variable->usesPeriodicBoundaryConditions())
             return true;
+    for (auto& batch : batches)
+        if (batch.variables->usesPeriodicBoundaryConditions())
+            return true;
     return false;
 }
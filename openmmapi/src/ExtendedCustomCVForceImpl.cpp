@@ -10,29 +10,510 @@
 
 
 #include "internal/ExtendedCustomCVForceImpl.h"
+#include "internal/TracingRange.h"
 #include "OpenMMLabKernels.h"
+#include "SlicedNonbondedForce.h"
 
+#include "openmm/CMAPTorsionForce.h"
+#include "openmm/CustomAngleForce.h"
+#include "openmm/CustomBondForce.h"
+#include "openmm/CustomCompoundBondForce.h"
+#include "openmm/CustomExternalForce.h"
+#include "openmm/CustomTorsionForce.h"
+#include "openmm/GBSAOBCForce.h"
+#include "openmm/HarmonicAngleForce.h"
+#include "openmm/HarmonicBondForce.h"
 #include "openmm/NonbondedForce.h"
 #include "openmm/OpenMMException.h"
+#include "openmm/Platform.h"
+#include "openmm/PeriodicTorsionForce.h"
+#include "openmm/RBTorsionForce.h"
+#include "openmm/RMSDForce.h"
+#include "openmm/State.h"
+#include "openmm/VirtualSite.h"
 #include "openmm/internal/ContextImpl.h"
 #include "openmm/serialization/XmlSerializer.h"
+#include "openmm/reference/ReferenceTabulatedFunction.h"
+#include "lepton/CustomFunction.h"
+#include "lepton/ParsedExpression.h"
+#include "lepton/Parser.h"
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <future>
 #include <map>
+#include <mutex>
+#include <set>
+#include <typeindex>
 
 using namespace OpenMMLab;
 using namespace OpenMM;
 using namespace std;
 
-ExtendedCustomCVForceImpl::ExtendedCustomCVForceImpl(const ExtendedCustomCVForce& owner) : owner(owner), innerIntegrator(1.0),
-        innerContext(NULL) {
+template <class T>
+static Force* copyForceOfType(const Force& force) {
+    return new T(dynamic_cast<const T&>(force));
+}
+
+/**
+ * The registered copy functions, indexed by exact type.  They start with the Forces whose
+ * copy constructors are deep copies, because they own no objects through pointers.
+ */
+static map<type_index, ExtendedCustomCVForceImpl::CopyFunction>& getCopyFunctions() {
+    static map<type_index, ExtendedCustomCVForceImpl::CopyFunction> functions = {
+        {type_index(typeid(CMAPTorsionForce)), copyForceOfType<CMAPTorsionForce>},
+        {type_index(typeid(CustomAngleForce)), copyForceOfType<CustomAngleForce>},
+        {type_index(typeid(CustomBondForce)), copyForceOfType<CustomBondForce>},
+        {type_index(typeid(CustomExternalForce)), copyForceOfType<CustomExternalForce>},
+        {type_index(typeid(CustomTorsionForce)), copyForceOfType<CustomTorsionForce>},
+        {type_index(typeid(GBSAOBCForce)), copyForceOfType<GBSAOBCForce>},
+        {type_index(typeid(HarmonicAngleForce)), copyForceOfType<HarmonicAngleForce>},
+        {type_index(typeid(HarmonicBondForce)), copyForceOfType<HarmonicBondForce>},
+        {type_index(typeid(NonbondedForce)), copyForceOfType<NonbondedForce>},
+        {type_index(typeid(PeriodicTorsionForce)), copyForceOfType<PeriodicTorsionForce>},
+        {type_index(typeid(RBTorsionForce)), copyForceOfType<RBTorsionForce>},
+        {type_index(typeid(RMSDForce)), copyForceOfType<RMSDForce>},
+        {type_index(typeid(SlicedNonbondedForce)), copyForceOfType<SlicedNonbondedForce>}
+    };
+    return functions;
+}
+
+static mutex copyFunctionsLock;
+
+void ExtendedCustomCVForceImpl::registerCopyFunction(const type_info& type, CopyFunction function) {
+    lock_guard<mutex> guard(copyFunctionsLock);
+    getCopyFunctions()[type_index(type)] = function;
+}
+
+Force* ExtendedCustomCVForceImpl::copyForce(const Force& force) {
+    CopyFunction function = NULL;
+    {
+        lock_guard<mutex> guard(copyFunctionsLock);
+        auto entry = getCopyFunctions().find(type_index(typeid(force)));
+        if (entry != getCopyFunctions().end())
+            function = entry->second;
+    }
+    if (function != NULL)
+        return function(force);
+    return XmlSerializer::clone<Force>(force);
+}
+
+/**
+ * Create a copy of a VirtualSite defining a shared particle, to be owned by a System or another force.
+ */
+static VirtualSite* copyVirtualSite(const VirtualSite& site) {
+    if (const TwoParticleAverageSite* s = dynamic_cast<const TwoParticleAverageSite*>(&site))
+        return new TwoParticleAverageSite(s->getParticle(0), s->getParticle(1), s->getWeight(0), s->getWeight(1));
+    if (const ThreeParticleAverageSite* s = dynamic_cast<const ThreeParticleAverageSite*>(&site))
+        return new ThreeParticleAverageSite(s->getParticle(0), s->getParticle(1), s->getParticle(2), s->getWeight(0), s->getWeight(1), s->getWeight(2));
+    if (const OutOfPlaneSite* s = dynamic_cast<const OutOfPlaneSite*>(&site))
+        return new OutOfPlaneSite(s->getParticle(0), s->getParticle(1), s->getParticle(2), s->getWeight12(), s->getWeight13(), s->getWeightCross());
+    if (const LocalCoordinatesSite* s = dynamic_cast<const LocalCoordinatesSite*>(&site)) {
+        vector<int> particles(s->getNumParticles());
+        for (int i = 0; i < particles.size(); i++)
+            particles[i] = s->getParticle(i);
+        return new LocalCoordinatesSite(particles, s->getOriginWeights(), s->getXWeights(), s->getYWeights(), s->getLocalPosition());
+    }
+    throw OpenMMException("ExtendedCustomCVForce: unsupported type of VirtualSite for a shared particle");
+}
+
+Force* ExtendedCustomCVForceImpl::createBatchForce(const Force& variables, int firstParticle) {
+    const CustomBondForce* bonds = dynamic_cast<const CustomBondForce*>(&variables);
+    const CustomCompoundBondForce* compound = dynamic_cast<const CustomCompoundBondForce*>(&variables);
+    if (bonds == NULL && compound == NULL)
+        throw OpenMMException("ExtendedCustomCVForce: a batch of collective variables must be a CustomBondForce or a CustomCompoundBondForce");
+    int numParticles = (bonds != NULL ? 2 : compound->getNumParticlesPerBond());
+    string origin = to_string(numParticles+1), particle = to_string(numParticles+2);
+    string expression = "(x"+particle+"-x"+origin+")*batchTerm; batchTerm=";
+    if (bonds != NULL)
+        expression += bonds->getEnergyFunction()+"; r=distance(p1,p2)";
+    else
+        expression += compound->getEnergyFunction();
+    CustomCompoundBondForce* force = new CustomCompoundBondForce(numParticles+2, expression);
+    force->setUsesPeriodicBoundaryConditions(variables.usesPeriodicBoundaryConditions());
+    vector<int> particles;
+    vector<double> parameters;
+    if (bonds != NULL) {
+        for (int i = 0; i < bonds->getNumGlobalParameters(); i++)
+            force->addGlobalParameter(bonds->getGlobalParameterName(i), bonds->getGlobalParameterDefaultValue(i));
+        for (int i = 0; i < bonds->getNumEnergyParameterDerivatives(); i++)
+            force->addEnergyParameterDerivative(bonds->getEnergyParameterDerivativeName(i));
+        for (int i = 0; i < bonds->getNumPerBondParameters(); i++)
+            force->addPerBondParameter(bonds->getPerBondParameterName(i));
+        particles.resize(2);
+        for (int i = 0; i < bonds->getNumBonds(); i++) {
+            bonds->getBondParameters(i, particles[0], particles[1], parameters);
+            force->addBond({particles[0], particles[1], firstParticle, firstParticle+1+i}, parameters);
+        }
+    }
+    else {
+        for (int i = 0; i < compound->getNumGlobalParameters(); i++)
+            force->addGlobalParameter(compound->getGlobalParameterName(i), compound->getGlobalParameterDefaultValue(i));
+        for (int i = 0; i < compound->getNumEnergyParameterDerivatives(); i++)
+            force->addEnergyParameterDerivative(compound->getEnergyParameterDerivativeName(i));
+        for (int i = 0; i < compound->getNumPerBondParameters(); i++)
+            force->addPerBondParameter(compound->getPerBondParameterName(i));
+        for (int i = 0; i < compound->getNumTabulatedFunctions(); i++)
+            force->addTabulatedFunction(compound->getTabulatedFunctionName(i), XmlSerializer::clone<TabulatedFunction>(compound->getTabulatedFunction(i)));
+        for (int i = 0; i < compound->getNumBonds(); i++) {
+            compound->getBondParameters(i, particles, parameters);
+            particles.push_back(firstParticle);
+            particles.push_back(firstParticle+1+i);
+            force->addBond(particles, parameters);
+        }
+    }
+    return force;
+}
+
+
+/**
+ * Get the ExtendedCustomCVForce that defines a collective variable, if it can be merged into
+ * the force containing it, or NULL otherwise.  This is the case if it has no radial basis
+ * functions, custom summations, or batches of collective variables, which cannot be written as
+ * subexpressions, and no shared particles, whose indices depend on the System it is part of.
+ */
+static const ExtendedCustomCVForce* getComposableForce(const Force& variable) {
+    const ExtendedCustomCVForce* nested = dynamic_cast<const ExtendedCustomCVForce*>(&variable);
+    if (nested == NULL || nested->getNumRadialBasisFunctions() > 0 || nested->getNumCustomSummations() > 0 ||
+            nested->getNumCollectiveVariableBatches() > 0 || nested->getNumSharedParticles() > 0)
+        return NULL;
+    return nested;
+}
+
+/**
+ * Get the composable ExtendedCustomCVForce that defines a collective variable of a force, or
+ * NULL if there is none.  A variable placed on another platform is never merged, since it is
+ * evaluated as a whole in a Context of that platform.
+ */
+static const ExtendedCustomCVForce* getComposableVariable(const ExtendedCustomCVForce& force, int index) {
+    if (!force.getCollectiveVariablePlatform(index).empty())
+        return NULL;
+    return getComposableForce(force.getCollectiveVariable(index));
+}
+
+/**
+ * Get the number of collective variables a composable force is flattened into.
+ */
+static int countLeafVariables(const ExtendedCustomCVForce& force) {
+    int count = 0;
+    for (int i = 0; i < force.getNumCollectiveVariables(); i++) {
+        const ExtendedCustomCVForce* nested = getComposableVariable(force, i);
+        count += (nested == NULL ? 1 : countLeafVariables(*nested));
+    }
+    return count;
+}
+
+static string trimSpaces(const string& text) {
+    size_t first = text.find_first_not_of(" \t\n");
+    if (first == string::npos)
+        return "";
+    return text.substr(first, text.find_last_not_of(" \t\n")-first+1);
+}
+
+/**
+ * Split an expression into its main expression and the definitions of its subexpressions.
+ */
+static vector<string> splitExpression(const string& expression) {
+    vector<string> parts;
+    size_t start = 0;
+    while (true) {
+        size_t end = expression.find(';', start);
+        string part = trimSpaces(expression.substr(start, end == string::npos ? string::npos : end-start));
+        if (parts.empty() || part.size() > 0)
+            parts.push_back(part);
+        if (end == string::npos)
+            return parts;
+        start = end+1;
+    }
+}
+
+/**
+ * Replace the names of variables and functions in an expression.  Numbers are skipped along
+ * with their exponents, so that the e of 1e-5 is not taken for a name.
+ */
+static string renameIdentifiers(const string& expression, const map<string, string>& replacements) {
+    const string delimiters = " \t\n+-*/^(),;=";
+    string result;
+    int pos = 0, size = expression.size();
+    while (pos < size) {
+        int start = pos;
+        char c = expression[pos];
+        if (delimiters.find(c) != string::npos)
+            pos++;
+        else if (c == '.' || isdigit((unsigned char) c)) {
+            while (pos < size && (expression[pos] == '.' || isdigit((unsigned char) expression[pos])))
+                pos++;
+            if (pos < size && (expression[pos] == 'e' || expression[pos] == 'E')) {
+                pos++;
+                if (pos < size && (expression[pos] == '+' || expression[pos] == '-'))
+                    pos++;
+                while (pos < size && isdigit((unsigned char) expression[pos]))
+                    pos++;
+            }
+        }
+        else {
+            while (pos < size && delimiters.find(expression[pos]) == string::npos)
+                pos++;
+            auto replacement = replacements.find(expression.substr(start, pos-start));
+            if (replacement != replacements.end()) {
+                result += replacement->second;
+                continue;
+            }
+        }
+        result += expression.substr(start, pos-start);
+    }
+    return result;
+}
+
+ExtendedCustomCVForceImpl::ExtendedCustomCVForceImpl(const ExtendedCustomCVForce& owner) : owner(owner), flattenedForce(NULL),
+        innerIntegrator(1.0), innerContext(NULL), numParticles(0), numSharedParticles(0) {
     forceGroup = owner.getForceGroup();
 }
 
 ExtendedCustomCVForceImpl::~ExtendedCustomCVForceImpl() {
+    placed.pending = future<void>();
+    for (auto placedContext : placedContexts)
+        delete placedContext;
+    for (auto placedIntegrator : placedIntegrators)
+        delete placedIntegrator;
+    for (auto placedSystem : placedSystems)
+        delete placedSystem;
     if (innerContext != NULL)
         delete innerContext;
+    if (flattenedForce != NULL)
+        delete flattenedForce;
+}
+
+void ExtendedCustomCVForceImpl::setTabulatedFunction(int index, const string& name, const TabulatedFunction& function, bool update) {
+    TabulatedFunction* copy = XmlSerializer::clone<TabulatedFunction>(function);
+    if (update) {
+        delete flattenedForce->functions[index].function;
+        flattenedForce->functions[index].function = copy;
+    }
+    else
+        flattenedForce->addTabulatedFunction(name, copy);
+}
+
+void ExtendedCustomCVForceImpl::addLeafVariable(const Force& variable, const string& name, int interval, const string& platform, bool update,
+                                                int& numVariables) {
+    if (!update) {
+        flattenedForce->addCollectiveVariable(name, copyForce(variable));
+        flattenedForce->setCollectiveVariablePlatform(numVariables, platform);
+    }
+    flattenedForce->setCollectiveVariableInterval(numVariables++, interval);
+}
+
+void ExtendedCustomCVForceImpl::addNestedVariables(const ExtendedCustomCVForce& nested, const string& name, int interval, bool update,
+                                                   int& numVariables, int& numFunctions, vector<string>& definitions) {
+    // The collective variables, tabulated functions, and subexpressions of the nested force
+    // are renamed so that they cannot clash with those of other forces.  Global parameters
+    // keep their names, since they are shared by the whole Context anyway.
+
+    string prefix = name+".";
+    map<string, string> replacements;
+    vector<string> parts = splitExpression(nested.getEnergyFunction());
+    for (int i = 1; i < parts.size(); i++) {
+        string subexpression = trimSpaces(parts[i].substr(0, parts[i].find('=')));
+        replacements[subexpression] = prefix+subexpression;
+    }
+    for (int i = 0; i < nested.getNumCollectiveVariables(); i++)
+        replacements[nested.getCollectiveVariableName(i)] = prefix+nested.getCollectiveVariableName(i);
+    for (int i = 0; i < nested.getNumTabulatedFunctions(); i++) {
+        const string& functionName = nested.getTabulatedFunctionName(i);
+        replacements[functionName] = prefix+functionName;
+        setTabulatedFunction(numFunctions++, prefix+functionName, nested.getTabulatedFunction(i), update);
+    }
+    if (!update) {
+        set<string> parameters, derivatives;
+        for (int i = 0; i < flattenedForce->getNumGlobalParameters(); i++)
+            parameters.insert(flattenedForce->getGlobalParameterName(i));
+        for (int i = 0; i < flattenedForce->getNumEnergyParameterDerivatives(); i++)
+            derivatives.insert(flattenedForce->getEnergyParameterDerivativeName(i));
+        for (int i = 0; i < nested.getNumGlobalParameters(); i++)
+            if (parameters.find(nested.getGlobalParameterName(i)) == parameters.end())
+                flattenedForce->addGlobalParameter(nested.getGlobalParameterName(i), nested.getGlobalParameterDefaultValue(i));
+        for (int i = 0; i < nested.getNumEnergyParameterDerivatives(); i++)
+            if (derivatives.find(nested.getEnergyParameterDerivativeName(i)) == derivatives.end())
+                flattenedForce->addEnergyParameterDerivative(nested.getEnergyParameterDerivativeName(i));
+    }
+
+    // A subexpression may only refer to those defined after it, so the definitions of the
+    // variables of the nested force follow its own.
+
+    definitions.push_back(name+"="+renameIdentifiers(parts[0], replacements));
+    for (int i = 1; i < parts.size(); i++)
+        definitions.push_back(renameIdentifiers(parts[i], replacements));
+    for (int i = 0; i < nested.getNumCollectiveVariables(); i++) {
+        const ExtendedCustomCVForce* child = getComposableVariable(nested, i);
+        int variableInterval = max(interval, nested.getCollectiveVariableInterval(i));
+        if (child != NULL)
+            addNestedVariables(*child, prefix+nested.getCollectiveVariableName(i), variableInterval, update, numVariables, numFunctions, definitions);
+        else
+            addLeafVariable(nested.getCollectiveVariable(i), prefix+nested.getCollectiveVariableName(i), variableInterval,
+                            nested.getCollectiveVariablePlatform(i), update, numVariables);
+    }
+}
+
+void ExtendedCustomCVForceImpl::flattenOwner(bool update) {
+    // When updating, the flattened force already has the same structure, and only the
+    // parameters that updateParametersInContext() transfers are copied again.
+
+    if (!update) {
+        flattenedForce = new ExtendedCustomCVForce(owner.getEnergyFunction());
+        flattenedForce->setUseCompressedForces(owner.getUseCompressedForces());
+        flattenedForce->setUseDerivativesOnDemand(owner.getUseDerivativesOnDemand());
+        flattenedForce->setCollectiveVariableHistorySize(owner.getCollectiveVariableHistorySize());
+        for (int i = 0; i < owner.getNumGlobalParameters(); i++)
+            flattenedForce->addGlobalParameter(owner.getGlobalParameterName(i), owner.getGlobalParameterDefaultValue(i));
+        for (int i = 0; i < owner.getNumEnergyParameterDerivatives(); i++)
+            flattenedForce->addEnergyParameterDerivative(owner.getEnergyParameterDerivativeName(i));
+        for (int i = 0; i < owner.getNumSharedParticles(); i++)
+            flattenedForce->addSharedParticle(copyVirtualSite(owner.getSharedParticle(i)));
+    }
+    int numVariables = 0, numFunctions = 0;
+    for (int i = 0; i < owner.getNumTabulatedFunctions(); i++)
+        setTabulatedFunction(numFunctions++, owner.getTabulatedFunctionName(i), owner.getTabulatedFunction(i), update);
+    vector<string> definitions;
+    valueIndices.clear();
+    for (int i = 0; i < owner.getNumCollectiveVariables(); i++) {
+        const string& name = owner.getCollectiveVariableName(i);
+        int interval = owner.getCollectiveVariableInterval(i);
+        if (nestedForces[i] != NULL) {
+            valueIndices.push_back(-1);
+            addNestedVariables(*nestedForces[i], name, interval, update, numVariables, numFunctions, definitions);
+        }
+        else {
+            valueIndices.push_back(numVariables);
+            addLeafVariable(owner.getCollectiveVariable(i), name, interval, owner.getCollectiveVariablePlatform(i), update, numVariables);
+        }
+    }
+    for (int i = 0; i < owner.getNumRadialBasisFunctions(); i++) {
+        string name;
+        ExtendedCustomCVForce::RadialBasisFunctionType type;
+        double shapeParameter;
+        vector<string> variables;
+        vector<double> centers, weights;
+        owner.getRadialBasisFunctionParameters(i, name, type, shapeParameter, variables, centers, weights);
+        if (update)
+            flattenedForce->setRadialBasisFunctionParameters(i, type, shapeParameter, centers, weights);
+        else
+            flattenedForce->addRadialBasisFunction(name, type, shapeParameter, variables, centers, weights);
+    }
+    for (int i = 0; i < owner.getNumCustomSummations(); i++) {
+        CustomSummation* summation = owner.getCustomSummation(i).clone();
+        if (update) {
+            delete flattenedForce->summations[i].summation;
+            flattenedForce->summations[i].summation = summation;
+        }
+        else
+            flattenedForce->addCustomSummation(owner.getCustomSummationName(i), summation, owner.getCustomSummationVariables(i));
+        vector<string> depositionParameters = owner.getCustomSummationDepositionParameters(i);
+        for (auto& parameter : depositionParameters)
+            for (auto& definition : definitions)
+                parameter += "; "+definition;
+        flattenedForce->setCustomSummationDeposition(i, owner.getCustomSummationDepositionInterval(i), depositionParameters);
+    }
+    for (int i = 0; i < owner.getNumCollectiveVariableBatches(); i++) {
+        if (!update)
+            flattenedForce->addCollectiveVariableBatch(owner.getCollectiveVariableBatchNames(i), copyForce(owner.getCollectiveVariableBatch(i)));
+        for (int j = 0; j < owner.getCollectiveVariableBatchNames(i).size(); j++)
+            valueIndices.push_back(numVariables++);
+    }
+    if (!update) {
+        string energy = owner.getEnergyFunction();
+        for (auto& definition : definitions)
+            energy += "; "+definition;
+        flattenedForce->setEnergyFunction(energy);
+        nestedDefinitions = definitions;
+        int index = 0;
+        for (int i = 0; i < flattenedForce->getNumCollectiveVariables(); i++)
+            flattenedIndices[flattenedForce->getCollectiveVariableName(i)] = index++;
+        for (int i = 0; i < flattenedForce->getNumCollectiveVariableBatches(); i++)
+            for (auto& name : flattenedForce->getCollectiveVariableBatchNames(i))
+                flattenedIndices[name] = index++;
+    }
+    createValueExpressions();
+}
+
+void ExtendedCustomCVForceImpl::createValueExpressions() {
+    // The values of the nested variables are computed on the host from those of the leaves,
+    // which is only needed by getCollectiveVariableValues().
+
+    map<string, Lepton::CustomFunction*> functions;
+    for (int i = 0; i < flattenedForce->getNumTabulatedFunctions(); i++)
+        functions[flattenedForce->getTabulatedFunctionName(i)] = createReferenceTabulatedFunction(flattenedForce->getTabulatedFunction(i));
+    valueExpressions.clear();
+    for (int i = 0; i < owner.getNumCollectiveVariables(); i++)
+        if (valueIndices[i] == -1) {
+            string expression = owner.getCollectiveVariableName(i);
+            for (auto& definition : nestedDefinitions)
+                expression += "; "+definition;
+            valueExpressions[i] = Lepton::Parser::parse(expression, functions).optimize().createCompiledExpression();
+        }
+    for (auto& function : functions)
+        delete function.second;
 }
 
 void ExtendedCustomCVForceImpl::initialize(ContextImpl& context) {
+    // Make sure every radial basis function and custom summation depends only on collective variables.
+
+    set<string> variableNames;
+    for (int i = 0; i < owner.getNumCollectiveVariables(); i++)
+        variableNames.insert(owner.getCollectiveVariableName(i));
+    for (int i = 0; i < owner.getNumCollectiveVariableBatches(); i++)
+        variableNames.insert(owner.getCollectiveVariableBatchNames(i).begin(), owner.getCollectiveVariableBatchNames(i).end());
+    for (int i = 0; i < owner.getNumRadialBasisFunctions(); i++) {
+        string name;
+        ExtendedCustomCVForce::RadialBasisFunctionType type;
+        double shapeParameter;
+        vector<string> variables;
+        vector<double> centers, weights;
+        owner.getRadialBasisFunctionParameters(i, name, type, shapeParameter, variables, centers, weights);
+        if (variableNames.find(name) != variableNames.end())
+            throw OpenMMException("ExtendedCustomCVForce: radial basis function '"+name+"' has the same name as a collective variable");
+        for (auto& variable : variables)
+            if (variableNames.find(variable) == variableNames.end())
+                throw OpenMMException("ExtendedCustomCVForce: radial basis function '"+name+"' depends on unknown collective variable '"+variable+"'");
+    }
+    for (int i = 0; i < owner.getNumCustomSummations(); i++) {
+        const string& name = owner.getCustomSummationName(i);
+        if (variableNames.find(name) != variableNames.end())
+            throw OpenMMException("ExtendedCustomCVForce: custom summation '"+name+"' has the same name as a collective variable");
+        for (auto& variable : owner.getCustomSummationVariables(i))
+            if (variableNames.find(variable) == variableNames.end())
+                throw OpenMMException("ExtendedCustomCVForce: custom summation '"+name+"' depends on unknown collective variable '"+variable+"'");
+    }
+
+    // Nested forces are flattened into a single inner system, unless that would exceed the
+    // number of force groups.  A nested variable used as an argument of a radial basis function
+    // or custom summation is kept as it is, since these need the values of actual variables.
+
+    set<string> arguments;
+    for (int i = 0; i < owner.getNumRadialBasisFunctions(); i++) {
+        string name;
+        ExtendedCustomCVForce::RadialBasisFunctionType type;
+        double shapeParameter;
+        vector<string> variables;
+        vector<double> centers, weights;
+        owner.getRadialBasisFunctionParameters(i, name, type, shapeParameter, variables, centers, weights);
+        arguments.insert(variables.begin(), variables.end());
+    }
+    for (int i = 0; i < owner.getNumCustomSummations(); i++)
+        arguments.insert(owner.getCustomSummationVariables(i).begin(), owner.getCustomSummationVariables(i).end());
+    bool nesting = false;
+    int numLeaves = owner.getNumCollectiveVariableBatches();
+    for (int i = 0; i < owner.getNumCollectiveVariables(); i++) {
+        const ExtendedCustomCVForce* nested = NULL;
+        if (arguments.find(owner.getCollectiveVariableName(i)) == arguments.end())
+            nested = getComposableVariable(owner, i);
+        nestedForces.push_back(nested);
+        nesting = nesting || nested != NULL;
+        numLeaves += (nested == NULL ? 1 : countLeafVariables(*nested));
+    }
+    if (nesting && numLeaves <= 32)
+        flattenOwner(false);
+    const ExtendedCustomCVForce& force = getFlattenedForce();
+
     // Construct the inner system used to evaluate collective variables.
 
     const System& system = context.getSystem();
@@ -41,30 +522,178 @@ void ExtendedCustomCVForceImpl::initialize(ContextImpl& context) {
     innerSystem.setDefaultPeriodicBoxVectors(a, b, c);
     for (int i = 0; i < system.getNumParticles(); i++)
         innerSystem.addParticle(system.getParticleMass(i));
-    for (int i = 0; i < owner.getNumCollectiveVariables(); i++) {
-        Force* variable = XmlSerializer::clone<Force>(owner.getCollectiveVariable(i));
+    numParticles = system.getNumParticles();
+    numSharedParticles = force.getNumSharedParticles();
+    for (int i = 0; i < numSharedParticles; i++) {
+        const VirtualSite& site = force.getSharedParticle(i);
+        for (int j = 0; j < site.getNumParticles(); j++)
+            if (site.getParticle(j) >= numParticles)
+                throw OpenMMException("ExtendedCustomCVForce: a shared particle can only depend on particles of the System");
+        innerSystem.setVirtualSite(innerSystem.addParticle(0.0), copyVirtualSite(site));
+    }
+    for (int i = 0; i < force.getNumCollectiveVariables(); i++) {
+        if (!force.getCollectiveVariablePlatform(i).empty())
+            continue;
+        Force* variable = copyForce(force.getCollectiveVariable(i));
         variable->setForceGroup(i);
         NonbondedForce* nonbonded = dynamic_cast<NonbondedForce*>(variable);
         if (nonbonded != NULL)
             nonbonded->setReciprocalSpaceForceGroup(-1);
         innerSystem.addForce(variable);
     }
+    vector<Vec3> positions(numParticles+numSharedParticles, Vec3());
+    for (int i = 0; i < force.getNumCollectiveVariableBatches(); i++) {
+        int firstParticle = innerSystem.getNumParticles();
+        Force* variables = createBatchForce(force.getCollectiveVariableBatch(i), firstParticle);
+        if (dynamic_cast<CustomCompoundBondForce*>(variables)->getNumBonds() != force.getCollectiveVariableBatchNames(i).size()) {
+            delete variables;
+            throw OpenMMException("ExtendedCustomCVForce: the number of names of a batch of collective variables must equal that of its bonds");
+        }
+        variables->setForceGroup(force.getNumCollectiveVariables()+i);
+        innerSystem.addForce(variables);
+        innerSystem.addParticle(0.0);
+        positions.push_back(Vec3());
+        for (int j = 0; j < force.getCollectiveVariableBatchNames(i).size(); j++) {
+            innerSystem.addParticle(0.0);
+            positions.push_back(Vec3(1, 0, 0));
+        }
+    }
 
-    // Create the inner context.
+    // Create the inner context and the kernel.  The contexts of the variables placed on other
+    // platforms do not depend on them, so they are created in another thread meanwhile.
 
+    createPlacedSystems(force, system);
+    future<double> placedTask = async(launch::async, [this] () {
+        auto start = chrono::steady_clock::now();
+        createPlacedContexts();
+        return chrono::duration<double, milli>(chrono::steady_clock::now()-start).count();
+    });
+    auto start = chrono::steady_clock::now();
     innerContext = context.createLinkedContext(innerSystem, innerIntegrator);
-    vector<Vec3> positions(system.getNumParticles(), Vec3());
     innerContext->setPositions(positions);
+    auto innerEnd = chrono::steady_clock::now();
+    kernel = context.getPlatform().createKernel(CalcExtendedCustomCVForceKernel::Name(), context);
+    kernel.getAs<CalcExtendedCustomCVForceKernel>().initialize(context.getSystem(), force, getContextImpl(*innerContext), placed);
+    auto kernelEnd = chrono::steady_clock::now();
+    double placedTime = placedTask.get();
+    if (isProfilingEnabled()) {
+        initTimes["init:innerContext"] = chrono::duration<double, milli>(innerEnd-start).count();
+        initTimes["init:kernel"] = chrono::duration<double, milli>(kernelEnd-innerEnd).count();
+        if (!placedContexts.empty())
+            initTimes["init:placedContexts"] = placedTime;
+    }
+}
+
+void ExtendedCustomCVForceImpl::createPlacedSystems(const ExtendedCustomCVForce& force, const System& system) {
+    map<string, int> platformIndices;
+    for (int i = 0; i < force.getNumCollectiveVariables(); i++) {
+        const string& platform = force.getCollectiveVariablePlatform(i);
+        if (platform.empty())
+            continue;
+        if (platformIndices.find(platform) == platformIndices.end()) {
+            platformIndices[platform] = placedSystems.size();
+            placedPlatforms.push_back(platform);
+            System* placedSystem = new System();
+            Vec3 a, b, c;
+            system.getDefaultPeriodicBoxVectors(a, b, c);
+            placedSystem->setDefaultPeriodicBoxVectors(a, b, c);
+            for (int j = 0; j < system.getNumParticles(); j++)
+                placedSystem->addParticle(system.getParticleMass(j));
+            for (int j = 0; j < force.getNumSharedParticles(); j++)
+                placedSystem->setVirtualSite(placedSystem->addParticle(0.0), copyVirtualSite(force.getSharedParticle(j)));
+            placedSystems.push_back(placedSystem);
+        }
+        int index = platformIndices[platform];
+        Force* variable = copyForce(force.getCollectiveVariable(i));
+        variable->setForceGroup(placedSystems[index]->getNumForces());
+        NonbondedForce* nonbonded = dynamic_cast<NonbondedForce*>(variable);
+        if (nonbonded != NULL)
+            nonbonded->setReciprocalSpaceForceGroup(-1);
+        placed.indices.push_back(i);
+        placedContextIndices.push_back(index);
+        placedGroups.push_back(variable->getForceGroup());
+        placedIntervals.push_back(force.getCollectiveVariableInterval(i));
+        placedSystems[index]->addForce(variable);
+    }
+    int numPlaced = placed.indices.size();
+    placed.values.resize(numPlaced);
+    placed.forces.resize(numPlaced);
+    placedSteps.resize(numPlaced);
+    placedHasValue.resize(numPlaced, false);
+}
+
+void ExtendedCustomCVForceImpl::createPlacedContexts() {
+    for (int i = 0; i < placedSystems.size(); i++) {
+        placedIntegrators.push_back(new VerletIntegrator(1.0));
+        placedContexts.push_back(new Context(*placedSystems[i], *placedIntegrators[i], Platform::getPlatformByName(placedPlatforms[i])));
+    }
+}
 
-    // Create the kernel.
+void ExtendedCustomCVForceImpl::startPlacedEvaluation(ContextImpl& context, bool includeForces) {
+    // A placed variable whose evaluation interval has not elapsed keeps the results of its
+    // latest evaluation, as do the variables evaluated by the kernel.
 
-    kernel = context.getPlatform().createKernel(CalcExtendedCustomCVForceKernel::Name(), context);
-    kernel.getAs<CalcExtendedCustomCVForceKernel>().initialize(context.getSystem(), owner, getContextImpl(*innerContext));
+    if (placed.pending.valid())
+        placed.pending.wait();
+    long long step = context.getStepCount();
+    vector<int> due;
+    for (int i = 0; i < placed.indices.size(); i++)
+        if (placedIntervals[i] <= 1 || !placedHasValue[i] || (includeForces && placed.forces[i].empty()) ||
+                step < placedSteps[i] || step >= placedSteps[i]+placedIntervals[i])
+            due.push_back(i);
+    if (due.empty())
+        return;
+
+    // The state is read here rather than in the thread, since the platform of the Context may
+    // not allow its data to be accessed concurrently.  The positions are downloaded only once,
+    // and those of the shared particles are computed by the placed Contexts.
+
+    vector<Vec3> positions;
+    context.getPositions(positions);
+    positions.resize(numParticles+numSharedParticles);
+    Vec3 box[3];
+    context.getPeriodicBoxVectors(box[0], box[1], box[2]);
+    map<string, double> parameters;
+    for (auto placedContext : placedContexts)
+        for (auto& parameter : placedContext->getParameters())
+            parameters[parameter.first] = context.getParameter(parameter.first);
+    placed.pending = async(launch::async, [=] () {
+        evaluatePlacedVariables(due, positions, box, parameters, step, includeForces);
+    });
+}
+
+void ExtendedCustomCVForceImpl::evaluatePlacedVariables(const vector<int>& due, const vector<Vec3>& positions, const Vec3* box,
+                                                        const map<string, double>& parameters, long long step, bool includeForces) {
+    vector<bool> ready(placedContexts.size(), false);
+    int types = State::Energy | (includeForces ? State::Forces : 0);
+    for (int i : due) {
+        Context& placedContext = *placedContexts[placedContextIndices[i]];
+        if (!ready[placedContextIndices[i]]) {
+            placedContext.setPeriodicBoxVectors(box[0], box[1], box[2]);
+            placedContext.setPositions(positions);
+            if (numSharedParticles > 0)
+                placedContext.computeVirtualSites();
+            for (auto& parameter : placedContext.getParameters())
+                placedContext.setParameter(parameter.first, parameters.at(parameter.first));
+            ready[placedContextIndices[i]] = true;
+        }
+        State state = placedContext.getState(types, false, 1<<placedGroups[i]);
+        placed.values[i] = state.getPotentialEnergy();
+        if (includeForces)
+            placed.forces[i] = state.getForces();
+        else
+            placed.forces[i].clear();
+        placedSteps[i] = step;
+        placedHasValue[i] = true;
+    }
 }
 
 double ExtendedCustomCVForceImpl::calcForcesAndEnergy(ContextImpl& context, bool includeForces, bool includeEnergy, int groups) {
-    if ((groups&(1<<forceGroup)) != 0)
+    if ((groups&(1<<forceGroup)) != 0) {
+        OPENMMLAB_TRACE_STEP(context.getStepCount());
+        startPlacedEvaluation(context, includeForces);
         return kernel.getAs<CalcExtendedCustomCVForceKernel>().execute(context, getContextImpl(*innerContext), includeForces, includeEnergy);
+    }
     return 0.0;
 }
 
@@ -79,25 +708,138 @@ vector<pair<int, int> > ExtendedCustomCVForceImpl::getBondedParticles() const {
     const ContextImpl& innerContextImpl = getContextImpl(*innerContext);
     for (auto& impl : innerContextImpl.getForceImpls()) {
         for (auto& bond : impl->getBondedParticles())
-            bonds.push_back(bond);
+            if (max(bond.first, bond.second) < numParticles)
+                bonds.push_back(bond);
     }
+    for (auto placedContext : placedContexts)
+        for (auto& impl : getContextImpl(*placedContext).getForceImpls())
+            for (auto& bond : impl->getBondedParticles())
+                if (max(bond.first, bond.second) < numParticles)
+                    bonds.push_back(bond);
     return bonds;
 }
 
 map<string, double> ExtendedCustomCVForceImpl::getDefaultParameters() {
     map<string, double> parameters;
     parameters.insert(innerContext->getParameters().begin(), innerContext->getParameters().end());
-    for (int i = 0; i < owner.getNumGlobalParameters(); i++)
-        parameters[owner.getGlobalParameterName(i)] = owner.getGlobalParameterDefaultValue(i);
+    for (auto placedContext : placedContexts)
+        parameters.insert(placedContext->getParameters().begin(), placedContext->getParameters().end());
+    const ExtendedCustomCVForce& force = getFlattenedForce();
+    for (int i = 0; i < force.getNumGlobalParameters(); i++)
+        parameters[force.getGlobalParameterName(i)] = force.getGlobalParameterDefaultValue(i);
     return parameters;
 }
 
 void ExtendedCustomCVForceImpl::getCollectiveVariableValues(ContextImpl& context, vector<double>& values) {
-    kernel.getAs<CalcExtendedCustomCVForceKernel>().copyState(context, getContextImpl(*innerContext));
-    values.clear();
-    for (int i = 0; i < innerSystem.getNumForces(); i++) {
-        double value = innerContext->getState(State::Energy, false, 1<<i).getPotentialEnergy();
-        values.push_back(value);
+    CalcExtendedCustomCVForceKernel& calculator = kernel.getAs<CalcExtendedCustomCVForceKernel>();
+    startPlacedEvaluation(context, false);
+    if (flattenedForce == NULL) {
+        calculator.getCollectiveVariableValues(context, getContextImpl(*innerContext), values);
+        return;
+    }
+    vector<double> leafValues;
+    calculator.getCollectiveVariableValues(context, getContextImpl(*innerContext), leafValues);
+    computeNestedValues(context, leafValues, values);
+}
+
+void ExtendedCustomCVForceImpl::computeNestedValues(ContextImpl& context, const vector<double>& leafValues, vector<double>& values) {
+    values.resize(valueIndices.size());
+    for (int i = 0; i < valueIndices.size(); i++)
+        if (valueIndices[i] != -1)
+            values[i] = leafValues[valueIndices[i]];
+    for (auto& entry : valueExpressions) {
+        Lepton::CompiledExpression& expression = entry.second;
+        for (auto& name : expression.getVariables()) {
+            auto leaf = flattenedIndices.find(name);
+            expression.getVariableReference(name) = (leaf == flattenedIndices.end() ? context.getParameter(name) : leafValues[leaf->second]);
+        }
+        values[entry.first] = expression.evaluate();
+    }
+}
+
+void ExtendedCustomCVForceImpl::getCollectiveVariableValuesForFrames(ContextImpl& context, const vector<vector<Vec3> >& frames,
+                                                                     const vector<vector<Vec3> >& boxVectors, vector<vector<double> >& values) {
+    if (boxVectors.size() != 0 && boxVectors.size() != frames.size())
+        throw OpenMMException("getCollectiveVariableValuesForFrames: the number of box vectors must be 0 or the number of frames");
+    for (auto& frame : frames)
+        if (frame.size() != numParticles)
+            throw OpenMMException("getCollectiveVariableValuesForFrames: every frame must have the positions of all particles");
+    for (auto& box : boxVectors)
+        if (box.size() != 3)
+            throw OpenMMException("getCollectiveVariableValuesForFrames: every frame must have three box vectors");
+    if (placed.pending.valid())
+        placed.pending.wait();
+
+    // The parameters are set once for all frames.  The dummy particles of the batches keep
+    // their positions, since the kernel sets their displacements, and those of the shared
+    // particles are computed from each frame.
+
+    CalcExtendedCustomCVForceKernel& calculator = kernel.getAs<CalcExtendedCustomCVForceKernel>();
+    ContextImpl& inner = getContextImpl(*innerContext);
+    map<string, double> innerParameters = inner.getParameters();
+    for (auto& parameter : innerParameters)
+        if (context.getParameter(parameter.first) != parameter.second)
+            inner.setParameter(parameter.first, context.getParameter(parameter.first));
+    for (auto placedContext : placedContexts)
+        for (auto& parameter : placedContext->getParameters())
+            placedContext->setParameter(parameter.first, context.getParameter(parameter.first));
+    Vec3 box[3];
+    context.getPeriodicBoxVectors(box[0], box[1], box[2]);
+    vector<Vec3> innerPositions;
+    inner.getPositions(innerPositions);
+    vector<double> leafValues;
+    values.resize(frames.size());
+    for (int frame = 0; frame < frames.size(); frame++) {
+        if (boxVectors.size() > 0)
+            for (int i = 0; i < 3; i++)
+                box[i] = boxVectors[frame][i];
+        inner.setPeriodicBoxVectors(box[0], box[1], box[2]);
+        copy(frames[frame].begin(), frames[frame].end(), innerPositions.begin());
+        inner.setPositions(innerPositions);
+        if (numSharedParticles > 0)
+            inner.computeVirtualSites();
+        calculator.evaluateInnerVariables(inner, leafValues);
+        vector<bool> ready(placedContexts.size(), false);
+        for (int i = 0; i < placed.indices.size(); i++) {
+            Context& placedContext = *placedContexts[placedContextIndices[i]];
+            if (!ready[placedContextIndices[i]]) {
+                placedContext.setPeriodicBoxVectors(box[0], box[1], box[2]);
+                if (numSharedParticles > 0) {
+                    vector<Vec3> placedPositions(frames[frame]);
+                    placedPositions.resize(numParticles+numSharedParticles);
+                    placedContext.setPositions(placedPositions);
+                    placedContext.computeVirtualSites();
+                }
+                else
+                    placedContext.setPositions(frames[frame]);
+                ready[placedContextIndices[i]] = true;
+            }
+            leafValues[placed.indices[i]] = placedContext.getState(State::Energy, false, 1<<placedGroups[i]).getPotentialEnergy();
+        }
+        if (flattenedForce == NULL)
+            values[frame] = leafValues;
+        else
+            computeNestedValues(context, leafValues, values[frame]);
+    }
+
+    // The placed Contexts now hold the last frame, so their variables are evaluated again at
+    // the next step.  The kernel copies the state to the inner Context whenever it evaluates.
+
+    placedHasValue.assign(placedHasValue.size(), false);
+}
+
+void ExtendedCustomCVForceImpl::getCollectiveVariableHistory(ContextImpl& context, vector<long long>& steps, vector<vector<double> >& values,
+                                                             vector<double>& energies) {
+    // The values of nested variables are computed from those of the leaves, with the current
+    // values of the global parameters.
+
+    kernel.getAs<CalcExtendedCustomCVForceKernel>().getCollectiveVariableHistory(steps, values, energies);
+    if (flattenedForce == NULL)
+        return;
+    vector<double> leafValues;
+    for (auto& stepValues : values) {
+        leafValues.swap(stepValues);
+        computeNestedValues(context, leafValues, stepValues);
     }
 }
 
@@ -106,6 +848,63 @@ Context& ExtendedCustomCVForceImpl::getInnerContext() {
 }
 
 void ExtendedCustomCVForceImpl::updateParametersInContext(ContextImpl& context) {
-    kernel.getAs<CalcExtendedCustomCVForceKernel>().copyParametersToContext(context, owner);
+    if (flattenedForce != NULL)
+        flattenOwner(true);
+    for (int i = 0; i < placed.indices.size(); i++)
+        placedIntervals[i] = getFlattenedForce().getCollectiveVariableInterval(placed.indices[i]);
+    kernel.getAs<CalcExtendedCustomCVForceKernel>().copyParametersToContext(context, getFlattenedForce());
     context.systemChanged();
 }
+
+void ExtendedCustomCVForceImpl::getStageTimes(map<string, double>& times) {
+    kernel.getAs<CalcExtendedCustomCVForceKernel>().getStageTimes(times);
+    for (auto& time : initTimes)
+        times[time.first] += time.second;
+}
+
+void ExtendedCustomCVForceImpl::resetStageTimes() {
+    kernel.getAs<CalcExtendedCustomCVForceKernel>().resetStageTimes();
+    initTimes.clear();
+}
+
+void ExtendedCustomCVForceImpl::getCounters(map<string, long long>& counters) {
+    kernel.getAs<CalcExtendedCustomCVForceKernel>().getCounters(counters);
+}
+
+void ExtendedCustomCVForceImpl::resetCounters() {
+    kernel.getAs<CalcExtendedCustomCVForceKernel>().resetCounters();
+}
+
+void ExtendedCustomCVForceImpl::getCollectiveVariableCache(vector<long long>& steps, vector<double>& values, vector<vector<double> >& derivatives) {
+    kernel.getAs<CalcExtendedCustomCVForceKernel>().getCollectiveVariableCache(steps, values, derivatives);
+}
+
+void ExtendedCustomCVForceImpl::setCollectiveVariableCache(const vector<long long>& steps, const vector<double>& values,
+                                                           const vector<vector<double> >& derivatives) {
+    kernel.getAs<CalcExtendedCustomCVForceKernel>().setCollectiveVariableCache(steps, values, derivatives);
+}
+
+void ExtendedCustomCVForceImpl::getDepositedTerms(int index, vector<vector<double> >& terms) {
+    kernel.getAs<CalcExtendedCustomCVForceKernel>().getDepositedTerms(index, terms);
+}
+
+vector<Lepton::CompiledExpression> ExtendedCustomCVForceImpl::createDepositionExpressions(const ExtendedCustomCVForce& force, int index,
+        const map<string, Lepton::CustomFunction*>& functions, map<string, double*>& variableLocations) {
+    vector<Lepton::CompiledExpression> expressions;
+    if (force.getCustomSummationDepositionInterval(index) == 0)
+        return expressions;
+    const string& name = force.getCustomSummationName(index);
+    for (auto& parameter : force.getCustomSummationDepositionParameters(index)) {
+        Lepton::CompiledExpression expression = Lepton::Parser::parse(parameter, functions).optimize().createCompiledExpression();
+        for (auto& variable : expression.getVariables())
+            if (variableLocations.find(variable) == variableLocations.end())
+                throw OpenMMException("ExtendedCustomCVForce: a deposition expression of custom summation '"+name+"' depends on unknown variable '"+variable+"'");
+        expression.setVariableLocations(variableLocations);
+        expressions.push_back(expression);
+    }
+    return expressions;
+}
+
+void ExtendedCustomCVForceImpl::getForceArrays(DeviceArray& forces, DeviceArray& atomIndices, vector<int>& variables) {
+    kernel.getAs<CalcExtendedCustomCVForceKernel>().getForceArrays(forces, atomIndices, variables);
+}
@@ -0,0 +1,96 @@
+/* -------------------------------------------------------------------------- *
+ *                             OpenMM Laboratory                              *
+ *                             =================                              *
+ *                                                                            *
+ * A plugin for testing low-level code implementation for OpenMM.             *
+ *                                                                            *
+ * Copyright (c) 2023 Charlles Abreu                                          *
+ * https://github.com/craabreu/openmm-lab                                     *
+ * -------------------------------------------------------------------------- */
+
+#include "internal/KernelCustomSummationImpl.h"
+#include "OpenMMLabKernels.h"
+#include "openmm/Context.h"
+#include "openmm/OpenMMException.h"
+#include "openmm/Platform.h"
+#include "openmm/internal/ContextImpl.h"
+#include "openmm/internal/ForceImpl.h"
+
+#include <map>
+#include <string>
+#include <vector>
+
+using namespace OpenMM;
+using namespace OpenMMLab;
+using namespace std;
+
+/**
+ * This class is never instantiated.  It only gives access to the ContextImpl of the
+ * inner Context, which is needed for creating the kernel.
+ */
+class ContextImplAccessor : public ForceImpl {
+public:
+    static ContextImpl& get(Context& context) {
+        return getContextImpl(context);
+    }
+};
+
+KernelCustomSummationImpl::KernelCustomSummationImpl(
+    int numArgs,
+    string expression,
+    map<string, double> overallParameters,
+    vector<string> perTermParameters,
+    Platform &platform,
+    map<string, string> platformProperties,
+    bool deterministic
+) : CustomSummationImpl(numArgs),
+    integrator(0.01),
+    arguments(numArgs, 0.0)
+{
+    if (!platform.supportsKernels(vector<string>{CalcCustomSummationKernel::Name()}))
+        throw OpenMMException("CustomSummation: the Kernel backend is not supported by platform " + platform.getName());
+    system.addParticle(1.0);
+    context = new Context(system, integrator, platform, platformProperties);
+    kernel = platform.createKernel(CalcCustomSummationKernel::Name(), ContextImplAccessor::get(*context));
+    kernel.getAs<CalcCustomSummationKernel>().initialize(numArgs, parseExpression(expression), overallParameters, perTermParameters, deterministic);
+}
+
+KernelCustomSummationImpl::~KernelCustomSummationImpl() {
+    // The kernel must be released before the context that owns its device memory.
+    kernel = Kernel();
+    delete context;
+}
+
+void KernelCustomSummationImpl::setArguments(const double *arguments) {
+    this->arguments.assign(arguments, arguments + numArgs);
+}
+
+double KernelCustomSummationImpl::computeValue() {
+    double value;
+    kernel.getAs<CalcCustomSummationKernel>().evaluate(arguments.data(), 1, &value, NULL);
+    return value;
+}
+
+void KernelCustomSummationImpl::computeDerivatives(vector<double> &derivatives) {
+    computeValueAndDerivatives(derivatives);
+}
+
+double KernelCustomSummationImpl::computeValueAndDerivatives(vector<double> &derivatives) {
+    double value;
+    kernel.getAs<CalcCustomSummationKernel>().evaluate(arguments.data(), 1, &value, derivatives.data());
+    return value;
+}
+
+void KernelCustomSummationImpl::evaluateBatch(const double *arguments, int numPoints, double *values, double *gradients) {
+    kernel.getAs<CalcCustomSummationKernel>().evaluate(arguments, numPoints, values, gradients);
+}
+
+void KernelCustomSummationImpl::update(const vector<vector<double>> &parameters, const set<int> &modifiedTerms) {
+    kernel.getAs<CalcCustomSummationKernel>().setTerms(parameters, modifiedTerms);
+    invalidateCache();
+}
+
+void KernelCustomSummationImpl::setParameter(const string &name, double value) {
+    kernel.getAs<CalcCustomSummationKernel>().setParameter(name, value);
+    invalidateCache();
+}
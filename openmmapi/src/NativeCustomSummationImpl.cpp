@@ -0,0 +1,679 @@
+/* -------------------------------------------------------------------------- *
+ *                             OpenMM Laboratory                              *
+ *                             =================                              *
+ *                                                                            *
+ * A plugin for testing low-level code implementation for OpenMM.             *
+ *                                                                            *
+ * Copyright (c) 2023 Charlles Abreu                                          *
+ * https://github.com/craabreu/openmm-lab                                     *
+ * -------------------------------------------------------------------------- */
+
+#include "internal/NativeCustomSummationImpl.h"
+#include "openmm/OpenMMException.h"
+#include "lepton/CompiledVectorExpression.h"
+#include "lepton/ParsedExpression.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+using namespace OpenMM;
+using namespace OpenMMLab;
+using namespace Lepton;
+using namespace std;
+
+NativeCustomSummationImpl::NativeCustomSummationImpl(
+    int numArgs,
+    string expression,
+    map<string, double> overallParameters,
+    vector<string> perTermParameters,
+    bool useVectors,
+    int pointsPerTerm
+) : CustomSummationImpl(numArgs, pointsPerTerm), numTerms(0), width(1), useCulling(false), useGrid(false) {
+    // Parse the expression and differentiate it. These complete expressions are used for
+    // the grid and the Hessian. If the terms have their own points, the expression is a
+    // function of the coordinates of those points alone.
+
+    int numTermArgs = (pointsPerTerm > 0 ? 3 * pointsPerTerm : numArgs);
+    int numCoordinates = 3 * ((numTermArgs + 2) / 3);
+    if (pointsPerTerm > 0)
+        pointArguments.resize(3 * ((numArgs + 2) / 3), 0.0);
+    ParsedExpression valueExpr = parseExpression(expression).optimize();
+    parsedValue = valueExpr;
+    for (int i = 0; i < numTermArgs; i++)
+        parsedDerivatives.push_back(valueExpr.differentiate(getArgumentName(i)).optimize());
+
+    // Subexpressions that do not depend on the per-term parameters take the same value in
+    // every term, and are hoisted out of the terms. Those that depend on the arguments,
+    // such as distances, angles, and dihedrals between argument points, are evaluated
+    // once per point, and the derivatives of the terms with respect to them are chained
+    // with their gradients. Those that only depend on overall parameters are evaluated
+    // whenever a parameter changes.
+
+    vector<ParsedExpression> argumentInvariants, parameterInvariants;
+    ParsedExpression termExpr = hoistInvariants(valueExpr, numTermArgs, perTermParameters, pointsPerTerm == 0, argumentInvariants, parameterInvariants);
+    numInvariants = argumentInvariants.size();
+    numTermDerivatives = numTermArgs + numInvariants;
+
+    // Lay out all variables in a single array: coordinates first, then overall
+    // parameters, invariants, and per-term parameters.
+
+    map<string, int> variableIndex;
+    for (int i = 0; i < numCoordinates; i++)
+        variableIndex[getArgumentName(i)] = i;
+    for (const auto& pair : overallParameters) {
+        overallParameterIndex[pair.first] = variableIndex.size();
+        variableIndex[pair.first] = overallParameterIndex[pair.first];
+    }
+    firstParameterInvariant = variableIndex.size();
+    for (int k = 0; k < parameterInvariants.size(); k++)
+        variableIndex["@parameter"+to_string(k)] = firstParameterInvariant + k;
+    firstInvariant = variableIndex.size();
+    vector<string> termVariables;
+    for (int i = 0; i < numTermArgs; i++)
+        termVariables.push_back(getArgumentName(i));
+    for (int k = 0; k < numInvariants; k++) {
+        termVariables.push_back("@argument"+to_string(k));
+        variableIndex[termVariables.back()] = firstInvariant + k;
+    }
+    firstPerTermParameter = variableIndex.size();
+    numPerTermParameters = perTermParameters.size();
+    for (int i = 0; i < numPerTermParameters; i++)
+        variableIndex[perTermParameters[i]] = firstPerTermParameter + i;
+    variables.resize(variableIndex.size(), 0.0);
+    for (const auto& pair : overallParameters)
+        variables[overallParameterIndex[pair.first]] = pair.second;
+    perTermValues.resize(numPerTermParameters);
+    for (const auto& pair : variableIndex)
+        variableLocations[pair.first] = &variables[pair.second];
+
+    // Compile the invariants and their gradients, and the terms along with their
+    // derivatives with respect to the arguments and the invariants.
+
+    for (ParsedExpression& invariant : parameterInvariants)
+        parameterInvariantExpressions.push_back(invariant.createCompiledExpression());
+    for (ParsedExpression& invariant : argumentInvariants) {
+        invariantExpressions.push_back(invariant.createCompiledExpression());
+        for (int i = 0; i < numArgs; i++)
+            invariantGradientExpressions.push_back(invariant.differentiate(getArgumentName(i)).optimize().createCompiledExpression());
+    }
+    valueExpression = termExpr.createCompiledExpression();
+    vector<ParsedExpression> termDerivatives;
+    for (const string& name : termVariables)
+        termDerivatives.push_back(termExpr.differentiate(name).optimize());
+    for (ParsedExpression& expr : termDerivatives)
+        derivativeExpressions.push_back(expr.createCompiledExpression());
+    for (CompiledExpression* expr : getCompiledExpressions())
+        for (const string& name : expr->getVariables())
+            if (variableIndex.find(name) == variableIndex.end())
+                throw OpenMMException("CustomSummation: unknown variable '" + name + "' in expression");
+    for (CompiledExpression* expr : getCompiledExpressions())
+        expr->setVariableLocations(variableLocations);
+    chainedDerivatives.resize(numTermDerivatives);
+    computeParameterInvariants();
+
+    // In single precision, also create vectorized versions of the term expressions, which
+    // evaluate several terms at once using SIMD instructions.
+
+    const vector<int>& allowedWidths = CompiledVectorExpression::getAllowedWidths();
+    if (useVectors && pointsPerTerm == 0 && allowedWidths.size() > 0) {
+        width = allowedWidths.back();
+        vectorExpressions.push_back(termExpr.createCompiledVectorExpression(width));
+        for (ParsedExpression& expr : termDerivatives)
+            vectorExpressions.push_back(expr.createCompiledVectorExpression(width));
+        vectorVariables.resize(width*variables.size(), 0.0f);
+        map<string, float*> vectorLocations;
+        for (const auto& pair : variableIndex)
+            vectorLocations[pair.first] = &vectorVariables[pair.second*width];
+        for (CompiledVectorExpression& expr : vectorExpressions)
+            expr.setVariableLocations(vectorLocations);
+        perTermVectorValues.resize(numPerTermParameters);
+        activeVectorValues.resize(numPerTermParameters);
+    }
+}
+
+vector<CompiledExpression*> NativeCustomSummationImpl::getCompiledExpressions() {
+    vector<CompiledExpression*> expressions = {&valueExpression};
+    for (CompiledExpression& expr : derivativeExpressions)
+        expressions.push_back(&expr);
+    for (CompiledExpression& expr : invariantExpressions)
+        expressions.push_back(&expr);
+    for (CompiledExpression& expr : invariantGradientExpressions)
+        expressions.push_back(&expr);
+    for (CompiledExpression& expr : parameterInvariantExpressions)
+        expressions.push_back(&expr);
+    return expressions;
+}
+
+void NativeCustomSummationImpl::computeParameterInvariants() {
+    for (int k = 0; k < parameterInvariantExpressions.size(); k++)
+        variables[firstParameterInvariant+k] = parameterInvariantExpressions[k].evaluate();
+}
+
+void NativeCustomSummationImpl::setArguments(const double *arguments) {
+    if (pointsPerTerm > 0) {
+        copy(arguments, arguments + numArgs, pointArguments.begin());
+        return;
+    }
+    for (int i = 0; i < numArgs; i++)
+        variables[i] = arguments[i];
+    if (useCulling)
+        findActiveTerms();
+}
+
+void NativeCustomSummationImpl::setCompactSupport(const vector<int> &centerParameters, int radiusParameter) {
+    this->centerParameters = centerParameters;
+    this->radiusParameter = radiusParameter;
+    useCulling = true;
+    buildTree();
+    invalidateCache();
+}
+
+void NativeCustomSummationImpl::setGaussianSupport(const vector<int> &centerParameters, int widthParameter, int heightParameter, double tolerance) {
+    this->centerParameters = centerParameters;
+    this->radiusParameter = -1;
+    this->widthParameter = widthParameter;
+    this->heightParameter = heightParameter;
+    gaussianTolerance = tolerance;
+    useCulling = true;
+    buildTree();
+    invalidateCache();
+}
+
+double NativeCustomSummationImpl::getSupportRadius(int term) const {
+    // The support radius of a Gaussian term is where |h|*exp(-d^2/(2*w^2)) equals the
+    // tolerance divided by the capacity of the tree. Since the tree is rebuilt before the
+    // number of terms exceeds its capacity, the skipped terms cannot add up to more than
+    // the tolerance, and the radii of the terms already in the tree remain valid.
+    if (radiusParameter >= 0)
+        return perTermValues[radiusParameter][term];
+    double ratio = treeCapacity*fabs(perTermValues[heightParameter][term])/gaussianTolerance;
+    return (ratio > 1.0 ? fabs(perTermValues[widthParameter][term])*sqrt(2.0*log(ratio)) : 0.0);
+}
+
+void NativeCustomSummationImpl::buildTree() {
+    treeCapacity = max(2*numTerms, 16);
+    supportRadii.resize(numTerms);
+    for (int term = 0; term < numTerms; term++)
+        supportRadii[term] = getSupportRadius(term);
+    vector<int> terms(numTerms);
+    for (int term = 0; term < numTerms; term++)
+        terms[term] = term;
+    treeNodes.clear();
+    buildSubtree(terms, 0, numTerms);
+}
+
+int NativeCustomSummationImpl::buildSubtree(vector<int> &terms, int start, int end) {
+    // Nodes are split at the median center along the axis of largest extent, until
+    // no more than a few terms are left in each leaf.
+
+    const int maxLeafSize = 8;
+    int index = treeNodes.size();
+    treeNodes.push_back(TreeNode());
+    TreeNode node;
+    node.lower.assign(numArgs, numeric_limits<double>::infinity());
+    node.upper.assign(numArgs, -numeric_limits<double>::infinity());
+    node.radius = 0.0;
+    for (int k = start; k < end; k++) {
+        int term = terms[k];
+        for (int i = 0; i < numArgs; i++) {
+            double x = perTermValues[centerParameters[i]][term];
+            node.lower[i] = min(node.lower[i], x);
+            node.upper[i] = max(node.upper[i], x);
+        }
+        node.radius = max(node.radius, supportRadii[term]);
+    }
+    node.left = node.right = -1;
+    if (end-start <= maxLeafSize) {
+        node.terms.assign(terms.begin()+start, terms.begin()+end);
+        treeNodes[index] = node;
+        return index;
+    }
+    node.axis = 0;
+    for (int i = 1; i < numArgs; i++)
+        if (node.upper[i]-node.lower[i] > node.upper[node.axis]-node.lower[node.axis])
+            node.axis = i;
+    const vector<double>& coordinate = perTermValues[centerParameters[node.axis]];
+    int middle = (start+end)/2;
+    nth_element(terms.begin()+start, terms.begin()+middle, terms.begin()+end,
+                [&] (int a, int b) { return coordinate[a] < coordinate[b]; });
+    node.split = coordinate[terms[middle]];
+    node.left = buildSubtree(terms, start, middle);
+    node.right = buildSubtree(terms, middle, end);
+    treeNodes[index] = node;
+    return index;
+}
+
+void NativeCustomSummationImpl::insertIntoTree(int term) {
+    // Descend to the leaf on the side of each split where the center lies, enlarging
+    // the bounding boxes and radii of all nodes along the way.
+
+    supportRadii.resize(numTerms);
+    supportRadii[term] = getSupportRadius(term);
+    int index = 0;
+    while (true) {
+        TreeNode& node = treeNodes[index];
+        for (int i = 0; i < numArgs; i++) {
+            double x = perTermValues[centerParameters[i]][term];
+            node.lower[i] = min(node.lower[i], x);
+            node.upper[i] = max(node.upper[i], x);
+        }
+        node.radius = max(node.radius, supportRadii[term]);
+        if (node.left == -1) {
+            node.terms.push_back(term);
+            return;
+        }
+        index = (perTermValues[centerParameters[node.axis]][term] < node.split ? node.left : node.right);
+    }
+}
+
+void NativeCustomSummationImpl::findActiveTerms() {
+    // A node can only contain terms whose support includes the arguments if the distance
+    // from the arguments to its bounding box does not exceed its largest support radius.
+
+    activeTerms.clear();
+    treeStack.assign(1, 0);
+    while (!treeStack.empty()) {
+        const TreeNode& node = treeNodes[treeStack.back()];
+        treeStack.pop_back();
+        double boxDistance2 = 0.0;
+        for (int i = 0; i < numArgs; i++) {
+            double delta = max(max(node.lower[i]-variables[i], variables[i]-node.upper[i]), 0.0);
+            boxDistance2 += delta*delta;
+        }
+        if (boxDistance2 > node.radius*node.radius)
+            continue;
+        if (node.left != -1) {
+            treeStack.push_back(node.right);
+            treeStack.push_back(node.left);
+            continue;
+        }
+        for (int term : node.terms) {
+            double radius = supportRadii[term];
+            double distance2 = 0.0;
+            for (int i = 0; i < numArgs; i++) {
+                double delta = variables[i]-perTermValues[centerParameters[i]][term];
+                distance2 += delta*delta;
+            }
+            if (distance2 <= radius*radius)
+                activeTerms.push_back(term);
+        }
+    }
+}
+
+double NativeCustomSummationImpl::computeValue() {
+    return computeTerms(true, NULL);
+}
+
+void NativeCustomSummationImpl::computeDerivatives(vector<double> &derivatives) {
+    computeTerms(false, &derivatives);
+}
+
+double NativeCustomSummationImpl::computeValueAndDerivatives(vector<double> &derivatives) {
+    return computeTerms(true, &derivatives);
+}
+
+void NativeCustomSummationImpl::setGrid(const vector<double> &minValues, const vector<double> &maxValues, const vector<int> &numPoints) {
+    // Every grid point stores the derivative of the summation with respect to each subset
+    // of the arguments, indexed by a bit mask, where the empty subset is the value itself.
+
+    if (gridExpressions.empty())
+        for (int mask = 0; mask < (1<<numArgs); mask++) {
+            ParsedExpression expr = parsedValue;
+            for (int i = 0; i < numArgs; i++)
+                if (mask & (1<<i))
+                    expr = expr.differentiate(getArgumentName(i)).optimize();
+            gridExpressions.push_back(expr.createCompiledExpression());
+            gridExpressions.back().setVariableLocations(variableLocations);
+        }
+    gridOrigin = minValues;
+    gridPoints = numPoints;
+    gridSpacing.resize(numArgs);
+    int numNodes = 1;
+    for (int i = 0; i < numArgs; i++) {
+        gridSpacing[i] = (maxValues[i]-minValues[i])/(numPoints[i]-1);
+        numNodes *= numPoints[i];
+    }
+    gridValues.assign(numNodes<<numArgs, 0.0);
+    useGrid = true;
+    for (int term = 0; term < numTerms; term++)
+        addTermToGrid(term, 1.0);
+    invalidateCache();
+}
+
+void NativeCustomSummationImpl::addTermToGrid(int term, double scale) {
+    // The grid points are ordered with the first argument varying fastest.
+
+    vector<double> arguments(variables.begin(), variables.begin()+numArgs);
+    double* termParameters = &variables[firstPerTermParameter];
+    for (int j = 0; j < numPerTermParameters; j++)
+        termParameters[j] = perTermValues[j][term];
+    int numMasks = 1<<numArgs;
+    int numNodes = gridValues.size()/numMasks;
+    for (int node = 0; node < numNodes; node++) {
+        int index = node;
+        for (int i = 0; i < numArgs; i++) {
+            variables[i] = gridOrigin[i]+gridSpacing[i]*(index%gridPoints[i]);
+            index /= gridPoints[i];
+        }
+        for (int mask = 0; mask < numMasks; mask++)
+            gridValues[node*numMasks+mask] += scale*gridExpressions[mask].evaluate();
+    }
+    copy(arguments.begin(), arguments.end(), variables.begin());
+}
+
+bool NativeCustomSummationImpl::interpolateGrid(double &value, vector<double> *derivatives) const {
+    // Locate the cell that contains the arguments, and compute the cubic Hermite basis
+    // functions of each axis, both for the values (v) and for the derivatives (h) at the
+    // two ends of the cell, along with their derivatives with respect to the argument.
+
+    const int maxArgs = 3;
+    int base = 0, stride = 1;
+    int strides[maxArgs];
+    double v[maxArgs][2], dv[maxArgs][2], h[maxArgs][2], dh[maxArgs][2];
+    for (int i = 0; i < numArgs; i++) {
+        double s = (variables[i]-gridOrigin[i])/gridSpacing[i];
+        if (!(s >= 0.0 && s <= gridPoints[i]-1))
+            return false;
+        int cell = min((int) s, gridPoints[i]-2);
+        double t = s-cell;
+        double t2 = t*t, t3 = t2*t;
+        v[i][0] = 2*t3-3*t2+1;
+        v[i][1] = 3*t2-2*t3;
+        dv[i][0] = (6*t2-6*t)/gridSpacing[i];
+        dv[i][1] = -dv[i][0];
+        h[i][0] = (t3-2*t2+t)*gridSpacing[i];
+        h[i][1] = (t3-t2)*gridSpacing[i];
+        dh[i][0] = 3*t2-4*t+1;
+        dh[i][1] = 3*t2-2*t;
+        base += cell*stride;
+        strides[i] = stride;
+        stride *= gridPoints[i];
+    }
+
+    // Each corner of the cell contributes its derivative with respect to every subset of
+    // the arguments, weighted by the derivative basis along the axes in the subset and by
+    // the value basis along the others.
+
+    int numMasks = 1<<numArgs;
+    value = 0.0;
+    if (derivatives != NULL)
+        fill(derivatives->begin(), derivatives->end(), 0.0);
+    for (int corner = 0; corner < numMasks; corner++) {
+        int node = base, bits[maxArgs];
+        for (int i = 0; i < numArgs; i++) {
+            bits[i] = (corner>>i)&1;
+            node += bits[i]*strides[i];
+        }
+        const double* nodeValues = &gridValues[node*numMasks];
+        for (int mask = 0; mask < numMasks; mask++) {
+            double f = nodeValues[mask];
+            double weight = 1.0;
+            for (int i = 0; i < numArgs; i++)
+                weight *= (mask & (1<<i) ? h[i][bits[i]] : v[i][bits[i]]);
+            value += weight*f;
+            if (derivatives != NULL)
+                for (int m = 0; m < numArgs; m++) {
+                    double dweight = 1.0;
+                    for (int i = 0; i < numArgs; i++) {
+                        bool alongDerivative = (mask & (1<<i));
+                        if (i == m)
+                            dweight *= (alongDerivative ? dh[i][bits[i]] : dv[i][bits[i]]);
+                        else
+                            dweight *= (alongDerivative ? h[i][bits[i]] : v[i][bits[i]]);
+                    }
+                    (*derivatives)[m] += dweight*f;
+                }
+        }
+    }
+    return true;
+}
+
+double NativeCustomSummationImpl::computePointTerms(bool includeValue, vector<double> *derivatives) {
+    // Padding coordinates of the last point are not arguments, so their derivatives are
+    // not evaluated.
+
+    double sum = 0.0;
+    if (derivatives != NULL)
+        fill(derivatives->begin(), derivatives->end(), 0.0);
+    double* termParameters = &variables[firstPerTermParameter];
+    for (int term = 0; term < numTerms; term++) {
+        for (int j = 0; j < numPerTermParameters; j++)
+            termParameters[j] = perTermValues[j][term];
+        const int* points = &termPointIndices[term * pointsPerTerm];
+        for (int j = 0; j < pointsPerTerm; j++)
+            for (int c = 0; c < 3; c++)
+                variables[3 * j + c] = pointArguments[3 * points[j] + c];
+        if (includeValue)
+            sum += valueExpression.evaluate();
+        if (derivatives != NULL)
+            for (int j = 0; j < pointsPerTerm; j++)
+                for (int c = 0; c < 3; c++) {
+                    int argument = 3 * points[j] + c;
+                    if (argument < numArgs)
+                        (*derivatives)[argument] += derivativeExpressions[3 * j + c].evaluate();
+                }
+    }
+    return sum;
+}
+
+double NativeCustomSummationImpl::computeTerms(bool includeValue, vector<double> *derivatives) {
+    if (pointsPerTerm > 0)
+        return computePointTerms(includeValue, derivatives);
+    double sum = 0.0;
+    if (useGrid && interpolateGrid(sum, derivatives))
+        return sum;
+    for (int k = 0; k < numInvariants; k++)
+        variables[firstInvariant+k] = invariantExpressions[k].evaluate();
+    vector<double>* termDerivatives = (derivatives != NULL && numInvariants > 0 ? &chainedDerivatives : derivatives);
+    if (termDerivatives != NULL)
+        fill(termDerivatives->begin(), termDerivatives->end(), 0.0);
+    int count = useCulling ? (int) activeTerms.size() : numTerms;
+    if (width == 1) {
+        double* termParameters = &variables[firstPerTermParameter];
+        for (int k = 0; k < count; k++) {
+            int term = useCulling ? activeTerms[k] : k;
+            for (int j = 0; j < numPerTermParameters; j++)
+                termParameters[j] = perTermValues[j][term];
+            if (includeValue)
+                sum += valueExpression.evaluate();
+            if (termDerivatives != NULL)
+                for (int i = 0; i < numTermDerivatives; i++)
+                    (*termDerivatives)[i] += derivativeExpressions[i].evaluate();
+        }
+    }
+    else {
+        // Broadcast the arguments, overall parameters, and invariants to all lanes, and
+        // then evaluate the terms in blocks of width terms at a time.
+
+        for (int j = 0; j < firstPerTermParameter; j++)
+            fill(&vectorVariables[j*width], &vectorVariables[(j+1)*width], (float) variables[j]);
+        vector<vector<float>>* values = &perTermVectorValues;
+        if (useCulling) {
+            int paddedSize = width*((count+width-1)/width);
+            for (int j = 0; j < numPerTermParameters; j++) {
+                activeVectorValues[j].resize(paddedSize);
+                for (int k = 0; k < paddedSize; k++)
+                    activeVectorValues[j][k] = (float) perTermValues[j][activeTerms[min(k, count-1)]];
+            }
+            values = &activeVectorValues;
+        }
+        float* termParameters = &vectorVariables[firstPerTermParameter*width];
+        for (int first = 0; first < count; first += width) {
+            int lanes = min(width, count-first);
+            for (int j = 0; j < numPerTermParameters; j++)
+                copy((*values)[j].data()+first, (*values)[j].data()+first+width, &termParameters[j*width]);
+            if (includeValue) {
+                const float* result = vectorExpressions[0].evaluate();
+                for (int lane = 0; lane < lanes; lane++)
+                    sum += result[lane];
+            }
+            if (termDerivatives != NULL)
+                for (int i = 0; i < numTermDerivatives; i++) {
+                    const float* result = vectorExpressions[i+1].evaluate();
+                    for (int lane = 0; lane < lanes; lane++)
+                        (*termDerivatives)[i] += result[lane];
+                }
+        }
+    }
+
+    // The derivatives with respect to the invariants are summed over all terms before
+    // being multiplied by the gradients of the invariants.
+
+    if (termDerivatives != derivatives) {
+        for (int i = 0; i < numArgs; i++) {
+            double derivative = chainedDerivatives[i];
+            for (int k = 0; k < numInvariants; k++)
+                derivative += chainedDerivatives[numArgs+k]*invariantGradientExpressions[k*numArgs+i].evaluate();
+            (*derivatives)[i] = derivative;
+        }
+    }
+    return sum;
+}
+
+void NativeCustomSummationImpl::createHessianExpressions() {
+    // Only the upper triangle is compiled, row by row, since the Hessian is symmetric.
+
+    if (!hessianExpressions.empty())
+        return;
+    for (int i = 0; i < numArgs; i++)
+        for (int j = i; j < numArgs; j++) {
+            hessianExpressions.push_back(parsedDerivatives[i].differentiate(getArgumentName(j)).optimize().createCompiledExpression());
+            hessianExpressions.back().setVariableLocations(variableLocations);
+        }
+}
+
+void NativeCustomSummationImpl::prepareHessian(const vector<double> &arguments) {
+    createHessianExpressions();
+    setArguments(arguments.data());
+    invalidateArguments();
+}
+
+void NativeCustomSummationImpl::evaluateHessianProduct(const vector<double> &arguments, const vector<double> &direction, vector<double> &product) {
+    if (pointsPerTerm > 0) {
+        CustomSummationImpl::evaluateHessianProduct(arguments, direction, product);
+        return;
+    }
+    prepareHessian(arguments);
+    product.assign(numArgs, 0.0);
+    double* termParameters = &variables[firstPerTermParameter];
+    int count = useCulling ? (int) activeTerms.size() : numTerms;
+    for (int k = 0; k < count; k++) {
+        int term = useCulling ? activeTerms[k] : k;
+        for (int j = 0; j < numPerTermParameters; j++)
+            termParameters[j] = perTermValues[j][term];
+        int index = 0;
+        for (int i = 0; i < numArgs; i++) {
+            product[i] += hessianExpressions[index++].evaluate()*direction[i];
+            for (int j = i+1; j < numArgs; j++) {
+                double h = hessianExpressions[index++].evaluate();
+                product[i] += h*direction[j];
+                product[j] += h*direction[i];
+            }
+        }
+    }
+}
+
+void NativeCustomSummationImpl::evaluateHessianDiagonal(const vector<double> &arguments, vector<double> &diagonal) {
+    if (pointsPerTerm > 0) {
+        CustomSummationImpl::evaluateHessianDiagonal(arguments, diagonal);
+        return;
+    }
+    prepareHessian(arguments);
+    diagonal.assign(numArgs, 0.0);
+    double* termParameters = &variables[firstPerTermParameter];
+    int count = useCulling ? (int) activeTerms.size() : numTerms;
+    for (int k = 0; k < count; k++) {
+        int term = useCulling ? activeTerms[k] : k;
+        for (int j = 0; j < numPerTermParameters; j++)
+            termParameters[j] = perTermValues[j][term];
+        int index = 0;
+        for (int i = 0; i < numArgs; i++) {
+            diagonal[i] += hessianExpressions[index].evaluate();
+            index += numArgs-i;
+        }
+    }
+}
+
+void NativeCustomSummationImpl::evaluateBatch(const double *arguments, int numPoints, double *values, double *gradients) {
+    vector<double> derivatives(numArgs);
+    for (int k = 0; k < numPoints; k++) {
+        setArguments(arguments + k * numArgs);
+        if (gradients == NULL)
+            values[k] = computeValue();
+        else {
+            values[k] = computeValueAndDerivatives(derivatives);
+            for (int i = 0; i < numArgs; i++)
+                gradients[k * numArgs + i] = derivatives[i];
+        }
+    }
+    invalidateArguments();
+}
+
+void NativeCustomSummationImpl::update(const vector<vector<double>> &parameters, const set<int> &modifiedTerms) {
+    int oldNumTerms = numTerms;
+    if (useGrid) {
+        // Remove the old contributions of the terms that have been modified or removed.
+
+        for (int term = parameters.size(); term < numTerms; term++)
+            addTermToGrid(term, -1.0);
+        for (int term : modifiedTerms)
+            if (term < min(numTerms, (int) parameters.size()))
+                addTermToGrid(term, -1.0);
+    }
+    numTerms = parameters.size();
+    for (int j = 0; j < numPerTermParameters; j++) {
+        perTermValues[j].resize(numTerms);
+        for (int term : modifiedTerms)
+            perTermValues[j][term] = parameters[term][j];
+    }
+    if (pointsPerTerm > 0) {
+        termPointIndices.resize(numTerms * pointsPerTerm);
+        for (int term : modifiedTerms)
+            copy(termPoints[term].begin(), termPoints[term].end(), &termPointIndices[term * pointsPerTerm]);
+    }
+    if (width > 1) {
+        // Pad the per-term values so that the last block is complete. Padding lanes
+        // are evaluated but excluded from the sums.
+        int paddedSize = width*((numTerms+width-1)/width);
+        for (int j = 0; j < numPerTermParameters; j++) {
+            perTermVectorValues[j].resize(paddedSize);
+            for (int term : modifiedTerms)
+                perTermVectorValues[j][term] = (float) perTermValues[j][term];
+            for (int term = numTerms; term < paddedSize; term++)
+                perTermVectorValues[j][term] = (float) perTermValues[j][numTerms-1];
+        }
+    }
+    if (useGrid)
+        for (int term : modifiedTerms)
+            if (term < numTerms)
+                addTermToGrid(term, 1.0);
+    if (useCulling) {
+        // Appended terms are inserted into the existing tree while it has room for them.
+
+        bool appendOnly = (numTerms >= oldNumTerms && (modifiedTerms.empty() || *modifiedTerms.begin() >= oldNumTerms));
+        if (appendOnly && numTerms <= treeCapacity && !treeNodes.empty())
+            for (int term = oldNumTerms; term < numTerms; term++)
+                insertIntoTree(term);
+        else
+            buildTree();
+    }
+    invalidateCache();
+}
+
+void NativeCustomSummationImpl::setParameter(const string &name, double value) {
+    variables[overallParameterIndex.at(name)] = value;
+    computeParameterInvariants();
+    if (useGrid) {
+        // Every node depends on the overall parameters, so the grid is filled again.
+
+        fill(gridValues.begin(), gridValues.end(), 0.0);
+        for (int term = 0; term < numTerms; term++)
+            addTermToGrid(term, 1.0);
+    }
+    invalidateCache();
+}
@@ -0,0 +1,121 @@
+/* -------------------------------------------------------------------------- *
+ *                             OpenMM Laboratory                              *
+ *                             =================                              *
+ *                                                                            *
+ * A plugin for testing low-level code implementation for OpenMM.             *
+ *                                                                            *
+ * Copyright (c) 2023 Charlles Abreu                                          *
+ * https://github.com/craabreu/openmm-lab                                     *
+ * -------------------------------------------------------------------------- */
+
+#include "RadialBasisFunctionFitter.h"
+#include "openmm/OpenMMException.h"
+#include "openmm/internal/AssertionUtilities.h"
+
+#include <cmath>
+#include <string>
+#include <vector>
+
+using namespace OpenMM;
+using namespace OpenMMLab;
+using namespace std;
+
+/**
+ * The lower triangular factor is packed by rows, so that row i starts at i*(i+1)/2 and
+ * adding a center only appends a row.
+ */
+static inline int packedIndex(int row, int column) {
+    return row*(row+1)/2+column;
+}
+
+RadialBasisFunctionFitter::RadialBasisFunctionFitter(int numVariables, double shapeParameter, double regularization) :
+        numVariables(numVariables), shapeParameter(shapeParameter), regularization(regularization) {
+    if (numVariables < 1)
+        throw OpenMMException("RadialBasisFunctionFitter: the number of variables must be positive");
+    if (shapeParameter <= 0.0)
+        throw OpenMMException("RadialBasisFunctionFitter: the shape parameter must be positive");
+    if (regularization < 0.0)
+        throw OpenMMException("RadialBasisFunctionFitter: the regularization cannot be negative");
+}
+
+double RadialBasisFunctionFitter::computeKernel(int center, const double *point) const {
+    const double* c = &centers[center*numVariables];
+    double r2 = 0.0;
+    for (int i = 0; i < numVariables; i++)
+        r2 += (point[i]-c[i])*(point[i]-c[i]);
+    return exp(-shapeParameter*shapeParameter*r2);
+}
+
+int RadialBasisFunctionFitter::addCenter(const vector<double> &center, double value) {
+    if (center.size() != numVariables)
+        throw OpenMMException("RadialBasisFunctionFitter: the number of coordinates must equal the number of variables");
+
+    // The new row l of the factor solves L*l = k, where k holds the kernel between the new
+    // center and the existing ones, and its diagonal entry is sqrt(1+lambda-l*l).
+
+    int n = values.size();
+    vector<double> row(n+1);
+    double norm2 = 0.0;
+    for (int j = 0; j < n; j++) {
+        double sum = computeKernel(j, center.data());
+        for (int m = 0; m < j; m++)
+            sum -= row[m]*factor[packedIndex(j, m)];
+        row[j] = sum/factor[packedIndex(j, j)];
+        norm2 += row[j]*row[j];
+    }
+    double pivot = 1.0+regularization-norm2;
+    if (pivot <= 1e-10*(1.0+regularization))
+        throw OpenMMException("RadialBasisFunctionFitter: the kernel matrix is singular, since the center nearly coincides with an existing one");
+    row[n] = sqrt(pivot);
+    factor.insert(factor.end(), row.begin(), row.end());
+    centers.insert(centers.end(), center.begin(), center.end());
+    values.push_back(value);
+    z.push_back(0.0);
+    weights.push_back(0.0);
+    solveWeights(n);
+    return n;
+}
+
+void RadialBasisFunctionFitter::setValue(int index, double value) {
+    ASSERT_VALID_INDEX(index, values);
+    values[index] = value;
+    solveWeights(index);
+}
+
+void RadialBasisFunctionFitter::solveWeights(int firstChanged) {
+    // Only the entries of z from the first changed value onward depend on it, while every
+    // weight does.
+
+    int n = values.size();
+    for (int i = firstChanged; i < n; i++) {
+        double sum = values[i];
+        for (int j = 0; j < i; j++)
+            sum -= factor[packedIndex(i, j)]*z[j];
+        z[i] = sum/factor[packedIndex(i, i)];
+    }
+    for (int i = n-1; i >= 0; i--) {
+        double sum = z[i];
+        for (int j = i+1; j < n; j++)
+            sum -= factor[packedIndex(j, i)]*weights[j];
+        weights[i] = sum/factor[packedIndex(i, i)];
+    }
+}
+
+double RadialBasisFunctionFitter::evaluate(const vector<double> &point) const {
+    if (point.size() != numVariables)
+        throw OpenMMException("RadialBasisFunctionFitter: the number of coordinates must equal the number of variables");
+    double sum = 0.0;
+    for (int k = 0; k < weights.size(); k++)
+        sum += weights[k]*computeKernel(k, point.data());
+    return sum;
+}
+
+int RadialBasisFunctionFitter::addRadialBasisFunction(ExtendedCustomCVForce &force, const string &name, const vector<string> &variables) const {
+    if (variables.size() != numVariables)
+        throw OpenMMException("RadialBasisFunctionFitter: the number of collective variables must equal the number of variables");
+    return force.addRadialBasisFunction(name, ExtendedCustomCVForce::Gaussian, shapeParameter, variables, centers, weights);
+}
+
+void RadialBasisFunctionFitter::updateRadialBasisFunction(ExtendedCustomCVForce &force, int index) const {
+    force.setRadialBasisFunctionParameters(index, ExtendedCustomCVForce::Gaussian, shapeParameter, centers, weights);
+}
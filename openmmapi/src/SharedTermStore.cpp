@@ -0,0 +1,134 @@
+/* -------------------------------------------------------------------------- *
+ *                             OpenMM Laboratory                              *
+ *                             =================                              *
+ *                                                                            *
+ * A plugin for testing low-level code implementation for OpenMM.             *
+ *                                                                            *
+ * Copyright (c) 2023 Charlles Abreu                                          *
+ * https://github.com/craabreu/openmm-lab                                     *
+ * -------------------------------------------------------------------------- */
+
+#include "SharedTermStore.h"
+#include "internal/TracingRange.h"
+#include "openmm/OpenMMException.h"
+#include "openmm/internal/AssertionUtilities.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+using namespace OpenMM;
+using namespace OpenMMLab;
+using namespace std;
+
+/**
+ * The file starts with a header made of a magic string, the version of the format, and
+ * the number of per-term parameters, which is followed by the parameters of the terms.
+ */
+static const char MAGIC[8] = {'O', 'M', 'M', 'L', 'T', 'E', 'R', 'M'};
+static const int32_t FORMAT_VERSION = 1;
+static const long HEADER_SIZE = sizeof(MAGIC) + 2*sizeof(int32_t);
+
+SharedTermStore::SharedTermStore(const string &path, int numParameters) :
+        path(path), numParameters(numParameters), writer(NULL), reader(NULL), hasHeader(false), synchronizedVersion(0) {
+    if (numParameters < 1)
+        throw OpenMMException("SharedTermStore: the number of parameters must be positive");
+
+    // Only the process that creates the file writes the header, since opening it in
+    // exclusive mode fails if another process has created it first.
+
+    FILE* created = fopen(path.c_str(), "wbx");
+    if (created != NULL) {
+        int32_t header[2] = {FORMAT_VERSION, numParameters};
+        bool written = (fwrite(MAGIC, sizeof(MAGIC), 1, created) == 1 && fwrite(header, sizeof(header), 1, created) == 1);
+        fclose(created);
+        if (!written)
+            throw OpenMMException("SharedTermStore: failed to write the header of "+path);
+    }
+    writer = fopen(path.c_str(), "ab");
+    reader = fopen(path.c_str(), "rb");
+    if (writer == NULL || reader == NULL) {
+        if (writer != NULL)
+            fclose(writer);
+        if (reader != NULL)
+            fclose(reader);
+        throw OpenMMException("SharedTermStore: failed to open "+path);
+    }
+    try {
+        readHeader();
+    }
+    catch (...) {
+        fclose(writer);
+        fclose(reader);
+        throw;
+    }
+}
+
+SharedTermStore::~SharedTermStore() {
+    fclose(writer);
+    fclose(reader);
+}
+
+void SharedTermStore::readHeader() {
+    // A file created by another process may not have its header yet, in which case
+    // the check is postponed.
+
+    if (hasHeader)
+        return;
+    char magic[sizeof(MAGIC)];
+    int32_t header[2];
+    clearerr(reader);
+    fseek(reader, 0, SEEK_SET);
+    if (fread(magic, sizeof(magic), 1, reader) != 1 || fread(header, sizeof(header), 1, reader) != 1)
+        return;
+    if (memcmp(magic, MAGIC, sizeof(MAGIC)) != 0 || header[0] != FORMAT_VERSION)
+        throw OpenMMException("SharedTermStore: "+path+" is not a term store");
+    if (header[1] != numParameters)
+        throw OpenMMException("SharedTermStore: "+path+" has terms with "+to_string(header[1])+" parameters, but "+
+                              to_string(numParameters)+" were expected");
+    hasHeader = true;
+}
+
+void SharedTermStore::append(const vector<double> &parameters) {
+    ASSERT_EQUAL(parameters.size(), numParameters);
+    readHeader();
+    if (!hasHeader)
+        throw OpenMMException("SharedTermStore: the header of "+path+" has not been written yet");
+    if (fwrite(parameters.data(), sizeof(double)*numParameters, 1, writer) != 1 || fflush(writer) != 0)
+        throw OpenMMException("SharedTermStore: failed to append a term to "+path);
+}
+
+int SharedTermStore::getVersion() {
+    readHeader();
+    if (!hasHeader)
+        return 0;
+    clearerr(reader);
+    fseek(reader, 0, SEEK_END);
+    long size = ftell(reader);
+    return (size-HEADER_SIZE)/(sizeof(double)*numParameters);
+}
+
+int SharedTermStore::synchronize(CustomSummation &summation) {
+    OPENMMLAB_TRACE_RANGE("SharedTermStore::synchronize");
+    ASSERT_EQUAL(summation.getPerTermParameters().size(), numParameters);
+    int version = getVersion();
+    int numNewTerms = version-synchronizedVersion;
+    if (numNewTerms <= 0)
+        return 0;
+    buffer.resize(numNewTerms*numParameters);
+    clearerr(reader);
+    fseek(reader, HEADER_SIZE+synchronizedVersion*sizeof(double)*numParameters, SEEK_SET);
+    if (fread(buffer.data(), sizeof(double)*numParameters, numNewTerms, reader) != numNewTerms)
+        throw OpenMMException("SharedTermStore: failed to read the terms of "+path);
+    vector<double> parameters(numParameters);
+    for (int term = 0; term < numNewTerms; term++) {
+        copy(buffer.begin()+term*numParameters, buffer.begin()+(term+1)*numParameters, parameters.begin());
+        summation.addTerm(parameters);
+    }
+    summation.update();
+    synchronizedVersion = version;
+    return numNewTerms;
+}
@@ -0,0 +1,68 @@
+/* -------------------------------------------------------------------------- *
+ *                             OpenMM Laboratory                              *
+ *                             =================                              *
+ *                                                                            *
+ * A plugin for testing low-level code implementation for OpenMM.             *
+ *                                                                            *
+ * Copyright (c) 2023 Charlles Abreu                                          *
+ * https://github.com/craabreu/openmm-lab                                     *
+ * -------------------------------------------------------------------------- */
+
+#include "internal/SharedThreadPool.h"
+#include <cstdlib>
+#include <sstream>
+
+using namespace OpenMM;
+using namespace OpenMMLab;
+using namespace std;
+
+// Whether the calling thread is running a part of a task, in which case it must not wait for
+// the pool.
+
+static thread_local bool inTask = false;
+
+static int getRequestedNumThreads() {
+    int numThreads = 0;
+    char* threadsVariable = getenv("OPENMM_CPU_THREADS");
+    if (threadsVariable != NULL)
+        stringstream(threadsVariable) >> numThreads;
+    return numThreads;
+}
+
+SharedThreadPool& SharedThreadPool::getInstance() {
+    static SharedThreadPool pool(getRequestedNumThreads());
+    return pool;
+}
+
+SharedThreadPool::SharedThreadPool(int numThreads) : threads(numThreads) {
+}
+
+int SharedThreadPool::getNumThreads() const {
+    return (inTask ? 1 : threads.getNumThreads());
+}
+
+void SharedThreadPool::execute(const function<void(int)>& task) {
+    int numThreads = getNumThreads();
+    if (numThreads > 1 && busy.try_lock()) {
+        threads.execute([&] (ThreadPool& pool, int thread) {
+            inTask = true;
+            task(thread);
+            inTask = false;
+        });
+        threads.waitForThreads();
+        busy.unlock();
+        return;
+    }
+    bool wasInTask = inTask;
+    inTask = true;
+    for (int thread = 0; thread < numThreads; thread++)
+        task(thread);
+    inTask = wasInTask;
+}
+
+void SharedThreadPool::parallelFor(int n, const function<void(int, int, int)>& task) {
+    int numThreads = getNumThreads();
+    execute([&] (int thread) {
+        task(thread, (int) ((long long) thread*n/numThreads), (int) ((long long) (thread+1)*n/numThreads));
+    });
+}
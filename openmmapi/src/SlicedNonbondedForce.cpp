@@ -29,7 +29,10 @@ using namespace OpenMMLab;
 }
 
 SlicedNonbondedForce::SlicedNonbondedForce(int numSubsets) :
-    NonbondedForce(), numSubsets(numSubsets), useCudaFFT(false) {
+    NonbondedForce(), numSubsets(numSubsets), softCoreAlphas(getNumSlices(), 0.0), softCorePowers(getNumSlices(), 1.0), pmeOrder(5),
+    useCudaFFT(false), useFFTAutotuning(false), useTunedPmeGridSizes(false), useFFTConvolution(false), useSinglePrecisionPmeGrids(false),
+    useCudaGraphs(false), useSortFreePme(false), useCpuPme(false), useDerivativesOnDemand(false),
+    useCompactParameters(false) {
 }
 
 SlicedNonbondedForce::SlicedNonbondedForce(const NonbondedForce& force, int numSubsets) : SlicedNonbondedForce(numSubsets) {
@@ -101,13 +104,41 @@ string SlicedNonbondedForce::getNonbondedMethodName() const {
 void SlicedNonbondedForce::setParticleSubset(int index, int subset) {
     ASSERT_VALID("Index", index, getNumParticles());
     ASSERT_VALID("Subset", subset, numSubsets);
+    if (index >= subsets.size())
+        subsets.resize(getNumParticles(), 0);
     subsets[index] = subset;
 }
 
 int SlicedNonbondedForce::getParticleSubset(int index) const {
     ASSERT_VALID("Index", index, getNumParticles());
-    auto element = subsets.find(index);
-    return element == subsets.end() ? 0 : element->second;
+    return index < subsets.size() ? subsets[index] : 0;
+}
+
+void SlicedNonbondedForce::setParticleSubsets(const vector<int>& subsets) {
+    if (subsets.size() != getNumParticles())
+        throw OpenMMException("setParticleSubsets: the number of subsets differs from the number of particles");
+    for (int subset : subsets)
+        ASSERT_VALID("Subset", subset, numSubsets);
+    this->subsets = subsets;
+}
+
+vector<int> SlicedNonbondedForce::getParticleSubsets() const {
+    vector<int> result(subsets);
+    result.resize(getNumParticles(), 0);
+    return result;
+}
+
+int SlicedNonbondedForce::addParticleParameterOffsets(const string& parameter, const vector<int>& particles, const vector<double>& chargeScales,
+                                                      const vector<double>& sigmaScales, const vector<double>& epsilonScales) {
+    int numOffsets = particles.size();
+    if (chargeScales.size() != numOffsets || sigmaScales.size() != numOffsets || epsilonScales.size() != numOffsets)
+        throw OpenMMException("addParticleParameterOffsets: the numbers of particles and scales differ");
+    for (int particle : particles)
+        ASSERT_VALID("Particle", particle, getNumParticles());
+    int first = getNumParticleParameterOffsets();
+    for (int i = 0; i < numOffsets; i++)
+        addParticleParameterOffset(parameter, particles[i], chargeScales[i], sigmaScales[i], epsilonScales[i]);
+    return first;
 }
 
 int SlicedNonbondedForce::getGlobalParameterIndex(const string& parameter) const {
@@ -188,6 +219,39 @@ void SlicedNonbondedForce::setScalingParameterDerivative(int index, const string
     }
 }
 
+void SlicedNonbondedForce::setSliceSoftCoreParameters(int subset1, int subset2, double alpha, double power) {
+    ASSERT_VALID("Subset", subset1, numSubsets);
+    ASSERT_VALID("Subset", subset2, numSubsets);
+    if (alpha < 0)
+        throw OpenMMException("setSliceSoftCoreParameters: alpha cannot be negative");
+    if (power < 1)
+        throw OpenMMException("setSliceSoftCoreParameters: power must be at least 1");
+    int slice = sliceIndex(subset1, subset2);
+    softCoreAlphas[slice] = alpha;
+    softCorePowers[slice] = power;
+}
+
+void SlicedNonbondedForce::setPMEInterpolationOrder(int order) {
+    if (order < 4 || order > 6)
+        throw OpenMMException("setPMEInterpolationOrder: the order must be 4, 5 or 6");
+    pmeOrder = order;
+}
+
+void SlicedNonbondedForce::getSliceSoftCoreParameters(int subset1, int subset2, double& alpha, double& power) const {
+    ASSERT_VALID("Subset", subset1, numSubsets);
+    ASSERT_VALID("Subset", subset2, numSubsets);
+    int slice = sliceIndex(subset1, subset2);
+    alpha = softCoreAlphas[slice];
+    power = softCorePowers[slice];
+}
+
+bool SlicedNonbondedForce::getUseSoftCore() const {
+    for (double alpha : softCoreAlphas)
+        if (alpha != 0)
+            return true;
+    return false;
+}
+
 ForceImpl* SlicedNonbondedForce::createImpl() const {
     return new SlicedNonbondedForceImpl(*this);
 }
@@ -202,4 +266,70 @@ void SlicedNonbondedForce::getLJPMEParametersInContext(const Context& context, d
 
 void SlicedNonbondedForce::updateParametersInContext(Context& context) {
     dynamic_cast<SlicedNonbondedForceImpl&>(getImplInContext(context)).updateParametersInContext(getContextImpl(context));
+}
+
+void SlicedNonbondedForce::getSliceEnergiesInContext(Context& context, vector<double>& coulombEnergies, vector<double>& ljEnergies) {
+    dynamic_cast<SlicedNonbondedForceImpl&>(getImplInContext(context)).getSliceEnergies(getContextImpl(context), coulombEnergies, ljEnergies);
+}
+
+int SlicedNonbondedForce::addForeignScalingParameterSet(const map<string, double>& values) {
+    for (auto& value : values)
+        getScalingParameterIndex(value.first);
+    foreignScalingParameterSets.push_back(values);
+    return foreignScalingParameterSets.size()-1;
+}
+
+const map<string, double>& SlicedNonbondedForce::getForeignScalingParameterSet(int index) const {
+    ASSERT_VALID("Index", index, getNumForeignScalingParameterSets());
+    return foreignScalingParameterSets[index];
+}
+
+void SlicedNonbondedForce::setForeignScalingParameterSet(int index, const map<string, double>& values) {
+    ASSERT_VALID("Index", index, getNumForeignScalingParameterSets());
+    for (auto& value : values)
+        getScalingParameterIndex(value.first);
+    foreignScalingParameterSets[index] = values;
+}
+
+void SlicedNonbondedForce::getForeignEnergiesInContext(Context& context, vector<double>& energies) {
+    dynamic_cast<SlicedNonbondedForceImpl&>(getImplInContext(context)).getForeignEnergies(getContextImpl(context), energies);
+}
+
+void SlicedNonbondedForce::getReducedForeignEnergiesInContext(Context& context, const vector<vector<Vec3>>& frames,
+                                                              const vector<vector<Vec3>>& boxVectors, double temperature,
+                                                              vector<vector<double>>& reducedEnergies) {
+    dynamic_cast<SlicedNonbondedForceImpl&>(getImplInContext(context)).getReducedForeignEnergies(getContextImpl(context), frames, boxVectors,
+                                                                                               temperature, reducedEnergies);
+}
+
+void SlicedNonbondedForce::getReplicaEnergiesInContext(Context& context, const vector<vector<Vec3>>& positions, vector<vector<double>>& energies) {
+    dynamic_cast<SlicedNonbondedForceImpl&>(getImplInContext(context)).getReplicaEnergies(getContextImpl(context), positions, energies);
+}
+
+void SlicedNonbondedForce::setLambdaStateInContext(Context& context, int index) {
+    dynamic_cast<SlicedNonbondedForceImpl&>(getImplInContext(context)).setLambdaState(index);
+}
+
+int SlicedNonbondedForce::getLambdaStateInContext(Context& context) {
+    return dynamic_cast<SlicedNonbondedForceImpl&>(getImplInContext(context)).getLambdaState();
+}
+
+map<string, double> SlicedNonbondedForce::getScalingParameterDerivativesInContext(Context& context) {
+    map<string, double> derivatives;
+    dynamic_cast<SlicedNonbondedForceImpl&>(getImplInContext(context)).getScalingParameterDerivatives(getContextImpl(context), derivatives);
+    return derivatives;
+}
+
+map<string, double> SlicedNonbondedForce::getStageTimesInContext(Context& context) {
+    map<string, double> times;
+    dynamic_cast<SlicedNonbondedForceImpl&>(getImplInContext(context)).getStageTimes(times);
+    return times;
+}
+
+void SlicedNonbondedForce::resetStageTimesInContext(Context& context) {
+    dynamic_cast<SlicedNonbondedForceImpl&>(getImplInContext(context)).resetStageTimes();
+}
+
+void SlicedNonbondedForce::getDeviceArraysInContext(Context& context, DeviceArray& coulombEnergies, DeviceArray& ljEnergies, vector<int>& slotSlices) {
+    dynamic_cast<SlicedNonbondedForceImpl&>(getImplInContext(context)).getSliceEnergyArrays(coulombEnergies, ljEnergies, slotSlices);
 }
\ No newline at end of file
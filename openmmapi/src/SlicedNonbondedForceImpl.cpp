@@ -12,13 +12,16 @@
   #define _USE_MATH_DEFINES // Needed to get M_PI
 #endif
 #include "internal/SlicedNonbondedForceImpl.h"
+#include "internal/TracingRange.h"
 #include "openmm/OpenMMException.h"
 #include "openmm/internal/ContextImpl.h"
+#include "openmm/reference/SimTKOpenMMRealType.h"
 #include "OpenMMLabKernels.h"
 #include <cmath>
 #include <map>
 #include <sstream>
 #include <algorithm>
+#include <chrono>
 
 using namespace OpenMMLab;
 using namespace OpenMM;
@@ -129,7 +132,12 @@ void SlicedNonbondedForceImpl::initialize(ContextImpl& context) {
         if (offsetParams.find(parameter) != offsetParams.end())
             throw OpenMMException("SlicedNonbondedForce: Cannot use a global parameter for both slice energy scaling and parameter offset.");
     }
+    if (owner.getUseSoftCore() && owner.getNonbondedMethod() == SlicedNonbondedForce::LJPME)
+        throw OpenMMException("SlicedNonbondedForce: Soft-core Lennard-Jones interactions are not supported with LJPME.");
+    auto start = chrono::steady_clock::now();
     kernel.getAs<CalcSlicedNonbondedForceKernel>().initialize(context.getSystem(), owner);
+    if (isProfilingEnabled())
+        initTimes["init:kernel"] = chrono::duration<double, milli>(chrono::steady_clock::now()-start).count();
 }
 
 double SlicedNonbondedForceImpl::calcForcesAndEnergy(ContextImpl& context, bool includeForces, bool includeEnergy, int groups) {
@@ -138,6 +146,7 @@ double SlicedNonbondedForceImpl::calcForcesAndEnergy(ContextImpl& context, bool
     if (reciprocalGroup < 0)
         reciprocalGroup = owner.getForceGroup();
     bool includeReciprocal = ((groups&(1<<reciprocalGroup)) != 0);
+    OPENMMLAB_TRACE_STEP(context.getStepCount());
     return kernel.getAs<CalcSlicedNonbondedForceKernel>().execute(context, includeForces, includeEnergy, includeDirect, includeReciprocal);
 }
 
@@ -261,22 +270,20 @@ double SlicedNonbondedForceImpl::calcDispersionCorrection(const System& system,
 }
 
 vector<double> SlicedNonbondedForceImpl::calcDispersionCorrections(const System& system, const SlicedNonbondedForce& force) {
-    int numSlices = force.getNumSlices();
-    vector<double> dispersionCorrections(numSlices, 0.0);
-    if (force.getNonbondedMethod() == SlicedNonbondedForce::NoCutoff ||
-        force.getNonbondedMethod() == SlicedNonbondedForce::CutoffNonPeriodic)
-        return dispersionCorrections;
+    DispersionCorrectionTable table;
+    return table.update(force);
+}
 
+vector<SlicedNonbondedForceImpl::ParticleClass> SlicedNonbondedForceImpl::getParticleClasses(const SlicedNonbondedForce& force) {
     // Record sigma and epsilon for every particle, including the default value
     // for every offset parameter.
 
-    int numParticles = system.getNumParticles();
+    int numParticles = force.getNumParticles();
     vector<double> sigma(numParticles), epsilon(numParticles);
-    vector<int> subset(numParticles);
+    vector<int> subset = force.getParticleSubsets();
     for (int i = 0; i < numParticles; i++) {
         double charge;
         force.getParticleParameters(i, charge, sigma[i], epsilon[i]);
-        subset[i] = force.getParticleSubset(i);
     }
     map<string, double> param;
     for (int i = 0; i < force.getNumGlobalParameters(); i++)
@@ -289,68 +296,91 @@ vector<double> SlicedNonbondedForceImpl::calcDispersionCorrections(const System&
         sigma[index] += param[parameter]*sigmaScale;
         epsilon[index] += param[parameter]*epsilonScale;
     }
+    vector<ParticleClass> classes(numParticles);
+    for (int i = 0; i < numParticles; i++)
+        classes[i] = make_tuple(sigma[i], epsilon[i], subset[i]);
+    return classes;
+}
 
-    // Identify all particle classes (defined by sigma, epsilon, and subset), and count the number of
-    // particles in each class.
+void SlicedNonbondedForceImpl::DispersionCorrectionTable::addPairTerms(const ParticleClass& class1, const ParticleClass& class2, double count) {
+    double sigma = 0.5*(get<0>(class1)+get<0>(class2));
+    double epsilon = (class1 == class2 ? get<1>(class1) : sqrt(get<1>(class1)*get<1>(class2)));
+    int subset1 = get<2>(class1), subset2 = get<2>(class2);
+    int slice = sliceIndex(subset1, subset2);
+    double sigmaSq = sigma*sigma;
+    double sigma6 = sigmaSq*sigmaSq*sigmaSq;
+    sum1[slice] += count*epsilon*sigma6*sigma6;
+    sum2[slice] += count*epsilon*sigma6;
+    if (useSwitch)
+        sum3[slice] += count*epsilon*(evalIntegral(cutoff, switchDistance, cutoff, sigma)-evalIntegral(switchDistance, switchDistance, cutoff, sigma));
+}
 
-    typedef tuple<double, double, int> ParticleClass;
-    map<ParticleClass, int> classCounts;
-    for (int i = 0; i < force.getNumParticles(); i++) {
-        ParticleClass key = make_tuple(sigma[i], epsilon[i], subset[i]);
-        map<ParticleClass, int>::iterator entry = classCounts.find(key);
-        if (entry == classCounts.end())
-            classCounts[key] = 1;
-        else
-            entry->second++;
-    }
+void SlicedNonbondedForceImpl::DispersionCorrectionTable::addParticle(const ParticleClass& particleClass, int delta) {
+    // A class with n particles contributes n(n+1)/2 pairs with itself and n*m pairs with a
+    // class with m particles, so adding or removing a particle only touches O(classes) terms.
 
-    // Loop over all pairs of classes to compute the coefficients.
+    int& count = classCounts[particleClass];
+    addPairTerms(particleClass, particleClass, delta > 0 ? count+1 : -count);
+    for (auto& entry : classCounts)
+        if (entry.first != particleClass)
+            addPairTerms(particleClass, entry.first, delta*(double) entry.second);
+    count += delta;
+    if (count == 0)
+        classCounts.erase(particleClass);
+}
 
-    vector<double> sum1(numSlices, 0), sum2(numSlices, 0), sum3(numSlices, 0);
-    bool useSwitch = force.getUseSwitchingFunction();
-    double cutoff = force.getCutoffDistance();
-    double switchDist = force.getSwitchingDistance();
-    for (map<ParticleClass, int>::const_iterator entry = classCounts.begin(); entry != classCounts.end(); ++entry) {
-        double sigma = get<0>(entry->first);
-        double epsilon = get<1>(entry->first);
-        int subset = get<2>(entry->first);
-        int count = entry->second*(entry->second+1)/2;
-        double sigmaSq = sigma*sigma;
-        double sigma6 = sigmaSq*sigmaSq*sigmaSq;
-        int slice = subset*(subset+3)/2;
-        sum1[slice] += count*epsilon*sigma6*sigma6;
-        sum2[slice] += count*epsilon*sigma6;
-        if (useSwitch)
-            sum3[slice] += count*epsilon*(evalIntegral(cutoff, switchDist, cutoff, sigma)-evalIntegral(switchDist, switchDist, cutoff, sigma));
+const vector<double>& SlicedNonbondedForceImpl::DispersionCorrectionTable::update(const SlicedNonbondedForce& force) {
+    int numSlices = force.getNumSlices();
+    if (force.getNonbondedMethod() == SlicedNonbondedForce::NoCutoff ||
+        force.getNonbondedMethod() == SlicedNonbondedForce::CutoffNonPeriodic) {
+        particleClasses.clear();
+        coefficients.assign(numSlices, 0.0);
+        return coefficients;
     }
-    for (map<ParticleClass, int>::const_iterator class1 = classCounts.begin(); class1 != classCounts.end(); ++class1) {
-        double sigma1 = get<0>(class1->first);
-        double epsilon1 = get<1>(class1->first);
-        int s1 = get<2>(class1->first);
-        for (map<ParticleClass, int>::const_iterator class2 = classCounts.begin(); class2 != class1; ++class2) {
-            double sigma2 = get<0>(class2->first);
-            double epsilon2 = get<1>(class2->first);
-            int s2 = get<2>(class2->first);
-            double sigma = 0.5*(sigma1+sigma2);
-            double epsilon = sqrt(epsilon1*epsilon2);
-            int slice = sliceIndex(s1, s2);
-            int count = class1->second*class2->second;
-            double sigmaSq = sigma*sigma;
-            double sigma6 = sigmaSq*sigmaSq*sigmaSq;
-            sum1[slice] += count*epsilon*sigma6*sigma6;
-            sum2[slice] += count*epsilon*sigma6;
-            if (useSwitch)
-                sum3[slice] += count*epsilon*(evalIntegral(cutoff, switchDist, cutoff, sigma)-evalIntegral(switchDist, switchDist, cutoff, sigma));
+
+    // Find the particles whose class has changed.  If there are more of them than there are
+    // classes, or the settings have changed, the sums are rebuilt from scratch.
+
+    vector<ParticleClass> classes = getParticleClasses(force);
+    bool sameSettings = (classes.size() == particleClasses.size() && sum1.size() == numSlices && cutoff == force.getCutoffDistance() &&
+                         useSwitch == force.getUseSwitchingFunction() && switchDistance == force.getSwitchingDistance());
+    vector<int> changed;
+    if (sameSettings)
+        for (int i = 0; i < classes.size() && changed.size() <= classCounts.size(); i++)
+            if (classes[i] != particleClasses[i])
+                changed.push_back(i);
+    if (sameSettings && changed.size() <= classCounts.size())
+        for (int i : changed) {
+            addParticle(particleClasses[i], -1);
+            addParticle(classes[i], 1);
+        }
+    else {
+        cutoff = force.getCutoffDistance();
+        useSwitch = force.getUseSwitchingFunction();
+        switchDistance = force.getSwitchingDistance();
+        sum1.assign(numSlices, 0.0);
+        sum2.assign(numSlices, 0.0);
+        sum3.assign(numSlices, 0.0);
+        classCounts.clear();
+        for (const ParticleClass& particleClass : classes)
+            classCounts[particleClass]++;
+        for (auto class1 = classCounts.begin(); class1 != classCounts.end(); ++class1) {
+            double count1 = class1->second;
+            addPairTerms(class1->first, class1->first, count1*(count1+1)/2);
+            for (auto class2 = classCounts.begin(); class2 != class1; ++class2)
+                addPairTerms(class1->first, class2->first, count1*class2->second);
         }
     }
+    particleClasses.swap(classes);
+
+    // Compute the coefficients from the sums.
+
+    double numParticles = particleClasses.size();
     double numInteractions = (numParticles*(numParticles+1))/2;
-    for (int slice = 0; slice < numSlices; slice++) {
-        sum1[slice] /= numInteractions;
-        sum2[slice] /= numInteractions;
-        sum3[slice] /= numInteractions;
-        dispersionCorrections[slice] = 8*numParticles*numParticles*M_PI*(sum1[slice]/(9*pow(cutoff, 9))-sum2[slice]/(3*pow(cutoff, 3))+sum3[slice]);
-    }
-    return dispersionCorrections;
+    coefficients.resize(numSlices);
+    for (int slice = 0; slice < numSlices; slice++)
+        coefficients[slice] = 8*numParticles*numParticles*M_PI*(sum1[slice]/(9*pow(cutoff, 9))-sum2[slice]/(3*pow(cutoff, 3))+sum3[slice])/numInteractions;
+    return coefficients;
 }
 
 void SlicedNonbondedForceImpl::updateParametersInContext(ContextImpl& context) {
@@ -358,6 +388,129 @@ void SlicedNonbondedForceImpl::updateParametersInContext(ContextImpl& context) {
     context.systemChanged();
 }
 
+void SlicedNonbondedForceImpl::getSliceEnergies(ContextImpl& context, vector<double>& coulombEnergies, vector<double>& ljEnergies) {
+    kernel.getAs<CalcSlicedNonbondedForceKernel>().getSliceEnergies(context, owner.getIncludeDirectSpace(), true, coulombEnergies, ljEnergies);
+}
+
+void SlicedNonbondedForceImpl::getForeignEnergies(ContextImpl& context, vector<double>& energies) {
+    if (owner.getUseSoftCore())
+        throw OpenMMException("getForeignEnergiesInContext: Foreign energies are not available with soft-core interactions");
+
+    // Find the scaling parameters of every slice, where an empty name means a constant 1.
+
+    int numSlices = owner.getNumSlices();
+    vector<string> coulombParams(numSlices), ljParams(numSlices);
+    for (int i = 0; i < owner.getNumScalingParameters(); i++) {
+        string parameter;
+        int subset1, subset2;
+        bool includeCoulomb, includeLJ;
+        owner.getScalingParameter(i, parameter, subset1, subset2, includeCoulomb, includeLJ);
+        int slice = sliceIndex(subset1, subset2);
+        if (includeCoulomb)
+            coulombParams[slice] = parameter;
+        if (includeLJ)
+            ljParams[slice] = parameter;
+    }
+
+    // The energy is linear in the scaling parameters, so every foreign energy is a weighted sum
+    // of the slice energies.
+
+    vector<double> coulombEnergies, ljEnergies;
+    getSliceEnergies(context, coulombEnergies, ljEnergies);
+    int numSets = owner.getNumForeignScalingParameterSets();
+    energies.assign(numSets, 0.0);
+    for (int k = 0; k < numSets; k++) {
+        const map<string, double>& values = owner.getForeignScalingParameterSet(k);
+        auto value = [&] (const string& parameter) {
+            if (parameter.empty())
+                return 1.0;
+            auto entry = values.find(parameter);
+            return entry == values.end() ? context.getParameter(parameter) : entry->second;
+        };
+        for (int slice = 0; slice < numSlices; slice++)
+            energies[k] += value(coulombParams[slice])*coulombEnergies[slice] + value(ljParams[slice])*ljEnergies[slice];
+    }
+}
+
+void SlicedNonbondedForceImpl::getScalingParameterDerivatives(ContextImpl& context, map<string, double>& derivatives) {
+    kernel.getAs<CalcSlicedNonbondedForceKernel>().getScalingParameterDerivatives(context, owner.getIncludeDirectSpace(), true, derivatives);
+}
+
+/**
+ * Saves the box vectors and positions of a Context, and restores them when destroyed, so
+ * that evaluating other configurations leaves the Context as it was even if one of the
+ * evaluations throws.
+ */
+class ConfigurationRestorer {
+public:
+    ConfigurationRestorer(ContextImpl& context) : context(context) {
+        context.getPositions(positions);
+        context.getPeriodicBoxVectors(box[0], box[1], box[2]);
+    }
+    ~ConfigurationRestorer() {
+        try {
+            context.setPeriodicBoxVectors(box[0], box[1], box[2]);
+            context.setPositions(positions);
+        }
+        catch (...) {
+            // The saved configuration was valid, and a destructor must not throw.
+        }
+    }
+private:
+    ContextImpl& context;
+    vector<Vec3> positions;
+    Vec3 box[3];
+};
+
+void SlicedNonbondedForceImpl::getReplicaEnergies(ContextImpl& context, const vector<vector<Vec3>>& positions, vector<vector<double>>& energies) {
+    int numParticles = context.getSystem().getNumParticles();
+    for (const vector<Vec3>& replicaPositions : positions)
+        if (replicaPositions.size() != numParticles)
+            throw OpenMMException("getReplicaEnergiesInContext: Number of positions does not match number of particles");
+
+    // This is a convenience loop on the host.  All replicas share the kernels and parameters
+    // of this Context, so only the positions are replaced between evaluations.
+
+    ConfigurationRestorer restorer(context);
+    energies.resize(positions.size());
+    for (int r = 0; r < positions.size(); r++) {
+        context.setPositions(positions[r]);
+        getForeignEnergies(context, energies[r]);
+    }
+}
+
+void SlicedNonbondedForceImpl::getReducedForeignEnergies(ContextImpl& context, const vector<vector<Vec3>>& frames, const vector<vector<Vec3>>& boxVectors,
+                                                         double temperature, vector<vector<double>>& reducedEnergies) {
+    int numParticles = context.getSystem().getNumParticles();
+    for (const vector<Vec3>& framePositions : frames)
+        if (framePositions.size() != numParticles)
+            throw OpenMMException("getReducedForeignEnergiesInContext: Number of positions does not match number of particles");
+    if (boxVectors.size() != 0 && boxVectors.size() != frames.size())
+        throw OpenMMException("getReducedForeignEnergiesInContext: Number of box vectors does not match number of frames");
+    for (const vector<Vec3>& box : boxVectors)
+        if (box.size() != 3)
+            throw OpenMMException("getReducedForeignEnergiesInContext: Every frame must have three box vectors");
+    if (temperature <= 0.0)
+        throw OpenMMException("getReducedForeignEnergiesInContext: The temperature must be positive");
+
+    // This is a convenience loop on the host.  The energies are stored by set, as MBAR
+    // expects them, and the state of the Context is only replaced between frames.
+
+    ConfigurationRestorer restorer(context);
+    double beta = 1.0/(BOLTZ*temperature);
+    int numSets = owner.getNumForeignScalingParameterSets();
+    reducedEnergies.assign(numSets, vector<double>(frames.size()));
+    vector<double> energies;
+    for (int n = 0; n < frames.size(); n++) {
+        if (boxVectors.size() > 0)
+            context.setPeriodicBoxVectors(boxVectors[n][0], boxVectors[n][1], boxVectors[n][2]);
+        context.setPositions(frames[n]);
+        getForeignEnergies(context, energies);
+        for (int k = 0; k < numSets; k++)
+            reducedEnergies[k][n] = beta*energies[k];
+    }
+}
+
 void SlicedNonbondedForceImpl::getPMEParameters(double& alpha, int& nx, int& ny, int& nz) const {
     kernel.getAs<CalcSlicedNonbondedForceKernel>().getPMEParameters(alpha, nx, ny, nz);
 }
@@ -365,3 +518,28 @@ void SlicedNonbondedForceImpl::getPMEParameters(double& alpha, int& nx, int& ny,
 void SlicedNonbondedForceImpl::getLJPMEParameters(double& alpha, int& nx, int& ny, int& nz) const {
     kernel.getAs<CalcSlicedNonbondedForceKernel>().getLJPMEParameters(alpha, nx, ny, nz);
 }
+
+void SlicedNonbondedForceImpl::getStageTimes(map<string, double>& times) {
+    kernel.getAs<CalcSlicedNonbondedForceKernel>().getStageTimes(times);
+    for (auto& time : initTimes)
+        times[time.first] += time.second;
+}
+
+void SlicedNonbondedForceImpl::resetStageTimes() {
+    kernel.getAs<CalcSlicedNonbondedForceKernel>().resetStageTimes();
+    initTimes.clear();
+}
+
+void SlicedNonbondedForceImpl::getSliceEnergyArrays(DeviceArray& coulombEnergies, DeviceArray& ljEnergies, vector<int>& slotSlices) {
+    kernel.getAs<CalcSlicedNonbondedForceKernel>().getSliceEnergyArrays(coulombEnergies, ljEnergies, slotSlices);
+}
+
+void SlicedNonbondedForceImpl::setLambdaState(int index) {
+    if (index < -1 || index >= owner.getNumForeignScalingParameterSets())
+        throw OpenMMException("setLambdaStateInContext: Illegal lambda state index");
+    kernel.getAs<CalcSlicedNonbondedForceKernel>().setLambdaState(index);
+}
+
+int SlicedNonbondedForceImpl::getLambdaState() const {
+    return kernel.getAs<CalcSlicedNonbondedForceKernel>().getLambdaState();
+}
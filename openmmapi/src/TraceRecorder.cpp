@@ -0,0 +1,130 @@
+/* -------------------------------------------------------------------------- *
+ *                             OpenMM Laboratory                              *
+ *                             =================                              *
+ *                                                                            *
+ * A plugin for testing low-level code implementation for OpenMM.             *
+ *                                                                            *
+ * Copyright (c) 2023 Charlles Abreu                                          *
+ * https://github.com/craabreu/openmm-lab                                     *
+ * -------------------------------------------------------------------------- */
+
+#include "internal/TraceRecorder.h"
+#include "openmm/OpenMMException.h"
+#include <atomic>
+#include <cstdlib>
+#include <utility>
+#include <vector>
+
+using namespace OpenMM;
+using namespace OpenMMLab;
+using namespace std;
+
+// The state of the calling thread: the step attached to its spans, the spans it has opened,
+// and its track, which is only assigned when it records its first span.
+
+static thread_local long long currentStep = -1;
+static thread_local vector<pair<string, double> > openSpans;
+static thread_local int hostTrack = -1;
+static atomic<int> numHostThreads(0);
+
+static const char* getTracePath() {
+    const char* path = getenv("OPENMMLAB_TRACE_FILE");
+    return (path != NULL && path[0] != '\0' ? path : NULL);
+}
+
+/**
+ * Write a string as a JSON string literal.
+ */
+static void writeString(FILE* file, const string& text) {
+    fputc('"', file);
+    for (char c : text) {
+        if (c == '"' || c == '\\')
+            fputc('\\', file);
+        if ((unsigned char) c < 0x20)
+            fprintf(file, "\\u%04x", c);
+        else
+            fputc(c, file);
+    }
+    fputc('"', file);
+}
+
+bool TraceRecorder::isEnabled() {
+    static const bool enabled = (getTracePath() != NULL);
+    return enabled;
+}
+
+TraceRecorder& TraceRecorder::getInstance() {
+    static TraceRecorder recorder(getTracePath() == NULL ? "" : getTracePath());
+    return recorder;
+}
+
+TraceRecorder::TraceRecorder(const string& path) : epoch(chrono::steady_clock::now()), isFirstEvent(true) {
+    if (path.empty())
+        throw OpenMMException("TraceRecorder: the environment variable OPENMMLAB_TRACE_FILE is not set");
+    file = fopen(path.c_str(), "w");
+    if (file == NULL)
+        throw OpenMMException("TraceRecorder: cannot open "+path);
+    fputs("[", file);
+}
+
+TraceRecorder::~TraceRecorder() {
+    fputs("\n]\n", file);
+    fclose(file);
+}
+
+double TraceRecorder::now() const {
+    return chrono::duration<double, micro>(chrono::steady_clock::now()-epoch).count();
+}
+
+void TraceRecorder::setStep(long long step) {
+    currentStep = step;
+}
+
+long long TraceRecorder::getStep() {
+    return currentStep;
+}
+
+void TraceRecorder::beginSpan(const char* name) {
+    openSpans.push_back(make_pair(string(name), now()));
+}
+
+void TraceRecorder::endSpan() {
+    if (openSpans.empty())
+        return;
+    double end = now();
+    pair<string, double> span = openSpans.back();
+    openSpans.pop_back();
+    lock_guard<mutex> guard(lock);
+    if (hostTrack < 0)
+        hostTrack = getTrackId("host thread "+to_string(numHostThreads++));
+    write(span.first, hostTrack, span.second, end-span.second, currentStep);
+}
+
+void TraceRecorder::addSpan(const string& name, const string& track, double start, double duration, long long step) {
+    lock_guard<mutex> guard(lock);
+    write(name, getTrackId(track), start, duration, step);
+}
+
+int TraceRecorder::getTrackId(const string& track) {
+    // Tracks are numbered in the order they appear, and named by a metadata event.
+
+    auto found = trackIds.find(track);
+    if (found != trackIds.end())
+        return found->second;
+    int id = trackIds.size()+1;
+    trackIds[track] = id;
+    fprintf(file, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":", (isFirstEvent ? "" : ","), id);
+    writeString(file, track);
+    fputs("}}", file);
+    isFirstEvent = false;
+    return id;
+}
+
+void TraceRecorder::write(const string& name, int track, double start, double duration, long long step) {
+    fprintf(file, "%s\n{\"name\":", (isFirstEvent ? "" : ","));
+    writeString(file, name);
+    fprintf(file, ",\"cat\":\"openmmlab\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"step\":%lld}}",
+            track, start, duration, step);
+    isFirstEvent = false;
+    fflush(file);
+}
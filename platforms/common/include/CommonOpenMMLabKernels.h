@@ -12,12 +12,19 @@
  * -------------------------------------------------------------------------- */
 
 #include "OpenMMLabKernels.h"
+#include "internal/CommonScratchPool.h"
 #include "openmm/common/ComputeContext.h"
 #include "openmm/common/ComputeArray.h"
 #include "openmm/common/ComputeKernel.h"
+#include "openmm/Kernel.h"
 #include "lepton/CompiledExpression.h"
 #include "lepton/CustomFunction.h"
 #include "lepton/ExpressionProgram.h"
+#include <chrono>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
 
 using namespace OpenMM;
 
@@ -29,7 +36,8 @@ namespace OpenMMLab {
 class CommonCalcExtendedCustomCVForceKernel : public CalcExtendedCustomCVForceKernel {
 public:
     CommonCalcExtendedCustomCVForceKernel(std::string name, const Platform& platform, ComputeContext& cc) : CalcExtendedCustomCVForceKernel(name, platform),
-            cc(cc), hasInitializedListeners(false) {
+            cc(cc), scratch(NULL), hasInitializedListeners(false), deferEvaluation(false), evaluationPending(false), derivativesOnDemand(false), hasSharedParticles(false), numReorders(0),
+            profileStages(isProfilingEnabled()) {
     }
     ~CommonCalcExtendedCustomCVForceKernel();
     /**
@@ -38,11 +46,18 @@ public:
      * @param system     the System this kernel will be applied to
      * @param force      the ExtendedCustomCVForce this kernel will be used for
      * @param innerContext   the context created by the ExtendedCustomCVForce for computing collective variables
+     * @param placed     the collective variables evaluated on other platforms
      */
-    void initialize(const System& system, const ExtendedCustomCVForce& force, ContextImpl& innerContext);
+    void initialize(const System& system, const ExtendedCustomCVForce& force, ContextImpl& innerContext, PlacedCollectiveVariables& placed);
     /**
      * Execute the kernel to calculate the forces and/or energy.
      *
+     * The collective variables are evaluated one after another.  They cannot be launched on
+     * separate streams or queues, because every pass runs in the same inner context and
+     * therefore clears, fills, and reduces the same force and energy buffers.
+     * Where the platform provides a side queue (see createSideQueue()), this only records the
+     * request, and the evaluation runs after the outer context has queued its other forces.
+     *
      * @param context        the context in which to execute this kernel
      * @param innerContext   the context created by the ExtendedCustomCVForce for computing collective variables
      * @param includeForces  true if forces should be calculated
@@ -53,10 +68,22 @@ public:
     /**
      * Copy state information to the inner context.
      *
+     * The inner context cannot alias the position and velocity arrays of the outer one,
+     * because each ComputeContext owns these arrays and reorders its atoms independently.
+     * A single kernel therefore scatters them through the two atom orderings.
+     *
      * @param context        the context in which to execute this kernel
      * @param innerContext   the context created by the ExtendedCustomCVForce for computing collective variables
      */
     void copyState(ContextImpl& context, ContextImpl& innerContext);
+    /**
+     * Get the current values of the collective variables.
+     *
+     * @param context        the context in which to execute this kernel
+     * @param innerContext   the context created by the ExtendedCustomCVForce for computing collective variables
+     * @param values         on exit, the value of each collective variable
+     */
+    void getCollectiveVariableValues(ContextImpl& context, ContextImpl& innerContext, std::vector<double>& values);
     /**
      * Copy changed parameters over to a context.
      *
@@ -68,22 +95,300 @@ public:
      * Get the ComputeContext corresponding to the inner Context.
      */
     virtual ComputeContext& getInnerComputeContext(ContextImpl& innerContext) = 0;
+    /**
+     * Block until all work queued on a ComputeContext has finished.  This is only used for
+     * timing the stages of execute() when profiling is enabled.
+     */
+    virtual void synchronize(ComputeContext& context) = 0;
+    /**
+     * Create the side queue on which the collective variables are evaluated while the outer
+     * context computes its other forces.  Platforms that support it create the queue and return
+     * true.  Otherwise, the collective variables are evaluated within execute().
+     *
+     * @param context        the ComputeContext of the outer Context
+     * @param innerContext   the ComputeContext of the inner Context
+     */
+    virtual bool createSideQueue(ComputeContext& context, ComputeContext& innerContext) {
+        return false;
+    }
+    /**
+     * Mark the work queued so far on the outer context, which the side queue must wait for.
+     */
+    virtual void markOuterQueue(ComputeContext& context) {
+    }
+    /**
+     * Make the side queue wait for the work marked by markOuterQueue(), and queue the work of
+     * both contexts on it.
+     */
+    virtual void beginSideQueue(ComputeContext& context, ComputeContext& innerContext) {
+    }
+    /**
+     * Restore the default queues of both contexts, and make that of the outer one wait for the
+     * work queued on the side queue.
+     */
+    virtual void endSideQueue(ComputeContext& context, ComputeContext& innerContext) {
+    }
+    /**
+     * Compile a program.  This calls ComputeContext::compileProgram(), and a platform may
+     * override it to reuse programs compiled before.
+     */
+    virtual ComputeProgram compileProgram(ComputeContext& context, const std::string& source, const std::map<std::string, std::string>& defines) {
+        return context.compileProgram(source, defines);
+    }
+    /**
+     * Get the time spent in each stage of the computation, in milliseconds.
+     *
+     * @param times    on exit, the accumulated time of each stage, keyed by stage name
+     */
+    void getStageTimes(std::map<std::string, double>& times);
+    /**
+     * Reset the accumulated times of all stages to zero.
+     */
+    void resetStageTimes();
+    /**
+     * Get the counters of the work done by this kernel, along with the device memory it
+     * owns ("deviceBytes") and the size of the scratch pool it shares with the other
+     * kernels of its context ("scratchBytes").
+     *
+     * @param counters    on exit, the value of each counter, keyed by counter name
+     */
+    void getCounters(std::map<std::string, long long>& counters);
+    /**
+     * Reset all counters to zero.
+     */
+    void resetCounters() {
+        counters.reset();
+    }
+    /**
+     * Describe the device arrays that hold the forces of the collective variables.
+     *
+     * @param forces        on exit, the forces of the collective variables stored densely
+     * @param atomIndices   on exit, the index of the atom at each position of the forces
+     * @param variables     on exit, the index of the collective variable of each row of forces
+     */
+    void getForceArrays(DeviceArray& forces, DeviceArray& atomIndices, std::vector<int>& variables);
+    /**
+     * Get the terms this kernel has deposited in a custom summation.
+     *
+     * @param index     the index of the summation
+     * @param terms     on exit, the per-term parameters of each deposited term
+     */
+    void getDepositedTerms(int index, std::vector<std::vector<double> >& terms);
+    /**
+     * Evaluate the variables that are not placed on other platforms at the current state of
+     * the inner context, regardless of their evaluation intervals.
+     *
+     * @param innerContext   the context created by the ExtendedCustomCVForce for computing collective variables
+     * @param values         on exit, the value of each variable
+     */
+    void evaluateInnerVariables(ContextImpl& innerContext, std::vector<double>& values);
+    /**
+     * Get the values of the collective variables and the energies recorded at the latest
+     * steps, from the oldest to the newest, and remove them from the history.
+     *
+     * @param steps      on exit, the step of each record
+     * @param values     on exit, the values of the variables at each step
+     * @param energies   on exit, the energy at each step
+     */
+    void getCollectiveVariableHistory(std::vector<long long>& steps, std::vector<std::vector<double> >& values, std::vector<double>& energies) {
+        history.take(steps, values, energies);
+    }
+    /**
+     * Get the results that the collective variables keep between evaluations.
+     *
+     * @param steps         on exit, the step at which each variable was last evaluated, or -1
+     *                      if it keeps no results
+     * @param values        on exit, the value of each variable
+     * @param derivatives   on exit, the derivatives of each variable with respect to the global
+     *                      parameters of the inner context
+     */
+    void getCollectiveVariableCache(std::vector<long long>& steps, std::vector<double>& values, std::vector<std::vector<double> >& derivatives);
+    /**
+     * Replace the results that the collective variables keep between evaluations.  Their
+     * forces are marked as missing, so a variable whose forces are needed is evaluated again.
+     *
+     * @param steps         the step at which each variable was evaluated, or -1 for a variable
+     *                      with no results.  If empty, all results are discarded.
+     * @param values        the value of each variable
+     * @param derivatives   the derivatives of each variable with respect to the global parameters
+     *                      of the inner context
+     */
+    void setCollectiveVariableCache(const std::vector<long long>& steps, const std::vector<double>& values,
+                                    const std::vector<std::vector<double> >& derivatives);
+    /**
+     * Fill in the address, stream, and device of an array of a ComputeContext.  Platforms
+     * that cannot export their device memory throw an exception.
+     */
+    virtual void describeArray(ComputeContext& context, ArrayInterface& array, DeviceArray& description) {
+        throw OpenMMException("ExtendedCustomCVForce: device arrays can only be exported by the CUDA platform");
+    }
 private:
+    class DeferredEvaluation;
     class ForceInfo;
     class ReorderListener;
     class TabulatedFunctionWrapper;
+    void uploadRadialBasisFunctions(const ExtendedCustomCVForce& force);
+    void updateAtomMaps(ComputeContext& cc2);
+    void initializeListeners(ContextImpl& innerContext);
+    void beginStage(const std::string& name);
+    void endStage();
+    double evaluateRadialBasisFunction(int index, std::vector<double>& gradient);
+    void uploadCustomSummations(const ExtendedCustomCVForce& force);
+    void depositSummationTerms(long long step);
+    void setBatchDisplacements(int batch, bool useDerivatives);
+    void evaluateBatches(ContextImpl& innerContext);
+    void readPlacedVariables(bool includeForces);
+    void readInnerDerivatives(ContextImpl& innerContext, std::vector<double>& derivs);
+    double evaluate(ContextImpl& context, ContextImpl& innerContext, bool includeForces, bool includeEnergy, bool addForces);
+    double finishDeferredEvaluation();
+    void addWeightedForces(bool includeForces);
     ComputeContext& cc;
-    bool hasInitializedListeners;
+    CommonScratchPool* scratch;
+    bool hasInitializedListeners, deferEvaluation, evaluationPending, copyVelocities, derivativesOnDemand, hasSharedParticles;
+    ContextImpl* deferredContext;
+    ContextImpl* deferredInnerContext;
+    bool deferredIncludeForces, deferredIncludeEnergy;
     Lepton::CompiledExpression energyExpression;
-    std::vector<std::string> variableNames, paramDerivNames, globalParameterNames;
+    std::vector<std::string> variableNames, paramDerivNames, globalParameterNames, innerParameterNames;
     std::vector<Lepton::CompiledExpression> variableDerivExpressions;
     std::vector<Lepton::CompiledExpression> paramDerivExpressions;
-    std::vector<ComputeArray> cvForces;
+    ComputeArray cvForces, dEdVArray, denseCVs;
+    ComputeArray sparseForces, sparseAtoms, sparseCVs;
+    std::vector<int> cvDenseSlot, cvSparseStart, cvSparseEnd;
+    int numDenseCVs, numSparseEntries, placedSparseStart;
+    PlacedCollectiveVariables* placed;
+    std::vector<bool> cvPlaced;
+    std::vector<int> sparseAtomsHost;
+    std::vector<long long> placedForcesHost;
+    std::vector<int> cvIntervals, cvReorders;
+    std::vector<long long> cvSteps;
+    std::vector<bool> cvHasValue, cvHasForces;
+    std::vector<std::vector<double> > cvDerivs;
+    std::vector<bool> cvEvaluate;
+    std::vector<double> dEdV;
+    std::vector<float> dEdVFloat;
+    int numReorders;
     std::vector<double> globalValues, cvValues;
     std::vector<Lepton::CustomFunction*> tabulatedFunctions;
+    std::vector<std::vector<double> > tabulatedFunctionData;
     ComputeArray invAtomOrder;
     ComputeArray innerInvAtomOrder;
-    ComputeKernel copyStateKernel, copyForcesKernel, addForcesKernel;
+    ComputeArray innerIndex;
+    ComputeKernel copyStateKernel, copyForcesKernel, addForcesKernel, copySparseForcesKernel, addSparseForcesKernel;
+    std::vector<int> batchGroups, batchOrigins, batchFirstVariables, batchSizes;
+    std::vector<std::vector<double> > batchDerivs;
+    std::vector<std::string> derivNames;
+    std::vector<int> innerDerivSlots;
+    std::map<std::string, double> innerDerivs;
+    std::vector<double> derivTotals;
+    std::vector<long long> batchForcesHost;
+    ComputeArray batchForces;
+    ComputeKernel setBatchDisplacementsKernel, copyBatchForcesKernel, addBatchForcesKernel;
+    std::vector<std::string> rbfNames;
+    std::vector<std::vector<int> > rbfVariables;
+    std::vector<int> rbfTypes, rbfNumCenters;
+    std::vector<double> rbfShapeParameters, rbfValues;
+    std::vector<Lepton::CompiledExpression> rbfDerivExpressions;
+    std::vector<ComputeArray> rbfCenters, rbfWeights;
+    std::vector<ComputeKernel> rbfKernels;
+    std::vector<std::vector<double> > rbfGradients;
+    std::vector<double> rbfSums, rbfDoubleBuffer;
+    std::vector<float> rbfFloatBuffer;
+    std::vector<std::string> summationNames;
+    std::vector<std::vector<int> > summationVariables;
+    std::vector<Kernel> summationKernels;
+    std::vector<Lepton::CompiledExpression> summationDerivExpressions;
+    std::vector<double> summationValues, summationArgs;
+    std::vector<std::vector<double> > summationGradients;
+    std::vector<int> depositionIntervals, numOwnTerms;
+    std::vector<std::vector<Lepton::CompiledExpression> > depositionExpressions;
+    std::vector<std::vector<std::vector<double> > > summationTerms;
+    long long lastDepositionStep;
+    CollectiveVariableHistory history;
+
+    // Profiling of the stages of execute().  The stages mix host and device work, so they
+    // are timed on the host, synchronizing with the device at their boundaries.
+
+    bool profileStages;
+    std::string currentStage;
+    std::chrono::steady_clock::time_point stageStart;
+    std::map<std::string, double> stageTimes;
+    ExtendedCustomCVForceCounters counters;
+};
+
+/**
+ * This kernel is invoked by the "Kernel" backend of CustomSummation.  The term expression
+ * and its derivatives are compiled into a single kernel, in which the terms are split
+ * among the threads and the partial sums of each thread group are reduced on the host.
+ *
+ * In deterministic mode, every term is converted to 64 bit fixed point before it is
+ * added, as OpenMM does with forces.  Integer addition is associative, so the results
+ * are bitwise identical for any distribution of the terms among threads and groups.
+ *
+ * The arguments of the points and the partial sums are only needed during a call of
+ * evaluate(), so they are taken from the CommonScratchPool of the context, where they
+ * are shared with the other summations and grow with the largest batch of points.
+ */
+class CommonCalcCustomSummationKernel : public CalcCustomSummationKernel {
+public:
+    CommonCalcCustomSummationKernel(std::string name, const Platform& platform, ComputeContext& cc) : CalcCustomSummationKernel(name, platform),
+            cc(cc), scratch(NULL), numArgs(0), numTerms(0), deterministic(false) {
+    }
+    ~CommonCalcCustomSummationKernel();
+    /**
+     * Initialize the kernel.
+     *
+     * @param numArgs              the number of arguments of the summation
+     * @param expression           the expression of each term, with point functions already
+     *                             expanded
+     * @param overallParameters    the names and initial values of the overall parameters
+     * @param perTermParameters    the names of the per-term parameters
+     * @param deterministic        whether the terms must be summed in fixed point
+     */
+    void initialize(int numArgs, const Lepton::ParsedExpression& expression, const std::map<std::string, double>& overallParameters,
+                    const std::vector<std::string>& perTermParameters, bool deterministic);
+    /**
+     * Update the terms of the summation.  Only the modified terms are uploaded, unless the
+     * array of parameters needs to grow.
+     *
+     * @param parameters      the parameters of all terms
+     * @param modifiedTerms   the indices of the terms that have been added or modified
+     *                        since the last update
+     */
+    void setTerms(const std::vector<std::vector<double> >& parameters, const std::set<int>& modifiedTerms);
+    /**
+     * Set the value of an overall parameter.
+     */
+    void setParameter(const std::string& name, double value);
+    /**
+     * Evaluate the summation at a set of points.
+     *
+     * @param arguments    the arguments of all points, stored consecutively
+     * @param numPoints    the number of points
+     * @param values       on exit, the value of the summation at each point
+     * @param gradients    on exit, the gradient of the summation at each point, stored
+     *                     consecutively.  If NULL, gradients are not computed.
+     */
+    void evaluate(const double* arguments, int numPoints, double* values, double* gradients);
+    /**
+     * Get the size in bytes of the device arrays owned by this kernel, not counting those
+     * taken from the scratch pool.
+     */
+    long long getNumBytes() const;
+private:
+    void uploadValues(ComputeArray& array, const std::vector<double>& values, int offset);
+    void computeParameterInvariants();
+    ComputeContext& cc;
+    CommonScratchPool* scratch;
+    int numArgs, numTerms;
+    bool deterministic;
+    std::vector<std::string> overallNames;
+    std::vector<double> overallValues, hostValues, sums;
+    std::vector<float> floatBuffer;
+    std::vector<long long> fixedSums;
+    std::vector<Lepton::CompiledExpression> invariantExpressions;
+    ComputeArray termParams, overall;
+    ComputeKernel kernel;
 };
 
 } // namespace OpenMMLab
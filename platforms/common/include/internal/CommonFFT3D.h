@@ -0,0 +1,102 @@
+#ifndef __OPENMM_COMMONFFT3D_H__
+#define __OPENMM_COMMONFFT3D_H__
+
+/* -------------------------------------------------------------------------- *
+ *                             OpenMM Laboratory                              *
+ *                             =================                              *
+ *                                                                            *
+ * A plugin for testing low-level code implementation for OpenMM.             *
+ *                                                                            *
+ * Copyright (c) 2023 Charlles Abreu                                          *
+ * https://github.com/craabreu/openmm-lab                                     *
+ * -------------------------------------------------------------------------- */
+
+namespace OpenMMLab {
+
+/**
+ * This is the interface shared by all the classes that perform three dimensional Fast
+ * Fourier Transforms on a GPU, whatever the platform and the library they are based on.
+ * Every backend is created for fixed dimensions, batch size and kind of transform, and
+ * for a fixed pair of input and output arrays, so code using this interface only needs
+ * to request forward and inverse transforms.
+ *
+ * Note that the transforms are unnormalized.  That means that if you perform a forward
+ * transform followed immediately by an inverse transform, the effect is to multiply every
+ * value of the original data set by the total number of data points.
+ */
+
+class CommonFFT3D {
+public:
+    /**
+     * Create a CommonFFT3D object.
+     *
+     * @param realToComplex    true if a real-to-complex transform is done, false if it is complex-to-complex
+     * @param doublePrecision  true if the transform is done in double precision
+     */
+    CommonFFT3D(bool realToComplex, bool doublePrecision) : realToComplex(realToComplex), doublePrecision(doublePrecision) {
+    }
+    virtual ~CommonFFT3D() {
+    }
+    /**
+     * Perform a Fourier transform on the current stream or queue of the context.
+     *
+     * @param forward  true to perform a forward transform, false to perform an inverse transform
+     */
+    virtual void execFFT(bool forward) = 0;
+    /**
+     * Get whether this object can apply a convolution between the forward and inverse
+     * transforms in a single call to execConvolution().
+     */
+    virtual bool hasConvolution() const {
+        return false;
+    }
+    /**
+     * Perform a forward transform of the input array, multiply every batch of the result by
+     * the convolution kernel, and perform the inverse transform back into the input array.
+     * This is only available if hasConvolution() returns true.
+     */
+    virtual void execConvolution() {
+    }
+    /**
+     * Get whether this object performs real-to-complex transforms.
+     */
+    bool getRealToComplex() const {
+        return realToComplex;
+    }
+    /**
+     * Get whether this object performs transforms in double precision.
+     */
+    bool getDoublePrecision() const {
+        return doublePrecision;
+    }
+    /**
+     * Get the smallest legal size for a dimension of the grid (that is, a size with no prime
+     * factors other than 2, 3, 5, ..., maxPrimeFactor).
+     *
+     * @param minimum   the minimum size the return value must be greater than or equal to
+     * @param maxPrimeFactor  the maximum supported prime number factor (default=13)
+     */
+    static int findLegalDimension(int minimum, int maxPrimeFactor=13) {
+        if (minimum < 1)
+            return 1;
+        while (true) {
+            // Attempt to factor the current value.
+
+            int unfactored = minimum;
+            for (int factor = 2; factor <= maxPrimeFactor; factor++) {
+                while (unfactored > 1 && unfactored%factor == 0)
+                    unfactored /= factor;
+            }
+            if (unfactored == 1)
+                return minimum;
+            minimum++;
+        }
+    }
+protected:
+    bool realToComplex;
+    bool doublePrecision;
+};
+
+} // namespace OpenMMLab
+
+#endif // __OPENMM_COMMONFFT3D_H__
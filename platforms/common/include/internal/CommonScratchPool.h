@@ -0,0 +1,73 @@
+#ifndef __OPENMM_COMMONSCRATCHPOOL_H__
+#define __OPENMM_COMMONSCRATCHPOOL_H__
+
+/* -------------------------------------------------------------------------- *
+ *                             OpenMM Laboratory                              *
+ *                             =================                              *
+ *                                                                            *
+ * A plugin for testing low-level code implementation for OpenMM.             *
+ *                                                                            *
+ * Copyright (c) 2023 Charlles Abreu                                          *
+ * https://github.com/craabreu/openmm-lab                                     *
+ * -------------------------------------------------------------------------- */
+
+#include "openmm/common/ComputeArray.h"
+#include "openmm/common/ComputeContext.h"
+#include <map>
+#include <mutex>
+#include <string>
+#include <utility>
+
+namespace OpenMMLab {
+
+/**
+ * This class holds device arrays whose contents are only needed during a single call of a
+ * kernel, such as the partial sums that a reduction writes and the host reads back right
+ * away.  All the OpenMMLab kernels of a ComputeContext share one pool, so that each kind of
+ * scratch array is allocated once, with the largest size any of them needs, instead of once
+ * per kernel.
+ *
+ * An array grows when a larger size is requested, which reallocates it.  Kernels must
+ * therefore request their arrays and set them as arguments right before every execution,
+ * and must not expect their contents to survive until the next call.
+ */
+
+class CommonScratchPool {
+public:
+    /**
+     * Get the pool of a ComputeContext, creating it if needed.  Every call must be matched
+     * by a call to release().
+     */
+    static CommonScratchPool* acquire(OpenMM::ComputeContext& cc);
+    /**
+     * Release a pool obtained from acquire().  The pool and its arrays are deleted when
+     * no kernel uses them anymore.
+     */
+    static void release(CommonScratchPool* pool);
+    /**
+     * Get a scratch array with at least a given number of elements.  Requests with the same
+     * name and element size share the same array.
+     *
+     * @param name           the name of the kind of array
+     * @param size           the minimum number of elements
+     * @param elementSize    the size of each element in bytes
+     */
+    OpenMM::ComputeArray& getArray(const std::string& name, int size, int elementSize);
+    /**
+     * Get the total size in bytes of the arrays in the pool.
+     */
+    long long getNumBytes() const;
+private:
+    CommonScratchPool(OpenMM::ComputeContext& cc) : cc(cc), references(0) {
+    }
+    ~CommonScratchPool();
+    OpenMM::ComputeContext& cc;
+    int references;
+    std::map<std::pair<std::string, int>, OpenMM::ComputeArray*> arrays;
+    static std::map<OpenMM::ComputeContext*, CommonScratchPool*> pools;
+    static std::mutex poolsMutex;
+};
+
+} // namespace OpenMMLab
+
+#endif // __OPENMM_COMMONSCRATCHPOOL_H__
@@ -10,7 +10,13 @@
 
 #include "CommonOpenMMLabKernels.h"
 #include "CommonOpenMMLabKernelSources.h"
+#include "internal/CommonScratchPool.h"
+#include "internal/CustomSummationImpl.h"
+#include "internal/ExtendedCustomCVForceImpl.h"
+#include "internal/TracingRange.h"
 #include "openmm/common/ContextSelector.h"
+#include "openmm/common/ExpressionUtilities.h"
+#include "openmm/OpenMMException.h"
 #include "openmm/internal/ContextImpl.h"
 #include "lepton/CustomFunction.h"
 #include "lepton/ExpressionTreeNode.h"
@@ -18,6 +24,31 @@
 #include "lepton/Parser.h"
 #include "lepton/ParsedExpression.h"
 #include "openmm/reference/ReferenceTabulatedFunction.h"
+#include "openmm/CMAPTorsionForce.h"
+#include "openmm/CustomAngleForce.h"
+#include "openmm/CustomBondForce.h"
+#include "openmm/CustomCentroidBondForce.h"
+#include "openmm/CustomCompoundBondForce.h"
+#include "openmm/CustomCVForce.h"
+#include "openmm/CustomExternalForce.h"
+#include "openmm/CustomGBForce.h"
+#include "openmm/CustomHbondForce.h"
+#include "openmm/CustomManyParticleForce.h"
+#include "openmm/CustomNonbondedForce.h"
+#include "openmm/CustomTorsionForce.h"
+#include "openmm/GBSAOBCForce.h"
+#include "openmm/GayBerneForce.h"
+#include "openmm/HarmonicAngleForce.h"
+#include "openmm/HarmonicBondForce.h"
+#include "openmm/NonbondedForce.h"
+#include "openmm/PeriodicTorsionForce.h"
+#include "openmm/RBTorsionForce.h"
+#include "openmm/RMSDForce.h"
+#include <algorithm>
+#include <cmath>
+#include <iterator>
+#include <set>
+#include <typeindex>
 
 using namespace OpenMMLab;
 using namespace OpenMM;
@@ -27,7 +58,7 @@ using namespace std;
 
 class CommonCalcExtendedCustomCVForceKernel::ForceInfo : public ComputeForceInfo {
 public:
-    ForceInfo(ComputeForceInfo& force) : force(force) {
+    ForceInfo(ComputeForceInfo& force, int numAtoms) : force(force), numAtoms(numAtoms) {
     }
     bool areParticlesIdentical(int particle1, int particle2) {
         return force.areParticlesIdentical(particle1, particle2);
@@ -36,29 +67,51 @@ public:
         return force.getNumParticleGroups();
     }
     void getParticlesInGroup(int index, std::vector<int>& particles) {
+        // The dummy particles of the batches of CVs do not exist in this context.
+
         force.getParticlesInGroup(index, particles);
+        particles.erase(remove_if(particles.begin(), particles.end(), [this] (int particle) { return particle >= numAtoms; }), particles.end());
     }
     bool areGroupsIdentical(int group1, int group2) {
         return force.areGroupsIdentical(group1, group2);
     }
 private:
     ComputeForceInfo& force;
+    int numAtoms;
+};
+
+/**
+ * Evaluate the CVs after the outer context has queued its bonded and nonbonded interactions,
+ * which it does once every ForceImpl has been called, just before the post-computations.
+ */
+class CommonCalcExtendedCustomCVForceKernel::DeferredEvaluation : public ComputeContext::ForcePostComputation {
+public:
+    DeferredEvaluation(CommonCalcExtendedCustomCVForceKernel& owner, int forceGroup) : owner(owner), forceGroup(forceGroup) {
+    }
+    double computeForceAndEnergy(bool includeForces, bool includeEnergy, int groups) {
+        if ((groups&(1<<forceGroup)) == 0)
+            return 0.0;
+        return owner.finishDeferredEvaluation();
+    }
+private:
+    CommonCalcExtendedCustomCVForceKernel& owner;
+    int forceGroup;
 };
 
 class CommonCalcExtendedCustomCVForceKernel::ReorderListener : public ComputeContext::ReorderListener {
 public:
-    ReorderListener(ComputeContext& cc, ArrayInterface& invAtomOrder) : cc(cc), invAtomOrder(invAtomOrder) {
+    ReorderListener(CommonCalcExtendedCustomCVForceKernel& owner, ComputeContext& cc2, bool isOuter) : owner(owner), cc2(cc2),
+            isOuter(isOuter) {
     }
     void execute() {
-        vector<int> invOrder(cc.getPaddedNumAtoms());
-        const vector<int>& order = cc.getAtomIndex();
-        for (int i = 0; i < order.size(); i++)
-            invOrder[order[i]] = i;
-        invAtomOrder.upload(invOrder);
+        owner.updateAtomMaps(cc2);
+        if (isOuter)
+            owner.numReorders++;
     }
 private:
-    ComputeContext& cc;
-    ArrayInterface& invAtomOrder;
+    CommonCalcExtendedCustomCVForceKernel& owner;
+    ComputeContext& cc2;
+    bool isOuter;
 };
 
 // This class allows us to update tabulated functions without having to recompile expressions
@@ -85,18 +138,239 @@ private:
     int index;
 };
 
-void CommonCalcExtendedCustomCVForceKernel::initialize(const System& system, const ExtendedCustomCVForce& force, ContextImpl& innerContext) {
+/**
+ * Get the sizes, values, and ranges of a tabulated function, which tell whether it has been
+ * modified since its reference implementation was created.  Functions of unknown types get a
+ * NaN, which never compares equal, so that they are always recreated.
+ */
+static vector<double> getTabulatedFunctionData(const TabulatedFunction& function) {
+    vector<double> data, values;
+    int xsize, ysize, zsize;
+    double xmin, xmax, ymin, ymax, zmin, zmax;
+    if (dynamic_cast<const Continuous1DFunction*>(&function) != NULL) {
+        dynamic_cast<const Continuous1DFunction&>(function).getFunctionParameters(values, xmin, xmax);
+        data = {1, xmin, xmax};
+    }
+    else if (dynamic_cast<const Continuous2DFunction*>(&function) != NULL) {
+        dynamic_cast<const Continuous2DFunction&>(function).getFunctionParameters(xsize, ysize, values, xmin, xmax, ymin, ymax);
+        data = {2, (double) xsize, (double) ysize, xmin, xmax, ymin, ymax};
+    }
+    else if (dynamic_cast<const Continuous3DFunction*>(&function) != NULL) {
+        dynamic_cast<const Continuous3DFunction&>(function).getFunctionParameters(xsize, ysize, zsize, values, xmin, xmax, ymin, ymax, zmin, zmax);
+        data = {3, (double) xsize, (double) ysize, (double) zsize, xmin, xmax, ymin, ymax, zmin, zmax};
+    }
+    else if (dynamic_cast<const Discrete1DFunction*>(&function) != NULL) {
+        dynamic_cast<const Discrete1DFunction&>(function).getFunctionParameters(values);
+        data = {4};
+    }
+    else if (dynamic_cast<const Discrete2DFunction*>(&function) != NULL) {
+        dynamic_cast<const Discrete2DFunction&>(function).getFunctionParameters(xsize, ysize, values);
+        data = {5, (double) xsize, (double) ysize};
+    }
+    else if (dynamic_cast<const Discrete3DFunction*>(&function) != NULL) {
+        dynamic_cast<const Discrete3DFunction&>(function).getFunctionParameters(xsize, ysize, zsize, values);
+        data = {6, (double) xsize, (double) ysize, (double) zsize};
+    }
+    else
+        data = {NAN};
+    data.insert(data.end(), values.begin(), values.end());
+    return data;
+}
+
+static const int RBF_WORK_GROUP_SIZE = 128;
+
+/**
+ * Get whether a Force may read the velocities of the particles.  None of the Forces of OpenMM
+ * does, nor do those of this plugin, except through the Forces they contain.  Any other type
+ * is assumed to.
+ */
+static bool mayReadVelocities(const Force& force) {
+    static const set<type_index> types = {
+        type_index(typeid(CMAPTorsionForce)), type_index(typeid(CustomAngleForce)), type_index(typeid(CustomBondForce)),
+        type_index(typeid(CustomCentroidBondForce)), type_index(typeid(CustomCompoundBondForce)), type_index(typeid(CustomExternalForce)),
+        type_index(typeid(CustomGBForce)), type_index(typeid(CustomHbondForce)), type_index(typeid(CustomManyParticleForce)),
+        type_index(typeid(CustomNonbondedForce)), type_index(typeid(CustomTorsionForce)), type_index(typeid(GBSAOBCForce)),
+        type_index(typeid(GayBerneForce)), type_index(typeid(HarmonicAngleForce)), type_index(typeid(HarmonicBondForce)),
+        type_index(typeid(NonbondedForce)), type_index(typeid(PeriodicTorsionForce)), type_index(typeid(RBTorsionForce)),
+        type_index(typeid(RMSDForce)), type_index(typeid(SlicedNonbondedForce))
+    };
+    if (const CustomCVForce* f = dynamic_cast<const CustomCVForce*>(&force)) {
+        for (int i = 0; i < f->getNumCollectiveVariables(); i++)
+            if (mayReadVelocities(f->getCollectiveVariable(i)))
+                return true;
+        return false;
+    }
+    if (const ExtendedCustomCVForce* f = dynamic_cast<const ExtendedCustomCVForce*>(&force)) {
+        for (int i = 0; i < f->getNumCollectiveVariables(); i++)
+            if (mayReadVelocities(f->getCollectiveVariable(i)))
+                return true;
+        for (int i = 0; i < f->getNumCollectiveVariableBatches(); i++)
+            if (mayReadVelocities(f->getCollectiveVariableBatch(i)))
+                return true;
+        return false;
+    }
+    return (types.find(type_index(typeid(force))) == types.end());
+}
+
+/**
+ * Find the particles on which a Force can exert forces, when they are determined by its particle
+ * lists.  Returns false if the Force may act on any particle of the system.
+ */
+static bool findForceFootprint(const Force& force, set<int>& particles) {
+    vector<int> list;
+    double p1, p2;
+    int i1, i2, i3, i4, n;
+    vector<double> params;
+    if (const CustomBondForce* f = dynamic_cast<const CustomBondForce*>(&force)) {
+        for (int i = 0; i < f->getNumBonds(); i++) {
+            f->getBondParameters(i, i1, i2, params);
+            particles.insert(i1);
+            particles.insert(i2);
+        }
+    }
+    else if (const HarmonicBondForce* f = dynamic_cast<const HarmonicBondForce*>(&force)) {
+        for (int i = 0; i < f->getNumBonds(); i++) {
+            f->getBondParameters(i, i1, i2, p1, p2);
+            particles.insert(i1);
+            particles.insert(i2);
+        }
+    }
+    else if (const CustomAngleForce* f = dynamic_cast<const CustomAngleForce*>(&force)) {
+        for (int i = 0; i < f->getNumAngles(); i++) {
+            f->getAngleParameters(i, i1, i2, i3, params);
+            particles.insert({i1, i2, i3});
+        }
+    }
+    else if (const HarmonicAngleForce* f = dynamic_cast<const HarmonicAngleForce*>(&force)) {
+        for (int i = 0; i < f->getNumAngles(); i++) {
+            f->getAngleParameters(i, i1, i2, i3, p1, p2);
+            particles.insert({i1, i2, i3});
+        }
+    }
+    else if (const CustomTorsionForce* f = dynamic_cast<const CustomTorsionForce*>(&force)) {
+        for (int i = 0; i < f->getNumTorsions(); i++) {
+            f->getTorsionParameters(i, i1, i2, i3, i4, params);
+            particles.insert({i1, i2, i3, i4});
+        }
+    }
+    else if (const PeriodicTorsionForce* f = dynamic_cast<const PeriodicTorsionForce*>(&force)) {
+        for (int i = 0; i < f->getNumTorsions(); i++) {
+            f->getTorsionParameters(i, i1, i2, i3, i4, n, p1, p2);
+            particles.insert({i1, i2, i3, i4});
+        }
+    }
+    else if (const CustomExternalForce* f = dynamic_cast<const CustomExternalForce*>(&force)) {
+        for (int i = 0; i < f->getNumParticles(); i++) {
+            f->getParticleParameters(i, i1, params);
+            particles.insert(i1);
+        }
+    }
+    else if (const CustomCompoundBondForce* f = dynamic_cast<const CustomCompoundBondForce*>(&force)) {
+        for (int i = 0; i < f->getNumBonds(); i++) {
+            f->getBondParameters(i, list, params);
+            particles.insert(list.begin(), list.end());
+        }
+    }
+    else if (const CustomCentroidBondForce* f = dynamic_cast<const CustomCentroidBondForce*>(&force)) {
+        vector<double> weights;
+        for (int i = 0; i < f->getNumGroups(); i++) {
+            f->getGroupParameters(i, list, weights);
+            particles.insert(list.begin(), list.end());
+        }
+    }
+    else if (const RMSDForce* f = dynamic_cast<const RMSDForce*>(&force)) {
+        if (f->getParticles().size() == 0)
+            return false;
+        particles.insert(f->getParticles().begin(), f->getParticles().end());
+    }
+    else
+        return false;
+    return true;
+}
+
+/**
+ * Replace the shared particles in the footprint of a Force, which come after the particles of
+ * the System, by the particles they depend on, to which their forces are distributed.
+ */
+static void expandSharedParticles(const ExtendedCustomCVForce& force, int numParticles, set<int>& particles) {
+    while (!particles.empty() && *particles.rbegin() >= numParticles) {
+        const VirtualSite& site = force.getSharedParticle(*particles.rbegin()-numParticles);
+        particles.erase(prev(particles.end()));
+        for (int i = 0; i < site.getNumParticles(); i++)
+            particles.insert(site.getParticle(i));
+    }
+}
+
+template <class T>
+static void sumPartialSums(ComputeArray& partialSums, int numGroups, vector<T>& data, vector<double>& sums) {
+    partialSums.download(data);
+    int width = sums.size();
+    for (int j = 0; j < width; j++)
+        sums[j] = 0.0;
+    for (int i = 0; i < numGroups; i++)
+        for (int j = 0; j < width; j++)
+            sums[j] += data[i*width+j];
+}
+
+void CommonCalcExtendedCustomCVForceKernel::initialize(const System& system, const ExtendedCustomCVForce& force, ContextImpl& innerContext,
+                                                       PlacedCollectiveVariables& placed) {
     ContextSelector selector(cc);
     int numCVs = force.getNumCollectiveVariables();
+    scratch = CommonScratchPool::acquire(cc);
+    this->placed = &placed;
+    cvPlaced.resize(numCVs, false);
+    for (int i : placed.indices)
+        cvPlaced[i] = true;
     for (int i = 0; i < force.getNumGlobalParameters(); i++)
         globalParameterNames.push_back(force.getGlobalParameterName(i));
     for (int i = 0; i < numCVs; i++)
         variableNames.push_back(force.getCollectiveVariableName(i));
+
+    // The batches follow the other variables, both in the force groups of the inner context
+    // and in the list of variables.  Their dummy particles follow the particles of the System
+    // and the shared particles.
+
+    int origin = system.getNumParticles()+force.getNumSharedParticles();
+    for (int i = 0; i < force.getNumCollectiveVariableBatches(); i++) {
+        const vector<string>& names = force.getCollectiveVariableBatchNames(i);
+        batchGroups.push_back(numCVs+i);
+        batchOrigins.push_back(origin);
+        batchFirstVariables.push_back(variableNames.size());
+        batchSizes.push_back(names.size());
+        variableNames.insert(variableNames.end(), names.begin(), names.end());
+        origin += names.size()+1;
+    }
+    int numVariables = variableNames.size();
+    int numBatchVariables = numVariables-numCVs;
+    batchDerivs.resize(batchGroups.size());
     for (int i = 0; i < force.getNumEnergyParameterDerivatives(); i++) {
         string name = force.getEnergyParameterDerivativeName(i);
         paramDerivNames.push_back(name);
+        derivNames.push_back(name);
         cc.addEnergyParameterDerivative(name);
     }
+    int numRBFs = force.getNumRadialBasisFunctions();
+    rbfVariables.resize(numRBFs);
+    for (int i = 0; i < numRBFs; i++) {
+        string name;
+        ExtendedCustomCVForce::RadialBasisFunctionType type;
+        double shapeParameter;
+        vector<string> variables;
+        vector<double> centers, weights;
+        force.getRadialBasisFunctionParameters(i, name, type, shapeParameter, variables, centers, weights);
+        rbfNames.push_back(name);
+        for (auto& variable : variables)
+            rbfVariables[i].push_back(find(variableNames.begin(), variableNames.end(), variable)-variableNames.begin());
+    }
+    int numSummations = force.getNumCustomSummations();
+    summationVariables.resize(numSummations);
+    summationGradients.resize(numSummations);
+    for (int i = 0; i < numSummations; i++) {
+        summationNames.push_back(force.getCustomSummationName(i));
+        for (auto& variable : force.getCustomSummationVariables(i))
+            summationVariables[i].push_back(find(variableNames.begin(), variableNames.end(), variable)-variableNames.begin());
+        summationGradients[i].resize(summationVariables[i].size());
+    }
 
     // Create custom functions for the tabulated functions.
 
@@ -104,6 +378,7 @@ void CommonCalcExtendedCustomCVForceKernel::initialize(const System& system, con
     tabulatedFunctions.resize(force.getNumTabulatedFunctions(), NULL);
     for (int i = 0; i < force.getNumTabulatedFunctions(); i++) {
         tabulatedFunctions[i] = createReferenceTabulatedFunction(force.getTabulatedFunction(i));
+        tabulatedFunctionData.push_back(getTabulatedFunctionData(force.getTabulatedFunction(i)));
         functions[force.getTabulatedFunctionName(i)] = new TabulatedFunctionWrapper(tabulatedFunctions, i);
     }
 
@@ -117,18 +392,44 @@ void CommonCalcExtendedCustomCVForceKernel::initialize(const System& system, con
     paramDerivExpressions.clear();
     for (auto& name : paramDerivNames)
         paramDerivExpressions.push_back(energyExpr.differentiate(name).createCompiledExpression());
+    rbfDerivExpressions.clear();
+    for (auto& name : rbfNames)
+        rbfDerivExpressions.push_back(energyExpr.differentiate(name).createCompiledExpression());
+    summationDerivExpressions.clear();
+    for (auto& name : summationNames)
+        summationDerivExpressions.push_back(energyExpr.differentiate(name).createCompiledExpression());
     globalValues.resize(globalParameterNames.size());
-    cvValues.resize(numCVs);
+    cvValues.resize(numVariables);
+    rbfValues.resize(numRBFs);
+    summationValues.resize(numSummations);
     map<string, double*> variableLocations;
     for (int i = 0; i < globalParameterNames.size(); i++)
         variableLocations[globalParameterNames[i]] = &globalValues[i];
-    for (int i = 0; i < numCVs; i++)
+    for (int i = 0; i < numVariables; i++)
         variableLocations[variableNames[i]] = &cvValues[i];
+    for (int i = 0; i < numRBFs; i++)
+        variableLocations[rbfNames[i]] = &rbfValues[i];
+    for (int i = 0; i < numSummations; i++)
+        variableLocations[summationNames[i]] = &summationValues[i];
     energyExpression.setVariableLocations(variableLocations);
     for (CompiledExpression& expr : variableDerivExpressions)
         expr.setVariableLocations(variableLocations);
     for (CompiledExpression& expr : paramDerivExpressions)
         expr.setVariableLocations(variableLocations);
+    for (CompiledExpression& expr : rbfDerivExpressions)
+        expr.setVariableLocations(variableLocations);
+    for (CompiledExpression& expr : summationDerivExpressions)
+        expr.setVariableLocations(variableLocations);
+    depositionIntervals.resize(numSummations);
+    depositionExpressions.resize(numSummations);
+    for (int i = 0; i < numSummations; i++) {
+        depositionIntervals[i] = force.getCustomSummationDepositionInterval(i);
+        depositionExpressions[i] = ExtendedCustomCVForceImpl::createDepositionExpressions(force, i, functions, variableLocations);
+    }
+    summationTerms.resize(numSummations);
+    numOwnTerms.resize(numSummations, 0);
+    lastDepositionStep = 0;
+    history.resize(force.getCollectiveVariableHistorySize(), numVariables);
 
     // Delete the custom functions.
 
@@ -143,141 +444,1126 @@ void CommonCalcExtendedCustomCVForceKernel::initialize(const System& system, con
 
     // Create arrays for storing information.
 
-    cvForces.resize(numCVs);
+    // CVs whose Forces act on a small set of atoms keep compact force arrays, while the others
+    // keep full slices of a strided buffer.  The forces of the CVs placed on other platforms are
+    // uploaded from the host, so they always keep compact arrays, which come last so that a
+    // single upload fills them.
+
+    vector<int> denseIndices, sparseAtomList, sparseCVList;
+    cvDenseSlot.resize(numCVs);
+    cvSparseStart.resize(numCVs);
+    cvSparseEnd.resize(numCVs);
+    for (int i = 0; i < numCVs; i++) {
+        if (cvPlaced[i])
+            continue;
+        set<int> footprint;
+        cvSparseStart[i] = cvSparseEnd[i] = sparseAtomList.size();
+        bool localized = findForceFootprint(force.getCollectiveVariable(i), footprint);
+        expandSharedParticles(force, system.getNumParticles(), footprint);
+        if (localized && 4*(int) footprint.size() < system.getNumParticles()) {
+            cvDenseSlot[i] = -1;
+            for (int atom : footprint) {
+                sparseAtomList.push_back(atom);
+                sparseCVList.push_back(i);
+            }
+            cvSparseEnd[i] = sparseAtomList.size();
+        }
+        else {
+            cvDenseSlot[i] = denseIndices.size();
+            denseIndices.push_back(i);
+        }
+    }
+    placedSparseStart = sparseAtomList.size();
+    for (int i : placed.indices) {
+        set<int> footprint;
+        if (!findForceFootprint(force.getCollectiveVariable(i), footprint))
+            for (int j = 0; j < system.getNumParticles(); j++)
+                footprint.insert(j);
+        expandSharedParticles(force, system.getNumParticles(), footprint);
+        cvDenseSlot[i] = -1;
+        cvSparseStart[i] = sparseAtomList.size();
+        for (int atom : footprint) {
+            sparseAtomList.push_back(atom);
+            sparseCVList.push_back(i);
+        }
+        cvSparseEnd[i] = sparseAtomList.size();
+    }
+    sparseAtomsHost = sparseAtomList;
+    numDenseCVs = denseIndices.size();
+    numSparseEntries = sparseAtomList.size();
+
+    // Where the platform supports it, the CVs are evaluated on a side queue while the outer
+    // context computes its bonded and nonbonded interactions.  Only the final addition of their
+    // forces waits for both.  The batches and the parameter derivatives need the outer queue
+    // between inner passes, so they keep the evaluation inside execute().
+
+    deferEvaluation = (force.getNumCollectiveVariableBatches() == 0 && paramDerivNames.empty() &&
+                       cc2.getEnergyParamDerivNames().empty() && createSideQueue(cc, cc2));
+    if (deferEvaluation)
+        cc.addPostComputation(new DeferredEvaluation(*this, force.getForceGroup()));
+    if (force.getUseCompressedForces())
+        cvForces.initialize<float>(cc, max(numDenseCVs, 1)*3*cc.getPaddedNumAtoms(), "cvForces");
+    else
+        cvForces.initialize<long long>(cc, max(numDenseCVs, 1)*3*cc.getPaddedNumAtoms(), "cvForces");
+    denseCVs.initialize<int>(cc, max(numDenseCVs, 1), "denseCVs");
+    sparseForces.initialize<long long>(cc, 3*max(numSparseEntries, 1), "sparseForces");
+    sparseAtoms.initialize<int>(cc, max(numSparseEntries, 1), "sparseAtoms");
+    sparseCVs.initialize<int>(cc, max(numSparseEntries, 1), "sparseCVs");
+    if (numDenseCVs > 0)
+        denseCVs.upload(denseIndices);
+    if (numSparseEntries > 0) {
+        sparseAtoms.upload(sparseAtomList);
+        sparseCVs.upload(sparseCVList);
+    }
+    int elementSize = (cc.getUseDoublePrecision() ? sizeof(double) : sizeof(float));
+    dEdVArray.initialize(cc, max(numVariables, 1), elementSize, "dEdV");
+    cvIntervals.resize(numCVs);
     for (int i = 0; i < numCVs; i++)
-        cvForces[i].initialize<long long>(cc, 3*cc.getPaddedNumAtoms(), "cvForce");
+        cvIntervals[i] = force.getCollectiveVariableInterval(i);
+    cvSteps.resize(numCVs);
+    cvReorders.resize(numCVs);
+    cvHasValue.resize(numCVs, false);
+    cvHasForces.resize(numCVs, false);
+    cvDerivs.resize(numCVs);
+    derivativesOnDemand = force.getUseDerivativesOnDemand();
+    hasSharedParticles = (force.getNumSharedParticles() > 0);
+    cvEvaluate.resize(numCVs);
+    dEdV.resize(numVariables);
+    dEdVFloat.resize(numVariables);
     invAtomOrder.initialize<int>(cc, cc.getPaddedNumAtoms(), "invAtomOrder");
-    innerInvAtomOrder.initialize<int>(cc, cc.getPaddedNumAtoms(), "innerInvAtomOrder");
+    innerInvAtomOrder.initialize<int>(cc, cc2.getPaddedNumAtoms(), "innerInvAtomOrder");
+    innerIndex.initialize<int>(cc, cc.getPaddedNumAtoms(), "innerIndex");
+    batchForces.initialize<long long>(cc, max(numBatchVariables, 1), "batchForces");
+    batchForcesHost.resize(numBatchVariables);
 
     // Create the kernels.
 
-    stringstream args, add;
-    for (int i = 0; i < numCVs; i++) {
-        args << ", GLOBAL mm_long * RESTRICT force" << i << ", real dEdV" << i;
-        add << "forces[i] += (mm_long) (force" << i << "[i]*dEdV" << i << ");\n";
-    }
-    map<string, string> replacements;
-    replacements["PARAMETER_ARGUMENTS"] = args.str();
-    replacements["ADD_FORCES"] = add.str();
-    ComputeProgram program = cc.compileProgram(cc.replaceStrings(CommonOpenMMLabKernelSources::customCVForce, replacements));
+    // Velocities are only copied if some inner Force may read them, which saves most of the
+    // bandwidth of copyState() for large systems.  The batches use only OpenMM Forces.
+
+    copyVelocities = false;
+    for (int i = 0; i < numCVs; i++)
+        copyVelocities = copyVelocities || (!cvPlaced[i] && mayReadVelocities(force.getCollectiveVariable(i)));
+    map<string, string> defines;
+    if (copyVelocities)
+        defines["COPY_VELOCITIES"] = "1";
+    if (force.getUseCompressedForces())
+        defines["COMPRESSED_FORCES"] = "1";
+    ComputeProgram program = compileProgram(cc, CommonOpenMMLabKernelSources::customCVForce, defines);
     copyStateKernel = program->createKernel("copyState");
+    copyStateKernel->addArg();
     copyStateKernel->addArg(cc.getPosq());
     copyStateKernel->addArg(cc2.getPosq());
     if (cc.getUseMixedPrecision()) {
         copyStateKernel->addArg(cc.getPosqCorrection());
         copyStateKernel->addArg(cc2.getPosqCorrection());
     }
-    copyStateKernel->addArg(cc.getVelm());
-    copyStateKernel->addArg(cc2.getVelm());
-    copyStateKernel->addArg(cc.getAtomIndexArray());
-    copyStateKernel->addArg(innerInvAtomOrder);
+    if (copyVelocities) {
+        copyStateKernel->addArg(cc.getVelm());
+        copyStateKernel->addArg(cc2.getVelm());
+    }
+    copyStateKernel->addArg(innerIndex);
     copyStateKernel->addArg(cc.getNumAtoms());
     copyForcesKernel = program->createKernel("copyForces");
     copyForcesKernel->addArg();
-    copyForcesKernel->addArg(invAtomOrder);
+    copyForcesKernel->addArg(cvForces);
+    copyForcesKernel->addArg();
     copyForcesKernel->addArg(cc2.getLongForceBuffer());
-    copyForcesKernel->addArg(cc2.getAtomIndexArray());
+    copyForcesKernel->addArg(innerIndex);
     copyForcesKernel->addArg(cc.getNumAtoms());
     copyForcesKernel->addArg(cc.getPaddedNumAtoms());
+    copyForcesKernel->addArg(cc2.getPaddedNumAtoms());
     addForcesKernel = program->createKernel("addForces");
     addForcesKernel->addArg(cc.getLongForceBuffer());
+    addForcesKernel->addArg(cvForces);
+    addForcesKernel->addArg(dEdVArray);
+    addForcesKernel->addArg(denseCVs);
     addForcesKernel->addArg((int) cc.getLongForceBuffer().getSize());
-    for (int i = 0; i < numCVs; i++) {
-        addForcesKernel->addArg();
-        addForcesKernel->addArg();
+    addForcesKernel->addArg(numDenseCVs);
+    copySparseForcesKernel = program->createKernel("copySparseForces");
+    copySparseForcesKernel->addArg(sparseForces);
+    copySparseForcesKernel->addArg(sparseAtoms);
+    copySparseForcesKernel->addArg();
+    copySparseForcesKernel->addArg();
+    copySparseForcesKernel->addArg(cc2.getLongForceBuffer());
+    copySparseForcesKernel->addArg(innerInvAtomOrder);
+    copySparseForcesKernel->addArg(cc2.getPaddedNumAtoms());
+    addSparseForcesKernel = program->createKernel("addSparseForces");
+    addSparseForcesKernel->addArg(cc.getLongForceBuffer());
+    addSparseForcesKernel->addArg(sparseForces);
+    addSparseForcesKernel->addArg(sparseAtoms);
+    addSparseForcesKernel->addArg(sparseCVs);
+    addSparseForcesKernel->addArg(dEdVArray);
+    addSparseForcesKernel->addArg(invAtomOrder);
+    addSparseForcesKernel->addArg(numSparseEntries);
+    addSparseForcesKernel->addArg(cc.getPaddedNumAtoms());
+    setBatchDisplacementsKernel = program->createKernel("setBatchDisplacements");
+    for (int i = 0; i < 4; i++)
+        setBatchDisplacementsKernel->addArg();
+    setBatchDisplacementsKernel->addArg(cc2.getPosq());
+    if (cc.getUseMixedPrecision())
+        setBatchDisplacementsKernel->addArg(cc2.getPosqCorrection());
+    setBatchDisplacementsKernel->addArg(innerInvAtomOrder);
+    setBatchDisplacementsKernel->addArg(dEdVArray);
+    copyBatchForcesKernel = program->createKernel("copyBatchForces");
+    for (int i = 0; i < 3; i++)
+        copyBatchForcesKernel->addArg();
+    copyBatchForcesKernel->addArg(batchForces);
+    copyBatchForcesKernel->addArg(cc2.getLongForceBuffer());
+    copyBatchForcesKernel->addArg(innerInvAtomOrder);
+    addBatchForcesKernel = program->createKernel("addBatchForces");
+    addBatchForcesKernel->addArg();
+    addBatchForcesKernel->addArg(cc.getLongForceBuffer());
+    addBatchForcesKernel->addArg(cc2.getLongForceBuffer());
+    addBatchForcesKernel->addArg(innerIndex);
+    addBatchForcesKernel->addArg(cc.getNumAtoms());
+    addBatchForcesKernel->addArg(cc.getPaddedNumAtoms());
+    addBatchForcesKernel->addArg(cc2.getPaddedNumAtoms());
+
+    // Create the kernels and arrays for the radial basis function expansions.
+
+    rbfCenters.resize(numRBFs);
+    rbfWeights.resize(numRBFs);
+    rbfNumCenters.resize(numRBFs, 0);
+    rbfTypes.resize(numRBFs);
+    rbfShapeParameters.resize(numRBFs);
+    rbfGradients.resize(numRBFs);
+    int mixedSize = (cc.getUseDoublePrecision() || cc.getUseMixedPrecision() ? sizeof(double) : sizeof(float));
+    for (int i = 0; i < numRBFs; i++) {
+        int dimension = rbfVariables[i].size();
+        stringstream pointArgs, loadPoint;
+        for (int j = 0; j < dimension; j++) {
+            pointArgs << ", real p" << j;
+            loadPoint << "point[" << j << "] = p" << j << ";\n";
+        }
+        map<string, string> rbfReplacements, defines;
+        rbfReplacements["POINT_ARGUMENTS"] = pointArgs.str();
+        rbfReplacements["LOAD_POINT"] = loadPoint.str();
+        defines["DIMENSION"] = cc.intToString(dimension);
+        defines["WORK_GROUP_SIZE"] = cc.intToString(RBF_WORK_GROUP_SIZE);
+        ComputeProgram rbfProgram = compileProgram(cc, cc.replaceStrings(CommonOpenMMLabKernelSources::radialBasisFunction, rbfReplacements), defines);
+        rbfKernels.push_back(rbfProgram->createKernel("evaluateRadialBasisFunction"));
+        scratch->getArray("rbfPartialSums", cc.getNumThreadBlocks()*(dimension+1), mixedSize);
+    }
+    uploadRadialBasisFunctions(force);
+
+    // The custom summations are evaluated by kernels that run in this context, rather than
+    // in the contexts of their own backends.
+
+    for (int i = 0; i < numSummations; i++) {
+        const CustomSummation& summation = force.getCustomSummation(i);
+        summationKernels.push_back(Kernel(new CommonCalcCustomSummationKernel(CalcCustomSummationKernel::Name(), getPlatform(), cc)));
+        summationKernels[i].getAs<CalcCustomSummationKernel>().initialize(summation.getNumArguments(),
+                CustomSummationImpl::parseExpression(summation.getExpression()), summation.getOverallParameters(), summation.getPerTermParameters(),
+                CustomSummationImpl::isDeterministic(summation.getPlatformProperties()));
     }
+    uploadCustomSummations(force);
 
     // This context needs to respect all forces in the inner context when reordering atoms.
 
     for (auto* info : cc2.getForceInfos())
-        cc.addForce(new ForceInfo(*info));
+        cc.addForce(new ForceInfo(*info, system.getNumParticles()));
 }
 
 CommonCalcExtendedCustomCVForceKernel::~CommonCalcExtendedCustomCVForceKernel() {
+    if (scratch != NULL)
+        CommonScratchPool::release(scratch);
     for (int i = 0; i < tabulatedFunctions.size(); i++)
         if (tabulatedFunctions[i] != NULL)
             delete tabulatedFunctions[i];
 }
 
+void CommonCalcExtendedCustomCVForceKernel::uploadRadialBasisFunctions(const ExtendedCustomCVForce& force) {
+    ContextSelector selector(cc);
+    int elementSize = (cc.getUseDoublePrecision() ? sizeof(double) : sizeof(float));
+    for (int i = 0; i < rbfNames.size(); i++) {
+        string name;
+        ExtendedCustomCVForce::RadialBasisFunctionType type;
+        double shapeParameter;
+        vector<string> variables;
+        vector<double> centers, weights;
+        force.getRadialBasisFunctionParameters(i, name, type, shapeParameter, variables, centers, weights);
+        bool sameVariables = (name == rbfNames[i] && variables.size() == rbfVariables[i].size());
+        for (int j = 0; sameVariables && j < variables.size(); j++)
+            sameVariables = (variables[j] == variableNames[rbfVariables[i][j]]);
+        if (!sameVariables)
+            throw OpenMMException("updateParametersInContext: The name and variables of a radial basis function cannot be changed");
+        int numCenters = weights.size();
+        if (!rbfWeights[i].isInitialized() || numCenters > rbfWeights[i].getSize()) {
+            int capacity = max(numCenters, 1);
+            if (rbfWeights[i].isInitialized()) {
+                rbfCenters[i].resize(capacity*variables.size());
+                rbfWeights[i].resize(capacity);
+            }
+            else {
+                rbfCenters[i].initialize(cc, capacity*variables.size(), elementSize, "rbfCenters");
+                rbfWeights[i].initialize(cc, capacity, elementSize, "rbfWeights");
+            }
+        }
+        centers.resize(rbfCenters[i].getSize(), 0.0);
+        weights.resize(rbfWeights[i].getSize(), 0.0);
+        rbfCenters[i].upload(centers, true);
+        rbfWeights[i].upload(weights, true);
+        rbfNumCenters[i] = numCenters;
+        rbfTypes[i] = (int) type;
+        rbfShapeParameters[i] = shapeParameter;
+    }
+}
+
+void CommonCalcExtendedCustomCVForceKernel::uploadCustomSummations(const ExtendedCustomCVForce& force) {
+    // The deposited terms follow those of the summation, whose number may have changed.
+
+    for (int i = 0; i < summationKernels.size(); i++) {
+        const CustomSummation& summation = force.getCustomSummation(i);
+        vector<vector<double> >& parameters = summationTerms[i];
+        parameters.erase(parameters.begin(), parameters.begin()+numOwnTerms[i]);
+        numOwnTerms[i] = summation.getNumTerms();
+        parameters.insert(parameters.begin(), numOwnTerms[i], vector<double>());
+        set<int> terms;
+        for (int k = 0; k < parameters.size(); k++) {
+            if (k < numOwnTerms[i])
+                parameters[k] = summation.getTerm(k);
+            terms.insert(terms.end(), k);
+        }
+        CalcCustomSummationKernel& kernel = summationKernels[i].getAs<CalcCustomSummationKernel>();
+        kernel.setTerms(parameters, terms);
+        for (auto& parameter : summation.getOverallParameters())
+            kernel.setParameter(parameter.first, parameter.second);
+    }
+}
+
+void CommonCalcExtendedCustomCVForceKernel::depositSummationTerms(long long step) {
+    // The terms are computed from the values of the latest evaluation, and only the new ones
+    // are uploaded.  A step is only deposited once, however many times it is evaluated.
+
+    if (step <= 0 || step == lastDepositionStep)
+        return;
+    lastDepositionStep = step;
+    for (int i = 0; i < depositionIntervals.size(); i++) {
+        if (depositionIntervals[i] == 0 || step%depositionIntervals[i] != 0)
+            continue;
+        vector<double> term;
+        for (CompiledExpression& expr : depositionExpressions[i])
+            term.push_back(expr.evaluate());
+        counters.expressionEvaluations += term.size();
+        summationTerms[i].push_back(term);
+        set<int> modified = {(int) summationTerms[i].size()-1};
+        summationKernels[i].getAs<CalcCustomSummationKernel>().setTerms(summationTerms[i], modified);
+    }
+}
+
+void CommonCalcExtendedCustomCVForceKernel::getDepositedTerms(int index, vector<vector<double> >& terms) {
+    terms.assign(summationTerms[index].begin()+numOwnTerms[index], summationTerms[index].end());
+}
+
+double CommonCalcExtendedCustomCVForceKernel::evaluateRadialBasisFunction(int index, vector<double>& gradient) {
+    int dimension = rbfVariables[index].size();
+    int numGroups = min(cc.getNumThreadBlocks(), (rbfNumCenters[index]+RBF_WORK_GROUP_SIZE-1)/RBF_WORK_GROUP_SIZE);
+    vector<double>& sums = rbfSums;
+    sums.assign(dimension+1, 0.0);
+    if (numGroups > 0) {
+        double shape2 = rbfShapeParameters[index]*rbfShapeParameters[index];
+        int mixedSize = (cc.getUseDoublePrecision() || cc.getUseMixedPrecision() ? sizeof(double) : sizeof(float));
+        ComputeArray& partialSums = scratch->getArray("rbfPartialSums", cc.getNumThreadBlocks()*(dimension+1), mixedSize);
+        ComputeKernel& kernel = rbfKernels[index];
+        kernel->setArg(0, rbfCenters[index]);
+        kernel->setArg(1, rbfWeights[index]);
+        kernel->setArg(2, partialSums);
+        kernel->setArg(3, rbfNumCenters[index]);
+        kernel->setArg(4, rbfTypes[index]);
+        if (cc.getUseDoublePrecision()) {
+            kernel->setArg(5, shape2);
+            for (int j = 0; j < dimension; j++)
+                kernel->setArg(6+j, cvValues[rbfVariables[index][j]]);
+        }
+        else {
+            kernel->setArg(5, (float) shape2);
+            for (int j = 0; j < dimension; j++)
+                kernel->setArg(6+j, (float) cvValues[rbfVariables[index][j]]);
+        }
+        kernel->execute(numGroups*RBF_WORK_GROUP_SIZE, RBF_WORK_GROUP_SIZE);
+        counters.synchronizations++;
+        counters.bytesCopied += partialSums.getSize()*partialSums.getElementSize();
+        if (partialSums.getElementSize() == sizeof(double))
+            sumPartialSums<double>(partialSums, numGroups, rbfDoubleBuffer, sums);
+        else
+            sumPartialSums<float>(partialSums, numGroups, rbfFloatBuffer, sums);
+    }
+    gradient.assign(sums.begin()+1, sums.end());
+    return sums[0];
+}
+
 double CommonCalcExtendedCustomCVForceKernel::execute(ContextImpl& context, ContextImpl& innerContext, bool includeForces, bool includeEnergy) {
-    copyState(context, innerContext);
-    int numCVs = variableNames.size();
+    if (!deferEvaluation)
+        return evaluate(context, innerContext, includeForces, includeEnergy, true);
+
+    // Only mark the point of the outer queue after which the positions are valid.  The energy
+    // is returned by DeferredEvaluation.
+
+    ContextSelector selector(cc);
+    markOuterQueue(cc);
+    deferredContext = &context;
+    deferredInnerContext = &innerContext;
+    deferredIncludeForces = includeForces;
+    deferredIncludeEnergy = includeEnergy;
+    evaluationPending = true;
+    return 0.0;
+}
+
+double CommonCalcExtendedCustomCVForceKernel::finishDeferredEvaluation() {
+    if (!evaluationPending)
+        return 0.0;
+    evaluationPending = false;
+    ComputeContext& cc2 = getInnerComputeContext(*deferredInnerContext);
+    double energy;
+    {
+        ContextSelector selector(cc);
+        beginSideQueue(cc, cc2);
+        try {
+            energy = evaluate(*deferredContext, *deferredInnerContext, deferredIncludeForces, deferredIncludeEnergy, false);
+        }
+        catch (...) {
+            endSideQueue(cc, cc2);
+            throw;
+        }
+        endSideQueue(cc, cc2);
+    }
+    if (deferredIncludeForces && cvValues.size() > 0) {
+        beginStage("addForces");
+        addWeightedForces(true);
+        endStage();
+    }
+    return energy;
+}
+
+void CommonCalcExtendedCustomCVForceKernel::addWeightedForces(bool includeForces) {
+    ContextSelector selector(cc);
+    int numVariables = variableNames.size();
+    if (cc.getUseDoublePrecision())
+        dEdVArray.upload(dEdV);
+    else {
+        for (int i = 0; i < numVariables; i++)
+            dEdVFloat[i] = (float) dEdV[i];
+        dEdVArray.upload(dEdVFloat);
+    }
+    counters.synchronizations++;  // the upload is blocking
+    counters.bytesCopied += numVariables*dEdVArray.getElementSize();
+    if (includeForces && numDenseCVs > 0)
+        addForcesKernel->execute(cc.getNumAtoms());
+    if (includeForces && numSparseEntries > 0)
+        addSparseForcesKernel->execute(numSparseEntries);
+}
+
+double CommonCalcExtendedCustomCVForceKernel::evaluate(ContextImpl& context, ContextImpl& innerContext, bool includeForces, bool includeEnergy,
+                                                       bool addForces) {
+    OPENMMLAB_TRACE_RANGE("ExtendedCustomCVForce::execute");
+    counters.evaluations++;
+    int numCVs = cvIntervals.size();
+    int numVariables = variableNames.size();
+    int numBatches = batchGroups.size();
     int numAtoms = cc.getNumAtoms();
     int paddedNumAtoms = cc.getPaddedNumAtoms();
-    vector<map<string, double> > cvDerivs(numCVs);
+
+    // A CV whose evaluation interval has not elapsed keeps the value and forces of its latest
+    // evaluation, unless the atoms have been reordered since then.  CVs with an interval of 1
+    // are evaluated at every call, since the state may have changed without a step.
+
+    long long step = context.getStepCount();
+    vector<bool>& evaluate = cvEvaluate;
+    bool anyEvaluation = (numBatches > 0);
     for (int i = 0; i < numCVs; i++) {
-        cvValues[i] = innerContext.calcForcesAndEnergy(true, true, 1<<i);
-        ContextSelector selector(cc);
-        copyForcesKernel->setArg(0, cvForces[i]);
-        copyForcesKernel->execute(numAtoms);
-        innerContext.getEnergyParameterDerivatives(cvDerivs[i]);
+        evaluate[i] = !cvPlaced[i] && (cvIntervals[i] <= 1 || !cvHasValue[i] || (includeForces && !cvHasForces[i]) || cvReorders[i] != numReorders ||
+                       step < cvSteps[i] || step >= cvSteps[i]+cvIntervals[i]);
+        anyEvaluation = anyEvaluation || evaluate[i];
+    }
+    if (anyEvaluation) {
+        beginStage("copyState");
+        copyState(context, innerContext);
+        endStage();
+    }
+
+    // The forces of each CV are only needed if forces were requested, and the inner parameter
+    // derivatives only if the inner context computes any.  Per-group passes cannot be merged,
+    // because the inner context accumulates the forces of all requested groups in one buffer.
+    // With derivatives on demand, the parameter derivatives are only computed along with the
+    // energy.  The inner ones are still read for every evaluation of a CV with a longer
+    // interval, whose results may be reused by a later evaluation that needs them.
+
+    bool includeParamDerivs = (!derivativesOnDemand || includeEnergy);
+    bool hasInnerParamDerivs = (getInnerComputeContext(innerContext).getEnergyParamDerivNames().size() > 0);
+    for (int i = 0; i < numCVs; i++) {
+        if (!evaluate[i])
+            continue;
+        beginStage("cv:"+variableNames[i]);
+        cvValues[i] = innerContext.calcForcesAndEnergy(includeForces, true, 1<<i);
+        counters.innerEvaluations++;
+        counters.synchronizations++;  // reading back the energy
+        if (includeForces) {
+            ContextSelector selector(cc);
+            if (cvDenseSlot[i] >= 0) {
+                copyForcesKernel->setArg(2, cvDenseSlot[i]);
+                copyForcesKernel->execute(numAtoms);
+                counters.bytesCopied += 3*sizeof(long long)*numAtoms;
+            }
+            else if (cvSparseEnd[i] > cvSparseStart[i]) {
+                copySparseForcesKernel->setArg(2, cvSparseStart[i]);
+                copySparseForcesKernel->setArg(3, cvSparseEnd[i]);
+                copySparseForcesKernel->execute(cvSparseEnd[i]-cvSparseStart[i]);
+                counters.bytesCopied += 3*sizeof(long long)*(cvSparseEnd[i]-cvSparseStart[i]);
+            }
+        }
+        if (hasInnerParamDerivs && (includeParamDerivs || cvIntervals[i] > 1))
+            readInnerDerivatives(innerContext, cvDerivs[i]);
+        cvSteps[i] = step;
+        cvReorders[i] = numReorders;
+        cvHasValue[i] = true;
+        cvHasForces[i] = includeForces;
+        endStage();
+    }
+    if (numBatches > 0) {
+        beginStage("batches");
+        evaluateBatches(innerContext);
+        endStage();
+    }
+    if (placed->indices.size() > 0) {
+        beginStage("placed");
+        readPlacedVariables(includeForces);
+        endStage();
     }
 
     // Compute the energy and forces.
 
     ContextSelector selector(cc);
+    beginStage("expression");
     for (int i = 0; i < globalParameterNames.size(); i++)
         globalValues[i] = context.getParameter(globalParameterNames[i]);
-    double energy = energyExpression.evaluate();
-    for (int i = 0; i < numCVs; i++) {
-        double dEdV = variableDerivExpressions[i].evaluate();
-        addForcesKernel->setArg(2*i+2, cvForces[i]);
-        if (cc.getUseDoublePrecision())
-            addForcesKernel->setArg(2*i+3, dEdV);
-        else
-            addForcesKernel->setArg(2*i+3, (float) dEdV);
+    int numRBFs = rbfNames.size();
+    for (int i = 0; i < numRBFs; i++)
+        rbfValues[i] = evaluateRadialBasisFunction(i, rbfGradients[i]);
+    int numSummations = summationNames.size();
+    for (int i = 0; i < numSummations; i++) {
+        summationArgs.resize(summationVariables[i].size());
+        for (int j = 0; j < summationVariables[i].size(); j++)
+            summationArgs[j] = cvValues[summationVariables[i][j]];
+        summationKernels[i].getAs<CalcCustomSummationKernel>().evaluate(summationArgs.data(), 1, &summationValues[i], summationGradients[i].data());
+        counters.synchronizations++;
+    }
+    bool recordHistory = history.isDue(step);
+    double energy = (includeEnergy || recordHistory ? energyExpression.evaluate() : 0.0);
+    counters.expressionEvaluations += (includeEnergy || recordHistory ? 1 : 0);
+    history.record(step, cvValues, energy);
+    if (!includeEnergy)
+        energy = 0.0;
+
+    // The derivatives with respect to the CVs are only needed for forces and parameter derivatives.
+
+    bool hasParamDerivs = (includeParamDerivs && (paramDerivExpressions.size() > 0 || hasInnerParamDerivs));
+    bool readBatchDerivs = (includeParamDerivs && hasInnerParamDerivs);
+    dEdV.assign(numVariables, 0.0);
+    if (includeForces || hasParamDerivs) {
+        for (int i = 0; i < numVariables; i++)
+            dEdV[i] = variableDerivExpressions[i].evaluate();
+        counters.expressionEvaluations += numVariables+numRBFs+numSummations;
+        for (int i = 0; i < numRBFs; i++) {
+            double dEdF = rbfDerivExpressions[i].evaluate();
+            for (int j = 0; j < rbfVariables[i].size(); j++)
+                dEdV[rbfVariables[i][j]] += dEdF*rbfGradients[i][j];
+        }
+        for (int i = 0; i < numSummations; i++) {
+            double dEdS = summationDerivExpressions[i].evaluate();
+            for (int j = 0; j < summationVariables[i].size(); j++)
+                dEdV[summationVariables[i][j]] += dEdS*summationGradients[i][j];
+        }
+    }
+    depositSummationTerms(step);
+    endStage();
+    // The batches need a second pass, whose displacements are the derivatives of the energy,
+    // for their forces and parameter derivatives.
+
+    bool batchForcesNeeded = (numBatches > 0 && (includeForces || readBatchDerivs));
+    if (addForces && ((includeForces && numVariables > 0) || batchForcesNeeded)) {
+        beginStage("addForces");
+        addWeightedForces(includeForces);
+        for (int i = 0; i < numBatches && batchForcesNeeded; i++) {
+            setBatchDisplacements(i, true);
+            innerContext.calcForcesAndEnergy(true, true, 1<<batchGroups[i]);
+            counters.innerEvaluations++;
+            counters.synchronizations++;  // reading back the energy
+            if (includeForces)
+                addBatchForcesKernel->execute(numAtoms);
+            if (readBatchDerivs)
+                readInnerDerivatives(innerContext, batchDerivs[i]);
+        }
+        endStage();
     }
-    addForcesKernel->execute(numAtoms);
 
     // Compute the energy parameter derivatives.
 
-    if (paramDerivExpressions.size() > 0) {
-        map<string, double>& energyParamDerivs = cc.getEnergyParamDerivWorkspace();
+    if (hasParamDerivs) {
+        // The contributions are summed by slot, so that the workspace is only looked up once
+        // per derivative.  The derivatives of the energy expression take the first slots.
+
+        derivTotals.assign(derivNames.size(), 0.0);
         for (int i = 0; i < paramDerivExpressions.size(); i++)
-            energyParamDerivs[paramDerivNames[i]] += paramDerivExpressions[i].evaluate();
-        for (int i = 0; i < numCVs; i++) {
-            double dEdV = variableDerivExpressions[i].evaluate();
-            for (auto& deriv : cvDerivs[i])
-                energyParamDerivs[deriv.first] += dEdV*deriv.second;
-        }
+            derivTotals[i] += paramDerivExpressions[i].evaluate();
+        counters.expressionEvaluations += paramDerivExpressions.size();
+        for (int i = 0; i < numCVs; i++)
+            for (int j = 0; j < cvDerivs[i].size(); j++)
+                derivTotals[j] += dEdV[i]*cvDerivs[i][j];
+        for (auto& derivs : batchDerivs)
+            for (int j = 0; j < derivs.size(); j++)
+                derivTotals[j] += derivs[j];
+        map<string, double>& energyParamDerivs = cc.getEnergyParamDerivWorkspace();
+        for (int i = 0; i < derivNames.size(); i++)
+            energyParamDerivs[derivNames[i]] += derivTotals[i];
     }
     return energy;
 }
 
+void CommonCalcExtendedCustomCVForceKernel::readInnerDerivatives(ContextImpl& innerContext, vector<double>& derivs) {
+    // The map is ordered by name, and its names rarely change, so its entries are matched to
+    // their slots by position.  The slots are only looked up again when its size changes.
+
+    innerContext.getEnergyParameterDerivatives(innerDerivs);
+    if (innerDerivs.size() != innerDerivSlots.size()) {
+        innerDerivSlots.clear();
+        for (auto& deriv : innerDerivs) {
+            int slot = find(derivNames.begin(), derivNames.end(), deriv.first)-derivNames.begin();
+            if (slot == derivNames.size())
+                derivNames.push_back(deriv.first);
+            innerDerivSlots.push_back(slot);
+        }
+    }
+    derivs.assign(derivNames.size(), 0.0);
+    int index = 0;
+    for (auto& deriv : innerDerivs)
+        derivs[innerDerivSlots[index++]] = deriv.second;
+}
+
+void CommonCalcExtendedCustomCVForceKernel::setBatchDisplacements(int batch, bool useDerivatives) {
+    ContextSelector selector(cc);
+    setBatchDisplacementsKernel->setArg(0, batchOrigins[batch]);
+    setBatchDisplacementsKernel->setArg(1, batchFirstVariables[batch]);
+    setBatchDisplacementsKernel->setArg(2, batchSizes[batch]);
+    setBatchDisplacementsKernel->setArg(3, useDerivatives ? 1 : 0);
+    setBatchDisplacementsKernel->execute(batchSizes[batch]);
+}
+
+void CommonCalcExtendedCustomCVForceKernel::evaluateBatches(ContextImpl& innerContext) {
+    // With unit displacements, the value of each variable is minus the x force on its particle.
+    // The forces of all batches are gathered first, so that they are downloaded together.
+
+    int numBatches = batchGroups.size();
+    int numCVs = cvIntervals.size();
+    for (int i = 0; i < numBatches; i++) {
+        setBatchDisplacements(i, false);
+        innerContext.calcForcesAndEnergy(true, false, 1<<batchGroups[i]);
+        counters.innerEvaluations++;
+        ContextSelector selector(cc);
+        copyBatchForcesKernel->setArg(0, batchOrigins[i]);
+        copyBatchForcesKernel->setArg(1, batchFirstVariables[i]-numCVs);
+        copyBatchForcesKernel->setArg(2, batchSizes[i]);
+        copyBatchForcesKernel->execute(batchSizes[i]);
+    }
+    batchForces.download(batchForcesHost);
+    counters.synchronizations++;
+    counters.bytesCopied += batchForcesHost.size()*sizeof(long long);
+    const double scale = 1.0/(double) 0x100000000;
+    for (int i = 0; i < batchForcesHost.size(); i++)
+        cvValues[numCVs+i] = -scale*batchForcesHost[i];
+}
+
+void CommonCalcExtendedCustomCVForceKernel::getCollectiveVariableValues(ContextImpl& context, ContextImpl& innerContext, vector<double>& values) {
+    OPENMMLAB_TRACE_RANGE("ExtendedCustomCVForce::getCollectiveVariableValues");
+
+    // The same rule as in execute() decides which values are still valid.  The values
+    // computed here are not cached, since their forces and parameter derivatives are not.
+
+    int numCVs = cvIntervals.size();
+    long long step = context.getStepCount();
+    vector<bool>& evaluate = cvEvaluate;
+    bool anyEvaluation = (batchGroups.size() > 0);
+    for (int i = 0; i < numCVs; i++) {
+        evaluate[i] = !cvPlaced[i] && (cvIntervals[i] <= 1 || !cvHasValue[i] || cvReorders[i] != numReorders ||
+                       step < cvSteps[i] || step >= cvSteps[i]+cvIntervals[i]);
+        anyEvaluation = anyEvaluation || evaluate[i];
+    }
+    if (anyEvaluation)
+        copyState(context, innerContext);
+    values.resize(variableNames.size());
+    for (int i = 0; i < numCVs; i++) {
+        if (evaluate[i]) {
+            values[i] = innerContext.calcForcesAndEnergy(false, true, 1<<i);
+            counters.innerEvaluations++;
+            counters.synchronizations++;  // reading back the energy
+        }
+        else
+            values[i] = cvValues[i];
+    }
+    if (batchGroups.size() > 0) {
+        evaluateBatches(innerContext);
+        for (int i = numCVs; i < values.size(); i++)
+            values[i] = cvValues[i];
+    }
+    readPlacedVariables(false);
+    for (int i : placed->indices)
+        values[i] = cvValues[i];
+}
+
+void CommonCalcExtendedCustomCVForceKernel::getCollectiveVariableCache(vector<long long>& steps, vector<double>& values, vector<vector<double> >& derivatives) {
+    // Only the variables evaluated in the inner context keep results between steps.
+
+    int numCVs = cvIntervals.size();
+    steps.assign(numCVs, -1);
+    values.assign(numCVs, 0.0);
+    derivatives.assign(numCVs, vector<double>());
+    for (int i = 0; i < numCVs; i++)
+        if (!cvPlaced[i] && cvHasValue[i]) {
+            steps[i] = cvSteps[i];
+            values[i] = cvValues[i];
+            derivatives[i] = cvDerivs[i];
+        }
+}
+
+void CommonCalcExtendedCustomCVForceKernel::setCollectiveVariableCache(const vector<long long>& steps, const vector<double>& values,
+                                                                      const vector<vector<double> >& derivatives) {
+    // The values do not depend on the order of the atoms, so they are valid for the current
+    // order.  The forces are not, and they are computed again when they are needed.
+
+    int numCVs = cvIntervals.size();
+    if (steps.empty()) {
+        cvHasValue.assign(numCVs, false);
+        cvHasForces.assign(numCVs, false);
+        return;
+    }
+    if ((int) steps.size() != numCVs || (int) values.size() != numCVs || (int) derivatives.size() != numCVs)
+        throw OpenMMException("ExtendedCustomCVForce: the cached results do not match the collective variables");
+    for (int i = 0; i < numCVs; i++) {
+        cvHasValue[i] = (!cvPlaced[i] && steps[i] >= 0);
+        cvHasForces[i] = false;
+        if (cvHasValue[i]) {
+            cvSteps[i] = steps[i];
+            cvReorders[i] = numReorders;
+            cvValues[i] = values[i];
+            cvDerivs[i] = derivatives[i];
+        }
+    }
+}
+
+void CommonCalcExtendedCustomCVForceKernel::evaluateInnerVariables(ContextImpl& innerContext, vector<double>& values) {
+    // The values of the batches are cached like those of an evaluation, but they are
+    // evaluated again at every step anyway.
+
+    ContextSelector selector(cc);
+    initializeListeners(innerContext);
+    int numCVs = cvIntervals.size();
+    values.assign(variableNames.size(), 0.0);
+    for (int i = 0; i < numCVs; i++) {
+        if (cvPlaced[i])
+            continue;
+        values[i] = innerContext.calcForcesAndEnergy(false, true, 1<<i);
+        counters.innerEvaluations++;
+        counters.synchronizations++;  // reading back the energy
+    }
+    if (batchGroups.size() > 0) {
+        evaluateBatches(innerContext);
+        for (int i = numCVs; i < values.size(); i++)
+            values[i] = cvValues[i];
+    }
+}
+
+void CommonCalcExtendedCustomCVForceKernel::readPlacedVariables(bool includeForces) {
+    // The placed variables were evaluated in another thread while the inner context evaluated
+    // the others.  Their forces are converted to the fixed point format of the inner force
+    // buffer and uploaded into their compact arrays.  Those evaluated without forces contribute
+    // none.
+
+    if (placed->indices.empty())
+        return;
+    placed->wait();
+    int numEntries = numSparseEntries-placedSparseStart;
+    placedForcesHost.resize(3*numEntries);
+    const double scale = (double) 0x100000000;
+    for (int i = 0; i < placed->indices.size(); i++) {
+        int index = placed->indices[i];
+        cvValues[index] = placed->values[i];
+        if (!includeForces)
+            continue;
+        const vector<Vec3>& forces = placed->forces[i];
+        for (int j = cvSparseStart[index]; j < cvSparseEnd[index]; j++)
+            for (int k = 0; k < 3; k++)
+                placedForcesHost[3*(j-placedSparseStart)+k] = (forces.empty() ? 0 : (long long) (forces[sparseAtomsHost[j]][k]*scale));
+    }
+    if (includeForces && numEntries > 0) {
+        ContextSelector selector(cc);
+        sparseForces.uploadSubArray(placedForcesHost.data(), 3*placedSparseStart, 3*numEntries);
+        counters.synchronizations++;  // the upload is blocking
+        counters.bytesCopied += 3*sizeof(long long)*numEntries;
+    }
+}
+
+void CommonCalcExtendedCustomCVForceKernel::beginStage(const string& name) {
+    OPENMMLAB_TRACE_PUSH(("ExtendedCustomCVForce::"+name).c_str());
+    if (!profileStages)
+        return;
+    synchronize(cc);
+    currentStage = name;
+    stageStart = chrono::steady_clock::now();
+}
+
+void CommonCalcExtendedCustomCVForceKernel::endStage() {
+    OPENMMLAB_TRACE_POP();
+    if (!profileStages)
+        return;
+    synchronize(cc);
+    stageTimes[currentStage] += chrono::duration<double, milli>(chrono::steady_clock::now()-stageStart).count();
+}
+
+void CommonCalcExtendedCustomCVForceKernel::getStageTimes(map<string, double>& times) {
+    times = stageTimes;
+}
+
+void CommonCalcExtendedCustomCVForceKernel::resetStageTimes() {
+    stageTimes.clear();
+}
+
+void CommonCalcExtendedCustomCVForceKernel::getForceArrays(DeviceArray& forces, DeviceArray& atomIndices, vector<int>& variables) {
+    // Uncompressed forces are stored in the fixed point units of the force buffers.
+
+    bool compressed = (cvForces.getElementSize() == sizeof(float));
+    describeArray(cc, cvForces, forces);
+    forces.typestr = (compressed ? "<f4" : "<i8");
+    forces.shape = {numDenseCVs, 3, cc.getPaddedNumAtoms()};
+    forces.scale = (compressed ? 1.0 : 1.0/0x100000000);
+    describeArray(cc, cc.getAtomIndexArray(), atomIndices);
+    atomIndices.typestr = "<i4";
+    atomIndices.shape = {cc.getPaddedNumAtoms()};
+    atomIndices.scale = 1.0;
+    variables.resize(numDenseCVs);
+    for (int i = 0; i < cvDenseSlot.size(); i++)
+        if (cvDenseSlot[i] >= 0)
+            variables[cvDenseSlot[i]] = i;
+}
+
+void CommonCalcExtendedCustomCVForceKernel::getCounters(map<string, long long>& counters) {
+    this->counters.get(counters);
+    long long bytes = 0;
+    vector<const ComputeArray*> arrays = {&cvForces, &dEdVArray, &denseCVs, &sparseForces, &sparseAtoms, &sparseCVs,
+                                          &invAtomOrder, &innerInvAtomOrder, &innerIndex, &batchForces};
+    for (int i = 0; i < rbfCenters.size(); i++) {
+        arrays.push_back(&rbfCenters[i]);
+        arrays.push_back(&rbfWeights[i]);
+    }
+    for (const ComputeArray* array : arrays)
+        if (array->isInitialized())
+            bytes += (long long) array->getSize()*array->getElementSize();
+    for (Kernel& kernel : summationKernels)
+        bytes += kernel.getAs<CommonCalcCustomSummationKernel>().getNumBytes();
+    counters["deviceBytes"] = bytes;
+    counters["scratchBytes"] = (scratch == NULL ? 0 : scratch->getNumBytes());
+}
+
+void CommonCalcExtendedCustomCVForceKernel::updateAtomMaps(ComputeContext& cc2) {
+    // The kernels that copy between the contexts atom by atom read a single composed index
+    // per atom, and none at all while both contexts keep the same order, which is the case
+    // until one of them reorders its atoms.
+
+    const vector<int>& order = cc.getAtomIndex();
+    const vector<int>& innerOrder = cc2.getAtomIndex();
+    vector<int> invOrder(cc.getPaddedNumAtoms()), innerInvOrder(cc2.getPaddedNumAtoms()), index(cc.getPaddedNumAtoms(), 0);
+    for (int i = 0; i < order.size(); i++)
+        invOrder[order[i]] = i;
+    for (int i = 0; i < innerOrder.size(); i++)
+        innerInvOrder[innerOrder[i]] = i;
+    bool sameOrder = true;
+    for (int i = 0; i < cc.getNumAtoms(); i++) {
+        index[i] = innerInvOrder[order[i]];
+        sameOrder = sameOrder && (index[i] == i);
+    }
+    invAtomOrder.upload(invOrder);
+    innerInvAtomOrder.upload(innerInvOrder);
+    innerIndex.upload(index);
+    copyStateKernel->setArg(0, (int) sameOrder);
+    copyForcesKernel->setArg(0, (int) sameOrder);
+    addBatchForcesKernel->setArg(0, (int) sameOrder);
+}
+
+void CommonCalcExtendedCustomCVForceKernel::initializeListeners(ContextImpl& innerContext) {
+    if (hasInitializedListeners)
+        return;
+    hasInitializedListeners = true;
+    ComputeContext& cc2 = getInnerComputeContext(innerContext);
+    cc.addReorderListener(new ReorderListener(*this, cc2, true));
+    cc2.addReorderListener(new ReorderListener(*this, cc2, false));
+    updateAtomMaps(cc2);
+}
+
 void CommonCalcExtendedCustomCVForceKernel::copyState(ContextImpl& context, ContextImpl& innerContext) {
     ContextSelector selector(cc);
     int numAtoms = cc.getNumAtoms();
-    ComputeContext& cc2 = getInnerComputeContext(innerContext);
-    if (!hasInitializedListeners) {
-        hasInitializedListeners = true;
+    initializeListeners(innerContext);
+    copyStateKernel->execute(numAtoms);
+    if (hasSharedParticles)
+        innerContext.computeVirtualSites();
+    counters.copyStates++;
+    counters.bytesCopied += numAtoms*cc.getPosq().getElementSize();
+    if (copyVelocities)
+        counters.bytesCopied += numAtoms*cc.getVelm().getElementSize();
+    if (cc.getUseMixedPrecision())
+        counters.bytesCopied += numAtoms*cc.getPosqCorrection().getElementSize();
 
-        // Initialize the listeners.
+    // Only push the box, time, and parameters that actually changed.  The set of parameters
+    // defined by the inner context is fixed, so its names are collected only once.
 
-        ReorderListener* listener1 = new ReorderListener(cc, invAtomOrder);
-        ReorderListener* listener2 = new ReorderListener(cc2, innerInvAtomOrder);
-        cc.addReorderListener(listener1);
-        cc2.addReorderListener(listener2);
-        listener1->execute();
-        listener2->execute();
+    Vec3 box[3], innerBox[3];
+    context.getPeriodicBoxVectors(box[0], box[1], box[2]);
+    innerContext.getPeriodicBoxVectors(innerBox[0], innerBox[1], innerBox[2]);
+    if (box[0] != innerBox[0] || box[1] != innerBox[1] || box[2] != innerBox[2])
+        innerContext.setPeriodicBoxVectors(box[0], box[1], box[2]);
+    if (innerContext.getTime() != context.getTime())
+        innerContext.setTime(context.getTime());
+    if (innerParameterNames.empty())
+        for (auto& param : innerContext.getParameters())
+            innerParameterNames.push_back(param.first);
+    for (auto& name : innerParameterNames) {
+        double value = context.getParameter(name);
+        if (innerContext.getParameter(name) != value)
+            innerContext.setParameter(name, value);
     }
-    copyStateKernel->execute(numAtoms);
-    Vec3 a, b, c;
-    context.getPeriodicBoxVectors(a, b, c);
-    innerContext.setPeriodicBoxVectors(a, b, c);
-    innerContext.setTime(context.getTime());
-    map<string, double> innerParameters = innerContext.getParameters();
-    for (auto& param : innerParameters)
-        innerContext.setParameter(param.first, context.getParameter(param.first));
 }
 
 void CommonCalcExtendedCustomCVForceKernel::copyParametersToContext(ContextImpl& context, const ExtendedCustomCVForce& force) {
-    // Create custom functions for the tabulated functions.
+    // Recreate the custom functions of the tabulated functions that have changed.  Creating
+    // one fits splines to the whole table, which is a waste for the many updates that only
+    // modify other parameters.
 
     for (int i = 0; i < force.getNumTabulatedFunctions(); i++) {
+        vector<double> data = getTabulatedFunctionData(force.getTabulatedFunction(i));
+        if (data == tabulatedFunctionData[i])
+            continue;
         if (tabulatedFunctions[i] != NULL) {
             delete tabulatedFunctions[i];
             tabulatedFunctions[i] = NULL;
         }
         tabulatedFunctions[i] = createReferenceTabulatedFunction(force.getTabulatedFunction(i));
+        tabulatedFunctionData[i].swap(data);
+    }
+    uploadRadialBasisFunctions(force);
+    uploadCustomSummations(force);
+    for (int i = 0; i < force.getNumCollectiveVariables(); i++)
+        cvIntervals[i] = force.getCollectiveVariableInterval(i);
+}
+
+static const int SUMMATION_WORK_GROUP_SIZE = 128;
+
+void CommonCalcCustomSummationKernel::initialize(int numArgs, const ParsedExpression& expression, const map<string, double>& overallParameters,
+                                                 const vector<string>& perTermParameters, bool deterministic) {
+    ContextSelector selector(cc);
+    this->numArgs = numArgs;
+    this->deterministic = deterministic;
+    int numParams = perTermParameters.size();
+
+    // Create the code for evaluating a term and its derivatives.
+
+    map<string, string> variables;
+    for (int i = 0; i < numArgs; i++)
+        variables[CustomSummationImpl::getArgumentName(i)] = "pointArgs["+cc.intToString(i)+"]";
+    for (auto& parameter : overallParameters) {
+        variables[parameter.first] = "overall["+cc.intToString(overallNames.size())+"]";
+        overallNames.push_back(parameter.first);
+        overallValues.push_back(parameter.second);
+    }
+    for (int k = 0; k < numParams; k++)
+        variables[perTermParameters[k]] = "termParams[term*"+cc.intToString(numParams)+"+"+cc.intToString(k)+"]";
+
+    // Subexpressions that only depend on overall parameters are the same for every term.
+    // They are evaluated on the host whenever a parameter changes, and stored in the
+    // overall array after the parameters themselves.
+
+    vector<ParsedExpression> argumentInvariants, parameterInvariants;
+    ParsedExpression termExpression = CustomSummationImpl::hoistInvariants(expression.optimize(), numArgs, perTermParameters, false,
+                                                                           argumentInvariants, parameterInvariants);
+    int numOverall = overallNames.size();
+    overallValues.resize(numOverall+parameterInvariants.size());
+    map<string, double*> overallLocations;
+    for (int i = 0; i < numOverall; i++)
+        overallLocations[overallNames[i]] = &overallValues[i];
+    for (int k = 0; k < parameterInvariants.size(); k++) {
+        variables["@parameter"+cc.intToString(k)] = "overall["+cc.intToString(numOverall+k)+"]";
+        invariantExpressions.push_back(parameterInvariants[k].createCompiledExpression());
+        invariantExpressions.back().setVariableLocations(overallLocations);
+    }
+    computeParameterInvariants();
+    map<string, ParsedExpression> valueExpressions, gradientExpressions;
+    valueExpressions["termValue[0] = "] = termExpression;
+    gradientExpressions["termValue[0] = "] = termExpression;
+    for (int i = 0; i < numArgs; i++)
+        gradientExpressions["termValue["+cc.intToString(i+1)+"] = "] = termExpression.differentiate(CustomSummationImpl::getArgumentName(i)).optimize();
+    vector<const TabulatedFunction*> functions;
+    vector<pair<string, string> > functionNames;
+    map<string, string> replacements, defines;
+    replacements["COMPUTE_VALUE"] = cc.getExpressionUtilities().createExpressions(valueExpressions, variables, functions, functionNames, "value");
+    replacements["COMPUTE_VALUE_AND_GRADIENT"] = cc.getExpressionUtilities().createExpressions(gradientExpressions, variables, functions, functionNames, "gradient");
+    defines["NUM_ARGS"] = cc.intToString(numArgs);
+    defines["WORK_GROUP_SIZE"] = cc.intToString(SUMMATION_WORK_GROUP_SIZE);
+    if (deterministic)
+        defines["DETERMINISTIC"] = "1";
+    ComputeProgram program = cc.compileProgram(cc.replaceStrings(CommonOpenMMLabKernelSources::customSummation, replacements), defines);
+    kernel = program->createKernel("evaluateSummation");
+
+    // Create the arrays.  Their sizes are at least 1, since empty arrays cannot be created.
+
+    int elementSize = (cc.getUseDoublePrecision() ? sizeof(double) : sizeof(float));
+    int mixedSize = (cc.getUseDoublePrecision() || cc.getUseMixedPrecision() ? sizeof(double) : sizeof(float));
+    int sumSize = (deterministic ? sizeof(long long) : mixedSize);
+    termParams.initialize(cc, max(numParams, 1), elementSize, "summationTermParams");
+    overall.initialize(cc, max((int) overallValues.size(), 1), elementSize, "summationOverall");
+    scratch = CommonScratchPool::acquire(cc);
+    scratch->getArray("summationPoints", numArgs, elementSize);
+    scratch->getArray("summationPartialSums", cc.getNumThreadBlocks()*(numArgs+1), sumSize);
+    uploadValues(overall, overallValues, 0);
+}
+
+CommonCalcCustomSummationKernel::~CommonCalcCustomSummationKernel() {
+    if (scratch != NULL)
+        CommonScratchPool::release(scratch);
+}
+
+long long CommonCalcCustomSummationKernel::getNumBytes() const {
+    long long bytes = 0;
+    for (const ComputeArray* array : {&termParams, &overall})
+        if (array->isInitialized())
+            bytes += (long long) array->getSize()*array->getElementSize();
+    return bytes;
+}
+
+void CommonCalcCustomSummationKernel::uploadValues(ComputeArray& array, const vector<double>& values, int offset) {
+    if (values.size() == 0)
+        return;
+    if (array.getElementSize() == sizeof(double))
+        array.uploadSubArray(values.data(), offset, values.size());
+    else {
+        floatBuffer.assign(values.begin(), values.end());
+        array.uploadSubArray(floatBuffer.data(), offset, floatBuffer.size());
+    }
+}
+
+void CommonCalcCustomSummationKernel::setTerms(const vector<vector<double> >& parameters, const set<int>& modifiedTerms) {
+    ContextSelector selector(cc);
+    numTerms = parameters.size();
+    if (numTerms == 0)
+        return;
+    int numParams = parameters[0].size();
+    if (numParams == 0)
+        return;
+    if (numTerms*numParams > termParams.getSize()) {
+        // The array grows geometrically, so that appending terms one at a time does not
+        // reallocate it every time.  Resizing discards its contents, so every term is uploaded.
+
+        termParams.resize(max(numTerms*numParams, 2*termParams.getSize()));
+        for (int term = 0; term < numTerms; term++)
+            hostValues.insert(hostValues.end(), parameters[term].begin(), parameters[term].end());
+        uploadValues(termParams, hostValues, 0);
+        hostValues.clear();
+        return;
+    }
+
+    // Upload each run of consecutive modified terms with a single transfer.
+
+    auto it = modifiedTerms.begin();
+    while (it != modifiedTerms.end() && *it < numTerms) {
+        int first = *it, last = first;
+        hostValues.clear();
+        while (it != modifiedTerms.end() && *it == last && last < numTerms) {
+            hostValues.insert(hostValues.end(), parameters[last].begin(), parameters[last].end());
+            ++it;
+            last++;
+        }
+        uploadValues(termParams, hostValues, first*numParams);
+    }
+    hostValues.clear();
+}
+
+void CommonCalcCustomSummationKernel::setParameter(const string& name, double value) {
+    ContextSelector selector(cc);
+    auto it = find(overallNames.begin(), overallNames.end(), name);
+    if (it == overallNames.end())
+        throw OpenMMException("CustomSummation: unknown parameter '"+name+"'");
+    overallValues[it-overallNames.begin()] = value;
+    computeParameterInvariants();
+    uploadValues(overall, overallValues, 0);
+}
+
+void CommonCalcCustomSummationKernel::computeParameterInvariants() {
+    for (int k = 0; k < invariantExpressions.size(); k++)
+        overallValues[overallNames.size()+k] = invariantExpressions[k].evaluate();
+}
+
+void CommonCalcCustomSummationKernel::evaluate(const double* arguments, int numPoints, double* values, double* gradients) {
+    ContextSelector selector(cc);
+    int width = numArgs+1;
+    int numGroups = min(cc.getNumThreadBlocks(), (numTerms+SUMMATION_WORK_GROUP_SIZE-1)/SUMMATION_WORK_GROUP_SIZE);
+    if (numGroups == 0) {
+        for (int k = 0; k < numPoints; k++)
+            values[k] = 0.0;
+        if (gradients != NULL)
+            for (int i = 0; i < numPoints*numArgs; i++)
+                gradients[i] = 0.0;
+        return;
+    }
+    int elementSize = (cc.getUseDoublePrecision() ? sizeof(double) : sizeof(float));
+    int mixedSize = (cc.getUseDoublePrecision() || cc.getUseMixedPrecision() ? sizeof(double) : sizeof(float));
+    ComputeArray& points = scratch->getArray("summationPoints", numPoints*numArgs, elementSize);
+    ComputeArray& partialSums = scratch->getArray("summationPartialSums", cc.getNumThreadBlocks()*numPoints*width, deterministic ? sizeof(long long) : mixedSize);
+    uploadValues(points, vector<double>(arguments, arguments+numPoints*numArgs), 0);
+    kernel->setArg(0, termParams);
+    kernel->setArg(1, overall);
+    kernel->setArg(2, points);
+    kernel->setArg(3, partialSums);
+    kernel->setArg(4, numTerms);
+    kernel->setArg(5, numPoints);
+    kernel->setArg(6, (int) (gradients != NULL));
+    kernel->execute(numGroups*SUMMATION_WORK_GROUP_SIZE, SUMMATION_WORK_GROUP_SIZE);
+
+    // Only the partial sums of the groups that have run are added.  In deterministic mode,
+    // they are added as integers and converted at the end.
+
+    if (deterministic) {
+        fixedSums.resize(partialSums.getSize());
+        partialSums.download(fixedSums);
+        const double scale = 1.0/(double) 0x100000000;
+        for (int k = 0; k < numPoints; k++)
+            for (int j = 0; j < (gradients == NULL ? 1 : width); j++) {
+                long long total = 0;
+                for (int group = 0; group < numGroups; group++)
+                    total += fixedSums[(group*numPoints+k)*width+j];
+                if (j == 0)
+                    values[k] = scale*total;
+                else
+                    gradients[k*numArgs+j-1] = scale*total;
+            }
+        return;
+    }
+    sums.resize(partialSums.getSize());
+    if (partialSums.getElementSize() == sizeof(double))
+        partialSums.download(sums);
+    else {
+        vector<float>& buffer = floatBuffer;
+        buffer.resize(partialSums.getSize());
+        partialSums.download(buffer);
+        sums.assign(buffer.begin(), buffer.end());
+    }
+    for (int k = 0; k < numPoints; k++) {
+        values[k] = 0.0;
+        if (gradients != NULL)
+            for (int i = 0; i < numArgs; i++)
+                gradients[k*numArgs+i] = 0.0;
+        for (int group = 0; group < numGroups; group++) {
+            const double* partial = &sums[(group*numPoints+k)*width];
+            values[k] += partial[0];
+            if (gradients != NULL)
+                for (int i = 0; i < numArgs; i++)
+                    gradients[k*numArgs+i] += partial[i+1];
+        }
     }
 }
@@ -0,0 +1,65 @@
+/* -------------------------------------------------------------------------- *
+ *                             OpenMM Laboratory                              *
+ *                             =================                              *
+ *                                                                            *
+ * A plugin for testing low-level code implementation for OpenMM.             *
+ *                                                                            *
+ * Copyright (c) 2023 Charlles Abreu                                          *
+ * https://github.com/craabreu/openmm-lab                                     *
+ * -------------------------------------------------------------------------- */
+
+#include "internal/CommonScratchPool.h"
+#include "openmm/common/ContextSelector.h"
+#include <algorithm>
+
+using namespace OpenMM;
+using namespace OpenMMLab;
+using namespace std;
+
+map<ComputeContext*, CommonScratchPool*> CommonScratchPool::pools;
+mutex CommonScratchPool::poolsMutex;
+
+CommonScratchPool* CommonScratchPool::acquire(ComputeContext& cc) {
+    lock_guard<mutex> lock(poolsMutex);
+    CommonScratchPool*& pool = pools[&cc];
+    if (pool == NULL)
+        pool = new CommonScratchPool(cc);
+    pool->references++;
+    return pool;
+}
+
+void CommonScratchPool::release(CommonScratchPool* pool) {
+    lock_guard<mutex> lock(poolsMutex);
+    if (--pool->references > 0)
+        return;
+    pools.erase(&pool->cc);
+    delete pool;
+}
+
+CommonScratchPool::~CommonScratchPool() {
+    ContextSelector selector(cc);
+    for (auto& entry : arrays)
+        delete entry.second;
+}
+
+ComputeArray& CommonScratchPool::getArray(const string& name, int size, int elementSize) {
+    ComputeArray*& array = arrays[make_pair(name, elementSize)];
+    if (array == NULL) {
+        array = new ComputeArray();
+        array->initialize(cc, max(size, 1), elementSize, name);
+    }
+    else if (array->getSize() < size) {
+        // Grow geometrically, so that slowly increasing requests do not reallocate the
+        // array every time.
+
+        array->resize(max(size, 2*(int) array->getSize()));
+    }
+    return *array;
+}
+
+long long CommonScratchPool::getNumBytes() const {
+    long long bytes = 0;
+    for (auto& entry : arrays)
+        bytes += (long long) entry.second->getSize()*entry.second->getElementSize();
+    return bytes;
+}
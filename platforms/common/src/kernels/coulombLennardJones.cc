@@ -1,124 +1,174 @@
 {
-    int slice = SUBSET1>SUBSET2 ? SUBSET1*(SUBSET1+1)/2+SUBSET2 : SUBSET2*(SUBSET2+1)/2+SUBSET1;
+    // Branch-free slice index, so that mixed-subset warps do not diverge here.  This code is
+    // run for every pair inside the tile loop of the default nonbonded kernel, which cannot
+    // dispatch on the subsets of a tile: the atoms of a neighbor-list tile come from many
+    // blocks, and each thread sees a different one at every iteration.  In tiles of a single
+    // subset, the slice is the same for all threads, so the lambdas are read at one address.
+
+    int subsetMax = max(SUBSET1, SUBSET2);
+    int slice = subsetMax*(subsetMax+1)/2+min(SUBSET1, SUBSET2);
     real clLambda = LAMBDA[slice].x;
     real ljLambda = LAMBDA[slice].y;
+
+    // Pairs in slices that are switched off contribute nothing unless a derivative is requested.
+
+    if (clLambda != 0 || ljLambda != 0 || SLICE_HAS_DERIVATIVE) {
 #if USE_EWALD
-    unsigned int includeInteraction = (!isExcluded && r2 < CUTOFF_SQUARED);
-    const real alphaR = EWALD_ALPHA*r;
-    const real expAlphaRSqr = EXP(-alphaR*alphaR);
+        unsigned int includeInteraction = (!isExcluded && r2 < CUTOFF_SQUARED);
+        const real alphaR = EWALD_ALPHA*r;
+        const real expAlphaRSqr = EXP(-alphaR*alphaR);
 #if HAS_COULOMB
-    const real prefactor = ONE_4PI_EPS0*CHARGE1*CHARGE2*invR;
+        const real prefactor = ONE_4PI_EPS0*CHARGE1*CHARGE2*invR;
 #else
-    const real prefactor = 0.0f;
+        const real prefactor = 0.0f;
 #endif
 
 #ifdef USE_DOUBLE_PRECISION
-    const real erfcAlphaR = erfc(alphaR);
+        const real erfcAlphaR = erfc(alphaR);
 #else
-    // This approximation for erfc is from Abramowitz and Stegun (1964) p. 299.  They cite the following as
-    // the original source: C. Hastings, Jr., Approximations for Digital Computers (1955).  It has a maximum
-    // error of 1.5e-7.
+        // This approximation for erfc is from Abramowitz and Stegun (1964) p. 299.  They cite the following as
+        // the original source: C. Hastings, Jr., Approximations for Digital Computers (1955).  It has a maximum
+        // error of 1.5e-7.
 
-    const real t = RECIP(1.0f+0.3275911f*alphaR);
-    const real erfcAlphaR = (0.254829592f+(-0.284496736f+(1.421413741f+(-1.453152027f+1.061405429f*t)*t)*t)*t)*t*expAlphaRSqr;
+        const real t = RECIP(1.0f+0.3275911f*alphaR);
+        const real erfcAlphaR = (0.254829592f+(-0.284496736f+(1.421413741f+(-1.453152027f+1.061405429f*t)*t)*t)*t)*t*expAlphaRSqr;
 #endif
-    real clEnergy = includeInteraction ? prefactor*erfcAlphaR : 0;
-    real tempForce = 0.0f;
+        real clEnergy = includeInteraction ? prefactor*erfcAlphaR : 0;
+        real tempForce = 0.0f;
 #if HAS_LENNARD_JONES
-    real sig = SIGMA_EPSILON1.x + SIGMA_EPSILON2.x;
-    real sig2 = invR*sig;
-    sig2 *= sig2;
-    real sig6 = sig2*sig2*sig2;
-    real eps = SIGMA_EPSILON1.y*SIGMA_EPSILON2.y;
-    real epssig6 = sig6*eps;
-    tempForce = epssig6*(12.0f*sig6 - 6.0f);
-    real ljEnergy = includeInteraction ? epssig6*(sig6 - 1.0f) : 0;
-    #if USE_LJ_SWITCH
-    if (r > LJ_SWITCH_CUTOFF) {
-        real x = r-LJ_SWITCH_CUTOFF;
-        real switchValue = 1+x*x*x*(LJ_SWITCH_C3+x*(LJ_SWITCH_C4+x*LJ_SWITCH_C5));
-        real switchDeriv = x*x*(3*LJ_SWITCH_C3+x*(4*LJ_SWITCH_C4+x*5*LJ_SWITCH_C5));
-        tempForce = tempForce*switchValue - ljEnergy*switchDeriv*r;
-        ljEnergy *= switchValue;
-    }
-    #endif
+        real sig = SIGMA_EPSILON1.x + SIGMA_EPSILON2.x;
+        real sig2 = invR*sig;
+        sig2 *= sig2;
+        real sig6 = sig2*sig2*sig2;
+        real eps = SIGMA_EPSILON1.y*SIGMA_EPSILON2.y;
+        real epssig6 = sig6*eps;
+        tempForce = epssig6*(12.0f*sig6 - 6.0f);
+        real ljEnergy = includeInteraction ? epssig6*(sig6 - 1.0f) : 0;
+        #if USE_SOFT_CORE
+        // In soft-core slices, (r/sigma)^6 is replaced by shift+(r/sigma)^6.  Writing
+        // u = 1/(shift+(r/sigma)^6) in terms of sig6 avoids 0/0 for a zero sigma.
+        real softCoreShift = 0, softCoreShiftDerivative = 0, ljShiftDerivative = 0;
+        COMPUTE_SOFT_CORE_SHIFT
+        if (softCoreShift != 0 || softCoreShiftDerivative != 0) {
+            real q = RECIP(1.0f+softCoreShift*sig6);
+            real u = sig6*q;
+            tempForce = eps*u*q*(12.0f*u - 6.0f);
+            ljEnergy = includeInteraction ? eps*u*(u - 1.0f) : 0;
+            ljShiftDerivative = includeInteraction ? eps*u*u*(1.0f - 2.0f*u)*softCoreShiftDerivative : 0;
+        }
+        #endif
+        #if USE_LJ_SWITCH
+        if (r > LJ_SWITCH_CUTOFF) {
+            real x = r-LJ_SWITCH_CUTOFF;
+            real switchValue = 1+x*x*x*(LJ_SWITCH_C3+x*(LJ_SWITCH_C4+x*LJ_SWITCH_C5));
+            real switchDeriv = x*x*(3*LJ_SWITCH_C3+x*(4*LJ_SWITCH_C4+x*5*LJ_SWITCH_C5));
+            tempForce = tempForce*switchValue - ljEnergy*switchDeriv*r;
+            ljEnergy *= switchValue;
+            #if USE_SOFT_CORE
+            ljShiftDerivative *= switchValue;
+            #endif
+        }
+        #endif
+        #if USE_SOFT_CORE
+        real ljDerivative = ljEnergy + ljLambda*ljShiftDerivative;
+        #endif
 #if DO_LJPME
-    // The multiplicative term to correct for the multiplicative terms that are always
-    // present in reciprocal space.
-    const real dispersionAlphaR = EWALD_DISPERSION_ALPHA*r;
-    const real dar2 = dispersionAlphaR*dispersionAlphaR;
-    const real dar4 = dar2*dar2;
-    const real dar6 = dar4*dar2;
-    const real invR2 = invR*invR;
-    const real expDar2 = EXP(-dar2);
-    const float2 sigExpProd = SIGMA_EPSILON1*SIGMA_EPSILON2;
-    const real c6 = 64*sigExpProd.x*sigExpProd.x*sigExpProd.x*sigExpProd.y;
-    const real coef = invR2*invR2*invR2*c6;
-    const real eprefac = 1.0f + dar2 + 0.5f*dar4;
-    const real dprefac = eprefac + dar6/6.0f;
-    // The multiplicative grid term
-    real ljPmeEnergy = coef*(1.0f - expDar2*eprefac);
-    tempForce += 6.0f*coef*(1.0f - expDar2*dprefac);
-    // The potential shift accounts for the step at the cutoff introduced by the
-    // transition from additive to multiplicative combintion rules and is only
-    // needed for the real (not excluded) terms.  By addin these terms to ljEnergy
-    // instead of tempEnergy here, the includeInteraction mask is correctly applied.
-    sig2 = sig*sig;
-    sig6 = sig2*sig2*sig2*INVCUT6;
-    epssig6 = eps*sig6;
-    // The additive part of the potential shift
-    ljPmeEnergy += epssig6*(1.0f - sig6);
-    // The multiplicative part of the potential shift
-    ljPmeEnergy += MULTSHIFT6*c6;
-    ljEnergy += includeInteraction ? ljPmeEnergy : 0;
+        // The multiplicative term to correct for the multiplicative terms that are always
+        // present in reciprocal space.
+        const real dispersionAlphaR = EWALD_DISPERSION_ALPHA*r;
+        const real dar2 = dispersionAlphaR*dispersionAlphaR;
+        const real dar4 = dar2*dar2;
+        const real dar6 = dar4*dar2;
+        const real invR2 = invR*invR;
+        const real expDar2 = EXP(-dar2);
+        const real c6 = C6_1*C6_2;
+        const real coef = invR2*invR2*invR2*c6;
+        const real eprefac = 1.0f + dar2 + 0.5f*dar4;
+        const real dprefac = eprefac + dar6/6.0f;
+        // The multiplicative grid term
+        real ljPmeEnergy = coef*(1.0f - expDar2*eprefac);
+        tempForce += 6.0f*coef*(1.0f - expDar2*dprefac);
+        // The potential shift accounts for the step at the cutoff introduced by the
+        // transition from additive to multiplicative combintion rules and is only
+        // needed for the real (not excluded) terms.  By addin these terms to ljEnergy
+        // instead of tempEnergy here, the includeInteraction mask is correctly applied.
+        sig2 = sig*sig;
+        sig6 = sig2*sig2*sig2*INVCUT6;
+        epssig6 = eps*sig6;
+        // The additive part of the potential shift
+        ljPmeEnergy += epssig6*(1.0f - sig6);
+        // The multiplicative part of the potential shift
+        ljPmeEnergy += MULTSHIFT6*c6;
+        ljEnergy += includeInteraction ? ljPmeEnergy : 0;
 #endif
-    tempForce *= ljLambda;
-    tempForce += clLambda*prefactor*(erfcAlphaR+alphaR*expAlphaRSqr*TWO_OVER_SQRT_PI);
-    tempEnergy += ljLambda*ljEnergy + clLambda*clEnergy;
+        tempForce *= ljLambda;
+        tempForce += clLambda*prefactor*(erfcAlphaR+alphaR*expAlphaRSqr*TWO_OVER_SQRT_PI);
+        tempEnergy += ljLambda*ljEnergy + clLambda*clEnergy;
 #else
-    tempForce = clLambda*prefactor*(erfcAlphaR+alphaR*expAlphaRSqr*TWO_OVER_SQRT_PI);
-    tempEnergy += clLambda*clEnergy;
+        tempForce = clLambda*prefactor*(erfcAlphaR+alphaR*expAlphaRSqr*TWO_OVER_SQRT_PI);
+        tempEnergy += clLambda*clEnergy;
 #endif
 #else
 #ifdef USE_CUTOFF
-    unsigned int includeInteraction = (!isExcluded && r2 < CUTOFF_SQUARED);
+        unsigned int includeInteraction = (!isExcluded && r2 < CUTOFF_SQUARED);
 #else
-    unsigned int includeInteraction = (!isExcluded);
+        unsigned int includeInteraction = (!isExcluded);
 #endif
-    real tempForce = 0.0f;
+        real tempForce = 0.0f;
 #if HAS_LENNARD_JONES
-    real sig = SIGMA_EPSILON1.x + SIGMA_EPSILON2.x;
-    real sig2 = invR*sig;
-    sig2 *= sig2;
-    real sig6 = sig2*sig2*sig2;
-    real epssig6 = sig6*(SIGMA_EPSILON1.y*SIGMA_EPSILON2.y);
-    tempForce = epssig6*(12.0f*sig6 - 6.0f);
-    real ljEnergy = includeInteraction ? epssig6*(sig6 - 1) : 0;
-    #if USE_LJ_SWITCH
-    if (r > LJ_SWITCH_CUTOFF) {
-        real x = r-LJ_SWITCH_CUTOFF;
-        real switchValue = 1+x*x*x*(LJ_SWITCH_C3+x*(LJ_SWITCH_C4+x*LJ_SWITCH_C5));
-        real switchDeriv = x*x*(3*LJ_SWITCH_C3+x*(4*LJ_SWITCH_C4+x*5*LJ_SWITCH_C5));
-        tempForce = tempForce*switchValue - ljEnergy*switchDeriv*r;
-        ljEnergy *= switchValue;
-    }
-    #endif
-    tempForce *= ljLambda;
-    tempEnergy += ljLambda*ljEnergy;
+        real sig = SIGMA_EPSILON1.x + SIGMA_EPSILON2.x;
+        real sig2 = invR*sig;
+        sig2 *= sig2;
+        real sig6 = sig2*sig2*sig2;
+        real eps = SIGMA_EPSILON1.y*SIGMA_EPSILON2.y;
+        real epssig6 = sig6*eps;
+        tempForce = epssig6*(12.0f*sig6 - 6.0f);
+        real ljEnergy = includeInteraction ? epssig6*(sig6 - 1) : 0;
+        #if USE_SOFT_CORE
+        // In soft-core slices, (r/sigma)^6 is replaced by shift+(r/sigma)^6.  Writing
+        // u = 1/(shift+(r/sigma)^6) in terms of sig6 avoids 0/0 for a zero sigma.
+        real softCoreShift = 0, softCoreShiftDerivative = 0, ljShiftDerivative = 0;
+        COMPUTE_SOFT_CORE_SHIFT
+        if (softCoreShift != 0 || softCoreShiftDerivative != 0) {
+            real q = RECIP(1.0f+softCoreShift*sig6);
+            real u = sig6*q;
+            tempForce = eps*u*q*(12.0f*u - 6.0f);
+            ljEnergy = includeInteraction ? eps*u*(u - 1.0f) : 0;
+            ljShiftDerivative = includeInteraction ? eps*u*u*(1.0f - 2.0f*u)*softCoreShiftDerivative : 0;
+        }
+        #endif
+        #if USE_LJ_SWITCH
+        if (r > LJ_SWITCH_CUTOFF) {
+            real x = r-LJ_SWITCH_CUTOFF;
+            real switchValue = 1+x*x*x*(LJ_SWITCH_C3+x*(LJ_SWITCH_C4+x*LJ_SWITCH_C5));
+            real switchDeriv = x*x*(3*LJ_SWITCH_C3+x*(4*LJ_SWITCH_C4+x*5*LJ_SWITCH_C5));
+            tempForce = tempForce*switchValue - ljEnergy*switchDeriv*r;
+            ljEnergy *= switchValue;
+            #if USE_SOFT_CORE
+            ljShiftDerivative *= switchValue;
+            #endif
+        }
+        #endif
+        #if USE_SOFT_CORE
+        real ljDerivative = ljEnergy + ljLambda*ljShiftDerivative;
+        #endif
+        tempForce *= ljLambda;
+        tempEnergy += ljLambda*ljEnergy;
 #endif
 #if HAS_COULOMB
-  #ifdef USE_CUTOFF
-    const real prefactor = ONE_4PI_EPS0*CHARGE1*CHARGE2;
-    real clEnergy = includeInteraction ? prefactor*(invR + REACTION_FIELD_K*r2 - REACTION_FIELD_C) : 0;
-    tempForce += clLambda*prefactor*(invR - 2.0f*REACTION_FIELD_K*r2);
-  #else
-    const real prefactor = ONE_4PI_EPS0*CHARGE1*CHARGE2*invR;
-    real clEnergy = includeInteraction ? prefactor : 0;
-    tempForce += clLambda*prefactor;
-  #endif
-    tempEnergy += clLambda*clEnergy;
+      #ifdef USE_CUTOFF
+        const real prefactor = ONE_4PI_EPS0*CHARGE1*CHARGE2;
+        real clEnergy = includeInteraction ? prefactor*(invR + REACTION_FIELD_K*r2 - REACTION_FIELD_C) : 0;
+        tempForce += clLambda*prefactor*(invR - 2.0f*REACTION_FIELD_K*r2);
+      #else
+        const real prefactor = ONE_4PI_EPS0*CHARGE1*CHARGE2*invR;
+        real clEnergy = includeInteraction ? prefactor : 0;
+        tempForce += clLambda*prefactor;
+      #endif
+        tempEnergy += clLambda*clEnergy;
 #endif
 #endif
-dEdR += includeInteraction ? tempForce*invR*invR : 0;
-COMPUTE_DERIVATIVES
+        dEdR += includeInteraction ? tempForce*invR*invR : 0;
+        COMPUTE_DERIVATIVES
+    }
 }
@@ -0,0 +1,35 @@
+{
+    // Compact variant for the reaction-field methods, used when there are no soft-core slices
+    // and no derivatives are requested.  The scaling parameters are folded into the prefactors,
+    // so that a pair costs about as much as in a NonbondedForce.
+
+    int subsetMax = max(SUBSET1, SUBSET2);
+    int slice = subsetMax*(subsetMax+1)/2+min(SUBSET1, SUBSET2);
+    unsigned int includeInteraction = (!isExcluded && r2 < CUTOFF_SQUARED);
+    real tempForce = 0.0f;
+#if HAS_LENNARD_JONES
+    real sig = SIGMA_EPSILON1.x + SIGMA_EPSILON2.x;
+    real sig2 = invR*sig;
+    sig2 *= sig2;
+    real sig6 = sig2*sig2*sig2;
+    real epssig6 = LAMBDA[slice].y*SIGMA_EPSILON1.y*SIGMA_EPSILON2.y*sig6;
+    tempForce = epssig6*(12.0f*sig6 - 6.0f);
+    real ljEnergy = epssig6*(sig6 - 1.0f);
+    #if USE_LJ_SWITCH
+    if (r > LJ_SWITCH_CUTOFF) {
+        real x = r-LJ_SWITCH_CUTOFF;
+        real switchValue = 1+x*x*x*(LJ_SWITCH_C3+x*(LJ_SWITCH_C4+x*LJ_SWITCH_C5));
+        real switchDeriv = x*x*(3*LJ_SWITCH_C3+x*(4*LJ_SWITCH_C4+x*5*LJ_SWITCH_C5));
+        tempForce = tempForce*switchValue - ljEnergy*switchDeriv*r;
+        ljEnergy *= switchValue;
+    }
+    #endif
+    tempEnergy += includeInteraction ? ljEnergy : 0;
+#endif
+#if HAS_COULOMB
+    const real prefactor = LAMBDA[slice].x*ONE_4PI_EPS0*CHARGE1*CHARGE2;
+    tempForce += prefactor*(invR - 2.0f*REACTION_FIELD_K*r2);
+    tempEnergy += includeInteraction ? prefactor*(invR + REACTION_FIELD_K*r2 - REACTION_FIELD_C) : 0;
+#endif
+    dEdR += includeInteraction ? tempForce*invR*invR : 0;
+}
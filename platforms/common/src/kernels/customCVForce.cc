@@ -1,19 +1,40 @@
+// The forces of the CVs are stored either in the fixed point format of the force buffers, or
+// compressed to 32 bit floats in the same units.  In both cases, LOAD_CV_FORCE() gives them
+// in fixed point units, ready to be weighted and added to the force buffer.
+
+#ifdef COMPRESSED_FORCES
+typedef float cvforce;
+#define STORE_CV_FORCE(f) ((float) ((f)*(1/(real) 0x100000000)))
+#define LOAD_CV_FORCE(f) ((f)*(real) 0x100000000)
+#else
+typedef mm_long cvforce;
+#define STORE_CV_FORCE(f) (f)
+#define LOAD_CV_FORCE(f) (f)
+#endif
+
 /**
- * Copy the positions and velocities to the inner context.
+ * Copy the positions to the inner context, and the velocities if some inner Force may read them.
+ * innerIndex gives the position in the inner context of the atom at each position of this one,
+ * and is not read if both contexts have the same order, which makes the copy contiguous.
  */
-KERNEL void copyState(GLOBAL real4* RESTRICT posq, GLOBAL real4* RESTRICT innerPosq,
+KERNEL void copyState(int sameOrder, GLOBAL real4* RESTRICT posq, GLOBAL real4* RESTRICT innerPosq,
 #ifdef USE_MIXED_PRECISION
         GLOBAL real4* RESTRICT posqCorrection, GLOBAL real4* RESTRICT innerPosqCorrection,
 #endif
-        GLOBAL mixed4* RESTRICT velm, GLOBAL mixed4* RESTRICT innerVelm, GLOBAL int* RESTRICT atomOrder, GLOBAL int* RESTRICT innerInvAtomOrder, int numAtoms) {
+#ifdef COPY_VELOCITIES
+        GLOBAL mixed4* RESTRICT velm, GLOBAL mixed4* RESTRICT innerVelm,
+#endif
+        GLOBAL const int* RESTRICT innerIndex, int numAtoms) {
     for (int i = GLOBAL_ID; i < numAtoms; i += GLOBAL_SIZE) {
-        int index = innerInvAtomOrder[atomOrder[i]];
+        int index = (sameOrder ? i : innerIndex[i]);
         real4 p = posq[i];
         p.w = innerPosq[index].w;
         innerPosq[index] = p;
+#ifdef COPY_VELOCITIES
         mixed4 v = velm[i];
         v.w = innerVelm[index].w;
         innerVelm[index] = v;
+#endif
 #ifdef USE_MIXED_PRECISION
         innerPosqCorrection[index] = posqCorrection[i];
 #endif
@@ -21,24 +42,108 @@ KERNEL void copyState(GLOBAL real4* RESTRICT posq, GLOBAL real4* RESTRICT innerP
 }
 
 /**
- * Copy the forces back to the main context.
+ * Copy the forces of one CV back to its slice of the strided CV force buffer.  The inner
+ * context may have more atoms, which are the dummy particles of the batches of CVs.
  */
-KERNEL void copyForces(GLOBAL mm_long* RESTRICT forces, GLOBAL int* RESTRICT invAtomOrder, GLOBAL mm_long* RESTRICT innerForces,
-        GLOBAL int* RESTRICT innerAtomOrder, int numAtoms, int paddedNumAtoms) {
+KERNEL void copyForces(int sameOrder, GLOBAL cvforce* RESTRICT cvForces, int cvIndex, GLOBAL mm_long* RESTRICT innerForces,
+        GLOBAL const int* RESTRICT innerIndex, int numAtoms, int paddedNumAtoms, int innerPaddedNumAtoms) {
+    GLOBAL cvforce* RESTRICT forces = cvForces+cvIndex*3*paddedNumAtoms;
     for (int i = GLOBAL_ID; i < numAtoms; i += GLOBAL_SIZE) {
-        int index = invAtomOrder[innerAtomOrder[i]];
-        forces[index] = innerForces[i];
-        forces[index+paddedNumAtoms] = innerForces[i+paddedNumAtoms];
-        forces[index+paddedNumAtoms*2] = innerForces[i+paddedNumAtoms*2];
+        int index = (sameOrder ? i : innerIndex[i]);
+        forces[i] = STORE_CV_FORCE(innerForces[index]);
+        forces[i+paddedNumAtoms] = STORE_CV_FORCE(innerForces[index+innerPaddedNumAtoms]);
+        forces[i+paddedNumAtoms*2] = STORE_CV_FORCE(innerForces[index+innerPaddedNumAtoms*2]);
     }
 }
 
 /**
- * Add all the forces from the CVs.
+ * Add the forces of all CVs, weighted by the derivatives of the energy with respect to them,
+ * in a single pass over the strided CV force buffer.  CVs with vanishing weights are skipped.
  */
-KERNEL void addForces(GLOBAL mm_long* RESTRICT forces, int bufferSize
-    PARAMETER_ARGUMENTS) {
+KERNEL void addForces(GLOBAL mm_long* RESTRICT forces, GLOBAL const cvforce* RESTRICT cvForces, GLOBAL const real* RESTRICT dEdV,
+        GLOBAL const int* RESTRICT denseCVs, int bufferSize, int numDenseCVs) {
     for (int i = GLOBAL_ID; i < bufferSize; i += GLOBAL_SIZE) {
-        ADD_FORCES
+        mm_long sum = 0;
+        for (int j = 0; j < numDenseCVs; j++) {
+            real weight = dEdV[denseCVs[j]];
+            if (weight != 0)
+                sum += (mm_long) (LOAD_CV_FORCE(cvForces[j*bufferSize+i])*weight);
+        }
+        forces[i] += sum;
+    }
+}
+
+/**
+ * Copy the forces that a localized CV exerts on the atoms of its footprint, which occupy the
+ * entries [start, end) of the sparse arrays.
+ */
+KERNEL void copySparseForces(GLOBAL mm_long* RESTRICT sparseForces, GLOBAL const int* RESTRICT sparseAtoms, int start, int end,
+        GLOBAL mm_long* RESTRICT innerForces, GLOBAL int* RESTRICT innerInvAtomOrder, int innerPaddedNumAtoms) {
+    for (int i = start+GLOBAL_ID; i < end; i += GLOBAL_SIZE) {
+        int index = innerInvAtomOrder[sparseAtoms[i]];
+        sparseForces[3*i] = innerForces[index];
+        sparseForces[3*i+1] = innerForces[index+innerPaddedNumAtoms];
+        sparseForces[3*i+2] = innerForces[index+innerPaddedNumAtoms*2];
     }
-}
\ No newline at end of file
+}
+
+/**
+ * Add the forces of all localized CVs.  Footprints may overlap, so atomic additions are used.
+ */
+KERNEL void addSparseForces(GLOBAL mm_ulong* RESTRICT forces, GLOBAL const mm_long* RESTRICT sparseForces,
+        GLOBAL const int* RESTRICT sparseAtoms, GLOBAL const int* RESTRICT sparseCVs, GLOBAL const real* RESTRICT dEdV,
+        GLOBAL const int* RESTRICT invAtomOrder, int numEntries, int paddedNumAtoms) {
+    for (int i = GLOBAL_ID; i < numEntries; i += GLOBAL_SIZE) {
+        real weight = dEdV[sparseCVs[i]];
+        if (weight != 0) {
+            int index = invAtomOrder[sparseAtoms[i]];
+            ATOMIC_ADD(&forces[index], (mm_ulong) ((mm_long) (sparseForces[3*i]*weight)));
+            ATOMIC_ADD(&forces[index+paddedNumAtoms], (mm_ulong) ((mm_long) (sparseForces[3*i+1]*weight)));
+            ATOMIC_ADD(&forces[index+paddedNumAtoms*2], (mm_ulong) ((mm_long) (sparseForces[3*i+2]*weight)));
+        }
+    }
+}
+
+/**
+ * Set the x displacements of the particles of a batch of CVs from its origin particle, either
+ * to 1 or to the derivatives of the energy with respect to the CVs.
+ */
+KERNEL void setBatchDisplacements(int origin, int firstVariable, int numVariables, int useDerivatives, GLOBAL real4* RESTRICT innerPosq,
+#ifdef USE_MIXED_PRECISION
+        GLOBAL real4* RESTRICT innerPosqCorrection,
+#endif
+        GLOBAL const int* RESTRICT innerInvAtomOrder, GLOBAL const real* RESTRICT dEdV) {
+    int originIndex = innerInvAtomOrder[origin];
+    real x = innerPosq[originIndex].x;
+    for (int i = GLOBAL_ID; i < numVariables; i += GLOBAL_SIZE) {
+        int index = innerInvAtomOrder[origin+1+i];
+        innerPosq[index].x = x+(useDerivatives ? dEdV[firstVariable+i] : (real) 1);
+#ifdef USE_MIXED_PRECISION
+        innerPosqCorrection[index].x = innerPosqCorrection[originIndex].x;
+#endif
+    }
+}
+
+/**
+ * Copy the x forces on the particles of a batch of CVs, which are minus the values of the CVs
+ * when the displacements are 1.
+ */
+KERNEL void copyBatchForces(int origin, int firstValue, int numVariables, GLOBAL mm_long* RESTRICT batchForces,
+        GLOBAL const mm_long* RESTRICT innerForces, GLOBAL const int* RESTRICT innerInvAtomOrder) {
+    for (int i = GLOBAL_ID; i < numVariables; i += GLOBAL_SIZE)
+        batchForces[firstValue+i] = innerForces[innerInvAtomOrder[origin+1+i]];
+}
+
+/**
+ * Add the forces of a batch of CVs, which are already weighted by the derivatives of the
+ * energy with respect to them.
+ */
+KERNEL void addBatchForces(int sameOrder, GLOBAL mm_long* RESTRICT forces, GLOBAL const mm_long* RESTRICT innerForces,
+        GLOBAL const int* RESTRICT innerIndex, int numAtoms, int paddedNumAtoms, int innerPaddedNumAtoms) {
+    for (int i = GLOBAL_ID; i < numAtoms; i += GLOBAL_SIZE) {
+        int index = (sameOrder ? i : innerIndex[i]);
+        forces[i] += innerForces[index];
+        forces[i+paddedNumAtoms] += innerForces[index+innerPaddedNumAtoms];
+        forces[i+paddedNumAtoms*2] += innerForces[index+innerPaddedNumAtoms*2];
+    }
+}
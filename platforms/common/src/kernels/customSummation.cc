@@ -0,0 +1,54 @@
+#ifdef DETERMINISTIC
+    typedef mm_long accum;
+    #define ACCUMULATE(x) realToFixedPoint(x)
+#else
+    typedef mixed accum;
+    #define ACCUMULATE(x) (x)
+#endif
+
+/**
+ * Evaluate a CustomSummation at a set of points.  Each thread group writes the partial
+ * sums of the value and, if requested, of the NUM_ARGS gradient components over the
+ * terms it has processed.  If DETERMINISTIC is defined, every term is converted to fixed
+ * point before it is added, so that the sums do not depend on the order of the additions.
+ */
+KERNEL void evaluateSummation(GLOBAL const real* RESTRICT termParams, GLOBAL const real* RESTRICT overall,
+        GLOBAL const real* RESTRICT points, GLOBAL accum* RESTRICT partialSums, int numTerms, int numPoints,
+        int computeGradient) {
+    LOCAL accum buffer[WORK_GROUP_SIZE];
+    const int width = (computeGradient ? NUM_ARGS+1 : 1);
+    for (int point = 0; point < numPoints; point++) {
+        real pointArgs[NUM_ARGS];
+        for (int j = 0; j < NUM_ARGS; j++)
+            pointArgs[j] = points[point*NUM_ARGS+j];
+        accum sum[NUM_ARGS+1];
+        for (int j = 0; j <= NUM_ARGS; j++)
+            sum[j] = 0;
+        for (int term = GLOBAL_ID; term < numTerms; term += GLOBAL_SIZE) {
+            real termValue[NUM_ARGS+1];
+            if (computeGradient) {
+                COMPUTE_VALUE_AND_GRADIENT
+            }
+            else {
+                COMPUTE_VALUE
+            }
+            for (int j = 0; j < width; j++)
+                sum[j] += ACCUMULATE(termValue[j]);
+        }
+
+        // Reduce the sums within the thread group.
+
+        for (int j = 0; j < width; j++) {
+            buffer[LOCAL_ID] = sum[j];
+            SYNC_THREADS;
+            for (int offset = WORK_GROUP_SIZE/2; offset > 0; offset >>= 1) {
+                if (LOCAL_ID < offset)
+                    buffer[LOCAL_ID] += buffer[LOCAL_ID+offset];
+                SYNC_THREADS;
+            }
+            if (LOCAL_ID == 0)
+                partialSums[(GROUP_ID*numPoints+point)*(NUM_ARGS+1)+j] = buffer[0];
+            SYNC_THREADS;
+        }
+    }
+}
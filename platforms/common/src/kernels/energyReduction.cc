@@ -0,0 +1,37 @@
+#ifdef USE_SUBGROUP_REDUCTION
+#pragma OPENCL EXTENSION cl_khr_subgroups : enable
+#endif
+
+/**
+ * Add up a value over a thread group of groupSize threads, which must be a power of 2,
+ * returning the sum to the first thread.  The buffer must hold groupSize values, and can be
+ * reused as soon as this returns.
+ *
+ * With sub-group reductions, each sub-group (a wavefront of 64 threads on AMD GPUs) reduces
+ * its values in registers, and only the partial sums go through local memory, so that two
+ * barriers are needed rather than one per level of a tree over the whole group.
+ */
+DEVICE mixed reduceOverGroup(mixed value, LOCAL_ARG mixed* RESTRICT buffer, int groupSize) {
+#ifdef USE_SUBGROUP_REDUCTION
+    mixed sum = sub_group_reduce_add(value);
+    if (get_sub_group_local_id() == 0)
+        buffer[get_sub_group_id()] = sum;
+    SYNC_THREADS;
+    if (LOCAL_ID == 0)
+        for (int i = 1; i < get_num_sub_groups(); i++)
+            sum += buffer[i];
+    SYNC_THREADS;
+    return sum;
+#else
+    buffer[LOCAL_ID] = value;
+    SYNC_THREADS;
+    for (int offset = groupSize/2; offset > 0; offset >>= 1) {
+        if (LOCAL_ID < offset)
+            buffer[LOCAL_ID] += buffer[LOCAL_ID+offset];
+        SYNC_THREADS;
+    }
+    mixed sum = buffer[0];
+    SYNC_THREADS;
+    return sum;
+#endif
+}
@@ -3,127 +3,209 @@ DEVICE real2 multofReal2(real2 a, real2 b) {
 }
 
 /**
- * Precompute the cosine and sine sums which appear in each force term.
+ * Find the wave vector that corresponds to a given index in the list of wave vectors of
+ * the half space rx >= 0, from which the vector (0, 0, 0) and its mirror images are
+ * excluded.
+ */
+
+DEVICE real3 ewaldWaveVector(int index, real3 reciprocalBoxSize) {
+    const int ksizey = 2*KMAX_Y-1;
+    const int ksizez = 2*KMAX_Z-1;
+    index += (KMAX_Y-1)*ksizez+KMAX_Z;
+    int rx = index/(ksizey*ksizez);
+    int remainder = index - rx*ksizey*ksizez;
+    int ry = remainder/ksizez;
+    int rz = remainder - ry*ksizez - KMAX_Z + 1;
+    ry += -KMAX_Y + 1;
+    return make_real3(rx*reciprocalBoxSize.x, ry*reciprocalBoxSize.y, rz*reciprocalBoxSize.z);
+}
+
+/**
+ * Compute the sums of all subsets for one wave vector, and add its contribution to the energy
+ * of every slot.  The return value is the prefactor of the wave vector.
+ */
+
+DEVICE real computeEwaldSums(real3 k, GLOBAL const real4* RESTRICT posq, GLOBAL const int* RESTRICT subsets, real2* sum, mixed* energy) {
+    for (int i = 0; i < NUM_SUBSETS; i++)
+        sum[i] = make_real2(0);
+    for (int atom = 0; atom < NUM_ATOMS; atom++) {
+        real4 apos = posq[atom];
+        real phase = apos.x*k.x;
+        real2 structureFactor = make_real2(COS(phase), SIN(phase));
+        phase = apos.y*k.y;
+        structureFactor = multofReal2(structureFactor, make_real2(COS(phase), SIN(phase)));
+        phase = apos.z*k.z;
+        structureFactor = multofReal2(structureFactor, make_real2(COS(phase), SIN(phase)));
+        sum[subsets[atom]] += apos.w*structureFactor;
+    }
+    real k2 = k.x*k.x + k.y*k.y + k.z*k.z;
+    real ak = EXP(k2*EXP_COEFFICIENT) / k2;
+    for (int i = 0; i < NUM_SUBSETS; i++) {
+        real2 sum_i = sum[i];
+        for (int j = 0; j < i; j++)
+            energy[SLICE_SLOT(i*(i+1)/2+j)] += 2*ak*(sum[j].x*sum_i.x + sum[j].y*sum_i.y);
+        energy[SLICE_SLOT(i*(i+3)/2)] += ak*(sum_i.x*sum_i.x + sum_i.y*sum_i.y);
+    }
+    return ak;
+}
+
+/**
+ * Combine the sums that act on atoms of subset i.
+ */
+
+DEVICE real2 packEwaldSums(int i, const real2* sum, GLOBAL const real2* RESTRICT sliceLambdas) {
+    real2 packed = make_real2(0);
+    for (int j = 0; j < NUM_SUBSETS; j++) {
+        int slice = j > i ? j*(j+1)/2+i : i*(i+1)/2+j;
+        packed += sliceLambdas[slice].x*sum[j];
+    }
+    return packed;
+}
+
+/**
+ * Precompute the cosine and sine sums which appear in each force term.  For every wave
+ * vector, the sums of all subsets are combined with the slice lambdas and the force
+ * prefactor and stored as one packed entry per subset, so that the force of an atom of
+ * subset i depends only on the i-th entry.
+ *
+ * Only the numKVectors wave vectors starting at firstKVector are processed, so that the host
+ * can stream a long list of wave vectors through a smaller buffer of sums.  The energies of
+ * a chunk are added to those of the previous ones, except for the first chunk.
  */
 
 KERNEL void calculateEwaldCosSinSums(GLOBAL mixed* RESTRICT energyBuffer, GLOBAL const real4* RESTRICT posq,
-                GLOBAL const int* RESTRICT subsets, GLOBAL real2* RESTRICT cosSinSum, real4 periodicBoxSize) {
-    const unsigned int ksizex = 2*KMAX_X-1;
-    const unsigned int ksizey = 2*KMAX_Y-1;
-    const unsigned int ksizez = 2*KMAX_Z-1;
-    const unsigned int totalK = ksizex*ksizey*ksizez;
+                GLOBAL const int* RESTRICT subsets, GLOBAL real2* RESTRICT cosSinSum, GLOBAL const real2* RESTRICT sliceLambdas,
+                real4 periodicBoxSize, int firstKVector, int numKVectors) {
     real3 reciprocalBoxSize = make_real3(2*M_PI/periodicBoxSize.x, 2*M_PI/periodicBoxSize.y, 2*M_PI/periodicBoxSize.z);
     real reciprocalCoefficient = ONE_4PI_EPS0*4*M_PI/(periodicBoxSize.x*periodicBoxSize.y*periodicBoxSize.z);
-    unsigned int index = GLOBAL_ID;
-    mixed energy[NUM_SLICES] = {0};
-    while (index < (KMAX_Y-1)*ksizez+KMAX_Z)
-        index += GLOBAL_SIZE;
-    while (index < totalK) {
-        // Find the wave vector (kx, ky, kz) this index corresponds to.
-
-        int rx = index/(ksizey*ksizez);
-        int remainder = index - rx*ksizey*ksizez;
-        int ry = remainder/ksizez;
-        int rz = remainder - ry*ksizez - KMAX_Z + 1;
-        ry += -KMAX_Y + 1;
-        real kx = rx*reciprocalBoxSize.x;
-        real ky = ry*reciprocalBoxSize.y;
-        real kz = rz*reciprocalBoxSize.z;
-
-        // Compute the sum for this wave vector.
-
-        real2 sum[NUM_SUBSETS] = {make_real2(0)};
-        for (int atom = 0; atom < NUM_ATOMS; atom++) {
-            real4 apos = posq[atom];
-            real phase = apos.x*kx;
-            real2 structureFactor = make_real2(COS(phase), SIN(phase));
-            phase = apos.y*ky;
-            structureFactor = multofReal2(structureFactor, make_real2(COS(phase), SIN(phase)));
-            phase = apos.z*kz;
-            structureFactor = multofReal2(structureFactor, make_real2(COS(phase), SIN(phase)));
-            sum[subsets[atom]] += apos.w*structureFactor;
-        }
+    mixed energy[NUM_ENERGY_SLOTS] = {0};
+    for (int index = GLOBAL_ID; index < numKVectors; index += GLOBAL_SIZE) {
+        real3 k = ewaldWaveVector(firstKVector+index, reciprocalBoxSize);
+        real2 sum[NUM_SUBSETS];
+        real ak = computeEwaldSums(k, posq, subsets, sum, energy);
+        for (int i = 0; i < NUM_SUBSETS; i++)
+            cosSinSum[NUM_SUBSETS*index+i] = 2*reciprocalCoefficient*ak*packEwaldSums(i, sum, sliceLambdas);
+    }
+
+    // Reduce the energies within the thread group, so that the buffer holds one entry per
+    // group rather than one per thread.
 
-        real k2 = kx*kx + ky*ky + kz*kz;
-        real ak = EXP(k2*EXP_COEFFICIENT) / k2;
+    LOCAL mixed reductionBuffer[ENERGY_GROUP_SIZE];
+    for (int slot = 0; slot < NUM_ENERGY_SLOTS; slot++) {
+        mixed sum = reduceOverGroup(reciprocalCoefficient*energy[slot], reductionBuffer, ENERGY_GROUP_SIZE);
+        if (LOCAL_ID == 0)
+            energyBuffer[GROUP_ID*NUM_ENERGY_SLOTS+slot] = (firstKVector == 0 ? 0 : energyBuffer[GROUP_ID*NUM_ENERGY_SLOTS+slot]) + sum;
+    }
+}
 
-        for (int j = 0; j < NUM_SUBSETS; j++) {
-            real2 sum_j = sum[j];
+/**
+ * Compute the reciprocal space part of the Ewald force, using the precomputed sums from the
+ * previous routine for the same chunk of wave vectors.  The wave vectors and their packed
+ * sums are processed in tiles of EWALD_TILE_SIZE, which the threads of a group load
+ * cooperatively into local memory and then share among all the atoms they are evaluating.
+ * This kernel must be launched with EWALD_TILE_SIZE threads per group.
+ */
 
-            cosSinSum[NUM_SUBSETS*index+j] = sum_j;
+KERNEL void calculateEwaldForces(GLOBAL mm_long* RESTRICT forceBuffers, GLOBAL const real4* RESTRICT posq, GLOBAL const real2* RESTRICT cosSinSum,
+            GLOBAL const int* RESTRICT subsets, real4 periodicBoxSize, int firstKVector, int numKVectors) {
+    LOCAL real3 tileWaveVectors[EWALD_TILE_SIZE];
+    LOCAL real2 tileSums[EWALD_TILE_SIZE*NUM_SUBSETS];
+    real3 reciprocalBoxSize = make_real3(2*M_PI/periodicBoxSize.x, 2*M_PI/periodicBoxSize.y, 2*M_PI/periodicBoxSize.z);
+    for (int base = GROUP_ID*EWALD_TILE_SIZE; base < NUM_ATOMS; base += GLOBAL_SIZE) {
+        int atom = base+LOCAL_ID;
+        bool isValid = (atom < NUM_ATOMS);
+        real4 apos = (isValid ? posq[atom] : make_real4(0));
+        int i = (isValid ? subsets[atom] : 0);
+        real3 force = make_real3(0);
+
+        // Loop over all wave vectors, one tile at a time.
+
+        for (int tileStart = 0; tileStart < numKVectors; tileStart += EWALD_TILE_SIZE) {
+            int tileSize = min(EWALD_TILE_SIZE, numKVectors-tileStart);
+            SYNC_THREADS;
+            if (LOCAL_ID < tileSize) {
+                int index = tileStart+LOCAL_ID;
+                tileWaveVectors[LOCAL_ID] = ewaldWaveVector(firstKVector+index, reciprocalBoxSize);
+                for (int j = 0; j < NUM_SUBSETS; j++)
+                    tileSums[LOCAL_ID*NUM_SUBSETS+j] = cosSinSum[NUM_SUBSETS*index+j];
+            }
+            SYNC_THREADS;
+            for (int m = 0; m < tileSize; m++) {
+                real3 k = tileWaveVectors[m];
+                real phase = apos.x*k.x + apos.y*k.y + apos.z*k.z;
+                real2 sum_i = tileSums[m*NUM_SUBSETS+i];
+                real dEdR = apos.w*(sum_i.x*SIN(phase) - sum_i.y*COS(phase));
+                force.x += dEdR*k.x;
+                force.y += dEdR*k.y;
+                force.z += dEdR*k.z;
+            }
+        }
 
-            // Compute the contribution to the energy.
+        // Record the force on the atom.
 
-            for (int i = 0; i < j; i++)
-                energy[j*(j+1)/2+i] += 2*ak*(sum[i].x*sum_j.x + sum[i].y*sum_j.y);
-            energy[j*(j+3)/2] += ak*(sum_j.x*sum_j.x + sum_j.y*sum_j.y);
+        if (isValid) {
+            forceBuffers[atom] += realToFixedPoint(force.x);
+            forceBuffers[atom+PADDED_NUM_ATOMS] += realToFixedPoint(force.y);
+            forceBuffers[atom+2*PADDED_NUM_ATOMS] += realToFixedPoint(force.z);
         }
-        index += GLOBAL_SIZE;
     }
-    for (int slice = 0; slice < NUM_SLICES; slice++)
-        energyBuffer[GLOBAL_ID*NUM_SLICES+slice] = reciprocalCoefficient*energy[slice];
 }
 
 /**
- * Compute the reciprocal space part of the Ewald force, using the precomputed sums from the
- * previous routine.
+ * Compute both the energy and the forces of the Ewald method in a single launch, for small
+ * systems whose cost is dominated by launch latency.  The groups stay resident and take
+ * tiles of EWALD_TILE_SIZE wave vectors in turn.  The threads of a group compute the sums of
+ * one wave vector each and keep them in local memory, and then add the forces of the whole
+ * tile to all the atoms, so that the sums never go through global memory.  This kernel must
+ * be launched with EWALD_TILE_SIZE threads per group.
  */
 
-KERNEL void calculateEwaldForces(GLOBAL mm_long* RESTRICT forceBuffers, GLOBAL const real4* RESTRICT posq, GLOBAL const real2* RESTRICT cosSinSum,
-            GLOBAL const int* RESTRICT subsets, GLOBAL const real2* RESTRICT sliceLambdas, real4 periodicBoxSize) {
-    unsigned int atom = GLOBAL_ID;
+KERNEL void calculateEwaldSumsAndForces(GLOBAL mixed* RESTRICT energyBuffer, GLOBAL mm_long* RESTRICT forceBuffers, GLOBAL const real4* RESTRICT posq,
+            GLOBAL const int* RESTRICT subsets, GLOBAL const real2* RESTRICT sliceLambdas, real4 periodicBoxSize, int numKVectors, int includeForces) {
+    LOCAL real3 tileWaveVectors[EWALD_TILE_SIZE];
+    LOCAL real2 tileSums[EWALD_TILE_SIZE*NUM_SUBSETS];
+    LOCAL mixed reductionBuffer[EWALD_TILE_SIZE];
     real3 reciprocalBoxSize = make_real3(2*M_PI/periodicBoxSize.x, 2*M_PI/periodicBoxSize.y, 2*M_PI/periodicBoxSize.z);
     real reciprocalCoefficient = ONE_4PI_EPS0*4*M_PI/(periodicBoxSize.x*periodicBoxSize.y*periodicBoxSize.z);
-    while (atom < NUM_ATOMS) {
-        real3 force = make_real3(0);
-        real4 apos = posq[atom];
-
-        // Loop over all wave vectors.
-
-        int lowry = 0;
-        int lowrz = 1;
-        for (int rx = 0; rx < KMAX_X; rx++) {
-            real kx = rx*reciprocalBoxSize.x;
-            for (int ry = lowry; ry < KMAX_Y; ry++) {
-                real ky = ry*reciprocalBoxSize.y;
-                real phase = apos.x*kx;
-                real2 tab_xy = make_real2(COS(phase), SIN(phase));
-                phase = apos.y*ky;
-                tab_xy = multofReal2(tab_xy, make_real2(COS(phase), SIN(phase)));
-                for (int rz = lowrz; rz < KMAX_Z; rz++) {
-                    real kz = rz*reciprocalBoxSize.z;
-
-                    // Compute the force contribution of this wave vector.
-
-                    int index = rx*(KMAX_Y*2-1)*(KMAX_Z*2-1) + (ry+KMAX_Y-1)*(KMAX_Z*2-1) + (rz+KMAX_Z-1);
-                    real k2 = kx*kx + ky*ky + kz*kz;
-                    real ak = EXP(k2*EXP_COEFFICIENT)/k2;
-                    phase = apos.z*kz;
-                    real2 structureFactor = multofReal2(tab_xy, make_real2(COS(phase), SIN(phase)));
-
-                    real sum = 0;
-                    int i = subsets[atom];
-                    for (int j = 0; j < NUM_SUBSETS; j++) {
-                        real2 sum_j = cosSinSum[NUM_SUBSETS*index+j];
-                        int slice = j > i ? j*(j+1)/2+i : i*(i+1)/2+j;
-                        sum += sliceLambdas[slice].x*(sum_j.x*structureFactor.y - sum_j.y*structureFactor.x);
-                    }
-                    real dEdR = 2*reciprocalCoefficient*ak*apos.w*sum;
-
-                    force.x += dEdR*kx;
-                    force.y += dEdR*ky;
-                    force.z += dEdR*kz;
-                    lowrz = 1 - KMAX_Z;
+    mixed energy[NUM_ENERGY_SLOTS] = {0};
+    for (int tileStart = GROUP_ID*EWALD_TILE_SIZE; tileStart < numKVectors; tileStart += GLOBAL_SIZE) {
+        int tileSize = min(EWALD_TILE_SIZE, numKVectors-tileStart);
+        if (LOCAL_ID < tileSize) {
+            real3 k = ewaldWaveVector(tileStart+LOCAL_ID, reciprocalBoxSize);
+            real2 sum[NUM_SUBSETS];
+            real ak = computeEwaldSums(k, posq, subsets, sum, energy);
+            tileWaveVectors[LOCAL_ID] = k;
+            for (int i = 0; i < NUM_SUBSETS; i++)
+                tileSums[LOCAL_ID*NUM_SUBSETS+i] = 2*reciprocalCoefficient*ak*packEwaldSums(i, sum, sliceLambdas);
+        }
+        SYNC_THREADS;
+        if (includeForces) {
+            for (int atom = LOCAL_ID; atom < NUM_ATOMS; atom += EWALD_TILE_SIZE) {
+                real4 apos = posq[atom];
+                int i = subsets[atom];
+                real3 force = make_real3(0);
+                for (int m = 0; m < tileSize; m++) {
+                    real3 k = tileWaveVectors[m];
+                    real phase = apos.x*k.x + apos.y*k.y + apos.z*k.z;
+                    real2 sum_i = tileSums[m*NUM_SUBSETS+i];
+                    real dEdR = apos.w*(sum_i.x*SIN(phase) - sum_i.y*COS(phase));
+                    force.x += dEdR*k.x;
+                    force.y += dEdR*k.y;
+                    force.z += dEdR*k.z;
                 }
-                lowry = 1 - KMAX_Y;
+                ATOMIC_ADD(&forceBuffers[atom], (mm_ulong) realToFixedPoint(force.x));
+                ATOMIC_ADD(&forceBuffers[atom+PADDED_NUM_ATOMS], (mm_ulong) realToFixedPoint(force.y));
+                ATOMIC_ADD(&forceBuffers[atom+2*PADDED_NUM_ATOMS], (mm_ulong) realToFixedPoint(force.z));
             }
         }
+        SYNC_THREADS;
+    }
 
-        // Record the force on the atom.
+    // Reduce the energies within the thread group.
 
-        forceBuffers[atom] += realToFixedPoint(force.x);
-        forceBuffers[atom+PADDED_NUM_ATOMS] += realToFixedPoint(force.y);
-        forceBuffers[atom+2*PADDED_NUM_ATOMS] += realToFixedPoint(force.z);
-        atom += GLOBAL_SIZE;
+    for (int slot = 0; slot < NUM_ENERGY_SLOTS; slot++) {
+        mixed sum = reduceOverGroup(reciprocalCoefficient*energy[slot], reductionBuffer, EWALD_TILE_SIZE);
+        if (LOCAL_ID == 0)
+            energyBuffer[GROUP_ID*NUM_ENERGY_SLOTS+slot] = sum;
     }
 }
@@ -1,10 +1,68 @@
+/**
+ * Compute the parameters of a particle from its base values and offsets, and store them.
+ */
+DEVICE float4 updateParticleParameters(int i, GLOBAL const real* RESTRICT globalParams, GLOBAL const float4* RESTRICT baseParticleParams,
+        GLOBAL real4* RESTRICT posq, GLOBAL real* RESTRICT charge, GLOBAL float2* RESTRICT sigmaEpsilon, GLOBAL float* RESTRICT c6,
+        GLOBAL const float4* RESTRICT particleParamOffsets, GLOBAL const int* RESTRICT particleOffsetIndices) {
+    float4 params = baseParticleParams[i];
+#ifdef HAS_PARTICLE_OFFSETS
+    int start = particleOffsetIndices[i], end = particleOffsetIndices[i+1];
+    for (int j = start; j < end; j++) {
+        float4 offset = particleParamOffsets[j];
+        real value = globalParams[(int) offset.w];
+        params.x += value*offset.x;
+        params.y += value*offset.y;
+        params.z += value*offset.z;
+    }
+#endif
+#ifdef USE_POSQ_CHARGES
+    posq[i].w = params.x;
+#else
+    charge[i] = params.x;
+#endif
+    float2 sigEps = make_float2(0.5f*params.y, 2*SQRT(params.z));
+    sigmaEpsilon[i] = sigEps;
+#ifdef HAS_DISPERSION_C6
+    // The C6 coefficient of a pair, 64*(sigma1*sigma2)^3*epsilon1*epsilon2 in terms of the
+    // stored values, is the product of one factor per particle.
+    c6[i] = 8*sigEps.x*sigEps.x*sigEps.x*sigEps.y;
+#endif
+    return params;
+}
+
+#ifdef HAS_EXCEPTIONS
+/**
+ * Compute the parameters of an exception from its base values and offsets, and store them.
+ */
+DEVICE void updateExceptionParameters(int i, GLOBAL const real* RESTRICT globalParams, GLOBAL const int* RESTRICT subsets,
+        GLOBAL const int2* RESTRICT exceptionPairs, GLOBAL const float4* RESTRICT baseExceptionParams, GLOBAL float4* RESTRICT exceptionParams,
+        GLOBAL const float4* RESTRICT exceptionParamOffsets, GLOBAL const int* RESTRICT exceptionOffsetIndices) {
+    float4 params = baseExceptionParams[i];
+#ifdef HAS_EXCEPTION_OFFSETS
+    int start = exceptionOffsetIndices[i], end = exceptionOffsetIndices[i+1];
+    for (int j = start; j < end; j++) {
+        float4 offset = exceptionParamOffsets[j];
+        real value = globalParams[(int) offset.w];
+        params.x += value*offset.x;
+        params.y += value*offset.y;
+        params.z += value*offset.z;
+    }
+#endif
+    int j = subsets[exceptionPairs[i].x];
+    int k = subsets[exceptionPairs[i].y];
+    int slice = j>k ? j*(j+1)/2+k : k*(k+1)/2+j;
+    float sliceAsFloat = *((float*) &slice);
+    exceptionParams[i] = make_float4((float) (ONE_4PI_EPS0*params.x), (float) params.y, (float) (4*params.z), sliceAsFloat);
+}
+#endif
+
 /**
  * Compute the nonbonded parameters for particles and exceptions.
  */
 KERNEL void computeParameters(GLOBAL mixed* RESTRICT energyBuffer, int includeSelfEnergy, GLOBAL real* RESTRICT globalParams,
         int numAtoms, GLOBAL const float4* RESTRICT baseParticleParams, GLOBAL real4* RESTRICT posq, GLOBAL real* RESTRICT charge,
-        GLOBAL float2* RESTRICT sigmaEpsilon, GLOBAL float4* RESTRICT particleParamOffsets, GLOBAL int* RESTRICT particleOffsetIndices,
-        GLOBAL const int* RESTRICT subsets, GLOBAL const real2* RESTRICT sliceLambdas
+        GLOBAL float2* RESTRICT sigmaEpsilon, GLOBAL float* RESTRICT c6, GLOBAL float4* RESTRICT particleParamOffsets,
+        GLOBAL int* RESTRICT particleOffsetIndices, GLOBAL const int* RESTRICT subsets, GLOBAL const real2* RESTRICT sliceLambdas
 #ifdef HAS_EXCEPTIONS
         , int numExceptions, GLOBAL const int2* RESTRICT exceptionPairs, GLOBAL const float4* RESTRICT baseExceptionParams,
         GLOBAL int* RESTRICT exceptionSlices, GLOBAL float4* RESTRICT exceptionParams,
@@ -17,23 +75,8 @@ KERNEL void computeParameters(GLOBAL mixed* RESTRICT energyBuffer, int includeSe
     // Compute particle parameters.
 
     for (int i = GLOBAL_ID; i < numAtoms; i += GLOBAL_SIZE) {
-        float4 params = baseParticleParams[i];
-#ifdef HAS_PARTICLE_OFFSETS
-        int start = particleOffsetIndices[i], end = particleOffsetIndices[i+1];
-        for (int j = start; j < end; j++) {
-            float4 offset = particleParamOffsets[j];
-            real value = globalParams[(int) offset.w];
-            params.x += value*offset.x;
-            params.y += value*offset.y;
-            params.z += value*offset.z;
-        }
-#endif
-#ifdef USE_POSQ_CHARGES
-        posq[i].w = params.x;
-#else
-        charge[i] = params.x;
-#endif
-        sigmaEpsilon[i] = make_float2(0.5f*params.y, 2*SQRT(params.z));
+        float4 params = updateParticleParameters(i, globalParams, baseParticleParams, posq, charge, sigmaEpsilon, c6,
+                particleParamOffsets, particleOffsetIndices);
 #ifdef HAS_OFFSETS
     #ifdef INCLUDE_EWALD
         clEnergy[subsets[i]] -= EWALD_SELF_ENERGY_SCALE*params.x*params.x;
@@ -48,24 +91,9 @@ KERNEL void computeParameters(GLOBAL mixed* RESTRICT energyBuffer, int includeSe
     // Compute exception parameters.
 
 #ifdef HAS_EXCEPTIONS
-    for (int i = GLOBAL_ID; i < numExceptions; i += GLOBAL_SIZE) {
-        float4 params = baseExceptionParams[i];
-#ifdef HAS_EXCEPTION_OFFSETS
-        int start = exceptionOffsetIndices[i], end = exceptionOffsetIndices[i+1];
-        for (int j = start; j < end; j++) {
-            float4 offset = exceptionParamOffsets[j];
-            real value = globalParams[(int) offset.w];
-            params.x += value*offset.x;
-            params.y += value*offset.y;
-            params.z += value*offset.z;
-        }
-#endif
-        int j = subsets[exceptionPairs[i].x];
-        int k = subsets[exceptionPairs[i].y];
-        int slice = j>k ? j*(j+1)/2+k : k*(k+1)/2+j;
-        float sliceAsFloat = *((float*) &slice);
-        exceptionParams[i] = make_float4((float) (ONE_4PI_EPS0*params.x), (float) params.y, (float) (4*params.z), sliceAsFloat);
-    }
+    for (int i = GLOBAL_ID; i < numExceptions; i += GLOBAL_SIZE)
+        updateExceptionParameters(i, globalParams, subsets, exceptionPairs, baseExceptionParams, exceptionParams,
+                exceptionParamOffsets, exceptionOffsetIndices);
 #endif
     if (includeSelfEnergy) {
         mixed energy = 0;
@@ -78,31 +106,76 @@ KERNEL void computeParameters(GLOBAL mixed* RESTRICT energyBuffer, int includeSe
 }
 
 /**
- * Compute parameters for subtracting the reciprocal part of excluded interactions.
+ * Recompute the parameters of only the particles and exceptions whose offsets depend on a
+ * global parameter that has changed.  The self energy is not computed here, since the host
+ * updates it incrementally.
  */
-KERNEL void computeExclusionParameters(GLOBAL real4* RESTRICT posq, GLOBAL real* RESTRICT charge,
+KERNEL void computeAffectedParameters(GLOBAL real* RESTRICT globalParams, int numAffectedParticles, GLOBAL const int* RESTRICT affectedParticles,
+        GLOBAL const float4* RESTRICT baseParticleParams, GLOBAL real4* RESTRICT posq, GLOBAL real* RESTRICT charge,
+        GLOBAL float2* RESTRICT sigmaEpsilon, GLOBAL float* RESTRICT c6, GLOBAL float4* RESTRICT particleParamOffsets,
+        GLOBAL int* RESTRICT particleOffsetIndices, GLOBAL const int* RESTRICT subsets
+#ifdef HAS_EXCEPTIONS
+        , int numAffectedExceptions, GLOBAL const int* RESTRICT affectedExceptions, GLOBAL const int2* RESTRICT exceptionPairs,
+        GLOBAL const float4* RESTRICT baseExceptionParams, GLOBAL float4* RESTRICT exceptionParams,
+        GLOBAL float4* RESTRICT exceptionParamOffsets, GLOBAL int* RESTRICT exceptionOffsetIndices
+#endif
+        ) {
+    for (int i = GLOBAL_ID; i < numAffectedParticles; i += GLOBAL_SIZE)
+        updateParticleParameters(affectedParticles[i], globalParams, baseParticleParams, posq, charge, sigmaEpsilon, c6,
+                particleParamOffsets, particleOffsetIndices);
+#ifdef HAS_EXCEPTIONS
+    for (int i = GLOBAL_ID; i < numAffectedExceptions; i += GLOBAL_SIZE)
+        updateExceptionParameters(affectedExceptions[i], globalParams, subsets, exceptionPairs, baseExceptionParams, exceptionParams,
+                exceptionParamOffsets, exceptionOffsetIndices);
+#endif
+}
+
+/**
+ * Compute the parameters of an exclusion from those of its particles, and store them.
+ */
+DEVICE void updateExclusionParameters(int i, GLOBAL real4* RESTRICT posq, GLOBAL real* RESTRICT charge,
         GLOBAL float2* RESTRICT sigmaEpsilon, GLOBAL const int* RESTRICT subsets,
-        int numExclusions, GLOBAL const int2* RESTRICT exclusionAtoms, GLOBAL float4* RESTRICT exclusionParams) {
-    for (int i = GLOBAL_ID; i < numExclusions; i += GLOBAL_SIZE) {
-        int2 atoms = exclusionAtoms[i];
+        GLOBAL const int2* RESTRICT exclusionAtoms, GLOBAL float4* RESTRICT exclusionParams) {
+    int2 atoms = exclusionAtoms[i];
 #ifdef USE_POSQ_CHARGES
-        real chargeProd = posq[atoms.x].w*posq[atoms.y].w;
+    real chargeProd = posq[atoms.x].w*posq[atoms.y].w;
 #else
-        real chargeProd = charge[atoms.x]*charge[atoms.y];
+    real chargeProd = charge[atoms.x]*charge[atoms.y];
 #endif
 #ifdef INCLUDE_LJPME_EXCEPTIONS
-        float2 sigEps1 = sigmaEpsilon[atoms.x];
-        float2 sigEps2 = sigmaEpsilon[atoms.y];
-        float sigma = sigEps1.x*sigEps2.x;
-        float epsilon = sigEps1.y*sigEps2.y;
+    float2 sigEps1 = sigmaEpsilon[atoms.x];
+    float2 sigEps2 = sigmaEpsilon[atoms.y];
+    float sigma = sigEps1.x*sigEps2.x;
+    float epsilon = sigEps1.y*sigEps2.y;
 #else
-        float sigma = 0;
-        float epsilon = 0;
+    float sigma = 0;
+    float epsilon = 0;
 #endif
-        int j = subsets[atoms.x];
-        int k = subsets[atoms.y];
-        int slice = j>k ? j*(j+1)/2+k : k*(k+1)/2+j;
-        float sliceAsFloat = *((float*) &slice);
-        exclusionParams[i] = make_float4((float) (ONE_4PI_EPS0*chargeProd), sigma, epsilon, sliceAsFloat);
-    }
+    int j = subsets[atoms.x];
+    int k = subsets[atoms.y];
+    int slice = j>k ? j*(j+1)/2+k : k*(k+1)/2+j;
+    float sliceAsFloat = *((float*) &slice);
+    exclusionParams[i] = make_float4((float) (ONE_4PI_EPS0*chargeProd), sigma, epsilon, sliceAsFloat);
+}
+
+/**
+ * Compute parameters for subtracting the reciprocal part of excluded interactions.
+ */
+KERNEL void computeExclusionParameters(GLOBAL real4* RESTRICT posq, GLOBAL real* RESTRICT charge,
+        GLOBAL float2* RESTRICT sigmaEpsilon, GLOBAL const int* RESTRICT subsets,
+        int numExclusions, GLOBAL const int2* RESTRICT exclusionAtoms, GLOBAL float4* RESTRICT exclusionParams) {
+    for (int i = GLOBAL_ID; i < numExclusions; i += GLOBAL_SIZE)
+        updateExclusionParameters(i, posq, charge, sigmaEpsilon, subsets, exclusionAtoms, exclusionParams);
+}
+
+/**
+ * Recompute the parameters of only the exclusions that involve particles whose parameters
+ * have changed.
+ */
+KERNEL void computeAffectedExclusionParameters(GLOBAL real4* RESTRICT posq, GLOBAL real* RESTRICT charge,
+        GLOBAL float2* RESTRICT sigmaEpsilon, GLOBAL const int* RESTRICT subsets,
+        int numAffectedExclusions, GLOBAL const int* RESTRICT affectedExclusions,
+        GLOBAL const int2* RESTRICT exclusionAtoms, GLOBAL float4* RESTRICT exclusionParams) {
+    for (int i = GLOBAL_ID; i < numAffectedExclusions; i += GLOBAL_SIZE)
+        updateExclusionParameters(affectedExclusions[i], posq, charge, sigmaEpsilon, subsets, exclusionAtoms, exclusionParams);
 }
\ No newline at end of file
@@ -1,3 +1,36 @@
+/**
+ * The charge grids are stored with elements of type GRID_REAL, which the host may set to float
+ * to keep the grids and their FFTs in single precision when real is double.
+ */
+#ifndef GRID_REAL
+#define GRID_REAL real
+#define GRID_REAL2 real2
+#define make_grid_real2 make_real2
+#endif
+
+/**
+ * The host may fold the slices that have no scaling parameter into a single energy slot, in
+ * which case it defines NUM_ENERGY_SLOTS and SLICE_SLOT.
+ */
+#ifndef NUM_ENERGY_SLOTS
+#define NUM_ENERGY_SLOTS NUM_SLICES
+#define SLICE_SLOT(slice) (slice)
+#endif
+
+/**
+ * The host may leave out the grids of subsets whose particles can never have charges (or
+ * dispersion coefficients), and let subsets whose slices are all scaled alike share a grid.
+ * It then defines NUM_GRIDS, the first subset of each grid in GRID_SUBSET, in increasing order,
+ * and the grid of each subset in SUBSET_GRID.  The energy of a pair of grids is accumulated
+ * into the slice of their first subsets.  The particles of a subset without a grid are assigned
+ * to grid 0, but spread nothing.
+ */
+#ifndef NUM_GRIDS
+#define NUM_GRIDS NUM_SUBSETS
+#define GRID_SUBSET(grid) (grid)
+#define SUBSET_GRID(subset) (subset)
+#endif
+
 KERNEL void findAtomGridIndex(GLOBAL const real4* RESTRICT posq, GLOBAL int2* RESTRICT pmeAtomGridIndex,
         real4 periodicBoxSize, real4 invPeriodicBoxSize, real4 periodicBoxVecX, real4 periodicBoxVecY, real4 periodicBoxVecZ,
         real4 recipBoxVecX, real4 recipBoxVecY, real4 recipBoxVecZ, GLOBAL const int* RESTRICT subsets
@@ -16,8 +49,45 @@ KERNEL void findAtomGridIndex(GLOBAL const real4* RESTRICT posq, GLOBAL int2* RE
         int3 gridIndex = make_int3(((int) t.x) % GRID_SIZE_X,
                                    ((int) t.y) % GRID_SIZE_Y,
                                    ((int) t.z) % GRID_SIZE_Z);
-        int subset = subsets[atom];
-        pmeAtomGridIndex[atom] = make_int2(atom, ((subset*GRID_SIZE_X+gridIndex.x)*GRID_SIZE_Y+gridIndex.y)*GRID_SIZE_Z+gridIndex.z);
+        int grid = SUBSET_GRID(subsets[atom]);
+        pmeAtomGridIndex[atom] = make_int2(atom, ((grid*GRID_SIZE_X+gridIndex.x)*GRID_SIZE_Y+gridIndex.y)*GRID_SIZE_Z+gridIndex.z);
+    }
+}
+
+/**
+ * Add forces that were computed on the host, stored in fixed point with the same layout as the
+ * force buffer.
+ */
+KERNEL void addHostForces(GLOBAL mm_long* RESTRICT forceBuffers, GLOBAL const mm_long* RESTRICT hostForces) {
+    for (int i = GLOBAL_ID; i < 3*PADDED_NUM_ATOMS; i += GLOBAL_SIZE)
+        forceBuffers[i] += hostForces[i];
+}
+
+/**
+ * Recompute the grid indices of atoms that have already been sorted for another grid of the same
+ * box, keeping their order.  The order only affects the efficiency of spreading and interpolation,
+ * and the order of another grid is still grouped by subset and spatially coherent, so no new sort
+ * is needed.
+ */
+KERNEL void rebinAtomGridIndex(GLOBAL const real4* RESTRICT posq, GLOBAL int2* RESTRICT pmeAtomGridIndex,
+        real4 periodicBoxSize, real4 invPeriodicBoxSize, real4 periodicBoxVecX, real4 periodicBoxVecY, real4 periodicBoxVecZ,
+        real4 recipBoxVecX, real4 recipBoxVecY, real4 recipBoxVecZ, GLOBAL const int* RESTRICT subsets
+    ) {
+    for (int i = GLOBAL_ID; i < NUM_ATOMS; i += GLOBAL_SIZE) {
+        int atom = pmeAtomGridIndex[i].x;
+        real4 pos = posq[atom];
+        APPLY_PERIODIC_TO_POS(pos)
+        real3 t = make_real3(pos.x*recipBoxVecX.x+pos.y*recipBoxVecY.x+pos.z*recipBoxVecZ.x,
+                             pos.y*recipBoxVecY.y+pos.z*recipBoxVecZ.y,
+                             pos.z*recipBoxVecZ.z);
+        t.x = (t.x-floor(t.x))*GRID_SIZE_X;
+        t.y = (t.y-floor(t.y))*GRID_SIZE_Y;
+        t.z = (t.z-floor(t.z))*GRID_SIZE_Z;
+        int3 gridIndex = make_int3(((int) t.x) % GRID_SIZE_X,
+                                   ((int) t.y) % GRID_SIZE_Y,
+                                   ((int) t.z) % GRID_SIZE_Z);
+        int grid = SUBSET_GRID(subsets[atom]);
+        pmeAtomGridIndex[i] = make_int2(atom, ((grid*GRID_SIZE_X+gridIndex.x)*GRID_SIZE_Y+gridIndex.y)*GRID_SIZE_Z+gridIndex.z);
     }
 }
 
@@ -28,7 +98,7 @@ KERNEL void gridSpreadCharge(GLOBAL const real4* RESTRICT posq,
 #ifdef USE_FIXED_POINT_CHARGE_SPREADING
         GLOBAL mm_ulong* RESTRICT pmeGrid,
 #else
-        GLOBAL real* RESTRICT pmeGrid,
+        GLOBAL GRID_REAL* RESTRICT pmeGrid,
 #endif
         real4 periodicBoxSize, real4 invPeriodicBoxSize, real4 periodicBoxVecX, real4 periodicBoxVecY, real4 periodicBoxVecZ,
         real4 recipBoxVecX, real4 recipBoxVecY, real4 recipBoxVecZ, GLOBAL const int2* RESTRICT pmeAtomGridIndex,
@@ -126,7 +196,7 @@ KERNEL void gridSpreadCharge(GLOBAL const real4* RESTRICT posq,
 #ifdef USE_FIXED_POINT_CHARGE_SPREADING
                     ATOMIC_ADD(&pmeGrid[offset+index], (mm_ulong) realToFixedPoint(add));
 #else
-                    ATOMIC_ADD(&pmeGrid[offset+index], add);
+                    ATOMIC_ADD(&pmeGrid[offset+index], (GRID_REAL) add);
 #endif
                 }
             }
@@ -138,9 +208,9 @@ KERNEL void finishSpreadCharge(
 #ifdef USE_FIXED_POINT_CHARGE_SPREADING
         GLOBAL const mm_long* RESTRICT grid1,
 #else
-        GLOBAL const real* RESTRICT grid1,
+        GLOBAL const GRID_REAL* RESTRICT grid1,
 #endif
-        GLOBAL real* RESTRICT grid2) {
+        GLOBAL GRID_REAL* RESTRICT grid2) {
 // HIP-TODO: Workaround for RDNA, remove it when the compiler issue is fixed
 #if defined(USE_HIP)
     (void)GLOBAL_ID;
@@ -159,7 +229,7 @@ KERNEL void finishSpreadCharge(
     SYNC_THREADS;
     const unsigned int gridSize = GRID_SIZE_X*GRID_SIZE_Y*GRID_SIZE_Z;
     const unsigned int extendedSize = GRID_SIZE_X*GRID_SIZE_Y*PME_ORDER*blockSize;
-    const unsigned int totalSize = NUM_SUBSETS*gridSize;
+    const unsigned int totalSize = NUM_GRIDS*gridSize;
 #ifdef USE_FIXED_POINT_CHARGE_SPREADING
     real scale = 1/(real) 0x100000000;
 #endif
@@ -169,18 +239,98 @@ KERNEL void finishSpreadCharge(
         int zindex = index%GRID_SIZE_Z;
         int loadIndex = zindexTable[zindex] + blockSize*(int) (index/GRID_SIZE_Z);
 #ifdef USE_FIXED_POINT_CHARGE_SPREADING
-        grid2[j*gridSize+index] = scale*grid1[j*extendedSize+loadIndex];
+        grid2[j*gridSize+index] = (GRID_REAL) (scale*grid1[j*extendedSize+loadIndex]);
 #else
         grid2[j*gridSize+index] = grid1[j*extendedSize+loadIndex];
 #endif
     }
 }
 
-KERNEL void reciprocalConvolution(GLOBAL real2* RESTRICT pmeGrid, GLOBAL const real* RESTRICT pmeBsplineModuliX,
+/**
+ * Compute the factor by which the reciprocal space convolution multiplies a point of the half
+ * complex grid.
+ */
+DEVICE real reciprocalConvolutionTerm(int index, GLOBAL const real* RESTRICT pmeBsplineModuliX,
+        GLOBAL const real* RESTRICT pmeBsplineModuliY, GLOBAL const real* RESTRICT pmeBsplineModuliZ,
+        real4 recipBoxVecX, real4 recipBoxVecY, real4 recipBoxVecZ) {
+#ifdef USE_LJPME
+    const real recipScaleFactor = -(2*M_PI/6)*SQRT(M_PI)*recipBoxVecX.x*recipBoxVecY.y*recipBoxVecZ.z;
+    real bfac = M_PI / EWALD_ALPHA;
+    real fac1 = 2*M_PI*M_PI*M_PI*SQRT(M_PI);
+    real fac2 = EWALD_ALPHA*EWALD_ALPHA*EWALD_ALPHA;
+    real fac3 = -2*EWALD_ALPHA*M_PI*M_PI;
+#else
+    const real recipScaleFactor = RECIP(M_PI)*recipBoxVecX.x*recipBoxVecY.y*recipBoxVecZ.z;
+#endif
+    // real indices
+    int kx = index/(GRID_SIZE_Y*(GRID_SIZE_Z/2+1));
+    int remainder = index-kx*GRID_SIZE_Y*(GRID_SIZE_Z/2+1);
+    int ky = remainder/(GRID_SIZE_Z/2+1);
+    int kz = remainder-ky*(GRID_SIZE_Z/2+1);
+    int mx = (kx < (GRID_SIZE_X+1)/2) ? kx : (kx-GRID_SIZE_X);
+    int my = (ky < (GRID_SIZE_Y+1)/2) ? ky : (ky-GRID_SIZE_Y);
+    int mz = (kz < (GRID_SIZE_Z+1)/2) ? kz : (kz-GRID_SIZE_Z);
+    real mhx = mx*recipBoxVecX.x;
+    real mhy = mx*recipBoxVecY.x+my*recipBoxVecY.y;
+    real mhz = mx*recipBoxVecZ.x+my*recipBoxVecZ.y+mz*recipBoxVecZ.z;
+    real bx = pmeBsplineModuliX[kx];
+    real by = pmeBsplineModuliY[ky];
+    real bz = pmeBsplineModuliZ[kz];
+    real m2 = mhx*mhx+mhy*mhy+mhz*mhz;
+#ifdef USE_LJPME
+    real denom = recipScaleFactor/(bx*by*bz);
+    real m = SQRT(m2);
+    real m3 = m*m2;
+    real b = bfac*m;
+    real expfac = -b*b;
+    real expterm = EXP(expfac);
+    real erfcterm = ERFC(b);
+    return (fac1*erfcterm*m3 + expterm*(fac2 + fac3*m2)) * denom;
+#else
+    real denom = m2*bx*by*bz;
+    return (kx != 0 || ky != 0 || kz != 0) ? recipScaleFactor*EXP(-RECIP_EXP_FACTOR*m2)/denom : 0;
+#endif
+}
+
+KERNEL void reciprocalConvolution(GLOBAL GRID_REAL2* RESTRICT pmeGrid, GLOBAL const real* RESTRICT pmeBsplineModuliX,
         GLOBAL const real* RESTRICT pmeBsplineModuliY, GLOBAL const real* RESTRICT pmeBsplineModuliZ,
         real4 recipBoxVecX, real4 recipBoxVecY, real4 recipBoxVecZ) {
     // R2C stores into a half complex matrix where the last dimension is cut by half
     const unsigned int gridSize = GRID_SIZE_X*GRID_SIZE_Y*(GRID_SIZE_Z/2+1);
+    for (int index = GLOBAL_ID; index < gridSize; index += GLOBAL_SIZE) {
+        real eterm = reciprocalConvolutionTerm(index, pmeBsplineModuliX, pmeBsplineModuliY, pmeBsplineModuliZ, recipBoxVecX, recipBoxVecY, recipBoxVecZ);
+        for (int j = 0; j < NUM_GRIDS; j++)
+            pmeGrid[j*gridSize+index] *= (GRID_REAL) eterm;
+    }
+}
+
+/**
+ * Store the factors of the reciprocal space convolution in a half complex grid, for FFT
+ * libraries that apply the convolution themselves between the forward and inverse transforms.
+ * The same grid is applied to all subsets.
+ */
+KERNEL void computeConvolutionKernel(GLOBAL GRID_REAL2* RESTRICT convolutionKernel, GLOBAL const real* RESTRICT pmeBsplineModuliX,
+        GLOBAL const real* RESTRICT pmeBsplineModuliY, GLOBAL const real* RESTRICT pmeBsplineModuliZ,
+        real4 recipBoxVecX, real4 recipBoxVecY, real4 recipBoxVecZ) {
+    const unsigned int gridSize = GRID_SIZE_X*GRID_SIZE_Y*(GRID_SIZE_Z/2+1);
+    for (int index = GLOBAL_ID; index < gridSize; index += GLOBAL_SIZE) {
+        real eterm = reciprocalConvolutionTerm(index, pmeBsplineModuliX, pmeBsplineModuliY, pmeBsplineModuliZ, recipBoxVecX, recipBoxVecY, recipBoxVecZ);
+        convolutionKernel[index] = make_grid_real2((GRID_REAL) eterm, (GRID_REAL) 0);
+    }
+}
+
+/**
+ * Apply the reciprocal space convolution to the grids of all subsets and, in the same pass,
+ * accumulate the energy of each slice.  Each point of the half complex grid except those in
+ * the kz = 0 and kz = GRID_SIZE_Z/2 planes stands for itself and its complex conjugate, which
+ * is why it is counted twice.  This replaces a gridEvaluateEnergy launch followed by a
+ * reciprocalConvolution launch when the energy is needed.
+ */
+KERNEL void reciprocalConvolutionWithEnergy(GLOBAL GRID_REAL2* RESTRICT pmeGrid, GLOBAL mixed* RESTRICT energyBuffer,
+        GLOBAL const real* RESTRICT pmeBsplineModuliX, GLOBAL const real* RESTRICT pmeBsplineModuliY,
+        GLOBAL const real* RESTRICT pmeBsplineModuliZ, real4 recipBoxVecX, real4 recipBoxVecY, real4 recipBoxVecZ) {
+    // R2C stores into a half complex matrix where the last dimension is cut by half
+    const unsigned int gridSize = GRID_SIZE_X*GRID_SIZE_Y*(GRID_SIZE_Z/2+1);
 #ifdef USE_LJPME
     const real recipScaleFactor = -(2*M_PI/6)*SQRT(M_PI)*recipBoxVecX.x*recipBoxVecY.y*recipBoxVecZ.z;
     real bfac = M_PI / EWALD_ALPHA;
@@ -191,6 +341,7 @@ KERNEL void reciprocalConvolution(GLOBAL real2* RESTRICT pmeGrid, GLOBAL const r
     const real recipScaleFactor = RECIP(M_PI)*recipBoxVecX.x*recipBoxVecY.y*recipBoxVecZ.z;
 #endif
 
+    mixed energy[NUM_ENERGY_SLOTS] = { 0 };
     for (int index = GLOBAL_ID; index < gridSize; index += GLOBAL_SIZE) {
         // real indices
         int kx = index/(GRID_SIZE_Y*(GRID_SIZE_Z/2+1));
@@ -220,12 +371,32 @@ KERNEL void reciprocalConvolution(GLOBAL real2* RESTRICT pmeGrid, GLOBAL const r
         real denom = m2*bx*by*bz;
         real eterm = (kx != 0 || ky != 0 || kz != 0) ? recipScaleFactor*EXP(-RECIP_EXP_FACTOR*m2)/denom : 0;
 #endif
-        for (int j = 0; j < NUM_SUBSETS; j++)
-            pmeGrid[j*gridSize+index] *= eterm;
+        real weight = (kz == 0 || 2*kz == GRID_SIZE_Z) ? (real) 0.5f*eterm : eterm;
+        real2 grid[NUM_GRIDS];
+        for (int j = 0; j < NUM_GRIDS; j++) {
+            GRID_REAL2 value = pmeGrid[j*gridSize+index];
+            grid[j] = make_real2(value.x, value.y);
+            int sj = GRID_SUBSET(j);
+            int offset = (sj+1)*sj/2;
+            for (int i = 0; i < j; i++)
+                energy[SLICE_SLOT(offset+GRID_SUBSET(i))] += 2*weight*(grid[i].x*grid[j].x + grid[i].y*grid[j].y);
+            energy[SLICE_SLOT(offset+sj)] += weight*(grid[j].x*grid[j].x + grid[j].y*grid[j].y);
+            pmeGrid[j*gridSize+index] = make_grid_real2((GRID_REAL) (grid[j].x*eterm), (GRID_REAL) (grid[j].y*eterm));
+        }
+    }
+
+    // Reduce the energies within the thread group, so that the buffer holds one entry per
+    // group rather than one per thread.
+
+    LOCAL mixed reductionBuffer[ENERGY_GROUP_SIZE];
+    for (int slot = 0; slot < NUM_ENERGY_SLOTS; slot++) {
+        mixed sum = reduceOverGroup(energy[slot], reductionBuffer, ENERGY_GROUP_SIZE);
+        if (LOCAL_ID == 0)
+            energyBuffer[GROUP_ID*NUM_ENERGY_SLOTS+slot] = sum;
     }
 }
 
-KERNEL void gridEvaluateEnergy(GLOBAL real2* RESTRICT pmeGrid, GLOBAL mixed* RESTRICT energyBuffer,
+KERNEL void gridEvaluateEnergy(GLOBAL GRID_REAL2* RESTRICT pmeGrid, GLOBAL mixed* RESTRICT energyBuffer,
                       GLOBAL const real* RESTRICT pmeBsplineModuliX, GLOBAL const real* RESTRICT pmeBsplineModuliY, GLOBAL const real* RESTRICT pmeBsplineModuliZ,
                       real4 recipBoxVecX, real4 recipBoxVecY, real4 recipBoxVecZ) {
     // R2C stores into a half complex matrix where the last dimension is cut by half
@@ -241,7 +412,7 @@ KERNEL void gridEvaluateEnergy(GLOBAL real2* RESTRICT pmeGrid, GLOBAL mixed* RES
     const real recipScaleFactor = RECIP(M_PI)*recipBoxVecX.x*recipBoxVecY.y*recipBoxVecZ.z;
 #endif
 
-    mixed energy[NUM_SLICES] = { 0 };
+    mixed energy[NUM_ENERGY_SLOTS] = { 0 };
     for (int index = GLOBAL_ID; index < gridSize; index += GLOBAL_SIZE) {
         // real indices
         int kx = index/(GRID_SIZE_Y*(GRID_SIZE_Z));
@@ -277,23 +448,33 @@ KERNEL void gridEvaluateEnergy(GLOBAL real2* RESTRICT pmeGrid, GLOBAL mixed* RES
             kz = GRID_SIZE_Z-kz;
         }
         int indexInHalfComplexGrid = kz + ky*(GRID_SIZE_Z/2+1)+kx*(GRID_SIZE_Y*(GRID_SIZE_Z/2+1));
-        real2 grid[NUM_SUBSETS];
-        for (int j = 0; j < NUM_SUBSETS; j++) {
-            grid[j] = pmeGrid[j*odist+indexInHalfComplexGrid];
-            int offset = (j+1)*j/2;
+        real2 grid[NUM_GRIDS];
+        for (int j = 0; j < NUM_GRIDS; j++) {
+            GRID_REAL2 value = pmeGrid[j*odist+indexInHalfComplexGrid];
+            grid[j] = make_real2(value.x, value.y);
+            int sj = GRID_SUBSET(j);
+            int offset = (sj+1)*sj/2;
             for (int i = 0; i < j; i++)
-                energy[offset+i] += eterm*(grid[i].x*grid[j].x + grid[i].y*grid[j].y);
-            energy[offset+j] += 0.5*eterm*(grid[j].x*grid[j].x + grid[j].y*grid[j].y);
+                energy[SLICE_SLOT(offset+GRID_SUBSET(i))] += eterm*(grid[i].x*grid[j].x + grid[i].y*grid[j].y);
+            energy[SLICE_SLOT(offset+sj)] += 0.5*eterm*(grid[j].x*grid[j].x + grid[j].y*grid[j].y);
         }
     }
-    for (int slice = 0; slice < NUM_SLICES; slice++)
-        energyBuffer[GLOBAL_ID*NUM_SLICES+slice] = energy[slice];
+
+    // Reduce the energies within the thread group, so that the buffer holds one entry per
+    // group rather than one per thread.
+
+    LOCAL mixed reductionBuffer[ENERGY_GROUP_SIZE];
+    for (int slot = 0; slot < NUM_ENERGY_SLOTS; slot++) {
+        mixed sum = reduceOverGroup(energy[slot], reductionBuffer, ENERGY_GROUP_SIZE);
+        if (LOCAL_ID == 0)
+            energyBuffer[GROUP_ID*NUM_ENERGY_SLOTS+slot] = sum;
+    }
 }
 
 #if defined(USE_HIP) && !defined(AMD_RDNA) && !defined(USE_DOUBLE_PRECISION)
 LAUNCH_BOUNDS_EXACT(128, 1)
 #endif
-KERNEL void gridInterpolateForce(GLOBAL const real4* RESTRICT posq, GLOBAL mm_ulong* RESTRICT forceBuffers, GLOBAL const real* RESTRICT pmeGrid,
+KERNEL void gridInterpolateForce(GLOBAL const real4* RESTRICT posq, GLOBAL mm_ulong* RESTRICT forceBuffers, GLOBAL const GRID_REAL* RESTRICT pmeGrid,
         real4 periodicBoxSize, real4 invPeriodicBoxSize, real4 periodicBoxVecX, real4 periodicBoxVecY, real4 periodicBoxVecZ,
         real4 recipBoxVecX, real4 recipBoxVecY, real4 recipBoxVecZ, GLOBAL const int2* RESTRICT pmeAtomGridIndex,
 #ifdef CHARGE_FROM_SIGEPS
@@ -314,6 +495,14 @@ KERNEL void gridInterpolateForce(GLOBAL const real4* RESTRICT posq, GLOBAL mm_ul
         int atom = pmeAtomGridIndex[i].x;
         real3 force = make_real3(0);
         real4 pos = posq[atom];
+#ifdef CHARGE_FROM_SIGEPS
+        const float2 sigEps = sigmaEpsilon[atom];
+        real q = 8*sigEps.x*sigEps.x*sigEps.x*sigEps.y;
+#else
+        real q = CHARGE*EPSILON_FACTOR;
+#endif
+        if (q == 0)
+            continue;
         int si = subsets[atom];
         APPLY_PERIODIC_TO_POS(pos)
         real3 t = make_real3(pos.x*recipBoxVecX.x+pos.y*recipBoxVecY.x+pos.z*recipBoxVecZ.x,
@@ -369,29 +558,21 @@ KERNEL void gridInterpolateForce(GLOBAL const real4* RESTRICT posq, GLOBAL mm_ul
                     zindex -= (zindex >= GRID_SIZE_Z ? GRID_SIZE_Z : 0);
                     int index = ybase + zindex;
                     real gridvalue = 0.0;
+                    for (int j = 0; j < NUM_GRIDS; j++) {
+                        int sj = GRID_SUBSET(j);
+                        int slice = (sj < si ? si*(si+1)/2+sj : sj*(sj+1)/2+si);
 #ifdef USE_LJPME
-                    for (int sj = 0; sj < si; sj++)
-                        gridvalue += sliceLambdas[si*(si+1)/2+sj].y*pmeGrid[sj*gridSize+index];
-                    for (int sj = si; sj < NUM_SUBSETS; sj++)
-                        gridvalue += sliceLambdas[sj*(sj+1)/2+si].y*pmeGrid[sj*gridSize+index];
+                        gridvalue += sliceLambdas[slice].y*pmeGrid[j*gridSize+index];
 #else
-                    for (int sj = 0; sj < si; sj++)
-                        gridvalue += sliceLambdas[si*(si+1)/2+sj].x*pmeGrid[sj*gridSize+index];
-                    for (int sj = si; sj < NUM_SUBSETS; sj++)
-                        gridvalue += sliceLambdas[sj*(sj+1)/2+si].x*pmeGrid[sj*gridSize+index];
+                        gridvalue += sliceLambdas[slice].x*pmeGrid[j*gridSize+index];
 #endif
+                    }
                     force.x += ddx*dy*data[iz].z*gridvalue;
                     force.y += dx*ddy*data[iz].z*gridvalue;
                     force.z += dx*dy*ddata[iz].z*gridvalue;
                 }
             }
         }
-#ifdef CHARGE_FROM_SIGEPS
-        const float2 sigEps = sigmaEpsilon[atom];
-        real q = 8*sigEps.x*sigEps.x*sigEps.x*sigEps.y;
-#else
-        real q = CHARGE*EPSILON_FACTOR;
-#endif
         real forceX = -q*(force.x*GRID_SIZE_X*recipBoxVecX.x);
         real forceY = -q*(force.x*GRID_SIZE_X*recipBoxVecY.x+force.y*GRID_SIZE_Y*recipBoxVecY.y);
         real forceZ = -q*(force.x*GRID_SIZE_X*recipBoxVecZ.x+force.y*GRID_SIZE_Y*recipBoxVecZ.y+force.z*GRID_SIZE_Z*recipBoxVecZ.z);
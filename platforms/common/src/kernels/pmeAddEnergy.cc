@@ -7,23 +7,38 @@ KERNEL void addEnergy(GLOBAL mixed* RESTRICT energyBuffer,
                       GLOBAL const mixed* RESTRICT ljpmeEnergyBuffer,
 #endif
                       GLOBAL const real2* RESTRICT sliceLambdas,
-                      int bufferSize) {
+                      int bufferSize
+#if HAS_DISPERSION_CORRECTION
+                      , GLOBAL const mixed* RESTRICT dispersionCoefficients,
+                      mixed invVolume
+#endif
+                      ) {
 
     const int index = GLOBAL_ID;
     mixed energy = 0;
-    mixed clEnergy[NUM_SLICES];
+    mixed clEnergy[NUM_ENERGY_SLOTS];
 #if USE_LJPME
-    mixed ljEnergy[NUM_SLICES];
+    mixed ljEnergy[NUM_ENERGY_SLOTS];
 #endif
-    for (int slice = 0; slice < NUM_SLICES; slice++) {
-        clEnergy[slice] = pmeEnergyBuffer[index*NUM_SLICES+slice];
+    for (int slot = 0; slot < NUM_ENERGY_SLOTS; slot++) {
+        const int slice = SLOT_SLICE(slot);
+        clEnergy[slot] = pmeEnergyBuffer[index*NUM_ENERGY_SLOTS+slot];
 #if USE_LJPME
-        ljEnergy[slice] = ljpmeEnergyBuffer[index*NUM_SLICES+slice];
-        energy += sliceLambdas[slice].x*clEnergy[slice] + sliceLambdas[slice].y*ljEnergy[slice];
+        ljEnergy[slot] = ljpmeEnergyBuffer[index*NUM_ENERGY_SLOTS+slot];
+        energy += sliceLambdas[slice].x*clEnergy[slot] + sliceLambdas[slice].y*ljEnergy[slot];
 #else
-        energy += sliceLambdas[slice].x*clEnergy[slice];
+        energy += sliceLambdas[slice].x*clEnergy[slot];
 #endif
         }
+#if HAS_DISPERSION_CORRECTION
+    // The dispersion correction of each slice is added once, by the first thread.
+
+    mixed dispersion[NUM_SLICES];
+    for (int slice = 0; slice < NUM_SLICES; slice++) {
+        dispersion[slice] = (index == 0 ? dispersionCoefficients[slice]*invVolume : 0);
+        energy += sliceLambdas[slice].y*dispersion[slice];
+    }
+#endif
     energyBuffer[index] += energy;
 #if HAS_DERIVATIVES
     ADD_DERIVATIVES
@@ -0,0 +1,64 @@
+/**
+ * Evaluate a radial basis function expansion and its gradient at a point of the space of
+ * collective variables.  Each thread group writes the partial sums of the value and of the
+ * DIMENSION gradient components over the centers it has processed.
+ */
+KERNEL void evaluateRadialBasisFunction(GLOBAL const real* RESTRICT centers, GLOBAL const real* RESTRICT weights,
+        GLOBAL mixed* RESTRICT partialSums, int numCenters, int basisType, real shape2
+        POINT_ARGUMENTS) {
+    LOCAL mixed buffer[WORK_GROUP_SIZE];
+    real point[DIMENSION];
+    LOAD_POINT
+    mixed sum[DIMENSION+1];
+    for (int j = 0; j <= DIMENSION; j++)
+        sum[j] = 0;
+    for (int k = GLOBAL_ID; k < numCenters; k += GLOBAL_SIZE) {
+        real delta[DIMENSION];
+        real r2 = 0;
+        for (int j = 0; j < DIMENSION; j++) {
+            delta[j] = point[j]-centers[k*DIMENSION+j];
+            r2 += delta[j]*delta[j];
+        }
+
+        // Compute phi(s) and (dphi/dr)/r, where s = e*r.
+
+        real s2 = shape2*r2;
+        real phi, dPhi;
+        if (basisType == 0) {
+            phi = EXP(-s2);
+            dPhi = -2*shape2*phi;
+        }
+        else if (basisType == 1) {
+            phi = SQRT(1+s2);
+            dPhi = shape2/phi;
+        }
+        else if (s2 > 0) {
+            real logS2 = LOG(s2);
+            phi = 0.5f*s2*logS2;
+            dPhi = shape2*(logS2+1);
+        }
+        else {
+            phi = 0;
+            dPhi = 0;
+        }
+        real w = weights[k];
+        sum[0] += w*phi;
+        for (int j = 0; j < DIMENSION; j++)
+            sum[j+1] += w*dPhi*delta[j];
+    }
+
+    // Reduce the sums within the thread group.
+
+    for (int j = 0; j <= DIMENSION; j++) {
+        buffer[LOCAL_ID] = sum[j];
+        SYNC_THREADS;
+        for (int offset = WORK_GROUP_SIZE/2; offset > 0; offset >>= 1) {
+            if (LOCAL_ID < offset)
+                buffer[LOCAL_ID] += buffer[LOCAL_ID+offset];
+            SYNC_THREADS;
+        }
+        if (LOCAL_ID == 0)
+            partialSums[GROUP_ID*(DIMENSION+1)+j] = buffer[0];
+        SYNC_THREADS;
+    }
+}
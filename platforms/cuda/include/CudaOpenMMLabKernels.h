@@ -16,12 +16,18 @@
 #include "internal/CudaFFT3D.h"
 #include "internal/CudaCuFFT3D.h"
 #include "internal/CudaVkFFT3D.h"
+#include "internal/SlicedNonbondedForceImpl.h"
+#include "internal/ReferenceSlicedPME.h"
 #include "openmm/internal/ContextImpl.h"
+#include "internal/SharedThreadPool.h"
+#include "internal/TraceRecorder.h"
 #include "openmm/cuda/CudaContext.h"
 #include "openmm/cuda/CudaArray.h"
 #include "openmm/cuda/CudaSort.h"
 #include <vector>
+#include <array>
 #include <algorithm>
+#include <future>
 
 using namespace OpenMM;
 using namespace std;
@@ -34,8 +40,12 @@ namespace OpenMMLab {
 class CudaCalcSlicedNonbondedForceKernel : public CalcSlicedNonbondedForceKernel {
 public:
     CudaCalcSlicedNonbondedForceKernel(std::string name, const Platform& platform, CudaContext& cu, const System& system) :
-            CalcSlicedNonbondedForceKernel(name, platform), cu(cu), hasInitializedFFT(false), sort(NULL),
-            dispersionFft(NULL), fft(NULL), usePmeStream(false) {};
+            CalcSlicedNonbondedForceKernel(name, platform), cu(cu), hasInitializedFFT(false), hasCreatedReciprocalKernels(false), sort(NULL),
+            dispersionFft(NULL), fft(NULL), addEnergy(NULL), usePmeStream(false), usePmeGraphs(false), sortPmeAtoms(true), useCpuPme(false), cpuPmeThreads(NULL), useFixedSliceLambdas(false),
+            hasParameterSources(false), lambdaStaging(NULL), paramStaging(NULL), lambdaState(-1), hasLambdaStateSelfEnergies(false), overlapPmeStream(true), pmeTimingSample(-1),
+            timeDevice(false), hasPendingRange(false), useDerivativesOnDemand(false), computeDerivatives(false), derivativeFlagValue(-1),
+            useCompactParameters(false), packCharges(false),
+            profileStages(isProfilingEnabled() || TraceRecorder::isEnabled()) {};
     ~CudaCalcSlicedNonbondedForceKernel();
     /**
      * Initialize the kernel.
@@ -62,6 +72,45 @@ public:
      * @param force      the SlicedNonbondedForce to copy the parameters from
      */
     void copyParametersToContext(ContextImpl& context, const SlicedNonbondedForce& force);
+    /**
+     * Compute the Coulomb and Lennard-Jones energies of every slice, not multiplied by the
+     * scaling parameters.
+     *
+     * @param context            the context in which to execute this kernel
+     * @param includeDirect      true if direct space interactions should be included
+     * @param includeReciprocal  true if reciprocal space interactions should be included
+     * @param coulombEnergies    on exit, the Coulomb energy of each slice
+     * @param ljEnergies         on exit, the Lennard-Jones energy of each slice
+     */
+    void getSliceEnergies(ContextImpl& context, bool includeDirect, bool includeReciprocal, vector<double>& coulombEnergies, vector<double>& ljEnergies);
+    /**
+     * Compute the slice energies of a force that is evaluated by one or more kernels, one per
+     * device.  The energy is linear in the scaling parameters, so the energy of each slice is
+     * the energy obtained with only that slice switched on minus the energy obtained with all
+     * slices switched off.  The latter also removes the energies of other forces that belong
+     * to the same force groups.  If reciprocal space has a force group of its own, its slice
+     * energies are read directly from the per-slice energy buffers after a single evaluation.
+     */
+    static void computeSliceEnergies(ContextImpl& context, const vector<CudaCalcSlicedNonbondedForceKernel*>& kernels,
+                                     bool includeDirect, bool includeReciprocal, vector<double>& coulombEnergies, vector<double>& ljEnergies);
+    /**
+     * Compute the derivatives of the energy with respect to the scaling parameters for which
+     * derivatives were requested.
+     *
+     * @param context            the context in which to execute this kernel
+     * @param includeDirect      true if direct space interactions should be included
+     * @param includeReciprocal  true if reciprocal space interactions should be included
+     * @param derivatives        on exit, the derivative with respect to each parameter
+     */
+    void getScalingParameterDerivatives(ContextImpl& context, bool includeDirect, bool includeReciprocal, map<string, double>& derivatives);
+    /**
+     * Compute the scaling parameter derivatives of a force that is evaluated by one or more
+     * kernels, one per device.  Only the slices that have a requested derivative are switched
+     * on, so the direct space kernels skip the pairs of all other slices.  Derivatives with
+     * respect to the same parameters from other forces in the same force groups are included.
+     */
+    static void computeScalingParameterDerivatives(ContextImpl& context, const vector<CudaCalcSlicedNonbondedForceKernel*>& kernels,
+                                                   bool includeDirect, bool includeReciprocal, map<string, double>& derivatives);
     /**
      * Get the parameters being used for PME.
      *
@@ -80,6 +129,54 @@ public:
      * @param nz      the number of grid points along the Z axis
      */
     void getLJPMEParameters(double& alpha, int& nx, int& ny, int& nz) const;
+    /**
+     * Describe the device arrays that accumulate the reciprocal space energies of the slices.
+     *
+     * @param coulombEnergies   on exit, the array of Coulomb energies
+     * @param ljEnergies        on exit, the array of Lennard-Jones energies
+     * @param slotSlices        on exit, the slice whose energy each column of the arrays holds
+     */
+    void getSliceEnergyArrays(DeviceArray& coulombEnergies, DeviceArray& ljEnergies, std::vector<int>& slotSlices);
+    /**
+     * Select a lambda state, or -1 to follow the scaling parameters of the
+     * context again.
+     *
+     * @param index    the index of the foreign set, or -1
+     */
+    void setLambdaState(int index);
+    /**
+     * Get the selected lambda state, or -1 if the scaling parameters of the context are used.
+     */
+    int getLambdaState() const;
+    /**
+     * Get the time spent in each stage of the computation, in milliseconds.
+     *
+     * @param times    on exit, the accumulated time of each stage, keyed by stage name
+     */
+    void getStageTimes(std::map<std::string, double>& times);
+    /**
+     * Reset the accumulated times of all stages to zero.
+     */
+    void resetStageTimes();
+    /**
+     * Time every force computation of the device, from the start of the pre-computations to
+     * the end of the post-computations, which follow the direct space kernel.  This is used
+     * by the parallel kernel to balance the direct space work between devices.
+     */
+    void enableDeviceTiming();
+    /**
+     * Get the average time of the force computations completed since the last call, in
+     * milliseconds, and reset it.
+     *
+     * @param numSamples   on exit, the number of force computations averaged
+     */
+    double takeDeviceTime(int& numSamples);
+    /**
+     * Set the range of direct space tiles computed by the device, as fractions of the total.
+     * It takes effect at the start of the next force computation, before the neighbor list
+     * is built.
+     */
+    void setAtomBlockRange(double startFraction, double endFraction);
 private:
     class SortTrait : public CudaSort::SortTrait {
         int getDataSize() const {return 8;}
@@ -96,12 +193,26 @@ private:
     class SyncStreamPreComputation;
     class AddEnergyPostComputation;
     class SyncStreamPostComputation;
+    class PmeTimingPreComputation;
+    class PmeTimingPostComputation;
+    class DeviceTimingPreComputation;
+    class DeviceTimingPostComputation;
+    class DerivativeFlagPreComputation;
     class DispersionCorrectionPostComputation;
+    class CpuPmePostComputation;
     CudaContext& cu;
     ForceInfo* info;
     bool hasInitializedFFT;
+    // The reciprocal space kernels are only compiled when they are first needed, since a
+    // Context may never evaluate them, for example when the reciprocal space is in a force
+    // group that is never requested.
+
+    bool hasCreatedReciprocalKernels;
+    std::map<std::string, std::string> ewaldReplacements, pmeDefines, pmeReplacements;
     CudaArray charges;
     CudaArray sigmaEpsilon;
+    CudaArray compactParams;
+    CudaArray particleC6;
     CudaArray exceptionParams;
     CudaArray exclusionAtoms;
     CudaArray exclusionParams;
@@ -124,13 +235,17 @@ private:
     CudaArray pmeAtomGridIndex;
     CudaArray pmeEnergyBuffer;
     CudaArray ljpmeEnergyBuffer;
+    CudaArray pmeConvolutionFactors;
+    CudaArray pmeDispersionConvolutionFactors;
     CudaSort* sort;
     CUstream pmeStream;
     CUevent pmeSyncEvent, paramsSyncEvent;
-    CudaFFT3D* fft;
-    CudaFFT3D* dispersionFft;
-    CUfunction computeParamsKernel, computeExclusionParamsKernel;
+    CommonFFT3D* fft;
+    CommonFFT3D* dispersionFft;
+    CUfunction computeParamsKernel, computeAffectedParamsKernel, computeExclusionParamsKernel, computeAffectedExclusionParamsKernel;
+    CUfunction packCompactParamsKernel;
     CUfunction ewaldSumsKernel;
+    CUfunction ewaldSumsAndForcesKernel;
     CUfunction ewaldForcesKernel;
     CUfunction pmeGridIndexKernel;
     CUfunction pmeDispersionGridIndexKernel;
@@ -138,13 +253,16 @@ private:
     CUfunction pmeDispersionSpreadChargeKernel;
     CUfunction pmeFinishSpreadChargeKernel;
     CUfunction pmeDispersionFinishSpreadChargeKernel;
-    CUfunction pmeEvalEnergyKernel;
-    CUfunction pmeEvalDispersionEnergyKernel;
+    CUfunction pmeConvolutionEnergyKernel;
+    CUfunction pmeDispersionConvolutionEnergyKernel;
     CUfunction pmeConvolutionKernel;
+    CUfunction pmeConvolutionFactorsKernel;
+    CUfunction pmeDispersionConvolutionFactorsKernel;
     CUfunction pmeDispersionConvolutionKernel;
     CUfunction pmeInterpolateForceKernel;
     CUfunction pmeInterpolateDispersionForceKernel;
     AddEnergyPostComputation* addEnergy;
+    std::vector<int> exceptionOrder;
     std::vector<std::pair<int, int> > exceptionAtoms;
     CudaArray exceptionPairs;
     CudaArray exceptionSlices;
@@ -153,21 +271,177 @@ private:
     double ewaldSelfEnergy, alpha, dispersionAlpha;
     int interpolateForceThreads;
     int gridSizeX, gridSizeY, gridSizeZ;
+    Vec3 pmeConvolutionBox[3], dispersionConvolutionBox[3];
     int dispersionGridSizeX, dispersionGridSizeY, dispersionGridSizeZ;
-    bool hasCoulomb, hasLJ, usePmeStream, useCudaFFT, doLJPME, usePosqCharges, recomputeParams, hasOffsets;
+    bool hasCoulomb, hasLJ, usePmeStream, useCudaFFT, doLJPME, usePosqCharges, recomputeParams, hasOffsets, sortPmeAtoms;
     NonbondedMethod nonbondedMethod;
-    static const int PmeOrder = 5;
+    int pmeOrder;
+    static const int EwaldTileSize = 64;
+    // The cosine and sine sums of at most this many bytes are kept at once.  Longer lists of
+    // wave vectors are processed in chunks.
+    static const int MaxEwaldSumsBytes = 64*1024*1024;
+    // Systems with at most this many atoms compute the Ewald sums and forces in one launch.
+    static const int MaxFusedEwaldAtoms = 5000;
+    int numKVectors, kVectorChunkSize;
+    bool useFusedEwald;
 
-    int numSubsets, numSlices;
-    bool hasDerivatives;
+    int numSubsets, numSlices, forceGroup, recipForceGroup;
+    bool hasDerivatives, useFixedSliceLambdas;
+    // With derivatives on demand, they are only computed in evaluations that include the
+    // energy, and the direct space kernels read whether to compute them from derivativeFlag.
+
+    bool useDerivativesOnDemand, computeDerivatives;
+    int derivativeFlagValue;
+    CudaArray derivativeFlag;
+    // With compact parameters, the direct space kernel reads the parameters of each particle
+    // from compactParams, which is refilled whenever the parameters change.
+
+    bool useCompactParameters, packCharges;
     vector<int> subsetsVec;
     vector<double> dispersionCoefficients;
+    SlicedNonbondedForceImpl::DispersionCorrectionTable dispersionTable;
     vector<double2> sliceLambdasVec, subsetSelfEnergy;
     vector<ScalingParameterInfo> sliceScalingParams;
+    int numEnergySlots;
+    vector<int> sliceEnergySlots, energySlotSlices;
+    // Only the subsets whose particles can have charges, or epsilons for the dispersion grids,
+    // get a PME grid, and subsets whose slices are scaled alike share one.  The first subset of
+    // each grid is listed in chargeGridSubsets, and the grid of each subset, or -1, is listed in
+    // chargeSubsetGrids (likewise for dispersion).
+
+    vector<int> chargeGridSubsets, dispersionGridSubsets, chargeSubsetGrids, dispersionSubsetGrids;
+    vector<std::string> selfDerivNames;
+    vector<int2> selfDerivSlots;
+    vector<double> selfDerivTotals;
     CudaArray subsets;
     CudaArray sliceLambdas;
+    CudaArray sliceDispersionCoefficients;
+
+    // Pointers to the values of the context parameters read at every step, so that they
+    // are not looked up by name, and pinned staging buffers for uploading them.
+
+    bool hasParameterSources;
+    vector<const double*> coulombLambdaSources, ljLambdaSources, paramSources;
+    void* lambdaStaging;
+    void* paramStaging;
+    CUevent lambdaUploadEvent, paramUploadEvent;
+
+    // Lambda states, which are the foreign sets of scaling parameter values with the lambdas
+    // of every slice precomputed.  The device holds one row per state, so selecting a state
+    // only copies its row into sliceLambdas, without involving the host.  The self energy of
+    // every state is cached until the self energies of the subsets change.
+
+    int lambdaState;
+    vector<vector<double2> > lambdaStatesVec;
+    CudaArray lambdaStates;
+    bool hasLambdaStateSelfEnergies;
+    vector<double> lambdaStateSelfEnergies;
+
+    // Automatic choice of whether the PME stream overlaps with the direct space calculation
+    // or is waited for as soon as it has been launched.  The first evaluations alternate
+    // between the two modes and are timed, and the faster mode is kept afterward.
+
+    static const int PmeTuningWarmup = 2, PmeTuningSamples = 10;
+    bool overlapPmeStream, pmeTimingPending;
+    int pmeTimingSample;
+    double pmeTimingTotal[2];
+    CUevent pmeTimingStartEvent, pmeTimingEndEvent;
+
+    // Timing of the whole force computation of the device, and the direct space tile range
+    // requested by the parallel kernel, which is applied by the next pre-computation.
+
+    bool timeDevice, deviceTimingPending, hasPendingRange;
+    int deviceTimingSamples;
+    double deviceTimingTotal, pendingRangeStart, pendingRangeEnd;
+    CUevent deviceTimingStartEvent, deviceTimingEndEvent;
+
+    // Graphs replaying the reciprocal space kernels, one for each combination of whether forces
+    // and energies are computed.  They are captured again when the box vectors change.
+
+    bool usePmeGraphs;
+    vector<CUgraphExec> pmeGraphs;
+    vector<bool> pmeGraphIsWarm, pmeGraphIsStale;
+    Vec3 pmeGraphBox[3];
+
+    // Reciprocal space computed on the host by the reference PME, in a worker thread that runs
+    // while the device computes direct space.  The positions and parameters are downloaded,
+    // and the forces uploaded in fixed point, through pinned buffers.
+
+    bool useCpuPme, cpuPmePending, cpuPmeParamsChanged;
+    SharedThreadPool* cpuPmeThreads;
+    pme_t cpuPmeData, cpuDispersionPmeData;
+    void* cpuPmePosq;
+    void* cpuPmeCharges;
+    void* cpuPmeSigmaEpsilon;
+    long long* cpuPmeForces;
+    CudaArray cpuPmeForceBuffer;
+    CUevent cpuPmeDownloadEvent;
+    CUfunction addHostForcesKernel;
+    std::future<void> cpuPmeResult;
+    vector<array<double, 3> > cpuPmeSliceEnergies;
+
+    // Profiling of the stages of execute().  Each stage is enclosed by a pair of events on
+    // the stream it runs on, and the elapsed times are only read at the next evaluation or
+    // when they are requested, so that profiling does not stall the host.  When a trace is
+    // recorded, the stages are also written as device spans, placed relative to the host
+    // time at which the first of them was enqueued.
+
+    bool profileStages;
+    vector<CUevent> stageEvents;
+    vector<string> pendingStages;
+    map<string, double> stageTimes;
+    double pendingStagesStart;
+    long long pendingStagesStep;
+
+    // The particles, exceptions and exclusions whose parameters depend on each global parameter,
+    // stored as ranges of the affected* arrays, so that a change only updates what it affects.
+    // The host keeps the base parameters and offsets to update the self energy the same way.
+
+    CudaArray affectedParticles, affectedExceptions, affectedExclusions;
+    vector<int> affectedParticlesVec, affectedParticleStart, affectedExceptionStart, affectedExclusionStart;
+    vector<float4> baseParticleParamVec, baseExceptionParamVec;
+    vector<vector<float4> > particleOffsetVec;
+    vector<double2> particleSelfEnergy;
+
+    // Automatic choice of the FFT library.  Both libraries are timed on each grid, and the
+    // faster one is recorded in a table shared by all contexts and stored on disk.
+
+    // The PME grid sizes can be tuned the same way, among the sizes that are at most
+    // MaxPmeGridGrowth percent larger than the ones required by the error tolerance.
+
+    static const int FFTTuningWarmup = 2, FFTTuningSamples = 10, MaxPmeGridGrowth = 10;
+    CommonFFT3D* createFFT(int xsize, int ysize, int zsize, int numGrids, bool useCuFFT, CudaArray* convolutionFactors=NULL);
+    bool chooseCuFFT(int xsize, int ysize, int zsize, int numGrids);
+    void choosePmeGridSize(int& xsize, int& ysize, int& zsize, int numGrids, bool doublePrecisionGrids, bool useCuFFT, bool autotune);
+    double timeFFT(CommonFFT3D& fft, CUstream stream);
 
     string getDerivativeExpression(string param, bool conditionCoulomb, bool conditionLJ);
+    void assignPmeGrids(const vector<bool>& gridded, bool coulomb, vector<int>& gridSubsets, vector<int>& subsetGrids);
+    void setGridDefines(map<string, string>& defines, const vector<int>& gridSubsets, const vector<int>& subsetGrids);
+    void setSliceLambdas(const vector<double2>& lambdas, bool fixed);
+    void uploadSliceLambdas();
+    void initializeLambdaStates(const SlicedNonbondedForce& force);
+    void createReciprocalKernels();
+    void getContextRange(int numItems, int& startIndex, int& endIndex) const;
+    void computeEwaldSelfEnergy();
+    void updateSelfEnergy(const int* particles, int numParticles);
+    void findParameterSources(ContextImpl& context);
+    void uploadAsync(CudaArray& array, const double* values, int numValues, void* staging, CUevent event);
+    void executePmeKernels(bool includeForces, bool includeEnergy, void* recipBoxVectorPointer[3]);
+    void launchPmeGraph(bool includeForces, bool includeEnergy, const Vec3* boxVectors, void* recipBoxVectorPointer[3]);
+    void initializeCpuPme();
+    void launchCpuPme(bool includeForces);
+    void computeCpuPme(bool includeForces, const Vec3* boxVectors, const vector<array<double, 2> >& lambdas);
+    double finishCpuPme(bool includeForces);
+    void beginPmeTiming();
+    void endPmeTiming();
+    void beginDeviceTiming(int groups);
+    void endDeviceTiming(int groups);
+    void setComputeDerivatives(bool compute);
+    void beginStage(const string& name);
+    void endStage();
+    void collectStageTimes();
+    void addReciprocalSliceEnergies(vector<double>& coulombEnergies, vector<double>& ljEnergies);
 
     vector<float2> double2Tofloat2(vector<double2> input) {
         vector<float2> output(input.size());
@@ -207,11 +481,43 @@ public:
  */
 class CudaCalcExtendedCustomCVForceKernel : public CommonCalcExtendedCustomCVForceKernel {
 public:
-    CudaCalcExtendedCustomCVForceKernel(std::string name, const Platform& platform, ComputeContext& cc) : CommonCalcExtendedCustomCVForceKernel(name, platform, cc) {
+    CudaCalcExtendedCustomCVForceKernel(std::string name, const Platform& platform, ComputeContext& cc) : CommonCalcExtendedCustomCVForceKernel(name, platform, cc),
+            hasSideStream(false) {
     }
+    ~CudaCalcExtendedCustomCVForceKernel();
+    /**
+     * Get the ComputeContext corresponding to the inner Context.  The inner Context is linked
+     * to the outer one, so it runs on the same devices and its own parallel kernels split the
+     * work of every collective variable among them.  Their forces end up summed on the first
+     * device, which is therefore the one this kernel reads them from.
+     */
     ComputeContext& getInnerComputeContext(ContextImpl& innerContext) {
         return *reinterpret_cast<CudaPlatform::PlatformData*>(innerContext.getPlatformData())->contexts[0];
     }
+    /**
+     * Block until all work queued on a ComputeContext has finished.
+     */
+    void synchronize(ComputeContext& context) {
+        cuStreamSynchronize(dynamic_cast<CudaContext&>(context).getCurrentStream());
+    }
+    /**
+     * Create a non-blocking stream shared by the outer and inner contexts while they evaluate
+     * the collective variables, and the events that synchronize it with the default stream.
+     */
+    bool createSideQueue(ComputeContext& context, ComputeContext& innerContext);
+    void markOuterQueue(ComputeContext& context);
+    void beginSideQueue(ComputeContext& context, ComputeContext& innerContext);
+    void endSideQueue(ComputeContext& context, ComputeContext& innerContext);
+    /**
+     * Fill in the device pointer of an array, along with the stream on which the outer
+     * context enqueues its work.
+     */
+    void describeArray(ComputeContext& context, ArrayInterface& array, DeviceArray& description);
+private:
+    bool hasSideStream;
+    CUstream sideStream;
+    CUevent outerEvent, sideEvent;
+    ComputeContext* outerContext;
 };
 
 } // namespace OpenMMLab
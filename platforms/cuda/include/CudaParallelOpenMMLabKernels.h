@@ -20,6 +20,18 @@ namespace OpenMMLab {
 
 /**
  * This kernel is invoked by SlicedNonbondedForce to calculate the forces acting on the system.
+ *
+ * The direct space tiles are split between the devices by the nonbonded utilities of OpenMM,
+ * whose parallel kernel only balances them during the first force computations.  After that,
+ * this kernel keeps them balanced: every device times its whole force computation, and at
+ * regular intervals the tiles are moved toward the devices that finished first, so that
+ * devices of different speeds, or whose speed changes during a run, end a step together.
+ *
+ * Each device accumulates its forces in its own fixed point buffer and its energy in its own
+ * slot of the platform data.  They are summed by the parallel kernel of OpenMM at the end of
+ * every force computation, which copies the force buffers directly between devices when the
+ * platform has enabled peer access among them, and only stages them through the host when it
+ * has not.  This kernel therefore has no reduction of its own.
  */
 class CudaParallelCalcSlicedNonbondedForceKernel : public CalcSlicedNonbondedForceKernel {
 public:
@@ -52,6 +64,27 @@ public:
      * @param force      the SlicedNonbondedForce to copy the parameters from
      */
     void copyParametersToContext(ContextImpl& context, const SlicedNonbondedForce& force);
+    /**
+     * Compute the Coulomb and Lennard-Jones energies of every slice, not multiplied by the
+     * scaling parameters.
+     *
+     * @param context            the context in which to execute this kernel
+     * @param includeDirect      true if direct space interactions should be included
+     * @param includeReciprocal  true if reciprocal space interactions should be included
+     * @param coulombEnergies    on exit, the Coulomb energy of each slice
+     * @param ljEnergies         on exit, the Lennard-Jones energy of each slice
+     */
+    void getSliceEnergies(ContextImpl& context, bool includeDirect, bool includeReciprocal, vector<double>& coulombEnergies, vector<double>& ljEnergies);
+    /**
+     * Compute the derivatives of the energy with respect to the scaling parameters for which
+     * derivatives were requested.
+     *
+     * @param context            the context in which to execute this kernel
+     * @param includeDirect      true if direct space interactions should be included
+     * @param includeReciprocal  true if reciprocal space interactions should be included
+     * @param derivatives        on exit, the derivative with respect to each parameter
+     */
+    void getScalingParameterDerivatives(ContextImpl& context, bool includeDirect, bool includeReciprocal, map<string, double>& derivatives);
     /**
      * Get the parameters being used for PME.
      *
@@ -70,10 +103,49 @@ public:
      * @param nz      the number of grid points along the Z axis
      */
     void getLJPMEParameters(double& alpha, int& nx, int& ny, int& nz) const;
+    /**
+     * Describe the device arrays that accumulate the reciprocal space energies of the slices,
+     * which reciprocal space computes on the first device.
+     *
+     * @param coulombEnergies   on exit, the array of Coulomb energies
+     * @param ljEnergies        on exit, the array of Lennard-Jones energies
+     * @param slotSlices        on exit, the slice whose energy each column of the arrays holds
+     */
+    void getSliceEnergyArrays(DeviceArray& coulombEnergies, DeviceArray& ljEnergies, std::vector<int>& slotSlices);
+    /**
+     * Select a lambda state on every device, or -1 to follow the scaling parameters of the
+     * context again.
+     *
+     * @param index    the index of the foreign set, or -1
+     */
+    void setLambdaState(int index);
+    /**
+     * Get the selected lambda state, or -1 if the scaling parameters of the context are used.
+     */
+    int getLambdaState() const;
+    /**
+     * Get the time spent in each stage of the computation, in milliseconds, summed over
+     * all devices.
+     *
+     * @param times    on exit, the accumulated time of each stage, keyed by stage name
+     */
+    void getStageTimes(std::map<std::string, double>& times);
+    /**
+     * Reset the accumulated times of all stages to zero.
+     */
+    void resetStageTimes();
 private:
     class Task;
+    void balanceLoad();
     CudaPlatform::PlatformData& data;
     std::vector<Kernel> kernels;
+    // OpenMM balances the tiles during its first BalanceStart force computations.  Afterward,
+    // they are balanced every BalanceInterval evaluations, unless the times of the devices
+    // differ by less than MinImbalance.
+
+    static const int BalanceStart = 200, BalanceInterval = 100;
+    static constexpr double MinImbalance = 0.02;
+    int evaluationsSinceBalance;
 };
 
 } // namespace OpenMM
@@ -14,6 +14,8 @@
 #include "internal/CudaFFT3D.h"
 #include "openmm/cuda/CudaArray.h"
 #include <cufft.h>
+#include <memory>
+#include <mutex>
 
 using namespace OpenMM;
 
@@ -34,9 +36,9 @@ public:
      * Create an CudaCuFFT3D object for performing transforms of a particular size.
      *
      * The transform cannot be done in-place: the input and output
-     * arrays must be different.  Also, the input array is used as workspace, so its contents
-     * are destroyed.  This also means that both arrays must be large enough to hold complex values,
-     * even when performing a real-to-complex transform.
+     * arrays must be different.  Also, the inverse transform overwrites the contents of the
+     * output array.  When performing a real-to-complex transform, the input array only needs
+     * to hold xsize*ysize*zsize real values per batch.
      *
      * When performing a real-to-complex transform, the output data is of size xsize*ysize*(zsize/2+1)
      * and contains only the non-redundant elements.
@@ -60,8 +62,23 @@ public:
      */
     void execFFT(bool forward);
 private:
-    cufftHandle fftForward;
-    cufftHandle fftBackward;
+    /**
+     * The plans for one combination of CUDA context, dimensions, batch size, precision and
+     * kind of transform.  They are shared by all CudaCuFFT3D objects created with the same
+     * combination, along with a single work area.  The uses of a plan on different streams
+     * are ordered with an event, since they share the work area.
+     */
+    struct Plan {
+        cufftHandle fftForward;
+        cufftHandle fftBackward;
+        CUdeviceptr workArea;
+        CUevent lastUse;
+        std::mutex lock;
+        ~Plan();
+    };
+    static std::shared_ptr<Plan> getPlan(int xsize, int ysize, int zsize, int batch, bool realToComplex, bool doublePrecision);
+    std::shared_ptr<Plan> plan;
+    CUstream* stream;
 };
 
 } // namespace OpenMMLab
@@ -15,6 +15,9 @@
 #include "openmm/cuda/CudaArray.h"
 #define VKFFT_BACKEND 1 // CUDA
 #include "vkFFT.h"
+#include <memory>
+#include <mutex>
+#include <string>
 
 using namespace OpenMM;
 
@@ -35,9 +38,9 @@ public:
      * Create an CudaVkFFT3D object for performing transforms of a particular size.
      *
      * The transform cannot be done in-place: the input and output
-     * arrays must be different.  Also, the input array is used as workspace, so its contents
-     * are destroyed.  This also means that both arrays must be large enough to hold complex values,
-     * even when performing a real-to-complex transform.
+     * arrays must be different.  Also, the inverse transform overwrites the contents of the
+     * output array.  When performing a real-to-complex transform, the input array only needs
+     * to hold xsize*ysize*zsize real values per batch.
      *
      * When performing a real-to-complex transform, the output data is of size xsize*ysize*(zsize/2+1)
      * and contains only the non-redundant elements.
@@ -51,8 +54,11 @@ public:
      * @param realToComplex  if true, a real-to-complex transform will be done.  Otherwise, it is complex-to-complex.
      * @param in      the data to transform, ordered such that in[x*ysize*zsize + y*zsize + z] contains element (x, y, z)
      * @param out     on exit, this contains the transformed data
+     * @param convolutionKernel  if not NULL, a grid with the layout of a single batch of the
+     *                           output, by which execConvolution() multiplies every batch
      */
-    CudaVkFFT3D(CudaContext& context, CUstream& stream, int xsize, int ysize, int zsize, int batch, bool realToComplex, CudaArray& in, CudaArray& out);
+    CudaVkFFT3D(CudaContext& context, CUstream& stream, int xsize, int ysize, int zsize, int batch, bool realToComplex, CudaArray& in, CudaArray& out,
+                CudaArray* convolutionKernel=NULL);
     ~CudaVkFFT3D();
     /**
      * Perform a Fourier transform.
@@ -60,11 +66,50 @@ public:
      * @param forward  true to perform a forward transform, false to perform an inverse transform
      */
     void execFFT(bool forward);
+    bool hasConvolution() const {
+        return convolutionPlan != NULL;
+    }
+    /**
+     * Perform a forward transform, the convolution, and an inverse transform in a single
+     * VkFFT application.
+     */
+    void execConvolution();
+    /**
+     * Set the directory where compiled VkFFT kernels are stored, so that later processes
+     * load them instead of compiling them again.  The directory must already exist.  The
+     * default is the value of the environment variable OPENMMLAB_VKFFT_CACHE_DIR, and an
+     * empty string disables the cache.
+     */
+    static void setKernelCacheDirectory(const std::string& directory);
+    /**
+     * Get the directory where compiled VkFFT kernels are stored, or an empty string if they
+     * are not stored.
+     */
+    static std::string getKernelCacheDirectory();
 private:
-    int device;
-    uint64_t inputBufferSize;
-    uint64_t outputBufferSize;
-    VkFFTApplication* app;
+    /**
+     * The VkFFT application for one combination of CUDA context, dimensions, batch size,
+     * precision and kind of transform.  It is shared by all CudaVkFFT3D objects created with
+     * the same combination, so its kernels are only compiled once.  Each object passes its
+     * own buffers and stream when it launches the transform, and the uses on different
+     * streams are ordered with an event, since they share the application's temporary buffer.
+     */
+    struct Plan {
+        int device;
+        CUstream stream;
+        uint64_t inputBufferSize;
+        uint64_t outputBufferSize;
+        uint64_t kernelSize;
+        VkFFTApplication app;
+        CUevent lastUse;
+        std::mutex lock;
+        ~Plan();
+    };
+    static std::shared_ptr<Plan> getPlan(CudaContext& context, int xsize, int ysize, int zsize, int batch, bool realToComplex, bool doublePrecision,
+                                         CUdeviceptr inputBuffer, CUdeviceptr outputBuffer, CUdeviceptr kernelBuffer);
+    std::shared_ptr<Plan> plan, convolutionPlan;
+    CUdeviceptr kernelBuffer;
+    CUstream* stream;
 };
 
 } // namespace OpenMMLab
@@ -10,14 +10,41 @@
 
 #include "internal/CudaCuFFT3D.h"
 #include "openmm/cuda/CudaContext.h"
+#include <algorithm>
+#include <map>
 #include <string>
+#include <tuple>
 
 using namespace OpenMMLab;
 using namespace OpenMM;
 using namespace std;
 
 CudaCuFFT3D::CudaCuFFT3D(CudaContext& context, CUstream& stream, int xsize, int ysize, int zsize, int batch, bool realToComplex, CudaArray& in, CudaArray& out) :
-        CudaFFT3D(context, stream, xsize, ysize, zsize, batch, realToComplex, in, out) {
+        CudaFFT3D(context, stream, xsize, ysize, zsize, batch, realToComplex, in, out), stream(&stream) {
+    plan = getPlan(xsize, ysize, zsize, batch, realToComplex, doublePrecision);
+}
+
+CudaCuFFT3D::~CudaCuFFT3D() {
+}
+
+CudaCuFFT3D::Plan::~Plan() {
+    cufftDestroy(fftForward);
+    cufftDestroy(fftBackward);
+    cuMemFree(workArea);
+    cuEventDestroy(lastUse);
+}
+
+shared_ptr<CudaCuFFT3D::Plan> CudaCuFFT3D::getPlan(int xsize, int ysize, int zsize, int batch, bool realToComplex, bool doublePrecision) {
+    static mutex cacheLock;
+    static map<tuple<CUcontext, int, int, int, int, bool, bool>, weak_ptr<Plan> > cache;
+    CUcontext cuContext;
+    cuCtxGetCurrent(&cuContext);
+    auto key = make_tuple(cuContext, xsize, ysize, zsize, batch, realToComplex, doublePrecision);
+    lock_guard<mutex> guard(cacheLock);
+    shared_ptr<Plan> plan = cache[key].lock();
+    if (plan)
+        return plan;
+
     int outputZSize = realToComplex ? (zsize/2+1) : zsize;
     int n[3] = {xsize, ysize, zsize};
     int inembed[] = {xsize, ysize, zsize};
@@ -33,24 +60,43 @@ CudaCuFFT3D::CudaCuFFT3D(CudaContext& context, CUstream& stream, int xsize, int
     else
         forwardType = backwardType = doublePrecision ? CUFFT_Z2Z : CUFFT_C2C;
 
-    cufftResult result = cufftPlanMany(&fftForward, 3, n, inembed, 1, idist, onembed, 1, odist, forwardType, batch);
+    // Create the plans without work areas, and then give both of them a single one that is
+    // large enough for either.
+
+    plan = make_shared<Plan>();
+    cufftCreate(&plan->fftForward);
+    cufftCreate(&plan->fftBackward);
+    cufftSetAutoAllocation(plan->fftForward, 0);
+    cufftSetAutoAllocation(plan->fftBackward, 0);
+    size_t forwardSize, backwardSize;
+    cufftResult result = cufftMakePlanMany(plan->fftForward, 3, n, inembed, 1, idist, onembed, 1, odist, forwardType, batch, &forwardSize);
     if (result != CUFFT_SUCCESS)
         throw OpenMMException("Error initializing CuFFT: "+to_string(result));
 
-    result = cufftPlanMany(&fftBackward, 3, n, onembed, 1, odist, inembed, 1, idist, backwardType, batch);
+    result = cufftMakePlanMany(plan->fftBackward, 3, n, onembed, 1, odist, inembed, 1, idist, backwardType, batch, &backwardSize);
     if (result != CUFFT_SUCCESS)
         throw OpenMMException("Error initializing FFT: "+to_string(result));
 
-    cufftSetStream(fftForward, stream);
-    cufftSetStream(fftBackward, stream);
-}
-
-CudaCuFFT3D::~CudaCuFFT3D() {
-    cufftDestroy(fftForward);
-    cufftDestroy(fftBackward);
+    if (cuMemAlloc(&plan->workArea, max(max(forwardSize, backwardSize), (size_t) 1)) != CUDA_SUCCESS)
+        throw OpenMMException("Error allocating the work area of CuFFT");
+    cufftSetWorkArea(plan->fftForward, (void*) plan->workArea);
+    cufftSetWorkArea(plan->fftBackward, (void*) plan->workArea);
+    if (cuEventCreate(&plan->lastUse, CU_EVENT_DISABLE_TIMING) != CUDA_SUCCESS)
+        throw OpenMMException("Error creating event for CuFFT");
+    cuEventRecord(plan->lastUse, 0);
+    cache[key] = plan;
+    return plan;
 }
 
 void CudaCuFFT3D::execFFT(bool forward) {
+    // Wait for any previous use of the plan on another stream before reusing its work area.
+
+    lock_guard<mutex> guard(plan->lock);
+    cuStreamWaitEvent(*stream, plan->lastUse, 0);
+    cufftHandle fftForward = plan->fftForward;
+    cufftHandle fftBackward = plan->fftBackward;
+    cufftSetStream(fftForward, *stream);
+    cufftSetStream(fftBackward, *stream);
     cufftResult result;
     if (forward) {
         if (realToComplex) {
@@ -82,4 +128,5 @@ void CudaCuFFT3D::execFFT(bool forward) {
     }
     if (result != CUFFT_SUCCESS)
         throw OpenMMException("Error executing FFT: "+to_string(result));
+    cuEventRecord(plan->lastUse, *stream);
 }
@@ -25,6 +25,7 @@ extern "C" OPENMM_EXPORT void registerKernelFactories() {
         CudaOpenMMLabKernelFactory* factory = new CudaOpenMMLabKernelFactory();
         platform.registerKernelFactory(CalcSlicedNonbondedForceKernel::Name(), factory);
         platform.registerKernelFactory(CalcExtendedCustomCVForceKernel::Name(), factory);
+        platform.registerKernelFactory(CalcCustomSummationKernel::Name(), factory);
     }
     catch (std::exception ex) {
         // Ignore
@@ -53,5 +54,7 @@ KernelImpl* CudaOpenMMLabKernelFactory::createKernelImpl(std::string name, const
         return new CudaCalcSlicedNonbondedForceKernel(name, platform, cu, context.getSystem());
     if (name == CalcExtendedCustomCVForceKernel::Name())
         return new CudaCalcExtendedCustomCVForceKernel(name, platform, cu);
+    if (name == CalcCustomSummationKernel::Name())
+        return new CommonCalcCustomSummationKernel(name, platform, cu);
     throw OpenMMException((std::string("Tried to create kernel with illegal kernel name '")+name+"'").c_str());
 }
@@ -13,14 +13,29 @@
 #include "CommonOpenMMLabKernelSources.h"
 #include "SlicedNonbondedForce.h"
 #include "internal/SlicedNonbondedForceImpl.h"
+#include "internal/TracingRange.h"
 #include "openmm/NonbondedForce.h"
 #include "openmm/cuda/CudaForceInfo.h"
 #include "openmm/reference/SimTKOpenMMRealType.h"
 #include "openmm/common/ContextSelector.h"
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
 #include <cstring>
+#include <fstream>
+#include <future>
 #include <map>
+#include <mutex>
 #include <algorithm>
 #include <iostream>
+#include <sstream>
+#ifdef _WIN32
+#include <process.h>
+#define getpid _getpid
+#else
+#include <unistd.h>
+#endif
 
 #define CHECK_RESULT(result, prefix) \
     if (result != CUDA_SUCCESS) { \
@@ -32,11 +47,97 @@ using namespace OpenMMLab;
 using namespace OpenMM;
 using namespace std;
 
+/**
+ * Build an expression that looks up an integer table indexed by a variable whose value is
+ * known at compile time after unrolling, so that it folds into a constant.
+ */
+static string tableLookupExpression(const string& variable, const vector<int>& table) {
+    bool identity = true;
+    for (int i = 0; i < table.size(); i++)
+        identity &= (table[i] == i);
+    if (identity)
+        return "("+variable+")";
+    stringstream expression;
+    expression<<"(";
+    for (int i = 0; i < (int) table.size()-1; i++)
+        expression<<variable<<"=="<<i<<" ? "<<table[i]<<" : ";
+    expression<<table.back()<<")";
+    return expression.str();
+}
+
+/**
+ * Find the subsets that need a PME grid, because some of their particles have a nonzero charge,
+ * or a nonzero epsilon for the dispersion grids, in their base parameters or in an offset.
+ */
+static void findGriddedSubsets(const SlicedNonbondedForce& force, vector<bool>& hasCharge, vector<bool>& hasEpsilon) {
+    hasCharge.assign(force.getNumSubsets(), false);
+    hasEpsilon.assign(force.getNumSubsets(), false);
+    for (int i = 0; i < force.getNumParticles(); i++) {
+        double charge, sigma, epsilon;
+        force.getParticleParameters(i, charge, sigma, epsilon);
+        int subset = force.getParticleSubset(i);
+        hasCharge[subset] = hasCharge[subset] || (charge != 0.0);
+        hasEpsilon[subset] = hasEpsilon[subset] || (epsilon != 0.0);
+    }
+    for (int i = 0; i < force.getNumParticleParameterOffsets(); i++) {
+        string param;
+        int particle;
+        double charge, sigma, epsilon;
+        force.getParticleParameterOffset(i, param, particle, charge, sigma, epsilon);
+        int subset = force.getParticleSubset(particle);
+        hasCharge[subset] = hasCharge[subset] || (charge != 0.0);
+        hasEpsilon[subset] = hasEpsilon[subset] || (epsilon != 0.0);
+    }
+}
+
+/**
+ * Upload the elements of an array that differ from the ones uploaded before.  Changed
+ * elements separated by small gaps are sent in a single transfer, since the cost of a
+ * transfer is dominated by its latency.
+ */
+template <class T>
+static void uploadChangedElements(CudaArray& array, const vector<T>& values, const vector<T>& previous) {
+    const int maxGap = 256;
+    int size = values.size();
+    if (previous.size() != size) {
+        array.upload(values);
+        return;
+    }
+    int start = -1, last = -1;
+    for (int i = 0; i <= size; i++) {
+        if (i < size && memcmp(&values[i], &previous[i], sizeof(T)) != 0) {
+            if (start < 0)
+                start = i;
+            last = i;
+        }
+        else if (start >= 0 && (i == size || i-last > maxGap)) {
+            array.uploadSubArray(&values[start], start, last-start+1);
+            start = -1;
+        }
+    }
+}
+
 class CudaCalcSlicedNonbondedForceKernel::ForceInfo : public CudaForceInfo {
 public:
     ForceInfo(const SlicedNonbondedForce& force) : force(force) {
+        hasOffsets.resize(force.getNumParticles(), false);
+        for (int i = 0; i < force.getNumParticleParameterOffsets(); i++) {
+            string param;
+            int particle;
+            double charge, sigma, epsilon;
+            force.getParticleParameterOffset(i, param, particle, charge, sigma, epsilon);
+            hasOffsets[particle] = true;
+        }
     }
+    /**
+     * Particles of different subsets are never identical, so atom reordering cannot swap them
+     * and mix the subsets of a tile.  The spatial order itself is chosen by the context, which
+     * does not let forces change it.  Particles with offsets are never identical either, since
+     * their parameters are only updated where the offsets were recorded.
+     */
     bool areParticlesIdentical(int particle1, int particle2) {
+        if (hasOffsets[particle1] || hasOffsets[particle2])
+            return false;
         double charge1, charge2, sigma1, sigma2, epsilon1, epsilon2;
         force.getParticleParameters(particle1, charge1, sigma1, epsilon1);
         force.getParticleParameters(particle2, charge2, sigma2, epsilon2);
@@ -70,6 +171,7 @@ public:
     }
 private:
     const SlicedNonbondedForce& force;
+    vector<bool> hasOffsets;
 };
 
 class CudaCalcSlicedNonbondedForceKernel::SyncStreamPreComputation : public CudaContext::ForcePreComputation {
@@ -103,19 +205,91 @@ private:
     int forceGroup;
 };
 
+class CudaCalcSlicedNonbondedForceKernel::PmeTimingPreComputation : public CudaContext::ForcePreComputation {
+public:
+    PmeTimingPreComputation(CudaCalcSlicedNonbondedForceKernel& owner, int forceGroup) : owner(owner), forceGroup(forceGroup) {
+    }
+    void computeForceAndEnergy(bool includeForces, bool includeEnergy, int groups) {
+        if ((groups&(1<<forceGroup)) != 0)
+            owner.beginPmeTiming();
+    }
+private:
+    CudaCalcSlicedNonbondedForceKernel& owner;
+    int forceGroup;
+};
+
+class CudaCalcSlicedNonbondedForceKernel::PmeTimingPostComputation : public CudaContext::ForcePostComputation {
+public:
+    PmeTimingPostComputation(CudaCalcSlicedNonbondedForceKernel& owner, int forceGroup) : owner(owner), forceGroup(forceGroup) {
+    }
+    double computeForceAndEnergy(bool includeForces, bool includeEnergy, int groups) {
+        if ((groups&(1<<forceGroup)) != 0)
+            owner.endPmeTiming();
+        return 0.0;
+    }
+private:
+    CudaCalcSlicedNonbondedForceKernel& owner;
+    int forceGroup;
+};
+
+class CudaCalcSlicedNonbondedForceKernel::DeviceTimingPreComputation : public CudaContext::ForcePreComputation {
+public:
+    DeviceTimingPreComputation(CudaCalcSlicedNonbondedForceKernel& owner) : owner(owner) {
+    }
+    void computeForceAndEnergy(bool includeForces, bool includeEnergy, int groups) {
+        owner.beginDeviceTiming(groups);
+    }
+private:
+    CudaCalcSlicedNonbondedForceKernel& owner;
+};
+
+class CudaCalcSlicedNonbondedForceKernel::DeviceTimingPostComputation : public CudaContext::ForcePostComputation {
+public:
+    DeviceTimingPostComputation(CudaCalcSlicedNonbondedForceKernel& owner) : owner(owner) {
+    }
+    double computeForceAndEnergy(bool includeForces, bool includeEnergy, int groups) {
+        owner.endDeviceTiming(groups);
+        return 0.0;
+    }
+private:
+    CudaCalcSlicedNonbondedForceKernel& owner;
+};
+
+class CudaCalcSlicedNonbondedForceKernel::DerivativeFlagPreComputation : public CudaContext::ForcePreComputation {
+public:
+    DerivativeFlagPreComputation(CudaCalcSlicedNonbondedForceKernel& owner) : owner(owner) {
+    }
+    void computeForceAndEnergy(bool includeForces, bool includeEnergy, int groups) {
+        owner.setComputeDerivatives(includeEnergy);
+    }
+private:
+    CudaCalcSlicedNonbondedForceKernel& owner;
+};
+
 class CudaCalcSlicedNonbondedForceKernel::AddEnergyPostComputation : public CudaContext::ForcePostComputation {
 public:
-    AddEnergyPostComputation(CudaContext& cu, int forceGroup) : cu(cu), forceGroup(forceGroup), initialized(false) {
+    AddEnergyPostComputation(CudaContext& cu, int forceGroup, const bool& computeDerivatives) : cu(cu), forceGroup(forceGroup),
+            computeDerivatives(computeDerivatives), initialized(false), dispersionCoefficients(NULL) {
+    }
+    /**
+     * Let the kernel also add the dispersion correction, whose coefficient for each slice is
+     * divided by the volume of the box.  This must be called before initialize().
+     */
+    void setDispersionCoefficients(CudaArray& coefficients) {
+        dispersionCoefficients = &coefficients;
     }
-    void initialize(CudaArray& pmeEnergyBuffer, CudaArray& ljpmeEnergyBuffer, CudaArray& sliceLambdas, vector<ScalingParameterInfo> sliceScalingParams) {
+    void initialize(CudaArray& pmeEnergyBuffer, CudaArray& ljpmeEnergyBuffer, CudaArray& sliceLambdas, const vector<ScalingParameterInfo>& sliceScalingParams,
+                    const vector<int>& sliceEnergySlots, const vector<int>& energySlotSlices) {
         int numSlices = sliceLambdas.getSize();
+        int numEnergySlots = energySlotSlices.size();
         bool doLJPME = ljpmeEnergyBuffer.isInitialized();
-        bufferSize = pmeEnergyBuffer.getSize()/numSlices;
+        bool hasDispersion = (dispersionCoefficients != NULL);
+        bufferSize = pmeEnergyBuffer.getSize()/numEnergySlots;
         set<string> requestedDerivs;
-        for (ScalingParameterInfo info : sliceScalingParams) {
+        for (const ScalingParameterInfo& info : sliceScalingParams) {
             if (info.hasDerivativeCoulomb)
                 requestedDerivs.insert(info.nameCoulomb);
-            if (doLJPME && info.hasDerivativeLJ)
+            if ((doLJPME || hasDispersion) && info.hasDerivativeLJ)
                 requestedDerivs.insert(info.nameLJ);
         }
         hasDerivatives = requestedDerivs.size() > 0;
@@ -126,20 +300,25 @@ public:
                 int position = find(allDerivs.begin(), allDerivs.end(), param) - allDerivs.begin();
                 code<<"energyParamDerivs[index*"<<allDerivs.size()<<"+"<<position<<"] += ";
                 for (int slice = 0; slice < numSlices; slice++) {
-                    ScalingParameterInfo info = sliceScalingParams[slice];
+                    const ScalingParameterInfo& info = sliceScalingParams[slice];
                     if (info.nameCoulomb == param)
-                        code<<"+clEnergy["<<slice<<"]";
+                        code<<"+clEnergy["<<sliceEnergySlots[slice]<<"]";
                     if (doLJPME && info.nameLJ == param)
-                        code<<"+ljEnergy["<<slice<<"]";
+                        code<<"+ljEnergy["<<sliceEnergySlots[slice]<<"]";
+                    if (hasDispersion && info.nameLJ == param)
+                        code<<"+dispersion["<<slice<<"]";
                 }
                 code<<";"<<endl;
             }
         }
         map<string, string> replacements, defines;
+        replacements["NUM_ENERGY_SLOTS"] = cu.intToString(numEnergySlots);
         replacements["NUM_SLICES"] = cu.intToString(numSlices);
         replacements["USE_LJPME"] = doLJPME ? "1" : "0";
+        replacements["HAS_DISPERSION_CORRECTION"] = hasDispersion ? "1" : "0";
         replacements["HAS_DERIVATIVES"] = hasDerivatives ? "1" : "0";
         replacements["ADD_DERIVATIVES"] = code.str();
+        defines["SLOT_SLICE(slot)"] = tableLookupExpression("slot", energySlotSlices);
         string source = cu.replaceStrings(CommonOpenMMLabKernelSources::pmeAddEnergy, replacements);
         CUmodule module = cu.createModule(source, defines);
         addEnergyKernel = cu.getKernel(module, "addEnergy");
@@ -152,14 +331,24 @@ public:
             arguments.push_back(&ljpmeEnergyBuffer.getDevicePointer());
         arguments.push_back(&sliceLambdas.getDevicePointer());
         arguments.push_back(&bufferSize);
+        if (hasDispersion) {
+            arguments.push_back(&dispersionCoefficients->getDevicePointer());
+            arguments.push_back(cu.getUseDoublePrecision() || cu.getUseMixedPrecision() ? (void*) &invVolume : (void*) &invVolumeFloat);
+        }
         initialized = true;
     }
     bool isInitialized() {
         return initialized;
     }
     double computeForceAndEnergy(bool includeForces, bool includeEnergy, int groups) {
-        if ((includeEnergy || hasDerivatives) && (groups&(1<<forceGroup)) != 0)
+        if ((includeEnergy || (hasDerivatives && computeDerivatives)) && (groups&(1<<forceGroup)) != 0) {
+            if (dispersionCoefficients != NULL) {
+                double4 boxSize = cu.getPeriodicBoxSize();
+                invVolume = 1.0/(boxSize.x*boxSize.y*boxSize.z);
+                invVolumeFloat = (float) invVolume;
+            }
             cu.executeKernel(addEnergyKernel, &arguments[0], bufferSize);
+        }
         return 0.0;
     }
 private:
@@ -168,34 +357,53 @@ private:
     vector<void*> arguments;
     int forceGroup;
     int bufferSize;
+    const bool& computeDerivatives;
     bool initialized;
     bool hasDerivatives;
+    CudaArray* dispersionCoefficients;
+    double invVolume;
+    float invVolumeFloat;
 };
 
 class CudaCalcSlicedNonbondedForceKernel::DispersionCorrectionPostComputation : public CudaContext::ForcePostComputation {
 public:
-    DispersionCorrectionPostComputation(CudaContext& cu, vector<double>& coefficients, vector<double2>& sliceLambdas, vector<ScalingParameterInfo>& sliceScalingParams, int forceGroup) :
-                                        cu(cu), coefficients(coefficients), sliceLambdas(sliceLambdas), sliceScalingParams(sliceScalingParams), forceGroup(forceGroup) {
+    DispersionCorrectionPostComputation(CudaContext& cu, vector<double>& coefficients, vector<double2>& sliceLambdas, vector<ScalingParameterInfo>& sliceScalingParams, int forceGroup,
+                                        const bool& computeDerivatives) :
+                                        cu(cu), coefficients(coefficients), sliceLambdas(sliceLambdas), sliceScalingParams(sliceScalingParams), forceGroup(forceGroup),
+                                        computeDerivatives(computeDerivatives) {
+        // Each slice with a derivative is assigned the slot of its parameter name, so that
+        // the workspace is looked up once per distinct name.
+
         numSlices = coefficients.size();
-        hasDerivatives = false;
-        for (auto info : sliceScalingParams)
-            hasDerivatives = hasDerivatives || info.hasDerivativeLJ;
+        derivSlots.assign(numSlices, -1);
+        for (int slice = 0; slice < numSlices; slice++) {
+            const ScalingParameterInfo& info = sliceScalingParams[slice];
+            if (info.hasDerivativeLJ) {
+                int slot = find(derivNames.begin(), derivNames.end(), info.nameLJ)-derivNames.begin();
+                if (slot == derivNames.size())
+                    derivNames.push_back(info.nameLJ);
+                derivSlots[slice] = slot;
+            }
+        }
+        hasDerivatives = derivNames.size() > 0;
     }
     double computeForceAndEnergy(bool includeForces, bool includeEnergy, int groups) {
         double energy = 0.0;
-        if ((includeEnergy || hasDerivatives) && (groups&(1<<forceGroup)) != 0) {
+        bool includeDerivatives = (hasDerivatives && computeDerivatives);
+        if ((includeEnergy || includeDerivatives) && (groups&(1<<forceGroup)) != 0) {
             double4 boxSize = cu.getPeriodicBoxSize();
             double volume = boxSize.x*boxSize.y*boxSize.z;
             if (includeEnergy)
                 for (int slice = 0; slice < numSlices; slice++)
                     energy += sliceLambdas[slice].y*coefficients[slice]/volume;
-            if (hasDerivatives) {
+            if (includeDerivatives) {
+                derivTotals.assign(derivNames.size(), 0.0);
+                for (int slice = 0; slice < numSlices; slice++)
+                    if (derivSlots[slice] != -1)
+                        derivTotals[derivSlots[slice]] += coefficients[slice]/volume;
                 map<string, double>& energyParamDerivs = cu.getEnergyParamDerivWorkspace();
-                for (int slice = 0; slice < numSlices; slice++) {
-                    ScalingParameterInfo info = sliceScalingParams[slice];
-                    if (info.hasDerivativeLJ)
-                        energyParamDerivs[info.nameLJ] += coefficients[slice]/volume;
-                }
+                for (int i = 0; i < derivNames.size(); i++)
+                    energyParamDerivs[derivNames[i]] += derivTotals[i];
             }
         }
         return energy;
@@ -206,12 +414,43 @@ private:
     vector<double2>& sliceLambdas;
     vector<ScalingParameterInfo>& sliceScalingParams;
     int forceGroup;
+    const bool& computeDerivatives;
     int numSlices;
     bool hasDerivatives;
+    vector<string> derivNames;
+    vector<int> derivSlots;
+    vector<double> derivTotals;
+};
+
+class CudaCalcSlicedNonbondedForceKernel::CpuPmePostComputation : public CudaContext::ForcePostComputation {
+public:
+    CpuPmePostComputation(CudaCalcSlicedNonbondedForceKernel& owner, int forceGroup) : owner(owner), forceGroup(forceGroup) {
+    }
+    double computeForceAndEnergy(bool includeForces, bool includeEnergy, int groups) {
+        if ((groups&(1<<forceGroup)) == 0)
+            return 0.0;
+        return owner.finishCpuPme(includeForces);
+    }
+private:
+    CudaCalcSlicedNonbondedForceKernel& owner;
+    int forceGroup;
 };
 
 CudaCalcSlicedNonbondedForceKernel::~CudaCalcSlicedNonbondedForceKernel() {
     ContextSelector selector(cu);
+    if (cpuPmeThreads != NULL) {
+        if (cpuPmeResult.valid())
+            cpuPmeResult.wait();
+        if (hasCoulomb)
+            pme_destroy(cpuPmeData);
+        if (doLJPME)
+            pme_destroy(cpuDispersionPmeData);
+        cuMemFreeHost(cpuPmePosq);
+        cuMemFreeHost(cpuPmeCharges);
+        cuMemFreeHost(cpuPmeSigmaEpsilon);
+        cuMemFreeHost(cpuPmeForces);
+        cuEventDestroy(cpuPmeDownloadEvent);
+    }
     if (sort != NULL)
         delete sort;
     if (fft != NULL)
@@ -222,14 +461,54 @@ CudaCalcSlicedNonbondedForceKernel::~CudaCalcSlicedNonbondedForceKernel() {
         cuStreamDestroy(pmeStream);
         cuEventDestroy(pmeSyncEvent);
         cuEventDestroy(paramsSyncEvent);
+        cuEventDestroy(pmeTimingStartEvent);
+        cuEventDestroy(pmeTimingEndEvent);
+    }
+    if (timeDevice) {
+        cuEventDestroy(deviceTimingStartEvent);
+        cuEventDestroy(deviceTimingEndEvent);
     }
+    if (lambdaStaging != NULL) {
+        cuMemFreeHost(lambdaStaging);
+        cuMemFreeHost(paramStaging);
+        cuEventDestroy(lambdaUploadEvent);
+        cuEventDestroy(paramUploadEvent);
+    }
+    for (CUevent event : stageEvents)
+        cuEventDestroy(event);
+    for (CUgraphExec graph : pmeGraphs)
+        if (graph != NULL)
+            cuGraphExecDestroy(graph);
 }
 
 string CudaCalcSlicedNonbondedForceKernel::getDerivativeExpression(string param, bool conditionCoulomb, bool conditionLJ) {
+    if (numSlices <= 32) {
+        // Encode the slices affected by the parameter as bit masks, so that the derivative costs
+        // a shift and a bitwise and instead of a chain of comparisons.
+
+        unsigned int maskCoulomb = 0, maskLJ = 0;
+        for (int slice = 0; slice < numSlices; slice++) {
+            const ScalingParameterInfo& info = sliceScalingParams[slice];
+            if (conditionCoulomb && info.nameCoulomb == param)
+                maskCoulomb |= 1u<<slice;
+            if (conditionLJ && info.nameLJ == param)
+                maskLJ |= 1u<<slice;
+        }
+        stringstream derivative;
+        if (maskCoulomb != 0 && maskCoulomb == maskLJ)
+            derivative<<"(("<<maskCoulomb<<"u>>slice)&1)*(clEnergy + ljEnergy)";
+        else {
+            if (maskCoulomb != 0)
+                derivative<<"(("<<maskCoulomb<<"u>>slice)&1)*clEnergy";
+            if (maskLJ != 0)
+                derivative<<(maskCoulomb != 0 ? " + " : "")<<"(("<<maskLJ<<"u>>slice)&1)*ljEnergy";
+        }
+        return derivative.str();
+    }
     stringstream exprCoulomb, exprLJ, exprBoth;
     int countCoulomb = 0, countLJ = 0, countBoth = 0;
     for (int slice = 0; slice < numSlices; slice++) {
-        ScalingParameterInfo info = sliceScalingParams[slice];
+        const ScalingParameterInfo& info = sliceScalingParams[slice];
         bool coulomb = conditionCoulomb && info.nameCoulomb == param;
         bool lj = conditionLJ && info.nameLJ == param;
         if (coulomb && lj)
@@ -257,24 +536,33 @@ void CudaCalcSlicedNonbondedForceKernel::initialize(const System& system, const
     for (forceIndex = 0; forceIndex < system.getNumForces() && &system.getForce(forceIndex) != &force; ++forceIndex)
         ;
     string prefix = "slicedNonbonded"+cu.intToString(forceIndex)+"_";
+    pmeOrder = force.getPMEInterpolationOrder();
 
     string realToFixedPoint = Platform::getOpenMMVersion()[0] == '7' ? CudaOpenMMLabKernelSources::realToFixedPoint : "";
 
     int numParticles = force.getNumParticles();
     numSubsets = force.getNumSubsets();
     numSlices = force.getNumSlices();
+    forceGroup = force.getForceGroup();
+    recipForceGroup = force.getReciprocalSpaceForceGroup() >= 0 ? force.getReciprocalSpaceForceGroup() : forceGroup;
     sliceLambdasVec.resize(numSlices, make_double2(1, 1));
     subsetSelfEnergy.resize(numSlices, make_double2(0, 0));
     sliceScalingParams.resize(numSlices, ScalingParameterInfo());
 
+    subsetsVec = force.getParticleSubsets();
     subsetsVec.resize(cu.getPaddedNumAtoms(), 0);
-    for (int i = 0; i < numParticles; i++)
-        subsetsVec[i] = force.getParticleSubset(i);
     subsets.initialize<int>(cu, cu.getPaddedNumAtoms(), "subsets");
     subsets.upload(subsetsVec);
 
     int numDerivs = force.getNumScalingParameterDerivatives();
     hasDerivatives = numDerivs > 0;
+    useDerivativesOnDemand = hasDerivatives && force.getUseDerivativesOnDemand();
+    computeDerivatives = hasDerivatives;
+    if (useDerivativesOnDemand) {
+        derivativeFlag.initialize<int>(cu, 1, "derivativeFlag");
+        setComputeDerivatives(true);
+        cu.addPreComputation(new DerivativeFlagPreComputation(*this));
+    }
     set<string> requestedDerivatives;
     for (int i = 0; i < numDerivs; i++)
         requestedDerivatives.insert(force.getScalingParameterDerivativeName(i));
@@ -288,12 +576,53 @@ void CudaCalcSlicedNonbondedForceKernel::initialize(const System& system, const
         sliceScalingParams[sliceIndex(subset1, subset2)].addInfo(name, includeCoulomb, includeLJ, hasDerivative);
     }
 
+    // Slices without a scaling parameter always have unit lambdas, so their reciprocal space
+    // energies share one slot, which is reported as the energy of the first of them.
+
+    sliceEnergySlots.resize(numSlices);
+    energySlotSlices.clear();
+    int constantSlot = -1;
+    for (int slice = 0; slice < numSlices; slice++) {
+        bool scaled = sliceScalingParams[slice].includeCoulomb || sliceScalingParams[slice].includeLJ;
+        if (!scaled && constantSlot >= 0)
+            sliceEnergySlots[slice] = constantSlot;
+        else {
+            sliceEnergySlots[slice] = energySlotSlices.size();
+            energySlotSlices.push_back(slice);
+            if (!scaled)
+                constantSlot = sliceEnergySlots[slice];
+        }
+    }
+    numEnergySlots = energySlotSlices.size();
+
+    // The self energies are accumulated into one slot per derivative, so that the workspace
+    // of the context is only looked up once per derivative rather than once per subset.
+
+    map<string, int> derivSlots;
+    auto getDerivSlot = [&] (const string& name) {
+        if (derivSlots.find(name) == derivSlots.end()) {
+            derivSlots[name] = selfDerivNames.size();
+            selfDerivNames.push_back(name);
+        }
+        return derivSlots[name];
+    };
+    selfDerivSlots.resize(numSubsets, make_int2(-1, -1));
+    for (int i = 0; i < numSubsets; i++) {
+        const ScalingParameterInfo& info = sliceScalingParams[sliceIndex(i, i)];
+        if (info.hasDerivativeCoulomb)
+            selfDerivSlots[i].x = getDerivSlot(info.nameCoulomb);
+        if (info.hasDerivativeLJ)
+            selfDerivSlots[i].y = getDerivSlot(info.nameLJ);
+    }
+    selfDerivTotals.resize(selfDerivNames.size());
+
     size_t sizeOfReal = cu.getUseDoublePrecision() ? sizeof(double) : sizeof(float);
     sliceLambdas.initialize(cu, numSlices, 2*sizeOfReal, "sliceLambdas");
     if (cu.getUseDoublePrecision())
         sliceLambdas.upload(sliceLambdasVec);
     else
         sliceLambdas.upload(double2Tofloat2(sliceLambdasVec));
+    initializeLambdaStates(force);
 
     // Identify which exceptions are 1-4 interactions.
 
@@ -306,22 +635,32 @@ void CudaCalcSlicedNonbondedForceKernel::initialize(const System& system, const
         exceptionsWithOffsets.insert(exception);
     }
     vector<pair<int, int> > exclusions;
-    vector<int> exceptions;
+    vector<int> exceptions, exceptionSliceOf(force.getNumExceptions());
     map<int, int> exceptionIndex;
     for (int i = 0; i < force.getNumExceptions(); i++) {
         int particle1, particle2;
         double chargeProd, sigma, epsilon;
         force.getExceptionParameters(i, particle1, particle2, chargeProd, sigma, epsilon);
         exclusions.push_back(pair<int, int>(particle1, particle2));
-        if (chargeProd != 0.0 || epsilon != 0.0 || exceptionsWithOffsets.find(i) != exceptionsWithOffsets.end()) {
-            exceptionIndex[i] = exceptions.size();
+        int subset1 = force.getParticleSubset(particle1);
+        int subset2 = force.getParticleSubset(particle2);
+        exceptionSliceOf[i] = sliceIndex(subset1, subset2);
+        if (chargeProd != 0.0 || epsilon != 0.0 || exceptionsWithOffsets.find(i) != exceptionsWithOffsets.end())
             exceptions.push_back(i);
-        }
     }
 
+    // Sort the exceptions by slice, so that the threads of a warp usually process exceptions of
+    // the same slice.  They then read the same lambdas and take the same branches, which lets
+    // whole warps skip the exceptions of slices that are switched off.
+
+    stable_sort(exceptions.begin(), exceptions.end(), [&] (int i, int j) {return exceptionSliceOf[i] < exceptionSliceOf[j];});
+    for (int i = 0; i < exceptions.size(); i++)
+        exceptionIndex[exceptions[i]] = i;
+    exceptionOrder = exceptions;
+
     // Initialize nonbonded interactions.
 
-    vector<float4> baseParticleParamVec(cu.getPaddedNumAtoms(), make_float4(0, 0, 0, 0));
+    baseParticleParamVec.assign(cu.getPaddedNumAtoms(), make_float4(0, 0, 0, 0));
     vector<vector<int> > exclusionList(numParticles);
     hasCoulomb = false;
     hasLJ = false;
@@ -345,6 +684,10 @@ void CudaCalcSlicedNonbondedForceKernel::initialize(const System& system, const
         if (epsilon != 0.0)
             hasLJ = true;
     }
+    vector<bool> hasCharge, hasEpsilon;
+    findGriddedSubsets(force, hasCharge, hasEpsilon);
+    assignPmeGrids(hasCharge, true, chargeGridSubsets, chargeSubsetGrids);
+    assignPmeGrids(hasEpsilon, false, dispersionGridSubsets, dispersionSubsetGrids);
     for (auto exclusion : exclusions) {
         exclusionList[exclusion.first].push_back(exclusion.second);
         exclusionList[exclusion.second].push_back(exclusion.first);
@@ -359,6 +702,34 @@ void CudaCalcSlicedNonbondedForceKernel::initialize(const System& system, const
     defines["HAS_COULOMB"] = (hasCoulomb ? "1" : "0");
     defines["HAS_LENNARD_JONES"] = (hasLJ ? "1" : "0");
     defines["USE_LJ_SWITCH"] = (useCutoff && force.getUseSwitchingFunction() ? "1" : "0");
+
+    // The shift of each soft-core slice is alpha*(1-lambda)^power, where lambda is the
+    // Lennard-Jones scaling parameter of the slice.  The soft-core parameters are compiled in,
+    // so that the regular slices keep the plain Lennard-Jones code path.
+
+    bool useSoftCore = (hasLJ && force.getUseSoftCore());
+    defines["USE_SOFT_CORE"] = (useSoftCore ? "1" : "0");
+    if (useSoftCore) {
+        stringstream shift;
+        shift<<"real softCoreBase = max(1-ljLambda, (real) 0);"<<endl;
+        int numSoftCoreSlices = 0;
+        for (int i = 0; i < numSubsets; i++)
+            for (int j = i; j < numSubsets; j++) {
+                double alpha, power;
+                force.getSliceSoftCoreParameters(i, j, alpha, power);
+                if (alpha == 0)
+                    continue;
+                shift<<(numSoftCoreSlices++ ? "else " : "")<<"if (slice == "<<sliceIndex(i, j)<<") {"<<endl;
+                if (power == 1)
+                    shift<<"softCoreShift = "<<cu.doubleToString(alpha)<<"*softCoreBase;"<<endl
+                         <<"softCoreShiftDerivative = "<<cu.doubleToString(-alpha)<<";"<<endl;
+                else
+                    shift<<"softCoreShift = "<<cu.doubleToString(alpha)<<"*POW(softCoreBase, (real) "<<cu.doubleToString(power)<<");"<<endl
+                         <<"softCoreShiftDerivative = "<<cu.doubleToString(-alpha*power)<<"*POW(softCoreBase, (real) "<<cu.doubleToString(power-1)<<");"<<endl;
+                shift<<"}"<<endl;
+            }
+        defines["COMPUTE_SOFT_CORE_SHIFT"] = shift.str();
+    }
     if (useCutoff) {
         // Compute the reaction field constants.
 
@@ -376,8 +747,19 @@ void CudaCalcSlicedNonbondedForceKernel::initialize(const System& system, const
             defines["LJ_SWITCH_C5"] = cu.doubleToString(6/pow(force.getSwitchingDistance()-force.getCutoffDistance(), 5.0));
         }
     }
+
+    // The dispersion correction only depends on the parameters, so it is computed in another
+    // thread while the kernels are compiled and the FFTs are planned.
+
+    future<vector<double> > dispersionTask;
+    double dispersionTime = 0.0;
     if (force.getUseDispersionCorrection() && cu.getContextIndex() == 0 && hasLJ && useCutoff && usePeriodic && !doLJPME)
-        dispersionCoefficients = SlicedNonbondedForceImpl::calcDispersionCorrections(system, force);
+        dispersionTask = async(launch::async, [&] () {
+            auto start = chrono::steady_clock::now();
+            vector<double> coefficients = dispersionTable.update(force);
+            dispersionTime = chrono::duration<double, milli>(chrono::steady_clock::now()-start).count();
+            return coefficients;
+        });
     alpha = 0;
     ewaldSelfEnergy = 0.0;
     map<string, string> paramsDefines;
@@ -392,8 +774,10 @@ void CudaCalcSlicedNonbondedForceKernel::initialize(const System& system, const
         paramsDefines["HAS_EXCEPTION_OFFSETS"] = "1";
     if (usePosqCharges)
         paramsDefines["USE_POSQ_CHARGES"] = "1";
-    if (doLJPME)
+    if (doLJPME) {
         paramsDefines["INCLUDE_LJPME_EXCEPTIONS"] = "1";
+        paramsDefines["HAS_DISPERSION_C6"] = "1";
+    }
     if (nonbondedMethod == Ewald) {
         // Compute the Ewald parameters.
 
@@ -412,42 +796,59 @@ void CudaCalcSlicedNonbondedForceKernel::initialize(const System& system, const
 
             // Create the reciprocal space kernels.
 
-            map<string, string> replacements;
-            replacements["NUM_ATOMS"] = cu.intToString(numParticles);
-            replacements["NUM_SUBSETS"] = cu.intToString(numSubsets);
-            replacements["NUM_SLICES"] = cu.intToString(numSlices);
-            replacements["PADDED_NUM_ATOMS"] = cu.intToString(cu.getPaddedNumAtoms());
-            replacements["KMAX_X"] = cu.intToString(kmaxx);
-            replacements["KMAX_Y"] = cu.intToString(kmaxy);
-            replacements["KMAX_Z"] = cu.intToString(kmaxz);
-            replacements["EXP_COEFFICIENT"] = cu.doubleToString(-1.0/(4.0*alpha*alpha));
-            replacements["ONE_4PI_EPS0"] = cu.doubleToString(ONE_4PI_EPS0);
-            replacements["M_PI"] = cu.doubleToString(M_PI);
-            CUmodule module = cu.createModule(realToFixedPoint+CudaOpenMMLabKernelSources::vectorOps+CommonOpenMMLabKernelSources::ewald, replacements);
-            ewaldSumsKernel = cu.getKernel(module, "calculateEwaldCosSinSums");
-            ewaldForcesKernel = cu.getKernel(module, "calculateEwaldForces");
+            // Only the half space rx >= 0 is considered, excluding (0, 0, 0) and its mirror images.
+
+            numKVectors = kmaxx*(2*kmaxy-1)*(2*kmaxz-1) - ((kmaxy-1)*(2*kmaxz-1)+kmaxz);
+            ewaldReplacements["NUM_ATOMS"] = cu.intToString(numParticles);
+            ewaldReplacements["NUM_SUBSETS"] = cu.intToString(numSubsets);
+            ewaldReplacements["NUM_SLICES"] = cu.intToString(numSlices);
+            ewaldReplacements["NUM_ENERGY_SLOTS"] = cu.intToString(numEnergySlots);
+            ewaldReplacements["ENERGY_GROUP_SIZE"] = cu.intToString(CudaContext::ThreadBlockSize);
+            ewaldReplacements["SLICE_SLOT(slice)"] = tableLookupExpression("slice", sliceEnergySlots);
+            ewaldReplacements["PADDED_NUM_ATOMS"] = cu.intToString(cu.getPaddedNumAtoms());
+            ewaldReplacements["KMAX_X"] = cu.intToString(kmaxx);
+            ewaldReplacements["KMAX_Y"] = cu.intToString(kmaxy);
+            ewaldReplacements["KMAX_Z"] = cu.intToString(kmaxz);
+            ewaldReplacements["EWALD_TILE_SIZE"] = cu.intToString(EwaldTileSize);
+            ewaldReplacements["EXP_COEFFICIENT"] = cu.doubleToString(-1.0/(4.0*alpha*alpha));
+            ewaldReplacements["ONE_4PI_EPS0"] = cu.doubleToString(ONE_4PI_EPS0);
+            ewaldReplacements["M_PI"] = cu.doubleToString(M_PI);
             int elementSize = (cu.getUseDoublePrecision() ? sizeof(double2) : sizeof(float2));
-            cosSinSums.initialize(cu, (2*kmaxx-1)*(2*kmaxy-1)*(2*kmaxz-1)*numSubsets, elementSize, "cosSinSums");
-            int bufferSize = cu.getNumThreadBlocks()*CudaContext::ThreadBlockSize;
-            pmeEnergyBuffer.initialize(cu, numSlices*bufferSize, elementSize, "pmeEnergyBuffer");
+            useFusedEwald = (numParticles <= MaxFusedEwaldAtoms);
+            kVectorChunkSize = MaxEwaldSumsBytes/(numSubsets*elementSize);
+            kVectorChunkSize = min(numKVectors, max(EwaldTileSize, kVectorChunkSize-kVectorChunkSize%EwaldTileSize));
+            cosSinSums.initialize(cu, kVectorChunkSize*numSubsets, elementSize, "cosSinSums");
+            int bufferSize = cu.getNumThreadBlocks();
+            pmeEnergyBuffer.initialize(cu, numEnergySlots*bufferSize, elementSize, "pmeEnergyBuffer");
             cu.clearBuffer(pmeEnergyBuffer);
             int recipForceGroup = force.getReciprocalSpaceForceGroup();
-            cu.addPostComputation(addEnergy = new AddEnergyPostComputation(cu, recipForceGroup >= 0 ? recipForceGroup : force.getForceGroup()));
+            cu.addPostComputation(addEnergy = new AddEnergyPostComputation(cu, recipForceGroup >= 0 ? recipForceGroup : force.getForceGroup(), computeDerivatives));
         }
     }
     else if (((nonbondedMethod == PME || nonbondedMethod == LJPME) && hasCoulomb) || doLJPME) {
         // Compute the PME parameters.
 
         SlicedNonbondedForceImpl::calcPMEParameters(system, force, alpha, gridSizeX, gridSizeY, gridSizeZ, false);
-        gridSizeX = CudaFFT3D::findLegalDimension(gridSizeX);
-        gridSizeY = CudaFFT3D::findLegalDimension(gridSizeY);
-        gridSizeZ = CudaFFT3D::findLegalDimension(gridSizeZ);
+        gridSizeX = CommonFFT3D::findLegalDimension(gridSizeX);
+        gridSizeY = CommonFFT3D::findLegalDimension(gridSizeY);
+        gridSizeZ = CommonFFT3D::findLegalDimension(gridSizeZ);
         if (doLJPME) {
             SlicedNonbondedForceImpl::calcPMEParameters(system, force, dispersionAlpha, dispersionGridSizeX,
                                                   dispersionGridSizeY, dispersionGridSizeZ, true);
-            dispersionGridSizeX = CudaFFT3D::findLegalDimension(dispersionGridSizeX);
-            dispersionGridSizeY = CudaFFT3D::findLegalDimension(dispersionGridSizeY);
-            dispersionGridSizeZ = CudaFFT3D::findLegalDimension(dispersionGridSizeZ);
+            dispersionGridSizeX = CommonFFT3D::findLegalDimension(dispersionGridSizeX);
+            dispersionGridSizeY = CommonFFT3D::findLegalDimension(dispersionGridSizeY);
+            dispersionGridSizeZ = CommonFFT3D::findLegalDimension(dispersionGridSizeZ);
+        }
+        int cufftVersion;
+        cufftGetVersion(&cufftVersion);
+        bool canUseCuFFT = (cufftVersion >= 7050); // There was a critical bug in version 7.0
+        bool autotune = canUseCuFFT && force.getUseFFTAutotuning();
+        if (cu.getContextIndex() == 0 && force.getUseTunedPmeGridSizes()) {
+            bool doublePrecisionGrids = (cu.getUseDoublePrecision() && !force.getUseSinglePrecisionPmeGrids());
+            bool useCuFFT = canUseCuFFT && force.getUseCudaFFT();
+            choosePmeGridSize(gridSizeX, gridSizeY, gridSizeZ, chargeGridSubsets.size(), doublePrecisionGrids, useCuFFT, autotune);
+            if (doLJPME)
+                choosePmeGridSize(dispersionGridSizeX, dispersionGridSizeY, dispersionGridSizeZ, dispersionGridSubsets.size(), doublePrecisionGrids, useCuFFT, autotune);
         }
         defines["EWALD_ALPHA"] = cu.doubleToString(alpha);
         defines["TWO_OVER_SQRT_PI"] = cu.doubleToString(2.0/sqrt(M_PI));
@@ -478,14 +879,18 @@ void CudaCalcSlicedNonbondedForceKernel::initialize(const System& system, const
                 int slice = sliceIndex(i, i);
                 ewaldSelfEnergy += sliceLambdasVec[slice].x*subsetSelfEnergy[i].x + sliceLambdasVec[slice].y*subsetSelfEnergy[i].y;
             }
-            char deviceName[100];
-            cuDeviceGetName(deviceName, 100, cu.getDevice());
-            usePmeStream = (!cu.getPlatformData().disablePmeStream && string(deviceName) != "GeForce GTX 980"); // Using a separate stream is slower on GTX 980
-            map<string, string> pmeDefines;
-            pmeDefines["PME_ORDER"] = cu.intToString(PmeOrder);
+            useCpuPme = force.getUseCpuPme();
+            if (useCpuPme)
+                initializeCpuPme();
+            usePmeStream = !cu.getPlatformData().disablePmeStream;
+            pmeDefines["PME_ORDER"] = cu.intToString(pmeOrder);
             pmeDefines["NUM_ATOMS"] = cu.intToString(numParticles);
             pmeDefines["NUM_SUBSETS"] = cu.intToString(numSubsets);
+            setGridDefines(pmeDefines, chargeGridSubsets, chargeSubsetGrids);
             pmeDefines["NUM_SLICES"] = cu.intToString(numSlices);
+            pmeDefines["NUM_ENERGY_SLOTS"] = cu.intToString(numEnergySlots);
+            pmeDefines["ENERGY_GROUP_SIZE"] = cu.intToString(CudaContext::ThreadBlockSize);
+            pmeDefines["SLICE_SLOT(slice)"] = tableLookupExpression("slice", sliceEnergySlots);
             pmeDefines["PADDED_NUM_ATOMS"] = cu.intToString(cu.getPaddedNumAtoms());
             pmeDefines["RECIP_EXP_FACTOR"] = cu.doubleToString(M_PI*M_PI/(alpha*alpha));
             pmeDefines["GRID_SIZE_X"] = cu.intToString(gridSizeX);
@@ -497,48 +902,40 @@ void CudaCalcSlicedNonbondedForceKernel::initialize(const System& system, const
                 pmeDefines["USE_FIXED_POINT_CHARGE_SPREADING"] = "1";
             if (usePmeStream)
                 pmeDefines["USE_PME_STREAM"] = "1";
-            map<string, string> replacements;
-            replacements["CHARGE"] = (usePosqCharges ? "pos.w" : "charges[atom]");
-            CUmodule module = cu.createModule(realToFixedPoint+CudaOpenMMLabKernelSources::vectorOps+cu.replaceStrings(CommonOpenMMLabKernelSources::pme, replacements), pmeDefines);
-            pmeGridIndexKernel = cu.getKernel(module, "findAtomGridIndex");
-            pmeSpreadChargeKernel = cu.getKernel(module, "gridSpreadCharge");
-            pmeConvolutionKernel = cu.getKernel(module, "reciprocalConvolution");
-            pmeInterpolateForceKernel = cu.getKernel(module, "gridInterpolateForce");
-            pmeEvalEnergyKernel = cu.getKernel(module, "gridEvaluateEnergy");
-            pmeFinishSpreadChargeKernel = cu.getKernel(module, "finishSpreadCharge");
-            cuFuncSetCacheConfig(pmeSpreadChargeKernel, CU_FUNC_CACHE_PREFER_SHARED);
-            cuFuncSetCacheConfig(pmeInterpolateForceKernel, CU_FUNC_CACHE_PREFER_L1);
-            if (doLJPME) {
-                pmeDefines["EWALD_ALPHA"] = cu.doubleToString(dispersionAlpha);
-                pmeDefines["GRID_SIZE_X"] = cu.intToString(dispersionGridSizeX);
-                pmeDefines["GRID_SIZE_Y"] = cu.intToString(dispersionGridSizeY);
-                pmeDefines["GRID_SIZE_Z"] = cu.intToString(dispersionGridSizeZ);
-                pmeDefines["RECIP_EXP_FACTOR"] = cu.doubleToString(M_PI*M_PI/(dispersionAlpha*dispersionAlpha));
-                pmeDefines["USE_LJPME"] = "1";
-                pmeDefines["CHARGE_FROM_SIGEPS"] = "1";
-                if (cu.getUseDoublePrecision() || cu.getPlatformData().deterministicForces)
-                    pmeDefines["USE_FIXED_POINT_CHARGE_SPREADING"] = "1";
-                module = cu.createModule(realToFixedPoint+CudaOpenMMLabKernelSources::vectorOps+CommonOpenMMLabKernelSources::pme, pmeDefines);
-                pmeDispersionFinishSpreadChargeKernel = cu.getKernel(module, "finishSpreadCharge");
-                pmeDispersionGridIndexKernel = cu.getKernel(module, "findAtomGridIndex");
-                pmeDispersionSpreadChargeKernel = cu.getKernel(module, "gridSpreadCharge");
-                pmeDispersionConvolutionKernel = cu.getKernel(module, "reciprocalConvolution");
-                pmeEvalDispersionEnergyKernel = cu.getKernel(module, "gridEvaluateEnergy");
-                pmeInterpolateDispersionForceKernel = cu.getKernel(module, "gridInterpolateForce");
-                cuFuncSetCacheConfig(pmeDispersionSpreadChargeKernel, CU_FUNC_CACHE_PREFER_L1);
+
+            // In double precision, the charge grids and their FFTs can optionally be kept in single
+            // precision, while everything else, including the force and energy accumulation, is not.
+
+            bool singlePrecisionGrids = (cu.getUseDoublePrecision() && force.getUseSinglePrecisionPmeGrids());
+            if (singlePrecisionGrids) {
+                pmeDefines["GRID_REAL"] = "float";
+                pmeDefines["GRID_REAL2"] = "float2";
+                pmeDefines["make_grid_real2"] = "make_float2";
             }
+            pmeReplacements["CHARGE"] = (usePosqCharges ? "pos.w" : "charges[atom]");
 
             // Create required data structures.
 
             int elementSize = (cu.getUseDoublePrecision() ? sizeof(double) : sizeof(float));
-            int roundedZSize = PmeOrder*(int) ceil(gridSizeZ/(double) PmeOrder);
-            int gridElements = gridSizeX*gridSizeY*roundedZSize*numSubsets;
-            if (doLJPME) {
-                roundedZSize = PmeOrder*(int) ceil(dispersionGridSizeZ/(double) PmeOrder);
-                gridElements = max(gridElements, dispersionGridSizeX*dispersionGridSizeY*roundedZSize*numSubsets);
+            int gridElementSize = (cu.getUseDoublePrecision() && !singlePrecisionGrids ? sizeof(double) : sizeof(float));
+            // pmeGrid2 receives the spread charges, with the z indices shuffled in blocks of
+            // pmeOrder, and later holds the half spectrum of the real-to-complex transform.
+            // pmeGrid1 only ever holds real grids.
+
+            size_t spreadElementSize = (cu.getUseDoublePrecision() || cu.getPlatformData().deterministicForces ? sizeof(long long) : gridElementSize);
+            size_t grid1Elements = 0, grid2Bytes = 0;
+            for (int grid = 0; grid < (doLJPME ? 2 : 1); grid++) {
+                size_t xsize = (grid == 0 ? gridSizeX : dispersionGridSizeX);
+                size_t ysize = (grid == 0 ? gridSizeY : dispersionGridSizeY);
+                size_t zsize = (grid == 0 ? gridSizeZ : dispersionGridSizeZ);
+                size_t numGrids = (grid == 0 ? chargeGridSubsets.size() : dispersionGridSubsets.size());
+                size_t roundedZSize = pmeOrder*(size_t) ceil(zsize/(double) pmeOrder);
+                grid1Elements = max(grid1Elements, xsize*ysize*zsize*numGrids);
+                grid2Bytes = max(grid2Bytes, xsize*ysize*roundedZSize*numGrids*spreadElementSize);
+                grid2Bytes = max(grid2Bytes, xsize*ysize*(zsize/2+1)*numGrids*2*gridElementSize);
             }
-            pmeGrid1.initialize(cu, gridElements, 2*elementSize, "pmeGrid1");
-            pmeGrid2.initialize(cu, gridElements, 2*elementSize, "pmeGrid2");
+            pmeGrid1.initialize(cu, grid1Elements, gridElementSize, "pmeGrid1");
+            pmeGrid2.initialize(cu, (grid2Bytes+2*gridElementSize-1)/(2*gridElementSize), 2*gridElementSize, "pmeGrid2");
             cu.addAutoclearBuffer(pmeGrid2);
             pmeBsplineModuliX.initialize(cu, gridSizeX, elementSize, "pmeBsplineModuliX");
             pmeBsplineModuliY.initialize(cu, gridSizeY, elementSize, "pmeBsplineModuliY");
@@ -550,10 +947,11 @@ void CudaCalcSlicedNonbondedForceKernel::initialize(const System& system, const
             }
             pmeAtomGridIndex.initialize<int2>(cu, numParticles, "pmeAtomGridIndex");
             int energyElementSize = (cu.getUseDoublePrecision() || cu.getUseMixedPrecision() ? sizeof(double) : sizeof(float));
-            int bufferSize = cu.getNumThreadBlocks()*CudaContext::ThreadBlockSize;
-            pmeEnergyBuffer.initialize(cu, numSlices*bufferSize, energyElementSize, "pmeEnergyBuffer");
+            int bufferSize = cu.getNumThreadBlocks();
+            pmeEnergyBuffer.initialize(cu, numEnergySlots*bufferSize, energyElementSize, "pmeEnergyBuffer");
             cu.clearBuffer(pmeEnergyBuffer);
             sort = new CudaSort(cu, new SortTrait(), cu.getNumAtoms());
+            sortPmeAtoms = !force.getUseSortFreePme();
 
             // Prepare for doing PME on its own stream.
 
@@ -567,30 +965,53 @@ void CudaCalcSlicedNonbondedForceKernel::initialize(const System& system, const
                 // CHECK_RESULT(cuEventCreate(&paramsSyncEvent, cu.getEventFlags()), "Error creating event for SlicedNonbondedForce");  // OpenMM 8.0
                 CHECK_RESULT(cuEventCreate(&pmeSyncEvent, CU_EVENT_DISABLE_TIMING), "Error creating event for SlicedNonbondedForce");
                 CHECK_RESULT(cuEventCreate(&paramsSyncEvent, CU_EVENT_DISABLE_TIMING), "Error creating event for SlicedNonbondedForce");
+                CHECK_RESULT(cuEventCreate(&pmeTimingStartEvent, 0), "Error creating event for SlicedNonbondedForce");
+                CHECK_RESULT(cuEventCreate(&pmeTimingEndEvent, 0), "Error creating event for SlicedNonbondedForce");
+                pmeTimingSample = 0;
+                pmeTimingPending = false;
+                pmeTimingTotal[0] = pmeTimingTotal[1] = 0.0;
+                cu.addPreComputation(new PmeTimingPreComputation(*this, recipForceGroup));
                 cu.addPreComputation(new SyncStreamPreComputation(cu, pmeStream, pmeSyncEvent, recipForceGroup));
                 cu.addPostComputation(new SyncStreamPostComputation(cu, pmeSyncEvent, recipForceGroup));
+                cu.addPostComputation(new PmeTimingPostComputation(*this, recipForceGroup));
             }
             else
                 pmeStream = cu.getCurrentStream();
 
-            cu.addPostComputation(addEnergy = new AddEnergyPostComputation(cu, recipForceGroup));
+            cu.addPostComputation(addEnergy = new AddEnergyPostComputation(cu, recipForceGroup, computeDerivatives));
 
-            int cufftVersion;
-            cufftGetVersion(&cufftVersion);
-            useCudaFFT = force.getUseCudaFFT() && (cufftVersion >= 7050); // There was a critical bug in version 7.0
-            if (useCudaFFT)
-                fft = (CudaFFT3D*) new CudaCuFFT3D(cu, pmeStream, gridSizeX, gridSizeY, gridSizeZ, numSubsets, true, pmeGrid1, pmeGrid2);
-            else
-                fft = (CudaFFT3D*) new CudaVkFFT3D(cu, pmeStream, gridSizeX, gridSizeY, gridSizeZ, numSubsets, true, pmeGrid1, pmeGrid2);
+            auto fftStart = chrono::steady_clock::now();
+            useCudaFFT = canUseCuFFT && (autotune ? chooseCuFFT(gridSizeX, gridSizeY, gridSizeZ, chargeGridSubsets.size()) : force.getUseCudaFFT());
+            // VkFFT can apply the convolution itself, with factors that only change with the box.
+
+            bool fftConvolution = force.getUseFFTConvolution();
+            if (fftConvolution && !useCudaFFT)
+                pmeConvolutionFactors.initialize(cu, gridSizeX*gridSizeY*(gridSizeZ/2+1), 2*gridElementSize, "pmeConvolutionFactors");
+            fft = createFFT(gridSizeX, gridSizeY, gridSizeZ, chargeGridSubsets.size(), useCudaFFT, pmeConvolutionFactors.isInitialized() ? &pmeConvolutionFactors : NULL);
             if (doLJPME) {
-                ljpmeEnergyBuffer.initialize(cu, numSlices*bufferSize, energyElementSize, "ljpmeEnergyBuffer");
+                ljpmeEnergyBuffer.initialize(cu, numEnergySlots*bufferSize, energyElementSize, "ljpmeEnergyBuffer");
                 cu.clearBuffer(ljpmeEnergyBuffer);
-                if (useCudaFFT)
-                    dispersionFft = (CudaFFT3D*) new CudaCuFFT3D(cu, pmeStream, dispersionGridSizeX, dispersionGridSizeY, dispersionGridSizeZ, numSubsets, true, pmeGrid1, pmeGrid2);
-                else
-                    dispersionFft = (CudaFFT3D*) new CudaVkFFT3D(cu, pmeStream, dispersionGridSizeX, dispersionGridSizeY, dispersionGridSizeZ, numSubsets, true, pmeGrid1, pmeGrid2);
+                bool dispersionCuFFT = canUseCuFFT && (autotune ? chooseCuFFT(dispersionGridSizeX, dispersionGridSizeY, dispersionGridSizeZ, dispersionGridSubsets.size()) : useCudaFFT);
+                if (fftConvolution && !dispersionCuFFT)
+                    pmeDispersionConvolutionFactors.initialize(cu, dispersionGridSizeX*dispersionGridSizeY*(dispersionGridSizeZ/2+1), 2*gridElementSize, "pmeDispersionConvolutionFactors");
+                dispersionFft = createFFT(dispersionGridSizeX, dispersionGridSizeY, dispersionGridSizeZ, dispersionGridSubsets.size(), dispersionCuFFT,
+                        pmeDispersionConvolutionFactors.isInitialized() ? &pmeDispersionConvolutionFactors : NULL);
             }
             hasInitializedFFT = true;
+            if (profileStages)
+                stageTimes["init:fft"] = chrono::duration<double, milli>(chrono::steady_clock::now()-fftStart).count();
+
+            // Replaying the reciprocal space kernels from graphs is incompatible with timing their
+            // stages, and the legacy default stream cannot be captured.  Neither can VkFFT, whose
+            // plans are shared between Contexts and ordered by events recorded at every use.
+
+            bool usesVkFFT = (dynamic_cast<CudaVkFFT3D*>(fft) != NULL || dynamic_cast<CudaVkFFT3D*>(dispersionFft) != NULL);
+            usePmeGraphs = force.getUseCudaGraphs() && !profileStages && pmeStream != 0 && !usesVkFFT;
+            if (usePmeGraphs) {
+                pmeGraphs.resize(4, NULL);
+                pmeGraphIsWarm.resize(4, false);
+                pmeGraphIsStale.resize(4, true);
+            }
 
             // Initialize the b-spline moduli.
 
@@ -616,13 +1037,13 @@ void CudaCalcSlicedNonbondedForceKernel::initialize(const System& system, const
                     zmoduli = &pmeDispersionBsplineModuliZ;
                 }
                 int maxSize = max(max(xsize, ysize), zsize);
-                vector<double> data(PmeOrder);
-                vector<double> ddata(PmeOrder);
+                vector<double> data(pmeOrder);
+                vector<double> ddata(pmeOrder);
                 vector<double> bsplines_data(maxSize);
-                data[PmeOrder-1] = 0.0;
+                data[pmeOrder-1] = 0.0;
                 data[1] = 0.0;
                 data[0] = 1.0;
-                for (int i = 3; i < PmeOrder; i++) {
+                for (int i = 3; i < pmeOrder; i++) {
                     double div = 1.0/(i-1.0);
                     data[i-1] = 0.0;
                     for (int j = 1; j < (i-1); j++)
@@ -633,16 +1054,16 @@ void CudaCalcSlicedNonbondedForceKernel::initialize(const System& system, const
                 // Differentiate.
 
                 ddata[0] = -data[0];
-                for (int i = 1; i < PmeOrder; i++)
+                for (int i = 1; i < pmeOrder; i++)
                     ddata[i] = data[i-1]-data[i];
-                double div = 1.0/(PmeOrder-1);
-                data[PmeOrder-1] = 0.0;
-                for (int i = 1; i < (PmeOrder-1); i++)
-                    data[PmeOrder-i-1] = div*(i*data[PmeOrder-i-2]+(PmeOrder-i)*data[PmeOrder-i-1]);
+                double div = 1.0/(pmeOrder-1);
+                data[pmeOrder-1] = 0.0;
+                for (int i = 1; i < (pmeOrder-1); i++)
+                    data[pmeOrder-i-1] = div*(i*data[pmeOrder-i-2]+(pmeOrder-i)*data[pmeOrder-i-1]);
                 data[0] = div*data[0];
                 for (int i = 0; i < maxSize; i++)
                     bsplines_data[i] = 0.0;
-                for (int i = 1; i <= PmeOrder; i++)
+                for (int i = 1; i <= pmeOrder; i++)
                     bsplines_data[i] = data[i-1];
 
                 // Evaluate the actual bspline moduli for X/Y/Z.
@@ -677,9 +1098,8 @@ void CudaCalcSlicedNonbondedForceKernel::initialize(const System& system, const
     // Add code to subtract off the reciprocal part of excluded interactions.
 
     if (nonbondedMethod == Ewald || nonbondedMethod == PME || nonbondedMethod == LJPME) {
-        int numContexts = cu.getPlatformData().contexts.size();
-        int startIndex = cu.getContextIndex()*force.getNumExceptions()/numContexts;
-        int endIndex = (cu.getContextIndex()+1)*force.getNumExceptions()/numContexts;
+        int startIndex, endIndex;
+        getContextRange(force.getNumExceptions(), startIndex, endIndex);
         int numExclusions = endIndex-startIndex;
         if (numExclusions > 0) {
             paramsDefines["HAS_EXCLUSIONS"] = "1";
@@ -710,58 +1130,140 @@ void CudaCalcSlicedNonbondedForceKernel::initialize(const System& system, const
                 if (expression.length() > 0)
                     code<<variableName<<" += "<<expression<<";"<<endl;
             }
-            replacements["COMPUTE_DERIVATIVES"] = code.str();
+            if (useDerivativesOnDemand)
+                replacements["COMPUTE_DERIVATIVES"] = "if ("+cu.getBondedUtilities().addArgument(derivativeFlag.getDevicePointer(), "int")+"[0]) {\n"+code.str()+"}\n";
+            else
+                replacements["COMPUTE_DERIVATIVES"] = code.str();
             if (force.getIncludeDirectSpace())
                 cu.getBondedUtilities().addInteraction(atoms, cu.replaceStrings(CommonOpenMMLabKernelSources::pmeExclusions, replacements), force.getForceGroup());
         }
     }
 
-    // Add the interaction to the default nonbonded kernel.
+    // Add the interaction to the default nonbonded kernel.  The reaction-field methods use a
+    // compact variant when neither soft-core interactions nor derivatives need the energies of
+    // each slice before scaling.
 
-    string source = cu.replaceStrings(CommonOpenMMLabKernelSources::coulombLennardJones, defines);
+    bool useCompactKernel = ((nonbondedMethod == CutoffPeriodic || nonbondedMethod == CutoffNonPeriodic) && !useSoftCore && !hasDerivatives);
+    string source = cu.replaceStrings(useCompactKernel ? CommonOpenMMLabKernelSources::coulombLennardJonesCutoff :
+                                                         CommonOpenMMLabKernelSources::coulombLennardJones, defines);
     charges.initialize(cu, cu.getPaddedNumAtoms(), cu.getUseDoublePrecision() ? sizeof(double) : sizeof(float), "charges");
     baseParticleParams.initialize<float4>(cu, cu.getPaddedNumAtoms(), "baseParticleParams");
     baseParticleParams.upload(baseParticleParamVec);
     map<string, string> replacements;
     replacements["ONE_4PI_EPS0"] = cu.doubleToString(ONE_4PI_EPS0);
+
+    // With compact parameters, the charge, subset, sigma and epsilon of a particle are read
+    // from a single uint2 filled by packCompactParameters.  Sigma and epsilon are halves,
+    // which are turned back into floats by shifting their bits into place and undoing the
+    // difference between the exponent biases, and the subset takes the lowest bits of the
+    // charge.
+
+    useCompactParameters = (force.getUseCompactParameters() && !cu.getUseDoublePrecision());
+    packCharges = (useCompactParameters && hasCoulomb && !usePosqCharges);
+    int subsetBits = 0;
+    while ((1<<subsetBits) < numSubsets)
+        subsetBits++;
+    string subsetMask = cu.intToString((1<<subsetBits)-1)+"u";
     if (usePosqCharges) {
         replacements["CHARGE1"] = "posq1.w";
         replacements["CHARGE2"] = "posq2.w";
     }
+    else if (packCharges) {
+        replacements["CHARGE1"] = "__uint_as_float("+prefix+"compactParams1.x)";
+        replacements["CHARGE2"] = "__uint_as_float("+prefix+"compactParams2.x)";
+    }
     else {
         replacements["CHARGE1"] = prefix+"charge1";
         replacements["CHARGE2"] = prefix+"charge2";
     }
-    if (hasCoulomb && !usePosqCharges)
+    if (hasCoulomb && !usePosqCharges && !packCharges)
         cu.getNonbondedUtilities().addParameter(CudaNonbondedUtilities::ParameterInfo(prefix+"charge", "real", 1, charges.getElementSize(), charges.getDevicePointer()));
     sigmaEpsilon.initialize<float2>(cu, cu.getPaddedNumAtoms(), "sigmaEpsilon");
-    if (hasLJ) {
+    if (hasLJ && useCompactParameters) {
+        for (string atom : {"1", "2"}) {
+            string word = prefix+"compactParams"+atom+".y";
+            replacements["SIGMA_EPSILON"+atom] = "make_float2(__uint_as_float(("+word+"&0x7fffu)<<13)*5.192296858534828e33f, "
+                    "__uint_as_float(("+word+">>3)&0x0fffe000u)*5.192296858534828e33f)";
+        }
+    }
+    else if (hasLJ) {
         replacements["SIGMA_EPSILON1"] = prefix+"sigmaEpsilon1";
         replacements["SIGMA_EPSILON2"] = prefix+"sigmaEpsilon2";
         cu.getNonbondedUtilities().addParameter(CudaNonbondedUtilities::ParameterInfo(prefix+"sigmaEpsilon", "float", 2, sizeof(float2), sigmaEpsilon.getDevicePointer()));
     }
-    replacements["SUBSET1"] = prefix+"subset1";
-    replacements["SUBSET2"] = prefix+"subset2";
-    cu.getNonbondedUtilities().addParameter(CudaNonbondedUtilities::ParameterInfo(prefix+"subset", "int", 1, sizeof(int), subsets.getDevicePointer()));
+    if (useCompactParameters) {
+        compactParams.initialize<uint2>(cu, cu.getPaddedNumAtoms(), "compactParams");
+        cu.getNonbondedUtilities().addParameter(CudaNonbondedUtilities::ParameterInfo(prefix+"compactParams", "uint", 2, sizeof(uint2), compactParams.getDevicePointer()));
+    }
+    particleC6.initialize<float>(cu, doLJPME ? cu.getPaddedNumAtoms() : 1, "particleC6");
+    if (doLJPME) {
+        replacements["C6_1"] = prefix+"c61";
+        replacements["C6_2"] = prefix+"c62";
+        cu.getNonbondedUtilities().addParameter(CudaNonbondedUtilities::ParameterInfo(prefix+"c6", "float", 1, sizeof(float), particleC6.getDevicePointer()));
+    }
+    if (numSubsets == 1) {
+        // With a single slice, the slice index folds to a constant and no subsets need to be loaded.
+        replacements["SUBSET1"] = "0";
+        replacements["SUBSET2"] = "0";
+    }
+    else if (useCompactParameters) {
+        replacements["SUBSET1"] = "((int) ("+prefix+"compactParams1.x&"+subsetMask+"))";
+        replacements["SUBSET2"] = "((int) ("+prefix+"compactParams2.x&"+subsetMask+"))";
+    }
+    else {
+        replacements["SUBSET1"] = prefix+"subset1";
+        replacements["SUBSET2"] = prefix+"subset2";
+        cu.getNonbondedUtilities().addParameter(CudaNonbondedUtilities::ParameterInfo(prefix+"subset", "int", 1, sizeof(int), subsets.getDevicePointer()));
+    }
     replacements["LAMBDA"] = prefix+"lambda";
     cu.getNonbondedUtilities().addArgument(CudaNonbondedUtilities::ParameterInfo(prefix+"lambda", "real", 2, 2*sizeOfReal, sliceLambdas.getDevicePointer()));
     stringstream code;
     for (string param : requestedDerivatives) {
         string variableName = cu.getNonbondedUtilities().addEnergyParameterDerivative(param);
         string expression = getDerivativeExpression(param, hasCoulomb, hasLJ);
+        if (useSoftCore)
+            expression = cu.replaceStrings(expression, {{"ljEnergy", "ljDerivative"}});
         if (expression.length() > 0)
             code<<variableName<<" += interactionScale*("<<expression<<");"<<endl;
     }
     replacements["COMPUTE_DERIVATIVES"] = code.str();
+
+    // With derivatives on demand, the pairs of switched-off slices are only visited, and the
+    // derivatives only accumulated, in evaluations that include the energy.
+
+    if (useDerivativesOnDemand) {
+        cu.getNonbondedUtilities().addArgument(CudaNonbondedUtilities::ParameterInfo(prefix+"derivativeFlag", "int", 1, sizeof(int), derivativeFlag.getDevicePointer()));
+        replacements["COMPUTE_DERIVATIVES"] = "if ("+prefix+"derivativeFlag[0]) {\n"+code.str()+"}\n";
+    }
+    stringstream derivativeSlices;
+    int numDerivativeSlices = 0;
+    unsigned int derivativeMask = 0;
+    for (int slice = 0; slice < numSlices; slice++)
+        if (sliceScalingParams[slice].hasDerivativeCoulomb || sliceScalingParams[slice].hasDerivativeLJ) {
+            derivativeSlices<<(numDerivativeSlices++ ? " || " : "")<<"slice=="<<slice;
+            if (slice < 32)
+                derivativeMask |= 1u<<slice;
+        }
+    if (numDerivativeSlices == 0)
+        replacements["SLICE_HAS_DERIVATIVE"] = "false";
+    else if (numSlices <= 32) {
+        stringstream mask;
+        mask<<"(("<<derivativeMask<<"u>>slice)&1)";
+        replacements["SLICE_HAS_DERIVATIVE"] = mask.str();
+    }
+    else
+        replacements["SLICE_HAS_DERIVATIVE"] = "("+derivativeSlices.str()+")";
+    string sliceHasDerivative = replacements["SLICE_HAS_DERIVATIVE"];
+    if (useDerivativesOnDemand && numDerivativeSlices > 0)
+        replacements["SLICE_HAS_DERIVATIVE"] = "("+prefix+"derivativeFlag[0] && "+sliceHasDerivative+")";
     source = cu.replaceStrings(source, replacements);
     if (force.getIncludeDirectSpace())
         cu.getNonbondedUtilities().addInteraction(useCutoff, usePeriodic, true, force.getCutoffDistance(), exclusionList, source, force.getForceGroup(), true);
 
     // Initialize the exceptions.
 
-    int numContexts = cu.getPlatformData().contexts.size();
-    int startIndex = cu.getContextIndex()*exceptions.size()/numContexts;
-    int endIndex = (cu.getContextIndex()+1)*exceptions.size()/numContexts;
+    int startIndex, endIndex;
+    getContextRange(exceptions.size(), startIndex, endIndex);
     int numExceptions = endIndex-startIndex;
     if (numExceptions > 0) {
         paramsDefines["HAS_EXCEPTIONS"] = "1";
@@ -771,22 +1273,29 @@ void CudaCalcSlicedNonbondedForceKernel::initialize(const System& system, const
         baseExceptionParams.initialize<float4>(cu, numExceptions, "baseExceptionParams");
         exceptionPairs.initialize<int2>(cu, numExceptions, "exceptionPairs");
         exceptionSlices.initialize<int>(cu, numExceptions, "exceptionSlices");
-        vector<float4> baseExceptionParamsVec(numExceptions);
+        baseExceptionParamVec.resize(numExceptions);
         vector<int> exceptionSlicesVec(numExceptions);
         for (int i = 0; i < numExceptions; i++) {
             double chargeProd, sigma, epsilon;
             force.getExceptionParameters(exceptions[startIndex+i], atoms[i][0], atoms[i][1], chargeProd, sigma, epsilon);
-            baseExceptionParamsVec[i] = make_float4(chargeProd, sigma, epsilon, 0);
+            baseExceptionParamVec[i] = make_float4(chargeProd, sigma, epsilon, 0);
             exceptionAtoms[i] = make_pair(atoms[i][0], atoms[i][1]);
             int subset1 = force.getParticleSubset(atoms[i][0]);
             int subset2 = force.getParticleSubset(atoms[i][1]);
             exceptionSlicesVec[i] = sliceIndex(subset1, subset2);
         }
-        baseExceptionParams.upload(baseExceptionParamsVec);
+        baseExceptionParams.upload(baseExceptionParamVec);
         exceptionPairs.upload(exceptionAtoms);
         exceptionSlices.upload(exceptionSlicesVec);
         map<string, string> replacements;
         replacements["APPLY_PERIODIC"] = (usePeriodic && force.getExceptionsUsePeriodicBoundaryConditions() ? "1" : "0");
+        replacements["SLICE_HAS_DERIVATIVE"] = sliceHasDerivative;
+        string derivativeFlagName;
+        if (useDerivativesOnDemand) {
+            derivativeFlagName = cu.getBondedUtilities().addArgument(derivativeFlag.getDevicePointer(), "int")+"[0]";
+            if (sliceHasDerivative != "false")
+                replacements["SLICE_HAS_DERIVATIVE"] = "("+derivativeFlagName+" && "+sliceHasDerivative+")";
+        }
         replacements["PARAMS"] = cu.getBondedUtilities().addArgument(exceptionParams.getDevicePointer(), "float4");
         replacements["LAMBDAS"] = cu.getBondedUtilities().addArgument(sliceLambdas.getDevicePointer(), "real2");
         stringstream code;
@@ -796,14 +1305,14 @@ void CudaCalcSlicedNonbondedForceKernel::initialize(const System& system, const
             if (expression.length() > 0)
                 code<<variableName<<" += "<<expression<<";"<<endl;
         }
-        replacements["COMPUTE_DERIVATIVES"] = code.str();
+        replacements["COMPUTE_DERIVATIVES"] = (useDerivativesOnDemand ? "if ("+derivativeFlagName+") {\n"+code.str()+"}\n" : code.str());
         if (force.getIncludeDirectSpace())
             cu.getBondedUtilities().addInteraction(atoms, cu.replaceStrings(CommonOpenMMLabKernelSources::nonbondedExceptions, replacements), force.getForceGroup());
     }
 
     // Initialize parameter offsets.
 
-    vector<vector<float4> > particleOffsetVec(force.getNumParticles());
+    particleOffsetVec.assign(force.getNumParticles(), vector<float4>());
     vector<vector<float4> > exceptionOffsetVec(numExceptions);
     for (int i = 0; i < force.getNumParticleParameterOffsets(); i++) {
         string param;
@@ -869,120 +1378,320 @@ void CudaCalcSlicedNonbondedForceKernel::initialize(const System& system, const
     globalParams.initialize(cu, max((int) paramValues.size(), 1), cu.getUseDoublePrecision() ? sizeof(double) : sizeof(float), "globalParams");
     if (paramValues.size() > 0)
         globalParams.upload(paramValues, true);
+
+    // Record which particles, exceptions and exclusions each global parameter affects.  The
+    // parameters of an exclusion depend only on those of its two particles.
+
+    vector<vector<int> > paramParticles(paramNames.size()), paramExceptions(paramNames.size());
+    for (int i = 0; i < particleOffsetVec.size(); i++)
+        for (int j = 0; j < particleOffsetVec[i].size(); j++) {
+            vector<int>& particles = paramParticles[(int) particleOffsetVec[i][j].w];
+            if (particles.empty() || particles.back() != i)
+                particles.push_back(i);
+        }
+    for (int i = 0; i < exceptionOffsetVec.size(); i++)
+        for (int j = 0; j < exceptionOffsetVec[i].size(); j++) {
+            vector<int>& exceptions = paramExceptions[(int) exceptionOffsetVec[i][j].w];
+            if (exceptions.empty() || exceptions.back() != i)
+                exceptions.push_back(i);
+        }
+    vector<vector<int> > particleExclusions(numParticles);
+    if (exclusionParams.isInitialized()) {
+        int firstExclusion, lastExclusion;
+        getContextRange(force.getNumExceptions(), firstExclusion, lastExclusion);
+        for (int i = firstExclusion; i < lastExclusion; i++) {
+            particleExclusions[exclusions[i].first].push_back(i-firstExclusion);
+            particleExclusions[exclusions[i].second].push_back(i-firstExclusion);
+        }
+    }
+    vector<int> affectedExceptionsVec, affectedExclusionsVec;
+    affectedParticlesVec.clear();
+    affectedParticleStart.assign(1, 0);
+    affectedExceptionStart.assign(1, 0);
+    affectedExclusionStart.assign(1, 0);
+    for (int i = 0; i < paramNames.size(); i++) {
+        affectedParticlesVec.insert(affectedParticlesVec.end(), paramParticles[i].begin(), paramParticles[i].end());
+        affectedExceptionsVec.insert(affectedExceptionsVec.end(), paramExceptions[i].begin(), paramExceptions[i].end());
+        vector<int> paramExclusions;
+        for (int particle : paramParticles[i])
+            paramExclusions.insert(paramExclusions.end(), particleExclusions[particle].begin(), particleExclusions[particle].end());
+        sort(paramExclusions.begin(), paramExclusions.end());
+        paramExclusions.erase(unique(paramExclusions.begin(), paramExclusions.end()), paramExclusions.end());
+        affectedExclusionsVec.insert(affectedExclusionsVec.end(), paramExclusions.begin(), paramExclusions.end());
+        affectedParticleStart.push_back(affectedParticlesVec.size());
+        affectedExceptionStart.push_back(affectedExceptionsVec.size());
+        affectedExclusionStart.push_back(affectedExclusionsVec.size());
+    }
+    affectedParticles.initialize<int>(cu, max((int) affectedParticlesVec.size(), 1), "affectedParticles");
+    affectedExceptions.initialize<int>(cu, max((int) affectedExceptionsVec.size(), 1), "affectedExceptions");
+    affectedExclusions.initialize<int>(cu, max((int) affectedExclusionsVec.size(), 1), "affectedExclusions");
+    if (affectedParticlesVec.size() > 0)
+        affectedParticles.upload(affectedParticlesVec);
+    if (affectedExceptionsVec.size() > 0)
+        affectedExceptions.upload(affectedExceptionsVec);
+    if (affectedExclusionsVec.size() > 0)
+        affectedExclusions.upload(affectedExclusionsVec);
     recomputeParams = true;
 
+    // Create the staging buffers for uploading changed lambdas and parameters asynchronously.
+
+    CHECK_RESULT(cuMemHostAlloc(&lambdaStaging, 2*numSlices*sizeof(double), 0), "Error allocating pinned memory for SlicedNonbondedForce");
+    CHECK_RESULT(cuMemHostAlloc(&paramStaging, max((int) paramValues.size(), 1)*sizeof(double), 0), "Error allocating pinned memory for SlicedNonbondedForce");
+    CHECK_RESULT(cuEventCreate(&lambdaUploadEvent, CU_EVENT_DISABLE_TIMING), "Error creating event for SlicedNonbondedForce");
+    CHECK_RESULT(cuEventCreate(&paramUploadEvent, CU_EVENT_DISABLE_TIMING), "Error creating event for SlicedNonbondedForce");
+
     // Add post-computation for dispersion correction.
 
-    if (dispersionCoefficients.size() > 0 && force.getIncludeDirectSpace())
-        cu.addPostComputation(new DispersionCorrectionPostComputation(cu, dispersionCoefficients, sliceLambdasVec, sliceScalingParams, force.getForceGroup()));
+    if (dispersionTask.valid()) {
+        dispersionCoefficients = dispersionTask.get();
+        if (profileStages)
+            stageTimes["init:dispersionCorrection"] = dispersionTime;
+    }
+    // When the reciprocal space energies are added up on the device in the same force group,
+    // the same kernel adds the dispersion correction.  Otherwise it is added on the host.
+
+    if (dispersionCoefficients.size() > 0 && force.getIncludeDirectSpace()) {
+        if (addEnergy != NULL && !useCpuPme && recipForceGroup == forceGroup) {
+            int elementSize = (cu.getUseDoublePrecision() || cu.getUseMixedPrecision() ? sizeof(double) : sizeof(float));
+            sliceDispersionCoefficients.initialize(cu, numSlices, elementSize, "sliceDispersionCoefficients");
+            sliceDispersionCoefficients.upload(dispersionCoefficients, true);
+            addEnergy->setDispersionCoefficients(sliceDispersionCoefficients);
+        }
+        else
+            cu.addPostComputation(new DispersionCorrectionPostComputation(cu, dispersionCoefficients, sliceLambdasVec, sliceScalingParams, force.getForceGroup(), computeDerivatives));
+    }
 
     // Initialize the kernel for updating parameters.
 
     CUmodule module = cu.createModule(CommonOpenMMLabKernelSources::nonbondedParameters, paramsDefines);
     computeParamsKernel = cu.getKernel(module, "computeParameters");
+    computeAffectedParamsKernel = cu.getKernel(module, "computeAffectedParameters");
     computeExclusionParamsKernel = cu.getKernel(module, "computeExclusionParameters");
+    computeAffectedExclusionParamsKernel = cu.getKernel(module, "computeAffectedExclusionParameters");
+    if (useCompactParameters) {
+        map<string, string> compactDefines;
+        if (packCharges)
+            compactDefines["PACK_CHARGES"] = "1";
+        compactDefines["SUBSET_MASK"] = subsetMask;
+        module = cu.createModule(CudaOpenMMLabKernelSources::compactParameters, compactDefines);
+        packCompactParamsKernel = cu.getKernel(module, "packCompactParameters");
+    }
     info = new ForceInfo(force);
     cu.addForce(info);
 }
 
+void CudaCalcSlicedNonbondedForceKernel::createReciprocalKernels() {
+    hasCreatedReciprocalKernels = true;
+    CUmodule module;
+    if (cosSinSums.isInitialized()) {
+        module = cu.createModule(realToFixedPoint+CudaOpenMMLabKernelSources::vectorOps+CommonOpenMMLabKernelSources::energyReduction+CommonOpenMMLabKernelSources::ewald, ewaldReplacements);
+        ewaldSumsKernel = cu.getKernel(module, "calculateEwaldCosSinSums");
+        ewaldForcesKernel = cu.getKernel(module, "calculateEwaldForces");
+        ewaldSumsAndForcesKernel = cu.getKernel(module, "calculateEwaldSumsAndForces");
+    }
+    if (pmeGrid1.isInitialized()) {
+        module = cu.createModule(realToFixedPoint+CudaOpenMMLabKernelSources::vectorOps+CommonOpenMMLabKernelSources::energyReduction+cu.replaceStrings(CommonOpenMMLabKernelSources::pme, pmeReplacements), pmeDefines);
+        pmeGridIndexKernel = cu.getKernel(module, "findAtomGridIndex");
+        pmeSpreadChargeKernel = cu.getKernel(module, "gridSpreadCharge");
+        pmeConvolutionKernel = cu.getKernel(module, "reciprocalConvolution");
+        pmeConvolutionFactorsKernel = cu.getKernel(module, "computeConvolutionKernel");
+        pmeInterpolateForceKernel = cu.getKernel(module, "gridInterpolateForce");
+        pmeConvolutionEnergyKernel = cu.getKernel(module, "reciprocalConvolutionWithEnergy");
+        pmeFinishSpreadChargeKernel = cu.getKernel(module, "finishSpreadCharge");
+        addHostForcesKernel = cu.getKernel(module, "addHostForces");
+        cuFuncSetCacheConfig(pmeSpreadChargeKernel, CU_FUNC_CACHE_PREFER_SHARED);
+        cuFuncSetCacheConfig(pmeInterpolateForceKernel, CU_FUNC_CACHE_PREFER_L1);
+        if (doLJPME) {
+            pmeDefines["EWALD_ALPHA"] = cu.doubleToString(dispersionAlpha);
+            pmeDefines["GRID_SIZE_X"] = cu.intToString(dispersionGridSizeX);
+            pmeDefines["GRID_SIZE_Y"] = cu.intToString(dispersionGridSizeY);
+            pmeDefines["GRID_SIZE_Z"] = cu.intToString(dispersionGridSizeZ);
+            pmeDefines["RECIP_EXP_FACTOR"] = cu.doubleToString(M_PI*M_PI/(dispersionAlpha*dispersionAlpha));
+            pmeDefines["USE_LJPME"] = "1";
+            pmeDefines["CHARGE_FROM_SIGEPS"] = "1";
+            setGridDefines(pmeDefines, dispersionGridSubsets, dispersionSubsetGrids);
+            if (cu.getUseDoublePrecision() || cu.getPlatformData().deterministicForces)
+                pmeDefines["USE_FIXED_POINT_CHARGE_SPREADING"] = "1";
+            module = cu.createModule(realToFixedPoint+CudaOpenMMLabKernelSources::vectorOps+CommonOpenMMLabKernelSources::energyReduction+CommonOpenMMLabKernelSources::pme, pmeDefines);
+            pmeDispersionFinishSpreadChargeKernel = cu.getKernel(module, "finishSpreadCharge");
+            pmeDispersionGridIndexKernel = cu.getKernel(module, hasCoulomb ? "rebinAtomGridIndex" : "findAtomGridIndex");
+            pmeDispersionSpreadChargeKernel = cu.getKernel(module, "gridSpreadCharge");
+            pmeDispersionConvolutionKernel = cu.getKernel(module, "reciprocalConvolution");
+            pmeDispersionConvolutionFactorsKernel = cu.getKernel(module, "computeConvolutionKernel");
+            pmeDispersionConvolutionEnergyKernel = cu.getKernel(module, "reciprocalConvolutionWithEnergy");
+            pmeInterpolateDispersionForceKernel = cu.getKernel(module, "gridInterpolateForce");
+            cuFuncSetCacheConfig(pmeDispersionSpreadChargeKernel, CU_FUNC_CACHE_PREFER_L1);
+        }
+    }
+}
+
 double CudaCalcSlicedNonbondedForceKernel::execute(ContextImpl& context, bool includeForces, bool includeEnergy, bool includeDirect, bool includeReciprocal) {
+    OPENMMLAB_TRACE_RANGE("SlicedNonbondedForce::execute");
     ContextSelector selector(cu);
+    collectStageTimes();
 
     // Update scaling parameters if needed.
 
+    if (!hasParameterSources)
+        findParameterSources(context);
     bool scalingParamChanged = false;
-    for (int slice = 0; slice < numSlices; slice++) {
-        ScalingParameterInfo info = sliceScalingParams[slice];
-        if (info.includeCoulomb) {
-            double value = context.getParameter(info.nameCoulomb);
-            if (value != sliceLambdasVec[slice].x) {
-                sliceLambdasVec[slice].x = value;
-                scalingParamChanged = true;
-            }
-        }
-        if (info.includeLJ) {
-            double value = context.getParameter(info.nameLJ);
-            if (value != sliceLambdasVec[slice].y) {
-                sliceLambdasVec[slice].y = value;
-                scalingParamChanged = true;
-            }
+    for (int slice = 0; slice < numSlices && !useFixedSliceLambdas && lambdaState < 0; slice++) {
+        if (coulombLambdaSources[slice] != NULL && *coulombLambdaSources[slice] != sliceLambdasVec[slice].x) {
+            sliceLambdasVec[slice].x = *coulombLambdaSources[slice];
+            scalingParamChanged = true;
         }
-    }
-    if (scalingParamChanged) {
-        ewaldSelfEnergy = 0.0;
-        for (int i = 0; i < numSubsets; i++) {
-            int slice = sliceIndex(i, i);
-            ewaldSelfEnergy += sliceLambdasVec[slice].x*subsetSelfEnergy[i].x + sliceLambdasVec[slice].y*subsetSelfEnergy[i].y;
+        if (ljLambdaSources[slice] != NULL && *ljLambdaSources[slice] != sliceLambdasVec[slice].y) {
+            sliceLambdasVec[slice].y = *ljLambdaSources[slice];
+            scalingParamChanged = true;
         }
-        if (cu.getUseDoublePrecision())
-            sliceLambdas.upload(sliceLambdasVec);
-        else
-            sliceLambdas.upload(double2Tofloat2(sliceLambdasVec));
     }
+    if (scalingParamChanged)
+        uploadSliceLambdas();
 
     // Update particle and exception parameters.
 
-    bool paramChanged = false;
+    vector<int> changedParams;
     for (int i = 0; i < paramNames.size(); i++) {
-        double value = context.getParameter(paramNames[i]);
+        double value = *paramSources[i];
         if (value != paramValues[i]) {
             paramValues[i] = value;
-            paramChanged = true;
+            changedParams.push_back(i);
         }
     }
-    if (paramChanged) {
-        recomputeParams = true;
-        globalParams.upload(paramValues, true);
-    }
-    double energy = (includeReciprocal ? ewaldSelfEnergy : 0.0);
-    if (recomputeParams || hasOffsets) {
-        int computeSelfEnergy = (includeEnergy && includeReciprocal);
-        int numAtoms = cu.getPaddedNumAtoms();
-        vector<void*> paramsArgs = {&cu.getEnergyBuffer().getDevicePointer(), &computeSelfEnergy, &globalParams.getDevicePointer(), &numAtoms,
-                &baseParticleParams.getDevicePointer(), &cu.getPosq().getDevicePointer(), &charges.getDevicePointer(), &sigmaEpsilon.getDevicePointer(),
-                &particleParamOffsets.getDevicePointer(), &particleOffsetIndices.getDevicePointer(), &subsets.getDevicePointer(), &sliceLambdas.getDevicePointer()};
-        int numExceptions;
-        if (exceptionParams.isInitialized()) {
-            numExceptions = exceptionParams.getSize();
-            paramsArgs.push_back(&numExceptions);
-            paramsArgs.push_back(&exceptionPairs.getDevicePointer());
-            paramsArgs.push_back(&baseExceptionParams.getDevicePointer());
-            paramsArgs.push_back(&exceptionSlices.getDevicePointer());
-            paramsArgs.push_back(&exceptionParams.getDevicePointer());
-            paramsArgs.push_back(&exceptionParamOffsets.getDevicePointer());
-            paramsArgs.push_back(&exceptionOffsetIndices.getDevicePointer());
-        }
-        cu.executeKernel(computeParamsKernel, &paramsArgs[0], cu.getPaddedNumAtoms());
-        if (exclusionParams.isInitialized()) {
-            int numExclusions = exclusionParams.getSize();
-            vector<void*> exclusionParamsArgs = {&cu.getPosq().getDevicePointer(), &charges.getDevicePointer(), &sigmaEpsilon.getDevicePointer(),
-                    &subsets.getDevicePointer(), &numExclusions, &exclusionAtoms.getDevicePointer(), &exclusionParams.getDevicePointer()};
-            cu.executeKernel(computeExclusionParamsKernel, &exclusionParamsArgs[0], numExclusions);
+    if (changedParams.size() > 0)
+        uploadAsync(globalParams, paramValues.data(), paramValues.size(), paramStaging, paramUploadEvent);
+    if (recomputeParams || changedParams.size() > 0) {
+        beginStage("computeParameters");
+        if (recomputeParams) {
+            int computeSelfEnergy = 0;
+            int numAtoms = cu.getPaddedNumAtoms();
+            vector<void*> paramsArgs = {&cu.getEnergyBuffer().getDevicePointer(), &computeSelfEnergy, &globalParams.getDevicePointer(), &numAtoms,
+                    &baseParticleParams.getDevicePointer(), &cu.getPosq().getDevicePointer(), &charges.getDevicePointer(), &sigmaEpsilon.getDevicePointer(),
+                    &particleC6.getDevicePointer(), &particleParamOffsets.getDevicePointer(), &particleOffsetIndices.getDevicePointer(), &subsets.getDevicePointer(), &sliceLambdas.getDevicePointer()};
+            int numExceptions;
+            if (exceptionParams.isInitialized()) {
+                numExceptions = exceptionParams.getSize();
+                paramsArgs.push_back(&numExceptions);
+                paramsArgs.push_back(&exceptionPairs.getDevicePointer());
+                paramsArgs.push_back(&baseExceptionParams.getDevicePointer());
+                paramsArgs.push_back(&exceptionSlices.getDevicePointer());
+                paramsArgs.push_back(&exceptionParams.getDevicePointer());
+                paramsArgs.push_back(&exceptionParamOffsets.getDevicePointer());
+                paramsArgs.push_back(&exceptionOffsetIndices.getDevicePointer());
+            }
+            cu.executeKernel(computeParamsKernel, &paramsArgs[0], cu.getPaddedNumAtoms());
+            if (hasOffsets) {
+                subsetSelfEnergy.assign(numSubsets, make_double2(0, 0));
+                particleSelfEnergy.assign(cu.getNumAtoms(), make_double2(0, 0));
+                vector<int> allParticles(cu.getNumAtoms());
+                for (int i = 0; i < cu.getNumAtoms(); i++)
+                    allParticles[i] = i;
+                updateSelfEnergy(allParticles.data(), cu.getNumAtoms());
+            }
+            if (exclusionParams.isInitialized()) {
+                int numExclusions = exclusionParams.getSize();
+                vector<void*> exclusionParamsArgs = {&cu.getPosq().getDevicePointer(), &charges.getDevicePointer(), &sigmaEpsilon.getDevicePointer(),
+                        &subsets.getDevicePointer(), &numExclusions, &exclusionAtoms.getDevicePointer(), &exclusionParams.getDevicePointer()};
+                cu.executeKernel(computeExclusionParamsKernel, &exclusionParamsArgs[0], numExclusions);
+            }
+        }
+        else {
+            // Only update the particles and exceptions whose offsets depend on the changed parameters.
+
+            for (int param : changedParams) {
+                int numAffectedParticles = affectedParticleStart[param+1]-affectedParticleStart[param];
+                int numAffectedExceptions = affectedExceptionStart[param+1]-affectedExceptionStart[param];
+                if (numAffectedParticles == 0 && numAffectedExceptions == 0)
+                    continue;
+                CUdeviceptr particleList = affectedParticles.getDevicePointer()+affectedParticleStart[param]*sizeof(int);
+                CUdeviceptr exceptionList = affectedExceptions.getDevicePointer()+affectedExceptionStart[param]*sizeof(int);
+                vector<void*> paramsArgs = {&globalParams.getDevicePointer(), &numAffectedParticles, &particleList,
+                        &baseParticleParams.getDevicePointer(), &cu.getPosq().getDevicePointer(), &charges.getDevicePointer(), &sigmaEpsilon.getDevicePointer(),
+                        &particleC6.getDevicePointer(), &particleParamOffsets.getDevicePointer(), &particleOffsetIndices.getDevicePointer(), &subsets.getDevicePointer()};
+                if (exceptionParams.isInitialized()) {
+                    paramsArgs.push_back(&numAffectedExceptions);
+                    paramsArgs.push_back(&exceptionList);
+                    paramsArgs.push_back(&exceptionPairs.getDevicePointer());
+                    paramsArgs.push_back(&baseExceptionParams.getDevicePointer());
+                    paramsArgs.push_back(&exceptionParams.getDevicePointer());
+                    paramsArgs.push_back(&exceptionParamOffsets.getDevicePointer());
+                    paramsArgs.push_back(&exceptionOffsetIndices.getDevicePointer());
+                }
+                cu.executeKernel(computeAffectedParamsKernel, &paramsArgs[0], max(numAffectedParticles, numAffectedExceptions));
+                updateSelfEnergy(&affectedParticlesVec[affectedParticleStart[param]], numAffectedParticles);
+            }
+
+            // Then the exclusions of the updated particles, which reads their new parameters.
+
+            for (int param : changedParams) {
+                int numAffectedExclusions = affectedExclusionStart[param+1]-affectedExclusionStart[param];
+                if (numAffectedExclusions == 0)
+                    continue;
+                CUdeviceptr exclusionList = affectedExclusions.getDevicePointer()+affectedExclusionStart[param]*sizeof(int);
+                vector<void*> exclusionParamsArgs = {&cu.getPosq().getDevicePointer(), &charges.getDevicePointer(), &sigmaEpsilon.getDevicePointer(),
+                        &subsets.getDevicePointer(), &numAffectedExclusions, &exclusionList, &exclusionAtoms.getDevicePointer(), &exclusionParams.getDevicePointer()};
+                cu.executeKernel(computeAffectedExclusionParamsKernel, &exclusionParamsArgs[0], numAffectedExclusions);
+            }
+        }
+        if (useCompactParameters) {
+            int numAtoms = cu.getPaddedNumAtoms();
+            void* packArgs[] = {&numAtoms, &charges.getDevicePointer(), &sigmaEpsilon.getDevicePointer(), &subsets.getDevicePointer(),
+                    &compactParams.getDevicePointer()};
+            cu.executeKernel(packCompactParamsKernel, packArgs, numAtoms);
         }
+        endStage();
         if (usePmeStream) {
             cuEventRecord(paramsSyncEvent, cu.getCurrentStream());
             cuStreamWaitEvent(pmeStream, paramsSyncEvent, 0);
         }
-        if (hasOffsets)
-            energy = 0.0; // The Ewald self energy was computed in the kernel.
         recomputeParams = false;
+        cpuPmeParamsChanged = true;
+    }
+    double energy = (includeReciprocal ? ewaldSelfEnergy : 0.0);
+    if (includeReciprocal && !hasCreatedReciprocalKernels) {
+        auto start = chrono::steady_clock::now();
+        createReciprocalKernels();
+        if (profileStages)
+            stageTimes["init:reciprocalKernels"] = chrono::duration<double, milli>(chrono::steady_clock::now()-start).count();
     }
 
     // Do reciprocal space calculations.
 
     if (cosSinSums.isInitialized() && includeReciprocal) {
         if (!addEnergy->isInitialized())
-            addEnergy->initialize(pmeEnergyBuffer, ljpmeEnergyBuffer, sliceLambdas, sliceScalingParams);
-        void* sumsArgs[] = {&pmeEnergyBuffer.getDevicePointer(), &cu.getPosq().getDevicePointer(),
-                &subsets.getDevicePointer(), &cosSinSums.getDevicePointer(), cu.getPeriodicBoxSizePointer()};
-        cu.executeKernel(ewaldSumsKernel, sumsArgs, cosSinSums.getSize()/numSubsets);
-        void* forcesArgs[] = {&cu.getForce().getDevicePointer(), &cu.getPosq().getDevicePointer(), &cosSinSums.getDevicePointer(),
-                &subsets.getDevicePointer(), &sliceLambdas.getDevicePointer(), cu.getPeriodicBoxSizePointer()};
-        cu.executeKernel(ewaldForcesKernel, forcesArgs, cu.getNumAtoms());
-    }
-    if (pmeGrid1.isInitialized() && includeReciprocal) {
+            addEnergy->initialize(pmeEnergyBuffer, ljpmeEnergyBuffer, sliceLambdas, sliceScalingParams, sliceEnergySlots, energySlotSlices);
+        if (useFusedEwald) {
+            int computeForces = includeForces;
+            void* args[] = {&pmeEnergyBuffer.getDevicePointer(), &cu.getForce().getDevicePointer(), &cu.getPosq().getDevicePointer(),
+                    &subsets.getDevicePointer(), &sliceLambdas.getDevicePointer(), cu.getPeriodicBoxSizePointer(), &numKVectors, &computeForces};
+            beginStage("ewaldSumsAndForces");
+            cu.executeKernel(ewaldSumsAndForcesKernel, args, numKVectors, EwaldTileSize);
+            endStage();
+        }
+        else {
+            for (int firstKVector = 0; firstKVector < numKVectors; firstKVector += kVectorChunkSize) {
+                int chunkSize = min(kVectorChunkSize, numKVectors-firstKVector);
+                void* sumsArgs[] = {&pmeEnergyBuffer.getDevicePointer(), &cu.getPosq().getDevicePointer(),
+                        &subsets.getDevicePointer(), &cosSinSums.getDevicePointer(), &sliceLambdas.getDevicePointer(),
+                        cu.getPeriodicBoxSizePointer(), &firstKVector, &chunkSize};
+                beginStage("ewaldSums");
+                cu.executeKernel(ewaldSumsKernel, sumsArgs, chunkSize);
+                endStage();
+                if (includeForces) {
+                    void* forcesArgs[] = {&cu.getForce().getDevicePointer(), &cu.getPosq().getDevicePointer(), &cosSinSums.getDevicePointer(),
+                            &subsets.getDevicePointer(), cu.getPeriodicBoxSizePointer(), &firstKVector, &chunkSize};
+                    beginStage("ewaldForces");
+                    cu.executeKernel(ewaldForcesKernel, forcesArgs, cu.getNumAtoms(), EwaldTileSize);
+                    endStage();
+                }
+            }
+        }
+    }
+    if (useCpuPme && includeReciprocal)
+        launchCpuPme(includeForces);
+    else if (pmeGrid1.isInitialized() && includeReciprocal) {
         if (!addEnergy->isInitialized())
-            addEnergy->initialize(pmeEnergyBuffer, ljpmeEnergyBuffer, sliceLambdas, sliceScalingParams);
+            addEnergy->initialize(pmeEnergyBuffer, ljpmeEnergyBuffer, sliceLambdas, sliceScalingParams, sliceEnergySlots, energySlotSlices);
 
         if (usePmeStream)
             cu.setCurrentStream(pmeStream);
@@ -1013,100 +1722,59 @@ double CudaCalcSlicedNonbondedForceKernel::execute(ContextImpl& context, bool in
             recipBoxVectorPointer[2] = &recipBoxVectorsFloat[2];
         }
 
-        // Execute the reciprocal space kernels.
-
-        if (hasCoulomb) {
-            void* gridIndexArgs[] = {&cu.getPosq().getDevicePointer(), &pmeAtomGridIndex.getDevicePointer(), cu.getPeriodicBoxSizePointer(),
-                    cu.getInvPeriodicBoxSizePointer(), cu.getPeriodicBoxVecXPointer(), cu.getPeriodicBoxVecYPointer(), cu.getPeriodicBoxVecZPointer(),
-                    recipBoxVectorPointer[0], recipBoxVectorPointer[1], recipBoxVectorPointer[2], &subsets.getDevicePointer()};
-            cu.executeKernel(pmeGridIndexKernel, gridIndexArgs, cu.getNumAtoms());
-
-            sort->sort(pmeAtomGridIndex);
-
-            void* spreadArgs[] = {&cu.getPosq().getDevicePointer(), &pmeGrid2.getDevicePointer(), cu.getPeriodicBoxSizePointer(),
-                    cu.getInvPeriodicBoxSizePointer(), cu.getPeriodicBoxVecXPointer(), cu.getPeriodicBoxVecYPointer(), cu.getPeriodicBoxVecZPointer(),
-                    recipBoxVectorPointer[0], recipBoxVectorPointer[1], recipBoxVectorPointer[2], &pmeAtomGridIndex.getDevicePointer(),
-                    &charges.getDevicePointer()};
-            cu.executeKernel(pmeSpreadChargeKernel, spreadArgs, cu.getNumAtoms(), 128);
-
-            void* finishSpreadArgs[] = {&pmeGrid2.getDevicePointer(), &pmeGrid1.getDevicePointer()};
-            cu.executeKernel(pmeFinishSpreadChargeKernel, finishSpreadArgs, gridSizeX*gridSizeY*gridSizeZ, 256);
-
-            fft->execFFT(true);
-
-            if (includeEnergy || hasDerivatives) {
-                void* computeEnergyArgs[] = {&pmeGrid2.getDevicePointer(), &pmeEnergyBuffer.getDevicePointer(),
-                        &pmeBsplineModuliX.getDevicePointer(), &pmeBsplineModuliY.getDevicePointer(), &pmeBsplineModuliZ.getDevicePointer(),
-                        recipBoxVectorPointer[0], recipBoxVectorPointer[1], recipBoxVectorPointer[2]};
-                cu.executeKernel(pmeEvalEnergyKernel, computeEnergyArgs, gridSizeX*gridSizeY*gridSizeZ);
-            }
+        // The convolution factors applied by the FFT library only change with the box, so they
+        // are updated before the sequence of reciprocal space kernels, which can then be replayed
+        // from a graph.
 
-            void* convolutionArgs[] = {&pmeGrid2.getDevicePointer(), &pmeBsplineModuliX.getDevicePointer(),
+        bool fuseConvolution = (includeForces && !includeEnergy && !computeDerivatives);
+        if (fuseConvolution && hasCoulomb && fft->hasConvolution() &&
+                (pmeConvolutionBox[0] != boxVectors[0] || pmeConvolutionBox[1] != boxVectors[1] || pmeConvolutionBox[2] != boxVectors[2])) {
+            void* factorsArgs[] = {&pmeConvolutionFactors.getDevicePointer(), &pmeBsplineModuliX.getDevicePointer(),
                     &pmeBsplineModuliY.getDevicePointer(), &pmeBsplineModuliZ.getDevicePointer(),
                     recipBoxVectorPointer[0], recipBoxVectorPointer[1], recipBoxVectorPointer[2]};
-            cu.executeKernel(pmeConvolutionKernel, convolutionArgs, gridSizeX*gridSizeY*gridSizeZ, 256);
-
-            fft->execFFT(false);
-
-            void* interpolateArgs[] = {&cu.getPosq().getDevicePointer(), &cu.getForce().getDevicePointer(), &pmeGrid1.getDevicePointer(), cu.getPeriodicBoxSizePointer(),
-                    cu.getInvPeriodicBoxSizePointer(), cu.getPeriodicBoxVecXPointer(), cu.getPeriodicBoxVecYPointer(), cu.getPeriodicBoxVecZPointer(),
-                    recipBoxVectorPointer[0], recipBoxVectorPointer[1], recipBoxVectorPointer[2], &pmeAtomGridIndex.getDevicePointer(),
-                    &charges.getDevicePointer(), &subsets.getDevicePointer(), &sliceLambdas.getDevicePointer()};
-            cu.executeKernel(pmeInterpolateForceKernel, interpolateArgs, cu.getNumAtoms(), 128);
+            beginStage("pmeConvolutionFactors");
+            cu.executeKernel(pmeConvolutionFactorsKernel, factorsArgs, gridSizeX*gridSizeY*(gridSizeZ/2+1), 256);
+            endStage();
+            for (int i = 0; i < 3; i++)
+                pmeConvolutionBox[i] = boxVectors[i];
         }
-
-        if (doLJPME && hasLJ) {
-            void* gridIndexArgs[] = {&cu.getPosq().getDevicePointer(), &pmeAtomGridIndex.getDevicePointer(), cu.getPeriodicBoxSizePointer(),
-                    cu.getInvPeriodicBoxSizePointer(), cu.getPeriodicBoxVecXPointer(), cu.getPeriodicBoxVecYPointer(), cu.getPeriodicBoxVecZPointer(),
-                    recipBoxVectorPointer[0], recipBoxVectorPointer[1], recipBoxVectorPointer[2], &subsets.getDevicePointer()};
-            cu.executeKernel(pmeDispersionGridIndexKernel, gridIndexArgs, cu.getNumAtoms());
-            sort->sort(pmeAtomGridIndex);
-            cu.clearBuffer(pmeGrid2);
-            void* spreadArgs[] = {&cu.getPosq().getDevicePointer(), &pmeGrid2.getDevicePointer(), cu.getPeriodicBoxSizePointer(),
-                    cu.getInvPeriodicBoxSizePointer(), cu.getPeriodicBoxVecXPointer(), cu.getPeriodicBoxVecYPointer(), cu.getPeriodicBoxVecZPointer(),
-                    recipBoxVectorPointer[0], recipBoxVectorPointer[1], recipBoxVectorPointer[2], &pmeAtomGridIndex.getDevicePointer(),
-                    &sigmaEpsilon.getDevicePointer()};
-            cu.executeKernel(pmeDispersionSpreadChargeKernel, spreadArgs, cu.getNumAtoms(), 128);
-
-            void* finishSpreadArgs[] = {&pmeGrid2.getDevicePointer(), &pmeGrid1.getDevicePointer()};
-            cu.executeKernel(pmeDispersionFinishSpreadChargeKernel, finishSpreadArgs, dispersionGridSizeX*dispersionGridSizeY*dispersionGridSizeZ, 256);
-
-            dispersionFft->execFFT(true);
-
-            if (includeEnergy || hasDerivatives) {
-                void* computeEnergyArgs[] = {&pmeGrid2.getDevicePointer(), &ljpmeEnergyBuffer.getDevicePointer(),
-                        &pmeDispersionBsplineModuliX.getDevicePointer(), &pmeDispersionBsplineModuliY.getDevicePointer(), &pmeDispersionBsplineModuliZ.getDevicePointer(),
-                        recipBoxVectorPointer[0], recipBoxVectorPointer[1], recipBoxVectorPointer[2]};
-                cu.executeKernel(pmeEvalDispersionEnergyKernel, computeEnergyArgs, dispersionGridSizeX*dispersionGridSizeY*dispersionGridSizeZ);
-            }
-
-            void* convolutionArgs[] = {&pmeGrid2.getDevicePointer(), &pmeDispersionBsplineModuliX.getDevicePointer(),
+        if (fuseConvolution && doLJPME && hasLJ && dispersionFft->hasConvolution() &&
+                (dispersionConvolutionBox[0] != boxVectors[0] || dispersionConvolutionBox[1] != boxVectors[1] || dispersionConvolutionBox[2] != boxVectors[2])) {
+            void* factorsArgs[] = {&pmeDispersionConvolutionFactors.getDevicePointer(), &pmeDispersionBsplineModuliX.getDevicePointer(),
                     &pmeDispersionBsplineModuliY.getDevicePointer(), &pmeDispersionBsplineModuliZ.getDevicePointer(),
                     recipBoxVectorPointer[0], recipBoxVectorPointer[1], recipBoxVectorPointer[2]};
-            cu.executeKernel(pmeDispersionConvolutionKernel, convolutionArgs, dispersionGridSizeX*dispersionGridSizeY*dispersionGridSizeZ, 256);
+            beginStage("ljpmeConvolutionFactors");
+            cu.executeKernel(pmeDispersionConvolutionFactorsKernel, factorsArgs, dispersionGridSizeX*dispersionGridSizeY*(dispersionGridSizeZ/2+1), 256);
+            endStage();
+            for (int i = 0; i < 3; i++)
+                dispersionConvolutionBox[i] = boxVectors[i];
+        }
 
-            dispersionFft->execFFT(false);
+        // Execute the reciprocal space kernels.
+
+        if (usePmeGraphs)
+            launchPmeGraph(includeForces, includeEnergy, boxVectors, recipBoxVectorPointer);
+        else
+            executePmeKernels(includeForces, includeEnergy, recipBoxVectorPointer);
 
-            void* interpolateArgs[] = {&cu.getPosq().getDevicePointer(), &cu.getForce().getDevicePointer(), &pmeGrid1.getDevicePointer(), cu.getPeriodicBoxSizePointer(),
-                    cu.getInvPeriodicBoxSizePointer(), cu.getPeriodicBoxVecXPointer(), cu.getPeriodicBoxVecYPointer(), cu.getPeriodicBoxVecZPointer(),
-                    recipBoxVectorPointer[0], recipBoxVectorPointer[1], recipBoxVectorPointer[2], &pmeAtomGridIndex.getDevicePointer(),
-                    &sigmaEpsilon.getDevicePointer(), &subsets.getDevicePointer(), &sliceLambdas.getDevicePointer()};
-            cu.executeKernel(pmeInterpolateDispersionForceKernel, interpolateArgs, cu.getNumAtoms(), 128);
-        }
         if (usePmeStream) {
             cuEventRecord(pmeSyncEvent, pmeStream);
             cu.restoreDefaultStream();
+            if (!overlapPmeStream)
+                cuStreamWaitEvent(cu.getCurrentStream(), pmeSyncEvent, 0);
         }
     }
-    if (!hasOffsets && includeReciprocal) {
-        map<string, double>& energyParamDerivs = cu.getEnergyParamDerivWorkspace();
+    if (includeReciprocal && computeDerivatives && selfDerivNames.size() > 0) {
+        selfDerivTotals.assign(selfDerivNames.size(), 0.0);
         for (int i = 0; i < numSubsets; i++) {
-            ScalingParameterInfo info = sliceScalingParams[sliceIndex(i, i)];
-            if (info.hasDerivativeCoulomb)
-                energyParamDerivs[info.nameCoulomb] += subsetSelfEnergy[i].x;
-            if (doLJPME && info.hasDerivativeLJ)
-                energyParamDerivs[info.nameLJ] += subsetSelfEnergy[i].y;
+            if (selfDerivSlots[i].x >= 0)
+                selfDerivTotals[selfDerivSlots[i].x] += subsetSelfEnergy[i].x;
+            if (doLJPME && selfDerivSlots[i].y >= 0)
+                selfDerivTotals[selfDerivSlots[i].y] += subsetSelfEnergy[i].y;
         }
+        map<string, double>& energyParamDerivs = cu.getEnergyParamDerivWorkspace();
+        for (int i = 0; i < selfDerivNames.size(); i++)
+            energyParamDerivs[selfDerivNames[i]] += selfDerivTotals[i];
     }
     return energy;
 }
@@ -1127,9 +1795,20 @@ void CudaCalcSlicedNonbondedForceKernel::copyParametersToContext(ContextImpl& co
                 throw OpenMMException("updateParametersInContext: The nonbonded force kernel does not include Lennard-Jones interactions, because all epsilons were originally 0");
         }
     }
-    for (int i = 0; i < force.getNumParticles(); i++)
-        subsetsVec[i] = force.getParticleSubset(i);
-    subsets.upload(subsetsVec);
+    if (pmeGrid1.isInitialized()) {
+        vector<bool> hasCharge, hasEpsilon;
+        findGriddedSubsets(force, hasCharge, hasEpsilon);
+        for (int i = 0; i < numSubsets; i++) {
+            if (hasCharge[i] && chargeSubsetGrids[i] < 0)
+                throw OpenMMException("updateParametersInContext: A subset whose particles all had zero charges cannot acquire charges");
+            if (doLJPME && hasEpsilon[i] && dispersionSubsetGrids[i] < 0)
+                throw OpenMMException("updateParametersInContext: A subset whose particles all had zero epsilons cannot acquire nonzero epsilons");
+        }
+    }
+    vector<int> subsetsVecNew = force.getParticleSubsets();
+    subsetsVecNew.resize(cu.getPaddedNumAtoms(), 0);
+    uploadChangedElements(subsets, subsetsVecNew, subsetsVec);
+    subsetsVec.swap(subsetsVecNew);
     set<int> exceptionsWithOffsets;
     for (int i = 0; i < force.getNumExceptionParameterOffsets(); i++) {
         string param;
@@ -1146,44 +1825,58 @@ void CudaCalcSlicedNonbondedForceKernel::copyParametersToContext(ContextImpl& co
         if (chargeProd != 0.0 || epsilon != 0.0 || exceptionsWithOffsets.find(i) != exceptionsWithOffsets.end())
             exceptions.push_back(i);
     }
-    int numContexts = cu.getPlatformData().contexts.size();
-    int startIndex = cu.getContextIndex()*exceptions.size()/numContexts;
-    int endIndex = (cu.getContextIndex()+1)*exceptions.size()/numContexts;
+    if (exceptions.size() != exceptionOrder.size())
+        throw OpenMMException("updateParametersInContext: The set of non-excluded exceptions has changed");
+    for (int exception : exceptionOrder)
+        if (!binary_search(exceptions.begin(), exceptions.end(), exception))
+            throw OpenMMException("updateParametersInContext: The set of non-excluded exceptions has changed");
+
+    // The exceptions keep the order in which they were sorted by initialize(), even if the
+    // subsets of their particles have changed since then.
+
+    exceptions = exceptionOrder;
+    int startIndex, endIndex;
+    getContextRange(exceptions.size(), startIndex, endIndex);
     int numExceptions = endIndex-startIndex;
     if (numExceptions != exceptionAtoms.size())
         throw OpenMMException("updateParametersInContext: The set of non-excluded exceptions has changed");
 
-    // Record the per-particle parameters.
+    // Record the per-particle parameters.  Only the ranges that changed are uploaded.
 
-    vector<float4> baseParticleParamVec(cu.getPaddedNumAtoms(), make_float4(0, 0, 0, 0));
-    const vector<int>& order = cu.getAtomIndex();
+    vector<float4> baseParticleParamVecNew(cu.getPaddedNumAtoms(), make_float4(0, 0, 0, 0));
     for (int i = 0; i < force.getNumParticles(); i++) {
         double charge, sigma, epsilon;
         force.getParticleParameters(i, charge, sigma, epsilon);
-        baseParticleParamVec[i] = make_float4(charge, sigma, epsilon, 0);
+        baseParticleParamVecNew[i] = make_float4(charge, sigma, epsilon, 0);
     }
-    baseParticleParams.upload(baseParticleParamVec);
+    uploadChangedElements(baseParticleParams, baseParticleParamVecNew, baseParticleParamVec);
+    baseParticleParamVec.swap(baseParticleParamVecNew);
 
     // Record the exceptions.
 
     if (numExceptions > 0) {
-        vector<float4> baseExceptionParamsVec(numExceptions);
+        vector<float4> baseExceptionParamVecNew(numExceptions);
         for (int i = 0; i < numExceptions; i++) {
             int particle1, particle2;
             double chargeProd, sigma, epsilon;
             force.getExceptionParameters(exceptions[startIndex+i], particle1, particle2, chargeProd, sigma, epsilon);
             if (make_pair(particle1, particle2) != exceptionAtoms[i])
                 throw OpenMMException("updateParametersInContext: The set of non-excluded exceptions has changed");
-            baseExceptionParamsVec[i] = make_float4(chargeProd, sigma, epsilon, 0);
+            baseExceptionParamVecNew[i] = make_float4(chargeProd, sigma, epsilon, 0);
         }
-        baseExceptionParams.upload(baseExceptionParamsVec);
+        uploadChangedElements(baseExceptionParams, baseExceptionParamVecNew, baseExceptionParamVec);
+        baseExceptionParamVec.swap(baseExceptionParamVecNew);
     }
 
     // Compute other values.
 
+    // With offsets, the next execution recomputes the self energies from the offset parameters
+    // anyway, so they are not computed from the base parameters here.
+
     ewaldSelfEnergy = 0.0;
     subsetSelfEnergy.assign(numSubsets, make_double2(0, 0));
-    if (nonbondedMethod == Ewald || nonbondedMethod == PME || nonbondedMethod == LJPME) {
+    hasLambdaStateSelfEnergies = false;
+    if ((nonbondedMethod == Ewald || nonbondedMethod == PME || nonbondedMethod == LJPME) && !hasOffsets) {
         if (cu.getContextIndex() == 0) {
             for (int i = 0; i < force.getNumParticles(); i++) {
                 subsetSelfEnergy[subsetsVec[i]].x -= baseParticleParamVec[i].x*baseParticleParamVec[i].x*ONE_4PI_EPS0*alpha/sqrt(M_PI);
@@ -1196,12 +1889,1087 @@ void CudaCalcSlicedNonbondedForceKernel::copyParametersToContext(ContextImpl& co
             }
         }
     }
-    if (force.getUseDispersionCorrection() && cu.getContextIndex() == 0 && (nonbondedMethod == CutoffPeriodic || nonbondedMethod == Ewald || nonbondedMethod == PME))
-        dispersionCoefficients = SlicedNonbondedForceImpl::calcDispersionCorrections(context.getSystem(), force);
+    if (force.getUseDispersionCorrection() && cu.getContextIndex() == 0 && (nonbondedMethod == CutoffPeriodic || nonbondedMethod == Ewald || nonbondedMethod == PME)) {
+        dispersionCoefficients = dispersionTable.update(force);
+        if (sliceDispersionCoefficients.isInitialized())
+            sliceDispersionCoefficients.upload(dispersionCoefficients, true);
+    }
+    initializeLambdaStates(force);
     cu.invalidateMolecules();
     recomputeParams = true;
 }
 
+void CudaCalcSlicedNonbondedForceKernel::getContextRange(int numItems, int& startIndex, int& endIndex) const {
+    // Only the first device computes reciprocal space, so when there are several devices it
+    // leaves the exceptions and exclusions to the others.
+
+    int numContexts = cu.getPlatformData().contexts.size();
+    int index = cu.getContextIndex();
+    if (numContexts > 1 && (nonbondedMethod == Ewald || nonbondedMethod == PME || nonbondedMethod == LJPME)) {
+        if (index == 0) {
+            startIndex = endIndex = 0;
+            return;
+        }
+        index--;
+        numContexts--;
+    }
+    startIndex = index*numItems/numContexts;
+    endIndex = (index+1)*numItems/numContexts;
+}
+
+void CudaCalcSlicedNonbondedForceKernel::uploadSliceLambdas() {
+    computeEwaldSelfEnergy();
+    uploadAsync(sliceLambdas, (const double*) sliceLambdasVec.data(), 2*numSlices, lambdaStaging, lambdaUploadEvent);
+
+    // Kernels on the PME stream read the lambdas too, so they must wait for the copy.
+
+    if (usePmeStream)
+        cuStreamWaitEvent(pmeStream, lambdaUploadEvent, 0);
+}
+
+void CudaCalcSlicedNonbondedForceKernel::computeEwaldSelfEnergy() {
+    ewaldSelfEnergy = 0.0;
+    for (int i = 0; i < numSubsets; i++) {
+        int slice = sliceIndex(i, i);
+        ewaldSelfEnergy += sliceLambdasVec[slice].x*subsetSelfEnergy[i].x + sliceLambdasVec[slice].y*subsetSelfEnergy[i].y;
+    }
+}
+
+void CudaCalcSlicedNonbondedForceKernel::initializeLambdaStates(const SlicedNonbondedForce& force) {
+    // Scaling parameters that are missing from a set take their default values, so that every
+    // state is fully determined when it is precomputed.
+
+    map<string, double> defaultValues;
+    for (int i = 0; i < force.getNumGlobalParameters(); i++)
+        defaultValues[force.getGlobalParameterName(i)] = force.getGlobalParameterDefaultValue(i);
+    int numStates = force.getNumForeignScalingParameterSets();
+    lambdaStatesVec.resize(numStates);
+    hasLambdaStateSelfEnergies = false;
+    vector<double2> allLambdas;
+    for (int k = 0; k < numStates; k++) {
+        const map<string, double>& values = force.getForeignScalingParameterSet(k);
+        auto value = [&] (const string& name) {
+            auto entry = values.find(name);
+            return entry == values.end() ? defaultValues[name] : entry->second;
+        };
+        lambdaStatesVec[k].assign(numSlices, make_double2(1, 1));
+        for (int slice = 0; slice < numSlices; slice++) {
+            const ScalingParameterInfo& info = sliceScalingParams[slice];
+            if (info.includeCoulomb)
+                lambdaStatesVec[k][slice].x = value(info.nameCoulomb);
+            if (info.includeLJ)
+                lambdaStatesVec[k][slice].y = value(info.nameLJ);
+        }
+        allLambdas.insert(allLambdas.end(), lambdaStatesVec[k].begin(), lambdaStatesVec[k].end());
+    }
+    if (numStates > 0) {
+        if (!lambdaStates.isInitialized())
+            lambdaStates.initialize(cu, allLambdas.size(), sliceLambdas.getElementSize(), "lambdaStates");
+        else if (lambdaStates.getSize() != allLambdas.size())
+            lambdaStates.resize(allLambdas.size());
+        if (cu.getUseDoublePrecision())
+            lambdaStates.upload(allLambdas);
+        else
+            lambdaStates.upload(double2Tofloat2(allLambdas));
+    }
+
+    // A state that is still selected is selected again, since its values may have changed.
+
+    int selected = lambdaState;
+    lambdaState = -1;
+    if (selected >= 0 && selected < numStates)
+        setLambdaState(selected);
+}
+
+void CudaCalcSlicedNonbondedForceKernel::setLambdaState(int index) {
+    if (index < -1 || index >= (int) lambdaStatesVec.size())
+        throw OpenMMException("setLambdaStateInContext: Illegal lambda state index");
+    if (index == lambdaState)
+        return;
+    lambdaState = index;
+
+    // When returning to the context parameters, the next execution finds which lambdas
+    // differ from them and uploads them as usual.
+
+    if (index < 0)
+        return;
+    ContextSelector selector(cu);
+    sliceLambdasVec = lambdaStatesVec[index];
+    if (!hasLambdaStateSelfEnergies) {
+        lambdaStateSelfEnergies.assign(lambdaStatesVec.size(), 0.0);
+        for (int k = 0; k < lambdaStatesVec.size(); k++)
+            for (int i = 0; i < numSubsets; i++) {
+                int slice = sliceIndex(i, i);
+                lambdaStateSelfEnergies[k] += lambdaStatesVec[k][slice].x*subsetSelfEnergy[i].x + lambdaStatesVec[k][slice].y*subsetSelfEnergy[i].y;
+            }
+        hasLambdaStateSelfEnergies = true;
+    }
+    ewaldSelfEnergy = lambdaStateSelfEnergies[index];
+    size_t rowSize = numSlices*sliceLambdas.getElementSize();
+    CHECK_RESULT(cuMemcpyDtoDAsync(sliceLambdas.getDevicePointer(), lambdaStates.getDevicePointer()+index*rowSize, rowSize, cu.getCurrentStream()),
+                 "Error selecting lambda state for SlicedNonbondedForce");
+    if (usePmeStream) {
+        CHECK_RESULT(cuEventRecord(lambdaUploadEvent, cu.getCurrentStream()), "Error recording event for SlicedNonbondedForce");
+        cuStreamWaitEvent(pmeStream, lambdaUploadEvent, 0);
+    }
+}
+
+int CudaCalcSlicedNonbondedForceKernel::getLambdaState() const {
+    return lambdaState;
+}
+
+void CudaCalcSlicedNonbondedForceKernel::updateSelfEnergy(const int* particles, int numParticles) {
+    if (numParticles == 0 || cu.getContextIndex() != 0 || !(nonbondedMethod == Ewald || nonbondedMethod == PME || nonbondedMethod == LJPME))
+        return;
+    hasLambdaStateSelfEnergies = false;
+
+    // Replace the old contribution of each particle by the one computed from its current parameters.
+
+    for (int k = 0; k < numParticles; k++) {
+        int i = particles[k];
+        double charge = baseParticleParamVec[i].x, sigma = baseParticleParamVec[i].y, epsilon = baseParticleParamVec[i].z;
+        for (const float4& offset : particleOffsetVec[i]) {
+            double value = paramValues[(int) offset.w];
+            charge += value*offset.x;
+            sigma += value*offset.y;
+            epsilon += value*offset.z;
+        }
+        double2 energy = make_double2(-charge*charge*ONE_4PI_EPS0*alpha/sqrt(M_PI), 0.0);
+        if (doLJPME)
+            energy.y = epsilon*pow(sigma*dispersionAlpha, 6)/3.0;
+        subsetSelfEnergy[subsetsVec[i]].x += energy.x-particleSelfEnergy[i].x;
+        subsetSelfEnergy[subsetsVec[i]].y += energy.y-particleSelfEnergy[i].y;
+        particleSelfEnergy[i] = energy;
+    }
+    computeEwaldSelfEnergy();
+}
+
+CommonFFT3D* CudaCalcSlicedNonbondedForceKernel::createFFT(int xsize, int ysize, int zsize, int numGrids, bool useCuFFT, CudaArray* convolutionFactors) {
+    if (useCuFFT)
+        return new CudaCuFFT3D(cu, pmeStream, xsize, ysize, zsize, numGrids, true, pmeGrid1, pmeGrid2);
+    return new CudaVkFFT3D(cu, pmeStream, xsize, ysize, zsize, numGrids, true, pmeGrid1, pmeGrid2, convolutionFactors);
+}
+
+void CudaCalcSlicedNonbondedForceKernel::assignPmeGrids(const vector<bool>& gridded, bool coulomb, vector<int>& gridSubsets, vector<int>& subsetGrids) {
+    // Two subsets can share a grid if every slice they form with a gridded subset, including
+    // each other, is scaled by the same parameter, or by none.  The reciprocal space energies
+    // of the slices merged this way are then accumulated into the first of them, whose lambda
+    // and derivative are those of all the others.
+
+    auto scaling = [&] (int subset1, int subset2) {
+        const ScalingParameterInfo& info = sliceScalingParams[sliceIndex(subset1, subset2)];
+        if (coulomb)
+            return info.includeCoulomb ? info.nameCoulomb : string();
+        return info.includeLJ ? info.nameLJ : string();
+    };
+    gridSubsets.clear();
+    subsetGrids.assign(numSubsets, -1);
+    for (int i = 0; i < numSubsets; i++) {
+        if (!gridded[i])
+            continue;
+        for (int grid = 0; grid < gridSubsets.size() && subsetGrids[i] < 0; grid++) {
+            bool alike = true;
+            for (int j = 0; j < numSubsets && alike; j++)
+                alike = !gridded[j] || scaling(i, j) == scaling(gridSubsets[grid], j);
+            if (alike)
+                subsetGrids[i] = grid;
+        }
+        if (subsetGrids[i] < 0) {
+            subsetGrids[i] = gridSubsets.size();
+            gridSubsets.push_back(i);
+        }
+    }
+
+    // There is always at least one grid, so that the FFTs have something to transform.
+
+    if (gridSubsets.empty())
+        gridSubsets.push_back(0);
+}
+
+void CudaCalcSlicedNonbondedForceKernel::setGridDefines(map<string, string>& defines, const vector<int>& gridSubsets, const vector<int>& subsetGrids) {
+    vector<int> grids(numSubsets);
+    for (int i = 0; i < numSubsets; i++)
+        grids[i] = max(subsetGrids[i], 0);
+    defines["NUM_GRIDS"] = cu.intToString(gridSubsets.size());
+    defines["GRID_SUBSET(grid)"] = tableLookupExpression("grid", gridSubsets);
+    defines["SUBSET_GRID(subset)"] = tableLookupExpression("subset", grids);
+}
+
+double CudaCalcSlicedNonbondedForceKernel::timeFFT(CommonFFT3D& fft, CUstream stream) {
+    CUevent start, end;
+    CHECK_RESULT(cuEventCreate(&start, 0), "Error creating event for SlicedNonbondedForce");
+    CHECK_RESULT(cuEventCreate(&end, 0), "Error creating event for SlicedNonbondedForce");
+    for (int i = 0; i < FFTTuningWarmup; i++) {
+        fft.execFFT(true);
+        fft.execFFT(false);
+    }
+    cuEventRecord(start, stream);
+    for (int i = 0; i < FFTTuningSamples; i++) {
+        fft.execFFT(true);
+        fft.execFFT(false);
+    }
+    cuEventRecord(end, stream);
+    float elapsed;
+    CHECK_RESULT(cuEventSynchronize(end), "Error synchronizing event for SlicedNonbondedForce");
+    CHECK_RESULT(cuEventElapsedTime(&elapsed, start, end), "Error timing SlicedNonbondedForce");
+    cuEventDestroy(start);
+    cuEventDestroy(end);
+    return elapsed;
+}
+
+/**
+ * The table of FFT libraries and PME grid sizes chosen by autotuning, indexed by device,
+ * grid dimensions, batch size and precision.  It is only stored on disk if the environment
+ * variable OPENMMLAB_FFT_TUNING_FILE names a file, and otherwise lasts for the process.  The
+ * file is read the first time the table is needed, and rewritten with every new entry.
+ */
+static map<string, string> fftTuningTable;
+static bool fftTuningTableLoaded = false;
+static mutex fftTuningMutex;
+static atomic<unsigned long long> fftTuningTempFileCounter(0);
+
+static string getFFTTuningFileName() {
+    const char* fileName = getenv("OPENMMLAB_FFT_TUNING_FILE");
+    return (fileName == NULL ? "" : fileName);
+}
+
+/**
+ * Add the entries of a tuning file to the table, except those the table already has.
+ */
+static void readFFTTuningFile(const string& fileName) {
+    if (fileName.empty())
+        return;
+    ifstream file(fileName.c_str());
+    string line;
+    while (getline(file, line)) {
+        size_t separator = line.rfind('\t');
+        if (separator != string::npos)
+            fftTuningTable.insert(make_pair(line.substr(0, separator), line.substr(separator+1)));
+    }
+}
+
+/**
+ * Find an entry of the tuning table, loading the table from disk if this has not been done
+ * before.  The caller must hold fftTuningMutex.
+ */
+static bool findFFTTuningEntry(const string& key, string& value) {
+    if (!fftTuningTableLoaded) {
+        fftTuningTableLoaded = true;
+        readFFTTuningFile(getFFTTuningFileName());
+    }
+    auto entry = fftTuningTable.find(key);
+    if (entry == fftTuningTable.end())
+        return false;
+    value = entry->second;
+    return true;
+}
+
+/**
+ * Add an entry to the tuning table and to its file.  The caller must hold fftTuningMutex.
+ */
+static void addFFTTuningEntry(const string& key, const string& value) {
+    fftTuningTable[key] = value;
+    string fileName = getFFTTuningFileName();
+    if (fileName.empty())
+        return;
+
+    // Other processes may have added entries since the file was read, so they are merged
+    // first.  The table is written to a temporary file, whose name is unique to this process
+    // and call, and then renamed, so that concurrent processes never read a partial file.
+
+    readFFTTuningFile(fileName);
+    string tempFile = fileName+"."+to_string((long long) getpid())+"."+to_string(fftTuningTempFileCounter++)+".tmp";
+    ofstream file(tempFile.c_str());
+    for (auto& entry : fftTuningTable)
+        file<<entry.first<<'\t'<<entry.second<<'\n';
+    file.close();
+    if (!file || rename(tempFile.c_str(), fileName.c_str()) != 0)
+        remove(tempFile.c_str());
+}
+
+bool CudaCalcSlicedNonbondedForceKernel::chooseCuFFT(int xsize, int ysize, int zsize, int numGrids) {
+    char deviceName[256];
+    CHECK_RESULT(cuDeviceGetName(deviceName, sizeof(deviceName), cu.getDevice()), "Error querying device name for SlicedNonbondedForce");
+    stringstream key;
+    key<<deviceName<<" "<<xsize<<"x"<<ysize<<"x"<<zsize<<" "<<numGrids<<" "<<(pmeGrid2.getElementSize() == 2*sizeof(double) ? "double" : "single");
+    lock_guard<mutex> lock(fftTuningMutex);
+    string value;
+    if (findFFTTuningEntry(key.str(), value))
+        return (value == "cuFFT");
+
+    // Time both libraries on this grid and keep the faster one.
+
+    cu.clearBuffer(pmeGrid1);
+    cu.clearBuffer(pmeGrid2);
+    CommonFFT3D* cuFFT = createFFT(xsize, ysize, zsize, numGrids, true);
+    double cuFFTTime = timeFFT(*cuFFT, pmeStream);
+    delete cuFFT;
+    CommonFFT3D* vkFFT = createFFT(xsize, ysize, zsize, numGrids, false);
+    double vkFFTTime = timeFFT(*vkFFT, pmeStream);
+    delete vkFFT;
+    cu.clearBuffer(pmeGrid2);
+    bool useCuFFT = (cuFFTTime < vkFFTTime);
+    addFFTTuningEntry(key.str(), useCuFFT ? "cuFFT" : "VkFFT");
+    return useCuFFT;
+}
+
+/**
+ * Get the sizes a grid dimension may take when its size is tuned: the smallest legal size,
+ * and all larger sizes with no prime factors other than 2, 3, 5 and 7, up to the maximum
+ * growth.
+ */
+static vector<int> getGridSizeCandidates(int minimum, int maxGrowth) {
+    vector<int> candidates(1, minimum);
+    int maximum = (minimum*(100+maxGrowth))/100;
+    for (int size = minimum+1; size <= maximum; size++)
+        if (CommonFFT3D::findLegalDimension(size, 7) == size)
+            candidates.push_back(size);
+    return candidates;
+}
+
+void CudaCalcSlicedNonbondedForceKernel::choosePmeGridSize(int& xsize, int& ysize, int& zsize, int numGrids, bool doublePrecisionGrids, bool useCuFFT, bool autotune) {
+    char deviceName[256];
+    CHECK_RESULT(cuDeviceGetName(deviceName, sizeof(deviceName), cu.getDevice()), "Error querying device name for SlicedNonbondedForce");
+    stringstream key;
+    key<<"grid "<<deviceName<<" "<<xsize<<"x"<<ysize<<"x"<<zsize<<" "<<numGrids<<" "<<(doublePrecisionGrids ? "double" : "single");
+    key<<" "<<(autotune ? "auto" : useCuFFT ? "cuFFT" : "VkFFT");
+    lock_guard<mutex> lock(fftTuningMutex);
+    string value;
+    if (!findFFTTuningEntry(key.str(), value)) {
+        // Time the transforms for every combination of candidate sizes, with the library that
+        // will be used or, when it is chosen automatically, with the faster of the two.
+
+        vector<int> xsizes = getGridSizeCandidates(xsize, MaxPmeGridGrowth);
+        vector<int> ysizes = getGridSizeCandidates(ysize, MaxPmeGridGrowth);
+        vector<int> zsizes = getGridSizeCandidates(zsize, MaxPmeGridGrowth);
+        size_t realSize = (doublePrecisionGrids ? sizeof(double) : sizeof(float));
+        size_t maxSize = (size_t) xsizes.back()*ysizes.back()*zsizes.back()*numGrids;
+        CudaArray in(cu, maxSize, realSize, "pmeGridTuningIn");
+        CudaArray out(cu, maxSize/2+(size_t) xsizes.back()*ysizes.back()*numGrids, 2*realSize, "pmeGridTuningOut");
+        cu.clearBuffer(in);
+        CUstream stream = cu.getCurrentStream();
+        double bestTime = 0.0;
+        int best[3] = {xsize, ysize, zsize};
+        for (int x : xsizes)
+            for (int y : ysizes)
+                for (int z : zsizes) {
+                    double time = 0.0;
+                    for (int library = 0; library < 2; library++) {
+                        bool cuFFT = (library == 0);
+                        if (!autotune && cuFFT != useCuFFT)
+                            continue;
+                        CommonFFT3D* fft;
+                        if (cuFFT)
+                            fft = new CudaCuFFT3D(cu, stream, x, y, z, numGrids, true, in, out);
+                        else
+                            fft = new CudaVkFFT3D(cu, stream, x, y, z, numGrids, true, in, out);
+                        double libraryTime = timeFFT(*fft, stream);
+                        delete fft;
+                        if (time == 0.0 || libraryTime < time)
+                            time = libraryTime;
+                    }
+                    if (bestTime == 0.0 || time < bestTime) {
+                        bestTime = time;
+                        best[0] = x;
+                        best[1] = y;
+                        best[2] = z;
+                    }
+                }
+        stringstream bestSize;
+        bestSize<<best[0]<<"x"<<best[1]<<"x"<<best[2];
+        value = bestSize.str();
+        addFFTTuningEntry(key.str(), value);
+    }
+    char separator;
+    stringstream(value)>>xsize>>separator>>ysize>>separator>>zsize;
+}
+
+void CudaCalcSlicedNonbondedForceKernel::beginPmeTiming() {
+    if (pmeTimingSample < 0)
+        return;
+    if (pmeTimingPending) {
+        // Record the time of the previous evaluation.
+
+        float elapsed;
+        CHECK_RESULT(cuEventSynchronize(pmeTimingEndEvent), "Error synchronizing event for SlicedNonbondedForce");
+        CHECK_RESULT(cuEventElapsedTime(&elapsed, pmeTimingStartEvent, pmeTimingEndEvent), "Error timing SlicedNonbondedForce");
+        if (pmeTimingSample >= PmeTuningWarmup)
+            pmeTimingTotal[overlapPmeStream ? 1 : 0] += elapsed;
+        pmeTimingPending = false;
+        pmeTimingSample++;
+    }
+    if (pmeTimingSample == PmeTuningWarmup+2*PmeTuningSamples) {
+        // Both modes have been timed the same number of times, so keep the faster one.
+
+        overlapPmeStream = (pmeTimingTotal[1] <= pmeTimingTotal[0]);
+        pmeTimingSample = -1;
+        return;
+    }
+    overlapPmeStream = (pmeTimingSample%2 == 0);
+    cuEventRecord(pmeTimingStartEvent, cu.getCurrentStream());
+}
+
+void CudaCalcSlicedNonbondedForceKernel::endPmeTiming() {
+    if (pmeTimingSample < 0)
+        return;
+    cuEventRecord(pmeTimingEndEvent, cu.getCurrentStream());
+    pmeTimingPending = true;
+}
+
+void CudaCalcSlicedNonbondedForceKernel::enableDeviceTiming() {
+    ContextSelector selector(cu);
+    CHECK_RESULT(cuEventCreate(&deviceTimingStartEvent, 0), "Error creating event for SlicedNonbondedForce");
+    CHECK_RESULT(cuEventCreate(&deviceTimingEndEvent, 0), "Error creating event for SlicedNonbondedForce");
+    timeDevice = true;
+    deviceTimingPending = false;
+    deviceTimingSamples = 0;
+    deviceTimingTotal = 0.0;
+    cu.addPreComputation(new DeviceTimingPreComputation(*this));
+    cu.addPostComputation(new DeviceTimingPostComputation(*this));
+}
+
+void CudaCalcSlicedNonbondedForceKernel::setComputeDerivatives(bool compute) {
+    // The flag only changes when an evaluation that includes the energy follows one that
+    // does not, or vice versa, so it is rarely uploaded.
+
+    computeDerivatives = compute;
+    int value = (compute ? 1 : 0);
+    if (value != derivativeFlagValue) {
+        derivativeFlag.upload(&value);
+        derivativeFlagValue = value;
+    }
+}
+
+double CudaCalcSlicedNonbondedForceKernel::takeDeviceTime(int& numSamples) {
+    numSamples = deviceTimingSamples;
+    double average = (numSamples > 0 ? deviceTimingTotal/numSamples : 0.0);
+    deviceTimingSamples = 0;
+    deviceTimingTotal = 0.0;
+    return average;
+}
+
+void CudaCalcSlicedNonbondedForceKernel::setAtomBlockRange(double startFraction, double endFraction) {
+    pendingRangeStart = startFraction;
+    pendingRangeEnd = endFraction;
+    hasPendingRange = true;
+}
+
+void CudaCalcSlicedNonbondedForceKernel::beginDeviceTiming(int groups) {
+    // The previous computation has finished by now, since its forces have been summed.  Only
+    // computations that include direct space are timed, since the others are not balanced.
+
+    if (deviceTimingPending) {
+        float elapsed;
+        CHECK_RESULT(cuEventSynchronize(deviceTimingEndEvent), "Error synchronizing event for SlicedNonbondedForce");
+        CHECK_RESULT(cuEventElapsedTime(&elapsed, deviceTimingStartEvent, deviceTimingEndEvent), "Error timing SlicedNonbondedForce");
+        deviceTimingTotal += elapsed;
+        deviceTimingSamples++;
+        deviceTimingPending = false;
+    }
+    if (hasPendingRange) {
+        cu.getNonbondedUtilities().setAtomBlockRange(pendingRangeStart, pendingRangeEnd);
+        hasPendingRange = false;
+    }
+    if ((groups&(1<<forceGroup)) != 0)
+        cuEventRecord(deviceTimingStartEvent, cu.getCurrentStream());
+}
+
+void CudaCalcSlicedNonbondedForceKernel::endDeviceTiming(int groups) {
+    if ((groups&(1<<forceGroup)) == 0)
+        return;
+    cuEventRecord(deviceTimingEndEvent, cu.getCurrentStream());
+    deviceTimingPending = true;
+}
+
+void CudaCalcSlicedNonbondedForceKernel::beginStage(const string& name) {
+    OPENMMLAB_TRACE_PUSH(("SlicedNonbondedForce::"+name).c_str());
+    if (!profileStages)
+        return;
+    if (pendingStages.empty() && TraceRecorder::isEnabled()) {
+        pendingStagesStart = TraceRecorder::getInstance().now();
+        pendingStagesStep = TraceRecorder::getStep();
+    }
+    int index = 2*pendingStages.size();
+    while (stageEvents.size() < index+2) {
+        CUevent event;
+        CHECK_RESULT(cuEventCreate(&event, 0), "Error creating event for SlicedNonbondedForce");
+        stageEvents.push_back(event);
+    }
+    cuEventRecord(stageEvents[index], cu.getCurrentStream());
+    pendingStages.push_back(name);
+}
+
+void CudaCalcSlicedNonbondedForceKernel::endStage() {
+    OPENMMLAB_TRACE_POP();
+    if (!profileStages)
+        return;
+    cuEventRecord(stageEvents[2*pendingStages.size()-1], cu.getCurrentStream());
+}
+
+void CudaCalcSlicedNonbondedForceKernel::collectStageTimes() {
+    for (int i = 0; i < pendingStages.size(); i++) {
+        float elapsed;
+        CHECK_RESULT(cuEventSynchronize(stageEvents[2*i+1]), "Error synchronizing event for SlicedNonbondedForce");
+        CHECK_RESULT(cuEventElapsedTime(&elapsed, stageEvents[2*i], stageEvents[2*i+1]), "Error timing SlicedNonbondedForce");
+        stageTimes[pendingStages[i]] += elapsed;
+        if (TraceRecorder::isEnabled()) {
+            float offset;
+            CHECK_RESULT(cuEventElapsedTime(&offset, stageEvents[0], stageEvents[2*i]), "Error timing SlicedNonbondedForce");
+            TraceRecorder::getInstance().addSpan("SlicedNonbondedForce::"+pendingStages[i], "SlicedNonbondedForce (device)",
+                    pendingStagesStart+1000*offset, 1000*elapsed, pendingStagesStep);
+        }
+    }
+    pendingStages.clear();
+}
+
+void CudaCalcSlicedNonbondedForceKernel::getStageTimes(map<string, double>& times) {
+    ContextSelector selector(cu);
+    collectStageTimes();
+    times = stageTimes;
+}
+
+void CudaCalcSlicedNonbondedForceKernel::resetStageTimes() {
+    ContextSelector selector(cu);
+    collectStageTimes();
+    stageTimes.clear();
+}
+
+void CudaCalcSlicedNonbondedForceKernel::uploadAsync(CudaArray& array, const double* values, int numValues, void* staging, CUevent event) {
+    // The previous copy from the staging buffer must be complete before it is overwritten.
+    // This only blocks if parameters change again before the stream has reached that copy.
+
+    CHECK_RESULT(cuEventSynchronize(event), "Error synchronizing upload for SlicedNonbondedForce");
+    size_t numBytes;
+    if (cu.getUseDoublePrecision()) {
+        memcpy(staging, values, numValues*sizeof(double));
+        numBytes = numValues*sizeof(double);
+    }
+    else {
+        for (int i = 0; i < numValues; i++)
+            ((float*) staging)[i] = (float) values[i];
+        numBytes = numValues*sizeof(float);
+    }
+    CHECK_RESULT(cuMemcpyHtoDAsync(array.getDevicePointer(), staging, numBytes, cu.getCurrentStream()), "Error uploading array for SlicedNonbondedForce");
+    CHECK_RESULT(cuEventRecord(event, cu.getCurrentStream()), "Error recording event for SlicedNonbondedForce");
+}
+
+void CudaCalcSlicedNonbondedForceKernel::executePmeKernels(bool includeForces, bool includeEnergy, void* recipBoxVectorPointer[3]) {
+    bool fuseConvolution = (includeForces && !includeEnergy && !computeDerivatives);
+    if (hasCoulomb) {
+        void* gridIndexArgs[] = {&cu.getPosq().getDevicePointer(), &pmeAtomGridIndex.getDevicePointer(), cu.getPeriodicBoxSizePointer(),
+                cu.getInvPeriodicBoxSizePointer(), cu.getPeriodicBoxVecXPointer(), cu.getPeriodicBoxVecYPointer(), cu.getPeriodicBoxVecZPointer(),
+                recipBoxVectorPointer[0], recipBoxVectorPointer[1], recipBoxVectorPointer[2], &subsets.getDevicePointer()};
+        beginStage("pmeGridIndex");
+        cu.executeKernel(pmeGridIndexKernel, gridIndexArgs, cu.getNumAtoms());
+        endStage();
+
+        // The order of the atoms only affects the efficiency of spreading and interpolation.
+        // Without the sort, they are processed in the order of the context, which is already
+        // spatially coherent because the context periodically reorders atoms by position.
+
+        if (sortPmeAtoms) {
+            beginStage("pmeSort");
+            sort->sort(pmeAtomGridIndex);
+            endStage();
+        }
+
+        void* spreadArgs[] = {&cu.getPosq().getDevicePointer(), &pmeGrid2.getDevicePointer(), cu.getPeriodicBoxSizePointer(),
+                cu.getInvPeriodicBoxSizePointer(), cu.getPeriodicBoxVecXPointer(), cu.getPeriodicBoxVecYPointer(), cu.getPeriodicBoxVecZPointer(),
+                recipBoxVectorPointer[0], recipBoxVectorPointer[1], recipBoxVectorPointer[2], &pmeAtomGridIndex.getDevicePointer(),
+                &charges.getDevicePointer()};
+        beginStage("pmeSpreadCharge");
+        cu.executeKernel(pmeSpreadChargeKernel, spreadArgs, cu.getNumAtoms(), 128);
+
+        void* finishSpreadArgs[] = {&pmeGrid2.getDevicePointer(), &pmeGrid1.getDevicePointer()};
+        cu.executeKernel(pmeFinishSpreadChargeKernel, finishSpreadArgs, gridSizeX*gridSizeY*gridSizeZ, 256);
+        endStage();
+
+        // The grids of all subsets are transformed, convolved, and transformed back as one batch.
+        // When the energy is needed, it is accumulated in the same pass as the convolution, with
+        // the default block size so that each thread owns one entry of the energy buffer.  When
+        // only forces are needed, the FFT library may apply the convolution itself.
+
+        if (fuseConvolution && fft->hasConvolution()) {
+            beginStage("pmeFFTConvolution");
+            fft->execConvolution();
+            endStage();
+        }
+        else {
+            beginStage("pmeForwardFFT");
+            fft->execFFT(true);
+            endStage();
+            if (includeEnergy || computeDerivatives) {
+                void* convolutionArgs[] = {&pmeGrid2.getDevicePointer(), &pmeEnergyBuffer.getDevicePointer(),
+                        &pmeBsplineModuliX.getDevicePointer(), &pmeBsplineModuliY.getDevicePointer(), &pmeBsplineModuliZ.getDevicePointer(),
+                        recipBoxVectorPointer[0], recipBoxVectorPointer[1], recipBoxVectorPointer[2]};
+                beginStage("pmeConvolution");
+                cu.executeKernel(pmeConvolutionEnergyKernel, convolutionArgs, gridSizeX*gridSizeY*(gridSizeZ/2+1));
+                endStage();
+            }
+            else if (includeForces) {
+                void* convolutionArgs[] = {&pmeGrid2.getDevicePointer(), &pmeBsplineModuliX.getDevicePointer(),
+                        &pmeBsplineModuliY.getDevicePointer(), &pmeBsplineModuliZ.getDevicePointer(),
+                        recipBoxVectorPointer[0], recipBoxVectorPointer[1], recipBoxVectorPointer[2]};
+                beginStage("pmeConvolution");
+                cu.executeKernel(pmeConvolutionKernel, convolutionArgs, gridSizeX*gridSizeY*gridSizeZ, 256);
+                endStage();
+            }
+
+            // When only the energy is needed, as for evaluations at foreign scaling parameters, the
+            // inverse transform and the force interpolation are skipped.
+
+            if (includeForces) {
+                beginStage("pmeInverseFFT");
+                fft->execFFT(false);
+                endStage();
+            }
+        }
+
+        if (includeForces) {
+            void* interpolateArgs[] = {&cu.getPosq().getDevicePointer(), &cu.getForce().getDevicePointer(), &pmeGrid1.getDevicePointer(), cu.getPeriodicBoxSizePointer(),
+                    cu.getInvPeriodicBoxSizePointer(), cu.getPeriodicBoxVecXPointer(), cu.getPeriodicBoxVecYPointer(), cu.getPeriodicBoxVecZPointer(),
+                    recipBoxVectorPointer[0], recipBoxVectorPointer[1], recipBoxVectorPointer[2], &pmeAtomGridIndex.getDevicePointer(),
+                    &charges.getDevicePointer(), &subsets.getDevicePointer(), &sliceLambdas.getDevicePointer()};
+            beginStage("pmeInterpolateForce");
+            cu.executeKernel(pmeInterpolateForceKernel, interpolateArgs, cu.getNumAtoms(), 128);
+            endStage();
+        }
+    }
+
+    if (doLJPME && hasLJ) {
+        void* gridIndexArgs[] = {&cu.getPosq().getDevicePointer(), &pmeAtomGridIndex.getDevicePointer(), cu.getPeriodicBoxSizePointer(),
+                cu.getInvPeriodicBoxSizePointer(), cu.getPeriodicBoxVecXPointer(), cu.getPeriodicBoxVecYPointer(), cu.getPeriodicBoxVecZPointer(),
+                recipBoxVectorPointer[0], recipBoxVectorPointer[1], recipBoxVectorPointer[2], &subsets.getDevicePointer()};
+
+        // When the Coulomb grid has been processed, the atoms are already sorted.  If both grids
+        // have the same dimensions, the indices are reused as they are, and otherwise they are
+        // only recomputed in the same order.
+
+        bool sameGrid = (gridSizeX == dispersionGridSizeX && gridSizeY == dispersionGridSizeY && gridSizeZ == dispersionGridSizeZ);
+        if (!hasCoulomb || !sameGrid) {
+            beginStage("ljpmeGridIndex");
+            cu.executeKernel(pmeDispersionGridIndexKernel, gridIndexArgs, cu.getNumAtoms());
+            endStage();
+        }
+        if (!hasCoulomb && sortPmeAtoms) {
+            beginStage("ljpmeSort");
+            sort->sort(pmeAtomGridIndex);
+            endStage();
+        }
+        cu.clearBuffer(pmeGrid2);
+        void* spreadArgs[] = {&cu.getPosq().getDevicePointer(), &pmeGrid2.getDevicePointer(), cu.getPeriodicBoxSizePointer(),
+                cu.getInvPeriodicBoxSizePointer(), cu.getPeriodicBoxVecXPointer(), cu.getPeriodicBoxVecYPointer(), cu.getPeriodicBoxVecZPointer(),
+                recipBoxVectorPointer[0], recipBoxVectorPointer[1], recipBoxVectorPointer[2], &pmeAtomGridIndex.getDevicePointer(),
+                &sigmaEpsilon.getDevicePointer()};
+        beginStage("ljpmeSpreadCharge");
+        cu.executeKernel(pmeDispersionSpreadChargeKernel, spreadArgs, cu.getNumAtoms(), 128);
+
+        void* finishSpreadArgs[] = {&pmeGrid2.getDevicePointer(), &pmeGrid1.getDevicePointer()};
+        cu.executeKernel(pmeDispersionFinishSpreadChargeKernel, finishSpreadArgs, dispersionGridSizeX*dispersionGridSizeY*dispersionGridSizeZ, 256);
+        endStage();
+
+        if (fuseConvolution && dispersionFft->hasConvolution()) {
+            beginStage("ljpmeFFTConvolution");
+            dispersionFft->execConvolution();
+            endStage();
+        }
+        else {
+            beginStage("ljpmeForwardFFT");
+            dispersionFft->execFFT(true);
+            endStage();
+            if (includeEnergy || computeDerivatives) {
+                void* convolutionArgs[] = {&pmeGrid2.getDevicePointer(), &ljpmeEnergyBuffer.getDevicePointer(),
+                        &pmeDispersionBsplineModuliX.getDevicePointer(), &pmeDispersionBsplineModuliY.getDevicePointer(), &pmeDispersionBsplineModuliZ.getDevicePointer(),
+                        recipBoxVectorPointer[0], recipBoxVectorPointer[1], recipBoxVectorPointer[2]};
+                beginStage("ljpmeConvolution");
+                cu.executeKernel(pmeDispersionConvolutionEnergyKernel, convolutionArgs, dispersionGridSizeX*dispersionGridSizeY*(dispersionGridSizeZ/2+1));
+                endStage();
+            }
+            else if (includeForces) {
+                void* convolutionArgs[] = {&pmeGrid2.getDevicePointer(), &pmeDispersionBsplineModuliX.getDevicePointer(),
+                        &pmeDispersionBsplineModuliY.getDevicePointer(), &pmeDispersionBsplineModuliZ.getDevicePointer(),
+                        recipBoxVectorPointer[0], recipBoxVectorPointer[1], recipBoxVectorPointer[2]};
+                beginStage("ljpmeConvolution");
+                cu.executeKernel(pmeDispersionConvolutionKernel, convolutionArgs, dispersionGridSizeX*dispersionGridSizeY*dispersionGridSizeZ, 256);
+                endStage();
+            }
+            if (includeForces) {
+                beginStage("ljpmeInverseFFT");
+                dispersionFft->execFFT(false);
+                endStage();
+            }
+        }
+
+        if (includeForces) {
+            void* interpolateArgs[] = {&cu.getPosq().getDevicePointer(), &cu.getForce().getDevicePointer(), &pmeGrid1.getDevicePointer(), cu.getPeriodicBoxSizePointer(),
+                    cu.getInvPeriodicBoxSizePointer(), cu.getPeriodicBoxVecXPointer(), cu.getPeriodicBoxVecYPointer(), cu.getPeriodicBoxVecZPointer(),
+                    recipBoxVectorPointer[0], recipBoxVectorPointer[1], recipBoxVectorPointer[2], &pmeAtomGridIndex.getDevicePointer(),
+                    &sigmaEpsilon.getDevicePointer(), &subsets.getDevicePointer(), &sliceLambdas.getDevicePointer()};
+            beginStage("ljpmeInterpolateForce");
+            cu.executeKernel(pmeInterpolateDispersionForceKernel, interpolateArgs, cu.getNumAtoms(), 128);
+            endStage();
+        }
+    }
+}
+
+void CudaCalcSlicedNonbondedForceKernel::launchPmeGraph(bool includeForces, bool includeEnergy, const Vec3* boxVectors, void* recipBoxVectorPointer[3]) {
+    // The box vectors are passed to the kernels by value, so the graphs are captured again
+    // when the box changes, and the new kernel parameters are written into the instantiated
+    // graphs, which is much cheaper than instantiating them again.  Each mode is executed
+    // once without a graph, so that the FFT libraries have done any lazy setup before capture.
+
+    if (pmeGraphBox[0] != boxVectors[0] || pmeGraphBox[1] != boxVectors[1] || pmeGraphBox[2] != boxVectors[2]) {
+        for (int i = 0; i < 3; i++)
+            pmeGraphBox[i] = boxVectors[i];
+        for (int mode = 0; mode < 4; mode++)
+            pmeGraphIsStale[mode] = true;
+    }
+    int mode = (includeForces ? 1 : 0) + (includeEnergy || computeDerivatives ? 2 : 0);
+    if (!pmeGraphIsWarm[mode]) {
+        executePmeKernels(includeForces, includeEnergy, recipBoxVectorPointer);
+        pmeGraphIsWarm[mode] = true;
+        return;
+    }
+    if (pmeGraphIsStale[mode]) {
+        CUgraph graph;
+        CHECK_RESULT(cuStreamBeginCapture(pmeStream, CU_STREAM_CAPTURE_MODE_THREAD_LOCAL), "Error capturing graph for SlicedNonbondedForce");
+        try {
+            executePmeKernels(includeForces, includeEnergy, recipBoxVectorPointer);
+        }
+        catch (...) {
+            // End the capture, so that the stream can still be used.
+
+            graph = NULL;
+            cuStreamEndCapture(pmeStream, &graph);
+            if (graph != NULL)
+                cuGraphDestroy(graph);
+            throw;
+        }
+        CHECK_RESULT(cuStreamEndCapture(pmeStream, &graph), "Error capturing graph for SlicedNonbondedForce");
+        bool updated = false;
+        if (pmeGraphs[mode] != NULL) {
+#if CUDA_VERSION >= 12000
+            CUgraphExecUpdateResultInfo result;
+            updated = (cuGraphExecUpdate(pmeGraphs[mode], graph, &result) == CUDA_SUCCESS);
+#else
+            CUgraphNode errorNode;
+            CUgraphExecUpdateResult result;
+            updated = (cuGraphExecUpdate(pmeGraphs[mode], graph, &errorNode, &result) == CUDA_SUCCESS);
+#endif
+            if (!updated)
+                cuGraphExecDestroy(pmeGraphs[mode]);
+        }
+        if (!updated)
+            CHECK_RESULT(cuGraphInstantiateWithFlags(&pmeGraphs[mode], graph, 0), "Error instantiating graph for SlicedNonbondedForce");
+        cuGraphDestroy(graph);
+        pmeGraphIsStale[mode] = false;
+    }
+    CHECK_RESULT(cuGraphLaunch(pmeGraphs[mode], pmeStream), "Error launching graph for SlicedNonbondedForce");
+}
+
+void CudaCalcSlicedNonbondedForceKernel::initializeCpuPme() {
+    // The calculation uses the pool shared by the plugin, whose number of threads can be set
+    // with the OPENMM_CPU_THREADS environment variable, as on the CPU platform.
+
+    cpuPmeThreads = &SharedThreadPool::getInstance();
+    int numAtoms = cu.getNumAtoms();
+    if (hasCoulomb) {
+        int gridSize[] = {gridSizeX, gridSizeY, gridSizeZ};
+        pme_init(&cpuPmeData, alpha, numAtoms, numSubsets, gridSize, pmeOrder, 1);
+        pme_set_thread_pool(cpuPmeData, cpuPmeThreads);
+    }
+    if (doLJPME) {
+        int gridSize[] = {dispersionGridSizeX, dispersionGridSizeY, dispersionGridSizeZ};
+        pme_init(&cpuDispersionPmeData, dispersionAlpha, numAtoms, numSubsets, gridSize, pmeOrder, 1);
+        pme_set_thread_pool(cpuDispersionPmeData, cpuPmeThreads);
+    }
+    int chargeSize = (cu.getUseDoublePrecision() ? sizeof(double) : sizeof(float));
+    CHECK_RESULT(cuMemHostAlloc(&cpuPmePosq, numAtoms*cu.getPosq().getElementSize(), 0), "Error allocating pinned memory for SlicedNonbondedForce");
+    CHECK_RESULT(cuMemHostAlloc(&cpuPmeCharges, numAtoms*chargeSize, 0), "Error allocating pinned memory for SlicedNonbondedForce");
+    CHECK_RESULT(cuMemHostAlloc(&cpuPmeSigmaEpsilon, numAtoms*sizeof(float2), 0), "Error allocating pinned memory for SlicedNonbondedForce");
+    CHECK_RESULT(cuMemHostAlloc((void**) &cpuPmeForces, 3*cu.getPaddedNumAtoms()*sizeof(long long), 0), "Error allocating pinned memory for SlicedNonbondedForce");
+    memset(cpuPmeForces, 0, 3*cu.getPaddedNumAtoms()*sizeof(long long));
+    cpuPmeForceBuffer.initialize<long long>(cu, 3*cu.getPaddedNumAtoms(), "cpuPmeForces");
+    CHECK_RESULT(cuEventCreate(&cpuPmeDownloadEvent, CU_EVENT_DISABLE_TIMING), "Error creating event for SlicedNonbondedForce");
+    cpuPmePending = false;
+    cpuPmeParamsChanged = true;
+    cu.addPostComputation(new CpuPmePostComputation(*this, recipForceGroup));
+}
+
+void CudaCalcSlicedNonbondedForceKernel::launchCpuPme(bool includeForces) {
+    // The downloads are queued behind the parameter kernels, and the worker thread waits for
+    // them, so the host returns at once and the device goes on with direct space.
+
+    int numAtoms = cu.getNumAtoms();
+    CUstream stream = cu.getCurrentStream();
+    CHECK_RESULT(cuMemcpyDtoHAsync(cpuPmePosq, cu.getPosq().getDevicePointer(), numAtoms*cu.getPosq().getElementSize(), stream),
+            "Error downloading positions for SlicedNonbondedForce");
+    if (cpuPmeParamsChanged) {
+        if (hasCoulomb && !usePosqCharges)
+            CHECK_RESULT(cuMemcpyDtoHAsync(cpuPmeCharges, charges.getDevicePointer(), numAtoms*charges.getElementSize(), stream),
+                    "Error downloading charges for SlicedNonbondedForce");
+        if (doLJPME)
+            CHECK_RESULT(cuMemcpyDtoHAsync(cpuPmeSigmaEpsilon, sigmaEpsilon.getDevicePointer(), numAtoms*sizeof(float2), stream),
+                    "Error downloading parameters for SlicedNonbondedForce");
+        cpuPmeParamsChanged = false;
+    }
+    CHECK_RESULT(cuEventRecord(cpuPmeDownloadEvent, stream), "Error recording event for SlicedNonbondedForce");
+    Vec3 boxVectors[3];
+    cu.getPeriodicBoxVectors(boxVectors[0], boxVectors[1], boxVectors[2]);
+    vector<array<double, 2> > lambdas(numSlices);
+    for (int slice = 0; slice < numSlices; slice++)
+        lambdas[slice] = {sliceLambdasVec[slice].x, sliceLambdasVec[slice].y};
+    cpuPmeResult = async(launch::async, [this, includeForces, boxVectors, lambdas] () {
+        computeCpuPme(includeForces, boxVectors, lambdas);
+    });
+    cpuPmePending = true;
+}
+
+void CudaCalcSlicedNonbondedForceKernel::computeCpuPme(bool includeForces, const Vec3* boxVectors, const vector<array<double, 2> >& lambdas) {
+    ContextSelector selector(cu);
+    CHECK_RESULT(cuEventSynchronize(cpuPmeDownloadEvent), "Error synchronizing event for SlicedNonbondedForce");
+    int numAtoms = cu.getNumAtoms();
+    bool doublePositions = (cu.getPosq().getElementSize() == sizeof(double4));
+    vector<Vec3> positions(numAtoms);
+    vector<double> charges(numAtoms);
+    for (int i = 0; i < numAtoms; i++) {
+        if (doublePositions) {
+            double4 pos = ((double4*) cpuPmePosq)[i];
+            positions[i] = Vec3(pos.x, pos.y, pos.z);
+            charges[i] = pos.w;
+        }
+        else {
+            float4 pos = ((float4*) cpuPmePosq)[i];
+            positions[i] = Vec3(pos.x, pos.y, pos.z);
+            charges[i] = pos.w;
+        }
+    }
+    vector<Vec3> forces(numAtoms);
+    cpuPmeSliceEnergies.assign(numSlices, {0.0, 0.0, 0.0});
+    if (hasCoulomb) {
+        if (!usePosqCharges)
+            for (int i = 0; i < numAtoms; i++)
+                charges[i] = cu.getUseDoublePrecision() ? ((double*) cpuPmeCharges)[i] : ((float*) cpuPmeCharges)[i];
+        pme_exec(cpuPmeData, positions, subsetsVec, lambdas, forces, charges, boxVectors, cpuPmeSliceEnergies);
+    }
+    if (doLJPME) {
+        vector<Vec3> dispersionForces(numAtoms);
+        vector<double> c6s(numAtoms);
+        for (int i = 0; i < numAtoms; i++) {
+            float2 sigEps = ((float2*) cpuPmeSigmaEpsilon)[i];
+            c6s[i] = 8.0*pow(sigEps.x, 3.0)*sigEps.y;
+        }
+        pme_exec_dpme(cpuDispersionPmeData, positions, subsetsVec, lambdas, dispersionForces, c6s, boxVectors, cpuPmeSliceEnergies);
+        for (int i = 0; i < numAtoms; i++)
+            forces[i] += dispersionForces[i];
+    }
+    if (includeForces) {
+        int paddedNumAtoms = cu.getPaddedNumAtoms();
+        for (int i = 0; i < numAtoms; i++)
+            for (int j = 0; j < 3; j++)
+                cpuPmeForces[i+j*paddedNumAtoms] = (long long) (forces[i][j]*0x100000000);
+    }
+}
+
+double CudaCalcSlicedNonbondedForceKernel::finishCpuPme(bool includeForces) {
+    if (!cpuPmePending)
+        return 0.0;
+    cpuPmePending = false;
+    cpuPmeResult.get();
+    if (includeForces) {
+        CHECK_RESULT(cuMemcpyHtoDAsync(cpuPmeForceBuffer.getDevicePointer(), cpuPmeForces, cpuPmeForceBuffer.getSize()*sizeof(long long), cu.getCurrentStream()),
+                "Error uploading forces for SlicedNonbondedForce");
+        void* args[] = {&cu.getForce().getDevicePointer(), &cpuPmeForceBuffer.getDevicePointer()};
+        cu.executeKernel(addHostForcesKernel, args, 3*cu.getPaddedNumAtoms());
+    }
+    double energy = 0.0;
+    map<string, double>& energyParamDerivs = cu.getEnergyParamDerivWorkspace();
+    for (int slice = 0; slice < numSlices; slice++) {
+        const ScalingParameterInfo& info = sliceScalingParams[slice];
+        energy += sliceLambdasVec[slice].x*cpuPmeSliceEnergies[slice][0] + sliceLambdasVec[slice].y*cpuPmeSliceEnergies[slice][1];
+        if (computeDerivatives && info.hasDerivativeCoulomb)
+            energyParamDerivs[info.nameCoulomb] += cpuPmeSliceEnergies[slice][0];
+        if (computeDerivatives && doLJPME && info.hasDerivativeLJ)
+            energyParamDerivs[info.nameLJ] += cpuPmeSliceEnergies[slice][1];
+    }
+    return energy;
+}
+
+void CudaCalcSlicedNonbondedForceKernel::findParameterSources(ContextImpl& context) {
+    // Parameters are never removed from a context, so the addresses of their values stay valid.
+
+    const map<string, double>& parameters = context.getParameters();
+    auto findSource = [&] (const string& name) -> const double* {
+        auto parameter = parameters.find(name);
+        if (parameter == parameters.end())
+            throw OpenMMException("SlicedNonbondedForce: unknown global parameter '"+name+"'");
+        return &parameter->second;
+    };
+    coulombLambdaSources.assign(numSlices, NULL);
+    ljLambdaSources.assign(numSlices, NULL);
+    for (int slice = 0; slice < numSlices; slice++) {
+        const ScalingParameterInfo& info = sliceScalingParams[slice];
+        if (info.includeCoulomb)
+            coulombLambdaSources[slice] = findSource(info.nameCoulomb);
+        if (info.includeLJ)
+            ljLambdaSources[slice] = findSource(info.nameLJ);
+    }
+    paramSources.clear();
+    for (const string& name : paramNames)
+        paramSources.push_back(findSource(name));
+    hasParameterSources = true;
+}
+
+void CudaCalcSlicedNonbondedForceKernel::setSliceLambdas(const vector<double2>& lambdas, bool fixed) {
+    ContextSelector selector(cu);
+    sliceLambdasVec = lambdas;
+    uploadSliceLambdas();
+    useFixedSliceLambdas = fixed;
+}
+
+void CudaCalcSlicedNonbondedForceKernel::addReciprocalSliceEnergies(vector<double>& coulombEnergies, vector<double>& ljEnergies) {
+    ContextSelector selector(cu);
+    bool useDoubleEnergies = cu.getUseDoublePrecision() || cu.getUseMixedPrecision();
+    CudaArray* buffers[] = {&pmeEnergyBuffer, &ljpmeEnergyBuffer};
+    vector<double>* energies[] = {&coulombEnergies, &ljEnergies};
+    for (int term = 0; term < 2; term++) {
+        CudaArray& buffer = *buffers[term];
+        if (!buffer.isInitialized())
+            continue;
+
+        // The buffer is read as raw bytes because its element size may exceed that of the energies.
+
+        vector<char> bytes(buffer.getSize()*buffer.getElementSize());
+        buffer.download(bytes.data());
+        for (int i = 0; i < buffer.getSize(); i++)
+            (*energies[term])[energySlotSlices[i%numEnergySlots]] += useDoubleEnergies ? ((double*) bytes.data())[i] : ((float*) bytes.data())[i];
+    }
+    for (int i = 0; i < numSubsets; i++) {
+        coulombEnergies[sliceIndex(i, i)] += subsetSelfEnergy[i].x;
+        ljEnergies[sliceIndex(i, i)] += subsetSelfEnergy[i].y;
+    }
+}
+
+void CudaCalcSlicedNonbondedForceKernel::getSliceEnergyArrays(DeviceArray& coulombEnergies, DeviceArray& ljEnergies, vector<int>& slotSlices) {
+    // Entry i of a buffer accumulates the energy of slot i%numEnergySlots, so the buffer is
+    // a matrix with one column per slot.
+
+    bool useDoubleEnergies = cu.getUseDoublePrecision() || cu.getUseMixedPrecision();
+    CudaArray* buffers[] = {&pmeEnergyBuffer, &ljpmeEnergyBuffer};
+    DeviceArray* arrays[] = {&coulombEnergies, &ljEnergies};
+    for (int term = 0; term < 2; term++) {
+        DeviceArray& array = *arrays[term];
+        array = DeviceArray();
+        CudaArray& buffer = *buffers[term];
+        if (!buffer.isInitialized())
+            continue;
+        array.pointer = (long long) buffer.getDevicePointer();
+        array.typestr = (useDoubleEnergies ? "<f8" : "<f4");
+        array.shape = {(int) buffer.getSize()/numEnergySlots, numEnergySlots};
+        array.stream = (long long) cu.getCurrentStream();
+        array.device = cu.getDeviceIndex();
+    }
+    slotSlices = energySlotSlices;
+}
+
+void CudaCalcSlicedNonbondedForceKernel::getSliceEnergies(ContextImpl& context, bool includeDirect, bool includeReciprocal,
+                                                          vector<double>& coulombEnergies, vector<double>& ljEnergies) {
+    computeSliceEnergies(context, vector<CudaCalcSlicedNonbondedForceKernel*>(1, this), includeDirect, includeReciprocal, coulombEnergies, ljEnergies);
+}
+
+void CudaCalcSlicedNonbondedForceKernel::computeSliceEnergies(ContextImpl& context, const vector<CudaCalcSlicedNonbondedForceKernel*>& kernels,
+                                                              bool includeDirect, bool includeReciprocal, vector<double>& coulombEnergies, vector<double>& ljEnergies) {
+    CudaCalcSlicedNonbondedForceKernel& first = *kernels[0];
+    int numSlices = first.numSlices;
+    bool readReciprocal = includeReciprocal && first.recipForceGroup != first.forceGroup;
+    int groups = (includeDirect ? 1<<first.forceGroup : 0) | (includeReciprocal && !readReciprocal ? 1<<first.recipForceGroup : 0);
+    vector<double2> savedLambdas = first.sliceLambdasVec;
+    vector<double2> lambdas(numSlices, make_double2(0, 0));
+    coulombEnergies.assign(numSlices, 0.0);
+    ljEnergies.assign(numSlices, 0.0);
+    if (readReciprocal) {
+        context.calcForcesAndEnergy(false, true, 1<<first.recipForceGroup);
+        for (auto kernel : kernels)
+            kernel->addReciprocalSliceEnergies(coulombEnergies, ljEnergies);
+    }
+    if (groups == 0)
+        return;
+    try {
+        for (auto kernel : kernels)
+            kernel->setSliceLambdas(lambdas, true);
+        double baseline = context.calcForcesAndEnergy(false, true, groups);
+        for (int slice = 0; slice < numSlices; slice++)
+            for (int term = 0; term < 2; term++) {
+                if (!(term == 0 ? first.hasCoulomb : first.hasLJ))
+                    continue;
+                (term == 0 ? lambdas[slice].x : lambdas[slice].y) = 1.0;
+                for (auto kernel : kernels)
+                    kernel->setSliceLambdas(lambdas, true);
+                double energy = context.calcForcesAndEnergy(false, true, groups)-baseline;
+                (term == 0 ? coulombEnergies[slice] : ljEnergies[slice]) += energy;
+                lambdas[slice] = make_double2(0, 0);
+            }
+    }
+    catch (...) {
+        for (auto kernel : kernels)
+            kernel->setSliceLambdas(savedLambdas, false);
+        throw;
+    }
+    for (auto kernel : kernels)
+        kernel->setSliceLambdas(savedLambdas, false);
+}
+
+void CudaCalcSlicedNonbondedForceKernel::getScalingParameterDerivatives(ContextImpl& context, bool includeDirect, bool includeReciprocal,
+                                                                         map<string, double>& derivatives) {
+    computeScalingParameterDerivatives(context, vector<CudaCalcSlicedNonbondedForceKernel*>(1, this), includeDirect, includeReciprocal, derivatives);
+}
+
+void CudaCalcSlicedNonbondedForceKernel::computeScalingParameterDerivatives(ContextImpl& context, const vector<CudaCalcSlicedNonbondedForceKernel*>& kernels,
+                                                                              bool includeDirect, bool includeReciprocal, map<string, double>& derivatives) {
+    CudaCalcSlicedNonbondedForceKernel& first = *kernels[0];
+    int groups = (includeDirect ? 1<<first.forceGroup : 0) | (includeReciprocal ? 1<<first.recipForceGroup : 0);
+    derivatives.clear();
+    if (!first.hasDerivatives || groups == 0)
+        return;
+
+    // Switch off every slice without a requested derivative.  The others keep the current
+    // values of their scaling parameters, or those of the selected lambda state, which matter
+    // for soft-core slices.
+
+    vector<double2> savedLambdas = first.sliceLambdasVec;
+    vector<double2> lambdas(first.numSlices, make_double2(0, 0));
+    for (int slice = 0; slice < first.numSlices; slice++) {
+        const ScalingParameterInfo& info = first.sliceScalingParams[slice];
+        if (!info.hasDerivativeCoulomb && !info.hasDerivativeLJ)
+            continue;
+        if (first.lambdaState >= 0)
+            lambdas[slice] = first.lambdaStatesVec[first.lambdaState][slice];
+        else
+            lambdas[slice] = make_double2(info.includeCoulomb ? context.getParameter(info.nameCoulomb) : 1.0,
+                                    info.includeLJ ? context.getParameter(info.nameLJ) : 1.0);
+    }
+    try {
+        for (auto kernel : kernels)
+            kernel->setSliceLambdas(lambdas, true);
+        context.calcForcesAndEnergy(false, true, groups);
+    }
+    catch (...) {
+        for (auto kernel : kernels)
+            kernel->setSliceLambdas(savedLambdas, false);
+        throw;
+    }
+    for (auto kernel : kernels)
+        kernel->setSliceLambdas(savedLambdas, false);
+    map<string, double> allDerivatives;
+    context.getEnergyParameterDerivatives(allDerivatives);
+    for (const ScalingParameterInfo& info : first.sliceScalingParams) {
+        if (info.hasDerivativeCoulomb)
+            derivatives[info.nameCoulomb] = allDerivatives[info.nameCoulomb];
+        if (info.hasDerivativeLJ)
+            derivatives[info.nameLJ] = allDerivatives[info.nameLJ];
+    }
+}
+
 void CudaCalcSlicedNonbondedForceKernel::getPMEParameters(double& alpha, int& nx, int& ny, int& nz) const {
     if (nonbondedMethod != PME)
         throw OpenMMException("getPMEParametersInContext: This Context is not using PME");
@@ -1219,3 +2987,47 @@ void CudaCalcSlicedNonbondedForceKernel::getLJPMEParameters(double& alpha, int&
     ny = dispersionGridSizeY;
     nz = dispersionGridSizeZ;
 }
+
+CudaCalcExtendedCustomCVForceKernel::~CudaCalcExtendedCustomCVForceKernel() {
+    if (hasSideStream) {
+        ContextSelector selector(*outerContext);
+        cuStreamDestroy(sideStream);
+        cuEventDestroy(outerEvent);
+        cuEventDestroy(sideEvent);
+    }
+}
+
+bool CudaCalcExtendedCustomCVForceKernel::createSideQueue(ComputeContext& context, ComputeContext& innerContext) {
+    ContextSelector selector(context);
+    CHECK_RESULT(cuStreamCreate(&sideStream, CU_STREAM_NON_BLOCKING), "Error creating stream for ExtendedCustomCVForce");
+    CHECK_RESULT(cuEventCreate(&outerEvent, CU_EVENT_DISABLE_TIMING), "Error creating event for ExtendedCustomCVForce");
+    CHECK_RESULT(cuEventCreate(&sideEvent, CU_EVENT_DISABLE_TIMING), "Error creating event for ExtendedCustomCVForce");
+    outerContext = &context;
+    hasSideStream = true;
+    return true;
+}
+
+void CudaCalcExtendedCustomCVForceKernel::markOuterQueue(ComputeContext& context) {
+    cuEventRecord(outerEvent, dynamic_cast<CudaContext&>(context).getCurrentStream());
+}
+
+void CudaCalcExtendedCustomCVForceKernel::beginSideQueue(ComputeContext& context, ComputeContext& innerContext) {
+    cuStreamWaitEvent(sideStream, outerEvent, 0);
+    dynamic_cast<CudaContext&>(context).setCurrentStream(sideStream);
+    dynamic_cast<CudaContext&>(innerContext).setCurrentStream(sideStream);
+}
+
+void CudaCalcExtendedCustomCVForceKernel::endSideQueue(ComputeContext& context, ComputeContext& innerContext) {
+    CudaContext& cu = dynamic_cast<CudaContext&>(context);
+    cuEventRecord(sideEvent, sideStream);
+    cu.restoreDefaultStream();
+    dynamic_cast<CudaContext&>(innerContext).restoreDefaultStream();
+    cuStreamWaitEvent(cu.getCurrentStream(), sideEvent, 0);
+}
+
+void CudaCalcExtendedCustomCVForceKernel::describeArray(ComputeContext& context, ArrayInterface& array, DeviceArray& description) {
+    CudaContext& cu = dynamic_cast<CudaContext&>(context);
+    description.pointer = (long long) cu.unwrap(array).getDevicePointer();
+    description.stream = (long long) cu.getCurrentStream();
+    description.device = cu.getDeviceIndex();
+}
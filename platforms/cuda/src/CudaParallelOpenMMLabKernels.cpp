@@ -11,6 +11,7 @@
 #include "CudaParallelOpenMMLabKernels.h"
 #include "CudaOpenMMLabKernelSources.h"
 #include "openmm/common/ContextSelector.h"
+#include <algorithm>
 
 using namespace OpenMMLab;
 using namespace OpenMM;
@@ -33,17 +34,22 @@ private:
 };
 
 CudaParallelCalcSlicedNonbondedForceKernel::CudaParallelCalcSlicedNonbondedForceKernel(std::string name, const Platform& platform, CudaPlatform::PlatformData& data, const System& system) :
-        CalcSlicedNonbondedForceKernel(name, platform), data(data) {
+        CalcSlicedNonbondedForceKernel(name, platform), data(data), evaluationsSinceBalance(0) {
     for (int i = 0; i < (int) data.contexts.size(); i++)
         kernels.push_back(Kernel(new CudaCalcSlicedNonbondedForceKernel(name, platform, *data.contexts[i], system)));
 }
 
 void CudaParallelCalcSlicedNonbondedForceKernel::initialize(const System& system, const SlicedNonbondedForce& force) {
-    for (int i = 0; i < (int) kernels.size(); i++)
+    for (int i = 0; i < (int) kernels.size(); i++) {
         getKernel(i).initialize(system, force);
+        if (kernels.size() > 1)
+            getKernel(i).enableDeviceTiming();
+    }
 }
 
 double CudaParallelCalcSlicedNonbondedForceKernel::execute(ContextImpl& context, bool includeForces, bool includeEnergy, bool includeDirect, bool includeReciprocal) {
+    if (kernels.size() > 1 && includeDirect)
+        balanceLoad();
     for (int i = 0; i < (int) data.contexts.size(); i++) {
         CudaContext& cu = *data.contexts[i];
         ComputeContext::WorkThread& thread = cu.getWorkThread();
@@ -57,6 +63,22 @@ void CudaParallelCalcSlicedNonbondedForceKernel::copyParametersToContext(Context
         getKernel(i).copyParametersToContext(context, force);
 }
 
+void CudaParallelCalcSlicedNonbondedForceKernel::getSliceEnergies(ContextImpl& context, bool includeDirect, bool includeReciprocal,
+                                                                  vector<double>& coulombEnergies, vector<double>& ljEnergies) {
+    vector<CudaCalcSlicedNonbondedForceKernel*> deviceKernels;
+    for (int i = 0; i < (int) kernels.size(); i++)
+        deviceKernels.push_back(&getKernel(i));
+    CudaCalcSlicedNonbondedForceKernel::computeSliceEnergies(context, deviceKernels, includeDirect, includeReciprocal, coulombEnergies, ljEnergies);
+}
+
+void CudaParallelCalcSlicedNonbondedForceKernel::getScalingParameterDerivatives(ContextImpl& context, bool includeDirect, bool includeReciprocal,
+                                                                                map<string, double>& derivatives) {
+    vector<CudaCalcSlicedNonbondedForceKernel*> deviceKernels;
+    for (int i = 0; i < (int) kernels.size(); i++)
+        deviceKernels.push_back(&getKernel(i));
+    CudaCalcSlicedNonbondedForceKernel::computeScalingParameterDerivatives(context, deviceKernels, includeDirect, includeReciprocal, derivatives);
+}
+
 void CudaParallelCalcSlicedNonbondedForceKernel::getPMEParameters(double& alpha, int& nx, int& ny, int& nz) const {
     dynamic_cast<const CudaCalcSlicedNonbondedForceKernel&>(kernels[0].getImpl()).getPMEParameters(alpha, nx, ny, nz);
 }
@@ -64,3 +86,88 @@ void CudaParallelCalcSlicedNonbondedForceKernel::getPMEParameters(double& alpha,
 void CudaParallelCalcSlicedNonbondedForceKernel::getLJPMEParameters(double& alpha, int& nx, int& ny, int& nz) const {
     dynamic_cast<const CudaCalcSlicedNonbondedForceKernel&>(kernels[0].getImpl()).getLJPMEParameters(alpha, nx, ny, nz);
 }
+
+void CudaParallelCalcSlicedNonbondedForceKernel::getStageTimes(map<string, double>& times) {
+    // The devices work in parallel, so the time of each stage is summed over all of them.
+
+    times.clear();
+    for (int i = 0; i < (int) kernels.size(); i++) {
+        data.contexts[i]->getWorkThread().flush();
+        map<string, double> deviceTimes;
+        getKernel(i).getStageTimes(deviceTimes);
+        for (auto& stage : deviceTimes)
+            times[stage.first] += stage.second;
+    }
+}
+
+void CudaParallelCalcSlicedNonbondedForceKernel::getSliceEnergyArrays(DeviceArray& coulombEnergies, DeviceArray& ljEnergies, vector<int>& slotSlices) {
+    data.contexts[0]->getWorkThread().flush();
+    getKernel(0).getSliceEnergyArrays(coulombEnergies, ljEnergies, slotSlices);
+}
+
+void CudaParallelCalcSlicedNonbondedForceKernel::setLambdaState(int index) {
+    for (int i = 0; i < (int) kernels.size(); i++) {
+        data.contexts[i]->getWorkThread().flush();
+        getKernel(i).setLambdaState(index);
+    }
+}
+
+int CudaParallelCalcSlicedNonbondedForceKernel::getLambdaState() const {
+    return dynamic_cast<const CudaCalcSlicedNonbondedForceKernel&>(kernels[0].getImpl()).getLambdaState();
+}
+
+void CudaParallelCalcSlicedNonbondedForceKernel::resetStageTimes() {
+    for (int i = 0; i < (int) kernels.size(); i++) {
+        data.contexts[i]->getWorkThread().flush();
+        getKernel(i).resetStageTimes();
+    }
+}
+
+void CudaParallelCalcSlicedNonbondedForceKernel::balanceLoad() {
+    if (data.contexts[0]->getComputeForceCount() < BalanceStart || ++evaluationsSinceBalance < BalanceInterval)
+        return;
+    evaluationsSinceBalance = 0;
+
+    // The work threads are idle after the flush, so the device kernels can be read and
+    // modified.  The fraction of the tiles of each device is what it currently computes.
+
+    int numDevices = kernels.size();
+    vector<double> times(numDevices), fractions(numDevices);
+    double totalTiles = 0.0;
+    for (int i = 0; i < numDevices; i++) {
+        data.contexts[i]->getWorkThread().flush();
+        int numSamples;
+        times[i] = getKernel(i).takeDeviceTime(numSamples);
+        if (numSamples == 0 || times[i] <= 0.0)
+            return;
+        fractions[i] = data.contexts[i]->getNonbondedUtilities().getNumTiles();
+        totalTiles += fractions[i];
+    }
+    if (totalTiles == 0.0)
+        return;
+    double minTime = *min_element(times.begin(), times.end());
+    double maxTime = *max_element(times.begin(), times.end());
+    if (maxTime < (1+MinImbalance)*minTime)
+        return;
+
+    // Each device is given a share of the tiles proportional to the rate at which it has
+    // processed its current share.  The time of a device also includes work that does not
+    // scale with its tiles, such as reciprocal space on the first device, so the shares are
+    // only moved halfway toward that target, and converge over several intervals to the
+    // point where all devices take the same time.
+
+    vector<double> rates(numDevices);
+    double totalRate = 0.0;
+    for (int i = 0; i < numDevices; i++) {
+        fractions[i] /= totalTiles;
+        rates[i] = fractions[i]/times[i];
+        totalRate += rates[i];
+    }
+    double start = 0.0;
+    for (int i = 0; i < numDevices; i++) {
+        double fraction = 0.5*(fractions[i]+rates[i]/totalRate);
+        double end = (i == numDevices-1 ? 1.0 : min(1.0, start+fraction));
+        getKernel(i).setAtomBlockRange(start, end);
+        start = end;
+    }
+}
@@ -10,26 +10,123 @@
 
 #include "internal/CudaVkFFT3D.h"
 #include "openmm/cuda/CudaContext.h"
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <iterator>
+#include <map>
+#include <sstream>
 #include <string>
+#include <tuple>
+#include <vector>
+#ifdef _WIN32
+#include <process.h>
+#define getpid _getpid
+#else
+#include <unistd.h>
+#endif
 
 using namespace OpenMMLab;
 using namespace OpenMM;
 using namespace std;
 
-CudaVkFFT3D::CudaVkFFT3D(CudaContext& context, CUstream& stream, int xsize, int ysize, int zsize, int batch, bool realToComplex, CudaArray& in, CudaArray& out) :
-        CudaFFT3D(context, stream, xsize, ysize, zsize, batch, realToComplex, in, out) {
+CudaVkFFT3D::CudaVkFFT3D(CudaContext& context, CUstream& stream, int xsize, int ysize, int zsize, int batch, bool realToComplex, CudaArray& in, CudaArray& out,
+                         CudaArray* convolutionKernel) :
+        CudaFFT3D(context, stream, xsize, ysize, zsize, batch, realToComplex, in, out), stream(&stream), kernelBuffer(0) {
+    plan = getPlan(context, xsize, ysize, zsize, batch, realToComplex, doublePrecision, inputBuffer, outputBuffer, 0);
+    if (convolutionKernel != NULL) {
+        kernelBuffer = convolutionKernel->getDevicePointer();
+        convolutionPlan = getPlan(context, xsize, ysize, zsize, batch, realToComplex, doublePrecision, inputBuffer, outputBuffer, kernelBuffer);
+    }
+}
+
+CudaVkFFT3D::~CudaVkFFT3D() {
+}
+
+static mutex kernelCacheLock;
+static bool kernelCacheDirectoryIsSet = false;
+static string kernelCacheDirectory;
+static atomic<unsigned long long> tempFileCounter(0);
+
+void CudaVkFFT3D::setKernelCacheDirectory(const string& directory) {
+    lock_guard<mutex> guard(kernelCacheLock);
+    kernelCacheDirectory = directory;
+    kernelCacheDirectoryIsSet = true;
+}
+
+string CudaVkFFT3D::getKernelCacheDirectory() {
+    lock_guard<mutex> guard(kernelCacheLock);
+    if (!kernelCacheDirectoryIsSet) {
+        const char* directory = getenv("OPENMMLAB_VKFFT_CACHE_DIR");
+        kernelCacheDirectory = (directory == NULL ? "" : directory);
+        kernelCacheDirectoryIsSet = true;
+    }
+    return kernelCacheDirectory;
+}
+
+/**
+ * Get the name of the file that stores the compiled kernels of a transform.  Kernels are
+ * specific to the device, the driver and the version of VkFFT, so all of them are part of
+ * the name along with the parameters of the transform.
+ */
+static string getKernelCacheFile(CudaContext& context, int xsize, int ysize, int zsize, int batch, bool realToComplex, bool doublePrecision, bool convolution) {
+    string directory = CudaVkFFT3D::getKernelCacheDirectory();
+    if (directory.empty())
+        return "";
+    char deviceName[256];
+    if (cuDeviceGetName(deviceName, sizeof(deviceName), context.getDevice()) != CUDA_SUCCESS)
+        return "";
+    int driverVersion;
+    cuDriverGetVersion(&driverVersion);
+    stringstream device;
+    device<<deviceName<<" "<<driverVersion;
+    stringstream name;
+    name<<directory<<"/vkfft-cuda-"<<VkFFTGetVersion()<<"-"<<hex<<hash<string>()(device.str())<<dec<<"-"<<xsize<<"x"<<ysize<<"x"<<zsize;
+    name<<"-"<<batch<<(realToComplex ? "-r2c" : "-c2c")<<(doublePrecision ? "-double" : "-single")<<(convolution ? "-convolution" : "")<<".bin";
+    return name.str();
+}
+
+CudaVkFFT3D::Plan::~Plan() {
+    deleteVkFFT(&app);
+    cuEventDestroy(lastUse);
+}
+
+shared_ptr<CudaVkFFT3D::Plan> CudaVkFFT3D::getPlan(CudaContext& context, int xsize, int ysize, int zsize, int batch, bool realToComplex, bool doublePrecision,
+                                                   CUdeviceptr inputBuffer, CUdeviceptr outputBuffer, CUdeviceptr kernelBuffer) {
+    static mutex cacheLock;
+    static map<tuple<CUcontext, int, int, int, int, bool, bool, bool>, weak_ptr<Plan> > cache;
+    CUcontext cuContext;
+    cuCtxGetCurrent(&cuContext);
+    bool convolution = (kernelBuffer != 0);
+    auto key = make_tuple(cuContext, xsize, ysize, zsize, batch, realToComplex, doublePrecision, convolution);
+    lock_guard<mutex> guard(cacheLock);
+    shared_ptr<Plan> plan = cache[key].lock();
+    if (plan)
+        return plan;
+
+    // Forget the plans that are no longer used by any transform.
+
+    for (auto entry = cache.begin(); entry != cache.end(); )
+        if (entry->second.expired())
+            entry = cache.erase(entry);
+        else
+            entry++;
+    plan = make_shared<Plan>();
     int outputZSize = realToComplex ? (zsize/2+1) : zsize;
     size_t realTypeSize = doublePrecision ? sizeof(double) : sizeof(float);
     size_t inputElementSize = realToComplex ? realTypeSize : 2*realTypeSize;
-    device = context.getDeviceIndex();
-    inputBufferSize = inputElementSize*zsize*ysize*xsize*batch;
-    outputBufferSize = 2*realTypeSize*outputZSize*ysize*xsize*batch;
+    plan->device = context.getDeviceIndex();
+    plan->stream = 0;
+    plan->inputBufferSize = inputElementSize*zsize*ysize*xsize*batch;
+    plan->outputBufferSize = 2*realTypeSize*outputZSize*ysize*xsize*batch;
 
     VkFFTConfiguration config = {};
     config.performR2C = realToComplex;
-    config.device = &device;
+    config.device = &plan->device;
     config.num_streams = 1;
-    config.stream = &stream;
+    config.stream = &plan->stream;
     config.doublePrecision = doublePrecision;
 
     config.FFTdim = 3;
@@ -40,31 +137,112 @@ CudaVkFFT3D::CudaVkFFT3D(CudaContext& context, CUstream& stream, int xsize, int
 
     config.inverseReturnToInputBuffer = true;
     config.isInputFormatted = true;
-    config.inputBufferSize = &inputBufferSize;
+    config.inputBufferSize = &plan->inputBufferSize;
     config.inputBuffer = (void**) &inputBuffer;
     config.inputBufferStride[0] = zsize;
     config.inputBufferStride[1] = zsize*ysize;
     config.inputBufferStride[2] = zsize*ysize*xsize;
 
-    config.bufferSize = &outputBufferSize;
+    config.bufferSize = &plan->outputBufferSize;
     config.buffer = (void**) &outputBuffer;
     config.bufferStride[0] = outputZSize;
     config.bufferStride[1] = outputZSize*ysize;
     config.bufferStride[2] = outputZSize*ysize*xsize;
 
-    app = new VkFFTApplication();
-    VkFFTResult result = initializeVkFFT(app, config);
-    if (result != VKFFT_SUCCESS)
-        throw OpenMMException("Error initializing VkFFT: "+to_string(result));
-}
+    if (convolution) {
+        // Multiply every batch by the same kernel between the forward and inverse transforms,
+        // and write the result back into the input buffer.
 
-CudaVkFFT3D::~CudaVkFFT3D() {
-    deleteVkFFT(app);
-    delete app;
+        plan->kernelSize = 2*realTypeSize*outputZSize*ysize*xsize;
+        config.performConvolution = 1;
+        config.coordinateFeatures = 1;
+        config.singleKernelMultipleBatches = 1;
+        config.kernelSize = &plan->kernelSize;
+        config.kernel = (void**) &kernelBuffer;
+        config.inverseReturnToInputBuffer = false;
+        config.isOutputFormatted = true;
+        config.outputBufferSize = &plan->inputBufferSize;
+        config.outputBuffer = (void**) &inputBuffer;
+        config.outputBufferStride[0] = zsize;
+        config.outputBufferStride[1] = zsize*ysize;
+        config.outputBufferStride[2] = zsize*ysize*xsize;
+    }
+
+    // Load the compiled kernels if they have been stored before.  Otherwise, or if they
+    // cannot be used, compile them and store them for later processes.
+
+    string cacheFile = getKernelCacheFile(context, xsize, ysize, zsize, batch, realToComplex, doublePrecision, convolution);
+    vector<char> kernels;
+    if (!cacheFile.empty()) {
+        ifstream file(cacheFile.c_str(), ios::binary);
+        kernels.assign(istreambuf_iterator<char>(file), istreambuf_iterator<char>());
+    }
+    VkFFTResult result = VKFFT_ERROR_FAILED_TO_INITIALIZE;
+    if (kernels.size() > 0) {
+        config.loadApplicationFromString = 1;
+        config.loadApplicationString = kernels.data();
+        plan->app = {};
+        result = initializeVkFFT(&plan->app, config);
+    }
+    if (result != VKFFT_SUCCESS) {
+        config.loadApplicationFromString = 0;
+        config.loadApplicationString = NULL;
+        config.saveApplicationToString = !cacheFile.empty();
+        plan->app = {};
+        result = initializeVkFFT(&plan->app, config);
+        if (result != VKFFT_SUCCESS)
+            throw OpenMMException("Error initializing VkFFT: "+to_string(result));
+        if (config.saveApplicationToString) {
+            // Write to a temporary file first, so that concurrent processes never read a
+            // partial file.  Its name is unique to this process and call.
+
+            string tempFile = cacheFile+"."+to_string((long long) getpid())+"."+to_string(tempFileCounter++)+".tmp";
+            ofstream file(tempFile.c_str(), ios::binary);
+            file.write((const char*) plan->app.saveApplicationString, plan->app.applicationStringSize);
+            file.close();
+            if (!file || rename(tempFile.c_str(), cacheFile.c_str()) != 0)
+                remove(tempFile.c_str());
+        }
+    }
+    if (cuEventCreate(&plan->lastUse, CU_EVENT_DISABLE_TIMING) != CUDA_SUCCESS)
+        throw OpenMMException("Error creating event for VkFFT");
+    if (cuEventRecord(plan->lastUse, 0) != CUDA_SUCCESS)
+        throw OpenMMException("Error recording event for VkFFT");
+    cache[key] = plan;
+    return plan;
 }
 
 void CudaVkFFT3D::execFFT(bool forward) {
-    VkFFTResult result = VkFFTAppend(app, forward ? -1 : 1, NULL);
+    // Wait for any previous use of the application on another stream, and then run it on this
+    // object's stream and buffers.
+
+    lock_guard<mutex> guard(plan->lock);
+    if (cuStreamWaitEvent(*stream, plan->lastUse, 0) != CUDA_SUCCESS)
+        throw OpenMMException("Error waiting for previous use of VkFFT");
+    plan->stream = *stream;
+    VkFFTLaunchParams launchParams = {};
+    launchParams.inputBuffer = (void**) &inputBuffer;
+    launchParams.buffer = (void**) &outputBuffer;
+    VkFFTResult result = VkFFTAppend(&plan->app, forward ? -1 : 1, &launchParams);
+    if (result != VKFFT_SUCCESS)
+        throw OpenMMException("Error executing VkFFT: "+to_string(result));
+    if (cuEventRecord(plan->lastUse, *stream) != CUDA_SUCCESS)
+        throw OpenMMException("Error recording use of VkFFT");
+}
+
+void CudaVkFFT3D::execConvolution() {
+    lock_guard<mutex> guard(convolutionPlan->lock);
+    if (cuStreamWaitEvent(*stream, convolutionPlan->lastUse, 0) != CUDA_SUCCESS)
+        throw OpenMMException("Error waiting for previous use of VkFFT");
+    convolutionPlan->stream = *stream;
+    VkFFTLaunchParams launchParams = {};
+    launchParams.inputBuffer = (void**) &inputBuffer;
+    launchParams.buffer = (void**) &outputBuffer;
+    launchParams.outputBuffer = (void**) &inputBuffer;
+    launchParams.kernel = (void**) &kernelBuffer;
+    VkFFTResult result = VkFFTAppend(&convolutionPlan->app, -1, &launchParams);
     if (result != VKFFT_SUCCESS)
         throw OpenMMException("Error executing VkFFT: "+to_string(result));
+    if (cuEventRecord(convolutionPlan->lastUse, *stream) != CUDA_SUCCESS)
+        throw OpenMMException("Error recording use of VkFFT");
 }
@@ -0,0 +1,29 @@
+/**
+ * Convert a non-negative float to the bits of the nearest half precision number.  Scaling by
+ * 2^-112 moves the exponent from the bias of float to that of half, so that the bits of a
+ * half are those of the scaled float shifted by 13.  Values too small to be normal halves
+ * become zero, and values too large become the largest half.
+ */
+inline __device__ unsigned int floatToHalfBits(float value) {
+    unsigned int bits = __float_as_uint(value*1.925929944387236e-34f);
+    return min((bits+0x1000u)>>13, 0x7bffu);
+}
+
+/**
+ * Pack the parameters that the direct space kernel reads for each particle into 8 bytes.
+ * The first word holds the subset of the particle, in the lowest bits of its charge when the
+ * charge is packed too, and the second word holds sigma in the low half and epsilon in the
+ * high half.
+ */
+extern "C" __global__ void packCompactParameters(int numAtoms, const real* __restrict__ charge, const float2* __restrict__ sigmaEpsilon,
+        const int* __restrict__ subsets, uint2* __restrict__ compactParams) {
+    for (int i = blockIdx.x*blockDim.x+threadIdx.x; i < numAtoms; i += blockDim.x*gridDim.x) {
+#ifdef PACK_CHARGES
+        unsigned int first = (__float_as_uint((float) charge[i]) & ~SUBSET_MASK) | subsets[i];
+#else
+        unsigned int first = subsets[i];
+#endif
+        float2 sigEps = sigmaEpsilon[i];
+        compactParams[i] = make_uint2(first, floatToHalfBits(sigEps.x) | (floatToHalfBits(sigEps.y)<<16));
+    }
+}
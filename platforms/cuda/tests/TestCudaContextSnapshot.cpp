@@ -0,0 +1,53 @@
+/* -------------------------------------------------------------------------- *
+ *                             OpenMM Laboratory                              *
+ *                             =================                              *
+ *                                                                            *
+ * A plugin for testing low-level code implementation for OpenMM.             *
+ *                                                                            *
+ * Copyright (c) 2023 Charlles Abreu                                          *
+ * https://github.com/craabreu/openmm-lab                                     *
+ * -------------------------------------------------------------------------- */
+
+#include "CudaOpenMMLabTests.h"
+#include "TestContextSnapshot.h"
+#include "SlicedNonbondedForce.h"
+
+void testLambdaStateSnapshot() {
+    // Two replicas exchange their snapshots, and each must then give the energy the other
+    // had, including the lambda state it had selected.
+
+    System system;
+    for (int i = 0; i < 4; i++)
+        system.addParticle(1.0);
+    system.setDefaultPeriodicBoxVectors(Vec3(3, 0, 0), Vec3(0, 3, 0), Vec3(0, 0, 3));
+    SlicedNonbondedForce* nonbonded = new SlicedNonbondedForce(2);
+    nonbonded->setNonbondedMethod(SlicedNonbondedForce::PME);
+    nonbonded->setCutoffDistance(1.0);
+    for (int i = 0; i < 4; i++) {
+        nonbonded->addParticle(i%2-0.5, 0.3, 1.0);
+        nonbonded->setParticleSubset(i, i/2);
+    }
+    nonbonded->addGlobalParameter("lambda", 1.0);
+    nonbonded->addScalingParameter("lambda", 0, 1, true, true);
+    nonbonded->addForeignScalingParameterSet({{"lambda", 0.3}});
+    system.addForce(nonbonded);
+    VerletIntegrator integrator1(0.001), integrator2(0.001);
+    Context context1(system, integrator1, platform), context2(system, integrator2, platform);
+    context1.setPositions(vector<Vec3>{Vec3(0, 0, 0), Vec3(0.5, 0, 0), Vec3(0, 0.5, 0), Vec3(0, 0, 0.5)});
+    context2.setPositions(vector<Vec3>{Vec3(0, 0, 0), Vec3(0.4, 0, 0), Vec3(0, 0.6, 0), Vec3(0, 0, 0.7)});
+    nonbonded->setLambdaStateInContext(context1, 0);
+    double energy1 = context1.getState(State::Energy).getPotentialEnergy();
+    double energy2 = context2.getState(State::Energy).getPotentialEnergy();
+    string snapshot1 = ContextSnapshot::saveToString(context1);
+    string snapshot2 = ContextSnapshot::saveToString(context2);
+    ContextSnapshot::loadFromString(context1, snapshot2);
+    ContextSnapshot::loadFromString(context2, snapshot1);
+    ASSERT_EQUAL(-1, nonbonded->getLambdaStateInContext(context1));
+    ASSERT_EQUAL(0, nonbonded->getLambdaStateInContext(context2));
+    ASSERT_EQUAL_TOL(energy2, context1.getState(State::Energy).getPotentialEnergy(), 1e-5);
+    ASSERT_EQUAL_TOL(energy1, context2.getState(State::Energy).getPotentialEnergy(), 1e-5);
+}
+
+void runPlatformTests() {
+    testLambdaStateSnapshot();
+}
@@ -11,5 +11,57 @@
 #include "CudaOpenMMLabTests.h"
 #include "TestExtendedCustomCVForce.h"
 
+void testDeviceArrays() {
+    // Only the variable that acts on all atoms has its forces stored densely.
+
+    const int numParticles = 20;
+    System system;
+    vector<Vec3> positions;
+    for (int i = 0; i < numParticles; i++) {
+        system.addParticle(1.0);
+        positions.push_back(Vec3(i%4, (i/4)%4, i/16)*0.5);
+    }
+    for (int compressed = 0; compressed < 2; compressed++) {
+        System system2 = system;
+        ExtendedCustomCVForce* cv = new ExtendedCustomCVForce("v1+v2");
+        CustomBondForce* v1 = new CustomBondForce("r^2");
+        v1->addBond(0, 1);
+        CustomNonbondedForce* v2 = new CustomNonbondedForce("1/r");
+        for (int i = 0; i < numParticles; i++)
+            v2->addParticle();
+        cv->addCollectiveVariable("v1", v1);
+        cv->addCollectiveVariable("v2", v2);
+        cv->setUseCompressedForces(compressed);
+        system2.addForce(cv);
+        VerletIntegrator integrator(1.0);
+        Context context(system2, integrator, platform);
+        context.setPositions(positions);
+        context.getState(State::Forces);
+        DeviceArray forces, atomIndices;
+        vector<int> variables;
+        cv->getDeviceArraysInContext(context, forces, atomIndices, variables);
+        ASSERT_EQUAL(1, variables.size());
+        ASSERT_EQUAL(1, variables[0]);
+        ASSERT(forces.pointer != 0);
+        ASSERT(atomIndices.pointer != 0);
+        ASSERT_EQUAL(3, forces.shape.size());
+        ASSERT_EQUAL(1, forces.shape[0]);
+        ASSERT_EQUAL(3, forces.shape[1]);
+        ASSERT(forces.shape[2] >= numParticles);
+        ASSERT_EQUAL(1, atomIndices.shape.size());
+        ASSERT_EQUAL(forces.shape[2], atomIndices.shape[0]);
+        ASSERT_EQUAL(string("<i4"), atomIndices.typestr);
+        if (compressed) {
+            ASSERT_EQUAL(string("<f4"), forces.typestr);
+            ASSERT_EQUAL(1.0, forces.scale);
+        }
+        else {
+            ASSERT_EQUAL(string("<i8"), forces.typestr);
+            ASSERT_EQUAL(1.0/0x100000000, forces.scale);
+        }
+    }
+}
+
 void runPlatformTests() {
+    testDeviceArrays();
 }
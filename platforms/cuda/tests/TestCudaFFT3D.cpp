@@ -9,7 +9,8 @@
  * -------------------------------------------------------------------------- */
 
 /**
- * This tests the CUDA implementation of FFT3D.
+ * This tests the CUDA implementation of FFT3D.  If the second argument is "benchmark",
+ * it measures the performance of the FFT backends instead.
  */
 
 #include "internal/CudaCuFFT3D.h"
@@ -20,8 +21,10 @@
 #include "openmm/cuda/CudaSort.h"
 #include "sfmt/SFMT.h"
 #include "openmm/System.h"
+#include <chrono>
 #include <cmath>
 #include <complex>
+#include <cstdio>
 #include <set>
 #ifdef _MSC_VER
   #define POCKETFFT_NO_VECTORS
@@ -142,10 +145,77 @@ void executeTests(int batch) {
     testTransform<FFT3D, Real, Real2>(true, 21, 25, 27, batch);
 }
 
+/**
+ * Measure the latency and the throughput of a transform, averaged over several pairs of
+ * forward and inverse transforms.  The flop count is the usual estimate of 5*N*log2(N) for
+ * a complex transform of N points, and half of that for a real one.
+ */
+template <class FFT3D, class Real2>
+void benchmarkTransform(CudaContext& context, const char* name, bool realToComplex, int size, int batch) {
+    const int numRepeats = 20;
+    int gridSize = size*size*size;
+    CudaArray grid1(context, gridSize*batch, sizeof(Real2), "grid1");
+    CudaArray grid2(context, gridSize*batch, sizeof(Real2), "grid2");
+    vector<Real2> values(gridSize*batch);
+    grid1.upload(values);
+    CUstream stream = context.getCurrentStream();
+    FFT3D fft(context, stream, size, size, size, batch, realToComplex, grid1, grid2);
+    fft.execFFT(true);
+    fft.execFFT(false);
+    cuStreamSynchronize(stream);
+    auto start = chrono::steady_clock::now();
+    for (int i = 0; i < numRepeats; i++) {
+        fft.execFFT(true);
+        fft.execFFT(false);
+    }
+    cuStreamSynchronize(stream);
+    double latency = chrono::duration<double>(chrono::steady_clock::now()-start).count()/(2*numRepeats);
+    double flops = (realToComplex ? 2.5 : 5.0)*gridSize*log2((double) gridSize)*batch;
+    printf("%-8s %-7s %5d %5d %4s %12.2f %10.2f\n", name, platform.getPropertyDefaultValue("CudaPrecision").c_str(),
+           size, batch, (realToComplex ? "R2C" : "C2C"), 1e6*latency, 1e-9*flops/latency);
+    fflush(stdout);
+}
+
+template <class Real2>
+void executeBenchmarks() {
+    System system;
+    system.addParticle(0.0);
+    CudaPlatform::PlatformData platformData(
+        NULL,
+        system,
+        "",
+        "true",
+        platform.getPropertyDefaultValue("CudaPrecision"),
+        "false",
+        platform.getPropertyDefaultValue(CudaPlatform::CudaTempDirectory()),
+        platform.getPropertyDefaultValue(CudaPlatform::CudaDisablePmeStream()),
+        "false",
+        1,
+        NULL
+    );
+    CudaContext& context = *platformData.contexts[0];
+    context.initialize();
+    context.setAsCurrent();
+    printf("%-8s %-7s %5s %5s %4s %12s %10s\n", "# FFT", "prec", "size", "batch", "type", "latency (us)", "GFLOP/s");
+    for (int size : {32, 48, 64, 80, 96, 128, 160, 192, 256})
+        for (int batch : {1, 2, 4})
+            for (bool realToComplex : {false, true}) {
+                benchmarkTransform<CudaCuFFT3D, Real2>(context, "cuFFT", realToComplex, size, batch);
+                benchmarkTransform<CudaVkFFT3D, Real2>(context, "VkFFT", realToComplex, size, batch);
+            }
+}
+
 int main(int argc, char* argv[]) {
     try {
         if (argc > 1)
             platform.setPropertyDefaultValue("CudaPrecision", string(argv[1]));
+        if (argc > 2 && string(argv[2]) == "benchmark") {
+            if (platform.getPropertyDefaultValue("CudaPrecision") == "double")
+                executeBenchmarks<double2>();
+            else
+                executeBenchmarks<float2>();
+            return 0;
+        }
         if (platform.getPropertyDefaultValue("CudaPrecision") == "double") {
             executeTests<CudaCuFFT3D, double, double2>(1);
             executeTests<CudaCuFFT3D, double, double2>(2);
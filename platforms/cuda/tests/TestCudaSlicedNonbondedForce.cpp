@@ -12,6 +12,9 @@
 #include "TestSlicedNonbondedForce.h"
 #include "openmm/NonbondedForce.h"
 // #include <cuda.h>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
 #include <string>
 
 void testParallelComputation(SlicedNonbondedForce::NonbondedMethod method) {
@@ -223,6 +226,567 @@ void testUseCuFFT() {
     assertForces(state1, state2, tol);
 }
 
+void testSinglePrecisionPmeGrids() {
+    // The option only has an effect in double precision, so both Contexts are created in
+    // double precision whatever precision the tests run in.
+
+    const int numMolecules = 100;
+    const int numParticles = numMolecules*2;
+    const double cutoff = 3.5;
+    const double L = 10.0;
+    const double tol = 1e-4;
+    map<string, string> doublePrecision = {{"Precision", "double"}};
+
+    System system1, system2;
+    for (int i = 0; i < numParticles; i++) {
+        system1.addParticle(1.0);
+        system2.addParticle(1.0);
+    }
+    system1.setDefaultPeriodicBoxVectors(Vec3(L, 0, 0), Vec3(0, L, 0), Vec3(0, 0, L));
+    system2.setDefaultPeriodicBoxVectors(Vec3(L, 0, 0), Vec3(0, L, 0), Vec3(0, 0, L));
+
+    SlicedNonbondedForce* nonbonded1 = new SlicedNonbondedForce(2);
+    nonbonded1->setNonbondedMethod(nonbonded1->LJPME);
+    nonbonded1->setCutoffDistance(cutoff);
+    nonbonded1->setEwaldErrorTolerance(1e-4);
+
+    vector<Vec3> positions(numParticles);
+    OpenMM_SFMT::SFMT sfmt;
+    init_gen_rand(0, sfmt);
+    for (int i = 0; i < numParticles; i++) {
+        positions[i] = Vec3(genrand_real2(sfmt), genrand_real2(sfmt), genrand_real2(sfmt))*L;
+        nonbonded1->addParticle(i%2 == 0 ? 1.0 : -1.0, 0.3, 1.0);
+        if (i%4 < 2)
+            nonbonded1->setParticleSubset(i, 1);
+    }
+    nonbonded1->addGlobalParameter("lambda", 0.5);
+    nonbonded1->addScalingParameter("lambda", 0, 1, true, true);
+
+    SlicedNonbondedForce* nonbonded2 = new SlicedNonbondedForce(*nonbonded1, 2);
+    for (int i = 0; i < numParticles; i++)
+        nonbonded2->setParticleSubset(i, nonbonded1->getParticleSubset(i));
+    nonbonded2->addScalingParameter("lambda", 0, 1, true, true);
+    nonbonded2->setUseSinglePrecisionPmeGrids(true);
+    ASSERT(nonbonded2->getUseSinglePrecisionPmeGrids());
+
+    system1.addForce(nonbonded1);
+    system2.addForce(nonbonded2);
+
+    VerletIntegrator integrator1(0.01);
+    Context context1(system1, integrator1, platform, doublePrecision);
+    context1.setPositions(positions);
+
+    VerletIntegrator integrator2(0.01);
+    Context context2(system2, integrator2, platform, doublePrecision);
+    context2.setPositions(positions);
+
+    State state1 = context1.getState(State::Energy | State::Forces);
+    State state2 = context2.getState(State::Energy | State::Forces);
+
+    // The results must agree to single precision, but not to double precision, which
+    // would mean that the grids were not in single precision.
+
+    assertEnergy(state1, state2, tol);
+    assertForces(state1, state2, tol);
+    double difference = abs(state1.getPotentialEnergy()-state2.getPotentialEnergy());
+    ASSERT(difference > 1e-10*abs(state1.getPotentialEnergy()));
+}
+
+void testFFTAutotuning() {
+    const int numParticles = 200;
+    const double L = 4.0;
+    double tol = platform.getPropertyDefaultValue("Precision") == "double" ? 1e-4 : 1e-3;
+#ifndef _WIN32
+    const char* tuningFile = "TestCudaFFTAutotuning.txt";
+    remove(tuningFile);
+    setenv("OPENMMLAB_FFT_TUNING_FILE", tuningFile, 1);
+#endif
+
+    System system;
+    for (int i = 0; i < numParticles; i++)
+        system.addParticle(1.0);
+    system.setDefaultPeriodicBoxVectors(Vec3(L, 0, 0), Vec3(0, L, 0), Vec3(0, 0, L));
+    SlicedNonbondedForce* nonbonded = new SlicedNonbondedForce(2);
+    nonbonded->setNonbondedMethod(SlicedNonbondedForce::LJPME);
+    nonbonded->setCutoffDistance(1.0);
+    OpenMM_SFMT::SFMT sfmt;
+    init_gen_rand(0, sfmt);
+    vector<Vec3> positions(numParticles);
+    for (int i = 0; i < numParticles; i++) {
+        nonbonded->addParticle(i%2-0.5, 0.3, 1.0);
+        nonbonded->setParticleSubset(i, i%4 == 0 ? 1 : 0);
+        positions[i] = Vec3(L*genrand_real2(sfmt), L*genrand_real2(sfmt), L*genrand_real2(sfmt));
+    }
+    system.addForce(nonbonded);
+    ASSERT(!nonbonded->getUseFFTAutotuning());
+
+    VerletIntegrator integrator1(0.001);
+    Context context1(system, integrator1, platform);
+    context1.setPositions(positions);
+    State state1 = context1.getState(State::Energy | State::Forces);
+
+    // The first context times both libraries, and the second one reads its choice from the table.
+
+    nonbonded->setUseFFTAutotuning(true);
+    ASSERT(nonbonded->getUseFFTAutotuning());
+    for (int k = 0; k < 2; k++) {
+        VerletIntegrator integrator2(0.001);
+        Context context2(system, integrator2, platform);
+        context2.setPositions(positions);
+        State state2 = context2.getState(State::Energy | State::Forces);
+        assertEnergy(state1, state2, tol);
+        assertForces(state1, state2, tol);
+    }
+#ifndef _WIN32
+    remove(tuningFile);
+    unsetenv("OPENMMLAB_FFT_TUNING_FILE");
+#endif
+}
+
+void testTunedPmeGridSizes() {
+    const int numParticles = 200;
+    const double L = 4.0;
+    const double tol = 2e-3; // Grids of different sizes only agree within the Ewald error tolerance.
+#ifndef _WIN32
+    const char* tuningFile = "TestCudaPmeGridTuning.txt";
+    remove(tuningFile);
+    setenv("OPENMMLAB_FFT_TUNING_FILE", tuningFile, 1);
+#endif
+
+    System system;
+    for (int i = 0; i < numParticles; i++)
+        system.addParticle(1.0);
+    system.setDefaultPeriodicBoxVectors(Vec3(L, 0, 0), Vec3(0, L, 0), Vec3(0, 0, L));
+    SlicedNonbondedForce* nonbonded = new SlicedNonbondedForce(2);
+    nonbonded->setNonbondedMethod(SlicedNonbondedForce::LJPME);
+    nonbonded->setCutoffDistance(1.0);
+    OpenMM_SFMT::SFMT sfmt;
+    init_gen_rand(0, sfmt);
+    vector<Vec3> positions(numParticles);
+    for (int i = 0; i < numParticles; i++) {
+        nonbonded->addParticle(i%2-0.5, 0.3, 1.0);
+        nonbonded->setParticleSubset(i, i%4 == 0 ? 1 : 0);
+        positions[i] = Vec3(L*genrand_real2(sfmt), L*genrand_real2(sfmt), L*genrand_real2(sfmt));
+    }
+    system.addForce(nonbonded);
+    ASSERT(!nonbonded->getUseTunedPmeGridSizes());
+
+    VerletIntegrator integrator1(0.001);
+    Context context1(system, integrator1, platform);
+    context1.setPositions(positions);
+    State state1 = context1.getState(State::Energy | State::Forces);
+    double alpha;
+    int size1[3], size2[3];
+    nonbonded->getPMEParametersInContext(context1, alpha, size1[0], size1[1], size1[2]);
+
+    // The tuned grids are at least as large as the default ones, and at most 10% larger.  The
+    // first context times the candidates, and the second one reads its choice from the table.
+
+    nonbonded->setUseTunedPmeGridSizes(true);
+    ASSERT(nonbonded->getUseTunedPmeGridSizes());
+    for (int k = 0; k < 2; k++) {
+        VerletIntegrator integrator2(0.001);
+        Context context2(system, integrator2, platform);
+        context2.setPositions(positions);
+        State state2 = context2.getState(State::Energy | State::Forces);
+        assertEnergy(state1, state2, tol);
+        assertForces(state1, state2, tol);
+        nonbonded->getPMEParametersInContext(context2, alpha, size2[0], size2[1], size2[2]);
+        for (int i = 0; i < 3; i++) {
+            ASSERT(size2[i] >= size1[i]);
+            ASSERT(size2[i] <= 1.1*size1[i]);
+        }
+    }
+#ifndef _WIN32
+    remove(tuningFile);
+    unsetenv("OPENMMLAB_FFT_TUNING_FILE");
+#endif
+}
+
+void testFFTConvolution() {
+    const int numParticles = 200;
+    const double L = 4.0;
+    double tol = platform.getPropertyDefaultValue("Precision") == "double" ? 1e-4 : 1e-3;
+    System system;
+    for (int i = 0; i < numParticles; i++)
+        system.addParticle(1.0);
+    system.setDefaultPeriodicBoxVectors(Vec3(L, 0, 0), Vec3(0, L, 0), Vec3(0, 0, L));
+    SlicedNonbondedForce* nonbonded = new SlicedNonbondedForce(2);
+    nonbonded->setNonbondedMethod(SlicedNonbondedForce::LJPME);
+    nonbonded->setCutoffDistance(1.0);
+    OpenMM_SFMT::SFMT sfmt;
+    init_gen_rand(0, sfmt);
+    vector<Vec3> positions(numParticles);
+    for (int i = 0; i < numParticles; i++) {
+        nonbonded->addParticle(i%2-0.5, 0.3, 1.0);
+        nonbonded->setParticleSubset(i, i%4 == 0 ? 1 : 0);
+        positions[i] = Vec3(L*genrand_real2(sfmt), L*genrand_real2(sfmt), L*genrand_real2(sfmt));
+    }
+    nonbonded->addGlobalParameter("lambda", 0.5);
+    nonbonded->addScalingParameter("lambda", 0, 1, true, true);
+    system.addForce(nonbonded);
+    ASSERT(!nonbonded->getUseFFTConvolution());
+
+    VerletIntegrator integrator1(0.001);
+    Context context1(system, integrator1, platform);
+    context1.setPositions(positions);
+    State state1 = context1.getState(State::Forces);
+
+    nonbonded->setUseFFTConvolution(true);
+    ASSERT(nonbonded->getUseFFTConvolution());
+    VerletIntegrator integrator2(0.001);
+    Context context2(system, integrator2, platform);
+    context2.setPositions(positions);
+    State state2 = context2.getState(State::Forces);
+    assertForces(state1, state2, tol);
+
+    // The convolution factors must follow changes of the box.
+
+    Vec3 a(0.95*L, 0, 0), b(0, 1.05*L, 0), c(0, 0, L);
+    context1.setPeriodicBoxVectors(a, b, c);
+    context2.setPeriodicBoxVectors(a, b, c);
+    state1 = context1.getState(State::Forces);
+    state2 = context2.getState(State::Forces);
+    assertForces(state1, state2, tol);
+}
+
+void testSortFreePme() {
+    const int numParticles = 200;
+    const double L = 4.0;
+    double tol = platform.getPropertyDefaultValue("Precision") == "double" ? 1e-5 : 1e-3;
+    System system;
+    for (int i = 0; i < numParticles; i++)
+        system.addParticle(1.0);
+    system.setDefaultPeriodicBoxVectors(Vec3(L, 0, 0), Vec3(0, L, 0), Vec3(0, 0, L));
+    SlicedNonbondedForce* nonbonded = new SlicedNonbondedForce(2);
+    nonbonded->setNonbondedMethod(SlicedNonbondedForce::LJPME);
+    nonbonded->setCutoffDistance(1.0);
+    OpenMM_SFMT::SFMT sfmt;
+    init_gen_rand(0, sfmt);
+    vector<Vec3> positions(numParticles);
+    for (int i = 0; i < numParticles; i++) {
+        nonbonded->addParticle(i%2-0.5, 0.3, 1.0);
+        nonbonded->setParticleSubset(i, i%4 == 0 ? 1 : 0);
+        positions[i] = Vec3(L*genrand_real2(sfmt), L*genrand_real2(sfmt), L*genrand_real2(sfmt));
+    }
+    nonbonded->addGlobalParameter("lambda", 0.5);
+    nonbonded->addScalingParameter("lambda", 0, 1, true, true);
+    system.addForce(nonbonded);
+    ASSERT(!nonbonded->getUseSortFreePme());
+
+    VerletIntegrator integrator1(0.001);
+    Context context1(system, integrator1, platform);
+    context1.setPositions(positions);
+    State state1 = context1.getState(State::Forces | State::Energy);
+
+    nonbonded->setUseSortFreePme(true);
+    ASSERT(nonbonded->getUseSortFreePme());
+    VerletIntegrator integrator2(0.001);
+    Context context2(system, integrator2, platform);
+    context2.setPositions(positions);
+    State state2 = context2.getState(State::Forces | State::Energy);
+    assertForces(state1, state2, tol);
+    ASSERT_EQUAL_TOL(state1.getPotentialEnergy(), state2.getPotentialEnergy(), tol);
+}
+
+void testCpuPme() {
+    const int numParticles = 200;
+    const double L = 4.0;
+    double tol = platform.getPropertyDefaultValue("Precision") == "double" ? 1e-5 : 1e-3;
+    System system;
+    for (int i = 0; i < numParticles; i++)
+        system.addParticle(1.0);
+    system.setDefaultPeriodicBoxVectors(Vec3(L, 0, 0), Vec3(0, L, 0), Vec3(0, 0, L));
+    SlicedNonbondedForce* nonbonded = new SlicedNonbondedForce(2);
+    nonbonded->setNonbondedMethod(SlicedNonbondedForce::LJPME);
+    nonbonded->setCutoffDistance(1.0);
+    OpenMM_SFMT::SFMT sfmt;
+    init_gen_rand(0, sfmt);
+    vector<Vec3> positions(numParticles);
+    for (int i = 0; i < numParticles; i++) {
+        nonbonded->addParticle(i%2-0.5, 0.3, 1.0);
+        nonbonded->setParticleSubset(i, i%4 == 0 ? 1 : 0);
+        positions[i] = Vec3(L*genrand_real2(sfmt), L*genrand_real2(sfmt), L*genrand_real2(sfmt));
+    }
+    nonbonded->addGlobalParameter("lambda", 0.5);
+    nonbonded->addScalingParameter("lambda", 0, 1, true, true);
+    nonbonded->addScalingParameterDerivative("lambda");
+    system.addForce(nonbonded);
+    ASSERT(!nonbonded->getUseCpuPme());
+
+    VerletIntegrator integrator1(0.001);
+    Context context1(system, integrator1, platform);
+    context1.setPositions(positions);
+    State state1 = context1.getState(State::Forces | State::Energy | State::ParameterDerivatives);
+
+    nonbonded->setUseCpuPme(true);
+    ASSERT(nonbonded->getUseCpuPme());
+    VerletIntegrator integrator2(0.001);
+    Context context2(system, integrator2, platform);
+    context2.setPositions(positions);
+    for (int step = 0; step < 2; step++) {
+        State state2 = context2.getState(State::Forces | State::Energy | State::ParameterDerivatives);
+        assertForces(state1, state2, tol);
+        ASSERT_EQUAL_TOL(state1.getPotentialEnergy(), state2.getPotentialEnergy(), tol);
+        ASSERT_EQUAL_TOL(state1.getEnergyParameterDerivatives().at("lambda"), state2.getEnergyParameterDerivatives().at("lambda"), tol);
+    }
+}
+
+void testCudaGraphs() {
+    const int numParticles = 200;
+    const double L = 4.0;
+    double tol = platform.getPropertyDefaultValue("Precision") == "double" ? 1e-5 : 1e-3;
+    System system;
+    for (int i = 0; i < numParticles; i++)
+        system.addParticle(1.0);
+    system.setDefaultPeriodicBoxVectors(Vec3(L, 0, 0), Vec3(0, L, 0), Vec3(0, 0, L));
+    SlicedNonbondedForce* nonbonded = new SlicedNonbondedForce(2);
+    nonbonded->setNonbondedMethod(SlicedNonbondedForce::LJPME);
+    nonbonded->setCutoffDistance(1.0);
+    OpenMM_SFMT::SFMT sfmt;
+    init_gen_rand(0, sfmt);
+    vector<Vec3> positions(numParticles);
+    for (int i = 0; i < numParticles; i++) {
+        nonbonded->addParticle(i%2-0.5, 0.3, 1.0);
+        nonbonded->setParticleSubset(i, i%4 == 0 ? 1 : 0);
+        positions[i] = Vec3(L*genrand_real2(sfmt), L*genrand_real2(sfmt), L*genrand_real2(sfmt));
+    }
+    nonbonded->addGlobalParameter("lambda", 0.5);
+    nonbonded->addScalingParameter("lambda", 0, 1, true, true);
+    system.addForce(nonbonded);
+    ASSERT(!nonbonded->getUseCudaGraphs());
+
+    // Graphs are not used with VkFFT, so both Contexts use cuFFT.
+
+    nonbonded->setUseCudaFFT(true);
+
+    VerletIntegrator integrator1(0.001);
+    Context context1(system, integrator1, platform);
+    nonbonded->setUseCudaGraphs(true);
+    ASSERT(nonbonded->getUseCudaGraphs());
+    VerletIntegrator integrator2(0.001);
+    Context context2(system, integrator2, platform);
+
+    // The first evaluation of each kind runs without a graph, the second one captures it, and
+    // the later ones replay it, also after the positions, the scaling parameter, and the box
+    // have changed.
+
+    for (int step = 0; step < 4; step++) {
+        if (step == 2) {
+            for (int i = 0; i < numParticles; i++)
+                positions[i] += Vec3(0.01, -0.02, 0.03);
+            context1.setParameter("lambda", 0.8);
+            context2.setParameter("lambda", 0.8);
+        }
+        if (step == 3) {
+            Vec3 a(0.95*L, 0, 0), b(0, 1.05*L, 0), c(0, 0, L);
+            context1.setPeriodicBoxVectors(a, b, c);
+            context2.setPeriodicBoxVectors(a, b, c);
+        }
+        context1.setPositions(positions);
+        context2.setPositions(positions);
+        State state1 = context1.getState(State::Forces | State::Energy);
+        State state2 = context2.getState(State::Forces | State::Energy);
+        assertForces(state1, state2, tol);
+        ASSERT_EQUAL_TOL(state1.getPotentialEnergy(), state2.getPotentialEnergy(), tol);
+        state1 = context1.getState(State::Forces);
+        state2 = context2.getState(State::Forces);
+        assertForces(state1, state2, tol);
+    }
+}
+
+void testStageProfiling() {
+    const int numParticles = 200;
+    const double L = 4.0;
+    System system;
+    for (int i = 0; i < numParticles; i++)
+        system.addParticle(1.0);
+    system.setDefaultPeriodicBoxVectors(Vec3(L, 0, 0), Vec3(0, L, 0), Vec3(0, 0, L));
+    SlicedNonbondedForce* nonbonded = new SlicedNonbondedForce(2);
+    nonbonded->setNonbondedMethod(SlicedNonbondedForce::LJPME);
+    nonbonded->setCutoffDistance(1.0);
+    OpenMM_SFMT::SFMT sfmt;
+    init_gen_rand(0, sfmt);
+    vector<Vec3> positions(numParticles);
+    for (int i = 0; i < numParticles; i++) {
+        nonbonded->addParticle(i%2-0.5, 0.3, 1.0);
+        nonbonded->setParticleSubset(i, i%4 == 0 ? 1 : 0);
+        positions[i] = Vec3(L*genrand_real2(sfmt), L*genrand_real2(sfmt), L*genrand_real2(sfmt));
+    }
+    system.addForce(nonbonded);
+
+    // Profiling is disabled by default.
+
+    VerletIntegrator integrator1(0.001);
+    Context context1(system, integrator1, platform);
+    context1.setPositions(positions);
+    context1.getState(State::Forces);
+    ASSERT(nonbonded->getStageTimesInContext(context1).empty());
+#ifndef _WIN32
+    setenv("OPENMMLAB_PROFILING", "1", 1);
+    VerletIntegrator integrator2(0.001);
+    Context context2(system, integrator2, platform);
+    unsetenv("OPENMMLAB_PROFILING");
+    context2.setPositions(positions);
+    for (int i = 0; i < 3; i++)
+        context2.getState(State::Forces);
+    map<string, double> times = nonbonded->getStageTimesInContext(context2);
+    const string stages[] = {"computeParameters", "pmeGridIndex", "pmeSort", "pmeSpreadCharge", "pmeForwardFFT", "pmeConvolution",
+                             "pmeInverseFFT", "pmeInterpolateForce", "ljpmeSpreadCharge", "ljpmeInterpolateForce", "init:kernel", "init:fft",
+                             "init:reciprocalKernels"};
+    for (const string& stage : stages) {
+        ASSERT(times.find(stage) != times.end());
+        ASSERT(times[stage] >= 0.0);
+    }
+    nonbonded->resetStageTimesInContext(context2);
+    ASSERT(nonbonded->getStageTimesInContext(context2).empty());
+#endif
+}
+
+void testLambdaStates() {
+    const int numParticles = 200;
+    const double L = 4.0;
+    const double tol = 1e-5;
+    System system;
+    for (int i = 0; i < numParticles; i++)
+        system.addParticle(1.0);
+    system.setDefaultPeriodicBoxVectors(Vec3(L, 0, 0), Vec3(0, L, 0), Vec3(0, 0, L));
+    SlicedNonbondedForce* nonbonded = new SlicedNonbondedForce(2);
+    nonbonded->setNonbondedMethod(SlicedNonbondedForce::LJPME);
+    nonbonded->setCutoffDistance(1.0);
+    OpenMM_SFMT::SFMT sfmt;
+    init_gen_rand(0, sfmt);
+    vector<Vec3> positions(numParticles);
+    for (int i = 0; i < numParticles; i++) {
+        nonbonded->addParticle(i%2-0.5, 0.3, 1.0);
+        nonbonded->setParticleSubset(i, i%4 == 0 ? 1 : 0);
+        positions[i] = Vec3(L*genrand_real2(sfmt), L*genrand_real2(sfmt), L*genrand_real2(sfmt));
+    }
+    nonbonded->addGlobalParameter("lambdaC", 1.0);
+    nonbonded->addGlobalParameter("lambdaLJ", 1.0);
+    nonbonded->addScalingParameter("lambdaC", 0, 1, true, false);
+    nonbonded->addScalingParameter("lambdaLJ", 0, 1, false, true);
+    nonbonded->addScalingParameter("lambdaC", 1, 1, true, false);
+    nonbonded->addGlobalParameter("chargeShift", 0.0);
+    for (int i = 0; i < numParticles; i += 4)
+        nonbonded->addParticleParameterOffset("chargeShift", i, 0.5, 0.0, 0.0);
+    nonbonded->addForeignScalingParameterSet({{"lambdaC", 0.2}, {"lambdaLJ", 0.7}});
+    nonbonded->addForeignScalingParameterSet({{"lambdaC", 0.6}});
+    system.addForce(nonbonded);
+    VerletIntegrator integrator1(0.001);
+    Context context1(system, integrator1, platform);
+    VerletIntegrator integrator2(0.001);
+    Context context2(system, integrator2, platform);
+    context1.setPositions(positions);
+    context2.setPositions(positions);
+    ASSERT_EQUAL(-1, nonbonded->getLambdaStateInContext(context1));
+
+    // Selecting a state must be equivalent to setting the scaling parameters, with those that
+    // are not in the set taking their default values.
+
+    auto compare = [&] (double lambdaC, double lambdaLJ) {
+        context2.setParameter("lambdaC", lambdaC);
+        context2.setParameter("lambdaLJ", lambdaLJ);
+        State state1 = context1.getState(State::Forces | State::Energy);
+        State state2 = context2.getState(State::Forces | State::Energy);
+        assertForces(state1, state2, tol);
+        ASSERT_EQUAL_TOL(state2.getPotentialEnergy(), state1.getPotentialEnergy(), tol);
+    };
+    context1.setParameter("lambdaC", 0.9);
+    nonbonded->setLambdaStateInContext(context1, 0);
+    ASSERT_EQUAL(0, nonbonded->getLambdaStateInContext(context1));
+    compare(0.2, 0.7);
+    nonbonded->setLambdaStateInContext(context1, 1);
+    compare(0.6, 1.0);
+    nonbonded->setLambdaStateInContext(context1, 0);
+    compare(0.2, 0.7);
+
+    // The self energies of the states must follow changes of the parameter offsets.
+
+    context1.setParameter("chargeShift", 0.3);
+    context2.setParameter("chargeShift", 0.3);
+    compare(0.2, 0.7);
+    nonbonded->setLambdaStateInContext(context1, 1);
+    compare(0.6, 1.0);
+
+    // Returning to the Context parameters makes the force follow them again.
+
+    nonbonded->setLambdaStateInContext(context1, -1);
+    ASSERT_EQUAL(-1, nonbonded->getLambdaStateInContext(context1));
+    compare(0.9, 1.0);
+
+    // Changes to the foreign sets take effect when the parameters are updated, and a state
+    // that is still selected follows them.
+
+    nonbonded->setLambdaStateInContext(context1, 1);
+    nonbonded->setForeignScalingParameterSet(1, {{"lambdaC", 0.3}, {"lambdaLJ", 0.4}});
+    nonbonded->updateParametersInContext(context1);
+    ASSERT_EQUAL(1, nonbonded->getLambdaStateInContext(context1));
+    compare(0.3, 0.4);
+    bool thrown = false;
+    try {
+        nonbonded->setLambdaStateInContext(context1, 2);
+    }
+    catch (const OpenMMException& e) {
+        thrown = true;
+    }
+    ASSERT(thrown);
+}
+
+void testCompactParameters() {
+    // Half precision values of sigma and epsilon make the Lennard-Jones interactions
+    // slightly less accurate, and the subsets must still be told apart.
+
+    const int numParticles = 300;
+    const double L = 4.0;
+    double tol = platform.getPropertyDefaultValue("Precision") == "double" ? 1e-5 : 5e-3;
+    System system;
+    for (int i = 0; i < numParticles; i++)
+        system.addParticle(1.0);
+    system.setDefaultPeriodicBoxVectors(Vec3(L, 0, 0), Vec3(0, L, 0), Vec3(0, 0, L));
+    SlicedNonbondedForce* nonbonded = new SlicedNonbondedForce(3);
+    nonbonded->setNonbondedMethod(SlicedNonbondedForce::PME);
+    nonbonded->setCutoffDistance(1.0);
+    OpenMM_SFMT::SFMT sfmt;
+    init_gen_rand(0, sfmt);
+    vector<Vec3> positions(numParticles);
+    for (int i = 0; i < numParticles; i++) {
+        nonbonded->addParticle(0.8*(i%2)-0.4, 0.25+0.1*genrand_real2(sfmt), 0.5+genrand_real2(sfmt));
+        nonbonded->setParticleSubset(i, i%3);
+        positions[i] = Vec3(L*genrand_real2(sfmt), L*genrand_real2(sfmt), L*genrand_real2(sfmt));
+    }
+    nonbonded->addGlobalParameter("lambda1", 0.5);
+    nonbonded->addGlobalParameter("lambda2", 0.2);
+    nonbonded->addScalingParameter("lambda1", 0, 1, true, true);
+    nonbonded->addScalingParameter("lambda2", 1, 2, true, false);
+    nonbonded->addParticleParameterOffset("lambda1", 0, 0.1, 0.01, 0.2);
+    system.addForce(nonbonded);
+    ASSERT(!nonbonded->getUseCompactParameters());
+
+    VerletIntegrator integrator1(0.001);
+    Context context1(system, integrator1, platform);
+    context1.setPositions(positions);
+    State state1 = context1.getState(State::Forces | State::Energy);
+
+    nonbonded->setUseCompactParameters(true);
+    ASSERT(nonbonded->getUseCompactParameters());
+    VerletIntegrator integrator2(0.001);
+    Context context2(system, integrator2, platform);
+    context2.setPositions(positions);
+    State state2 = context2.getState(State::Forces | State::Energy);
+    assertForces(state1, state2, tol);
+    ASSERT_EQUAL_TOL(state1.getPotentialEnergy(), state2.getPotentialEnergy(), tol);
+
+    // The packed parameters follow changes of the global parameters.
+
+    context1.setParameter("lambda1", 0.8);
+    context2.setParameter("lambda1", 0.8);
+    state1 = context1.getState(State::Forces | State::Energy);
+    state2 = context2.getState(State::Forces | State::Energy);
+    assertForces(state1, state2, tol);
+    ASSERT_EQUAL_TOL(state1.getPotentialEnergy(), state2.getPotentialEnergy(), tol);
+}
+
 void runPlatformTests() {
     testParallelComputation(SlicedNonbondedForce::NoCutoff);
     testParallelComputation(SlicedNonbondedForce::Ewald);
@@ -231,6 +795,16 @@ void runPlatformTests() {
     testReordering();
     testDeterministicForces();
     testUseCuFFT();
+    testSinglePrecisionPmeGrids();
+    testFFTAutotuning();
+    testTunedPmeGridSizes();
+    testFFTConvolution();
+    testCudaGraphs();
+    testSortFreePme();
+    testCpuPme();
+    testCompactParameters();
+    testStageProfiling();
+    testLambdaStates();
     // if (canRunHugeTest())
     //     testHugeSystem();
 }
@@ -13,11 +13,16 @@
 
 #include "OpenMMLabKernels.h"
 #include "CommonOpenMMLabKernels.h"
+#include "internal/OpenCLProgramCache.h"
 #include "internal/OpenCLVkFFT3D.h"
+#include "internal/SlicedNonbondedForceImpl.h"
 #include "openmm/internal/ContextImpl.h"
 #include "openmm/opencl/OpenCLContext.h"
 #include "openmm/opencl/OpenCLArray.h"
+#include "openmm/opencl/OpenCLProgram.h"
 #include "openmm/opencl/OpenCLSort.h"
+#include <chrono>
+#include <map>
 #include <vector>
 #include <algorithm>
 
@@ -30,7 +35,8 @@ class OpenCLCalcSlicedNonbondedForceKernel : public CalcSlicedNonbondedForceKern
 public:
     OpenCLCalcSlicedNonbondedForceKernel(std::string name, const Platform& platform, OpenCLContext& cl, const System& system) :
             CalcSlicedNonbondedForceKernel(name, platform), hasInitializedKernel(false), cl(cl), sort(NULL),
-            fft(NULL), dispersionFft(NULL), usePmeQueue(false) {};
+            fft(NULL), dispersionFft(NULL), usePmeQueue(false), useFixedSliceLambdas(false),
+            profileStages(isProfilingEnabled()) {};
     ~OpenCLCalcSlicedNonbondedForceKernel();
     /**
      * Initialize the kernel.
@@ -57,6 +63,45 @@ public:
      * @param force      the SlicedNonbondedForce to copy the parameters from
      */
     void copyParametersToContext(ContextImpl& context, const SlicedNonbondedForce& force);
+    /**
+     * Compute the Coulomb and Lennard-Jones energies of every slice, not multiplied by the
+     * scaling parameters.
+     *
+     * @param context            the context in which to execute this kernel
+     * @param includeDirect      true if direct space interactions should be included
+     * @param includeReciprocal  true if reciprocal space interactions should be included
+     * @param coulombEnergies    on exit, the Coulomb energy of each slice
+     * @param ljEnergies         on exit, the Lennard-Jones energy of each slice
+     */
+    void getSliceEnergies(ContextImpl& context, bool includeDirect, bool includeReciprocal, vector<double>& coulombEnergies, vector<double>& ljEnergies);
+    /**
+     * Compute the slice energies of a force that is evaluated by one or more kernels, one per
+     * device.  The energy is linear in the scaling parameters, so the energy of each slice is
+     * the energy obtained with only that slice switched on minus the energy obtained with all
+     * slices switched off.  The latter also removes the energies of other forces that belong
+     * to the same force groups.  If reciprocal space has a force group of its own, its slice
+     * energies are read directly from the per-slice energy buffers after a single evaluation.
+     */
+    static void computeSliceEnergies(ContextImpl& context, const vector<OpenCLCalcSlicedNonbondedForceKernel*>& kernels,
+                                     bool includeDirect, bool includeReciprocal, vector<double>& coulombEnergies, vector<double>& ljEnergies);
+    /**
+     * Compute the derivatives of the energy with respect to the scaling parameters for which
+     * derivatives were requested.
+     *
+     * @param context            the context in which to execute this kernel
+     * @param includeDirect      true if direct space interactions should be included
+     * @param includeReciprocal  true if reciprocal space interactions should be included
+     * @param derivatives        on exit, the derivative with respect to each parameter
+     */
+    void getScalingParameterDerivatives(ContextImpl& context, bool includeDirect, bool includeReciprocal, map<string, double>& derivatives);
+    /**
+     * Compute the scaling parameter derivatives of a force that is evaluated by one or more
+     * kernels, one per device.  Only the slices that have a requested derivative are switched
+     * on, so the direct space kernels skip the pairs of all other slices.  Derivatives with
+     * respect to the same parameters from other forces in the same force groups are included.
+     */
+    static void computeScalingParameterDerivatives(ContextImpl& context, const vector<OpenCLCalcSlicedNonbondedForceKernel*>& kernels,
+                                                   bool includeDirect, bool includeReciprocal, map<string, double>& derivatives);
     /**
      * Get the parameters being used for PME.
      *
@@ -75,6 +120,16 @@ public:
      * @param nz      the number of grid points along the Z axis
      */
     void getLJPMEParameters(double& alpha, int& nx, int& ny, int& nz) const;
+    /**
+     * Get the time spent in each stage of the computation, in milliseconds.
+     *
+     * @param times    on exit, the accumulated time of each stage, keyed by stage name
+     */
+    void getStageTimes(std::map<std::string, double>& times);
+    /**
+     * Reset the accumulated times of all stages to zero.
+     */
+    void resetStageTimes();
 private:
     class SortTrait : public OpenCLSort::SortTrait {
         int getDataSize() const {return 8;}
@@ -97,6 +152,7 @@ private:
     bool hasInitializedKernel;
     OpenCLArray charges;
     OpenCLArray sigmaEpsilon;
+    OpenCLArray particleC6;
     OpenCLArray exceptionParams;
     OpenCLArray exclusionAtoms;
     OpenCLArray exclusionParams;
@@ -124,8 +180,8 @@ private:
     OpenCLSort* sort;
     cl::CommandQueue pmeQueue;
     cl::Event pmeSyncEvent;
-    OpenCLVkFFT3D* fft;
-    OpenCLVkFFT3D* dispersionFft;
+    CommonFFT3D* fft;
+    CommonFFT3D* dispersionFft;
     AddEnergyPostComputation* addEnergy;
     cl::Kernel computeParamsKernel, computeExclusionParamsKernel;
     cl::Kernel ewaldSumsKernel;
@@ -148,6 +204,7 @@ private:
     cl::Kernel pmeDispersionInterpolateForceKernel;
     std::string realToFixedPoint;
     std::map<std::string, std::string> pmeDefines;
+    std::vector<int> exceptionOrder;
     std::vector<std::pair<int, int> > exceptionAtoms;
     OpenCLArray exceptionPairs;
     OpenCLArray exceptionSlices;
@@ -158,18 +215,37 @@ private:
     int dispersionGridSizeX, dispersionGridSizeY, dispersionGridSizeZ;
     bool hasCoulomb, hasLJ, usePmeQueue, doLJPME, usePosqCharges, recomputeParams, hasOffsets;
     NonbondedMethod nonbondedMethod;
-    static const int PmeOrder = 5;
+    int pmeOrder;
+    static const int EwaldTileSize = 64;
+    // The cosine and sine sums of at most this many bytes are kept at once.  Longer lists of
+    // wave vectors are processed in chunks.
+    static const int MaxEwaldSumsBytes = 64*1024*1024;
+    int numKVectors, kVectorChunkSize;
 
-    int numSubsets, numSlices;
-    bool hasDerivatives;
+    int numSubsets, numSlices, forceGroup, recipForceGroup;
+    bool hasDerivatives, useFixedSliceLambdas;
     vector<int> subsetsVec;
     vector<double> dispersionCoefficients;
+    SlicedNonbondedForceImpl::DispersionCorrectionTable dispersionTable;
     vector<mm_double2> sliceLambdasVec, subsetSelfEnergy;
     vector<ScalingParameterInfo> sliceScalingParams;
+    int numEnergySlots;
+    vector<int> sliceEnergySlots, energySlotSlices;
     OpenCLArray subsets;
     OpenCLArray sliceLambdas;
+    // The stages are timed on the host, finishing the current queue at their boundaries.
+    bool profileStages;
+    string currentStage;
+    chrono::steady_clock::time_point stageStart;
+    map<string, double> stageTimes;
 
     string getDerivativeExpression(string param, bool conditionCoulomb, bool conditionLJ);
+    void setSliceLambdas(const vector<mm_double2>& lambdas, bool fixed);
+    void uploadSliceLambdas();
+    void getContextRange(int numItems, int& startIndex, int& endIndex) const;
+    void addReciprocalSliceEnergies(vector<double>& coulombEnergies, vector<double>& ljEnergies);
+    void beginStage(const string& name);
+    void endStage();
 
     vector<mm_float2> double2Tofloat2(vector<mm_double2> input) {
         vector<mm_float2> output(input.size());
@@ -211,9 +287,28 @@ class OpenCLCalcExtendedCustomCVForceKernel : public CommonCalcExtendedCustomCVF
 public:
     OpenCLCalcExtendedCustomCVForceKernel(std::string name, const Platform& platform, ComputeContext& cc) : CommonCalcExtendedCustomCVForceKernel(name, platform, cc) {
     }
+    /**
+     * Get the ComputeContext corresponding to the inner Context.  The inner Context is linked
+     * to the outer one, so it runs on the same devices and its own parallel kernels split the
+     * work of every collective variable among them.  Their forces end up summed on the first
+     * device, which is therefore the one this kernel reads them from.
+     */
     ComputeContext& getInnerComputeContext(ContextImpl& innerContext) {
         return *reinterpret_cast<OpenCLPlatform::PlatformData*>(innerContext.getPlatformData())->contexts[0];
     }
+    /**
+     * Block until all work queued on a ComputeContext has finished.
+     */
+    void synchronize(ComputeContext& context) {
+        dynamic_cast<OpenCLContext&>(context).getQueue().finish();
+    }
+    /**
+     * Compile a program, reusing its binary from the cache of OpenCLProgramCache.
+     */
+    ComputeProgram compileProgram(ComputeContext& context, const std::string& source, const std::map<std::string, std::string>& defines) {
+        OpenCLContext& cl = dynamic_cast<OpenCLContext&>(context);
+        return std::make_shared<OpenCLProgram>(cl, OpenCLProgramCache::createProgram(cl, source, defines));
+    }
 };
 
 } // namespace OpenMMLab
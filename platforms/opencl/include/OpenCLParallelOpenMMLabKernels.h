@@ -52,6 +52,27 @@ public:
      * @param force      the SlicedNonbondedForce to copy the parameters from
      */
     void copyParametersToContext(ContextImpl& context, const SlicedNonbondedForce& force);
+    /**
+     * Compute the Coulomb and Lennard-Jones energies of every slice, not multiplied by the
+     * scaling parameters.
+     *
+     * @param context            the context in which to execute this kernel
+     * @param includeDirect      true if direct space interactions should be included
+     * @param includeReciprocal  true if reciprocal space interactions should be included
+     * @param coulombEnergies    on exit, the Coulomb energy of each slice
+     * @param ljEnergies         on exit, the Lennard-Jones energy of each slice
+     */
+    void getSliceEnergies(ContextImpl& context, bool includeDirect, bool includeReciprocal, vector<double>& coulombEnergies, vector<double>& ljEnergies);
+    /**
+     * Compute the derivatives of the energy with respect to the scaling parameters for which
+     * derivatives were requested.
+     *
+     * @param context            the context in which to execute this kernel
+     * @param includeDirect      true if direct space interactions should be included
+     * @param includeReciprocal  true if reciprocal space interactions should be included
+     * @param derivatives        on exit, the derivative with respect to each parameter
+     */
+    void getScalingParameterDerivatives(ContextImpl& context, bool includeDirect, bool includeReciprocal, map<string, double>& derivatives);
     /**
      * Get the parameters being used for PME.
      *
@@ -0,0 +1,64 @@
+#ifndef __OPENMM_OPENCLPROGRAMCACHE_H__
+#define __OPENMM_OPENCLPROGRAMCACHE_H__
+
+/* -------------------------------------------------------------------------- *
+ *                             OpenMM Laboratory                              *
+ *                             =================                              *
+ *                                                                            *
+ * A plugin for testing low-level code implementation for OpenMM.             *
+ *                                                                            *
+ * Copyright (c) 2023 Charlles Abreu                                          *
+ * https://github.com/craabreu/openmm-lab                                     *
+ * -------------------------------------------------------------------------- */
+
+#include "openmm/opencl/OpenCLContext.h"
+#include <map>
+#include <string>
+
+using namespace OpenMM;
+
+namespace OpenMMLab {
+
+/**
+ * This class compiles the OpenCL programs of the plugin and stores their binaries on disk,
+ * so that later Contexts, including those of other processes, load them instead of
+ * compiling the sources again.
+ *
+ * A binary is identified by a hash of its source, its defines, the device, the driver, the
+ * version of OpenMM and the settings of the context that OpenCLContext::createProgram()
+ * adds to every program.  The file also stores the full key, which is compared before the
+ * binary is used, so a hash collision only causes a recompilation.
+ *
+ * The CUDA platform needs no such cache, because CudaContext::createModule() already keeps
+ * the compiled modules in the directory given by the CudaTempDirectory property.
+ */
+
+class OpenCLProgramCache {
+public:
+    /**
+     * Create an OpenCL program in the same way as OpenCLContext::createProgram(), loading its
+     * binary from the cache if possible.  Otherwise, the source is compiled and its binary is
+     * stored in the cache.
+     *
+     * @param context   the context in which the program will be used
+     * @param source    the source code of the program
+     * @param defines   a set of preprocessor definitions to add to the source code
+     */
+    static cl::Program createProgram(OpenCLContext& context, const std::string& source,
+                                     const std::map<std::string, std::string>& defines=std::map<std::string, std::string>());
+    /**
+     * Set the directory where compiled programs are stored.  The directory must already
+     * exist.  The default is the value of the environment variable
+     * OPENMMLAB_KERNEL_CACHE_DIR, and an empty string disables the cache.
+     */
+    static void setCacheDirectory(const std::string& directory);
+    /**
+     * Get the directory where compiled programs are stored, or an empty string if they are
+     * not stored.
+     */
+    static std::string getCacheDirectory();
+};
+
+} // namespace OpenMMLab
+
+#endif // __OPENMM_OPENCLPROGRAMCACHE_H__
@@ -11,9 +11,13 @@
  * https://github.com/craabreu/openmm-lab                                     *
  * -------------------------------------------------------------------------- */
 
+#include "internal/CommonFFT3D.h"
 #include "openmm/opencl/OpenCLArray.h"
 #define VKFFT_BACKEND 3 // OpenCL
 #include "vkFFT.h"
+#include <memory>
+#include <mutex>
+#include <string>
 
 using namespace OpenMM;
 
@@ -28,15 +32,15 @@ namespace OpenMMLab {
  * multiply every value of the original data set by the total number of data points.
  */
 
-class OpenCLVkFFT3D {
+class OpenCLVkFFT3D : public CommonFFT3D {
 public:
     /**
      * Create an OpenCLVkFFT3D object for performing transforms of a particular size.
      *
      * The transform cannot be done in-place: the input and output
-     * arrays must be different.  Also, the input array is used as workspace, so its contents
-     * are destroyed.  This also means that both arrays must be large enough to hold complex values,
-     * even when performing a real-to-complex transform.
+     * arrays must be different.  Also, the inverse transform overwrites the contents of the
+     * output array.  When performing a real-to-complex transform, the input array only needs
+     * to hold xsize*ysize*zsize real values per batch.
      *
      * When performing a real-to-complex transform, the output data is of size xsize*ysize*(zsize/2+1)
      * and contains only the non-redundant elements.
@@ -52,6 +56,12 @@ public:
      */
     OpenCLVkFFT3D(OpenCLContext& context, int xsize, int ysize, int zsize, int batch, bool realToComplex, OpenCLArray& in, OpenCLArray& out);
     ~OpenCLVkFFT3D();
+    /**
+     * Perform a Fourier transform on the current queue of the context.
+     *
+     * @param forward  true to perform a forward transform, false to perform an inverse transform
+     */
+    void execFFT(bool forward);
     /**
      * Perform a Fourier transform.
      *
@@ -60,36 +70,40 @@ public:
      */
     void execFFT(bool forward, cl::CommandQueue queue);
     /**
-     * Get the smallest legal size for a dimension of the grid (that is, a size with no prime
-     * factors other than 2, 3, 5, ..., maxPrimeFactor).
-     *
-     * @param minimum   the minimum size the return value must be greater than or equal to
-     * @param maxPrimeFactor  the maximum supported prime number factor (default=13)
+     * Set the directory where compiled VkFFT kernels are stored, so that later processes
+     * load them instead of compiling them again.  The directory must already exist.  The
+     * default is the value of the environment variable OPENMMLAB_VKFFT_CACHE_DIR, and an
+     * empty string disables the cache.
      */
-    static int findLegalDimension(int minimum, int maxPrimeFactor=13) {
-        if (minimum < 1)
-            return 1;
-        while (true) {
-            // Attempt to factor the current value.
-
-            int unfactored = minimum;
-            for (int factor = 2; factor <= maxPrimeFactor; factor++) {
-                while (unfactored > 1 && unfactored%factor == 0)
-                    unfactored /= factor;
-            }
-            if (unfactored == 1)
-                return minimum;
-            minimum++;
-        }
-    }
+    static void setKernelCacheDirectory(const std::string& directory);
+    /**
+     * Get the directory where compiled VkFFT kernels are stored, or an empty string if they
+     * are not stored.
+     */
+    static std::string getKernelCacheDirectory();
 private:
+    /**
+     * The VkFFT application for one combination of OpenCL context, device, dimensions, batch
+     * size, precision and kind of transform.  It is shared by all OpenCLVkFFT3D objects created
+     * with the same combination, so its kernels are only compiled once.  Each object passes its
+     * own buffers when it launches the transform, and the uses on different queues are ordered
+     * with an event, since they share the application's temporary buffer.
+     */
+    struct Plan {
+        cl_device_id device;
+        cl_context cl;
+        uint64_t inputBufferSize;
+        uint64_t outputBufferSize;
+        VkFFTApplication app = {};
+        cl::Event lastUse;
+        std::mutex lock;
+        ~Plan();
+    };
+    static std::shared_ptr<Plan> getPlan(OpenCLContext& context, int xsize, int ysize, int zsize, int batch, bool realToComplex, cl_mem inputBuffer, cl_mem outputBuffer);
+    OpenCLContext& context;
+    std::shared_ptr<Plan> plan;
     cl_mem inputBuffer;
     cl_mem outputBuffer;
-    cl_device_id device;
-    cl_context cl;
-    uint64_t inputBufferSize;
-    uint64_t outputBufferSize;
-    VkFFTApplication app = {};
 };
 
 } // namespace OpenMMLab
@@ -31,6 +31,7 @@ extern "C" OPENMM_EXPORT void registerKernelFactories() {
         OpenCLOpenMMLabKernelFactory* factory = new OpenCLOpenMMLabKernelFactory();
         platform.registerKernelFactory(CalcSlicedNonbondedForceKernel::Name(), factory);
         platform.registerKernelFactory(CalcExtendedCustomCVForceKernel::Name(), factory);
+        platform.registerKernelFactory(CalcCustomSummationKernel::Name(), factory);
     }
     catch (std::exception ex) {
         // Ignore
@@ -52,6 +53,8 @@ KernelImpl* OpenCLOpenMMLabKernelFactory::createKernelImpl(std::string name, con
     if (data.contexts.size() > 1) {
         if (name == CalcSlicedNonbondedForceKernel::Name())
             return new OpenCLParallelCalcSlicedNonbondedForceKernel(name, platform, data, context.getSystem());
+        if (name == CalcCustomSummationKernel::Name())
+            return new CommonCalcCustomSummationKernel(name, platform, *data.contexts[0]);
         throw OpenMMException((std::string("Tried to create kernel with illegal kernel name '")+name+"'").c_str());
     }
     OpenCLContext& cl = *data.contexts[0];
@@ -59,5 +62,7 @@ KernelImpl* OpenCLOpenMMLabKernelFactory::createKernelImpl(std::string name, con
         return new OpenCLCalcSlicedNonbondedForceKernel(name, platform, cl, context.getSystem());
     if (name == CalcExtendedCustomCVForceKernel::Name())
         return new OpenCLCalcExtendedCustomCVForceKernel(name, platform, cl);
+    if (name == CalcCustomSummationKernel::Name())
+        return new CommonCalcCustomSummationKernel(name, platform, cl);
     throw OpenMMException((std::string("Tried to create kernel with illegal kernel name '")+name+"'").c_str());
 }
@@ -12,11 +12,14 @@
 #include "OpenCLOpenMMLabKernelSources.h"
 #include "CommonOpenMMLabKernelSources.h"
 #include "SlicedNonbondedForce.h"
+#include "internal/OpenCLProgramCache.h"
 #include "internal/SlicedNonbondedForceImpl.h"
+#include "internal/TracingRange.h"
 #include "openmm/internal/ContextImpl.h"
 #include "openmm/opencl/OpenCLForceInfo.h"
 #include "openmm/reference/SimTKOpenMMRealType.h"
 #include <cstring>
+#include <future>
 #include <map>
 #include <algorithm>
 #include <iostream>
@@ -25,6 +28,24 @@ using namespace OpenMMLab;
 using namespace OpenMM;
 using namespace std;
 
+/**
+ * Build an expression that looks up an integer table indexed by a variable whose value is
+ * known at compile time after unrolling, so that it folds into a constant.
+ */
+static string tableLookupExpression(const string& variable, const vector<int>& table) {
+    bool identity = true;
+    for (int i = 0; i < table.size(); i++)
+        identity &= (table[i] == i);
+    if (identity)
+        return "("+variable+")";
+    stringstream expression;
+    expression<<"(";
+    for (int i = 0; i < (int) table.size()-1; i++)
+        expression<<variable<<"=="<<i<<" ? "<<table[i]<<" : ";
+    expression<<table.back()<<")";
+    return expression.str();
+}
+
 static void setPeriodicBoxSizeArg(OpenCLContext& cl, cl::Kernel& kernel, int index) {
     if (cl.getUseDoublePrecision())
         kernel.setArg<mm_double4>(index, cl.getPeriodicBoxSizeDouble());
@@ -128,10 +149,12 @@ class OpenCLCalcSlicedNonbondedForceKernel::AddEnergyPostComputation : public Op
 public:
     AddEnergyPostComputation(OpenCLContext& cl, int forceGroup) : cl(cl), forceGroup(forceGroup), initialized(false) {
     }
-    void initialize(OpenCLArray& pmeEnergyBuffer, OpenCLArray& ljpmeEnergyBuffer, OpenCLArray& sliceLambdas, vector<ScalingParameterInfo> sliceScalingParams) {
+    void initialize(OpenCLArray& pmeEnergyBuffer, OpenCLArray& ljpmeEnergyBuffer, OpenCLArray& sliceLambdas, vector<ScalingParameterInfo> sliceScalingParams,
+                    const vector<int>& sliceEnergySlots, const vector<int>& energySlotSlices) {
         int numSlices = sliceLambdas.getSize();
+        int numEnergySlots = energySlotSlices.size();
         bool doLJPME = ljpmeEnergyBuffer.isInitialized();
-        bufferSize = pmeEnergyBuffer.getSize()/numSlices;
+        bufferSize = pmeEnergyBuffer.getSize()/numEnergySlots;
         set<string> requestedDerivs;
         for (ScalingParameterInfo info : sliceScalingParams) {
             if (info.hasDerivativeCoulomb)
@@ -149,20 +172,22 @@ public:
                 for (int slice = 0; slice < numSlices; slice++) {
                     ScalingParameterInfo info = sliceScalingParams[slice];
                     if (info.nameCoulomb == param)
-                        code<<"+clEnergy["<<slice<<"]";
+                        code<<"+clEnergy["<<sliceEnergySlots[slice]<<"]";
                     if (doLJPME && info.nameLJ == param)
-                        code<<"+ljEnergy["<<slice<<"]";
+                        code<<"+ljEnergy["<<sliceEnergySlots[slice]<<"]";
                 }
                 code<<";"<<endl;
             }
         }
         map<string, string> replacements, defines;
-        replacements["NUM_SLICES"] = cl.intToString(numSlices);
+        replacements["NUM_ENERGY_SLOTS"] = cl.intToString(numEnergySlots);
         replacements["USE_LJPME"] = doLJPME ? "1" : "0";
+        replacements["HAS_DISPERSION_CORRECTION"] = "0";
         replacements["HAS_DERIVATIVES"] = hasDerivatives ? "1" : "0";
         replacements["ADD_DERIVATIVES"] = code.str();
+        defines["SLOT_SLICE(slot)"] = tableLookupExpression("slot", energySlotSlices);
         string source = cl.replaceStrings(CommonOpenMMLabKernelSources::pmeAddEnergy, replacements);
-        cl::Program program = cl.createProgram(source, defines);
+        cl::Program program = OpenCLProgramCache::createProgram(cl, source, defines);
         addEnergyKernel = cl::Kernel(program, "addEnergy");
         int arg = 0;
         addEnergyKernel.setArg<cl::Buffer>(arg++, cl.getEnergyBuffer().getDeviceBuffer());
@@ -240,6 +265,29 @@ OpenCLCalcSlicedNonbondedForceKernel::~OpenCLCalcSlicedNonbondedForceKernel() {
 }
 
 string OpenCLCalcSlicedNonbondedForceKernel::getDerivativeExpression(string param, bool conditionCoulomb, bool conditionLJ) {
+    if (numSlices <= 32) {
+        // Encode the slices affected by the parameter as bit masks, so that the derivative costs
+        // a shift and a bitwise and instead of a chain of comparisons.
+
+        unsigned int maskCoulomb = 0, maskLJ = 0;
+        for (int slice = 0; slice < numSlices; slice++) {
+            ScalingParameterInfo info = sliceScalingParams[slice];
+            if (conditionCoulomb && info.nameCoulomb == param)
+                maskCoulomb |= 1u<<slice;
+            if (conditionLJ && info.nameLJ == param)
+                maskLJ |= 1u<<slice;
+        }
+        stringstream derivative;
+        if (maskCoulomb != 0 && maskCoulomb == maskLJ)
+            derivative<<"(("<<maskCoulomb<<"u>>slice)&1)*(clEnergy + ljEnergy)";
+        else {
+            if (maskCoulomb != 0)
+                derivative<<"(("<<maskCoulomb<<"u>>slice)&1)*clEnergy";
+            if (maskLJ != 0)
+                derivative<<(maskCoulomb != 0 ? " + " : "")<<"(("<<maskLJ<<"u>>slice)&1)*ljEnergy";
+        }
+        return derivative.str();
+    }
     stringstream exprCoulomb, exprLJ, exprBoth;
     int countCoulomb = 0, countLJ = 0, countBoth = 0;
     for (int slice = 0; slice < numSlices; slice++) {
@@ -270,19 +318,21 @@ void OpenCLCalcSlicedNonbondedForceKernel::initialize(const System& system, cons
     for (forceIndex = 0; forceIndex < system.getNumForces() && &system.getForce(forceIndex) != &force; ++forceIndex)
         ;
     string prefix = "slicedNonbonded"+cl.intToString(forceIndex)+"_";
+    pmeOrder = force.getPMEInterpolationOrder();
 
     realToFixedPoint = Platform::getOpenMMVersion()[0] == '7' ? OpenCLOpenMMLabKernelSources::realToFixedPoint : "";
 
     int numParticles = force.getNumParticles();
     numSubsets = force.getNumSubsets();
     numSlices = force.getNumSlices();
+    forceGroup = force.getForceGroup();
+    recipForceGroup = force.getReciprocalSpaceForceGroup() >= 0 ? force.getReciprocalSpaceForceGroup() : forceGroup;
     sliceLambdasVec.resize(numSlices, mm_double2(1, 1));
     subsetSelfEnergy.resize(numSlices, mm_double2(0, 0));
     sliceScalingParams.resize(numSlices, ScalingParameterInfo());
 
+    subsetsVec = force.getParticleSubsets();
     subsetsVec.resize(cl.getPaddedNumAtoms(), 0);
-    for (int i = 0; i < numParticles; i++)
-        subsetsVec[i] = force.getParticleSubset(i);
     subsets.initialize<int>(cl, cl.getPaddedNumAtoms(), "subsets");
     subsets.upload(subsetsVec);
 
@@ -301,6 +351,25 @@ void OpenCLCalcSlicedNonbondedForceKernel::initialize(const System& system, cons
         sliceScalingParams[sliceIndex(subset1, subset2)].addInfo(name, includeCoulomb, includeLJ, hasDerivative);
     }
 
+    // Slices without a scaling parameter always have unit lambdas, so their reciprocal space
+    // energies share one slot, which is reported as the energy of the first of them.
+
+    sliceEnergySlots.resize(numSlices);
+    energySlotSlices.clear();
+    int constantSlot = -1;
+    for (int slice = 0; slice < numSlices; slice++) {
+        bool scaled = sliceScalingParams[slice].includeCoulomb || sliceScalingParams[slice].includeLJ;
+        if (!scaled && constantSlot >= 0)
+            sliceEnergySlots[slice] = constantSlot;
+        else {
+            sliceEnergySlots[slice] = energySlotSlices.size();
+            energySlotSlices.push_back(slice);
+            if (!scaled)
+                constantSlot = sliceEnergySlots[slice];
+        }
+    }
+    numEnergySlots = energySlotSlices.size();
+
     size_t sizeOfReal = cl.getUseDoublePrecision() ? sizeof(double) : sizeof(float);
     sliceLambdas.initialize(cl, numSlices, 2*sizeOfReal, "sliceLambdas");
     if (cl.getUseDoublePrecision())
@@ -319,19 +388,29 @@ void OpenCLCalcSlicedNonbondedForceKernel::initialize(const System& system, cons
         exceptionsWithOffsets.insert(exception);
     }
     vector<pair<int, int> > exclusions;
-    vector<int> exceptions;
+    vector<int> exceptions, exceptionSliceOf(force.getNumExceptions());
     map<int, int> exceptionIndex;
     for (int i = 0; i < force.getNumExceptions(); i++) {
         int particle1, particle2;
         double chargeProd, sigma, epsilon;
         force.getExceptionParameters(i, particle1, particle2, chargeProd, sigma, epsilon);
         exclusions.push_back(pair<int, int>(particle1, particle2));
-        if (chargeProd != 0.0 || epsilon != 0.0 || exceptionsWithOffsets.find(i) != exceptionsWithOffsets.end()) {
-            exceptionIndex[i] = exceptions.size();
+        int subset1 = force.getParticleSubset(particle1);
+        int subset2 = force.getParticleSubset(particle2);
+        exceptionSliceOf[i] = sliceIndex(subset1, subset2);
+        if (chargeProd != 0.0 || epsilon != 0.0 || exceptionsWithOffsets.find(i) != exceptionsWithOffsets.end())
             exceptions.push_back(i);
-        }
     }
 
+    // Sort the exceptions by slice, so that the threads of a warp usually process exceptions of
+    // the same slice.  They then read the same lambdas and take the same branches, which lets
+    // whole warps skip the exceptions of slices that are switched off.
+
+    stable_sort(exceptions.begin(), exceptions.end(), [&] (int i, int j) {return exceptionSliceOf[i] < exceptionSliceOf[j];});
+    for (int i = 0; i < exceptions.size(); i++)
+        exceptionIndex[exceptions[i]] = i;
+    exceptionOrder = exceptions;
+
     // Initialize nonbonded interactions.
 
     vector<mm_float4> baseParticleParamVec(cl.getPaddedNumAtoms(), mm_float4(0, 0, 0, 0));
@@ -372,6 +451,34 @@ void OpenCLCalcSlicedNonbondedForceKernel::initialize(const System& system, cons
     defines["HAS_COULOMB"] = (hasCoulomb ? "1" : "0");
     defines["HAS_LENNARD_JONES"] = (hasLJ ? "1" : "0");
     defines["USE_LJ_SWITCH"] = (useCutoff && force.getUseSwitchingFunction() ? "1" : "0");
+
+    // The shift of each soft-core slice is alpha*(1-lambda)^power, where lambda is the
+    // Lennard-Jones scaling parameter of the slice.  The soft-core parameters are compiled in,
+    // so that the regular slices keep the plain Lennard-Jones code path.
+
+    bool useSoftCore = (hasLJ && force.getUseSoftCore());
+    defines["USE_SOFT_CORE"] = (useSoftCore ? "1" : "0");
+    if (useSoftCore) {
+        stringstream shift;
+        shift<<"real softCoreBase = max(1-ljLambda, (real) 0);"<<endl;
+        int numSoftCoreSlices = 0;
+        for (int i = 0; i < numSubsets; i++)
+            for (int j = i; j < numSubsets; j++) {
+                double alpha, power;
+                force.getSliceSoftCoreParameters(i, j, alpha, power);
+                if (alpha == 0)
+                    continue;
+                shift<<(numSoftCoreSlices++ ? "else " : "")<<"if (slice == "<<sliceIndex(i, j)<<") {"<<endl;
+                if (power == 1)
+                    shift<<"softCoreShift = "<<cl.doubleToString(alpha)<<"*softCoreBase;"<<endl
+                         <<"softCoreShiftDerivative = "<<cl.doubleToString(-alpha)<<";"<<endl;
+                else
+                    shift<<"softCoreShift = "<<cl.doubleToString(alpha)<<"*POW(softCoreBase, (real) "<<cl.doubleToString(power)<<");"<<endl
+                         <<"softCoreShiftDerivative = "<<cl.doubleToString(-alpha*power)<<"*POW(softCoreBase, (real) "<<cl.doubleToString(power-1)<<");"<<endl;
+                shift<<"}"<<endl;
+            }
+        defines["COMPUTE_SOFT_CORE_SHIFT"] = shift.str();
+    }
     if (useCutoff) {
         // Compute the reaction field constants.
 
@@ -389,8 +496,15 @@ void OpenCLCalcSlicedNonbondedForceKernel::initialize(const System& system, cons
             defines["LJ_SWITCH_C5"] = cl.doubleToString(6/pow(force.getSwitchingDistance()-force.getCutoffDistance(), 5.0));
         }
     }
+
+    // The dispersion correction only depends on the parameters, so it is computed in another
+    // thread while the kernels are compiled and the FFTs are planned.
+
+    future<vector<double> > dispersionTask;
     if (force.getUseDispersionCorrection() && cl.getContextIndex() == 0 && hasLJ && useCutoff && usePeriodic && !doLJPME)
-        dispersionCoefficients = SlicedNonbondedForceImpl::calcDispersionCorrections(system, force);
+        dispersionTask = async(launch::async, [&] () {
+            return dispersionTable.update(force);
+        });
     alpha = 0;
     ewaldSelfEnergy = 0.0;
     map<string, string> paramsDefines;
@@ -405,8 +519,17 @@ void OpenCLCalcSlicedNonbondedForceKernel::initialize(const System& system, cons
         paramsDefines["HAS_EXCEPTION_OFFSETS"] = "1";
     if (usePosqCharges)
         paramsDefines["USE_POSQ_CHARGES"] = "1";
-    if (doLJPME)
+    if (doLJPME) {
         paramsDefines["INCLUDE_LJPME_EXCEPTIONS"] = "1";
+        paramsDefines["HAS_DISPERSION_C6"] = "1";
+    }
+
+    // The reciprocal space energies are reduced within sub-groups when the device supports
+    // them, which on AMD GPUs are wavefronts of 64 threads, rather than with a tree in local
+    // memory that needs a barrier at every level.
+
+    string extensions = cl.getDevice().getInfo<CL_DEVICE_EXTENSIONS>();
+    bool useSubgroupReduction = (extensions.find("cl_khr_subgroups") != string::npos);
     if (nonbondedMethod == Ewald) {
         // Compute the Ewald parameters.
 
@@ -425,24 +548,35 @@ void OpenCLCalcSlicedNonbondedForceKernel::initialize(const System& system, cons
 
             // Create the reciprocal space kernels.
 
+            // Only the half space rx >= 0 is considered, excluding (0, 0, 0) and its mirror images.
+
+            numKVectors = kmaxx*(2*kmaxy-1)*(2*kmaxz-1) - ((kmaxy-1)*(2*kmaxz-1)+kmaxz);
             map<string, string> replacements;
             replacements["NUM_ATOMS"] = cl.intToString(numParticles);
             replacements["NUM_SUBSETS"] = cl.intToString(numSubsets);
             replacements["NUM_SLICES"] = cl.intToString(numSlices);
+            replacements["NUM_ENERGY_SLOTS"] = cl.intToString(numEnergySlots);
+            replacements["ENERGY_GROUP_SIZE"] = cl.intToString(OpenCLContext::ThreadBlockSize);
+            if (useSubgroupReduction)
+                replacements["USE_SUBGROUP_REDUCTION"] = "1";
+            replacements["SLICE_SLOT(slice)"] = tableLookupExpression("slice", sliceEnergySlots);
             replacements["PADDED_NUM_ATOMS"] = cl.intToString(cl.getPaddedNumAtoms());
             replacements["KMAX_X"] = cl.intToString(kmaxx);
             replacements["KMAX_Y"] = cl.intToString(kmaxy);
             replacements["KMAX_Z"] = cl.intToString(kmaxz);
+            replacements["EWALD_TILE_SIZE"] = cl.intToString(EwaldTileSize);
             replacements["EXP_COEFFICIENT"] = cl.doubleToString(-1.0/(4.0*alpha*alpha));
             replacements["ONE_4PI_EPS0"] = cl.doubleToString(ONE_4PI_EPS0);
             replacements["M_PI"] = cl.doubleToString(M_PI);
-            cl::Program program = cl.createProgram(realToFixedPoint+CommonOpenMMLabKernelSources::ewald, replacements);
+            cl::Program program = OpenCLProgramCache::createProgram(cl, realToFixedPoint+CommonOpenMMLabKernelSources::energyReduction+CommonOpenMMLabKernelSources::ewald, replacements);
             ewaldSumsKernel = cl::Kernel(program, "calculateEwaldCosSinSums");
             ewaldForcesKernel = cl::Kernel(program, "calculateEwaldForces");
             int elementSize = (cl.getUseDoublePrecision() ? sizeof(mm_double2) : sizeof(mm_float2));
-            cosSinSums.initialize(cl, (2*kmaxx-1)*(2*kmaxy-1)*(2*kmaxz-1)*numSubsets, elementSize, "cosSinSums");
-            int bufferSize = cl.getNumThreadBlocks()*OpenCLContext::ThreadBlockSize;
-            pmeEnergyBuffer.initialize(cl, numSlices*bufferSize, elementSize, "pmeEnergyBuffer");
+            kVectorChunkSize = MaxEwaldSumsBytes/(numSubsets*elementSize);
+            kVectorChunkSize = min(numKVectors, max(EwaldTileSize, kVectorChunkSize-kVectorChunkSize%EwaldTileSize));
+            cosSinSums.initialize(cl, kVectorChunkSize*numSubsets, elementSize, "cosSinSums");
+            int bufferSize = cl.getNumThreadBlocks();
+            pmeEnergyBuffer.initialize(cl, numEnergySlots*bufferSize, elementSize, "pmeEnergyBuffer");
             cl.clearBuffer(pmeEnergyBuffer);
             int recipForceGroup = force.getReciprocalSpaceForceGroup();
             cl.addPostComputation(addEnergy = new AddEnergyPostComputation(cl, recipForceGroup >= 0 ? recipForceGroup : force.getForceGroup()));
@@ -452,15 +586,15 @@ void OpenCLCalcSlicedNonbondedForceKernel::initialize(const System& system, cons
         // Compute the PME parameters.
 
         SlicedNonbondedForceImpl::calcPMEParameters(system, force, alpha, gridSizeX, gridSizeY, gridSizeZ, false);
-        gridSizeX = OpenCLVkFFT3D::findLegalDimension(gridSizeX);
-        gridSizeY = OpenCLVkFFT3D::findLegalDimension(gridSizeY);
-        gridSizeZ = OpenCLVkFFT3D::findLegalDimension(gridSizeZ);
+        gridSizeX = CommonFFT3D::findLegalDimension(gridSizeX);
+        gridSizeY = CommonFFT3D::findLegalDimension(gridSizeY);
+        gridSizeZ = CommonFFT3D::findLegalDimension(gridSizeZ);
         if (doLJPME) {
             SlicedNonbondedForceImpl::calcPMEParameters(system, force, dispersionAlpha, dispersionGridSizeX,
                                                   dispersionGridSizeY, dispersionGridSizeZ, true);
-            dispersionGridSizeX = OpenCLVkFFT3D::findLegalDimension(dispersionGridSizeX);
-            dispersionGridSizeY = OpenCLVkFFT3D::findLegalDimension(dispersionGridSizeY);
-            dispersionGridSizeZ = OpenCLVkFFT3D::findLegalDimension(dispersionGridSizeZ);
+            dispersionGridSizeX = CommonFFT3D::findLegalDimension(dispersionGridSizeX);
+            dispersionGridSizeY = CommonFFT3D::findLegalDimension(dispersionGridSizeY);
+            dispersionGridSizeZ = CommonFFT3D::findLegalDimension(dispersionGridSizeZ);
         }
         defines["EWALD_ALPHA"] = cl.doubleToString(alpha);
         defines["TWO_OVER_SQRT_PI"] = cl.doubleToString(2.0/sqrt(M_PI));
@@ -491,10 +625,15 @@ void OpenCLCalcSlicedNonbondedForceKernel::initialize(const System& system, cons
                 int slice = sliceIndex(i, i);
                 ewaldSelfEnergy += sliceLambdasVec[slice].x*subsetSelfEnergy[i].x + sliceLambdasVec[slice].y*subsetSelfEnergy[i].y;
             }
-            pmeDefines["PME_ORDER"] = cl.intToString(PmeOrder);
+            pmeDefines["PME_ORDER"] = cl.intToString(pmeOrder);
             pmeDefines["NUM_ATOMS"] = cl.intToString(numParticles);
             pmeDefines["NUM_SUBSETS"] = cl.intToString(numSubsets);
             pmeDefines["NUM_SLICES"] = cl.intToString(numSlices);
+            pmeDefines["NUM_ENERGY_SLOTS"] = cl.intToString(numEnergySlots);
+            pmeDefines["ENERGY_GROUP_SIZE"] = cl.intToString(OpenCLContext::ThreadBlockSize);
+            if (useSubgroupReduction)
+                pmeDefines["USE_SUBGROUP_REDUCTION"] = "1";
+            pmeDefines["SLICE_SLOT(slice)"] = tableLookupExpression("slice", sliceEnergySlots);
             pmeDefines["PADDED_NUM_ATOMS"] = cl.intToString(cl.getPaddedNumAtoms());
             pmeDefines["RECIP_EXP_FACTOR"] = cl.doubleToString(M_PI*M_PI/(alpha*alpha));
             pmeDefines["GRID_SIZE_X"] = cl.intToString(gridSizeX);
@@ -510,14 +649,22 @@ void OpenCLCalcSlicedNonbondedForceKernel::initialize(const System& system, cons
             // Create required data structures.
 
             int elementSize = (cl.getUseDoublePrecision() ? sizeof(double) : sizeof(float));
-            int roundedZSize = PmeOrder*(int) ceil(gridSizeZ/(double) PmeOrder);
-            int gridElements = gridSizeX*gridSizeY*roundedZSize*numSubsets;
-            if (doLJPME) {
-                roundedZSize = PmeOrder*(int) ceil(dispersionGridSizeZ/(double) PmeOrder);
-                gridElements = max(gridElements, dispersionGridSizeX*dispersionGridSizeY*roundedZSize*numSubsets);
+            // pmeGrid2 receives the spread charges as fixed point values, with the z indices
+            // shuffled in blocks of pmeOrder, and later holds the half spectrum of the
+            // real-to-complex transform.  pmeGrid1 only ever holds real grids.
+
+            size_t grid1Elements = 0, grid2Bytes = 0;
+            for (int grid = 0; grid < (doLJPME ? 2 : 1); grid++) {
+                size_t xsize = (grid == 0 ? gridSizeX : dispersionGridSizeX);
+                size_t ysize = (grid == 0 ? gridSizeY : dispersionGridSizeY);
+                size_t zsize = (grid == 0 ? gridSizeZ : dispersionGridSizeZ);
+                size_t roundedZSize = pmeOrder*(size_t) ceil(zsize/(double) pmeOrder);
+                grid1Elements = max(grid1Elements, xsize*ysize*zsize*numSubsets);
+                grid2Bytes = max(grid2Bytes, xsize*ysize*roundedZSize*numSubsets*sizeof(cl_long));
+                grid2Bytes = max(grid2Bytes, xsize*ysize*(zsize/2+1)*numSubsets*2*elementSize);
             }
-            pmeGrid1.initialize(cl, gridElements, 2*elementSize, "pmeGrid1");
-            pmeGrid2.initialize(cl, gridElements, 2*elementSize, "pmeGrid2");
+            pmeGrid1.initialize(cl, grid1Elements, elementSize, "pmeGrid1");
+            pmeGrid2.initialize(cl, (grid2Bytes+2*elementSize-1)/(2*elementSize), 2*elementSize, "pmeGrid2");
             cl.addAutoclearBuffer(pmeGrid2);
             pmeBsplineModuliX.initialize(cl, gridSizeX, elementSize, "pmeBsplineModuliX");
             pmeBsplineModuliY.initialize(cl, gridSizeY, elementSize, "pmeBsplineModuliY");
@@ -527,24 +674,25 @@ void OpenCLCalcSlicedNonbondedForceKernel::initialize(const System& system, cons
                 pmeDispersionBsplineModuliY.initialize(cl, dispersionGridSizeY, elementSize, "pmeDispersionBsplineModuliY");
                 pmeDispersionBsplineModuliZ.initialize(cl, dispersionGridSizeZ, elementSize, "pmeDispersionBsplineModuliZ");
             }
-            pmeBsplineTheta.initialize(cl, PmeOrder*numParticles, 4*elementSize, "pmeBsplineTheta");
+            pmeBsplineTheta.initialize(cl, pmeOrder*numParticles, 4*elementSize, "pmeBsplineTheta");
             pmeAtomRange.initialize<cl_int>(cl, gridSizeX*gridSizeY*gridSizeZ+1, "pmeAtomRange");
             pmeAtomGridIndex.initialize<mm_int2>(cl, numParticles, "pmeAtomGridIndex");
             int energyElementSize = (cl.getUseDoublePrecision() || cl.getUseMixedPrecision() ? sizeof(double) : sizeof(float));
-            int bufferSize = cl.getNumThreadBlocks()*OpenCLContext::ThreadBlockSize;
-            pmeEnergyBuffer.initialize(cl, numSlices*bufferSize, energyElementSize, "pmeEnergyBuffer");
+            int bufferSize = cl.getNumThreadBlocks();
+            pmeEnergyBuffer.initialize(cl, numEnergySlots*bufferSize, energyElementSize, "pmeEnergyBuffer");
             cl.clearBuffer(pmeEnergyBuffer);
             sort = new OpenCLSort(cl, new SortTrait(), cl.getNumAtoms());
             fft = new OpenCLVkFFT3D(cl, gridSizeX, gridSizeY, gridSizeZ, numSubsets, true, pmeGrid1, pmeGrid2);
             if (doLJPME) {
-                ljpmeEnergyBuffer.initialize(cl, numSlices*bufferSize, energyElementSize, "ljpmeEnergyBuffer");
+                ljpmeEnergyBuffer.initialize(cl, numEnergySlots*bufferSize, energyElementSize, "ljpmeEnergyBuffer");
                 cl.clearBuffer(ljpmeEnergyBuffer);
                 dispersionFft = new OpenCLVkFFT3D(cl, dispersionGridSizeX, dispersionGridSizeY, dispersionGridSizeZ, numSubsets, true, pmeGrid1, pmeGrid2);
             }
 
-            string vendor = cl.getDevice().getInfo<CL_DEVICE_VENDOR>();
-            bool isNvidia = (vendor.size() >= 6 && vendor.substr(0, 6) == "NVIDIA");
-            usePmeQueue = (!cl.getPlatformData().disablePmeStream && isNvidia);
+            // Reciprocal space runs on its own queue on every GPU, so that it can overlap with the
+            // direct space part.  On CPU devices the two would only compete for the same cores.
+
+            usePmeQueue = (!cl.getPlatformData().disablePmeStream && !deviceIsCpu);
             int recipForceGroup = force.getReciprocalSpaceForceGroup();
             if (recipForceGroup < 0)
                 recipForceGroup = force.getForceGroup();
@@ -580,13 +728,13 @@ void OpenCLCalcSlicedNonbondedForceKernel::initialize(const System& system, cons
                     zmoduli = &pmeDispersionBsplineModuliZ;
                 }
                 int maxSize = max(max(xsize, ysize), zsize);
-                vector<double> data(PmeOrder);
-                vector<double> ddata(PmeOrder);
+                vector<double> data(pmeOrder);
+                vector<double> ddata(pmeOrder);
                 vector<double> bsplines_data(maxSize);
-                data[PmeOrder-1] = 0.0;
+                data[pmeOrder-1] = 0.0;
                 data[1] = 0.0;
                 data[0] = 1.0;
-                for (int i = 3; i < PmeOrder; i++) {
+                for (int i = 3; i < pmeOrder; i++) {
                     double div = 1.0/(i-1.0);
                     data[i-1] = 0.0;
                     for (int j = 1; j < (i-1); j++)
@@ -597,16 +745,16 @@ void OpenCLCalcSlicedNonbondedForceKernel::initialize(const System& system, cons
                 // Differentiate.
 
                 ddata[0] = -data[0];
-                for (int i = 1; i < PmeOrder; i++)
+                for (int i = 1; i < pmeOrder; i++)
                     ddata[i] = data[i-1]-data[i];
-                double div = 1.0/(PmeOrder-1);
-                data[PmeOrder-1] = 0.0;
-                for (int i = 1; i < (PmeOrder-1); i++)
-                    data[PmeOrder-i-1] = div*(i*data[PmeOrder-i-2]+(PmeOrder-i)*data[PmeOrder-i-1]);
+                double div = 1.0/(pmeOrder-1);
+                data[pmeOrder-1] = 0.0;
+                for (int i = 1; i < (pmeOrder-1); i++)
+                    data[pmeOrder-i-1] = div*(i*data[pmeOrder-i-2]+(pmeOrder-i)*data[pmeOrder-i-1]);
                 data[0] = div*data[0];
                 for (int i = 0; i < maxSize; i++)
                     bsplines_data[i] = 0.0;
-                for (int i = 1; i <= PmeOrder; i++)
+                for (int i = 1; i <= pmeOrder; i++)
                     bsplines_data[i] = data[i-1];
 
                 // Evaluate the actual bspline moduli for X/Y/Z.
@@ -641,9 +789,8 @@ void OpenCLCalcSlicedNonbondedForceKernel::initialize(const System& system, cons
     // Add code to subtract off the reciprocal part of excluded interactions.
 
     if (nonbondedMethod == Ewald || nonbondedMethod == PME || nonbondedMethod == LJPME) {
-        int numContexts = cl.getPlatformData().contexts.size();
-        int startIndex = cl.getContextIndex()*force.getNumExceptions()/numContexts;
-        int endIndex = (cl.getContextIndex()+1)*force.getNumExceptions()/numContexts;
+        int startIndex, endIndex;
+        getContextRange(force.getNumExceptions(), startIndex, endIndex);
         int numExclusions = endIndex-startIndex;
         if (numExclusions > 0) {
             paramsDefines["HAS_EXCLUSIONS"] = "1";
@@ -704,28 +851,61 @@ void OpenCLCalcSlicedNonbondedForceKernel::initialize(const System& system, cons
         replacements["SIGMA_EPSILON2"] = prefix+"sigmaEpsilon2";
         cl.getNonbondedUtilities().addParameter(OpenCLNonbondedUtilities::ParameterInfo(prefix+"sigmaEpsilon", "float", 2, sizeof(cl_float2), sigmaEpsilon.getDeviceBuffer()));
     }
-    replacements["SUBSET1"] = prefix+"subset1";
-    replacements["SUBSET2"] = prefix+"subset2";
-    cl.getNonbondedUtilities().addParameter(OpenCLNonbondedUtilities::ParameterInfo(prefix+"subset", "int", 1, sizeof(int), subsets.getDeviceBuffer()));
+    particleC6.initialize<cl_float>(cl, doLJPME ? cl.getPaddedNumAtoms() : 1, "particleC6");
+    if (doLJPME) {
+        replacements["C6_1"] = prefix+"c61";
+        replacements["C6_2"] = prefix+"c62";
+        cl.getNonbondedUtilities().addParameter(OpenCLNonbondedUtilities::ParameterInfo(prefix+"c6", "float", 1, sizeof(cl_float), particleC6.getDeviceBuffer()));
+    }
+    if (numSubsets == 1) {
+        // With a single slice, the slice index folds to a constant and no subsets need to be loaded.
+        replacements["SUBSET1"] = "0";
+        replacements["SUBSET2"] = "0";
+    }
+    else {
+        replacements["SUBSET1"] = prefix+"subset1";
+        replacements["SUBSET2"] = prefix+"subset2";
+        cl.getNonbondedUtilities().addParameter(OpenCLNonbondedUtilities::ParameterInfo(prefix+"subset", "int", 1, sizeof(int), subsets.getDeviceBuffer()));
+    }
     replacements["LAMBDA"] = prefix+"lambda";
     cl.getNonbondedUtilities().addArgument(OpenCLNonbondedUtilities::ParameterInfo(prefix+"lambda", "real", 2, 2*sizeOfReal, sliceLambdas.getDeviceBuffer()));
     stringstream code;
     for (string param : requestedDerivatives) {
         string variableName = cl.getNonbondedUtilities().addEnergyParameterDerivative(param);
         string expression = getDerivativeExpression(param, hasCoulomb, hasLJ);
+        if (useSoftCore)
+            expression = cl.replaceStrings(expression, {{"ljEnergy", "ljDerivative"}});
         if (expression.length() > 0)
             code<<variableName<<" += interactionScale*("<<expression<<");"<<endl;
     }
     replacements["COMPUTE_DERIVATIVES"] = code.str();
+    stringstream derivativeSlices;
+    int numDerivativeSlices = 0;
+    unsigned int derivativeMask = 0;
+    for (int slice = 0; slice < numSlices; slice++)
+        if (sliceScalingParams[slice].hasDerivativeCoulomb || sliceScalingParams[slice].hasDerivativeLJ) {
+            derivativeSlices<<(numDerivativeSlices++ ? " || " : "")<<"slice=="<<slice;
+            if (slice < 32)
+                derivativeMask |= 1u<<slice;
+        }
+    if (numDerivativeSlices == 0)
+        replacements["SLICE_HAS_DERIVATIVE"] = "false";
+    else if (numSlices <= 32) {
+        stringstream mask;
+        mask<<"(("<<derivativeMask<<"u>>slice)&1)";
+        replacements["SLICE_HAS_DERIVATIVE"] = mask.str();
+    }
+    else
+        replacements["SLICE_HAS_DERIVATIVE"] = "("+derivativeSlices.str()+")";
+    string sliceHasDerivative = replacements["SLICE_HAS_DERIVATIVE"];
     source = cl.replaceStrings(source, replacements);
     if (force.getIncludeDirectSpace())
         cl.getNonbondedUtilities().addInteraction(useCutoff, usePeriodic, true, force.getCutoffDistance(), exclusionList, source, force.getForceGroup());
 
     // Initialize the exceptions.
 
-    int numContexts = cl.getPlatformData().contexts.size();
-    int startIndex = cl.getContextIndex()*exceptions.size()/numContexts;
-    int endIndex = (cl.getContextIndex()+1)*exceptions.size()/numContexts;
+    int startIndex, endIndex;
+    getContextRange(exceptions.size(), startIndex, endIndex);
     int numExceptions = endIndex-startIndex;
     if (numExceptions > 0) {
         paramsDefines["HAS_EXCEPTIONS"] = "1";
@@ -751,6 +931,7 @@ void OpenCLCalcSlicedNonbondedForceKernel::initialize(const System& system, cons
         exceptionSlices.upload(exceptionSlicesVec);
         map<string, string> replacements;
         replacements["APPLY_PERIODIC"] = (usePeriodic && force.getExceptionsUsePeriodicBoundaryConditions() ? "1" : "0");
+        replacements["SLICE_HAS_DERIVATIVE"] = sliceHasDerivative;
         replacements["PARAMS"] = cl.getBondedUtilities().addArgument(exceptionParams.getDeviceBuffer(), "float4");
         replacements["LAMBDAS"] = cl.getBondedUtilities().addArgument(sliceLambdas.getDeviceBuffer(), "real2");
         stringstream code;
@@ -837,12 +1018,14 @@ void OpenCLCalcSlicedNonbondedForceKernel::initialize(const System& system, cons
 
     // Add post-computation for dispersion correction.
 
+    if (dispersionTask.valid())
+        dispersionCoefficients = dispersionTask.get();
     if (dispersionCoefficients.size() > 0 && force.getIncludeDirectSpace())
         cl.addPostComputation(new DispersionCorrectionPostComputation(cl, dispersionCoefficients, sliceLambdasVec, sliceScalingParams, force.getForceGroup()));
 
     // Initialize the kernel for updating parameters.
 
-    cl::Program program = cl.createProgram(CommonOpenMMLabKernelSources::nonbondedParameters, paramsDefines);
+    cl::Program program = OpenCLProgramCache::createProgram(cl, CommonOpenMMLabKernelSources::nonbondedParameters, paramsDefines);
     computeParamsKernel = cl::Kernel(program, "computeParameters");
     computeExclusionParamsKernel = cl::Kernel(program, "computeExclusionParameters");
     info = new ForceInfo(0, force);
@@ -850,6 +1033,7 @@ void OpenCLCalcSlicedNonbondedForceKernel::initialize(const System& system, cons
 }
 
 double OpenCLCalcSlicedNonbondedForceKernel::execute(ContextImpl& context, bool includeForces, bool includeEnergy, bool includeDirect, bool includeReciprocal) {
+    OPENMMLAB_TRACE_RANGE("SlicedNonbondedForce::execute");
     bool deviceIsCpu = (cl.getDevice().getInfo<CL_DEVICE_TYPE>() == CL_DEVICE_TYPE_CPU);
     if (!hasInitializedKernel) {
         hasInitializedKernel = true;
@@ -862,6 +1046,7 @@ double OpenCLCalcSlicedNonbondedForceKernel::execute(ContextImpl& context, bool
         computeParamsKernel.setArg<cl::Buffer>(index++, cl.getPosq().getDeviceBuffer());
         computeParamsKernel.setArg<cl::Buffer>(index++, charges.getDeviceBuffer());
         computeParamsKernel.setArg<cl::Buffer>(index++, sigmaEpsilon.getDeviceBuffer());
+        computeParamsKernel.setArg<cl::Buffer>(index++, particleC6.getDeviceBuffer());
         computeParamsKernel.setArg<cl::Buffer>(index++, particleParamOffsets.getDeviceBuffer());
         computeParamsKernel.setArg<cl::Buffer>(index++, particleOffsetIndices.getDeviceBuffer());
         computeParamsKernel.setArg<cl::Buffer>(index++, subsets.getDeviceBuffer());
@@ -889,19 +1074,19 @@ double OpenCLCalcSlicedNonbondedForceKernel::execute(ContextImpl& context, bool
             ewaldSumsKernel.setArg<cl::Buffer>(1, cl.getPosq().getDeviceBuffer());
             ewaldSumsKernel.setArg<cl::Buffer>(2, subsets.getDeviceBuffer());
             ewaldSumsKernel.setArg<cl::Buffer>(3, cosSinSums.getDeviceBuffer());
+            ewaldSumsKernel.setArg<cl::Buffer>(4, sliceLambdas.getDeviceBuffer());
             ewaldForcesKernel.setArg<cl::Buffer>(0, cl.getLongForceBuffer().getDeviceBuffer());
             ewaldForcesKernel.setArg<cl::Buffer>(1, cl.getPosq().getDeviceBuffer());
             ewaldForcesKernel.setArg<cl::Buffer>(2, cosSinSums.getDeviceBuffer());
             ewaldForcesKernel.setArg<cl::Buffer>(3, subsets.getDeviceBuffer());
-            ewaldForcesKernel.setArg<cl::Buffer>(4, sliceLambdas.getDeviceBuffer());
-            addEnergy->initialize(pmeEnergyBuffer, ljpmeEnergyBuffer, sliceLambdas, sliceScalingParams);
+            addEnergy->initialize(pmeEnergyBuffer, ljpmeEnergyBuffer, sliceLambdas, sliceScalingParams, sliceEnergySlots, energySlotSlices);
         }
         if (pmeGrid1.isInitialized()) {
             // Create kernels for Coulomb PME.
 
             map<string, string> replacements;
             replacements["CHARGE"] = (usePosqCharges ? "pos.w" : "charges[atom]");
-            cl::Program program = cl.createProgram(realToFixedPoint+cl.replaceStrings(CommonOpenMMLabKernelSources::pme, replacements), pmeDefines);
+            cl::Program program = OpenCLProgramCache::createProgram(cl, realToFixedPoint+CommonOpenMMLabKernelSources::energyReduction+cl.replaceStrings(CommonOpenMMLabKernelSources::pme, replacements), pmeDefines);
             pmeGridIndexKernel = cl::Kernel(program, "findAtomGridIndex");
             pmeSpreadChargeKernel = cl::Kernel(program, "gridSpreadCharge");
             pmeConvolutionKernel = cl::Kernel(program, "reciprocalConvolution");
@@ -934,7 +1119,7 @@ double OpenCLCalcSlicedNonbondedForceKernel::execute(ContextImpl& context, bool
             pmeFinishSpreadChargeKernel = cl::Kernel(program, "finishSpreadCharge");
             pmeFinishSpreadChargeKernel.setArg<cl::Buffer>(0, pmeGrid2.getDeviceBuffer());
             pmeFinishSpreadChargeKernel.setArg<cl::Buffer>(1, pmeGrid1.getDeviceBuffer());
-            addEnergy->initialize(pmeEnergyBuffer, ljpmeEnergyBuffer, sliceLambdas, sliceScalingParams);
+            addEnergy->initialize(pmeEnergyBuffer, ljpmeEnergyBuffer, sliceLambdas, sliceScalingParams, sliceEnergySlots, energySlotSlices);
 
             if (doLJPME) {
                 // Create kernels for LJ PME.
@@ -947,8 +1132,8 @@ double OpenCLCalcSlicedNonbondedForceKernel::execute(ContextImpl& context, bool
                 pmeDefines["RECIP_EXP_FACTOR"] = cl.doubleToString(M_PI*M_PI/(dispersionAlpha*dispersionAlpha));
                 pmeDefines["USE_LJPME"] = "1";
                 pmeDefines["CHARGE_FROM_SIGEPS"] = "1";
-                program = cl.createProgram(realToFixedPoint+CommonOpenMMLabKernelSources::pme, pmeDefines);
-                pmeDispersionGridIndexKernel = cl::Kernel(program, "findAtomGridIndex");
+                program = OpenCLProgramCache::createProgram(cl, realToFixedPoint+CommonOpenMMLabKernelSources::energyReduction+CommonOpenMMLabKernelSources::pme, pmeDefines);
+                pmeDispersionGridIndexKernel = cl::Kernel(program, hasCoulomb ? "rebinAtomGridIndex" : "findAtomGridIndex");
                 pmeDispersionSpreadChargeKernel = cl::Kernel(program, "gridSpreadCharge");
                 pmeDispersionConvolutionKernel = cl::Kernel(program, "reciprocalConvolution");
                 pmeDispersionEvalEnergyKernel = cl::Kernel(program, "gridEvaluateEnergy");
@@ -986,7 +1171,7 @@ double OpenCLCalcSlicedNonbondedForceKernel::execute(ContextImpl& context, bool
     // Update scaling parameters if needed.
 
     bool scalingParamChanged = false;
-    for (int slice = 0; slice < numSlices; slice++) {
+    for (int slice = 0; slice < numSlices && !useFixedSliceLambdas; slice++) {
         ScalingParameterInfo info = sliceScalingParams[slice];
         if (info.includeCoulomb) {
             double value = context.getParameter(info.nameCoulomb);
@@ -1003,17 +1188,8 @@ double OpenCLCalcSlicedNonbondedForceKernel::execute(ContextImpl& context, bool
             }
         }
     }
-    if (scalingParamChanged) {
-        ewaldSelfEnergy = 0.0;
-        for (int i = 0; i < numSubsets; i++) {
-            int slice = sliceIndex(i, i);
-            ewaldSelfEnergy += sliceLambdasVec[slice].x*subsetSelfEnergy[i].x + sliceLambdasVec[slice].y*subsetSelfEnergy[i].y;
-        }
-        if (cl.getUseDoublePrecision())
-            sliceLambdas.upload(sliceLambdasVec);
-        else
-            sliceLambdas.upload(double2Tofloat2(sliceLambdasVec));
-    }
+    if (scalingParamChanged)
+        uploadSliceLambdas();
 
     // Update particle and exception parameters.
 
@@ -1031,10 +1207,12 @@ double OpenCLCalcSlicedNonbondedForceKernel::execute(ContextImpl& context, bool
     }
     double energy = (includeReciprocal ? ewaldSelfEnergy : 0.0);
     if (recomputeParams || hasOffsets) {
+        beginStage("computeParameters");
         computeParamsKernel.setArg<cl_int>(1, includeEnergy && includeReciprocal);
         cl.executeKernel(computeParamsKernel, cl.getPaddedNumAtoms());
         if (exclusionParams.isInitialized())
             cl.executeKernel(computeExclusionParamsKernel, exclusionParams.getSize());
+        endStage();
         if (usePmeQueue) {
             vector<cl::Event> events(1);
             cl.getQueue().enqueueMarkerWithWaitList(NULL, &events[0]);
@@ -1048,20 +1226,32 @@ double OpenCLCalcSlicedNonbondedForceKernel::execute(ContextImpl& context, bool
     // Do reciprocal space calculations.
 
     if (cosSinSums.isInitialized() && includeReciprocal) {
+        OPENMMLAB_TRACE_RANGE("SlicedNonbondedForce::ewald");
+        beginStage("ewaldSumsAndForces");
         mm_double4 boxSize = cl.getPeriodicBoxSizeDouble();
         if (cl.getUseDoublePrecision()) {
-            ewaldSumsKernel.setArg<mm_double4>(4, boxSize);
-            ewaldForcesKernel.setArg<mm_double4>(5, boxSize);
+            ewaldSumsKernel.setArg<mm_double4>(5, boxSize);
+            ewaldForcesKernel.setArg<mm_double4>(4, boxSize);
         }
         else {
-            ewaldSumsKernel.setArg<mm_float4>(4, mm_float4((float) boxSize.x, (float) boxSize.y, (float) boxSize.z, 0));
-            ewaldForcesKernel.setArg<mm_float4>(5, mm_float4((float) boxSize.x, (float) boxSize.y, (float) boxSize.z, 0));
+            ewaldSumsKernel.setArg<mm_float4>(5, mm_float4((float) boxSize.x, (float) boxSize.y, (float) boxSize.z, 0));
+            ewaldForcesKernel.setArg<mm_float4>(4, mm_float4((float) boxSize.x, (float) boxSize.y, (float) boxSize.z, 0));
         }
-        cl.executeKernel(ewaldSumsKernel, cosSinSums.getSize());
-        cl.executeKernel(ewaldForcesKernel, cl.getNumAtoms());
+        for (int firstKVector = 0; firstKVector < numKVectors; firstKVector += kVectorChunkSize) {
+            int chunkSize = min(kVectorChunkSize, numKVectors-firstKVector);
+            ewaldSumsKernel.setArg<cl_int>(6, firstKVector);
+            ewaldSumsKernel.setArg<cl_int>(7, chunkSize);
+            cl.executeKernel(ewaldSumsKernel, chunkSize);
+            if (includeForces) {
+                ewaldForcesKernel.setArg<cl_int>(5, firstKVector);
+                ewaldForcesKernel.setArg<cl_int>(6, chunkSize);
+                cl.executeKernel(ewaldForcesKernel, cl.getNumAtoms(), EwaldTileSize);
+            }
+        }
+        endStage();
     }
     if (pmeGrid1.isInitialized() && includeReciprocal) {
-        if (usePmeQueue && !includeEnergy)
+        if (usePmeQueue)
             cl.setQueue(pmeQueue);
 
         // Invert the periodic box vectors.
@@ -1081,6 +1271,7 @@ double OpenCLCalcSlicedNonbondedForceKernel::execute(ContextImpl& context, bool
         // Execute the reciprocal space kernels.
 
         if (hasCoulomb) {
+            OPENMMLAB_TRACE_RANGE("SlicedNonbondedForce::pme");
             setPeriodicBoxArgs(cl, pmeGridIndexKernel, 2);
             if (cl.getUseDoublePrecision()) {
                 pmeGridIndexKernel.setArg<mm_double4>(7, recipBoxVectors[0]);
@@ -1092,8 +1283,13 @@ double OpenCLCalcSlicedNonbondedForceKernel::execute(ContextImpl& context, bool
                 pmeGridIndexKernel.setArg<mm_float4>(8, recipBoxVectorsFloat[1]);
                 pmeGridIndexKernel.setArg<mm_float4>(9, recipBoxVectorsFloat[2]);
             }
+            beginStage("pmeGridIndex");
             cl.executeKernel(pmeGridIndexKernel, cl.getNumAtoms());
+            endStage();
+            beginStage("pmeSort");
             sort->sort(pmeAtomGridIndex);
+            endStage();
+            beginStage("pmeSpreadCharge");
             setPeriodicBoxArgs(cl, pmeSpreadChargeKernel, 2);
             if (cl.getUseDoublePrecision()) {
                 pmeSpreadChargeKernel.setArg<mm_double4>(7, recipBoxVectors[0]);
@@ -1107,7 +1303,10 @@ double OpenCLCalcSlicedNonbondedForceKernel::execute(ContextImpl& context, bool
             }
             cl.executeKernel(pmeSpreadChargeKernel, cl.getNumAtoms());
             cl.executeKernel(pmeFinishSpreadChargeKernel, gridSizeX*gridSizeY*gridSizeZ);
-            fft->execFFT(true, cl.getQueue());
+            endStage();
+            beginStage("pmeForwardFFT");
+            fft->execFFT(true);
+            endStage();
             mm_double4 boxSize = cl.getPeriodicBoxSizeDouble();
             if (cl.getUseDoublePrecision()) {
                 pmeConvolutionKernel.setArg<mm_double4>(4, recipBoxVectors[0]);
@@ -1125,41 +1324,71 @@ double OpenCLCalcSlicedNonbondedForceKernel::execute(ContextImpl& context, bool
                 pmeEvalEnergyKernel.setArg<mm_float4>(6, recipBoxVectorsFloat[1]);
                 pmeEvalEnergyKernel.setArg<mm_float4>(7, recipBoxVectorsFloat[2]);
             }
-            if (includeEnergy || hasDerivatives)
+            if (includeEnergy || hasDerivatives) {
+                beginStage("pmeConvolution");
                 cl.executeKernel(pmeEvalEnergyKernel, gridSizeX*gridSizeY*gridSizeZ);
-            cl.executeKernel(pmeConvolutionKernel, gridSizeX*gridSizeY*gridSizeZ);
-            fft->execFFT(false, cl.getQueue());
-            setPeriodicBoxArgs(cl, pmeInterpolateForceKernel, 3);
-            if (cl.getUseDoublePrecision()) {
-                pmeInterpolateForceKernel.setArg<mm_double4>(8, recipBoxVectors[0]);
-                pmeInterpolateForceKernel.setArg<mm_double4>(9, recipBoxVectors[1]);
-                pmeInterpolateForceKernel.setArg<mm_double4>(10, recipBoxVectors[2]);
+                endStage();
             }
-            else {
-                pmeInterpolateForceKernel.setArg<mm_float4>(8, recipBoxVectorsFloat[0]);
-                pmeInterpolateForceKernel.setArg<mm_float4>(9, recipBoxVectorsFloat[1]);
-                pmeInterpolateForceKernel.setArg<mm_float4>(10, recipBoxVectorsFloat[2]);
+            // When only the energy is needed, as for evaluations at foreign scaling parameters, the
+            // convolution, the inverse transform and the force interpolation are skipped.
+
+            if (includeForces) {
+                beginStage("pmeConvolution");
+                cl.executeKernel(pmeConvolutionKernel, gridSizeX*gridSizeY*gridSizeZ);
+                endStage();
+                beginStage("pmeInverseFFT");
+                fft->execFFT(false);
+                endStage();
+                setPeriodicBoxArgs(cl, pmeInterpolateForceKernel, 3);
+                if (cl.getUseDoublePrecision()) {
+                    pmeInterpolateForceKernel.setArg<mm_double4>(8, recipBoxVectors[0]);
+                    pmeInterpolateForceKernel.setArg<mm_double4>(9, recipBoxVectors[1]);
+                    pmeInterpolateForceKernel.setArg<mm_double4>(10, recipBoxVectors[2]);
+                }
+                else {
+                    pmeInterpolateForceKernel.setArg<mm_float4>(8, recipBoxVectorsFloat[0]);
+                    pmeInterpolateForceKernel.setArg<mm_float4>(9, recipBoxVectorsFloat[1]);
+                    pmeInterpolateForceKernel.setArg<mm_float4>(10, recipBoxVectorsFloat[2]);
+                }
+                beginStage("pmeInterpolateForce");
+                if (deviceIsCpu)
+                    cl.executeKernel(pmeInterpolateForceKernel, 2*cl.getDevice().getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>(), 1);
+                else
+                    cl.executeKernel(pmeInterpolateForceKernel, cl.getNumAtoms());
+                endStage();
             }
-            if (deviceIsCpu)
-                cl.executeKernel(pmeInterpolateForceKernel, 2*cl.getDevice().getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>(), 1);
-            else
-                cl.executeKernel(pmeInterpolateForceKernel, cl.getNumAtoms());
         }
 
         if (doLJPME && hasLJ) {
-            setPeriodicBoxArgs(cl, pmeDispersionGridIndexKernel, 2);
-            if (cl.getUseDoublePrecision()) {
-                pmeDispersionGridIndexKernel.setArg<mm_double4>(7, recipBoxVectors[0]);
-                pmeDispersionGridIndexKernel.setArg<mm_double4>(8, recipBoxVectors[1]);
-                pmeDispersionGridIndexKernel.setArg<mm_double4>(9, recipBoxVectors[2]);
+            OPENMMLAB_TRACE_RANGE("SlicedNonbondedForce::ljpme");
+
+            // When the Coulomb grid has been processed, the atoms are already sorted.  If both grids
+            // have the same dimensions, the indices are reused as they are, and otherwise they are
+            // only recomputed in the same order.
+
+            bool sameGrid = (gridSizeX == dispersionGridSizeX && gridSizeY == dispersionGridSizeY && gridSizeZ == dispersionGridSizeZ);
+            if (!hasCoulomb || !sameGrid) {
+                setPeriodicBoxArgs(cl, pmeDispersionGridIndexKernel, 2);
+                if (cl.getUseDoublePrecision()) {
+                    pmeDispersionGridIndexKernel.setArg<mm_double4>(7, recipBoxVectors[0]);
+                    pmeDispersionGridIndexKernel.setArg<mm_double4>(8, recipBoxVectors[1]);
+                    pmeDispersionGridIndexKernel.setArg<mm_double4>(9, recipBoxVectors[2]);
+                }
+                else {
+                    pmeDispersionGridIndexKernel.setArg<mm_float4>(7, recipBoxVectorsFloat[0]);
+                    pmeDispersionGridIndexKernel.setArg<mm_float4>(8, recipBoxVectorsFloat[1]);
+                    pmeDispersionGridIndexKernel.setArg<mm_float4>(9, recipBoxVectorsFloat[2]);
+                }
+                beginStage("ljpmeGridIndex");
+                cl.executeKernel(pmeDispersionGridIndexKernel, cl.getNumAtoms());
+                endStage();
             }
-            else {
-                pmeDispersionGridIndexKernel.setArg<mm_float4>(7, recipBoxVectorsFloat[0]);
-                pmeDispersionGridIndexKernel.setArg<mm_float4>(8, recipBoxVectorsFloat[1]);
-                pmeDispersionGridIndexKernel.setArg<mm_float4>(9, recipBoxVectorsFloat[2]);
+            if (!hasCoulomb) {
+                beginStage("ljpmeSort");
+                sort->sort(pmeAtomGridIndex);
+                endStage();
             }
-            cl.executeKernel(pmeDispersionGridIndexKernel, cl.getNumAtoms());
-            sort->sort(pmeAtomGridIndex);
+            beginStage("ljpmeSpreadCharge");
             cl.clearBuffer(pmeGrid2);
             setPeriodicBoxArgs(cl, pmeDispersionSpreadChargeKernel, 2);
             if (cl.getUseDoublePrecision()) {
@@ -1174,7 +1403,10 @@ double OpenCLCalcSlicedNonbondedForceKernel::execute(ContextImpl& context, bool
             }
             cl.executeKernel(pmeDispersionSpreadChargeKernel, cl.getNumAtoms());
             cl.executeKernel(pmeDispersionFinishSpreadChargeKernel, gridSizeX*gridSizeY*gridSizeZ);
-            dispersionFft->execFFT(true, cl.getQueue());
+            endStage();
+            beginStage("ljpmeForwardFFT");
+            dispersionFft->execFFT(true);
+            endStage();
             if (cl.getUseDoublePrecision()) {
                 pmeDispersionConvolutionKernel.setArg<mm_double4>(4, recipBoxVectors[0]);
                 pmeDispersionConvolutionKernel.setArg<mm_double4>(5, recipBoxVectors[1]);
@@ -1192,28 +1424,43 @@ double OpenCLCalcSlicedNonbondedForceKernel::execute(ContextImpl& context, bool
                 pmeDispersionEvalEnergyKernel.setArg<mm_float4>(7, recipBoxVectorsFloat[2]);
             }
             // if (!hasCoulomb) cl.clearBuffer(ljpmeEnergyBuffer);  // Is this necessary?
-            if (includeEnergy || hasDerivatives)
+            if (includeEnergy || hasDerivatives) {
+                beginStage("ljpmeConvolution");
                 cl.executeKernel(pmeDispersionEvalEnergyKernel, gridSizeX*gridSizeY*gridSizeZ);
-            cl.executeKernel(pmeDispersionConvolutionKernel, gridSizeX*gridSizeY*gridSizeZ);
-            dispersionFft->execFFT(false, cl.getQueue());
-            setPeriodicBoxArgs(cl, pmeDispersionInterpolateForceKernel, 3);
-            if (cl.getUseDoublePrecision()) {
-                pmeDispersionInterpolateForceKernel.setArg<mm_double4>(8, recipBoxVectors[0]);
-                pmeDispersionInterpolateForceKernel.setArg<mm_double4>(9, recipBoxVectors[1]);
-                pmeDispersionInterpolateForceKernel.setArg<mm_double4>(10, recipBoxVectors[2]);
+                endStage();
             }
-            else {
-                pmeDispersionInterpolateForceKernel.setArg<mm_float4>(8, recipBoxVectorsFloat[0]);
-                pmeDispersionInterpolateForceKernel.setArg<mm_float4>(9, recipBoxVectorsFloat[1]);
-                pmeDispersionInterpolateForceKernel.setArg<mm_float4>(10, recipBoxVectorsFloat[2]);
+            if (includeForces) {
+                beginStage("ljpmeConvolution");
+                cl.executeKernel(pmeDispersionConvolutionKernel, gridSizeX*gridSizeY*gridSizeZ);
+                endStage();
+                beginStage("ljpmeInverseFFT");
+                dispersionFft->execFFT(false);
+                endStage();
+                setPeriodicBoxArgs(cl, pmeDispersionInterpolateForceKernel, 3);
+                if (cl.getUseDoublePrecision()) {
+                    pmeDispersionInterpolateForceKernel.setArg<mm_double4>(8, recipBoxVectors[0]);
+                    pmeDispersionInterpolateForceKernel.setArg<mm_double4>(9, recipBoxVectors[1]);
+                    pmeDispersionInterpolateForceKernel.setArg<mm_double4>(10, recipBoxVectors[2]);
+                }
+                else {
+                    pmeDispersionInterpolateForceKernel.setArg<mm_float4>(8, recipBoxVectorsFloat[0]);
+                    pmeDispersionInterpolateForceKernel.setArg<mm_float4>(9, recipBoxVectorsFloat[1]);
+                    pmeDispersionInterpolateForceKernel.setArg<mm_float4>(10, recipBoxVectorsFloat[2]);
+                }
+                beginStage("ljpmeInterpolateForce");
+                if (deviceIsCpu)
+                    cl.executeKernel(pmeDispersionInterpolateForceKernel, 2*cl.getDevice().getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>(), 1);
+                else
+                    cl.executeKernel(pmeDispersionInterpolateForceKernel, cl.getNumAtoms());
+                endStage();
             }
-            if (deviceIsCpu)
-                cl.executeKernel(pmeDispersionInterpolateForceKernel, 2*cl.getDevice().getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>(), 1);
-            else
-                cl.executeKernel(pmeDispersionInterpolateForceKernel, cl.getNumAtoms());
         }
         if (usePmeQueue) {
+            // Some drivers do not submit the commands of a queue until it is flushed, which
+            // would delay the reciprocal space until the main queue waits for it.
+
             pmeQueue.enqueueMarkerWithWaitList(NULL, &pmeSyncEvent);
+            pmeQueue.flush();
             cl.restoreDefaultQueue();
         }
     }
@@ -1245,8 +1492,8 @@ void OpenCLCalcSlicedNonbondedForceKernel::copyParametersToContext(ContextImpl&
                 throw OpenMMException("updateParametersInContext: The nonbonded force kernel does not include Lennard-Jones interactions, because all epsilons were originally 0");
         }
     }
-    for (int i = 0; i < force.getNumParticles(); i++)
-        subsetsVec[i] = force.getParticleSubset(i);
+    subsetsVec = force.getParticleSubsets();
+    subsetsVec.resize(cl.getPaddedNumAtoms(), 0);
     subsets.upload(subsetsVec);
     set<int> exceptionsWithOffsets;
     for (int i = 0; i < force.getNumExceptionParameterOffsets(); i++) {
@@ -1264,9 +1511,18 @@ void OpenCLCalcSlicedNonbondedForceKernel::copyParametersToContext(ContextImpl&
         if (chargeProd != 0.0 || epsilon != 0.0 || exceptionsWithOffsets.find(i) != exceptionsWithOffsets.end())
             exceptions.push_back(i);
     }
-    int numContexts = cl.getPlatformData().contexts.size();
-    int startIndex = cl.getContextIndex()*exceptions.size()/numContexts;
-    int endIndex = (cl.getContextIndex()+1)*exceptions.size()/numContexts;
+    if (exceptions.size() != exceptionOrder.size())
+        throw OpenMMException("updateParametersInContext: The set of non-excluded exceptions has changed");
+    for (int exception : exceptionOrder)
+        if (!binary_search(exceptions.begin(), exceptions.end(), exception))
+            throw OpenMMException("updateParametersInContext: The set of non-excluded exceptions has changed");
+
+    // The exceptions keep the order in which they were sorted by initialize(), even if the
+    // subsets of their particles have changed since then.
+
+    exceptions = exceptionOrder;
+    int startIndex, endIndex;
+    getContextRange(exceptions.size(), startIndex, endIndex);
     int numExceptions = endIndex-startIndex;
     if (numExceptions != exceptionAtoms.size())
         throw OpenMMException("updateParametersInContext: The set of non-excluded exceptions has changed");
@@ -1314,11 +1570,162 @@ void OpenCLCalcSlicedNonbondedForceKernel::copyParametersToContext(ContextImpl&
         }
     }
     if (force.getUseDispersionCorrection() && cl.getContextIndex() == 0 && (nonbondedMethod == CutoffPeriodic || nonbondedMethod == Ewald || nonbondedMethod == PME))
-        dispersionCoefficients = SlicedNonbondedForceImpl::calcDispersionCorrections(context.getSystem(), force);
+        dispersionCoefficients = dispersionTable.update(force);
     cl.invalidateMolecules(info);
     recomputeParams = true;
 }
 
+void OpenCLCalcSlicedNonbondedForceKernel::getContextRange(int numItems, int& startIndex, int& endIndex) const {
+    // Only the first device computes reciprocal space, so when there are several devices it
+    // leaves the exceptions and exclusions to the others.
+
+    int numContexts = cl.getPlatformData().contexts.size();
+    int index = cl.getContextIndex();
+    if (numContexts > 1 && (nonbondedMethod == Ewald || nonbondedMethod == PME || nonbondedMethod == LJPME)) {
+        if (index == 0) {
+            startIndex = endIndex = 0;
+            return;
+        }
+        index--;
+        numContexts--;
+    }
+    startIndex = index*numItems/numContexts;
+    endIndex = (index+1)*numItems/numContexts;
+}
+
+void OpenCLCalcSlicedNonbondedForceKernel::uploadSliceLambdas() {
+    ewaldSelfEnergy = 0.0;
+    for (int i = 0; i < numSubsets; i++) {
+        int slice = sliceIndex(i, i);
+        ewaldSelfEnergy += sliceLambdasVec[slice].x*subsetSelfEnergy[i].x + sliceLambdasVec[slice].y*subsetSelfEnergy[i].y;
+    }
+    if (cl.getUseDoublePrecision())
+        sliceLambdas.upload(sliceLambdasVec);
+    else
+        sliceLambdas.upload(double2Tofloat2(sliceLambdasVec));
+}
+
+void OpenCLCalcSlicedNonbondedForceKernel::setSliceLambdas(const vector<mm_double2>& lambdas, bool fixed) {
+    sliceLambdasVec = lambdas;
+    uploadSliceLambdas();
+    useFixedSliceLambdas = fixed;
+}
+
+void OpenCLCalcSlicedNonbondedForceKernel::addReciprocalSliceEnergies(vector<double>& coulombEnergies, vector<double>& ljEnergies) {
+    bool useDoubleEnergies = cl.getUseDoublePrecision() || cl.getUseMixedPrecision();
+    OpenCLArray* buffers[] = {&pmeEnergyBuffer, &ljpmeEnergyBuffer};
+    vector<double>* energies[] = {&coulombEnergies, &ljEnergies};
+    for (int term = 0; term < 2; term++) {
+        OpenCLArray& buffer = *buffers[term];
+        if (!buffer.isInitialized())
+            continue;
+
+        // The buffer is read as raw bytes because its element size may exceed that of the energies.
+
+        vector<char> bytes(buffer.getSize()*buffer.getElementSize());
+        buffer.download(bytes.data());
+        for (int i = 0; i < buffer.getSize(); i++)
+            (*energies[term])[energySlotSlices[i%numEnergySlots]] += useDoubleEnergies ? ((double*) bytes.data())[i] : ((float*) bytes.data())[i];
+    }
+    for (int i = 0; i < numSubsets; i++) {
+        coulombEnergies[sliceIndex(i, i)] += subsetSelfEnergy[i].x;
+        ljEnergies[sliceIndex(i, i)] += subsetSelfEnergy[i].y;
+    }
+}
+
+void OpenCLCalcSlicedNonbondedForceKernel::getSliceEnergies(ContextImpl& context, bool includeDirect, bool includeReciprocal,
+                                                            vector<double>& coulombEnergies, vector<double>& ljEnergies) {
+    computeSliceEnergies(context, vector<OpenCLCalcSlicedNonbondedForceKernel*>(1, this), includeDirect, includeReciprocal, coulombEnergies, ljEnergies);
+}
+
+void OpenCLCalcSlicedNonbondedForceKernel::computeSliceEnergies(ContextImpl& context, const vector<OpenCLCalcSlicedNonbondedForceKernel*>& kernels,
+                                                                bool includeDirect, bool includeReciprocal, vector<double>& coulombEnergies, vector<double>& ljEnergies) {
+    OpenCLCalcSlicedNonbondedForceKernel& first = *kernels[0];
+    int numSlices = first.numSlices;
+    bool readReciprocal = includeReciprocal && first.recipForceGroup != first.forceGroup && !first.hasOffsets;
+    int groups = (includeDirect ? 1<<first.forceGroup : 0) | (includeReciprocal && !readReciprocal ? 1<<first.recipForceGroup : 0);
+    vector<mm_double2> savedLambdas = first.sliceLambdasVec;
+    vector<mm_double2> lambdas(numSlices, mm_double2(0, 0));
+    coulombEnergies.assign(numSlices, 0.0);
+    ljEnergies.assign(numSlices, 0.0);
+    if (readReciprocal) {
+        context.calcForcesAndEnergy(false, true, 1<<first.recipForceGroup);
+        for (auto kernel : kernels)
+            kernel->addReciprocalSliceEnergies(coulombEnergies, ljEnergies);
+    }
+    if (groups == 0)
+        return;
+    try {
+        for (auto kernel : kernels)
+            kernel->setSliceLambdas(lambdas, true);
+        double baseline = context.calcForcesAndEnergy(false, true, groups);
+        for (int slice = 0; slice < numSlices; slice++)
+            for (int term = 0; term < 2; term++) {
+                if (!(term == 0 ? first.hasCoulomb : first.hasLJ))
+                    continue;
+                (term == 0 ? lambdas[slice].x : lambdas[slice].y) = 1.0;
+                for (auto kernel : kernels)
+                    kernel->setSliceLambdas(lambdas, true);
+                double energy = context.calcForcesAndEnergy(false, true, groups)-baseline;
+                (term == 0 ? coulombEnergies[slice] : ljEnergies[slice]) += energy;
+                lambdas[slice] = mm_double2(0, 0);
+            }
+    }
+    catch (...) {
+        for (auto kernel : kernels)
+            kernel->setSliceLambdas(savedLambdas, false);
+        throw;
+    }
+    for (auto kernel : kernels)
+        kernel->setSliceLambdas(savedLambdas, false);
+}
+
+void OpenCLCalcSlicedNonbondedForceKernel::getScalingParameterDerivatives(ContextImpl& context, bool includeDirect, bool includeReciprocal,
+                                                                         map<string, double>& derivatives) {
+    computeScalingParameterDerivatives(context, vector<OpenCLCalcSlicedNonbondedForceKernel*>(1, this), includeDirect, includeReciprocal, derivatives);
+}
+
+void OpenCLCalcSlicedNonbondedForceKernel::computeScalingParameterDerivatives(ContextImpl& context, const vector<OpenCLCalcSlicedNonbondedForceKernel*>& kernels,
+                                                                              bool includeDirect, bool includeReciprocal, map<string, double>& derivatives) {
+    OpenCLCalcSlicedNonbondedForceKernel& first = *kernels[0];
+    int groups = (includeDirect ? 1<<first.forceGroup : 0) | (includeReciprocal ? 1<<first.recipForceGroup : 0);
+    derivatives.clear();
+    if (!first.hasDerivatives || groups == 0)
+        return;
+
+    // Switch off every slice without a requested derivative.  The others keep the current
+    // values of their scaling parameters, which matter for soft-core slices.
+
+    vector<mm_double2> savedLambdas = first.sliceLambdasVec;
+    vector<mm_double2> lambdas(first.numSlices, mm_double2(0, 0));
+    for (int slice = 0; slice < first.numSlices; slice++) {
+        const ScalingParameterInfo& info = first.sliceScalingParams[slice];
+        if (info.hasDerivativeCoulomb || info.hasDerivativeLJ)
+            lambdas[slice] = mm_double2(info.includeCoulomb ? context.getParameter(info.nameCoulomb) : 1.0,
+                                    info.includeLJ ? context.getParameter(info.nameLJ) : 1.0);
+    }
+    try {
+        for (auto kernel : kernels)
+            kernel->setSliceLambdas(lambdas, true);
+        context.calcForcesAndEnergy(false, true, groups);
+    }
+    catch (...) {
+        for (auto kernel : kernels)
+            kernel->setSliceLambdas(savedLambdas, false);
+        throw;
+    }
+    for (auto kernel : kernels)
+        kernel->setSliceLambdas(savedLambdas, false);
+    map<string, double> allDerivatives;
+    context.getEnergyParameterDerivatives(allDerivatives);
+    for (const ScalingParameterInfo& info : first.sliceScalingParams) {
+        if (info.hasDerivativeCoulomb)
+            derivatives[info.nameCoulomb] = allDerivatives[info.nameCoulomb];
+        if (info.hasDerivativeLJ)
+            derivatives[info.nameLJ] = allDerivatives[info.nameLJ];
+    }
+}
+
 void OpenCLCalcSlicedNonbondedForceKernel::getPMEParameters(double& alpha, int& nx, int& ny, int& nz) const {
     if (nonbondedMethod != PME)
         throw OpenMMException("getPMEParametersInContext: This Context is not using PME");
@@ -1336,3 +1743,28 @@ void OpenCLCalcSlicedNonbondedForceKernel::getLJPMEParameters(double& alpha, int
     ny = dispersionGridSizeY;
     nz = dispersionGridSizeZ;
 }
+
+void OpenCLCalcSlicedNonbondedForceKernel::beginStage(const string& name) {
+    OPENMMLAB_TRACE_PUSH(("SlicedNonbondedForce::"+name).c_str());
+    if (!profileStages)
+        return;
+    cl.getQueue().finish();
+    currentStage = name;
+    stageStart = chrono::steady_clock::now();
+}
+
+void OpenCLCalcSlicedNonbondedForceKernel::endStage() {
+    OPENMMLAB_TRACE_POP();
+    if (!profileStages)
+        return;
+    cl.getQueue().finish();
+    stageTimes[currentStage] += chrono::duration<double, milli>(chrono::steady_clock::now()-stageStart).count();
+}
+
+void OpenCLCalcSlicedNonbondedForceKernel::getStageTimes(map<string, double>& times) {
+    times = stageTimes;
+}
+
+void OpenCLCalcSlicedNonbondedForceKernel::resetStageTimes() {
+    stageTimes.clear();
+}
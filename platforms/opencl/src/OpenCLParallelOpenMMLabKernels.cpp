@@ -55,6 +55,22 @@ void OpenCLParallelCalcSlicedNonbondedForceKernel::copyParametersToContext(Conte
         getKernel(i).copyParametersToContext(context, force);
 }
 
+void OpenCLParallelCalcSlicedNonbondedForceKernel::getSliceEnergies(ContextImpl& context, bool includeDirect, bool includeReciprocal,
+                                                                  vector<double>& coulombEnergies, vector<double>& ljEnergies) {
+    vector<OpenCLCalcSlicedNonbondedForceKernel*> deviceKernels;
+    for (int i = 0; i < (int) kernels.size(); i++)
+        deviceKernels.push_back(&getKernel(i));
+    OpenCLCalcSlicedNonbondedForceKernel::computeSliceEnergies(context, deviceKernels, includeDirect, includeReciprocal, coulombEnergies, ljEnergies);
+}
+
+void OpenCLParallelCalcSlicedNonbondedForceKernel::getScalingParameterDerivatives(ContextImpl& context, bool includeDirect, bool includeReciprocal,
+                                                                                map<string, double>& derivatives) {
+    vector<OpenCLCalcSlicedNonbondedForceKernel*> deviceKernels;
+    for (int i = 0; i < (int) kernels.size(); i++)
+        deviceKernels.push_back(&getKernel(i));
+    OpenCLCalcSlicedNonbondedForceKernel::computeScalingParameterDerivatives(context, deviceKernels, includeDirect, includeReciprocal, derivatives);
+}
+
 void OpenCLParallelCalcSlicedNonbondedForceKernel::getPMEParameters(double& alpha, int& nx, int& ny, int& nz) const {
     dynamic_cast<const OpenCLCalcSlicedNonbondedForceKernel&>(kernels[0].getImpl()).getPMEParameters(alpha, nx, ny, nz);
 }
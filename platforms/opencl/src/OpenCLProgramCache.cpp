@@ -0,0 +1,139 @@
+/* -------------------------------------------------------------------------- *
+ *                             OpenMM Laboratory                              *
+ *                             =================                              *
+ *                                                                            *
+ * A plugin for testing low-level code implementation for OpenMM.             *
+ *                                                                            *
+ * Copyright (c) 2023 Charlles Abreu                                          *
+ * https://github.com/craabreu/openmm-lab                                     *
+ * -------------------------------------------------------------------------- */
+
+#include "internal/OpenCLProgramCache.h"
+#include "openmm/Platform.h"
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iterator>
+#include <mutex>
+#include <sstream>
+#include <vector>
+#ifdef _WIN32
+#include <process.h>
+#define getpid _getpid
+#else
+#include <unistd.h>
+#endif
+
+using namespace OpenMMLab;
+using namespace OpenMM;
+using namespace std;
+
+static mutex programCacheLock;
+static bool programCacheDirectoryIsSet = false;
+static string programCacheDirectory;
+static atomic<unsigned long long> tempFileCounter(0);
+
+void OpenCLProgramCache::setCacheDirectory(const string& directory) {
+    lock_guard<mutex> guard(programCacheLock);
+    programCacheDirectory = directory;
+    programCacheDirectoryIsSet = true;
+}
+
+string OpenCLProgramCache::getCacheDirectory() {
+    lock_guard<mutex> guard(programCacheLock);
+    if (!programCacheDirectoryIsSet) {
+        const char* directory = getenv("OPENMMLAB_KERNEL_CACHE_DIR");
+        programCacheDirectory = (directory == NULL ? "" : directory);
+        programCacheDirectoryIsSet = true;
+    }
+    return programCacheDirectory;
+}
+
+/**
+ * Compute a 64 bit FNV-1a hash, which unlike std::hash is the same for every compiler and
+ * standard library, so that all builds of the plugin share the cache files.
+ */
+static unsigned long long computeHash(const string& text) {
+    unsigned long long hash = 14695981039346656037ULL;
+    for (unsigned char c : text) {
+        hash ^= c;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+/**
+ * Build the key that identifies a program.  Besides the source and defines, it includes
+ * everything that OpenCLContext::createProgram() takes from the context or the device.
+ */
+static string getProgramKey(OpenCLContext& context, const string& source, const map<string, string>& defines) {
+    cl::Device& device = context.getDevice();
+    stringstream key;
+    key<<"OpenMM "<<Platform::getOpenMMVersion()<<"\n";
+    key<<device.getInfo<CL_DEVICE_VENDOR>()<<"\n"<<device.getInfo<CL_DEVICE_NAME>()<<"\n";
+    key<<device.getInfo<CL_DEVICE_VERSION>()<<"\n"<<device.getInfo<CL_DRIVER_VERSION>()<<"\n";
+    key<<"double "<<context.getUseDoublePrecision()<<" mixed "<<context.getUseMixedPrecision();
+    key<<" simd "<<context.getSIMDWidth()<<" atoms "<<context.getNumAtoms()<<" "<<context.getPaddedNumAtoms()<<"\n";
+    for (auto& define : defines)
+        key<<"#define "<<define.first<<" "<<define.second<<"\n";
+    key<<source;
+    return key.str();
+}
+
+cl::Program OpenCLProgramCache::createProgram(OpenCLContext& context, const string& source, const map<string, string>& defines) {
+    string directory = getCacheDirectory();
+    if (directory.empty())
+        return context.createProgram(source, defines);
+    string key = getProgramKey(context, source, defines);
+    stringstream fileName;
+    fileName<<directory<<"/openmmlab-opencl-"<<hex<<computeHash(key)<<".bin";
+    string cacheFile = fileName.str();
+    vector<cl::Device> devices(1, context.getDevice());
+
+    // A cached file holds the length of the key, the key and the binary.  Any file that
+    // does not match or cannot be built is ignored and later replaced.
+
+    {
+        ifstream file(cacheFile.c_str(), ios::binary);
+        vector<unsigned char> contents((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+        unsigned long long keySize = 0;
+        if (contents.size() > sizeof(keySize)) {
+            copy(contents.begin(), contents.begin()+sizeof(keySize), (unsigned char*) &keySize);
+            size_t binaryStart = sizeof(keySize)+keySize;
+            if (keySize == key.size() && binaryStart < contents.size() && equal(key.begin(), key.end(), contents.begin()+sizeof(keySize))) {
+                try {
+                    cl::Program::Binaries binaries(1, vector<unsigned char>(contents.begin()+binaryStart, contents.end()));
+                    cl::Program program(context.getContext(), devices, binaries);
+                    program.build(devices);
+                    return program;
+                }
+                catch (cl::Error& err) {
+                }
+            }
+        }
+    }
+    cl::Program program = context.createProgram(source, defines);
+    try {
+        vector<vector<unsigned char> > binaries = program.getInfo<CL_PROGRAM_BINARIES>();
+        if (binaries.size() == 1 && binaries[0].size() > 0) {
+            // Write to a temporary file first, so that concurrent processes never read a
+            // partial file.  Its name is unique to this process and call.
+
+            string tempFile = cacheFile+"."+to_string((long long) getpid())+"."+to_string(tempFileCounter++)+".tmp";
+            ofstream file(tempFile.c_str(), ios::binary);
+            unsigned long long keySize = key.size();
+            file.write((const char*) &keySize, sizeof(keySize));
+            file.write(key.data(), key.size());
+            file.write((const char*) binaries[0].data(), binaries[0].size());
+            file.close();
+            if (!file || rename(tempFile.c_str(), cacheFile.c_str()) != 0)
+                remove(tempFile.c_str());
+        }
+    }
+    catch (cl::Error& err) {
+        // The binary could not be retrieved, so the program is simply not cached.
+    }
+    return program;
+}
@@ -10,29 +10,112 @@
 
 #include "internal/OpenCLVkFFT3D.h"
 #include "openmm/opencl/OpenCLContext.h"
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <iterator>
+#include <map>
+#include <sstream>
 #include <string>
+#include <tuple>
+#include <vector>
+#ifdef _WIN32
+#include <process.h>
+#define getpid _getpid
+#else
+#include <unistd.h>
+#endif
 
 using namespace OpenMMLab;
 using namespace OpenMM;
 using namespace std;
 
-OpenCLVkFFT3D::OpenCLVkFFT3D(OpenCLContext& context, int xsize, int ysize, int zsize, int batch, bool realToComplex, OpenCLArray& in, OpenCLArray& out) {
-    device = context.getDevice().get();
-    cl = context.getContext().get();
+OpenCLVkFFT3D::OpenCLVkFFT3D(OpenCLContext& context, int xsize, int ysize, int zsize, int batch, bool realToComplex, OpenCLArray& in, OpenCLArray& out) :
+        CommonFFT3D(realToComplex, context.getUseDoublePrecision()), context(context) {
     inputBuffer = in.getDeviceBuffer().get();
     outputBuffer = out.getDeviceBuffer().get();
+    plan = getPlan(context, xsize, ysize, zsize, batch, realToComplex, inputBuffer, outputBuffer);
+}
+
+OpenCLVkFFT3D::~OpenCLVkFFT3D() {
+}
+
+static mutex kernelCacheLock;
+static bool kernelCacheDirectoryIsSet = false;
+static string kernelCacheDirectory;
+static atomic<unsigned long long> tempFileCounter(0);
+
+void OpenCLVkFFT3D::setKernelCacheDirectory(const string& directory) {
+    lock_guard<mutex> guard(kernelCacheLock);
+    kernelCacheDirectory = directory;
+    kernelCacheDirectoryIsSet = true;
+}
+
+string OpenCLVkFFT3D::getKernelCacheDirectory() {
+    lock_guard<mutex> guard(kernelCacheLock);
+    if (!kernelCacheDirectoryIsSet) {
+        const char* directory = getenv("OPENMMLAB_VKFFT_CACHE_DIR");
+        kernelCacheDirectory = (directory == NULL ? "" : directory);
+        kernelCacheDirectoryIsSet = true;
+    }
+    return kernelCacheDirectory;
+}
+
+/**
+ * Get the name of the file that stores the compiled kernels of a transform.  Kernels are
+ * specific to the device, the driver and the version of VkFFT, so all of them are part of
+ * the name along with the parameters of the transform.
+ */
+static string getKernelCacheFile(OpenCLContext& context, int xsize, int ysize, int zsize, int batch, bool realToComplex, bool doublePrecision) {
+    string directory = OpenCLVkFFT3D::getKernelCacheDirectory();
+    if (directory.empty())
+        return "";
+    cl::Device& device = context.getDevice();
+    stringstream deviceInfo;
+    deviceInfo<<device.getInfo<CL_DEVICE_NAME>()<<" "<<device.getInfo<CL_DRIVER_VERSION>();
+    stringstream name;
+    name<<directory<<"/vkfft-opencl-"<<VkFFTGetVersion()<<"-"<<hex<<hash<string>()(deviceInfo.str())<<dec<<"-"<<xsize<<"x"<<ysize<<"x"<<zsize;
+    name<<"-"<<batch<<(realToComplex ? "-r2c" : "-c2c")<<(doublePrecision ? "-double" : "-single")<<".bin";
+    return name.str();
+}
 
+OpenCLVkFFT3D::Plan::~Plan() {
+    deleteVkFFT(&app);
+}
+
+shared_ptr<OpenCLVkFFT3D::Plan> OpenCLVkFFT3D::getPlan(OpenCLContext& context, int xsize, int ysize, int zsize, int batch, bool realToComplex,
+                                                       cl_mem inputBuffer, cl_mem outputBuffer) {
+    static mutex cacheLock;
+    static map<tuple<cl_context, cl_device_id, int, int, int, int, bool, bool>, weak_ptr<Plan> > cache;
     bool doublePrecision = context.getUseDoublePrecision();
+    auto key = make_tuple(context.getContext().get(), context.getDevice().get(), xsize, ysize, zsize, batch, realToComplex, doublePrecision);
+    lock_guard<mutex> guard(cacheLock);
+    shared_ptr<Plan> plan = cache[key].lock();
+    if (plan)
+        return plan;
+
+    // Forget the plans that are no longer used by any transform.
+
+    for (auto entry = cache.begin(); entry != cache.end(); )
+        if (entry->second.expired())
+            entry = cache.erase(entry);
+        else
+            entry++;
+    plan = make_shared<Plan>();
+    plan->device = context.getDevice().get();
+    plan->cl = context.getContext().get();
     int outputZSize = realToComplex ? (zsize/2+1) : zsize;
     size_t realTypeSize = doublePrecision ? sizeof(double) : sizeof(float);
     size_t inputElementSize = realToComplex ? realTypeSize : 2*realTypeSize;
-    inputBufferSize = inputElementSize*zsize*ysize*xsize*batch;
-    outputBufferSize = 2*realTypeSize*outputZSize*ysize*xsize*batch;
+    plan->inputBufferSize = inputElementSize*zsize*ysize*xsize*batch;
+    plan->outputBufferSize = 2*realTypeSize*outputZSize*ysize*xsize*batch;
 
     VkFFTConfiguration config = {};
     config.performR2C = realToComplex;
-    config.device = &device;
-    config.context = &cl;
+    config.device = &plan->device;
+    config.context = &plan->cl;
     config.doublePrecision = doublePrecision;
 
     config.FFTdim = 3;
@@ -43,32 +126,80 @@ OpenCLVkFFT3D::OpenCLVkFFT3D(OpenCLContext& context, int xsize, int ysize, int z
 
     config.inverseReturnToInputBuffer = true;
     config.isInputFormatted = true;
-    config.inputBufferSize = &inputBufferSize;
+    config.inputBufferSize = &plan->inputBufferSize;
     config.inputBuffer = &inputBuffer;
     config.inputBufferStride[0] = zsize;
     config.inputBufferStride[1] = zsize*ysize;
     config.inputBufferStride[2] = zsize*ysize*xsize;
 
-    config.bufferSize = &outputBufferSize;
+    config.bufferSize = &plan->outputBufferSize;
     config.buffer = &outputBuffer;
     config.bufferStride[0] = outputZSize;
     config.bufferStride[1] = outputZSize*ysize;
     config.bufferStride[2] = outputZSize*ysize*xsize;
 
-    VkFFTResult result = initializeVkFFT(&app, config);
-    if (result != VKFFT_SUCCESS)
-        throw OpenMMException("Error initializing VkFFT: "+to_string(result));
+    // Load the compiled kernels if they have been stored before.  Otherwise, or if they
+    // cannot be used, compile them and store them for later processes.
+
+    string cacheFile = getKernelCacheFile(context, xsize, ysize, zsize, batch, realToComplex, doublePrecision);
+    vector<char> kernels;
+    if (!cacheFile.empty()) {
+        ifstream file(cacheFile.c_str(), ios::binary);
+        kernels.assign(istreambuf_iterator<char>(file), istreambuf_iterator<char>());
+    }
+    VkFFTResult result = VKFFT_ERROR_FAILED_TO_INITIALIZE;
+    if (kernels.size() > 0) {
+        config.loadApplicationFromString = 1;
+        config.loadApplicationString = kernels.data();
+        plan->app = {};
+        result = initializeVkFFT(&plan->app, config);
+    }
+    if (result != VKFFT_SUCCESS) {
+        config.loadApplicationFromString = 0;
+        config.loadApplicationString = NULL;
+        config.saveApplicationToString = !cacheFile.empty();
+        plan->app = {};
+        result = initializeVkFFT(&plan->app, config);
+        if (result != VKFFT_SUCCESS)
+            throw OpenMMException("Error initializing VkFFT: "+to_string(result));
+        if (config.saveApplicationToString) {
+            // Write to a temporary file first, so that concurrent processes never read a
+            // partial file.  Its name is unique to this process and call.
+
+            string tempFile = cacheFile+"."+to_string((long long) getpid())+"."+to_string(tempFileCounter++)+".tmp";
+            ofstream file(tempFile.c_str(), ios::binary);
+            file.write((const char*) plan->app.saveApplicationString, plan->app.applicationStringSize);
+            file.close();
+            if (!file || rename(tempFile.c_str(), cacheFile.c_str()) != 0)
+                remove(tempFile.c_str());
+        }
+    }
+    cache[key] = plan;
+    return plan;
 }
 
-OpenCLVkFFT3D::~OpenCLVkFFT3D() {
-    deleteVkFFT(&app);
+void OpenCLVkFFT3D::execFFT(bool forward) {
+    execFFT(forward, context.getQueue());
 }
 
 void OpenCLVkFFT3D::execFFT(bool forward, cl::CommandQueue queue) {
+    // Wait for any previous use of the application on another queue, and then run it on this
+    // object's buffers.
+
+    lock_guard<mutex> guard(plan->lock);
+    bool isShared = (plan.use_count() > 1);
+    if (isShared && plan->lastUse() != NULL) {
+        vector<cl::Event> events(1, plan->lastUse);
+        queue.enqueueBarrierWithWaitList(&events);
+    }
     cl_command_queue commandQueue = queue.get();
     VkFFTLaunchParams launchParams = {};
     launchParams.commandQueue = &commandQueue;
-    VkFFTResult result = VkFFTAppend(&app, forward ? -1 : 1, &launchParams);
+    launchParams.inputBuffer = &inputBuffer;
+    launchParams.buffer = &outputBuffer;
+    VkFFTResult result = VkFFTAppend(&plan->app, forward ? -1 : 1, &launchParams);
     if (result != VKFFT_SUCCESS)
         throw OpenMMException("Error executing VkFFT: "+to_string(result));
+    if (isShared)
+        queue.enqueueMarkerWithWaitList(NULL, &plan->lastUse);
 }
@@ -13,7 +13,10 @@
 #define CL_HPP_MINIMUM_OPENCL_VERSION 120
 #include "OpenCLOpenMMLabTests.h"
 #include "TestSlicedNonbondedForce.h"
+#include "internal/OpenCLProgramCache.h"
 // #include <openmm/opencl/opencl.hpp>
+#include <cstdlib>
+#include <map>
 #include <string>
 
 void testParallelComputation(SlicedNonbondedForce::NonbondedMethod method) {
@@ -131,12 +134,95 @@ void testReordering() {
 //     return (memory >= 4*(long long)(1<<30));
 // }
 
+void testProgramCache() {
+    // The first Context compiles the programs and stores them in the current directory, and
+    // the second one loads them.  Both must give the same results.
+
+    System system;
+    const int numParticles = 100;
+    for (int i = 0; i < numParticles; i++)
+        system.addParticle(1.0);
+    SlicedNonbondedForce* force = new SlicedNonbondedForce(1);
+    for (int i = 0; i < numParticles; i++)
+        force->addParticle(i%2-0.5, 0.5, 1.0);
+    force->setNonbondedMethod(SlicedNonbondedForce::PME);
+    system.addForce(force);
+    system.setDefaultPeriodicBoxVectors(Vec3(4,0,0), Vec3(0,4,0), Vec3(0,0,4));
+    OpenMM_SFMT::SFMT sfmt;
+    init_gen_rand(0, sfmt);
+    vector<Vec3> positions(numParticles);
+    for (int i = 0; i < numParticles; i++)
+        positions[i] = Vec3(4*genrand_real2(sfmt), 4*genrand_real2(sfmt), 4*genrand_real2(sfmt));
+    string previousDirectory = OpenCLProgramCache::getCacheDirectory();
+    OpenCLProgramCache::setCacheDirectory(".");
+    vector<State> states;
+    for (int i = 0; i < 2; i++) {
+        VerletIntegrator integrator(0.01);
+        Context context(system, integrator, platform);
+        context.setPositions(positions);
+        states.push_back(context.getState(State::Forces | State::Energy));
+    }
+    OpenCLProgramCache::setCacheDirectory(previousDirectory);
+    ASSERT_EQUAL_TOL(states[0].getPotentialEnergy(), states[1].getPotentialEnergy(), 1e-6);
+    for (int i = 0; i < numParticles; i++)
+        ASSERT_EQUAL_VEC(states[0].getForces()[i], states[1].getForces()[i], 1e-6);
+}
+
+void testStageProfiling() {
+    const int numParticles = 200;
+    const double L = 4.0;
+    System system;
+    for (int i = 0; i < numParticles; i++)
+        system.addParticle(1.0);
+    system.setDefaultPeriodicBoxVectors(Vec3(L, 0, 0), Vec3(0, L, 0), Vec3(0, 0, L));
+    SlicedNonbondedForce* nonbonded = new SlicedNonbondedForce(2);
+    nonbonded->setNonbondedMethod(SlicedNonbondedForce::LJPME);
+    nonbonded->setCutoffDistance(1.0);
+    OpenMM_SFMT::SFMT sfmt;
+    init_gen_rand(0, sfmt);
+    vector<Vec3> positions(numParticles);
+    for (int i = 0; i < numParticles; i++) {
+        nonbonded->addParticle(i%2-0.5, 0.3, 1.0);
+        nonbonded->setParticleSubset(i, i%4 == 0 ? 1 : 0);
+        positions[i] = Vec3(L*genrand_real2(sfmt), L*genrand_real2(sfmt), L*genrand_real2(sfmt));
+    }
+    system.addForce(nonbonded);
+
+    // Profiling is disabled by default.
+
+    VerletIntegrator integrator1(0.001);
+    Context context1(system, integrator1, platform);
+    context1.setPositions(positions);
+    context1.getState(State::Forces);
+    ASSERT(nonbonded->getStageTimesInContext(context1).empty());
+#ifndef _WIN32
+    setenv("OPENMMLAB_PROFILING", "1", 1);
+    VerletIntegrator integrator2(0.001);
+    Context context2(system, integrator2, platform);
+    unsetenv("OPENMMLAB_PROFILING");
+    context2.setPositions(positions);
+    for (int i = 0; i < 3; i++)
+        context2.getState(State::Forces);
+    map<string, double> times = nonbonded->getStageTimesInContext(context2);
+    const string stages[] = {"computeParameters", "pmeGridIndex", "pmeSort", "pmeSpreadCharge", "pmeForwardFFT", "pmeConvolution",
+                             "pmeInverseFFT", "pmeInterpolateForce", "ljpmeSpreadCharge", "ljpmeInterpolateForce", "init:kernel"};
+    for (const string& stage : stages) {
+        ASSERT(times.find(stage) != times.end());
+        ASSERT(times[stage] >= 0.0);
+    }
+    nonbonded->resetStageTimesInContext(context2);
+    ASSERT(nonbonded->getStageTimesInContext(context2).empty());
+#endif
+}
+
 void runPlatformTests() {
     testParallelComputation(SlicedNonbondedForce::NoCutoff);
     testParallelComputation(SlicedNonbondedForce::Ewald);
     testParallelComputation(SlicedNonbondedForce::PME);
     testParallelComputation(SlicedNonbondedForce::LJPME);
     testReordering();
+    testProgramCache();
+    testStageProfiling();
     // if (canRunHugeTest()) {
     //     double tol = (platform.getPropertyDefaultValue("Precision") == "double" ? 1e-4 : 1e-3);
     //     testHugeSystem(platform, tol);
@@ -12,8 +12,11 @@
 #define __ReferenceExtendedCustomCVForce_H__
 
 #include "ExtendedCustomCVForce.h"
+#include "OpenMMLabKernels.h"
 #include "openmm/internal/ContextImpl.h"
-#include "lepton/ExpressionProgram.h"
+#include "internal/SharedThreadPool.h"
+#include "lepton/CompiledExpression.h"
+#include "lepton/CustomFunction.h"
 #include <map>
 #include <string>
 #include <vector>
@@ -22,16 +25,59 @@ namespace OpenMMLab {
 
 class ReferenceExtendedCustomCVForce {
 private:
-    Lepton::ExpressionProgram energyExpression;
-    std::vector<std::string> variableNames, paramDerivNames;
-    std::vector<Lepton::ExpressionProgram> variableDerivExpressions;
-    std::vector<Lepton::ExpressionProgram> paramDerivExpressions;
+    Lepton::CompiledExpression energyExpression;
+    std::vector<std::string> variableNames, paramDerivNames, globalParameterNames;
+    std::vector<Lepton::CompiledExpression> variableDerivExpressions;
+    std::vector<Lepton::CompiledExpression> paramDerivExpressions;
+    std::vector<Lepton::CustomFunction*> tabulatedFunctions;
+    std::vector<std::string> rbfNames;
+    std::vector<std::vector<int> > rbfVariables;
+    std::vector<ExtendedCustomCVForce::RadialBasisFunctionType> rbfTypes;
+    std::vector<double> rbfShapeParameters;
+    std::vector<std::vector<double> > rbfCenters, rbfWeights;
+    std::vector<Lepton::CompiledExpression> rbfDerivExpressions;
+    std::vector<std::string> summationNames;
+    std::vector<std::vector<int> > summationVariables;
+    std::vector<CustomSummation*> summations;
+    std::vector<Lepton::CompiledExpression> summationDerivExpressions;
+    std::vector<double> summationValues, summationArgs;
+    std::vector<std::vector<double> > summationGradients;
+    std::vector<int> depositionIntervals;
+    std::vector<std::vector<Lepton::CompiledExpression> > depositionExpressions;
+    std::vector<std::vector<std::vector<double> > > depositedTerms;
+    long long lastDepositionStep;
+    CollectiveVariableHistory history;
+    std::vector<int> cvIntervals;
+    std::vector<int> batchGroups, batchOffsets, batchFirstVariables, batchSizes;
+    std::vector<std::map<std::string, double> > batchDerivs;
+    std::vector<long long> cvSteps;
+    std::vector<bool> cvHasValue, cvPlaced;
+    std::vector<double> cvValues;
+    std::vector<std::vector<OpenMM::Vec3> > cvForces;
+    std::vector<std::map<std::string, double> > cvDerivs;
+    std::vector<double> globalValues, rbfValues, dEdV, rbfDelta;
+    std::vector<std::vector<double> > rbfGradients;
+    SharedThreadPool* threads;
+    PlacedCollectiveVariables* placed;
+    bool isCurrent(int index, long long step) const;
+    void addChainRuleForces(int numParticles, std::vector<OpenMM::Vec3>& forces);
+    void setBatchDisplacements(ContextImpl& innerContext, int numParticles, int batch, bool useDerivatives);
+    void evaluateBatches(ContextImpl& innerContext, int numParticles, ExtendedCustomCVForceCounters& counters);
+    void readPlacedVariables(int numParticles, bool includeForces);
+    void depositSummationTerms(long long step);
 
 public:
     /**
      * Constructor
+     *
+     * @param force      the force to compute
+     * @param threads    the pool among whose threads the particles are split when the chain
+     *                   rule forces are accumulated, or NULL to accumulate them serially
+     * @param placed     the collective variables evaluated on other platforms, or NULL if
+     *                   there are none
      */
-    ReferenceExtendedCustomCVForce(const ExtendedCustomCVForce& force);
+    ReferenceExtendedCustomCVForce(const ExtendedCustomCVForce& force, SharedThreadPool* threads = NULL,
+                                   PlacedCollectiveVariables* placed = NULL);
 
     /**
      * Destructor
@@ -44,19 +90,109 @@ public:
      */
     void updateTabulatedFunctions(const ExtendedCustomCVForce& force);
 
+    /**
+     * Update the parameters of the radial basis function expansions.  This is called when the
+     * user calls updateParametersInContext().
+     */
+    void updateRadialBasisFunctions(const ExtendedCustomCVForce& force);
+
+    /**
+     * Update the terms and overall parameters of the custom summations.  This is called when
+     * the user calls updateParametersInContext().
+     */
+    void updateCustomSummations(const ExtendedCustomCVForce& force);
+
+    /**
+     * Get the terms deposited in a custom summation.
+     *
+     * @param index     the index of the summation
+     * @param terms     on exit, the per-term parameters of each deposited term
+     */
+    void getDepositedTerms(int index, std::vector<std::vector<double> >& terms) const {
+        terms = depositedTerms[index];
+    }
+
+    /**
+     * Get the values of the collective variables and the energies recorded at the latest
+     * steps, from the oldest to the newest, and remove them from the history.
+     *
+     * @param steps      on exit, the step of each record
+     * @param values     on exit, the values of the variables at each step
+     * @param energies   on exit, the energy at each step
+     */
+    void getCollectiveVariableHistory(std::vector<long long>& steps, std::vector<std::vector<double> >& values, std::vector<double>& energies) {
+        history.take(steps, values, energies);
+    }
+
+    /**
+     * Discard the results that the collective variables keep between evaluations, so that
+     * all of them are evaluated at the next call.
+     */
+    void discardCollectiveVariableResults() {
+        cvHasValue.assign(cvHasValue.size(), false);
+    }
+
+    /**
+     * Update the evaluation intervals of the collective variables.  This is called when the
+     * user calls updateParametersInContext().
+     */
+    void updateCollectiveVariableIntervals(const ExtendedCustomCVForce& force);
+
+    /**
+     * Get whether any collective variable must be evaluated, rather than keeping the value
+     * of its latest evaluation.
+     *
+     * @param step    the current step count
+     */
+    bool needsEvaluation(long long step) const;
+
+    /**
+     * Get the current values of the collective variables.  Those whose evaluation interval
+     * has not elapsed keep the values of their latest evaluation, and the others are
+     * evaluated without forces.  The new values are not cached.
+     *
+     * @param innerContext    the context created by the force for evaluating collective variables
+     * @param numParticles    the number of particles in the System, which the dummy particles of
+     *                        the batches follow in the inner context
+     * @param step            the current step count
+     * @param values          on exit, the value of each collective variable
+     * @param counters        the counter of inner evaluations is incremented
+     */
+    void getCollectiveVariableValues(ContextImpl& innerContext, int numParticles, long long step, std::vector<double>& values,
+                                     ExtendedCustomCVForceCounters& counters);
+
+    /**
+     * Evaluate the variables that are not placed on other platforms at the current state of
+     * the inner context, regardless of their evaluation intervals.  The cached values are not
+     * affected, except for those of the batches, which are evaluated at every call anyway.
+     *
+     * @param innerContext    the context created by the force for evaluating collective variables
+     * @param numParticles    the number of particles in the System
+     * @param values          on exit, the value of each variable
+     * @param counters        the counter of inner evaluations is incremented
+     */
+    void evaluateInnerVariables(ContextImpl& innerContext, int numParticles, std::vector<double>& values,
+                                ExtendedCustomCVForceCounters& counters);
+
     /**
      * Calculate the interaction.
      *
      * @param innerContext       the context created by the force for evaluating collective variables
+     * @param step               the current step count, used to decide which collective variables are due
+     *                           for evaluation
      * @param atomCoordinates    atom coordinates
-     * @param globalParameters   the values of global parameters
+     * @param globalParameters   the values of the global parameters, in the order in which they
+     *                           were added to the force
      * @param forces             the forces are added to this
      * @param totalEnergy        the energy is added to this
      * @param energyParamDerivs  parameter derivatives are added to this
+     * @param counters           the counters of inner evaluations and expression evaluations are
+     *                           incremented
      */
-   void calculateIxn(ContextImpl& innerContext, std::vector<OpenMM::Vec3>& atomCoordinates,
-                     const std::map<std::string, double>& globalParameters,
-                     std::vector<OpenMM::Vec3>& forces, double* totalEnergy, std::map<std::string, double>& energyParamDerivs) const;
+   void calculateIxn(ContextImpl& innerContext, long long step, std::vector<OpenMM::Vec3>& atomCoordinates,
+                     const std::vector<double>& globalParameters,
+                     std::vector<OpenMM::Vec3>& forces, double* totalEnergy, std::map<std::string, double>& energyParamDerivs,
+                     ExtendedCustomCVForceCounters& counters);
 };
 
 } // namespace OpenMMLab
@@ -15,6 +15,9 @@
 #include "ReferenceExtendedCustomCVForce.h"
 #include "openmm/Platform.h"
 #include "openmm/reference/ReferenceNeighborList.h"
+#include "internal/SharedThreadPool.h"
+#include "internal/ReferenceSlicedPME.h"
+#include "internal/SlicedNonbondedForceImpl.h"
 #include <vector>
 #include <array>
 #include <map>
@@ -28,7 +31,8 @@ namespace OpenMMLab {
  */
 class ReferenceCalcSlicedNonbondedForceKernel : public CalcSlicedNonbondedForceKernel {
 public:
-    ReferenceCalcSlicedNonbondedForceKernel(string name, const Platform& platform) : CalcSlicedNonbondedForceKernel(name, platform) {
+    ReferenceCalcSlicedNonbondedForceKernel(string name, const Platform& platform) : CalcSlicedNonbondedForceKernel(name, platform), threads(NULL),
+            pmeData(NULL), dispersionPmeData(NULL) {
     }
     ~ReferenceCalcSlicedNonbondedForceKernel();
     /**
@@ -55,6 +59,27 @@ public:
      * @param force      the SlicedNonbondedForce to copy the parameters from
      */
     void copyParametersToContext(ContextImpl& context, const SlicedNonbondedForce& force);
+    /**
+     * Compute the Coulomb and Lennard-Jones energies of every slice, not multiplied by the
+     * scaling parameters, in a single pass.
+     *
+     * @param context            the context in which to execute this kernel
+     * @param includeDirect      true if direct space interactions should be included
+     * @param includeReciprocal  true if reciprocal space interactions should be included
+     * @param coulombEnergies    on exit, the Coulomb energy of each slice
+     * @param ljEnergies         on exit, the Lennard-Jones energy of each slice
+     */
+    void getSliceEnergies(ContextImpl& context, bool includeDirect, bool includeReciprocal, vector<double>& coulombEnergies, vector<double>& ljEnergies);
+    /**
+     * Compute the derivatives of the energy with respect to the scaling parameters for which
+     * derivatives were requested, in a single pass.
+     *
+     * @param context            the context in which to execute this kernel
+     * @param includeDirect      true if direct space interactions should be included
+     * @param includeReciprocal  true if reciprocal space interactions should be included
+     * @param derivatives        on exit, the derivative with respect to each parameter
+     */
+    void getScalingParameterDerivatives(ContextImpl& context, bool includeDirect, bool includeReciprocal, map<string, double>& derivatives);
     /**
      * Get the parameters being used for PME.
      *
@@ -76,25 +101,44 @@ public:
 private:
     static const int Coul = 0;
     static const int vdW = 1;
+    static const int SoftCore = 2;
     class ScalingParameterInfo;
     void computeParameters(ContextImpl& context);
+    void computeParticleParameters(int particle);
+    void computeExceptionParameters(int exception);
+    void sortExceptionsBySlice();
+    void updateNeighborList(const vector<Vec3>& positions, const Vec3* boxVectors, bool usePeriodic);
+    void computeSliceEnergies(ContextImpl& context, vector<Vec3>& forceData, bool includeDirect, bool includeReciprocal, bool applySoftCore,
+                              bool skipZeroSlices=false);
     int numParticles, num14;
-    vector<vector<int>>bonded14IndexArray;
-    vector<vector<double>> particleParamArray, bonded14ParamArray;
-    vector<int> bonded14SliceArray;
+    vector<array<int, 2>> bonded14IndexArray;
+    vector<array<double, 3>> particleParamArray, bonded14ParamArray;
+    vector<int> bonded14SliceArray, bonded14SliceStarts, bonded14Positions;
     vector<array<double, 3>> baseParticleParams, baseExceptionParams;
-    map<pair<string, int>, array<double, 3>> particleParamOffsets, exceptionParamOffsets;
+    vector<vector<pair<int, array<double, 3>>>> particleParamOffsets, exceptionParamOffsets;
+    vector<vector<int>> paramParticles, paramExceptions;
+    vector<string> paramNames;
+    vector<double> paramValues;
+    bool recomputeParams;
     double nonbondedCutoff, switchingDistance, rfDielectric, ewaldAlpha, ewaldDispersionAlpha;
     vector<double> dispersionCoefficients;
+    SlicedNonbondedForceImpl::DispersionCorrectionTable dispersionTable;
     int kmax[3], gridSize[3], dispersionGridSize[3];
-    bool useSwitchingFunction, exceptionsArePeriodic;
+    bool useSwitchingFunction, exceptionsArePeriodic, useSoftCore;
+    vector<double> softCoreAlphas, softCorePowers;
     vector<set<int>> exclusions;
+    vector<int> exclusionStarts, exclusionAtoms;
     NonbondedMethod nonbondedMethod;
     NeighborList* neighborList;
+    vector<Vec3> neighborListPositions;
+    Vec3 neighborListBoxVectors[3];
+    SharedThreadPool* threads;
+    pme_t pmeData, dispersionPmeData;
 
     int numSubsets, numSlices;
     vector<int> subsets;
-    vector<vector<double>> sliceLambdas;
+    vector<array<double, 2>> sliceLambdas;
+    vector<array<double, 3>> sliceEnergies;
     vector<vector<ScalingParameterInfo>> sliceScalingParams;
 };
 
@@ -111,7 +155,8 @@ public:
  */
 class ReferenceCalcExtendedCustomCVForceKernel : public CalcExtendedCustomCVForceKernel {
 public:
-    ReferenceCalcExtendedCustomCVForceKernel(std::string name, const Platform& platform) : CalcExtendedCustomCVForceKernel(name, platform), ixn(NULL) {
+    ReferenceCalcExtendedCustomCVForceKernel(std::string name, const Platform& platform) : CalcExtendedCustomCVForceKernel(name, platform), ixn(NULL),
+            threads(NULL) {
     }
     ~ReferenceCalcExtendedCustomCVForceKernel();
     /**
@@ -120,8 +165,9 @@ public:
      * @param system     the System this kernel will be applied to
      * @param force      the ExtendedCustomCVForce this kernel will be used for
      * @param innerContext   the context created by the ExtendedCustomCVForce for computing collective variables
+     * @param placed     the collective variables evaluated on other platforms
      */
-    void initialize(const System& system, const ExtendedCustomCVForce& force, ContextImpl& innerContext);
+    void initialize(const System& system, const ExtendedCustomCVForce& force, ContextImpl& innerContext, PlacedCollectiveVariables& placed);
     /**
      * Execute the kernel to calculate the forces and/or energy.
      *
@@ -139,6 +185,14 @@ public:
      * @param innerContext   the context created by the ExtendedCustomCVForce for computing collective variables
      */
     void copyState(ContextImpl& context, ContextImpl& innerContext);
+    /**
+     * Get the current values of the collective variables.
+     *
+     * @param context        the context in which to execute this kernel
+     * @param innerContext   the context created by the ExtendedCustomCVForce for computing collective variables
+     * @param values         on exit, the value of each collective variable
+     */
+    void getCollectiveVariableValues(ContextImpl& context, ContextImpl& innerContext, std::vector<double>& values);
     /**
      * Copy changed parameters over to a context.
      *
@@ -146,9 +200,64 @@ public:
      * @param force      the ExtendedCustomCVForce to copy the parameters from
      */
     void copyParametersToContext(ContextImpl& context, const ExtendedCustomCVForce& force);
+    /**
+     * Get the terms this kernel has deposited in a custom summation.
+     *
+     * @param index     the index of the summation
+     * @param terms     on exit, the per-term parameters of each deposited term
+     */
+    void getDepositedTerms(int index, std::vector<std::vector<double> >& terms) {
+        ixn->getDepositedTerms(index, terms);
+    }
+    /**
+     * Evaluate the variables that are not placed on other platforms at the current state of
+     * the inner context, regardless of their evaluation intervals.
+     *
+     * @param innerContext   the context created by the ExtendedCustomCVForce for computing collective variables
+     * @param values         on exit, the value of each variable
+     */
+    void evaluateInnerVariables(ContextImpl& innerContext, std::vector<double>& values);
+    /**
+     * Get the values of the collective variables and the energies recorded at the latest
+     * steps, from the oldest to the newest, and remove them from the history.
+     *
+     * @param steps      on exit, the step of each record
+     * @param values     on exit, the values of the variables at each step
+     * @param energies   on exit, the energy at each step
+     */
+    void getCollectiveVariableHistory(std::vector<long long>& steps, std::vector<std::vector<double> >& values, std::vector<double>& energies) {
+        ixn->getCollectiveVariableHistory(steps, values, energies);
+    }
+    /**
+     * Replace the results that the collective variables keep between evaluations.  This
+     * platform keeps the forces along with the values, so the results are discarded instead.
+     */
+    void setCollectiveVariableCache(const std::vector<long long>& steps, const std::vector<double>& values,
+                                    const std::vector<std::vector<double> >& derivatives) {
+        ixn->discardCollectiveVariableResults();
+    }
+    /**
+     * Get the counters of the work done by this kernel.
+     *
+     * @param counters    on exit, the value of each counter, keyed by counter name
+     */
+    void getCounters(std::map<std::string, long long>& counters) {
+        this->counters.get(counters);
+    }
+    /**
+     * Reset all counters to zero.
+     */
+    void resetCounters() {
+        counters.reset();
+    }
 private:
     ReferenceExtendedCustomCVForce* ixn;
-    std::vector<std::string> globalParameterNames, energyParamDerivNames;
+    SharedThreadPool* threads;
+    int numParticles;
+    bool hasSharedParticles;
+    std::vector<std::string> globalParameterNames, energyParamDerivNames, innerParameterNames;
+    std::vector<double> globalParameterValues;
+    ExtendedCustomCVForceCounters counters;
 };
 
 } // namespace OpenMMLab
@@ -11,8 +11,10 @@
  * -------------------------------------------------------------------------- */
 
 #include "openmm/Vec3.h"
+#include "internal/SharedThreadPool.h"
 #include "internal/windowsExportOpenMMLab.h"
 #include <vector>
+#include <array>
 
 using namespace std;
 using namespace OpenMM;
@@ -51,26 +53,56 @@ public:
 
     /**---------------------------------------------------------------------------------------
 
-       Calculate nonbonded 1-4 interactinos
+       Set a thread pool for computing the 1-4 ixns of different slices in parallel.
+
+       @param pool  the thread pool to use
+
+       --------------------------------------------------------------------------------------- */
+
+    void setThreadPool(SharedThreadPool& pool);
+
+    /**---------------------------------------------------------------------------------------
+
+       Calculate nonbonded 1-4 interactions.  The pairs must be sorted by slice, so that those
+       of each slice are stored contiguously.
 
        @param atomIndices      atom indices of the atoms in each pair
-       @param atomCoordinates  atom coordinates
        @param parameters       (sigma, 4*epsilon, charge product) for each pair
+       @param sliceStarts      the pairs of slice s are those from sliceStarts[s] to sliceStarts[s+1]-1
+       @param atomCoordinates  atom coordinates
+       @param sliceLambdas     the scaling parameters of each slice
        @param forces           force array (forces added to current values)
-       @param sliceLambdas     the scaling parameters of the slice
-       @param sliceEnergies    the energies of the slice
+       @param sliceEnergies    the energies of each slice (energies added to current values)
 
        --------------------------------------------------------------------------------------- */
 
-    void calculateBondIxn(vector<int>& atomIndices, vector<OpenMM::Vec3>& atomCoordinates,
-                          vector<double>& parameters, vector<OpenMM::Vec3>& forces,
-                          vector<double>& sliceLambdas, vector<double>& sliceEnergies);
+    void calculateBondIxns(const vector<array<int, 2>>& atomIndices, const vector<array<double, 3>>& parameters,
+                           const vector<int>& sliceStarts, const vector<OpenMM::Vec3>& atomCoordinates,
+                           const vector<array<double, 2>>& sliceLambdas, vector<OpenMM::Vec3>& forces,
+                           vector<array<double, 3>>& sliceEnergies) const;
 
 private:
    static const int   Coul = 0;
    static const int   vdW = 1;
+
+   // the number of pairs processed together by calculateSliceIxns()
+
+   static const int   PairBlockSize = 4;
+
    bool periodic;
+   SharedThreadPool* threads;
    OpenMM::Vec3 periodicBoxVectors[3];
+
+   /**---------------------------------------------------------------------------------------
+
+      Calculate the 1-4 ixns of a range of pairs belonging to a single slice, in blocks of
+      PairBlockSize pairs whose arithmetic runs as straight-line loops.
+
+      --------------------------------------------------------------------------------------- */
+
+   void calculateSliceIxns(int start, int end, const vector<array<int, 2>>& atomIndices, const vector<array<double, 3>>& parameters,
+                           const vector<OpenMM::Vec3>& atomCoordinates, const array<double, 2>& sliceLambdas,
+                           vector<OpenMM::Vec3>& forces, array<double, 3>& sliceEnergies) const;
 };
 
 } // namespace OpenMMLab
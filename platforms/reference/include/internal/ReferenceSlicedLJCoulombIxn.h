@@ -13,6 +13,8 @@
 
 #include "openmm/reference/ReferencePairIxn.h"
 #include "openmm/reference/ReferenceNeighborList.h"
+#include "internal/SharedThreadPool.h"
+#include "internal/ReferenceSlicedPME.h"
 
 using namespace std;
 using namespace OpenMM;
@@ -25,16 +27,20 @@ class ReferenceSlicedLJCoulombIxn {
 
       bool cutoff;
       bool useSwitch;
+      bool softCore;
+      vector<double> softCoreShifts, softCoreShiftDerivatives;
       bool periodic, periodicExceptions;
       bool ewald;
       bool pme, ljpme;
       const OpenMM::NeighborList* neighborList;
+      SharedThreadPool* threads;
+      vector<bool> skippedSlices;
       OpenMM::Vec3 periodicBoxVectors[3];
       double cutoffDistance, switchingDistance;
       double krf, crf;
       double alphaEwald, alphaDispersionEwald;
       int numRx, numRy, numRz;
-      int meshDim[3], dispersionMeshDim[3];
+      pme_t pmeData, dispersionPmeData;
 
       // parameter indices
 
@@ -45,9 +51,25 @@ class ReferenceSlicedLJCoulombIxn {
       static const int   Coul = 0;
       static const int   vdW = 1;
 
+      // the derivative of the Lennard-Jones energy of a soft-core slice with respect to its
+      // scaling parameter, at fixed prefactor
+
+      static const int   SoftCore = 2;
+
+      // the number of neighbor pairs processed together by calculatePairBlock()
+
+      static const int PairBlockSize = 4;
+
+      // per-particle parameters stored as separate arrays
+
+      struct ParticleArrays {
+          vector<double> charge, sigma, epsilon;
+      };
+
       /**---------------------------------------------------------------------------------------
 
-         Calculate LJ Coulomb pair ixn between two atoms
+         Calculate LJ Coulomb pair ixn between two atoms, with the options of the force as
+         template arguments
 
          @param atom1            the index of the first atom
          @param atom2            the index of the second atom
@@ -60,9 +82,113 @@ class ReferenceSlicedLJCoulombIxn {
 
          --------------------------------------------------------------------------------------- */
 
+      template <bool CUTOFF, bool SWITCH, bool SOFTCORE>
       void calculateOneIxn(int atom1, int atom2, vector<OpenMM::Vec3>& atomCoordinates, const vector<int>& atomSubsets,
-                           const vector<vector<double>>& atomParameters, const vector<vector<double>>& sliceLambdas, vector<OpenMM::Vec3>& forces,
-                           vector<vector<double>>& sliceEnergies) const;
+                           const vector<array<double, 3>>& atomParameters, const vector<array<double, 2>>& sliceLambdas, vector<OpenMM::Vec3>& forces,
+                           vector<array<double, 3>>& sliceEnergies) const;
+
+      /**---------------------------------------------------------------------------------------
+
+         Calculate the direct space Ewald ixn between two atoms, with the options of the force
+         as template arguments
+
+         @param atom1            the index of the first atom
+         @param atom2            the index of the second atom
+         @param atomCoordinates  atom coordinates
+         @param atomSubsets      atom subsets
+         @param atomParameters   atom parameters (charges, c6, c12, ...)     atomParameters[atomIndex][paramterIndex]
+         @param sliceLambda      Coulomb and LJ scaling parameters for each slice
+         @param forces           force array (forces added)
+         @param sliceEnergies    the energy of each slice
+
+         --------------------------------------------------------------------------------------- */
+
+      template <bool SWITCH, bool LJPME>
+      void calculateOneEwaldIxn(int atom1, int atom2, vector<OpenMM::Vec3>& atomCoordinates, const vector<int>& atomSubsets,
+                                const vector<array<double, 3>>& atomParameters, const vector<array<double, 2>>& sliceLambdas, vector<OpenMM::Vec3>& forces,
+                                vector<array<double, 3>>& sliceEnergies) const;
+
+      /**---------------------------------------------------------------------------------------
+
+         Calculate the reciprocal space ixns of the Ewald method, splitting the k-vectors among
+         the threads of the thread pool, if one has been set
+
+         --------------------------------------------------------------------------------------- */
+
+      void calculateEwaldReciprocalIxns(int numberOfAtoms, vector<OpenMM::Vec3>& atomCoordinates, int numberOfSubsets,
+                                        const vector<int>& atomSubsets, const vector<array<double, 3>>& atomParameters,
+                                        const vector<array<double, 2>>& sliceLambdas, vector<OpenMM::Vec3>& forces,
+                                        vector<array<double, 3>>& sliceEnergies) const;
+
+      /**---------------------------------------------------------------------------------------
+
+         Calculate the direct space ixns of all pairs, splitting them among the threads of the
+         thread pool, if one has been set, with separate force and energy buffers per thread
+
+         --------------------------------------------------------------------------------------- */
+
+      void calculateDirectIxns(int numberOfAtoms, vector<OpenMM::Vec3>& atomCoordinates, const vector<int>& atomSubsets,
+                               const vector<array<double, 3>>& atomParameters, const vector<array<double, 2>>& sliceLambdas,
+                               const vector<int>& exclusionStarts, const vector<int>& exclusionAtoms, vector<OpenMM::Vec3>& forces, vector<array<double, 3>>& sliceEnergies) const;
+
+      /**---------------------------------------------------------------------------------------
+
+         Calculate the direct space ixns of the pairs assigned to one of several threads.  The
+         options of the force are template arguments, so that each variant is compiled without
+         testing them for every pair.
+
+         --------------------------------------------------------------------------------------- */
+
+      template <bool CUTOFF, bool SWITCH, bool SOFTCORE, bool EWALD, bool LJPME>
+      void calculateDirectIxnRange(int threadIndex, int numThreads, int numberOfAtoms, vector<OpenMM::Vec3>& atomCoordinates,
+                                   const vector<int>& atomSubsets, const vector<array<double, 3>>& atomParameters,
+                                   const ParticleArrays& particles, const vector<array<double, 2>>& sliceLambdas,
+                                   const vector<int>& exclusionStarts, const vector<int>& exclusionAtoms, vector<OpenMM::Vec3>& forces,
+                                   vector<array<double, 3>>& sliceEnergies) const;
+
+      /**---------------------------------------------------------------------------------------
+
+         Get whether the slice of a pair of atoms is skipped (see setSkippedSlices())
+
+         --------------------------------------------------------------------------------------- */
+
+      bool isSkipped(int atom1, int atom2, const vector<int>& atomSubsets) const;
+
+      typedef void (ReferenceSlicedLJCoulombIxn::*DirectIxnRange)(int, int, int, vector<OpenMM::Vec3>&, const vector<int>&,
+                                                                  const vector<array<double, 3>>&, const ParticleArrays&,
+                                                                  const vector<array<double, 2>>&, const vector<int>&, const vector<int>&,
+                                                                  vector<OpenMM::Vec3>&, vector<array<double, 3>>&) const;
+
+      /**---------------------------------------------------------------------------------------
+
+         Select the variant of calculateDirectIxnRange() that matches the options of the force
+
+         --------------------------------------------------------------------------------------- */
+
+      DirectIxnRange selectDirectIxnRange() const;
+
+      /**---------------------------------------------------------------------------------------
+
+         Calculate the direct space ixns of up to PairBlockSize neighbor pairs at once.  The
+         pairs are gathered into fixed-size arrays, so that the arithmetic runs as straight-line
+         loops over the block that the compiler can vectorize.
+
+         @param pairs            the first pair of the block
+         @param numPairs         the number of pairs in the block
+         @param atomCoordinates  atom coordinates
+         @param atomSubsets      atom subsets
+         @param particles        the per-particle parameters
+         @param sliceLambda      Coulomb and LJ scaling parameters for each slice
+         @param forces           force array (forces added)
+         @param sliceEnergies    the energy of each slice
+
+         --------------------------------------------------------------------------------------- */
+
+      template <bool SWITCH, bool SOFTCORE, bool EWALD>
+      void calculatePairBlock(const OpenMM::AtomPair* pairs, int numPairs, const vector<OpenMM::Vec3>& atomCoordinates,
+                              const vector<int>& atomSubsets, const ParticleArrays& particles,
+                              const vector<array<double, 2>>& sliceLambdas, vector<OpenMM::Vec3>& forces,
+                              vector<array<double, 3>>& sliceEnergies) const;
 
 
    public:
@@ -105,6 +231,21 @@ class ReferenceSlicedLJCoulombIxn {
 
       void setUseSwitchingFunction(double distance);
 
+      /**---------------------------------------------------------------------------------------
+
+         Set the force to use a soft-core Lennard-Jones potential in some slices, in which
+         (r/sigma)^6 is replaced by shift + (r/sigma)^6.  The derivative of the Lennard-Jones
+         energy of each slice with respect to its scaling parameter, apart from the scaling
+         parameter itself as a prefactor, is then accumulated in sliceEnergies[slice][SoftCore].
+
+         @param shifts            the shift of each slice, which is zero for regular slices
+         @param shiftDerivatives  the derivative of each shift with respect to the scaling
+                                  parameter of its slice
+
+         --------------------------------------------------------------------------------------- */
+
+      void setUseSoftCore(const vector<double>& shifts, const vector<double>& shiftDerivatives);
+
       /**---------------------------------------------------------------------------------------
 
          Set the force to use periodic boundary conditions.  This requires that a cutoff has
@@ -136,22 +277,22 @@ class ReferenceSlicedLJCoulombIxn {
          Set the force to use Particle-Mesh Ewald (PME) summation.
 
          @param alpha    the Ewald separation parameter
-         @param gridSize the dimensions of the mesh
+         @param pmeData  the PME data, created with pme_init() by the caller, who owns it
 
          --------------------------------------------------------------------------------------- */
 
-      void setUsePME(double alpha, int meshSize[3]);
+      void setUsePME(double alpha, pme_t pmeData);
 
       /**---------------------------------------------------------------------------------------
 
          Set the force to use Particle-Mesh Ewald (PME) summation for dispersion.
 
          @param dalpha    the dispersion Ewald separation parameter
-         @param dgridSize the dimensions of the dispersion mesh
+         @param dpmeData  the dispersion PME data, created with pme_init() by the caller, who owns it
 
          --------------------------------------------------------------------------------------- */
 
-      void setUseLJPME(double dalpha, int dmeshSize[3]);
+      void setUseLJPME(double dalpha, pme_t dpmeData);
 
       /**---------------------------------------------------------------------------------------
 
@@ -161,6 +302,29 @@ class ReferenceSlicedLJCoulombIxn {
 
       void setPeriodicExceptions(bool periodic);
 
+      /**---------------------------------------------------------------------------------------
+
+         Set the slices whose direct space pair ixns are skipped.  This serves to drop the
+         slices whose scaling parameters are all zero when neither their energies nor their
+         derivatives are needed, since they exert no forces.  Exclusion corrections and
+         reciprocal space are not affected.
+
+         @param skipped  whether each slice is skipped
+
+         --------------------------------------------------------------------------------------- */
+
+      void setSkippedSlices(const vector<bool>& skipped);
+
+      /**---------------------------------------------------------------------------------------
+
+         Set a thread pool for computing the direct space pair ixns in parallel.
+
+         @param pool  the thread pool to use
+
+         --------------------------------------------------------------------------------------- */
+
+      void setThreadPool(SharedThreadPool& pool);
+
       /**---------------------------------------------------------------------------------------
 
          Calculate LJ Coulomb pair ixn
@@ -170,8 +334,9 @@ class ReferenceSlicedLJCoulombIxn {
          @param atomSubsets      atom subsets
          @param atomParameters   atom parameters (charges, c6, c12, ...)     atomParameters[atomIndex][paramterIndex]
          @param sliceLambda      Coulomb and LJ scaling parameters for each slice
-         @param exclusions       atom exclusion indices
-                                 exclusions[atomIndex] contains the list of exclusions for that atom
+         @param exclusionStarts  the exclusions of atom i are exclusionAtoms[exclusionStarts[i]] to
+                                 exclusionAtoms[exclusionStarts[i+1]-1], in increasing order
+         @param exclusionAtoms   the excluded atoms of all atoms, stored contiguously
          @param forces           force array (forces added)
          @param sliceEnergies    the energy of each slice
          @param includeDirect      true if direct space interactions should be included
@@ -180,8 +345,8 @@ class ReferenceSlicedLJCoulombIxn {
          --------------------------------------------------------------------------------------- */
 
       void calculatePairIxn(int numberOfAtoms, vector<OpenMM::Vec3>& atomCoordinates, int numberOfSubsets, const vector<int>& atomSubsets,
-                           const vector<vector<double>>& atomParameters, const vector<vector<double>>& sliceLambdas, const vector<set<int> >& exclusions,
-                            vector<OpenMM::Vec3>& forces, vector<vector<double>>& sliceEnergies, bool includeDirect, bool includeReciprocal) const;
+                           const vector<array<double, 3>>& atomParameters, const vector<array<double, 2>>& sliceLambdas, const vector<int>& exclusionStarts, const vector<int>& exclusionAtoms,
+                            vector<OpenMM::Vec3>& forces, vector<array<double, 3>>& sliceEnergies, bool includeDirect, bool includeReciprocal) const;
 
 private:
       /**---------------------------------------------------------------------------------------
@@ -193,8 +358,9 @@ private:
          @param atomSubsets      atom subsets
          @param atomParameters   atom parameters (charges, c6, c12, ...)     atomParameters[atomIndex][paramterIndex]
          @param sliceLambda      Coulomb and LJ scaling parameters for each slice
-         @param exclusions       atom exclusion indices
-                                 exclusions[atomIndex] contains the list of exclusions for that atom
+         @param exclusionStarts  the exclusions of atom i are exclusionAtoms[exclusionStarts[i]] to
+                                 exclusionAtoms[exclusionStarts[i+1]-1], in increasing order
+         @param exclusionAtoms   the excluded atoms of all atoms, stored contiguously
          @param forces           force array (forces added)
          @param sliceEnergies    the energy of each slice
          @param includeDirect      true if direct space interactions should be included
@@ -203,8 +369,8 @@ private:
          --------------------------------------------------------------------------------------- */
 
       void calculateEwaldIxn(int numberOfAtoms, vector<OpenMM::Vec3>& atomCoordinates, int numberOfSubsets, const vector<int>& atomSubsets,
-                           const vector<vector<double>>& atomParameters, const vector<vector<double>>& sliceLambdas, const vector<set<int> >& exclusions,
-                           vector<OpenMM::Vec3>& forces, vector<vector<double>>& sliceEnergies, bool includeDirect, bool includeReciprocal) const;
+                           const vector<array<double, 3>>& atomParameters, const vector<array<double, 2>>& sliceLambdas, const vector<int>& exclusionStarts, const vector<int>& exclusionAtoms,
+                           vector<OpenMM::Vec3>& forces, vector<array<double, 3>>& sliceEnergies, bool includeDirect, bool includeReciprocal) const;
 };
 
 } // namespace OpenMM
@@ -12,8 +12,10 @@
  * -------------------------------------------------------------------------- */
 
 #include "openmm/Vec3.h"
+#include "internal/SharedThreadPool.h"
 #include "internal/windowsExportOpenMMLab.h"
 #include <vector>
+#include <array>
 
 using namespace std;
 using namespace OpenMM;
@@ -64,11 +66,11 @@ int OPENMM_EXPORT_OPENMM_LAB
 pme_exec(pme_t pme,
          const vector<OpenMM::Vec3>& atomCoordinates,
          const vector<int>& atomSubsets,
-         const vector<vector<double>>& sliceLambdas,
+         const vector<array<double, 2>>& sliceLambdas,
          vector<OpenMM::Vec3>& forces,
          const vector<double>& charges,
          const OpenMM::Vec3 periodicBoxVectors[3],
-         vector<vector<double>>& sliceEnergies);
+         vector<array<double, 3>>& sliceEnergies);
 
 
 /**
@@ -87,15 +89,21 @@ int OPENMM_EXPORT_OPENMM_LAB
 pme_exec_dpme(pme_t pme,
          const vector<OpenMM::Vec3>& atomCoordinates,
          const vector<int>& atomSubsets,
-         const vector<vector<double>>& sliceLambdas,
+         const vector<array<double, 2>>& sliceLambdas,
          vector<OpenMM::Vec3>& forces,
          const vector<double>& c6s,
          const OpenMM::Vec3 periodicBoxVectors[3],
-         vector<vector<double>>& sliceEnergies);
+         vector<array<double, 3>>& sliceEnergies);
 
 
 
 
+/* Split the spreading, convolution and interpolation among the threads of a pool, and
+ * run the FFTs with the same number of threads.  Passing NULL runs everything serially.
+ */
+int OPENMM_EXPORT_OPENMM_LAB
+pme_set_thread_pool(pme_t pme, SharedThreadPool* threads);
+
 /* Release all memory in pme structure */
 int OPENMM_EXPORT_OPENMM_LAB
 pme_destroy(pme_t    pme);
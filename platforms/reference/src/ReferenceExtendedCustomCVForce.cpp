@@ -9,40 +9,140 @@
  * -------------------------------------------------------------------------- */
 
 #include "ReferenceExtendedCustomCVForce.h"
+#include "internal/ExtendedCustomCVForceImpl.h"
 #include "openmm/reference/ReferencePlatform.h"
 #include "openmm/reference/ReferenceTabulatedFunction.h"
 #include "lepton/CustomFunction.h"
 #include "lepton/ParsedExpression.h"
 #include "lepton/Parser.h"
-#include "lepton/Operation.h"
+#include <algorithm>
+#include <cmath>
 
 using namespace OpenMMLab;
 using namespace OpenMM;
 using namespace Lepton;
 using namespace std;
 
-ReferenceExtendedCustomCVForce::ReferenceExtendedCustomCVForce(const ExtendedCustomCVForce& force) {
+// This class allows us to update tabulated functions without having to recompile expressions
+// that use them.
+namespace {
+class TabulatedFunctionWrapper : public CustomFunction {
+public:
+    TabulatedFunctionWrapper(vector<CustomFunction*>& tabulatedFunctions, int index) :
+            tabulatedFunctions(tabulatedFunctions), index(index) {
+    }
+    int getNumArguments() const {
+        return tabulatedFunctions[index]->getNumArguments();
+    }
+    double evaluate(const double* arguments) const {
+        return tabulatedFunctions[index]->evaluate(arguments);
+    }
+    double evaluateDerivative(const double* arguments, const int* derivOrder) const {
+        return tabulatedFunctions[index]->evaluateDerivative(arguments, derivOrder);
+    }
+    CustomFunction* clone() const {
+        return new TabulatedFunctionWrapper(tabulatedFunctions, index);
+    }
+private:
+    vector<CustomFunction*>& tabulatedFunctions;
+    int index;
+};
+}
+
+ReferenceExtendedCustomCVForce::ReferenceExtendedCustomCVForce(const ExtendedCustomCVForce& force, SharedThreadPool* threads,
+                                                               PlacedCollectiveVariables* placed) : lastDepositionStep(0), threads(threads), placed(placed) {
     for (int i = 0; i < force.getNumCollectiveVariables(); i++)
         variableNames.push_back(force.getCollectiveVariableName(i));
+
+    // The batches follow the other variables, both in the force groups of the inner context
+    // and in the list of variables.  Their dummy particles follow the particles of the System
+    // and the shared particles.
+
+    int offset = force.getNumSharedParticles();
+    for (int i = 0; i < force.getNumCollectiveVariableBatches(); i++) {
+        const vector<string>& names = force.getCollectiveVariableBatchNames(i);
+        batchGroups.push_back(force.getNumCollectiveVariables()+i);
+        batchOffsets.push_back(offset);
+        batchFirstVariables.push_back(variableNames.size());
+        batchSizes.push_back(names.size());
+        variableNames.insert(variableNames.end(), names.begin(), names.end());
+        offset += names.size()+1;
+    }
+    batchDerivs.resize(batchGroups.size());
     for (int i = 0; i < force.getNumEnergyParameterDerivatives(); i++)
         paramDerivNames.push_back(force.getEnergyParameterDerivativeName(i));
+    for (int i = 0; i < force.getNumGlobalParameters(); i++)
+        globalParameterNames.push_back(force.getGlobalParameterName(i));
+    updateRadialBasisFunctions(force);
+    updateCustomSummations(force);
+    updateCollectiveVariableIntervals(force);
+    int numCVs = force.getNumCollectiveVariables();
+    int numVariables = variableNames.size();
+    cvSteps.resize(numCVs);
+    cvHasValue.resize(numCVs, false);
+    cvPlaced.resize(numCVs, false);
+    if (placed != NULL)
+        for (int i : placed->indices)
+            cvPlaced[i] = true;
+    cvValues.resize(numVariables);
+    history.resize(force.getCollectiveVariableHistorySize(), numVariables);
+    cvForces.resize(numCVs);
+    cvDerivs.resize(numCVs);
+    dEdV.resize(numVariables);
 
     // Create custom functions for the tabulated functions.
 
     map<string, CustomFunction*> functions;
-    for (int i = 0; i < (int) force.getNumTabulatedFunctions(); i++)
-        functions[force.getTabulatedFunctionName(i)] = createReferenceTabulatedFunction(force.getTabulatedFunction(i));
+    tabulatedFunctions.resize(force.getNumTabulatedFunctions(), NULL);
+    for (int i = 0; i < force.getNumTabulatedFunctions(); i++) {
+        tabulatedFunctions[i] = createReferenceTabulatedFunction(force.getTabulatedFunction(i));
+        functions[force.getTabulatedFunctionName(i)] = new TabulatedFunctionWrapper(tabulatedFunctions, i);
+    }
 
-    // Create the expressions.
+    // Create the expressions.  They are compiled once and read their variables from fixed
+    // locations, so that evaluating them involves no lookups by name.
 
-    ParsedExpression energyExpr = Parser::parse(force.getEnergyFunction(), functions);
-    energyExpression = energyExpr.createProgram();
+    ParsedExpression energyExpr = Parser::parse(force.getEnergyFunction(), functions).optimize();
+    energyExpression = energyExpr.createCompiledExpression();
     variableDerivExpressions.clear();
     for (auto& name : variableNames)
-        variableDerivExpressions.push_back(energyExpr.differentiate(name).optimize().createProgram());
+        variableDerivExpressions.push_back(energyExpr.differentiate(name).optimize().createCompiledExpression());
     paramDerivExpressions.clear();
     for (auto& name : paramDerivNames)
-        paramDerivExpressions.push_back(energyExpr.differentiate(name).optimize().createProgram());
+        paramDerivExpressions.push_back(energyExpr.differentiate(name).optimize().createCompiledExpression());
+    rbfDerivExpressions.clear();
+    for (auto& name : rbfNames)
+        rbfDerivExpressions.push_back(energyExpr.differentiate(name).optimize().createCompiledExpression());
+    summationDerivExpressions.clear();
+    for (auto& name : summationNames)
+        summationDerivExpressions.push_back(energyExpr.differentiate(name).optimize().createCompiledExpression());
+    globalValues.resize(globalParameterNames.size());
+    rbfValues.resize(rbfNames.size());
+    summationValues.resize(summationNames.size());
+    map<string, double*> variableLocations;
+    for (int i = 0; i < globalParameterNames.size(); i++)
+        variableLocations[globalParameterNames[i]] = &globalValues[i];
+    for (int i = 0; i < numVariables; i++)
+        variableLocations[variableNames[i]] = &cvValues[i];
+    for (int i = 0; i < rbfNames.size(); i++)
+        variableLocations[rbfNames[i]] = &rbfValues[i];
+    for (int i = 0; i < summationNames.size(); i++)
+        variableLocations[summationNames[i]] = &summationValues[i];
+    energyExpression.setVariableLocations(variableLocations);
+    for (CompiledExpression& expr : variableDerivExpressions)
+        expr.setVariableLocations(variableLocations);
+    for (CompiledExpression& expr : paramDerivExpressions)
+        expr.setVariableLocations(variableLocations);
+    for (CompiledExpression& expr : rbfDerivExpressions)
+        expr.setVariableLocations(variableLocations);
+    for (CompiledExpression& expr : summationDerivExpressions)
+        expr.setVariableLocations(variableLocations);
+    depositionIntervals.resize(summationNames.size());
+    depositionExpressions.resize(summationNames.size());
+    for (int i = 0; i < summationNames.size(); i++) {
+        depositionIntervals[i] = force.getCustomSummationDepositionInterval(i);
+        depositionExpressions[i] = ExtendedCustomCVForceImpl::createDepositionExpressions(force, i, functions, variableLocations);
+    }
 
     // Delete the custom functions.
 
@@ -50,78 +150,342 @@ ReferenceExtendedCustomCVForce::ReferenceExtendedCustomCVForce(const ExtendedCus
         delete function.second;
 }
 
-static void replaceFunctionsInExpression(map<string, CustomFunction*>& functions, ExpressionProgram& expression) {
-    for (int i = 0; i < expression.getNumOperations(); i++) {
-        if (expression.getOperation(i).getId() == Operation::CUSTOM) {
-            const Operation::Custom& op = dynamic_cast<const Operation::Custom&>(expression.getOperation(i));
-            expression.setOperation(i, new Operation::Custom(op.getName(), functions[op.getName()]->clone(), op.getDerivOrder()));
-        }
+void ReferenceExtendedCustomCVForce::updateTabulatedFunctions(const ExtendedCustomCVForce& force) {
+    for (int i = 0; i < force.getNumTabulatedFunctions(); i++) {
+        if (tabulatedFunctions[i] != NULL)
+            delete tabulatedFunctions[i];
+        tabulatedFunctions[i] = createReferenceTabulatedFunction(force.getTabulatedFunction(i));
     }
 }
 
-void ReferenceExtendedCustomCVForce::updateTabulatedFunctions(const ExtendedCustomCVForce& force) {
-    // Create custom functions for the tabulated functions.
-
-    map<string, CustomFunction*> functions;
-    for (int i = 0; i < (int) force.getNumTabulatedFunctions(); i++)
-        functions[force.getTabulatedFunctionName(i)] = createReferenceTabulatedFunction(force.getTabulatedFunction(i));
+void ReferenceExtendedCustomCVForce::updateRadialBasisFunctions(const ExtendedCustomCVForce& force) {
+    int numRBFs = force.getNumRadialBasisFunctions();
+    rbfNames.resize(numRBFs);
+    rbfVariables.resize(numRBFs);
+    rbfTypes.resize(numRBFs);
+    rbfShapeParameters.resize(numRBFs);
+    rbfCenters.resize(numRBFs);
+    rbfWeights.resize(numRBFs);
+    rbfGradients.resize(numRBFs);
+    for (int i = 0; i < numRBFs; i++) {
+        vector<string> variables;
+        force.getRadialBasisFunctionParameters(i, rbfNames[i], rbfTypes[i], rbfShapeParameters[i], variables, rbfCenters[i], rbfWeights[i]);
+        rbfVariables[i].clear();
+        for (auto& variable : variables)
+            rbfVariables[i].push_back(find(variableNames.begin(), variableNames.end(), variable)-variableNames.begin());
+    }
+}
 
-    // Replace tabulated functions in the expressions.
+void ReferenceExtendedCustomCVForce::updateCustomSummations(const ExtendedCustomCVForce& force) {
+    // Clones are cheap and are evaluated with the backends of the original summations.  The
+    // update makes the terms added since the latest update of the original effective.  The
+    // deposited terms are added again after those of the original.
 
-    replaceFunctionsInExpression(functions, energyExpression);
-    for (auto& expression : variableDerivExpressions)
-        replaceFunctionsInExpression(functions, expression);
-    for (auto& expression : paramDerivExpressions)
-        replaceFunctionsInExpression(functions, expression);
+    for (auto summation : summations)
+        delete summation;
+    int numSummations = force.getNumCustomSummations();
+    summationNames.resize(numSummations);
+    summationVariables.resize(numSummations);
+    summations.resize(numSummations);
+    summationGradients.resize(numSummations);
+    depositedTerms.resize(numSummations);
+    for (int i = 0; i < numSummations; i++) {
+        summationNames[i] = force.getCustomSummationName(i);
+        summationVariables[i].clear();
+        for (auto& variable : force.getCustomSummationVariables(i))
+            summationVariables[i].push_back(find(variableNames.begin(), variableNames.end(), variable)-variableNames.begin());
+        summations[i] = force.getCustomSummation(i).clone();
+        for (auto& term : depositedTerms[i])
+            summations[i]->addTerm(term);
+        summations[i]->update();
+    }
+}
 
-    // Delete the custom functions.
+void ReferenceExtendedCustomCVForce::updateCollectiveVariableIntervals(const ExtendedCustomCVForce& force) {
+    cvIntervals.resize(force.getNumCollectiveVariables());
+    for (int i = 0; i < cvIntervals.size(); i++)
+        cvIntervals[i] = force.getCollectiveVariableInterval(i);
+}
 
-    for (auto& function : functions)
-        delete function.second;
+/**
+ * Compute phi(s) and (dphi/dr)/r for a radial basis function, given e^2 and r^2.
+ */
+static void computeBasisFunction(ExtendedCustomCVForce::RadialBasisFunctionType type, double shape2, double r2, double& phi, double& dPhi) {
+    double s2 = shape2*r2;
+    if (type == ExtendedCustomCVForce::Gaussian) {
+        phi = exp(-s2);
+        dPhi = -2*shape2*phi;
+    }
+    else if (type == ExtendedCustomCVForce::Multiquadric) {
+        phi = sqrt(1+s2);
+        dPhi = shape2/phi;
+    }
+    else if (s2 > 0) {
+        double logS2 = log(s2);
+        phi = 0.5*s2*logS2;
+        dPhi = shape2*(logS2+1);
+    }
+    else
+        phi = dPhi = 0;
 }
 
 ReferenceExtendedCustomCVForce::~ReferenceExtendedCustomCVForce() {
+    for (auto function : tabulatedFunctions)
+        if (function != NULL)
+            delete function;
+    for (auto summation : summations)
+        delete summation;
+}
+
+bool ReferenceExtendedCustomCVForce::isCurrent(int index, long long step) const {
+    return (cvIntervals[index] > 1 && cvHasValue[index] && step >= cvSteps[index] && step < cvSteps[index]+cvIntervals[index]);
+}
+
+bool ReferenceExtendedCustomCVForce::needsEvaluation(long long step) const {
+    if (batchGroups.size() > 0)
+        return true;
+    for (int i = 0; i < cvIntervals.size(); i++)
+        if (!cvPlaced[i] && !isCurrent(i, step))
+            return true;
+    return false;
+}
+
+void ReferenceExtendedCustomCVForce::setBatchDisplacements(ContextImpl& innerContext, int numParticles, int batch, bool useDerivatives) {
+    ReferencePlatform::PlatformData* data = reinterpret_cast<ReferencePlatform::PlatformData*>(innerContext.getPlatformData());
+    vector<Vec3>& innerPositions = *((vector<Vec3>*) data->positions);
+    int origin = numParticles+batchOffsets[batch];
+    for (int i = 0; i < batchSizes[batch]; i++)
+        innerPositions[origin+1+i][0] = innerPositions[origin][0]+(useDerivatives ? dEdV[batchFirstVariables[batch]+i] : 1.0);
+}
+
+void ReferenceExtendedCustomCVForce::evaluateBatches(ContextImpl& innerContext, int numParticles, ExtendedCustomCVForceCounters& counters) {
+    // With unit displacements, the value of each variable is minus the x force on its particle.
+
+    ReferencePlatform::PlatformData* data = reinterpret_cast<ReferencePlatform::PlatformData*>(innerContext.getPlatformData());
+    vector<Vec3>& innerForces = *((vector<Vec3>*) data->forces);
+    for (int i = 0; i < batchGroups.size(); i++) {
+        setBatchDisplacements(innerContext, numParticles, i, false);
+        innerContext.calcForcesAndEnergy(true, false, 1<<batchGroups[i]);
+        counters.innerEvaluations++;
+        int origin = numParticles+batchOffsets[i];
+        for (int j = 0; j < batchSizes[i]; j++)
+            cvValues[batchFirstVariables[i]+j] = -innerForces[origin+1+j][0];
+    }
 }
 
-void ReferenceExtendedCustomCVForce::calculateIxn(ContextImpl& innerContext, vector<Vec3>& atomCoordinates,
-                                          const map<string, double>& globalParameters, vector<Vec3>& forces,
-                                          double* totalEnergy, map<string, double>& energyParamDerivs) const {
+void ReferenceExtendedCustomCVForce::readPlacedVariables(int numParticles, bool includeForces) {
+    // The placed variables were evaluated in another thread while the inner context evaluated
+    // the others.  Those evaluated without forces contribute none.
+
+    if (placed == NULL)
+        return;
+    placed->wait();
+    for (int i = 0; i < placed->indices.size(); i++) {
+        int index = placed->indices[i];
+        cvValues[index] = placed->values[i];
+        if (!includeForces)
+            continue;
+        if (placed->forces[i].empty())
+            cvForces[index].assign(numParticles, Vec3());
+        else
+            cvForces[index] = placed->forces[i];
+    }
+}
+
+void ReferenceExtendedCustomCVForce::getCollectiveVariableValues(ContextImpl& innerContext, int numParticles, long long step, vector<double>& values,
+                                                                 ExtendedCustomCVForceCounters& counters) {
+    int numCVs = cvIntervals.size();
+    values.resize(variableNames.size());
+    for (int i = 0; i < numCVs; i++) {
+        if (cvPlaced[i])
+            continue;
+        if (isCurrent(i, step))
+            values[i] = cvValues[i];
+        else {
+            values[i] = innerContext.calcForcesAndEnergy(false, true, 1<<i);
+            counters.innerEvaluations++;
+        }
+    }
+    evaluateBatches(innerContext, numParticles, counters);
+    readPlacedVariables(numParticles, false);
+    for (int i = 0; i < numCVs; i++)
+        if (cvPlaced[i])
+            values[i] = cvValues[i];
+    for (int i = numCVs; i < values.size(); i++)
+        values[i] = cvValues[i];
+}
+
+void ReferenceExtendedCustomCVForce::depositSummationTerms(long long step) {
+    // A step is only deposited once, however many times it is evaluated.
+
+    if (step <= 0 || step == lastDepositionStep)
+        return;
+    lastDepositionStep = step;
+    for (int i = 0; i < depositionIntervals.size(); i++) {
+        if (depositionIntervals[i] == 0 || step%depositionIntervals[i] != 0)
+            continue;
+        vector<double> term;
+        for (CompiledExpression& expr : depositionExpressions[i])
+            term.push_back(expr.evaluate());
+        depositedTerms[i].push_back(term);
+        summations[i]->addTerm(term);
+        summations[i]->update();
+    }
+}
+
+void ReferenceExtendedCustomCVForce::evaluateInnerVariables(ContextImpl& innerContext, int numParticles, vector<double>& values,
+                                                            ExtendedCustomCVForceCounters& counters) {
+    int numCVs = cvIntervals.size();
+    values.assign(variableNames.size(), 0.0);
+    for (int i = 0; i < numCVs; i++) {
+        if (cvPlaced[i])
+            continue;
+        values[i] = innerContext.calcForcesAndEnergy(false, true, 1<<i);
+        counters.innerEvaluations++;
+    }
+    evaluateBatches(innerContext, numParticles, counters);
+    for (int i = numCVs; i < values.size(); i++)
+        values[i] = cvValues[i];
+}
+
+void ReferenceExtendedCustomCVForce::addChainRuleForces(int numParticles, vector<Vec3>& forces) {
+    // Every thread takes a contiguous block of particles and adds the forces of one variable
+    // at a time, in the same order as a serial loop, so the result does not depend on the
+    // number of threads.  The components are traversed as a flat array, which the compiler
+    // can vectorize.
+
+    int numCVs = cvIntervals.size();
+    auto addBlock = [&] (int thread, int start, int end) {
+        double* total = &forces[0][0];
+        for (int i = 0; i < numCVs; i++) {
+            const double* partial = &cvForces[i][0][0];
+            double scale = dEdV[i];
+            for (int k = 3*start; k < 3*end; k++)
+                total[k] += partial[k]*scale;
+        }
+    };
+    if (numCVs == 0 || numParticles == 0)
+        return;
+    if (threads == NULL)
+        addBlock(0, 0, numParticles);
+    else
+        threads->parallelFor(numParticles, addBlock);
+}
+
+void ReferenceExtendedCustomCVForce::calculateIxn(ContextImpl& innerContext, long long step, vector<Vec3>& atomCoordinates,
+                                          const vector<double>& globalParameters, vector<Vec3>& forces,
+                                          double* totalEnergy, map<string, double>& energyParamDerivs,
+                                          ExtendedCustomCVForceCounters& counters) {
     // Compute the collective variables, and their derivatives with respect to particle positions.
+    // A variable whose evaluation interval has not elapsed keeps the results of its latest evaluation.
+    // Variables with an interval of 1 are evaluated at every call, even if the step is the same.
 
-    int numCVs = variableNames.size();
+    int numCVs = cvIntervals.size();
+    int numVariables = variableNames.size();
     ReferencePlatform::PlatformData* data = reinterpret_cast<ReferencePlatform::PlatformData*>(innerContext.getPlatformData());
     vector<Vec3>& innerForces = *((vector<Vec3>*) data->forces);
     map<string, double>& innerDerivs = *((map<string, double>*) data->energyParameterDerivatives);
-    vector<double> cvValues;
-    vector<vector<Vec3> > cvForces;
-    vector<map<string, double> > cvDerivs;
     for (int i = 0; i < numCVs; i++) {
-        cvValues.push_back(innerContext.calcForcesAndEnergy(true, true, 1<<i));
-        cvForces.push_back(innerForces);
-        cvDerivs.push_back(innerDerivs);
+        if (cvPlaced[i] || isCurrent(i, step))
+            continue;
+        cvValues[i] = innerContext.calcForcesAndEnergy(true, true, 1<<i);
+        counters.innerEvaluations++;
+        // The inner context clears its forces at the start of every evaluation, so they can be
+        // swapped out instead of copied.
+
+        cvForces[i].resize(innerForces.size());
+        cvForces[i].swap(innerForces);
+        cvDerivs[i] = innerDerivs;
+        cvSteps[i] = step;
+        cvHasValue[i] = true;
     }
+    int numParticles = atomCoordinates.size();
+    evaluateBatches(innerContext, numParticles, counters);
+    readPlacedVariables(numParticles, true);
 
     // Compute the energy and forces.
 
-    int numParticles = atomCoordinates.size();
-    map<string, double> variables = globalParameters;
-    for (int i = 0; i < numCVs; i++)
-        variables[variableNames[i]] = cvValues[i];
-    if (totalEnergy != NULL)
-        *totalEnergy += energyExpression.evaluate(variables);
-    for (int i = 0; i < numCVs; i++) {
-        double dEdV = variableDerivExpressions[i].evaluate(variables);
+    copy(globalParameters.begin(), globalParameters.end(), globalValues.begin());
+
+    // Evaluate the radial basis function expansions and their gradients.
+
+    int numRBFs = rbfNames.size();
+    for (int i = 0; i < numRBFs; i++) {
+        int dimension = rbfVariables[i].size();
+        int numCenters = rbfWeights[i].size();
+        double shape2 = rbfShapeParameters[i]*rbfShapeParameters[i];
+        double value = 0;
+        vector<double>& delta = rbfDelta;
+        delta.resize(dimension);
+        rbfGradients[i].assign(dimension, 0.0);
+        for (int k = 0; k < numCenters; k++) {
+            double r2 = 0;
+            for (int j = 0; j < dimension; j++) {
+                delta[j] = cvValues[rbfVariables[i][j]]-rbfCenters[i][k*dimension+j];
+                r2 += delta[j]*delta[j];
+            }
+            double phi, dPhi;
+            computeBasisFunction(rbfTypes[i], shape2, r2, phi, dPhi);
+            value += rbfWeights[i][k]*phi;
+            for (int j = 0; j < dimension; j++)
+                rbfGradients[i][j] += rbfWeights[i][k]*dPhi*delta[j];
+        }
+        rbfValues[i] = value;
+    }
+
+    // Evaluate the custom summations and their gradients.
+
+    int numSummations = summationNames.size();
+    for (int i = 0; i < numSummations; i++) {
+        summationArgs.resize(summationVariables[i].size());
+        for (int j = 0; j < summationVariables[i].size(); j++)
+            summationArgs[j] = cvValues[summationVariables[i][j]];
+        summationValues[i] = summations[i]->evaluateWithDerivatives(summationArgs, summationGradients[i]);
+    }
+    if (totalEnergy != NULL || history.isDue(step)) {
+        double energy = energyExpression.evaluate();
+        counters.expressionEvaluations++;
+        history.record(step, cvValues, energy);
+        if (totalEnergy != NULL)
+            *totalEnergy += energy;
+    }
+    for (int i = 0; i < numVariables; i++)
+        dEdV[i] = variableDerivExpressions[i].evaluate();
+    for (int i = 0; i < numRBFs; i++) {
+        double dEdF = rbfDerivExpressions[i].evaluate();
+        for (int j = 0; j < rbfVariables[i].size(); j++)
+            dEdV[rbfVariables[i][j]] += dEdF*rbfGradients[i][j];
+    }
+    for (int i = 0; i < numSummations; i++) {
+        double dEdS = summationDerivExpressions[i].evaluate();
+        for (int j = 0; j < summationVariables[i].size(); j++)
+            dEdV[summationVariables[i][j]] += dEdS*summationGradients[i][j];
+    }
+    counters.expressionEvaluations += numVariables+numRBFs+numSummations;
+    depositSummationTerms(step);
+    addChainRuleForces(numParticles, forces);
+
+    // With displacements equal to the derivatives of the energy, the forces on the particles of
+    // the System and the parameter derivatives are those of the whole batch.
+
+    for (int i = 0; i < batchGroups.size(); i++) {
+        setBatchDisplacements(innerContext, numParticles, i, true);
+        innerContext.calcForcesAndEnergy(true, true, 1<<batchGroups[i]);
+        counters.innerEvaluations++;
         for (int j = 0; j < numParticles; j++)
-            forces[j] += cvForces[i][j]*dEdV;
+            forces[j] += innerForces[j];
+        batchDerivs[i] = innerDerivs;
     }
 
     // Compute the energy parameter derivatives.
 
     for (int i = 0; i < paramDerivExpressions.size(); i++)
-        energyParamDerivs[paramDerivNames[i]] += paramDerivExpressions[i].evaluate(variables);
-    for (int i = 0; i < numCVs; i++) {
-        double dEdV = variableDerivExpressions[i].evaluate(variables);
+        energyParamDerivs[paramDerivNames[i]] += paramDerivExpressions[i].evaluate();
+    counters.expressionEvaluations += paramDerivExpressions.size();
+    for (int i = 0; i < numCVs; i++)
         for (auto& deriv : cvDerivs[i])
-            energyParamDerivs[deriv.first] += dEdV*deriv.second;
-    }
+            energyParamDerivs[deriv.first] += dEdV[i]*deriv.second;
+    for (auto& derivs : batchDerivs)
+        for (auto& deriv : derivs)
+            energyParamDerivs[deriv.first] += deriv.second;
 }
@@ -19,11 +19,13 @@
 #include "openmm/reference/SimTKOpenMMRealType.h"
 #include "openmm/reference/ReferenceBondForce.h"
 #include "openmm/reference/ReferenceNeighborList.h"
+#include <cstdlib>
 #include <cstring>
 #include <numeric>
 #include <vector>
 #include <algorithm>
 #include <iostream>
+#include <sstream>
 
 #include "internal/ReferenceSlicedLJCoulombIxn.h"
 #include "internal/ReferenceSlicedLJCoulomb14.h"
@@ -32,6 +34,10 @@ using namespace OpenMMLab;
 using namespace OpenMM;
 using namespace std;
 
+// The neighbor list skin of SlicedNonbondedForce, as a fraction of the cutoff distance.
+
+static const double NeighborListSkin = 0.1;
+
 static vector<RealVec>& extractPositions(ContextImpl& context) {
     ReferencePlatform::PlatformData* data = reinterpret_cast<ReferencePlatform::PlatformData*>(context.getPlatformData());
     return *((vector<RealVec>*) data->positions);
@@ -60,18 +66,20 @@ static map<string, double>& extractEnergyParameterDerivatives(ContextImpl& conte
 ReferenceCalcSlicedNonbondedForceKernel::~ReferenceCalcSlicedNonbondedForceKernel() {
     if (neighborList != NULL)
         delete neighborList;
+    if (pmeData != NULL)
+        pme_destroy(pmeData);
+    if (dispersionPmeData != NULL)
+        pme_destroy(dispersionPmeData);
 }
 
 void ReferenceCalcSlicedNonbondedForceKernel::initialize(const System& system, const SlicedNonbondedForce& force) {
     numParticles = force.getNumParticles();
     numSubsets = force.getNumSubsets();
     numSlices = force.getNumSlices();
-    sliceLambdas.resize(numSlices, vector<double>(2));
+    sliceLambdas.resize(numSlices);
     sliceScalingParams.resize(numSlices, vector<ScalingParameterInfo>(2));
 
-    subsets.resize(numParticles);
-    for (int i = 0; i < numParticles; i++)
-        subsets[i] = force.getParticleSubset(i);
+    subsets = force.getParticleSubsets();
 
     set<string> requestedDerivatives;
     for (int i = 0; i < force.getNumScalingParameterDerivatives(); i++)
@@ -116,13 +124,23 @@ void ReferenceCalcSlicedNonbondedForceKernel::initialize(const System& system, c
         }
     }
 
+    // Store the exclusions contiguously, each atom's in increasing order.
+
+    exclusionStarts.resize(numParticles+1);
+    exclusionAtoms.clear();
+    for (int i = 0; i < numParticles; i++) {
+        exclusionStarts[i] = exclusionAtoms.size();
+        exclusionAtoms.insert(exclusionAtoms.end(), exclusions[i].begin(), exclusions[i].end());
+    }
+    exclusionStarts[numParticles] = exclusionAtoms.size();
+
     // Build the arrays.
 
     num14 = nb14s.size();
-    bonded14IndexArray.resize(num14, vector<int>(2));
-    bonded14ParamArray.resize(num14, vector<double>(3));
+    bonded14IndexArray.resize(num14);
+    bonded14ParamArray.resize(num14);
     bonded14SliceArray.resize(num14);
-    particleParamArray.resize(numParticles, vector<double>(4));
+    particleParamArray.resize(numParticles);
     baseParticleParams.resize(numParticles);
     baseExceptionParams.resize(num14);
     for (int i = 0; i < numParticles; ++i)
@@ -136,20 +154,42 @@ void ReferenceCalcSlicedNonbondedForceKernel::initialize(const System& system, c
         int s2 = subsets[particle2];
         bonded14SliceArray[i] = sliceIndex(s1, s2);
     }
+    sortExceptionsBySlice();
+
+    // Record the offsets of each particle and exception, and which ones each parameter affects.
+
+    particleParamOffsets.resize(numParticles);
+    exceptionParamOffsets.resize(num14);
+    auto getParamIndex = [&] (const string& param) {
+        auto paramPos = find(paramNames.begin(), paramNames.end(), param);
+        if (paramPos != paramNames.end())
+            return (int) (paramPos-paramNames.begin());
+        paramNames.push_back(param);
+        paramParticles.push_back(vector<int>());
+        paramExceptions.push_back(vector<int>());
+        return (int) paramNames.size()-1;
+    };
     for (int i = 0; i < force.getNumParticleParameterOffsets(); i++) {
         string param;
         int particle;
         double charge, sigma, epsilon;
         force.getParticleParameterOffset(i, param, particle, charge, sigma, epsilon);
-        particleParamOffsets[make_pair(param, particle)] = {charge, sigma, epsilon};
+        int paramIndex = getParamIndex(param);
+        particleParamOffsets[particle].push_back(make_pair(paramIndex, array<double, 3>{charge, sigma, epsilon}));
+        paramParticles[paramIndex].push_back(particle);
     }
     for (int i = 0; i < force.getNumExceptionParameterOffsets(); i++) {
         string param;
         int exception;
         double charge, sigma, epsilon;
         force.getExceptionParameterOffset(i, param, exception, charge, sigma, epsilon);
-        exceptionParamOffsets[make_pair(param, nb14Index[exception])] = {charge, sigma, epsilon};
+        int paramIndex = getParamIndex(param);
+        int index = nb14Index[exception];
+        exceptionParamOffsets[index].push_back(make_pair(paramIndex, array<double, 3>{charge, sigma, epsilon}));
+        paramExceptions[paramIndex].push_back(index);
     }
+    paramValues.resize(paramNames.size(), 0.0);
+    recomputeParams = true;
     nonbondedMethod = CalcSlicedNonbondedForceKernel::NonbondedMethod(force.getNonbondedMethod());
     nonbondedCutoff = force.getCutoffDistance();
     if (nonbondedMethod == NoCutoff) {
@@ -184,23 +224,73 @@ void ReferenceCalcSlicedNonbondedForceKernel::initialize(const System& system, c
     else
         exceptionsArePeriodic = force.getExceptionsUsePeriodicBoundaryConditions();
     rfDielectric = force.getReactionFieldDielectric();
+    useSoftCore = force.getUseSoftCore();
+    softCoreAlphas.resize(numSlices);
+    softCorePowers.resize(numSlices);
+    for (int i = 0; i < numSubsets; i++)
+        for (int j = i; j < numSubsets; j++) {
+            int slice = sliceIndex(i, j);
+            force.getSliceSoftCoreParameters(i, j, softCoreAlphas[slice], softCorePowers[slice]);
+        }
     if (force.getUseDispersionCorrection())
-        dispersionCoefficients = SlicedNonbondedForceImpl::calcDispersionCorrections(system, force);
+        dispersionCoefficients = dispersionTable.update(force);
     else
         dispersionCoefficients.resize(numSlices, 0.0);
+
+    // The direct space pairs are split among the threads of the pool shared by the plugin.
+
+    threads = &SharedThreadPool::getInstance();
+
+    // The PME grids and B-spline moduli depend only on the grid dimensions, which are fixed,
+    // so they are created once and reused in every evaluation.
+
+    if (nonbondedMethod == PME || nonbondedMethod == LJPME) {
+        pme_init(&pmeData, ewaldAlpha, numParticles, numSubsets, gridSize, force.getPMEInterpolationOrder(), 1);
+        pme_set_thread_pool(pmeData, threads);
+    }
+    if (nonbondedMethod == LJPME) {
+        pme_init(&dispersionPmeData, ewaldDispersionAlpha, numParticles, numSubsets, dispersionGridSize, force.getPMEInterpolationOrder(), 1);
+        pme_set_thread_pool(dispersionPmeData, threads);
+    }
 }
 
-double ReferenceCalcSlicedNonbondedForceKernel::execute(ContextImpl& context, bool includeForces, bool includeEnergy, bool includeDirect, bool includeReciprocal) {
+void ReferenceCalcSlicedNonbondedForceKernel::updateNeighborList(const vector<Vec3>& positions, const Vec3* boxVectors, bool usePeriodic) {
+    // Pairs are listed up to the cutoff plus a skin, so that the list stays valid until some atom
+    // has moved by more than half the skin.  The skin is dropped if the box is too small for it.
+
+    double skin = NeighborListSkin*nonbondedCutoff;
+    if (usePeriodic) {
+        double minSize = 2*(nonbondedCutoff+skin);
+        if (boxVectors[0][0] < minSize || boxVectors[1][1] < minSize || boxVectors[2][2] < minSize)
+            skin = 0.0;
+    }
+    bool rebuild = (skin == 0.0 || neighborListPositions.size() != numParticles);
+    for (int i = 0; i < 3 && !rebuild; i++)
+        rebuild = (usePeriodic && boxVectors[i] != neighborListBoxVectors[i]);
+    double maxDisplacement2 = 0.25*skin*skin;
+    for (int i = 0; i < numParticles && !rebuild; i++) {
+        Vec3 delta = positions[i]-neighborListPositions[i];
+        rebuild = (delta.dot(delta) > maxDisplacement2);
+    }
+    if (rebuild) {
+        computeNeighborListVoxelHash(*neighborList, numParticles, positions, exclusions, boxVectors, usePeriodic, nonbondedCutoff+skin, 0.0);
+        neighborListPositions = positions;
+        for (int i = 0; i < 3; i++)
+            neighborListBoxVectors[i] = boxVectors[i];
+    }
+}
+
+void ReferenceCalcSlicedNonbondedForceKernel::computeSliceEnergies(ContextImpl& context, vector<Vec3>& forceData,
+                                                                   bool includeDirect, bool includeReciprocal, bool applySoftCore, bool skipZeroSlices) {
     computeParameters(context);
     vector<Vec3>& posData = extractPositions(context);
-    vector<Vec3>& forceData = extractForces(context);
     ReferenceSlicedLJCoulombIxn clj;
     bool periodic = (nonbondedMethod == CutoffPeriodic);
     bool ewald  = (nonbondedMethod == Ewald);
     bool pme  = (nonbondedMethod == PME);
     bool ljpme = (nonbondedMethod == LJPME);
     if (nonbondedMethod != NoCutoff) {
-        computeNeighborListVoxelHash(*neighborList, numParticles, posData, exclusions, extractBoxVectors(context), periodic || ewald || pme || ljpme, nonbondedCutoff, 0.0);
+        updateNeighborList(posData, extractBoxVectors(context), periodic || ewald || pme || ljpme);
         clj.setUseCutoff(nonbondedCutoff, *neighborList, rfDielectric);
     }
     if (periodic || ewald || pme || ljpme) {
@@ -214,15 +304,41 @@ double ReferenceCalcSlicedNonbondedForceKernel::execute(ContextImpl& context, bo
     if (ewald)
         clj.setUseEwald(ewaldAlpha, kmax[0], kmax[1], kmax[2]);
     if (pme)
-        clj.setUsePME(ewaldAlpha, gridSize);
+        clj.setUsePME(ewaldAlpha, pmeData);
     if (ljpme){
-        clj.setUsePME(ewaldAlpha, gridSize);
-        clj.setUseLJPME(ewaldDispersionAlpha, dispersionGridSize);
+        clj.setUsePME(ewaldAlpha, pmeData);
+        clj.setUseLJPME(ewaldDispersionAlpha, dispersionPmeData);
     }
-    vector<vector<double>> sliceEnergies(numSlices, (vector<double>){0.0, 0.0});
+    sliceEnergies.assign(numSlices, {0.0, 0.0, 0.0});
     if (useSwitchingFunction)
         clj.setUseSwitchingFunction(switchingDistance);
-    clj.calculatePairIxn(numParticles, posData, numSubsets, subsets, particleParamArray, sliceLambdas, exclusions, forceData, sliceEnergies, includeDirect, includeReciprocal);
+    if (useSoftCore && applySoftCore) {
+        // The shift of a soft-core slice is alpha*(1-lambda)^power, where lambda is the
+        // Lennard-Jones scaling parameter of the slice.
+
+        vector<double> shifts(numSlices, 0.0), shiftDerivatives(numSlices, 0.0);
+        for (int slice = 0; slice < numSlices; slice++) {
+            double alpha = softCoreAlphas[slice], power = softCorePowers[slice];
+            double base = max(1.0-sliceLambdas[slice][vdW], 0.0);
+            if (alpha != 0.0) {
+                shifts[slice] = alpha*pow(base, power);
+                shiftDerivatives[slice] = -alpha*power*pow(base, power-1.0);
+            }
+        }
+        clj.setUseSoftCore(shifts, shiftDerivatives);
+    }
+    if (skipZeroSlices) {
+        // A slice whose scaling parameters are all zero exerts no forces, so its pairs are
+        // only needed for its energy or for a requested derivative.
+
+        vector<bool> skipped(numSlices);
+        for (int slice = 0; slice < numSlices; slice++)
+            skipped[slice] = (sliceLambdas[slice][Coul] == 0.0 && sliceLambdas[slice][vdW] == 0.0 &&
+                              !sliceScalingParams[slice][Coul].hasDerivative && !sliceScalingParams[slice][vdW].hasDerivative);
+        clj.setSkippedSlices(skipped);
+    }
+    clj.setThreadPool(*threads);
+    clj.calculatePairIxn(numParticles, posData, numSubsets, subsets, particleParamArray, sliceLambdas, exclusionStarts, exclusionAtoms, forceData, sliceEnergies, includeDirect, includeReciprocal);
 
     if (includeDirect) {
         ReferenceSlicedLJCoulomb14 nonbonded14;
@@ -230,11 +346,9 @@ double ReferenceCalcSlicedNonbondedForceKernel::execute(ContextImpl& context, bo
             Vec3* boxVectors = extractBoxVectors(context);
             nonbonded14.setPeriodic(boxVectors);
         }
-        for (int k = 0; k < num14; k++) {
-            int slice = bonded14SliceArray[k];
-            nonbonded14.calculateBondIxn(bonded14IndexArray[k], posData, bonded14ParamArray[k],
-                                         forceData, sliceLambdas[slice], sliceEnergies[slice]);
-        }
+        nonbonded14.setThreadPool(*threads);
+        nonbonded14.calculateBondIxns(bonded14IndexArray, bonded14ParamArray, bonded14SliceStarts, posData,
+                                      sliceLambdas, forceData, sliceEnergies);
         if (periodic || ewald || pme) {
             Vec3* boxVectors = extractBoxVectors(context);
             double volume = boxVectors[0][0]*boxVectors[1][1]*boxVectors[2][2];
@@ -242,6 +356,10 @@ double ReferenceCalcSlicedNonbondedForceKernel::execute(ContextImpl& context, bo
                 sliceEnergies[slice][vdW] += dispersionCoefficients[slice]/volume;
         }
     }
+}
+
+double ReferenceCalcSlicedNonbondedForceKernel::execute(ContextImpl& context, bool includeForces, bool includeEnergy, bool includeDirect, bool includeReciprocal) {
+    computeSliceEnergies(context, extractForces(context), includeDirect, includeReciprocal, true, !includeEnergy);
 
     double energy = 0;
     if (includeEnergy)
@@ -253,21 +371,51 @@ double ReferenceCalcSlicedNonbondedForceKernel::execute(ContextImpl& context, bo
     for (int slice = 0; slice < numSlices; slice++)
         for (int term = 0; term < 2; term++) {
             ScalingParameterInfo info = sliceScalingParams[slice][term];
-            if (info.hasDerivative)
+            if (info.hasDerivative) {
                 energyParamDerivs[info.name] += sliceEnergies[slice][term];
+                if (term == vdW)
+                    energyParamDerivs[info.name] += sliceLambdas[slice][vdW]*sliceEnergies[slice][SoftCore];
+            }
         }
 
     return energy;
 }
 
+void ReferenceCalcSlicedNonbondedForceKernel::getSliceEnergies(ContextImpl& context, bool includeDirect, bool includeReciprocal,
+                                                               vector<double>& coulombEnergies, vector<double>& ljEnergies) {
+    vector<Vec3> forceData(numParticles, Vec3());
+    computeSliceEnergies(context, forceData, includeDirect, includeReciprocal, false);
+    coulombEnergies.resize(numSlices);
+    ljEnergies.resize(numSlices);
+    for (int slice = 0; slice < numSlices; slice++) {
+        coulombEnergies[slice] = sliceEnergies[slice][Coul];
+        ljEnergies[slice] = sliceEnergies[slice][vdW];
+    }
+}
+
+void ReferenceCalcSlicedNonbondedForceKernel::getScalingParameterDerivatives(ContextImpl& context, bool includeDirect, bool includeReciprocal,
+                                                                             map<string, double>& derivatives) {
+    vector<Vec3> forceData(numParticles, Vec3());
+    computeSliceEnergies(context, forceData, includeDirect, includeReciprocal, true);
+    derivatives.clear();
+    for (int slice = 0; slice < numSlices; slice++)
+        for (int term = 0; term < 2; term++) {
+            ScalingParameterInfo info = sliceScalingParams[slice][term];
+            if (info.hasDerivative) {
+                derivatives[info.name] += sliceEnergies[slice][term];
+                if (term == vdW)
+                    derivatives[info.name] += sliceLambdas[slice][vdW]*sliceEnergies[slice][SoftCore];
+            }
+        }
+}
+
 void ReferenceCalcSlicedNonbondedForceKernel::copyParametersToContext(ContextImpl& context, const SlicedNonbondedForce& force) {
     if (force.getNumParticles() != numParticles)
         throw OpenMMException("updateParametersInContext: The number of particles has changed");
 
     // Get particle subsets.
 
-    for (int i = 0; i < numParticles; i++)
-        subsets[i] = force.getParticleSubset(i);
+    subsets = force.getParticleSubsets();
 
     // Identify which exceptions are 1-4 interactions.
 
@@ -303,12 +451,14 @@ void ReferenceCalcSlicedNonbondedForceKernel::copyParametersToContext(ContextImp
         int s2 = subsets[particle2];
         bonded14SliceArray[i] = sliceIndex(s1, s2);
     }
+    sortExceptionsBySlice();
 
     // Recompute the coefficient for the dispersion correction.
 
     SlicedNonbondedForce::NonbondedMethod method = force.getNonbondedMethod();
     if (force.getUseDispersionCorrection() && (method == SlicedNonbondedForce::CutoffPeriodic || method == SlicedNonbondedForce::Ewald || method == SlicedNonbondedForce::PME))
-        dispersionCoefficients = SlicedNonbondedForceImpl::calcDispersionCorrections(context.getSystem(), force);
+        dispersionCoefficients = dispersionTable.update(force);
+    recomputeParams = true;
 }
 
 void ReferenceCalcSlicedNonbondedForceKernel::getPMEParameters(double& alpha, int& nx, int& ny, int& nz) const {
@@ -339,49 +489,82 @@ void ReferenceCalcSlicedNonbondedForceKernel::computeParameters(ContextImpl& con
             sliceLambdas[slice][term] = info.name == "" ? 1.0 : context.getParameter(info.name);
         }
 
-    // Compute particle parameters.
+    // Find which offset parameters have changed, and update only the particles and exceptions they affect.
 
-    vector<double> charges(numParticles), sigmas(numParticles), epsilons(numParticles);
-    for (int i = 0; i < numParticles; i++) {
-        charges[i] = baseParticleParams[i][0];
-        sigmas[i] = baseParticleParams[i][1];
-        epsilons[i] = baseParticleParams[i][2];
+    vector<int> changedParams;
+    for (int i = 0; i < paramNames.size(); i++) {
+        double value = context.getParameter(paramNames[i]);
+        if (value != paramValues[i]) {
+            paramValues[i] = value;
+            changedParams.push_back(i);
+        }
     }
-    for (auto& offset : particleParamOffsets) {
-        double value = context.getParameter(offset.first.first);
-        int index = offset.first.second;
-        charges[index] += value*offset.second[0];
-        sigmas[index] += value*offset.second[1];
-        epsilons[index] += value*offset.second[2];
+    if (recomputeParams) {
+        for (int i = 0; i < numParticles; i++)
+            computeParticleParameters(i);
+        for (int i = 0; i < num14; i++)
+            computeExceptionParameters(i);
+        recomputeParams = false;
+        return;
     }
-    for (int i = 0; i < numParticles; i++) {
-        particleParamArray[i][0] = 0.5*sigmas[i];
-        particleParamArray[i][1] = 2.0*sqrt(epsilons[i]);
-        particleParamArray[i][2] = charges[i];
+    for (int param : changedParams) {
+        for (int particle : paramParticles[param])
+            computeParticleParameters(particle);
+        for (int exception : paramExceptions[param])
+            computeExceptionParameters(exception);
     }
+}
 
-    // Compute exception parameters.
-
-    charges.resize(num14);
-    sigmas.resize(num14);
-    epsilons.resize(num14);
-    for (int i = 0; i < num14; i++) {
-        charges[i] = baseExceptionParams[i][0];
-        sigmas[i] = baseExceptionParams[i][1];
-        epsilons[i] = baseExceptionParams[i][2];
+void ReferenceCalcSlicedNonbondedForceKernel::computeParticleParameters(int particle) {
+    double charge = baseParticleParams[particle][0];
+    double sigma = baseParticleParams[particle][1];
+    double epsilon = baseParticleParams[particle][2];
+    for (auto& offset : particleParamOffsets[particle]) {
+        double value = paramValues[offset.first];
+        charge += value*offset.second[0];
+        sigma += value*offset.second[1];
+        epsilon += value*offset.second[2];
     }
-    for (auto& offset : exceptionParamOffsets) {
-        double value = context.getParameter(offset.first.first);
-        int index = offset.first.second;
-        charges[index] += value*offset.second[0];
-        sigmas[index] += value*offset.second[1];
-        epsilons[index] += value*offset.second[2];
+    particleParamArray[particle][0] = 0.5*sigma;
+    particleParamArray[particle][1] = 2.0*sqrt(epsilon);
+    particleParamArray[particle][2] = charge;
+}
+
+void ReferenceCalcSlicedNonbondedForceKernel::computeExceptionParameters(int exception) {
+    double chargeProd = baseExceptionParams[exception][0];
+    double sigma = baseExceptionParams[exception][1];
+    double epsilon = baseExceptionParams[exception][2];
+    for (auto& offset : exceptionParamOffsets[exception]) {
+        double value = paramValues[offset.first];
+        chargeProd += value*offset.second[0];
+        sigma += value*offset.second[1];
+        epsilon += value*offset.second[2];
     }
-    for (int i = 0; i < num14; i++) {
-        bonded14ParamArray[i][0] = sigmas[i];
-        bonded14ParamArray[i][1] = 4.0*epsilons[i];
-        bonded14ParamArray[i][2] = charges[i];
+    int position = bonded14Positions[exception];
+    bonded14ParamArray[position][0] = sigma;
+    bonded14ParamArray[position][1] = 4.0*epsilon;
+    bonded14ParamArray[position][2] = chargeProd;
+}
+
+void ReferenceCalcSlicedNonbondedForceKernel::sortExceptionsBySlice() {
+    // Store the exceptions of each slice contiguously in bonded14IndexArray and bonded14ParamArray,
+    // keeping their relative order.  The other per-exception arrays keep the original order, which
+    // bonded14Positions maps to the new one.
+
+    vector<int> order(num14);
+    iota(order.begin(), order.end(), 0);
+    stable_sort(order.begin(), order.end(), [&] (int a, int b) { return bonded14SliceArray[a] < bonded14SliceArray[b]; });
+    vector<array<int, 2>> sortedIndices(num14);
+    bonded14Positions.resize(num14);
+    bonded14SliceStarts.assign(numSlices+1, 0);
+    for (int k = 0; k < num14; k++) {
+        sortedIndices[k] = bonded14IndexArray[order[k]];
+        bonded14Positions[order[k]] = k;
+        bonded14SliceStarts[bonded14SliceArray[order[k]]+1]++;
     }
+    for (int slice = 0; slice < numSlices; slice++)
+        bonded14SliceStarts[slice+1] += bonded14SliceStarts[slice];
+    bonded14IndexArray = sortedIndices;
 }
 
 ReferenceCalcExtendedCustomCVForceKernel::~ReferenceCalcExtendedCustomCVForceKernel() {
@@ -389,39 +572,77 @@ ReferenceCalcExtendedCustomCVForceKernel::~ReferenceCalcExtendedCustomCVForceKer
         delete ixn;
 }
 
-void ReferenceCalcExtendedCustomCVForceKernel::initialize(const System& system, const ExtendedCustomCVForce& force, ContextImpl& innerContext) {
+void ReferenceCalcExtendedCustomCVForceKernel::initialize(const System& system, const ExtendedCustomCVForce& force, ContextImpl& innerContext,
+                                                          PlacedCollectiveVariables& placed) {
     for (int i = 0; i < force.getNumGlobalParameters(); i++)
         globalParameterNames.push_back(force.getGlobalParameterName(i));
     for (int i = 0; i < force.getNumEnergyParameterDerivatives(); i++)
         energyParamDerivNames.push_back(force.getEnergyParameterDerivativeName(i));
-    ixn = new ReferenceExtendedCustomCVForce(force);
+
+    // The chain rule forces are split among the threads of the pool shared by the plugin.
+
+    threads = &SharedThreadPool::getInstance();
+    ixn = new ReferenceExtendedCustomCVForce(force, threads, &placed);
+    numParticles = system.getNumParticles();
+    hasSharedParticles = (force.getNumSharedParticles() > 0);
 }
 
 double ReferenceCalcExtendedCustomCVForceKernel::execute(ContextImpl& context, ContextImpl& innerContext, bool includeForces, bool includeEnergy) {
+    counters.evaluations++;
     copyState(context, innerContext);
     vector<Vec3>& posData = extractPositions(context);
     vector<Vec3>& forceData = extractForces(context);
     double energy = 0;
-    map<string, double> globalParameters;
-    for (auto& name : globalParameterNames)
-        globalParameters[name] = context.getParameter(name);
+    globalParameterValues.resize(globalParameterNames.size());
+    for (int i = 0; i < globalParameterNames.size(); i++)
+        globalParameterValues[i] = context.getParameter(globalParameterNames[i]);
     map<string, double>& energyParamDerivs = extractEnergyParameterDerivatives(context);
-    ixn->calculateIxn(innerContext, posData, globalParameters, forceData, includeEnergy ? &energy : NULL, energyParamDerivs);
+    ixn->calculateIxn(innerContext, context.getStepCount(), posData, globalParameterValues, forceData, includeEnergy ? &energy : NULL, energyParamDerivs, counters);
     return energy;
 }
 
 void ReferenceCalcExtendedCustomCVForceKernel::copyState(ContextImpl& context, ContextImpl& innerContext) {
-    extractPositions(innerContext) = extractPositions(context);
-    extractVelocities(innerContext) = extractVelocities(context);
-    Vec3 a, b, c;
-    context.getPeriodicBoxVectors(a, b, c);
-    innerContext.setPeriodicBoxVectors(a, b, c);
-    innerContext.setTime(context.getTime());
-    map<string, double> innerParameters = innerContext.getParameters();
-    for (auto& param : innerParameters)
-        innerContext.setParameter(param.first, context.getParameter(param.first));
+    // The inner context may have more particles, which are the shared particles, whose
+    // positions are computed from the copied ones, and the dummy particles of the batches.
+
+    vector<RealVec>& positions = extractPositions(context);
+    vector<Vec3>& velocities = extractVelocities(context);
+    copy(positions.begin(), positions.end(), extractPositions(innerContext).begin());
+    copy(velocities.begin(), velocities.end(), extractVelocities(innerContext).begin());
+    if (hasSharedParticles)
+        innerContext.computeVirtualSites();
+    counters.copyStates++;
+    counters.bytesCopied += 2*context.getSystem().getNumParticles()*sizeof(Vec3);
+    Vec3 box[3], innerBox[3];
+    context.getPeriodicBoxVectors(box[0], box[1], box[2]);
+    innerContext.getPeriodicBoxVectors(innerBox[0], innerBox[1], innerBox[2]);
+    if (box[0] != innerBox[0] || box[1] != innerBox[1] || box[2] != innerBox[2])
+        innerContext.setPeriodicBoxVectors(box[0], box[1], box[2]);
+    if (innerContext.getTime() != context.getTime())
+        innerContext.setTime(context.getTime());
+    if (innerParameterNames.empty())
+        for (auto& param : innerContext.getParameters())
+            innerParameterNames.push_back(param.first);
+    for (auto& name : innerParameterNames) {
+        double value = context.getParameter(name);
+        if (innerContext.getParameter(name) != value)
+            innerContext.setParameter(name, value);
+    }
+}
+
+void ReferenceCalcExtendedCustomCVForceKernel::getCollectiveVariableValues(ContextImpl& context, ContextImpl& innerContext, vector<double>& values) {
+    if (ixn->needsEvaluation(context.getStepCount()))
+        copyState(context, innerContext);
+    ixn->getCollectiveVariableValues(innerContext, context.getSystem().getNumParticles(), context.getStepCount(), values, counters);
+}
+
+void ReferenceCalcExtendedCustomCVForceKernel::evaluateInnerVariables(ContextImpl& innerContext, vector<double>& values) {
+    ixn->evaluateInnerVariables(innerContext, numParticles, values, counters);
 }
 
 void ReferenceCalcExtendedCustomCVForceKernel::copyParametersToContext(ContextImpl& context, const ExtendedCustomCVForce& force) {
     ixn->updateTabulatedFunctions(force);
+    ixn->updateRadialBasisFunctions(force);
+    ixn->updateCustomSummations(force);
+    ixn->updateCollectiveVariableIntervals(force);
 }
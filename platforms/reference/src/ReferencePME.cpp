@@ -12,6 +12,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <complex>
+#include <functional>
 
 #include "internal/ReferenceSlicedPME.h"
 #include "openmm/reference/SimTKOpenMMRealType.h"
@@ -77,12 +78,34 @@ struct pme
      */
 
     double       epsilon_r;             /* Dielectric coefficient to use, typically 1.0 */
+
+    SharedThreadPool* threads;          /* Thread pool used to parallelize the calculation, or NULL */
+
+    vector<vector<complex<double> > > threadgrids;  /* Private charge grids of the threads, kept between calls */
 };
 
 
 /* Internal setup routines */
 
 
+static int
+pme_num_threads(pme_t pme)
+{
+    return (pme->threads == NULL ? 1 : pme->threads->getNumThreads());
+}
+
+
+/* Split the range [0, n) in contiguous chunks, one per thread, and call task(thread, start, end) for each of them */
+static void
+pme_parallel_for(pme_t pme, int n, const function<void(int, int, int)>& task)
+{
+    if (pme->threads == NULL)
+        task(0, 0, n);
+    else
+        pme->threads->parallelFor(n, task);
+}
+
+
 
 /* Only called once from init_pme(), performance does not matter! */
 static void
@@ -317,91 +340,158 @@ pme_update_bsplines(pme_t    pme)
 }
 
 
+/* Spread the charge of one atom on a grid that contains the planes xstart to xstart+width-1 of the full grid.
+ * Element (subset,i,j,k) of this grid is grid[((subset*width + i-xstart)*ngrid[1] + j)*ngrid[2] + k].
+ */
 static void
-pme_grid_spread_charge(pme_t pme, const vector<double>& charges, const vector<int>& subsets)
+pme_spread_atom_charge(pme_t pme, int atom, double q, int subset, complex<double>* grid, int xstart, int width)
 {
     int       order;
-    int       i;
     int       ix,iy,iz;
     int       x0index,y0index,z0index;
     int       xindex,yindex,zindex;
     int       index;
-    double    q;
     double *  thetax;
     double *  thetay;
     double *  thetaz;
 
     order = pme->order;
 
-    /* Reset the grid */
-    for (i=0;i<pme->ngrid[0]*pme->ngrid[1]*pme->ngrid[2]*pme->nsubsets;i++)
-    {
-        pme->grid[i] = complex<double>(0, 0);
-    }
+    /* Grid index for the actual atom position */
+    x0index = pme->particleindex[atom][0];
+    y0index = pme->particleindex[atom][1];
+    z0index = pme->particleindex[atom][2];
 
-    for (i=0;i<pme->natoms;i++)
+    /* Bspline factors for this atom in each dimension , calculated from fractional coordinates */
+    thetax  = &(pme->bsplines_theta[0][atom*order]);
+    thetay  = &(pme->bsplines_theta[1][atom*order]);
+    thetaz  = &(pme->bsplines_theta[2][atom*order]);
+
+    /* Loop over norder*norder*norder (typically 4*4*4) neighbor cells.
+     *
+     * As a neat optimization, we only spread in the forward direction, but apply PBC!
+     *
+     * Since we are going to do an FFT on the grid, it doesnt matter where the data is,
+     * in frequency space the result will be the same.
+     *
+     * So, the influence function (bsplines) will probably be something like (0.15,0.35,0.35,0.15),
+     * with largest weight 2-3 steps forward (you dont need to understand that for the implementation :-)
+     * Effectively, you can look at this as translating the entire grid.
+     *
+     * Why do we do this stupid thing?
+     *
+     * 1) The loops get much simpler
+     * 2) Just looking forward will hopefully get us more cache hits
+     * 3) When we parallelize things, we only need to communicate in one direction instead of two!
+     */
+
+    for (ix=0;ix<order;ix++)
     {
-        q = charges[i];
-        int subset = subsets[i];
+        /* Calculate index, apply PBC so we spread to index 0/1/2 when a particle is close to the upper limit of the grid */
+        xindex = x0index + ix - xstart;
+        if (xindex >= width)
+            xindex -= width;
 
-        /* Grid index for the actual atom position */
-        x0index = pme->particleindex[i][0];
-        y0index = pme->particleindex[i][1];
-        z0index = pme->particleindex[i][2];
+        for (iy=0;iy<order;iy++)
+        {
+            yindex = (y0index + iy) % pme->ngrid[1];
 
-        /* Bspline factors for this atom in each dimension , calculated from fractional coordinates */
-        thetax  = &(pme->bsplines_theta[0][i*order]);
-        thetay  = &(pme->bsplines_theta[1][i*order]);
-        thetaz  = &(pme->bsplines_theta[2][i*order]);
+            for (iz=0;iz<order;iz++)
+            {
+                /* Can be optimized, but we keep it simple here */
+                zindex            = (z0index + iz) % pme->ngrid[2];
+                /* Calculate index in the charge grid */
+                index = ((subset*width + xindex)*pme->ngrid[1] + yindex)*pme->ngrid[2] + zindex;
+                /* Add the charge times the bspline spread/interpolation factors to this grid position */
+                grid[index] += q*thetax[ix]*thetay[iy]*thetaz[iz];
+            }
+        }
+    }
+}
 
-        /* Loop over norder*norder*norder (typically 4*4*4) neighbor cells.
-         *
-         * As a neat optimization, we only spread in the forward direction, but apply PBC!
-         *
-         * Since we are going to do an FFT on the grid, it doesnt matter where the data is,
-         * in frequency space the result will be the same.
-         *
-         * So, the influence function (bsplines) will probably be something like (0.15,0.35,0.35,0.15),
-         * with largest weight 2-3 steps forward (you dont need to understand that for the implementation :-)
-         * Effectively, you can look at this as translating the entire grid.
-         *
-         * Why do we do this stupid thing?
-         *
-         * 1) The loops get much simpler
-         * 2) Just looking forward will hopefully get us more cache hits
-         * 3) When we parallelize things, we only need to communicate in one direction instead of two!
-         */
 
-        for (ix=0;ix<order;ix++)
+static void
+pme_grid_spread_charge(pme_t pme, const vector<double>& charges, const vector<int>& subsets)
+{
+    int order = pme->order;
+    int nx = pme->ngrid[0];
+    int planeSize = pme->ngrid[1]*pme->ngrid[2];
+    int nthreads = pme_num_threads(pme);
+
+    if (nthreads == 1 || nx < nthreads*order)
+    {
+        /* Spread all charges directly on the full grid */
+        for (int i=0;i<nx*planeSize*pme->nsubsets;i++)
+            pme->grid[i] = complex<double>(0, 0);
+        for (int i=0;i<pme->natoms;i++)
+            pme_spread_atom_charge(pme, i, charges[i], subsets[i], pme->grid, 0, nx);
+        return;
+    }
+
+    /* Each thread owns a slab of consecutive X planes and spreads the atoms whose grid index lies in that slab.
+     * Since atoms only spread forward, the private grid of a thread covers its slab plus order-1 planes ahead.
+     */
+    vector<int> slabStart(nthreads+1), slabOfPlane(nx);
+    for (int t=0;t<=nthreads;t++)
+        slabStart[t] = (int) ((long long) t*nx/nthreads);
+    for (int t=0;t<nthreads;t++)
+        for (int x=slabStart[t];x<slabStart[t+1];x++)
+            slabOfPlane[x] = t;
+
+    /* Bin the atoms by slab */
+    vector<int> binStart(nthreads+1, 0), binnedAtoms(pme->natoms);
+    for (int i=0;i<pme->natoms;i++)
+        binStart[slabOfPlane[pme->particleindex[i][0]]+1]++;
+    for (int t=0;t<nthreads;t++)
+        binStart[t+1] += binStart[t];
+    vector<int> binFill(binStart.begin(), binStart.end()-1);
+    for (int i=0;i<pme->natoms;i++)
+        binnedAtoms[binFill[slabOfPlane[pme->particleindex[i][0]]]++] = i;
+
+    vector<vector<complex<double> > >& threadGrids = pme->threadgrids;
+    threadGrids.resize(nthreads);
+    pme->threads->execute([&] (int thread) {
+        int width = slabStart[thread+1]-slabStart[thread]+order-1;
+        threadGrids[thread].assign(pme->nsubsets*width*planeSize, complex<double>(0, 0));
+        for (int k=binStart[thread];k<binStart[thread+1];k++)
         {
-            /* Calculate index, apply PBC so we spread to index 0/1/2 when a particle is close to the upper limit of the grid */
-            xindex = (x0index + ix) % pme->ngrid[0];
+            int i = binnedAtoms[k];
+            pme_spread_atom_charge(pme, i, charges[i], subsets[i], threadGrids[thread].data(), slabStart[thread], width);
+        }
+    });
 
-            for (iy=0;iy<order;iy++)
+    /* Sum the private grids of all subsets on the full grid, plane by plane and in a fixed thread order */
+    pme_parallel_for(pme, nx*pme->nsubsets, [&] (int thread, int start, int end) {
+        for (int p=start;p<end;p++)
+        {
+            int subset = p/nx;
+            int x = p%nx;
+            complex<double>* plane = pme->grid + p*planeSize;
+            for (int k=0;k<planeSize;k++)
+                plane[k] = complex<double>(0, 0);
+            for (int t=0;t<nthreads;t++)
             {
-                yindex = (y0index + iy) % pme->ngrid[1];
-
-                for (iz=0;iz<order;iz++)
-                {
-                    /* Can be optimized, but we keep it simple here */
-                    zindex            = (z0index + iz) % pme->ngrid[2];
-                    /* Calculate index in the charge grid */
-                    index = ((subset*pme->ngrid[0] + xindex)*pme->ngrid[1] + yindex)*pme->ngrid[2] + zindex;
-                    /* Add the charge times the bspline spread/interpolation factors to this grid position */
-                    pme->grid[index] += q*thetax[ix]*thetay[iy]*thetaz[iz];
-                }
+                int width = slabStart[t+1]-slabStart[t]+order-1;
+                int local = (x-slabStart[t]+nx)%nx;
+                if (local >= width)
+                    continue;
+                const complex<double>* source = threadGrids[t].data() + (subset*width + local)*planeSize;
+                for (int k=0;k<planeSize;k++)
+                    plane[k] += source[k];
             }
         }
-    }
+    });
 }
 
 
 
 static void
-pme_reciprocal_convolution(pme_t     pme,
+pme_reciprocal_convolution(pme_t pme,
                            const Vec3 periodicBoxVectors[3],
                            const Vec3 recipBoxVectors[3],
-                           vector<vector<double>>& sliceEnergies)
+                           int kxstart,
+                           int kxend,
+                           vector<array<double, 3>>& sliceEnergies)
 {
     int kx,ky,kz;
     int nx,ny,nz;
@@ -430,7 +520,7 @@ pme_reciprocal_convolution(pme_t     pme,
     maxky = (ny+1)/2;
     maxkz = (nz+1)/2;
 
-    for (kx=0;kx<nx;kx++)
+    for (kx=kxstart;kx<kxend;kx++)
     {
         /* Calculate frequency. Grid indices in the upper half correspond to negative frequencies! */
         mx  = (kx<maxkx) ? kx : (kx-nx);
@@ -500,7 +590,9 @@ static void
 dpme_reciprocal_convolution(pme_t pme,
                            const Vec3 periodicBoxVectors[3],
                            const Vec3 recipBoxVectors[3],
-                           vector<vector<double>>& sliceEnergies)
+                           int kxstart,
+                           int kxend,
+                           vector<array<double, 3>>& sliceEnergies)
 {
     int kx,ky,kz;
     int nx,ny,nz;
@@ -531,7 +623,7 @@ dpme_reciprocal_convolution(pme_t pme,
     double fac3 = -2.0*pme->ewaldcoeff*M_PI*M_PI;
     double b, m, m3, expfac, expterm, erfcterm;
 
-    for (kx=0;kx<nx;kx++)
+    for (kx=kxstart;kx<kxend;kx++)
     {
         /* Calculate frequency. Grid indices in the upper half correspond to negative frequencies! */
         mx  = ((kx<maxkx) ? kx : (kx-nx));
@@ -599,10 +691,12 @@ static void
 pme_grid_interpolate_force(pme_t pme,
                            const Vec3 recipBoxVectors[3],
                            const vector<int>& atomSubsets,
-                           const vector<vector<double>>& sliceLambdas,
+                           const vector<array<double, 2>>& sliceLambdas,
                            const vector<double>& charges,
                            vector<Vec3>& forces,
-                           int term)
+                           int term,
+                           int start,
+                           int end)
 {
     int       i;
     int       ix,iy,iz;
@@ -631,7 +725,7 @@ pme_grid_interpolate_force(pme_t pme,
 
     /* This is almost identical to the charge spreading routine! */
 
-    for (i=0;i<pme->natoms;i++)
+    for (i=start;i<end;i++)
     {
         fx = fy = fz = 0;
 
@@ -679,7 +773,7 @@ pme_grid_interpolate_force(pme_t pme,
                     dtz                  = dthetaz[iz];
 
                     for (int sj = 0; sj < pme->nsubsets; sj++) {
-                        index = ((sj*pme->ngrid[2] + xindex)*pme->ngrid[1] + yindex)*pme->ngrid[2] + zindex;
+                        index = ((sj*pme->ngrid[0] + xindex)*pme->ngrid[1] + yindex)*pme->ngrid[2] + zindex;
                         int slice = si > sj ? si*(si+1)/2+sj : sj*(sj+1)/2+si;
 
                         /* Get the fft+convoluted+ifft:d data from the grid, which must be real by definition */
@@ -703,6 +797,37 @@ pme_grid_interpolate_force(pme_t pme,
 
 
 
+/* Apply a convolution to the grid, splitting the X frequencies among the threads, and add up the energies in a fixed thread order */
+static void
+pme_convolve(pme_t pme,
+             void (*convolution)(pme_t, const Vec3[3], const Vec3[3], int, int, vector<array<double, 3>>&),
+             const Vec3 periodicBoxVectors[3],
+             const Vec3 recipBoxVectors[3],
+             vector<array<double, 3>>& sliceEnergies)
+{
+    typedef vector<array<double, 3>> Energies;
+    Energies energies(sliceEnergies.size(), {0.0, 0.0, 0.0});
+    auto convolve = [&] (int start, int end, Energies& partial) {
+        convolution(pme, periodicBoxVectors, recipBoxVectors, start, end, partial);
+    };
+    if (pme->threads == NULL)
+        convolve(0, pme->ngrid[0], energies);
+    else
+        energies = pme->threads->parallelReduce(pme->ngrid[0], energies, convolve, [] (Energies& total, const Energies& partial) {
+            for (int slice=0;slice<total.size();slice++)
+            {
+                total[slice][Coul] += partial[slice][Coul];
+                total[slice][vdW] += partial[slice][vdW];
+            }
+        });
+    for (int slice=0;slice<sliceEnergies.size();slice++)
+    {
+        sliceEnergies[slice][Coul] += energies[slice][Coul];
+        sliceEnergies[slice][vdW] += energies[slice][vdW];
+    }
+}
+
+
 /* EXPORTED ROUTINES */
 
 int
@@ -717,7 +842,7 @@ pme_init(pme_t *       ppme,
     pme_t pme;
     int   d;
 
-    pme = (pme_t) malloc(sizeof(struct pme));
+    pme = new struct pme;
 
     pme->order       = pme_order;
     pme->epsilon_r   = epsilon_r;
@@ -725,6 +850,7 @@ pme_init(pme_t *       ppme,
     pme->natoms      = natoms;
     pme->nsubsets = nsubsets;
     pme->nslices = nsubsets*(nsubsets+1)/2;
+    pme->threads = NULL;
 
     for (d=0;d<3;d++)
     {
@@ -754,11 +880,11 @@ pme_init(pme_t *       ppme,
 int pme_exec(pme_t       pme,
              const vector<Vec3>& atomCoordinates,
              const vector<int>& atomSubsets,
-             const vector<vector<double>>& sliceLambdas,
+             const vector<array<double, 2>>& sliceLambdas,
              vector<Vec3>& forces,
              const vector<double>& charges,
              const Vec3 periodicBoxVectors[3],
-             vector<vector<double>>& sliceEnergies)
+             vector<array<double, 3>>& sliceEnergies)
 {
     /* Routine is called with coordinates in x, a box, and charges in q */
 
@@ -790,22 +916,25 @@ int pme_exec(pme_t       pme,
     vector<ptrdiff_t> stride = {(ptrdiff_t) (ny*nz*sizeof(complex<double>)),
                                 (ptrdiff_t) (nz*sizeof(complex<double>)),
                                 (ptrdiff_t) sizeof(complex<double>)};
+    size_t nthreads = pme_num_threads(pme);
     for (int i = 0; i < pme->nsubsets; i++) {
         int offset = i*nx*ny*nz;
-        pocketfft::c2c(shape, stride, stride, axes, true, pme->grid+offset, pme->grid+offset, 1.0, 0);
+        pocketfft::c2c(shape, stride, stride, axes, true, pme->grid+offset, pme->grid+offset, 1.0, nthreads);
     }
 
     /* solve in k-space */
-    pme_reciprocal_convolution(pme,periodicBoxVectors,recipBoxVectors,sliceEnergies);
+    pme_convolve(pme,pme_reciprocal_convolution,periodicBoxVectors,recipBoxVectors,sliceEnergies);
 
     /* do 3d-invfft */
     for (int i = 0; i < pme->nsubsets; i++) {
         int offset = i*nx*ny*nz;
-        pocketfft::c2c(shape, stride, stride, axes, false, pme->grid+offset, pme->grid+offset, 1.0, 0);
+        pocketfft::c2c(shape, stride, stride, axes, false, pme->grid+offset, pme->grid+offset, 1.0, nthreads);
     }
 
     /* Get the particle forces from the grid and bsplines in the pme structure */
-    pme_grid_interpolate_force(pme,recipBoxVectors,atomSubsets,sliceLambdas,charges,forces,Coul);
+    pme_parallel_for(pme, pme->natoms, [&] (int thread, int start, int end) {
+        pme_grid_interpolate_force(pme,recipBoxVectors,atomSubsets,sliceLambdas,charges,forces,Coul,start,end);
+    });
 
     return 0;
 }
@@ -814,11 +943,11 @@ int pme_exec(pme_t       pme,
 int pme_exec_dpme(pme_t       pme,
              const vector<Vec3>& atomCoordinates,
              const vector<int>& atomSubsets,
-             const vector<vector<double>>& sliceLambdas,
+             const vector<array<double, 2>>& sliceLambdas,
              vector<Vec3>& forces,
              const vector<double>& c6s,
              const Vec3 periodicBoxVectors[3],
-             vector<vector<double>>& sliceEnergies)
+             vector<array<double, 3>>& sliceEnergies)
 {
     /* Routine is called with coordinates in x, a box, and charges in q */
 
@@ -850,23 +979,34 @@ int pme_exec_dpme(pme_t       pme,
     vector<ptrdiff_t> stride = {(ptrdiff_t) (ny*nz*sizeof(complex<double>)),
                                 (ptrdiff_t) (nz*sizeof(complex<double>)),
                                 (ptrdiff_t) sizeof(complex<double>)};
+    size_t nthreads = pme_num_threads(pme);
     for (int i = 0; i < pme->nsubsets; i++) {
         int offset = i*nx*ny*nz;
-        pocketfft::c2c(shape, stride, stride, axes, true, pme->grid+offset, pme->grid+offset, 1.0, 0);
+        pocketfft::c2c(shape, stride, stride, axes, true, pme->grid+offset, pme->grid+offset, 1.0, nthreads);
     }
 
     /* solve in k-space */
-    dpme_reciprocal_convolution(pme,periodicBoxVectors,recipBoxVectors,sliceEnergies);
+    pme_convolve(pme,dpme_reciprocal_convolution,periodicBoxVectors,recipBoxVectors,sliceEnergies);
 
     /* do 3d-invfft */
     for (int i = 0; i < pme->nsubsets; i++) {
         int offset = i*nx*ny*nz;
-        pocketfft::c2c(shape, stride, stride, axes, false, pme->grid+offset, pme->grid+offset, 1.0, 0);
+        pocketfft::c2c(shape, stride, stride, axes, false, pme->grid+offset, pme->grid+offset, 1.0, nthreads);
     }
 
     /* Get the particle forces from the grid and bsplines in the pme structure */
-    pme_grid_interpolate_force(pme,recipBoxVectors,atomSubsets,sliceLambdas,c6s,forces,vdW);
+    pme_parallel_for(pme, pme->natoms, [&] (int thread, int start, int end) {
+        pme_grid_interpolate_force(pme,recipBoxVectors,atomSubsets,sliceLambdas,c6s,forces,vdW,start,end);
+    });
+
+    return 0;
+}
+
 
+int
+pme_set_thread_pool(pme_t pme, SharedThreadPool* threads)
+{
+    pme->threads = threads;
     return 0;
 }
 
@@ -889,7 +1029,7 @@ pme_destroy(pme_t    pme)
     free(pme->particleindex);
 
     /* destroy structure itself */
-    free(pme);
+    delete pme;
 
     return 0;
 }
@@ -11,6 +11,7 @@
 
 #include <string.h>
 #include <sstream>
+#include <algorithm>
 
 #include "internal/ReferenceSlicedLJCoulomb14.h"
 #include "openmm/reference/ReferenceForce.h"
@@ -26,7 +27,7 @@ using namespace OpenMM;
 
    --------------------------------------------------------------------------------------- */
 
-ReferenceSlicedLJCoulomb14::ReferenceSlicedLJCoulomb14() : periodic(false) {
+ReferenceSlicedLJCoulomb14::ReferenceSlicedLJCoulomb14() : periodic(false), threads(NULL) {
 }
 
 /**---------------------------------------------------------------------------------------
@@ -45,51 +46,122 @@ void ReferenceSlicedLJCoulomb14::setPeriodic(OpenMM::Vec3* vectors) {
     periodicBoxVectors[2] = vectors[2];
 }
 
+void ReferenceSlicedLJCoulomb14::setThreadPool(SharedThreadPool& pool) {
+    threads = &pool;
+}
+
 /**---------------------------------------------------------------------------------------
 
-   Calculate LJ 1-4 ixn
+   Calculate LJ 1-4 ixns, distributing the slices among the threads of the thread pool, if
+   one has been set.  Each slice is handled by a single thread, which therefore owns its
+   energies, while the forces are accumulated in separate buffers per thread.
 
        @param atomIndices      atom indices of the atoms in each pair
-       @param atomCoordinates  atom coordinates
        @param parameters       (sigma, 4*epsilon, charge product) for each pair
+       @param sliceStarts      the pairs of slice s are those from sliceStarts[s] to sliceStarts[s+1]-1
+       @param atomCoordinates  atom coordinates
+       @param sliceLambdas     the scaling parameters of each slice
        @param forces           force array (forces added to current values)
-       @param sliceLambdas     the scaling parameters of the slice
-       @param sliceEnergies    the energies of the slice
+       @param sliceEnergies    the energies of each slice (energies added to current values)
 
    --------------------------------------------------------------------------------------- */
 
-void ReferenceSlicedLJCoulomb14::calculateBondIxn(vector<int>& atomIndices, vector<Vec3>& atomCoordinates,
-                                     vector<double>& parameters, vector<Vec3>& forces,
-                                     vector<double>& sliceLambdas, vector<double>& sliceEnergies) {
-    double deltaR[2][ReferenceForce::LastDeltaRIndex];
-
-    // get deltaR, R2, and R between 2 atoms
+void ReferenceSlicedLJCoulomb14::calculateBondIxns(const vector<array<int, 2>>& atomIndices, const vector<array<double, 3>>& parameters,
+                                                   const vector<int>& sliceStarts, const vector<Vec3>& atomCoordinates,
+                                                   const vector<array<double, 2>>& sliceLambdas, vector<Vec3>& forces,
+                                                   vector<array<double, 3>>& sliceEnergies) const {
+    int numSlices = sliceStarts.size()-1;
+    int numNonemptySlices = 0;
+    for (int slice = 0; slice < numSlices; slice++)
+        if (sliceStarts[slice+1] > sliceStarts[slice])
+            numNonemptySlices++;
+    int numThreads = (threads == NULL ? 1 : min(threads->getNumThreads(), numNonemptySlices));
+    if (numThreads <= 1) {
+        for (int slice = 0; slice < numSlices; slice++)
+            calculateSliceIxns(sliceStarts[slice], sliceStarts[slice+1], atomIndices, parameters, atomCoordinates,
+                               sliceLambdas[slice], forces, sliceEnergies[slice]);
+        return;
+    }
+    vector<vector<Vec3>> threadForces(numThreads, vector<Vec3>(forces.size()));
+    threads->execute([&] (int threadIndex) {
+        if (threadIndex >= numThreads)
+            return;
+        for (int slice = threadIndex; slice < numSlices; slice += numThreads)
+            calculateSliceIxns(sliceStarts[slice], sliceStarts[slice+1], atomIndices, parameters, atomCoordinates,
+                               sliceLambdas[slice], threadForces[threadIndex], sliceEnergies[slice]);
+    });
+
+    // Sum the contributions of the threads in a fixed order, so that the results do not depend on timing.
+
+    for (int i = 0; i < numThreads; i++)
+        for (int j = 0; j < forces.size(); j++)
+            forces[j] += threadForces[i][j];
+}
 
-    int i = atomIndices[0];
-    int j = atomIndices[1];
-    if (periodic)
-        ReferenceForce::getDeltaRPeriodic(atomCoordinates[j], atomCoordinates[i], periodicBoxVectors, deltaR[0]);
-    else
-        ReferenceForce::getDeltaR(atomCoordinates[j], atomCoordinates[i], deltaR[0]);
+/**---------------------------------------------------------------------------------------
 
-    double inverseR  = 1.0/(deltaR[0][ReferenceForce::RIndex]);
-    double sig2      = inverseR*parameters[0];
-           sig2     *= sig2;
-    double sig6      = sig2*sig2*sig2;
+   Calculate the LJ 1-4 ixns of a range of pairs belonging to a single slice
 
-    double dEdR      = sliceLambdas[vdW]*parameters[1]*(12.0*sig6 - 6.0)*sig6;
-           dEdR     += sliceLambdas[Coul]*ONE_4PI_EPS0*parameters[2]*inverseR;
-           dEdR     *= inverseR*inverseR;
+       @param start            the first pair
+       @param end              one past the last pair
+       @param atomIndices      atom indices of the atoms in each pair
+       @param parameters       (sigma, 4*epsilon, charge product) for each pair
+       @param atomCoordinates  atom coordinates
+       @param sliceLambdas     the scaling parameters of the slice
+       @param forces           force array (forces added to current values)
+       @param sliceEnergies    the energies of the slice (energies added to current values)
 
-    // accumulate forces
+   --------------------------------------------------------------------------------------- */
 
-    for (int k = 0; k < 3; k++) {
-        double force = dEdR*deltaR[0][k];
-        forces[i][k] += force;
-        forces[j][k] -= force;
+void ReferenceSlicedLJCoulomb14::calculateSliceIxns(int start, int end, const vector<array<int, 2>>& atomIndices,
+                                                    const vector<array<double, 3>>& parameters, const vector<Vec3>& atomCoordinates,
+                                                    const array<double, 2>& sliceLambdas, vector<Vec3>& forces,
+                                                    array<double, 3>& sliceEnergies) const {
+    double dx[PairBlockSize], dy[PairBlockSize], dz[PairBlockSize];
+    double sig[PairBlockSize], eps[PairBlockSize], chargeProd[PairBlockSize];
+    double dEdR[PairBlockSize], clEnergy[PairBlockSize], ljEnergy[PairBlockSize];
+    for (int first = start; first < end; first += PairBlockSize) {
+        int numPairs = min((int) PairBlockSize, end-first);
+
+        // Gather the pairs.  Unused lanes repeat the last pair with zero parameters.
+
+        for (int l = 0; l < PairBlockSize; l++) {
+            int k = first+min(l, numPairs-1);
+            Vec3 diff = atomCoordinates[atomIndices[k][0]]-atomCoordinates[atomIndices[k][1]];
+            if (periodic) {
+                diff -= periodicBoxVectors[2]*floor(diff[2]/periodicBoxVectors[2][2]+0.5);
+                diff -= periodicBoxVectors[1]*floor(diff[1]/periodicBoxVectors[1][1]+0.5);
+                diff -= periodicBoxVectors[0]*floor(diff[0]/periodicBoxVectors[0][0]+0.5);
+            }
+            dx[l] = diff[0];
+            dy[l] = diff[1];
+            dz[l] = diff[2];
+            bool active = (l < numPairs);
+            sig[l] = parameters[k][0];
+            eps[l] = active ? parameters[k][1] : 0.0;
+            chargeProd[l] = active ? ONE_4PI_EPS0*parameters[k][2] : 0.0;
+        }
+
+        // Compute the interactions of all lanes.
+
+        for (int l = 0; l < PairBlockSize; l++) {
+            double inverseR = 1.0/sqrt(dx[l]*dx[l]+dy[l]*dy[l]+dz[l]*dz[l]);
+            double sig2 = inverseR*sig[l];
+            sig2 *= sig2;
+            double sig6 = sig2*sig2*sig2;
+            ljEnergy[l] = eps[l]*(sig6-1.0)*sig6;
+            clEnergy[l] = chargeProd[l]*inverseR;
+            dEdR[l] = (sliceLambdas[vdW]*eps[l]*(12.0*sig6-6.0)*sig6 + sliceLambdas[Coul]*clEnergy[l])*inverseR*inverseR;
+        }
+
+        // Scatter the forces and accumulate the energies.
+
+        for (int l = 0; l < numPairs; l++) {
+            Vec3 force = Vec3(dx[l], dy[l], dz[l])*dEdR[l];
+            forces[atomIndices[first+l][0]] += force;
+            forces[atomIndices[first+l][1]] -= force;
+            sliceEnergies[Coul] += clEnergy[l];
+            sliceEnergies[vdW] += ljEnergy[l];
+        }
     }
-
-    // accumulate energies
-    sliceEnergies[vdW] += parameters[1]*(sig6 - 1.0)*sig6;
-    sliceEnergies[Coul] += ONE_4PI_EPS0*parameters[2]*inverseR;
 }
@@ -12,6 +12,7 @@
 #include <sstream>
 #include <complex>
 #include <algorithm>
+#include <array>
 #include <iostream>
 
 #include "internal/ReferenceSlicedLJCoulombIxn.h"
@@ -34,8 +35,9 @@ using namespace OpenMM;
 
    --------------------------------------------------------------------------------------- */
 
-ReferenceSlicedLJCoulombIxn::ReferenceSlicedLJCoulombIxn() : cutoff(false), useSwitch(false),
-            periodic(false), periodicExceptions(false), ewald(false), pme(false), ljpme(false) {
+ReferenceSlicedLJCoulombIxn::ReferenceSlicedLJCoulombIxn() : cutoff(false), useSwitch(false), softCore(false),
+            periodic(false), periodicExceptions(false), ewald(false), pme(false), ljpme(false), threads(NULL),
+            pmeData(NULL), dispersionPmeData(NULL) {
 }
 
 /**---------------------------------------------------------------------------------------
@@ -78,6 +80,22 @@ void ReferenceSlicedLJCoulombIxn::setUseSwitchingFunction(double distance) {
     switchingDistance = distance;
 }
 
+/**---------------------------------------------------------------------------------------
+
+     Set the force to use a soft-core Lennard-Jones potential in some slices.
+
+     @param shifts            the shift of each slice, which is zero for regular slices
+     @param shiftDerivatives  the derivative of each shift with respect to the scaling
+                              parameter of its slice
+
+     --------------------------------------------------------------------------------------- */
+
+void ReferenceSlicedLJCoulombIxn::setUseSoftCore(const vector<double>& shifts, const vector<double>& shiftDerivatives) {
+    softCore = true;
+    softCoreShifts = shifts;
+    softCoreShiftDerivatives = shiftDerivatives;
+}
+
 /**---------------------------------------------------------------------------------------
 
      Set the force to use periodic boundary conditions.  This requires that a cutoff has
@@ -122,16 +140,14 @@ void ReferenceSlicedLJCoulombIxn::setUseEwald(double alpha, int kmaxx, int kmaxy
 
      Set the force to use Particle-Mesh Ewald (PME) summation.
 
-     @param alpha  the Ewald separation parameter
-     @param gridSize the dimensions of the mesh
+     @param alpha    the Ewald separation parameter
+     @param pmeData  the PME data, created with pme_init() by the caller, who owns it
 
      --------------------------------------------------------------------------------------- */
 
-void ReferenceSlicedLJCoulombIxn::setUsePME(double alpha, int meshSize[3]) {
+void ReferenceSlicedLJCoulombIxn::setUsePME(double alpha, pme_t pmeData) {
     alphaEwald = alpha;
-    meshDim[0] = meshSize[0];
-    meshDim[1] = meshSize[1];
-    meshDim[2] = meshSize[2];
+    this->pmeData = pmeData;
     pme = true;
 }
 
@@ -139,16 +155,14 @@ void ReferenceSlicedLJCoulombIxn::setUsePME(double alpha, int meshSize[3]) {
 
      Set the force to use Particle-Mesh Ewald (PME) summation for dispersion terms.
 
-     @param alpha  the dispersion Ewald separation parameter
-     @param gridSize the dimensions of the dispersion mesh
+     @param alpha    the dispersion Ewald separation parameter
+     @param pmeData  the dispersion PME data, created with pme_init() by the caller, who owns it
 
      --------------------------------------------------------------------------------------- */
 
-void ReferenceSlicedLJCoulombIxn::setUseLJPME(double alpha, int meshSize[3]) {
+void ReferenceSlicedLJCoulombIxn::setUseLJPME(double alpha, pme_t pmeData) {
     alphaDispersionEwald = alpha;
-    dispersionMeshDim[0] = meshSize[0];
-    dispersionMeshDim[1] = meshSize[1];
-    dispersionMeshDim[2] = meshSize[2];
+    dispersionPmeData = pmeData;
     ljpme = true;
 }
 
@@ -156,6 +170,47 @@ void ReferenceSlicedLJCoulombIxn::setPeriodicExceptions(bool periodic) {
     periodicExceptions = periodic;
 }
 
+/**---------------------------------------------------------------------------------------
+
+     Set the slices whose direct space pair ixns are skipped.
+
+     @param skipped  whether each slice is skipped
+
+     --------------------------------------------------------------------------------------- */
+
+void ReferenceSlicedLJCoulombIxn::setSkippedSlices(const vector<bool>& skipped) {
+    skippedSlices.clear();
+    for (bool skip : skipped)
+        if (skip) {
+            skippedSlices = skipped;
+            break;
+        }
+}
+
+/**---------------------------------------------------------------------------------------
+
+     Get whether the slice of a pair of atoms is skipped.
+
+     --------------------------------------------------------------------------------------- */
+
+bool ReferenceSlicedLJCoulombIxn::isSkipped(int atom1, int atom2, const vector<int>& atomSubsets) const {
+    int si = atomSubsets[atom1];
+    int sj = atomSubsets[atom2];
+    return skippedSlices[si > sj ? si*(si+1)/2+sj : sj*(sj+1)/2+si];
+}
+
+/**---------------------------------------------------------------------------------------
+
+     Set a thread pool for computing the direct space pair ixns in parallel.
+
+     @param pool  the thread pool to use
+
+     --------------------------------------------------------------------------------------- */
+
+void ReferenceSlicedLJCoulombIxn::setThreadPool(SharedThreadPool& pool) {
+    threads = &pool;
+}
+
 /**---------------------------------------------------------------------------------------
 
    Calculate Ewald ixn
@@ -165,8 +220,9 @@ void ReferenceSlicedLJCoulombIxn::setPeriodicExceptions(bool periodic) {
    @param atomSubsets      atom subsets
    @param atomParameters   atom parameters (charges, c6, c12, ...)     atomParameters[atomIndex][paramterIndex]
    @param sliceLambda      Coulomb and LJ scaling parameters for each slice
-   @param exclusions       atom exclusion indices
-                           exclusions[atomIndex] contains the list of exclusions for that atom
+   @param exclusionStarts  the exclusions of atom i are exclusionAtoms[exclusionStarts[i]] to
+                           exclusionAtoms[exclusionStarts[i+1]-1], in increasing order
+   @param exclusionAtoms   the excluded atoms of all atoms, stored contiguously
    @param forces           force array (forces added)
    @param sliceEnergies    the energy of each slice
    @param includeDirect      true if direct space interactions should be included
@@ -175,15 +231,9 @@ void ReferenceSlicedLJCoulombIxn::setPeriodicExceptions(bool periodic) {
    --------------------------------------------------------------------------------------- */
 
 void ReferenceSlicedLJCoulombIxn::calculateEwaldIxn(int numberOfAtoms, vector<Vec3>& atomCoordinates, int numberOfSubsets, const vector<int>& atomSubsets,
-                                            const vector<vector<double>>& atomParameters, const vector<vector<double>>& sliceLambdas, const vector<set<int>>& exclusions,
-                                            vector<Vec3>& forces, vector<vector<double>>& sliceEnergies, bool includeDirect, bool includeReciprocal) const {
-    typedef complex<double> d_complex;
-
-    int kmax = ewald ? max(numRx, max(numRy, numRz)) : 0;
-    double factorEwald = -1/(4*alphaEwald*alphaEwald);
+                                            const vector<array<double, 3>>& atomParameters, const vector<array<double, 2>>& sliceLambdas, const vector<int>& exclusionStarts, const vector<int>& exclusionAtoms,
+                                            vector<Vec3>& forces, vector<array<double, 3>>& sliceEnergies, bool includeDirect, bool includeReciprocal) const {
     double SQRT_PI = sqrt(PI_M);
-    double TWO_PI = 2.0*PI_M;
-    double recipCoeff = ONE_4PI_EPS0*4*PI_M/(periodicBoxVectors[0][0]*periodicBoxVectors[1][1]*periodicBoxVectors[2][2]);
 
     // A couple of sanity checks
     if (ljpme && useSwitch)
@@ -211,135 +261,26 @@ void ReferenceSlicedLJCoulombIxn::calculateEwaldIxn(int numberOfAtoms, vector<Ve
     // PME
 
     if (pme && includeReciprocal) {
-        pme_t pmedata; /* abstract handle for PME data */
-
-        pme_init(&pmedata, alphaEwald, numberOfAtoms, numberOfSubsets, meshDim, 5, 1);
-
         vector<double> charges(numberOfAtoms);
         for (int i = 0; i < numberOfAtoms; i++)
             charges[i] = atomParameters[i][QIndex];
-        pme_exec(pmedata, atomCoordinates, atomSubsets, sliceLambdas, forces, charges, periodicBoxVectors, sliceEnergies);
-
-        pme_destroy(pmedata);
+        pme_exec(pmeData, atomCoordinates, atomSubsets, sliceLambdas, forces, charges, periodicBoxVectors, sliceEnergies);
 
         if (ljpme) {
             // Dispersion reciprocal space terms
-            pme_init(&pmedata, alphaDispersionEwald, numberOfAtoms, numberOfSubsets, dispersionMeshDim, 5, 1);
-
             vector<Vec3> dpmeforces(numberOfAtoms);
             for (int i = 0; i < numberOfAtoms; i++)
                 charges[i] = 8.0*pow(atomParameters[i][SigIndex], 3.0)*atomParameters[i][EpsIndex];
-            pme_exec_dpme(pmedata, atomCoordinates, atomSubsets, sliceLambdas, dpmeforces, charges, periodicBoxVectors, sliceEnergies);
+            pme_exec_dpme(dispersionPmeData, atomCoordinates, atomSubsets, sliceLambdas, dpmeforces, charges, periodicBoxVectors, sliceEnergies);
             for (int i = 0; i < numberOfAtoms; i++)
                 forces[i] += dpmeforces[i];
-            pme_destroy(pmedata);
         }
     }
     // Ewald method
 
-    else if (ewald && includeReciprocal) {
-
-        // setup reciprocal box
-
-        double recipBoxSize[3] = { TWO_PI/periodicBoxVectors[0][0], TWO_PI/periodicBoxVectors[1][1], TWO_PI/periodicBoxVectors[2][2]};
-
-        // setup K-vectors
-
-        #define EIR(subset, x, y, z) eir[(((subset)*kmax+(x))*numberOfAtoms+(y))*3+z]
-        vector<d_complex> eir(numberOfSubsets*kmax*numberOfAtoms*3);
-        vector<d_complex> tab_xy(numberOfAtoms);
-        vector<d_complex> tab_qxyz(numberOfAtoms);
-
-        if (kmax < 1)
-            throw OpenMMException("kmax for Ewald summation < 1");
-
-        for (int i = 0; (i < numberOfAtoms); i++) {
-            int subset = atomSubsets[i];
-            for (int m = 0; (m < 3); m++)
-                EIR(subset, 0, i, m) = d_complex(1,0);
-
-            for (int m=0; (m<3); m++)
-                EIR(subset, 1, i, m) = d_complex(cos(atomCoordinates[i][m]*recipBoxSize[m]),
-                                         sin(atomCoordinates[i][m]*recipBoxSize[m]));
-
-            for (int j=2; (j<kmax); j++)
-                for (int m=0; (m<3); m++)
-                    EIR(subset, j, i, m) = EIR(subset, j-1, i, m)*EIR(subset, 1, i, m);
-        }
-
-        // calculate reciprocal space energy and forces
-
-        int lowry = 0;
-        int lowrz = 1;
-
-        for (int rx = 0; rx < numRx; rx++) {
-
-            double kx = rx*recipBoxSize[0];
-
-            for (int ry = lowry; ry < numRy; ry++) {
-
-                double ky = ry*recipBoxSize[1];
-
-                if (ry >= 0)
-                    for (int n = 0; n < numberOfAtoms; n++) {
-                        int subset = atomSubsets[n];
-                        tab_xy[n] = EIR(subset, rx, n, 0)*EIR(subset, ry, n, 1);
-                    }
-                else
-                    for (int n = 0; n < numberOfAtoms; n++) {
-                        int subset = atomSubsets[n];
-                        tab_xy[n]= EIR(subset, rx, n, 0)*conj(EIR(subset, -ry, n, 1));
-                    }
-
-                for (int rz = lowrz; rz < numRz; rz++) {
-
-                    if (rz >= 0)
-                        for (int n = 0; n < numberOfAtoms; n++) {
-                            int subset = atomSubsets[n];
-                            tab_qxyz[n] = atomParameters[n][QIndex]*(tab_xy[n]*EIR(subset, rz, n, 2));
-                        }
-                    else
-                        for (int n = 0; n < numberOfAtoms; n++) {
-                            int subset = atomSubsets[n];
-                            tab_qxyz[n] = atomParameters[n][QIndex]*(tab_xy[n]*conj(EIR(subset, -rz, n, 2)));
-                        }
-
-                    vector<double> cs(numberOfSubsets, 0);
-                    vector<double> ss(numberOfSubsets, 0);
-
-                    for (int n = 0; n < numberOfAtoms; n++) {
-                        int subset = atomSubsets[n];
-                        cs[subset] += tab_qxyz[n].real();
-                        ss[subset] += tab_qxyz[n].imag();
-                    }
-
-                    double kz = rz*recipBoxSize[2];
-                    double k2 = kx*kx + ky*ky + kz*kz;
-                    double ak = exp(k2*factorEwald)/k2;
-
-                    for (int n = 0; n < numberOfAtoms; n++) {
-                        int i = atomSubsets[n];
-                        for (int j = 0; j < numberOfSubsets; j++) {
-                            int slice = i > j ? i*(i+1)/2+j : j*(j+1)/2+i;
-                            double force = 2*recipCoeff*sliceLambdas[slice][Coul]*ak*(cs[j]*tab_qxyz[n].imag() - ss[j]*tab_qxyz[n].real());
-                            forces[n][0] += force*kx;
-                            forces[n][1] += force*ky;
-                            forces[n][2] += force*kz;
-                        }
-                    }
-
-                    for (int j = 0; j < numberOfSubsets; j++) {
-                        for (int i = 0; i < j; i++)
-                            sliceEnergies[j*(j+1)/2+i][Coul] += 2*recipCoeff*ak*(cs[i]*cs[j] + ss[i]*ss[j]);
-                        sliceEnergies[j*(j+3)/2][Coul] += recipCoeff*ak*(cs[j]*cs[j] + ss[j]*ss[j]);
-                    }
-
-                    lowrz = 1 - numRz;
-                }
-                lowry = 1 - numRy;
-            }
-        }
-    }
+    else if (ewald && includeReciprocal)
+        calculateEwaldReciprocalIxns(numberOfAtoms, atomCoordinates, numberOfSubsets, atomSubsets, atomParameters, sliceLambdas,
+                                     forces, sliceEnergies);
 
     // **************************************************************************************
     // SHORT-RANGE ENERGY AND FORCES
@@ -348,91 +289,14 @@ void ReferenceSlicedLJCoulombIxn::calculateEwaldIxn(int numberOfAtoms, vector<Ve
     if (!includeDirect)
         return;
 
-    for (auto& pair : *neighborList) {
-        int ii = pair.first;
-        int jj = pair.second;
-
-        int si = atomSubsets[ii];
-        int sj = atomSubsets[jj];
-        int slice = si > sj ? si*(si+1)/2+sj : sj*(sj+1)/2+si;
-
-        double deltaR[2][ReferenceForce::LastDeltaRIndex];
-        ReferenceForce::getDeltaRPeriodic(atomCoordinates[jj], atomCoordinates[ii], periodicBoxVectors, deltaR[0]);
-        double r         = deltaR[0][ReferenceForce::RIndex];
-        double inverseR  = 1.0/(deltaR[0][ReferenceForce::RIndex]);
-        double switchValue = 1, switchDeriv = 0;
-        if (useSwitch && r > switchingDistance) {
-            double t = (r-switchingDistance)/(cutoffDistance-switchingDistance);
-            switchValue = 1+t*t*t*(-10+t*(15-t*6));
-            switchDeriv = t*t*(-30+t*(60-t*30))/(cutoffDistance-switchingDistance);
-        }
-        double alphaR = alphaEwald*r;
-
-        double dEdRCoul = ONE_4PI_EPS0*atomParameters[ii][QIndex]*atomParameters[jj][QIndex]*inverseR*inverseR*inverseR;
-        dEdRCoul *= erfc(alphaR) + 2*alphaR*exp(-alphaR*alphaR)/SQRT_PI;
-
-        double sig = atomParameters[ii][SigIndex] +  atomParameters[jj][SigIndex];
-        double sig2 = inverseR*sig;
-        sig2 *= sig2;
-        double sig6 = sig2*sig2*sig2;
-        double eps = atomParameters[ii][EpsIndex]*atomParameters[jj][EpsIndex];
-        double dEdRvdW = switchValue*eps*(12.0*sig6 - 6.0)*sig6*inverseR*inverseR;
-        double vdwEnergy = eps*(sig6-1.0)*sig6;
-
-        if (ljpme) {
-            double dalphaR   = alphaDispersionEwald*r;
-            double dar2 = dalphaR*dalphaR;
-            double dar4 = dar2*dar2;
-            double dar6 = dar4*dar2;
-            double inverseR2 = inverseR*inverseR;
-            double c6i = 8.0*pow(atomParameters[ii][SigIndex], 3.0)*atomParameters[ii][EpsIndex];
-            double c6j = 8.0*pow(atomParameters[jj][SigIndex], 3.0)*atomParameters[jj][EpsIndex];
-            // For the energies and forces, we first add the regular Lorentz−Berthelot terms.  The C12 term is treated as usual
-            // but we then subtract out (remembering that the C6 term is negative) the multiplicative C6 term that has been
-            // computed in real space.  Finally, we add a potential shift term to account for the difference between the LB
-            // and multiplicative functional forms at the cutoff.
-            double emult = c6i*c6j*inverseR2*inverseR2*inverseR2*(1.0 - EXP(-dar2)*(1.0 + dar2 + 0.5*dar4));
-            dEdRvdW += 6.0*c6i*c6j*inverseR2*inverseR2*inverseR2*inverseR2*(1.0 - EXP(-dar2)*(1.0 + dar2 + 0.5*dar4 + dar6/6.0));
-
-            double inverseCut2 = 1.0/(cutoffDistance*cutoffDistance);
-            double inverseCut6 = inverseCut2*inverseCut2*inverseCut2;
-            sig2 = atomParameters[ii][SigIndex] +  atomParameters[jj][SigIndex];
-            sig2 *= sig2;
-            sig6 = sig2*sig2*sig2;
-            // The additive part of the potential shift
-            double potentialshift = eps*(1.0-sig6*inverseCut6)*sig6*inverseCut6;
-            dalphaR   = alphaDispersionEwald*cutoffDistance;
-            dar2 = dalphaR*dalphaR;
-            dar4 = dar2*dar2;
-            // The multiplicative part of the potential shift
-            potentialshift -= c6i*c6j*inverseCut6*(1.0 - EXP(-dar2)*(1.0 + dar2 + 0.5*dar4));
-            vdwEnergy += emult + potentialshift;
-        }
-
-        if (useSwitch) {
-            dEdRvdW -= vdwEnergy*switchDeriv*inverseR;
-            vdwEnergy *= switchValue;
-        }
-
-        // accumulate forces
-
-        double factor = sliceLambdas[slice][vdW]*dEdRvdW+sliceLambdas[slice][Coul]*dEdRCoul;
-        for (int kk = 0; kk < 3; kk++) {
-            double force = factor*deltaR[0][kk];
-            forces[ii][kk] += force;
-            forces[jj][kk] -= force;
-        }
-
-        // accumulate energies
-        sliceEnergies[slice][vdW] += vdwEnergy;
-        sliceEnergies[slice][Coul] += ONE_4PI_EPS0*atomParameters[ii][QIndex]*atomParameters[jj][QIndex]*inverseR*erfc(alphaR);
-    }
+    calculateDirectIxns(numberOfAtoms, atomCoordinates, atomSubsets, atomParameters, sliceLambdas, exclusionStarts, exclusionAtoms, forces, sliceEnergies);
 
     // Now subtract off the exclusions, since they were implicitly included in the reciprocal space sum.
 
     const double TWO_OVER_SQRT_PI = 2/sqrt(PI_M);
     for (int i = 0; i < numberOfAtoms; i++)
-        for (int exclusion : exclusions[i]) {
+        for (int k = exclusionStarts[i]; k < exclusionStarts[i+1]; k++) {
+            int exclusion = exclusionAtoms[k];
             if (exclusion > i) {
                 int ii = i;
                 int jj = exclusion;
@@ -491,6 +355,121 @@ void ReferenceSlicedLJCoulombIxn::calculateEwaldIxn(int numberOfAtoms, vector<Ve
 }
 
 
+/**---------------------------------------------------------------------------------------
+
+     Calculate the reciprocal space ixns of the Ewald method.  The k-vectors are split among
+     the threads of the thread pool, if one has been set, and each thread accumulates the
+     structure factors of all subsets in a single pass over the atoms per k-vector
+
+     --------------------------------------------------------------------------------------- */
+
+void ReferenceSlicedLJCoulombIxn::calculateEwaldReciprocalIxns(int numberOfAtoms, vector<Vec3>& atomCoordinates, int numberOfSubsets,
+                                            const vector<int>& atomSubsets, const vector<array<double, 3>>& atomParameters,
+                                            const vector<array<double, 2>>& sliceLambdas, vector<Vec3>& forces,
+                                            vector<array<double, 3>>& sliceEnergies) const {
+    typedef complex<double> d_complex;
+
+    int kmax = max(numRx, max(numRy, numRz));
+    if (kmax < 1)
+        throw OpenMMException("kmax for Ewald summation < 1");
+    double factorEwald = -1/(4*alphaEwald*alphaEwald);
+    double TWO_PI = 2.0*PI_M;
+    double recipCoeff = ONE_4PI_EPS0*4*PI_M/(periodicBoxVectors[0][0]*periodicBoxVectors[1][1]*periodicBoxVectors[2][2]);
+    double recipBoxSize[3] = { TWO_PI/periodicBoxVectors[0][0], TWO_PI/periodicBoxVectors[1][1], TWO_PI/periodicBoxVectors[2][2]};
+
+    // Tabulate exp(i*k*r) for each atom and each Cartesian component of the k-vectors.
+
+    #define EIR(x, y, z) eir[((x)*numberOfAtoms+(y))*3+z]
+    vector<d_complex> eir(kmax*numberOfAtoms*3);
+    for (int i = 0; i < numberOfAtoms; i++) {
+        for (int m = 0; m < 3; m++) {
+            EIR(0, i, m) = d_complex(1, 0);
+            EIR(1, i, m) = d_complex(cos(atomCoordinates[i][m]*recipBoxSize[m]), sin(atomCoordinates[i][m]*recipBoxSize[m]));
+        }
+        for (int j = 2; j < kmax; j++)
+            for (int m = 0; m < 3; m++)
+                EIR(j, i, m) = EIR(j-1, i, m)*EIR(1, i, m);
+    }
+
+    // List the k-vectors, of which only one of each pair k and -k is included.
+
+    vector<array<int, 3>> kvectors;
+    for (int rx = 0; rx < numRx; rx++)
+        for (int ry = (rx == 0 ? 0 : 1-numRy); ry < numRy; ry++)
+            for (int rz = (rx == 0 && ry == 0 ? 1 : 1-numRz); rz < numRz; rz++)
+                kvectors.push_back({rx, ry, rz});
+
+    int numThreads = (threads == NULL ? 1 : threads->getNumThreads());
+    vector<vector<Vec3>> threadForces(numThreads, vector<Vec3>(numberOfAtoms));
+    vector<vector<double>> threadEnergies(numThreads, vector<double>(sliceEnergies.size(), 0.0));
+    auto task = [&] (int threadIndex) {
+        vector<d_complex> tab_qxyz(numberOfAtoms);
+        vector<double> cs(numberOfSubsets), ss(numberOfSubsets), csLambda(numberOfSubsets), ssLambda(numberOfSubsets);
+        vector<Vec3>& f = threadForces[threadIndex];
+        vector<double>& energies = threadEnergies[threadIndex];
+        for (int k = threadIndex; k < kvectors.size(); k += numThreads) {
+            int rx = kvectors[k][0], ry = kvectors[k][1], rz = kvectors[k][2];
+
+            // Compute q*exp(i*k*r) for all atoms and accumulate the structure factor of each subset.
+
+            fill(cs.begin(), cs.end(), 0.0);
+            fill(ss.begin(), ss.end(), 0.0);
+            for (int n = 0; n < numberOfAtoms; n++) {
+                d_complex eiy = (ry >= 0 ? EIR(ry, n, 1) : conj(EIR(-ry, n, 1)));
+                d_complex eiz = (rz >= 0 ? EIR(rz, n, 2) : conj(EIR(-rz, n, 2)));
+                tab_qxyz[n] = atomParameters[n][QIndex]*(EIR(rx, n, 0)*eiy*eiz);
+                int subset = atomSubsets[n];
+                cs[subset] += tab_qxyz[n].real();
+                ss[subset] += tab_qxyz[n].imag();
+            }
+
+            double kx = rx*recipBoxSize[0];
+            double ky = ry*recipBoxSize[1];
+            double kz = rz*recipBoxSize[2];
+            double k2 = kx*kx + ky*ky + kz*kz;
+            double ak = exp(k2*factorEwald)/k2;
+
+            // The force on an atom of subset i involves the structure factors of all subsets j,
+            // weighted by the Coulomb scaling parameter of slice (i, j).
+
+            for (int i = 0; i < numberOfSubsets; i++) {
+                csLambda[i] = ssLambda[i] = 0.0;
+                for (int j = 0; j < numberOfSubsets; j++) {
+                    int slice = i > j ? i*(i+1)/2+j : j*(j+1)/2+i;
+                    csLambda[i] += sliceLambdas[slice][Coul]*cs[j];
+                    ssLambda[i] += sliceLambdas[slice][Coul]*ss[j];
+                }
+            }
+            for (int n = 0; n < numberOfAtoms; n++) {
+                int i = atomSubsets[n];
+                double force = 2*recipCoeff*ak*(csLambda[i]*tab_qxyz[n].imag() - ssLambda[i]*tab_qxyz[n].real());
+                f[n][0] += force*kx;
+                f[n][1] += force*ky;
+                f[n][2] += force*kz;
+            }
+            for (int j = 0; j < numberOfSubsets; j++) {
+                for (int i = 0; i < j; i++)
+                    energies[j*(j+1)/2+i] += 2*recipCoeff*ak*(cs[i]*cs[j] + ss[i]*ss[j]);
+                energies[j*(j+3)/2] += recipCoeff*ak*(cs[j]*cs[j] + ss[j]*ss[j]);
+            }
+        }
+    };
+    if (numThreads == 1)
+        task(0);
+    else
+        threads->execute(task);
+    #undef EIR
+
+    // Sum the contributions of the threads in a fixed order, so that the results do not depend on timing.
+
+    for (int i = 0; i < numThreads; i++) {
+        for (int n = 0; n < numberOfAtoms; n++)
+            forces[n] += threadForces[i][n];
+        for (int slice = 0; slice < sliceEnergies.size(); slice++)
+            sliceEnergies[slice][Coul] += threadEnergies[i][slice];
+    }
+}
+
 /**---------------------------------------------------------------------------------------
 
    Calculate LJ Coulomb pair ixn
@@ -500,8 +479,9 @@ void ReferenceSlicedLJCoulombIxn::calculateEwaldIxn(int numberOfAtoms, vector<Ve
    @param atomSubsets      atom subsets
    @param atomParameters   atom parameters (charges, c6, c12, ...)     atomParameters[atomIndex][paramterIndex]
    @param sliceLambda      Coulomb and LJ scaling parameters for each slice
-   @param exclusions       atom exclusion indices
-                           exclusions[atomIndex] contains the list of exclusions for that atom
+   @param exclusionStarts  the exclusions of atom i are exclusionAtoms[exclusionStarts[i]] to
+                           exclusionAtoms[exclusionStarts[i+1]-1], in increasing order
+   @param exclusionAtoms   the excluded atoms of all atoms, stored contiguously
    @param forces           force array (forces added)
    @param sliceEnergies    the energy of each slice
    @param includeDirect      true if direct space interactions should be included
@@ -510,28 +490,281 @@ void ReferenceSlicedLJCoulombIxn::calculateEwaldIxn(int numberOfAtoms, vector<Ve
    --------------------------------------------------------------------------------------- */
 
 void ReferenceSlicedLJCoulombIxn::calculatePairIxn(int numberOfAtoms, vector<Vec3>& atomCoordinates, int numberOfSubsets, const vector<int>& atomSubsets,
-                const vector<vector<double>>& atomParameters, const vector<vector<double>>& sliceLambdas, const vector<set<int>>& exclusions,
-                vector<Vec3>& forces, vector<vector<double>>& sliceEnergies, bool includeDirect, bool includeReciprocal) const {
+                const vector<array<double, 3>>& atomParameters, const vector<array<double, 2>>& sliceLambdas, const vector<int>& exclusionStarts, const vector<int>& exclusionAtoms,
+                vector<Vec3>& forces, vector<array<double, 3>>& sliceEnergies, bool includeDirect, bool includeReciprocal) const {
 
     if (ewald || pme || ljpme) {
-        calculateEwaldIxn(numberOfAtoms, atomCoordinates, numberOfSubsets, atomSubsets, atomParameters, sliceLambdas, exclusions, forces,
+        calculateEwaldIxn(numberOfAtoms, atomCoordinates, numberOfSubsets, atomSubsets, atomParameters, sliceLambdas, exclusionStarts, exclusionAtoms, forces,
                           sliceEnergies, includeDirect, includeReciprocal);
         return;
     }
     if (!includeDirect)
         return;
-    if (cutoff) {
-        for (auto& pair : *neighborList)
-            calculateOneIxn(pair.first, pair.second, atomCoordinates, atomSubsets, atomParameters, sliceLambdas, forces, sliceEnergies);
+    calculateDirectIxns(numberOfAtoms, atomCoordinates, atomSubsets, atomParameters, sliceLambdas, exclusionStarts, exclusionAtoms, forces, sliceEnergies);
+}
+
+/**---------------------------------------------------------------------------------------
+
+     Calculate the direct space ixns of all pairs, splitting them among the threads of the
+     thread pool, if one has been set, with separate force and energy buffers per thread
+
+     --------------------------------------------------------------------------------------- */
+
+void ReferenceSlicedLJCoulombIxn::calculateDirectIxns(int numberOfAtoms, vector<Vec3>& atomCoordinates, const vector<int>& atomSubsets,
+                                            const vector<array<double, 3>>& atomParameters, const vector<array<double, 2>>& sliceLambdas,
+                                            const vector<int>& exclusionStarts, const vector<int>& exclusionAtoms, vector<Vec3>& forces, vector<array<double, 3>>& sliceEnergies) const {
+    ParticleArrays particles;
+    particles.charge.resize(numberOfAtoms);
+    particles.sigma.resize(numberOfAtoms);
+    particles.epsilon.resize(numberOfAtoms);
+    for (int i = 0; i < numberOfAtoms; i++) {
+        particles.charge[i] = atomParameters[i][QIndex];
+        particles.sigma[i] = atomParameters[i][SigIndex];
+        particles.epsilon[i] = atomParameters[i][EpsIndex];
+    }
+    DirectIxnRange calculateRange = selectDirectIxnRange();
+    int numThreads = (threads == NULL ? 1 : threads->getNumThreads());
+    if (numThreads == 1) {
+        (this->*calculateRange)(0, 1, numberOfAtoms, atomCoordinates, atomSubsets, atomParameters, particles, sliceLambdas, exclusionStarts, exclusionAtoms,
+                                forces, sliceEnergies);
+        return;
+    }
+    vector<vector<Vec3>> threadForces(numThreads, vector<Vec3>(forces.size()));
+    vector<vector<array<double, 3>>> threadEnergies(numThreads, vector<array<double, 3>>(sliceEnergies.size(), {0.0, 0.0, 0.0}));
+    threads->execute([&] (int threadIndex) {
+        (this->*calculateRange)(threadIndex, numThreads, numberOfAtoms, atomCoordinates, atomSubsets, atomParameters, particles,
+                                sliceLambdas, exclusionStarts, exclusionAtoms, threadForces[threadIndex], threadEnergies[threadIndex]);
+    });
+
+    // Sum the contributions of the threads in a fixed order, so that the results do not depend on timing.
+
+    for (int i = 0; i < numThreads; i++) {
+        for (int j = 0; j < forces.size(); j++)
+            forces[j] += threadForces[i][j];
+        for (int slice = 0; slice < sliceEnergies.size(); slice++) {
+            sliceEnergies[slice][Coul] += threadEnergies[i][slice][Coul];
+            sliceEnergies[slice][vdW] += threadEnergies[i][slice][vdW];
+            if (softCore)
+                sliceEnergies[slice][SoftCore] += threadEnergies[i][slice][SoftCore];
+        }
+    }
+}
+
+/**---------------------------------------------------------------------------------------
+
+     Select the variant of calculateDirectIxnRange() that matches the options of this force.
+     Switching and soft-core interactions are not allowed with LJPME, and no option other than
+     soft-core interactions applies without a cutoff, so only these variants are instantiated.
+
+     --------------------------------------------------------------------------------------- */
+
+ReferenceSlicedLJCoulombIxn::DirectIxnRange ReferenceSlicedLJCoulombIxn::selectDirectIxnRange() const {
+    if (!cutoff)
+        return softCore ? &ReferenceSlicedLJCoulombIxn::calculateDirectIxnRange<false, false, true, false, false>
+                        : &ReferenceSlicedLJCoulombIxn::calculateDirectIxnRange<false, false, false, false, false>;
+    if (ljpme)
+        return &ReferenceSlicedLJCoulombIxn::calculateDirectIxnRange<true, false, false, true, true>;
+    static const DirectIxnRange variants[] = {
+        &ReferenceSlicedLJCoulombIxn::calculateDirectIxnRange<true, false, false, false, false>,
+        &ReferenceSlicedLJCoulombIxn::calculateDirectIxnRange<true, true, false, false, false>,
+        &ReferenceSlicedLJCoulombIxn::calculateDirectIxnRange<true, false, true, false, false>,
+        &ReferenceSlicedLJCoulombIxn::calculateDirectIxnRange<true, true, true, false, false>,
+        &ReferenceSlicedLJCoulombIxn::calculateDirectIxnRange<true, false, false, true, false>,
+        &ReferenceSlicedLJCoulombIxn::calculateDirectIxnRange<true, true, false, true, false>,
+        &ReferenceSlicedLJCoulombIxn::calculateDirectIxnRange<true, false, true, true, false>,
+        &ReferenceSlicedLJCoulombIxn::calculateDirectIxnRange<true, true, true, true, false>
+    };
+    return variants[(useSwitch ? 1 : 0) + (softCore ? 2 : 0) + (ewald || pme ? 4 : 0)];
+}
+
+/**---------------------------------------------------------------------------------------
+
+     Calculate the direct space ixns of the pairs assigned to one of several threads
+
+     @param threadIndex  the index of the thread
+     @param numThreads   the number of threads the pairs are split among
+
+     --------------------------------------------------------------------------------------- */
+
+template <bool CUTOFF, bool SWITCH, bool SOFTCORE, bool EWALD, bool LJPME>
+void ReferenceSlicedLJCoulombIxn::calculateDirectIxnRange(int threadIndex, int numThreads, int numberOfAtoms, vector<Vec3>& atomCoordinates,
+                                            const vector<int>& atomSubsets, const vector<array<double, 3>>& atomParameters,
+                                            const ParticleArrays& particles, const vector<array<double, 2>>& sliceLambdas,
+                                            const vector<int>& exclusionStarts, const vector<int>& exclusionAtoms, vector<Vec3>& forces, vector<array<double, 3>>& sliceEnergies) const {
+    if (CUTOFF && !LJPME) {
+        int numPairs = neighborList->size();
+        int start = (int) ((long long) threadIndex*numPairs/numThreads);
+        int end = (int) ((long long) (threadIndex+1)*numPairs/numThreads);
+        if (skippedSlices.empty()) {
+            for (int k = start; k < end; k += PairBlockSize)
+                calculatePairBlock<SWITCH, SOFTCORE, EWALD>(&(*neighborList)[k], min((int) PairBlockSize, end-k), atomCoordinates, atomSubsets, particles, sliceLambdas,
+                                   forces, sliceEnergies);
+            return;
+        }
+
+        // Only the pairs of slices that are not skipped are gathered into blocks.
+
+        AtomPair block[PairBlockSize];
+        int blockSize = 0;
+        for (int k = start; k < end; k++) {
+            const AtomPair& pair = (*neighborList)[k];
+            if (isSkipped(pair.first, pair.second, atomSubsets))
+                continue;
+            block[blockSize++] = pair;
+            if (blockSize == PairBlockSize) {
+                calculatePairBlock<SWITCH, SOFTCORE, EWALD>(block, blockSize, atomCoordinates, atomSubsets, particles, sliceLambdas, forces, sliceEnergies);
+                blockSize = 0;
+            }
+        }
+        if (blockSize > 0)
+            calculatePairBlock<SWITCH, SOFTCORE, EWALD>(block, blockSize, atomCoordinates, atomSubsets, particles, sliceLambdas, forces, sliceEnergies);
+    }
+    else if (CUTOFF) {
+        int numPairs = neighborList->size();
+        int start = (int) ((long long) threadIndex*numPairs/numThreads);
+        int end = (int) ((long long) (threadIndex+1)*numPairs/numThreads);
+        for (int k = start; k < end; k++) {
+            const AtomPair& pair = (*neighborList)[k];
+            if (!skippedSlices.empty() && isSkipped(pair.first, pair.second, atomSubsets))
+                continue;
+            calculateOneEwaldIxn<SWITCH, LJPME>(pair.first, pair.second, atomCoordinates, atomSubsets, atomParameters, sliceLambdas, forces, sliceEnergies);
+        }
     }
     else {
-        for (int ii = 0; ii < numberOfAtoms; ii++) {
-            // loop over atom pairs
+        for (int ii = threadIndex; ii < numberOfAtoms; ii += numThreads) {
+            // loop over atom pairs, stepping through the sorted exclusions of atom ii alongside
+
+            int next = exclusionStarts[ii];
+            int last = exclusionStarts[ii+1];
+            for (int jj = ii+1; jj < numberOfAtoms; jj++) {
+                while (next < last && exclusionAtoms[next] < jj)
+                    next++;
+                if ((next == last || exclusionAtoms[next] != jj) && (skippedSlices.empty() || !isSkipped(ii, jj, atomSubsets)))
+                    calculateOneIxn<CUTOFF, SWITCH, SOFTCORE>(ii, jj, atomCoordinates, atomSubsets, atomParameters, sliceLambdas, forces, sliceEnergies);
+            }
+        }
+    }
+}
+
+/**---------------------------------------------------------------------------------------
+
+     Calculate the direct space ixns of up to PairBlockSize neighbor pairs at once.  The
+     pairs are gathered into fixed-size arrays, so that the arithmetic runs as straight-line
+     loops over the block that the compiler can vectorize.
 
-            for (int jj = ii+1; jj < numberOfAtoms; jj++)
-                if (exclusions[jj].find(ii) == exclusions[jj].end())
-                    calculateOneIxn(ii, jj, atomCoordinates, atomSubsets, atomParameters, sliceLambdas, forces, sliceEnergies);
+     @param pairs            the first pair of the block
+     @param numPairs         the number of pairs in the block
+     @param atomCoordinates  atom coordinates
+     @param atomSubsets      atom subsets
+     @param particles        the per-particle parameters
+     @param sliceLambda      Coulomb and LJ scaling parameters for each slice
+     @param forces           force array (forces added)
+     @param sliceEnergies    the energy of each slice
+
+     --------------------------------------------------------------------------------------- */
+
+template <bool SWITCH, bool SOFTCORE, bool EWALD>
+void ReferenceSlicedLJCoulombIxn::calculatePairBlock(const AtomPair* pairs, int numPairs, const vector<Vec3>& atomCoordinates,
+                                            const vector<int>& atomSubsets, const ParticleArrays& particles,
+                                            const vector<array<double, 2>>& sliceLambdas, vector<Vec3>& forces,
+                                            vector<array<double, 3>>& sliceEnergies) const {
+    double dx[PairBlockSize], dy[PairBlockSize], dz[PairBlockSize];
+    double chargeProd[PairBlockSize], sig[PairBlockSize], eps[PairBlockSize];
+    double clLambda[PairBlockSize], ljLambda[PairBlockSize];
+    double shift[PairBlockSize], shiftDerivative[PairBlockSize];
+    int slice[PairBlockSize];
+
+    // Gather the pairs.  Unused lanes, which repeat the last pair, and pairs beyond the cutoff
+    // get zero parameters.
+
+    for (int l = 0; l < PairBlockSize; l++) {
+        const AtomPair& pair = pairs[min(l, numPairs-1)];
+        int ii = pair.first;
+        int jj = pair.second;
+        Vec3 diff = atomCoordinates[ii]-atomCoordinates[jj];
+        if (periodic) {
+            diff -= periodicBoxVectors[2]*floor(diff[2]/periodicBoxVectors[2][2]+0.5);
+            diff -= periodicBoxVectors[1]*floor(diff[1]/periodicBoxVectors[1][1]+0.5);
+            diff -= periodicBoxVectors[0]*floor(diff[0]/periodicBoxVectors[0][0]+0.5);
+        }
+        dx[l] = diff[0];
+        dy[l] = diff[1];
+        dz[l] = diff[2];
+        bool active = (l < numPairs && diff.dot(diff) < cutoffDistance*cutoffDistance);
+        chargeProd[l] = active ? ONE_4PI_EPS0*particles.charge[ii]*particles.charge[jj] : 0.0;
+        sig[l] = particles.sigma[ii]+particles.sigma[jj];
+        eps[l] = active ? particles.epsilon[ii]*particles.epsilon[jj] : 0.0;
+        int si = atomSubsets[ii];
+        int sj = atomSubsets[jj];
+        slice[l] = si > sj ? si*(si+1)/2+sj : sj*(sj+1)/2+si;
+        clLambda[l] = sliceLambdas[slice[l]][Coul];
+        ljLambda[l] = sliceLambdas[slice[l]][vdW];
+        shift[l] = SOFTCORE ? softCoreShifts[slice[l]] : 0.0;
+        shiftDerivative[l] = SOFTCORE ? softCoreShiftDerivatives[slice[l]] : 0.0;
+    }
+
+    // Compute the interactions of all lanes.
+
+    double dEdR[PairBlockSize], clEnergy[PairBlockSize], ljEnergy[PairBlockSize], ljShiftTerm[PairBlockSize];
+    const double TWO_OVER_SQRT_PI = 2/sqrt(PI_M);
+    for (int l = 0; l < PairBlockSize; l++) {
+        double r2 = dx[l]*dx[l]+dy[l]*dy[l]+dz[l]*dz[l];
+        double r = sqrt(r2);
+        double inverseR = 1.0/r;
+        double inverseR2 = inverseR*inverseR;
+        double sig2 = inverseR*sig[l];
+        sig2 *= sig2;
+        double sig6 = sig2*sig2*sig2;
+        double vdwEnergy, dEdRvdW, shiftTerm = 0.0;
+        if (SOFTCORE) {
+            // u = 1/(shift + (r/sigma)^6) is written in terms of sig6 = (sigma/r)^6, so that a
+            // zero sigma gives zero instead of 0/0.
+
+            double q = 1.0/(1.0+shift[l]*sig6);
+            double u = sig6*q;
+            vdwEnergy = eps[l]*(u-1.0)*u;
+            dEdRvdW = eps[l]*(12.0*u-6.0)*u*q*inverseR2;
+            shiftTerm = eps[l]*(1.0-2.0*u)*u*u*shiftDerivative[l];
+        }
+        else {
+            vdwEnergy = eps[l]*(sig6-1.0)*sig6;
+            dEdRvdW = eps[l]*(12.0*sig6-6.0)*sig6*inverseR2;
+        }
+        if (SWITCH) {
+            double t = (r > switchingDistance ? (r-switchingDistance)/(cutoffDistance-switchingDistance) : 0.0);
+            double switchValue = 1+t*t*t*(-10+t*(15-t*6));
+            double switchDeriv = t*t*(-30+t*(60-t*30))/(cutoffDistance-switchingDistance);
+            dEdRvdW = switchValue*dEdRvdW-vdwEnergy*switchDeriv*inverseR;
+            vdwEnergy *= switchValue;
+            shiftTerm *= switchValue;
+        }
+        double dEdRCoul, coulEnergy;
+        if (EWALD) {
+            double alphaR = alphaEwald*r;
+            double erfcAlphaR = erfc(alphaR);
+            dEdRCoul = chargeProd[l]*inverseR2*inverseR*(erfcAlphaR+alphaR*exp(-alphaR*alphaR)*TWO_OVER_SQRT_PI);
+            coulEnergy = chargeProd[l]*inverseR*erfcAlphaR;
         }
+        else {
+            dEdRCoul = chargeProd[l]*inverseR2*(inverseR-2.0*krf*r2);
+            coulEnergy = chargeProd[l]*(inverseR+krf*r2-crf);
+        }
+        dEdR[l] = ljLambda[l]*dEdRvdW+clLambda[l]*dEdRCoul;
+        clEnergy[l] = coulEnergy;
+        ljEnergy[l] = vdwEnergy;
+        ljShiftTerm[l] = shiftTerm;
+    }
+
+    // Scatter the forces and energies.
+
+    for (int l = 0; l < numPairs; l++) {
+        Vec3 force = Vec3(dx[l], dy[l], dz[l])*dEdR[l];
+        forces[pairs[l].first] += force;
+        forces[pairs[l].second] -= force;
+        sliceEnergies[slice[l]][Coul] += clEnergy[l];
+        sliceEnergies[slice[l]][vdW] += ljEnergy[l];
+        if (SOFTCORE)
+            sliceEnergies[slice[l]][SoftCore] += ljShiftTerm[l];
     }
 }
 
@@ -550,9 +783,10 @@ void ReferenceSlicedLJCoulombIxn::calculatePairIxn(int numberOfAtoms, vector<Vec
 
      --------------------------------------------------------------------------------------- */
 
+template <bool CUTOFF, bool SWITCH, bool SOFTCORE>
 void ReferenceSlicedLJCoulombIxn::calculateOneIxn(int ii, int jj, vector<Vec3>& atomCoordinates, const vector<int>& atomSubsets,
-                                            const vector<vector<double>>& atomParameters, const vector<vector<double>>& sliceLambdas, vector<Vec3>& forces,
-                                            vector<vector<double>>& sliceEnergies) const {
+                                            const vector<array<double, 3>>& atomParameters, const vector<array<double, 2>>& sliceLambdas, vector<Vec3>& forces,
+                                            vector<array<double, 3>>& sliceEnergies) const {
     double deltaR[2][ReferenceForce::LastDeltaRIndex];
 
     int si = atomSubsets[ii];
@@ -567,9 +801,11 @@ void ReferenceSlicedLJCoulombIxn::calculateOneIxn(int ii, int jj, vector<Vec3>&
         ReferenceForce::getDeltaR(atomCoordinates[jj], atomCoordinates[ii], deltaR[0]);
 
     double r2        = deltaR[0][ReferenceForce::R2Index];
+    if (CUTOFF && r2 >= cutoffDistance*cutoffDistance)
+        return;
     double inverseR  = 1.0/(deltaR[0][ReferenceForce::RIndex]);
     double switchValue = 1, switchDeriv = 0;
-    if (useSwitch) {
+    if (SWITCH) {
         double r = deltaR[0][ReferenceForce::RIndex];
         if (r > switchingDistance) {
             double t = (r-switchingDistance)/(cutoffDistance-switchingDistance);
@@ -583,19 +819,33 @@ void ReferenceSlicedLJCoulombIxn::calculateOneIxn(int ii, int jj, vector<Vec3>&
     double sig6 = sig2*sig2*sig2;
 
     double eps = atomParameters[ii][EpsIndex]*atomParameters[jj][EpsIndex];
-    double dEdRvdW = switchValue*eps*(12.0*sig6 - 6.0)*sig6*inverseR*inverseR;
+    double shift = SOFTCORE ? softCoreShifts[slice] : 0.0;
+    double shiftTerm = 0.0;
+    double dEdRvdW, energy;
+    if (SOFTCORE && (shift != 0.0 || softCoreShiftDerivatives[slice] != 0.0)) {
+        double q = 1.0/(1.0+shift*sig6);
+        double u = sig6*q;
+        dEdRvdW = switchValue*eps*(12.0*u - 6.0)*u*q*inverseR*inverseR;
+        energy = eps*(u-1.0)*u;
+        shiftTerm = switchValue*eps*(1.0-2.0*u)*u*u*softCoreShiftDerivatives[slice];
+    }
+    else {
+        dEdRvdW = switchValue*eps*(12.0*sig6 - 6.0)*sig6*inverseR*inverseR;
+        energy = eps*(sig6-1.0)*sig6;
+    }
     double dEdRCoul = inverseR*inverseR;
-    if (cutoff)
+    if (CUTOFF)
         dEdRCoul *= ONE_4PI_EPS0*atomParameters[ii][QIndex]*atomParameters[jj][QIndex]*(inverseR-2.0f*krf*r2);
     else
         dEdRCoul *= ONE_4PI_EPS0*atomParameters[ii][QIndex]*atomParameters[jj][QIndex]*inverseR;
-    double energy = eps*(sig6-1.0)*sig6;
-    if (useSwitch) {
+    if (SWITCH) {
         dEdRvdW -= energy*switchDeriv*inverseR;
         energy *= switchValue;
     }
     sliceEnergies[slice][vdW] += energy;
-    if (cutoff)
+    if (SOFTCORE)
+        sliceEnergies[slice][SoftCore] += shiftTerm;
+    if (CUTOFF)
         sliceEnergies[slice][Coul] += ONE_4PI_EPS0*atomParameters[ii][QIndex]*atomParameters[jj][QIndex]*(inverseR+krf*r2-crf);
     else
         sliceEnergies[slice][Coul] += ONE_4PI_EPS0*atomParameters[ii][QIndex]*atomParameters[jj][QIndex]*inverseR;
@@ -609,3 +859,102 @@ void ReferenceSlicedLJCoulombIxn::calculateOneIxn(int ii, int jj, vector<Vec3>&
         forces[jj][kk] -= force;
     }
 }
+
+/**---------------------------------------------------------------------------------------
+
+     Calculate the direct space Ewald ixn between two atoms
+
+     @param ii               the index of the first atom
+     @param jj               the index of the second atom
+     @param atomCoordinates  atom coordinates
+     @param atomSubsets      atom subsets
+     @param atomParameters   atom parameters (charges, c6, c12, ...)     atomParameters[atomIndex][paramterIndex]
+     @param sliceLambda      Coulomb and LJ scaling parameters for each slice
+     @param forces           force array (forces added)
+     @param sliceEnergies    the energy of each slice
+
+     --------------------------------------------------------------------------------------- */
+
+template <bool SWITCH, bool LJPME>
+void ReferenceSlicedLJCoulombIxn::calculateOneEwaldIxn(int ii, int jj, vector<Vec3>& atomCoordinates, const vector<int>& atomSubsets,
+                                            const vector<array<double, 3>>& atomParameters, const vector<array<double, 2>>& sliceLambdas, vector<Vec3>& forces,
+                                            vector<array<double, 3>>& sliceEnergies) const {
+    double SQRT_PI = sqrt(PI_M);
+
+    int si = atomSubsets[ii];
+    int sj = atomSubsets[jj];
+    int slice = si > sj ? si*(si+1)/2+sj : sj*(sj+1)/2+si;
+
+    double deltaR[2][ReferenceForce::LastDeltaRIndex];
+    ReferenceForce::getDeltaRPeriodic(atomCoordinates[jj], atomCoordinates[ii], periodicBoxVectors, deltaR[0]);
+    double r         = deltaR[0][ReferenceForce::RIndex];
+    if (r >= cutoffDistance)
+        return;
+    double inverseR  = 1.0/(deltaR[0][ReferenceForce::RIndex]);
+    double switchValue = 1, switchDeriv = 0;
+    if (SWITCH && r > switchingDistance) {
+        double t = (r-switchingDistance)/(cutoffDistance-switchingDistance);
+        switchValue = 1+t*t*t*(-10+t*(15-t*6));
+        switchDeriv = t*t*(-30+t*(60-t*30))/(cutoffDistance-switchingDistance);
+    }
+    double alphaR = alphaEwald*r;
+
+    double dEdRCoul = ONE_4PI_EPS0*atomParameters[ii][QIndex]*atomParameters[jj][QIndex]*inverseR*inverseR*inverseR;
+    dEdRCoul *= erfc(alphaR) + 2*alphaR*exp(-alphaR*alphaR)/SQRT_PI;
+
+    double sig = atomParameters[ii][SigIndex] +  atomParameters[jj][SigIndex];
+    double sig2 = inverseR*sig;
+    sig2 *= sig2;
+    double sig6 = sig2*sig2*sig2;
+    double eps = atomParameters[ii][EpsIndex]*atomParameters[jj][EpsIndex];
+    double dEdRvdW = switchValue*eps*(12.0*sig6 - 6.0)*sig6*inverseR*inverseR;
+    double vdwEnergy = eps*(sig6-1.0)*sig6;
+
+    if (LJPME) {
+        double dalphaR   = alphaDispersionEwald*r;
+        double dar2 = dalphaR*dalphaR;
+        double dar4 = dar2*dar2;
+        double dar6 = dar4*dar2;
+        double inverseR2 = inverseR*inverseR;
+        double c6i = 8.0*pow(atomParameters[ii][SigIndex], 3.0)*atomParameters[ii][EpsIndex];
+        double c6j = 8.0*pow(atomParameters[jj][SigIndex], 3.0)*atomParameters[jj][EpsIndex];
+        // For the energies and forces, we first add the regular Lorentz−Berthelot terms.  The C12 term is treated as usual
+        // but we then subtract out (remembering that the C6 term is negative) the multiplicative C6 term that has been
+        // computed in real space.  Finally, we add a potential shift term to account for the difference between the LB
+        // and multiplicative functional forms at the cutoff.
+        double emult = c6i*c6j*inverseR2*inverseR2*inverseR2*(1.0 - EXP(-dar2)*(1.0 + dar2 + 0.5*dar4));
+        dEdRvdW += 6.0*c6i*c6j*inverseR2*inverseR2*inverseR2*inverseR2*(1.0 - EXP(-dar2)*(1.0 + dar2 + 0.5*dar4 + dar6/6.0));
+
+        double inverseCut2 = 1.0/(cutoffDistance*cutoffDistance);
+        double inverseCut6 = inverseCut2*inverseCut2*inverseCut2;
+        sig2 = atomParameters[ii][SigIndex] +  atomParameters[jj][SigIndex];
+        sig2 *= sig2;
+        sig6 = sig2*sig2*sig2;
+        // The additive part of the potential shift
+        double potentialshift = eps*(1.0-sig6*inverseCut6)*sig6*inverseCut6;
+        dalphaR   = alphaDispersionEwald*cutoffDistance;
+        dar2 = dalphaR*dalphaR;
+        dar4 = dar2*dar2;
+        // The multiplicative part of the potential shift
+        potentialshift -= c6i*c6j*inverseCut6*(1.0 - EXP(-dar2)*(1.0 + dar2 + 0.5*dar4));
+        vdwEnergy += emult + potentialshift;
+    }
+
+    if (SWITCH) {
+        dEdRvdW -= vdwEnergy*switchDeriv*inverseR;
+        vdwEnergy *= switchValue;
+    }
+
+    // accumulate forces
+
+    double factor = sliceLambdas[slice][vdW]*dEdRvdW+sliceLambdas[slice][Coul]*dEdRCoul;
+    for (int kk = 0; kk < 3; kk++) {
+        double force = factor*deltaR[0][kk];
+        forces[ii][kk] += force;
+        forces[jj][kk] -= force;
+    }
+
+    // accumulate energies
+    sliceEnergies[slice][vdW] += vdwEnergy;
+    sliceEnergies[slice][Coul] += ONE_4PI_EPS0*atomParameters[ii][QIndex]*atomParameters[jj][QIndex]*inverseR*erfc(alphaR);
+}
@@ -10,6 +10,37 @@
 
 #include "ReferenceOpenMMLabTests.h"
 #include "TestSlicedNonbondedForce.h"
+#include "internal/SharedThreadPool.h"
+#include <thread>
+
+void testSharedThreadPool() {
+    // Nested calls and calls from several threads at once run in the calling thread when the
+    // pool is busy, and must give the same sums as a serial loop, without deadlocking.
+
+    SharedThreadPool& pool = SharedThreadPool::getInstance();
+    int n = 1000;
+    long long expected = (long long) n*(n-1)/2*n*(n-1)/2;
+    auto sum = [] (long long& total, long long partial) { total += partial; };
+    auto nestedSum = [&] () {
+        return pool.parallelReduce(n, 0LL, [&] (int start, int end, long long& partial) {
+            for (int i = start; i < end; i++)
+                partial += pool.parallelReduce(n, 0LL, [&] (int start2, int end2, long long& partial2) {
+                    for (int j = start2; j < end2; j++)
+                        partial2 += (long long) i*j;
+                }, sum);
+        }, sum);
+    };
+    ASSERT_EQUAL(expected, nestedSum());
+    vector<long long> results(4);
+    vector<thread> callers;
+    for (int i = 0; i < results.size(); i++)
+        callers.push_back(thread([&, i] () { results[i] = nestedSum(); }));
+    for (thread& caller : callers)
+        caller.join();
+    for (long long result : results)
+        ASSERT_EQUAL(expected, result);
+}
 
 void runPlatformTests() {
+    testSharedThreadPool();
 }
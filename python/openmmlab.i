@@ -1,4 +1,4 @@
-%module openmmlab
+%module(threads="1") openmmlab
 
 %import(module="openmm") "swig/OpenMMSwigHeaders.i"
 %include "swig/typemaps.i"
@@ -8,15 +8,26 @@
 
 namespace std {
   %template(vectord) vector<double>;
+  %template(vectori) vector<int>;
+  %template(vectorll) vector<long long>;
+  %template(vectorvectord) vector<vector<double>>;
+  %template(vectorVec3) vector<OpenMM::Vec3>;
+  %template(vectorvectorVec3) vector<vector<OpenMM::Vec3>>;
   %template(vectorstring) vector<string>;
   %template(mapstringstring) map<string,string>;
   %template(mapstringdouble) map<string,double>;
+  %template(mapstringlonglong) map<string,long long>;
 };
 
 %{
 #define SWIG_PYTHON_CAST_MODE
+#include "DeviceArray.h"
 #include "SlicedNonbondedForce.h"
 #include "CustomSummation.h"
+#include "CustomSummationGroup.h"
+#include "SharedTermStore.h"
+#include "ContextSnapshot.h"
+#include "RadialBasisFunctionFitter.h"
 #include "ExtendedCustomCVForce.h"
 #include "OpenMM.h"
 #include "OpenMMAmoeba.h"
@@ -25,7 +36,76 @@ namespace std {
 #include "openmm/RPMDMonteCarloBarostat.h"
 %}
 
+/*
+ * Output typemaps for the argument types that the typemaps of OpenMM do not cover.  Every
+ * output is appended to the result as a list, or as an int for enumerations.
+*/
+
+%{
+static PyObject* openmmlabToPython(int value) {
+    return PyLong_FromLong(value);
+}
+
+static PyObject* openmmlabToPython(long long value) {
+    return PyLong_FromLongLong(value);
+}
+
+static PyObject* openmmlabToPython(double value) {
+    return PyFloat_FromDouble(value);
+}
+
+static PyObject* openmmlabToPython(const std::string& value) {
+    return PyUnicode_FromStringAndSize(value.data(), value.size());
+}
+
+template <class T>
+static PyObject* openmmlabToPython(const std::vector<T>& values) {
+    PyObject* list = PyList_New(values.size());
+    if (list == NULL)
+        return NULL;
+    for (size_t i = 0; i < values.size(); i++) {
+        PyObject* item = openmmlabToPython(values[i]);
+        if (item == NULL) {
+            Py_DECREF(list);
+            return NULL;
+        }
+        PyList_SET_ITEM(list, i, item);
+    }
+    return list;
+}
+%}
+
+%define OPENMMLAB_OUTPUT_TYPEMAP(TYPE)
+%typemap(in, numinputs=0) TYPE& OUTPUT (TYPE temp) {
+    $1 = &temp;
+}
+%typemap(argout) TYPE& OUTPUT {
+    PyObject* output = openmmlabToPython(*$1);
+    if (output == NULL)
+        SWIG_fail;
+    %append_output(output);
+}
+%enddef
+
+OPENMMLAB_OUTPUT_TYPEMAP(std::vector<int>)
+OPENMMLAB_OUTPUT_TYPEMAP(std::vector<long long>)
+OPENMMLAB_OUTPUT_TYPEMAP(std::vector<std::string>)
+OPENMMLAB_OUTPUT_TYPEMAP(std::vector<std::vector<double> >)
+
+%typemap(in, numinputs=0) OpenMMLab::ExtendedCustomCVForce::RadialBasisFunctionType& OUTPUT
+        (OpenMMLab::ExtendedCustomCVForce::RadialBasisFunctionType temp) {
+    $1 = &temp;
+}
+%typemap(argout) OpenMMLab::ExtendedCustomCVForce::RadialBasisFunctionType& OUTPUT {
+    PyObject* output = openmmlabToPython((int) *$1);
+    if (output == NULL)
+        SWIG_fail;
+    %append_output(output);
+}
+
 %pythoncode %{
+import numpy as np
+
 __version__ = "@CMAKE_PROJECT_VERSION@"
 %}
 
@@ -74,11 +154,52 @@ __version__ = "@CMAKE_PROJECT_VERSION@"
         raise Exception(s)
 %}
 
+%pythonprepend OpenMMLab::ExtendedCustomCVForce::addCollectiveVariableBatch(
+    const std::vector<std::string>& names, OpenMM::Force* variables) %{
+    if not variables.thisown:
+        s = ("the %s object does not own its corresponding OpenMM object"
+                % self.__class__.__name__)
+        raise Exception(s)
+%}
+
+%pythonappend OpenMMLab::ExtendedCustomCVForce::addCollectiveVariableBatch(
+    const std::vector<std::string>& names, OpenMM::Force* variables) %{
+    variables.thisown = 0
+%}
+
+%pythonprepend OpenMMLab::ExtendedCustomCVForce::addSharedParticle(OpenMM::VirtualSite* site) %{
+    if not site.thisown:
+        s = ("the %s object does not own its corresponding OpenMM object"
+                % self.__class__.__name__)
+        raise Exception(s)
+%}
+
+%pythonappend OpenMMLab::ExtendedCustomCVForce::addSharedParticle(OpenMM::VirtualSite* site) %{
+    site.thisown = 0
+%}
+
 %pythonappend OpenMMLab::ExtendedCustomCVForce::addTabulatedFunction(
     const std::string& name, OpenMM::TabulatedFunction* function) %{
     function.thisown = 0
 %}
 
+/*
+ * Process custom summation when adding it.
+*/
+
+%pythonprepend OpenMMLab::ExtendedCustomCVForce::addCustomSummation(
+    const std::string& name, CustomSummation* summation, const std::vector<std::string>& variables) %{
+    if not summation.thisown:
+        s = ("the %s object does not own its corresponding OpenMM object"
+                % self.__class__.__name__)
+        raise Exception(s)
+%}
+
+%pythonappend OpenMMLab::ExtendedCustomCVForce::addCustomSummation(
+    const std::string& name, CustomSummation* summation, const std::vector<std::string>& variables) %{
+    summation.thisown = 0
+%}
+
 
 /*
  * Converts swig maps to dicts
@@ -93,6 +214,36 @@ __version__ = "@CMAKE_PROJECT_VERSION@"
     val = dict(val)
 %}
 
+%pythonappend OpenMMLab::SlicedNonbondedForce::getStageTimesInContext(OpenMM::Context& context) %{
+    val = dict(val)
+%}
+
+%pythonappend OpenMMLab::ExtendedCustomCVForce::getStageTimesInContext(OpenMM::Context& context) %{
+    val = dict(val)
+%}
+
+%pythonappend OpenMMLab::ExtendedCustomCVForce::getCountersInContext(OpenMM::Context& context) %{
+    val = dict(val)
+%}
+
+/*
+ * Release the GIL during the calls that can take long, so that Python threads driving
+ * different contexts or summations run concurrently. Every other call keeps the GIL,
+ * since releasing it costs more than they do.
+*/
+
+%nothread;
+%thread OpenMMLab::SlicedNonbondedForce::updateParametersInContext;
+%thread OpenMMLab::ExtendedCustomCVForce::getCollectiveVariableValues;
+%thread OpenMMLab::ExtendedCustomCVForce::updateParametersInContext;
+%thread OpenMMLab::CustomSummation::evaluate;
+%thread OpenMMLab::CustomSummation::evaluateDerivative;
+%thread OpenMMLab::CustomSummation::evaluateHessianProduct;
+%thread OpenMMLab::CustomSummation::evaluateHessianDiagonal;
+%thread OpenMMLab::CustomSummation::update;
+%thread OpenMMLab::CustomSummationGroup::evaluate;
+%thread OpenMMLab::CustomSummationGroup::update;
+
 /*
  * Convert C++ exceptions to Python exceptions.
 */
@@ -109,6 +260,7 @@ __version__ = "@CMAKE_PROJECT_VERSION@"
 namespace OpenMMLab {
 
 %apply double& OUTPUT {double& alpha};
+%apply double& OUTPUT {double& power};
 %apply int& OUTPUT {int& nx};
 %apply int& OUTPUT {int& ny};
 %apply int& OUTPUT {int& nz};
@@ -118,6 +270,62 @@ namespace OpenMMLab {
 %apply bool& OUTPUT {bool& includeLJ};
 %apply bool& OUTPUT {bool& includeCoulomb};
 
+/**
+ * This describes an array that resides in the memory of a GPU, so that other libraries can
+ * read it in place, without copying it to the host.  It implements the CUDA array interface,
+ * so it can be passed directly to functions such as ``torch.as_tensor`` or ``cupy.asarray``.
+ *
+ * The array is owned by the Context it was obtained from.  It remains valid until the Context
+ * is destroyed or reinitialized, but its contents change every time the Context computes
+ * forces.  Consumers that honor the stream of the interface order their work after that of
+ * the Context.
+ */
+class DeviceArray {
+public:
+    DeviceArray();
+    /**
+     * The address of the first element in device memory, or 0 if the array does not exist.
+     */
+    long long pointer;
+    /**
+     * The type of the elements, as a NumPy type string such as "<f4" or "<i8".
+     */
+    std::string typestr;
+    /**
+     * The number of elements along each dimension, in row-major order.
+     */
+    std::vector<int> shape;
+    /**
+     * The handle of the CUDA stream on which the Context writes the array.
+     */
+    long long stream;
+    /**
+     * The index of the device that holds the array.
+     */
+    int device;
+    /**
+     * The factor that converts the stored elements into standard units, which is not 1
+     * when they are stored in fixed point.
+     */
+    double scale;
+
+    %pythoncode %{
+    @property
+    def __cuda_array_interface__(self):
+        if self.pointer == 0:
+            raise AttributeError("the array does not exist")
+        # In the interface, 1 denotes the legacy default stream, whose handle is 0.
+        return {
+            "shape": tuple(self.shape),
+            "typestr": self.typestr,
+            "data": (self.pointer, False),
+            "version": 3,
+            "strides": None,
+            "stream": self.stream if self.stream != 0 else 1,
+        }
+    %}
+};
+
 /**
  * This class implements sliced nonbonded interactions between particles, including a Coulomb force to represent
  * electrostatics and a Lennard-Jones force to represent van der Waals interactions.  It optionally supports
@@ -294,6 +502,230 @@ public:
      *         the Context in which to update the parameters
      */
     void updateParametersInContext(OpenMM::Context& context);
+    /**
+     * Compute the Coulomb and Lennard-Jones energies of every slice for the current state of a Context, not
+     * multiplied by the scaling parameters.  Since the energy of this force is linear in the scaling parameters,
+     * these are all that is needed to evaluate it for any other set of parameter values, e.g. for reweighting a
+     * trajectory over a lambda window.  Self energies and dispersion corrections are included in the slices they
+     * belong to.  On the Reference platform all slices are computed in a single pass.  On other platforms each
+     * slice takes one energy evaluation of the force groups of this force, except that reciprocal space slice
+     * energies are read in a single pass if they belong to a separate force group and there are no parameter
+     * offsets.  On the CUDA and OpenCL platforms, the reciprocal space energies of all slices without a scaling
+     * parameter are reported together, as part of the first of these slices.
+     *
+     * Parameters
+     * ----------
+     *     context : Context
+     *         the Context in which to compute the energies
+     *
+     * Returns
+     * -------
+     *     coulombEnergies : list(float)
+     *         the Coulomb energy of each slice, in kJ/mol
+     *     ljEnergies : list(float)
+     *         the Lennard-Jones energy of each slice, in kJ/mol
+     */
+%apply std::vector<double>& OUTPUT {std::vector<double>& coulombEnergies};
+%apply std::vector<double>& OUTPUT {std::vector<double>& ljEnergies};
+    void getSliceEnergiesInContext(OpenMM::Context& context, std::vector<double>& coulombEnergies, std::vector<double>& ljEnergies);
+%clear std::vector<double>& coulombEnergies;
+%clear std::vector<double>& ljEnergies;
+    /**
+     * Add a foreign set of scaling parameter values, at which :func:`getForeignEnergiesInContext` evaluates the
+     * energy of this force.  This serves, for instance, to compute the energies of all lambda windows of an expanded
+     * ensemble or MBAR analysis at every step.
+     *
+     * Parameters
+     * ----------
+     *     values : dict(str, float)
+     *         the values of some scaling parameters, indexed by name.  Scaling parameters that are not in the set keep
+     *         their current values in the Context
+     *
+     * Returns
+     * -------
+     *     index : int
+     *         the index of the set that was added
+     */
+    int addForeignScalingParameterSet(const std::map<std::string, double>& values);
+    /**
+     * Get the number of foreign sets of scaling parameter values.
+     */
+    int getNumForeignScalingParameterSets() const;
+    /**
+     * Get a foreign set of scaling parameter values.
+     *
+     * Parameters
+     * ----------
+     *     index : int
+     *         the index of the set, between 0 and the result of :func:`getNumForeignScalingParameterSets`
+     */
+    const std::map<std::string, double>& getForeignScalingParameterSet(int index) const;
+    /**
+     * Replace a foreign set of scaling parameter values.
+     *
+     * Parameters
+     * ----------
+     *     index : int
+     *         the index of the set, between 0 and the result of :func:`getNumForeignScalingParameterSets`
+     *     values : dict(str, float)
+     *         the values of some scaling parameters, indexed by name
+     */
+    void setForeignScalingParameterSet(int index, const std::map<std::string, double>& values);
+    /**
+     * Compute the energy of this force at each foreign set of scaling parameter values, for the current state of a
+     * Context.  The slice energies are computed once, as in :func:`getSliceEnergiesInContext`, and every foreign
+     * energy is obtained from them, so that the cost hardly depends on the number of sets.  This is not available if
+     * some slice uses a soft-core potential.
+     *
+     * Parameters
+     * ----------
+     *     context : Context
+     *         the Context in which to compute the energies
+     *
+     * Returns
+     * -------
+     *     energies : list(float)
+     *         the energy at each foreign set of scaling parameter values, in kJ/mol
+     */
+%apply std::vector<double>& OUTPUT {std::vector<double>& energies};
+    void getForeignEnergiesInContext(OpenMM::Context& context, std::vector<double>& energies);
+%clear std::vector<double>& energies;
+    /**
+     * Compute the foreign energies of several replicas of the same System, which differ only in their positions,
+     * using a single Context.  This gives the whole energy matrix of a Hamiltonian replica exchange simulation,
+     * with the foreign sets being the scaling parameter values of the replicas, without creating a Context for
+     * each replica.  This is a convenience loop that calls :func:`getForeignEnergiesInContext` once per replica,
+     * with no batching on the device.  The positions of the Context are restored afterward, also if an evaluation
+     * fails, and its box vectors are used for all replicas.
+     *
+     * Parameters
+     * ----------
+     *     context : Context
+     *         the Context in which to compute the energies
+     *     positions : list(list(Vec3))
+     *         the positions of the particles in each replica, in nm
+     *
+     * Returns
+     * -------
+     *     energies : list(list(float))
+     *         the energy of each replica at each foreign set of scaling parameter values, in kJ/mol
+     */
+%apply std::vector<std::vector<double>>& OUTPUT {std::vector<std::vector<double>>& energies};
+    void getReplicaEnergiesInContext(OpenMM::Context& context, const std::vector<std::vector<OpenMM::Vec3>>& positions,
+                                     std::vector<std::vector<double>>& energies);
+%clear std::vector<std::vector<double>>& energies;
+    /**
+     * Compute the reduced energies of this force at every foreign set of scaling parameter values for a batch of
+     * frames, such as those of a saved trajectory to be analyzed with MBAR.  This is a convenience loop that calls
+     * :func:`getForeignEnergiesInContext` once per frame, with no batching on the device, so each frame costs the
+     * same regardless of the number of sets, and no parameter of the Context is changed.  The positions and box
+     * vectors of the Context are restored afterward, also if an evaluation fails.  The energies of the other
+     * forces of the System shift the reduced energies of each frame by the same amount at every set, which does not
+     * change MBAR estimates.
+     *
+     * Parameters
+     * ----------
+     *     context : Context
+     *         the Context in which to compute the energies
+     *     frames : list(list(Vec3))
+     *         the positions of the particles at each frame, in nm
+     *     boxVectors : list(list(Vec3))
+     *         the three periodic box vectors at each frame, in nm, or an empty list to use those of the Context
+     *     temperature : float
+     *         the temperature, in Kelvin, at which the energies are reduced
+     *
+     * Returns
+     * -------
+     *     reducedEnergies : list(list(float))
+     *         the energy of each frame at each foreign set of scaling parameter values divided by kT, indexed by set
+     *         and then by frame
+     */
+%apply std::vector<std::vector<double>>& OUTPUT {std::vector<std::vector<double>>& reducedEnergies};
+    void getReducedForeignEnergiesInContext(OpenMM::Context& context, const std::vector<std::vector<OpenMM::Vec3>>& frames,
+                                            const std::vector<std::vector<OpenMM::Vec3>>& boxVectors, double temperature,
+                                            std::vector<std::vector<double>>& reducedEnergies);
+%clear std::vector<std::vector<double>>& reducedEnergies;
+    /**
+     * Make a Context evaluate this force at one of the foreign sets of scaling parameter values, which then serves
+     * as a lambda state.  The lambdas of all slices are precomputed for every set and kept in device memory, so that
+     * switching states, as Hamiltonian replica exchange does at every exchange attempt, neither looks up parameters
+     * nor copies anything from the host.  Scaling parameters that are not in a set take their default values.
+     *
+     * While a state is selected, this force ignores the values of the scaling parameters in the Context, and
+     * selecting -1 makes it follow them again.  The states are precomputed when the Context is created and whenever
+     * updateParametersInContext() is called, so changes to the foreign sets only take effect then.  This is
+     * currently only supported by the CUDA platform.
+     *
+     * Parameters
+     * ----------
+     *     context : Context
+     *         the Context in which to select the state
+     *     index : int
+     *         the index of the foreign set, or -1 to use the scaling parameters of the Context
+     */
+    void setLambdaStateInContext(OpenMM::Context& context, int index);
+    /**
+     * Get the lambda state selected in a Context by setLambdaStateInContext(), or -1 if this force uses the
+     * scaling parameters of the Context.
+     *
+     * Parameters
+     * ----------
+     *     context : Context
+     *         the Context in which the force is evaluated
+     */
+    int getLambdaStateInContext(OpenMM::Context& context);
+    /**
+     * Compute the derivatives of the energy of this force with respect to the scaling parameters for which
+     * derivatives were requested, for the current state of a Context.  This is cheaper than a full evaluation, as
+     * needed for thermodynamic integration: on the CUDA and OpenCL platforms, only the slices that have a requested
+     * derivative are switched on, so the direct space kernels skip the pairs of all other slices, although
+     * reciprocal space is still computed in full.  On those platforms, derivatives with respect to the same
+     * parameters from other forces in the same force groups are included as well.
+     *
+     * Parameters
+     * ----------
+     *     context : Context
+     *         the Context in which to compute the derivatives
+     *
+     * Returns
+     * -------
+     *     dict(str, float)
+     *         the derivative with respect to each parameter, in kJ/mol
+     */
+    std::map<std::string, double> getScalingParameterDerivativesInContext(OpenMM::Context& context);
+    /**
+     * Get the time spent in each stage of the computation of this force in a Context, in milliseconds,
+     * accumulated since the Context was created or the times were last reset.  On the CUDA platform the stages are
+     * timed by the GPU itself, so they do not include the time of launching the kernels.  On the OpenCL platform
+     * they are timed on the host, which waits for the queue at the start and the end of every stage.  Profiling must
+     * be enabled by setting the environment variable OPENMMLAB_PROFILING to 1 before the Context is created, and is
+     * currently supported by the CUDA and OpenCL platforms.  On every platform, profiling also reports the time taken to initialize the kernel when
+     * the Context was created ("init:kernel").  On the CUDA platform, this is further split into the creation of
+     * the FFT plans ("init:fft") and the computation of the dispersion correction ("init:dispersionCorrection"),
+     * which runs concurrently with the rest, and the compilation of the reciprocal space kernels, which happens
+     * in the first evaluation, is reported as "init:reciprocalKernels".  Otherwise, the returned dictionary is
+     * empty.
+     *
+     * Parameters
+     * ----------
+     *     context : Context
+     *         the Context in which the force is evaluated
+     *
+     * Returns
+     * -------
+     *     dict(str, float)
+     *         the accumulated time of each stage, in milliseconds
+     */
+    std::map<std::string, double> getStageTimesInContext(OpenMM::Context& context);
+    /**
+     * Reset the accumulated times returned by getStageTimesInContext() to zero.
+     *
+     * Parameters
+     * ----------
+     *     context : Context
+     *         the Context in which the force is evaluated
+     */
+    void resetStageTimesInContext(OpenMM::Context& context);
     /**
      * Get the name of the method used for handling long range nonbonded interactions.
      */
@@ -326,6 +758,300 @@ public:
      *         the subset to which this particle belongs
      */
     void setParticleSubset(int index, int subset);
+
+    /*
+     * Add methods that exchange the subsets, parameter offsets, and scaling parameters in
+     * bulk through the buffer protocol, so that no Python object is created per entry.
+    */
+
+    %extend {
+        void _setParticleSubsets(PyObject* subsets) {
+            Py_buffer view;
+            if (PyObject_GetBuffer(subsets, &view, PyBUF_C_CONTIGUOUS) != 0) {
+                PyErr_Clear();
+                throw OpenMM::OpenMMException("setParticleSubsets: the subsets must be a contiguous array");
+            }
+            const int* data = (const int*) view.buf;
+            std::vector<int> values(data, data + view.len/sizeof(int));
+            PyBuffer_Release(&view);
+            $self->setParticleSubsets(values);
+        }
+
+        void _getParticleSubsets(PyObject* subsets) const {
+            Py_buffer view;
+            if (PyObject_GetBuffer(subsets, &view, PyBUF_C_CONTIGUOUS | PyBUF_WRITABLE) != 0) {
+                PyErr_Clear();
+                throw OpenMM::OpenMMException("getParticleSubsets: the output must be a writable contiguous array");
+            }
+            std::vector<int> values = $self->getParticleSubsets();
+            bool valid = (view.len == values.size()*sizeof(int));
+            if (valid && values.size() > 0)
+                memcpy(view.buf, values.data(), view.len);
+            PyBuffer_Release(&view);
+            if (!valid)
+                throw OpenMM::OpenMMException("getParticleSubsets: wrong size of the output array");
+        }
+
+        int _addParticleParameterOffsets(const std::string& parameter, PyObject* particles, PyObject* scales, int numOffsets) {
+            Py_buffer particleView, scaleView;
+            if (PyObject_GetBuffer(particles, &particleView, PyBUF_C_CONTIGUOUS) != 0) {
+                PyErr_Clear();
+                throw OpenMM::OpenMMException("addParticleParameterOffsets: the particles must be a contiguous array");
+            }
+            if (PyObject_GetBuffer(scales, &scaleView, PyBUF_C_CONTIGUOUS) != 0) {
+                PyErr_Clear();
+                PyBuffer_Release(&particleView);
+                throw OpenMM::OpenMMException("addParticleParameterOffsets: the scales must be a contiguous array");
+            }
+            bool valid = (particleView.len == numOffsets*sizeof(int) && scaleView.len == 3*numOffsets*sizeof(double));
+            std::vector<int> indices;
+            std::vector<double> chargeScales, sigmaScales, epsilonScales;
+            if (valid) {
+                const int* p = (const int*) particleView.buf;
+                const double* s = (const double*) scaleView.buf;
+                indices.assign(p, p + numOffsets);
+                for (int i = 0; i < numOffsets; i++) {
+                    chargeScales.push_back(s[3*i]);
+                    sigmaScales.push_back(s[3*i+1]);
+                    epsilonScales.push_back(s[3*i+2]);
+                }
+            }
+            PyBuffer_Release(&particleView);
+            PyBuffer_Release(&scaleView);
+            if (!valid)
+                throw OpenMM::OpenMMException("addParticleParameterOffsets: wrong size of the arrays");
+            return $self->addParticleParameterOffsets(parameter, indices, chargeScales, sigmaScales, epsilonScales);
+        }
+
+        std::vector<std::string> _getParticleParameterOffsets(PyObject* particles, PyObject* scales) const {
+            Py_buffer particleView, scaleView;
+            if (PyObject_GetBuffer(particles, &particleView, PyBUF_C_CONTIGUOUS | PyBUF_WRITABLE) != 0) {
+                PyErr_Clear();
+                throw OpenMM::OpenMMException("getParticleParameterOffsets: the output must be a writable contiguous array");
+            }
+            if (PyObject_GetBuffer(scales, &scaleView, PyBUF_C_CONTIGUOUS | PyBUF_WRITABLE) != 0) {
+                PyErr_Clear();
+                PyBuffer_Release(&particleView);
+                throw OpenMM::OpenMMException("getParticleParameterOffsets: the output must be a writable contiguous array");
+            }
+            int numOffsets = $self->getNumParticleParameterOffsets();
+            bool valid = (particleView.len == numOffsets*sizeof(int) && scaleView.len == 3*numOffsets*sizeof(double));
+            std::vector<std::string> parameters(valid ? numOffsets : 0);
+            for (int i = 0; i < parameters.size(); i++) {
+                double* s = (double*) scaleView.buf + 3*i;
+                $self->getParticleParameterOffset(i, parameters[i], ((int*) particleView.buf)[i], s[0], s[1], s[2]);
+            }
+            PyBuffer_Release(&particleView);
+            PyBuffer_Release(&scaleView);
+            if (!valid)
+                throw OpenMM::OpenMMException("getParticleParameterOffsets: wrong size of the output arrays");
+            return parameters;
+        }
+
+        void _addScalingParameters(const std::vector<std::string>& parameters, PyObject* settings) {
+            Py_buffer view;
+            if (PyObject_GetBuffer(settings, &view, PyBUF_C_CONTIGUOUS) != 0) {
+                PyErr_Clear();
+                throw OpenMM::OpenMMException("addScalingParameters: the settings must be a contiguous array");
+            }
+            bool valid = (view.len == 4*parameters.size()*sizeof(int));
+            std::vector<int> values;
+            if (valid)
+                values.assign((const int*) view.buf, (const int*) view.buf + 4*parameters.size());
+            PyBuffer_Release(&view);
+            if (!valid)
+                throw OpenMM::OpenMMException("addScalingParameters: wrong size of the settings array");
+            for (int i = 0; i < parameters.size(); i++)
+                $self->addScalingParameter(parameters[i], values[4*i], values[4*i+1], values[4*i+2] != 0, values[4*i+3] != 0);
+        }
+
+        std::vector<std::string> _getScalingParameters(PyObject* settings) const {
+            Py_buffer view;
+            if (PyObject_GetBuffer(settings, &view, PyBUF_C_CONTIGUOUS | PyBUF_WRITABLE) != 0) {
+                PyErr_Clear();
+                throw OpenMM::OpenMMException("getScalingParameters: the output must be a writable contiguous array");
+            }
+            int numParameters = $self->getNumScalingParameters();
+            bool valid = (view.len == 4*numParameters*sizeof(int));
+            std::vector<std::string> parameters(valid ? numParameters : 0);
+            for (int i = 0; i < parameters.size(); i++) {
+                int* values = (int*) view.buf + 4*i;
+                bool includeCoulomb, includeLJ;
+                $self->getScalingParameter(i, parameters[i], values[0], values[1], includeCoulomb, includeLJ);
+                values[2] = includeCoulomb;
+                values[3] = includeLJ;
+            }
+            PyBuffer_Release(&view);
+            if (!valid)
+                throw OpenMM::OpenMMException("getScalingParameters: wrong size of the output array");
+            return parameters;
+        }
+
+        void _getDeviceArraysInContext(OpenMM::Context& context, OpenMMLab::DeviceArray& coulombEnergies,
+                                       OpenMMLab::DeviceArray& ljEnergies, std::vector<int>& slotSlices) {
+            $self->getDeviceArraysInContext(context, coulombEnergies, ljEnergies, slotSlices);
+        }
+
+        %pythoncode %{
+        def setParticleSubsets(self, subsets):
+            """
+            Set the subsets of all particles at once. This is much faster than calling
+            :func:`setParticleSubset` for each particle.
+
+            Parameters
+            ----------
+                subsets : numpy.ndarray
+                    a one-dimensional array with the subset of every particle
+
+            Raises
+            ------
+            ValueError
+                if the array does not have one entry per particle
+            """
+            subsets = np.ascontiguousarray(subsets, dtype=np.intc)
+            if subsets.ndim != 1 or subsets.size != self.getNumParticles():
+                raise ValueError("the subsets must be a one-dimensional array with one entry per particle")
+            self._setParticleSubsets(subsets)
+
+        def getParticleSubsets(self):
+            """
+            Get the subsets of all particles at once.
+
+            Returns
+            -------
+            numpy.ndarray
+                a one-dimensional array with the subset of every particle
+            """
+            subsets = np.empty(self.getNumParticles(), dtype=np.intc)
+            self._getParticleSubsets(subsets)
+            return subsets
+
+        def getDeviceArraysInContext(self, context):
+            """
+            Get the device arrays in which the reciprocal space energies of the slices are
+            accumulated in a Context, so that other libraries, such as PyTorch or JAX, can
+            read them in place.  This is only supported by the CUDA platform, and only with
+            the PME and LJPME methods.  Otherwise, or for a term that is not computed in
+            reciprocal space, the pointer of the array is 0.
+
+            Each array holds partial sums in a shape (number of partial sums,
+            len(slotSlices)).  Summing over the first dimension gives the energy of slice
+            slotSlices[k] in column k, not multiplied by its scaling parameters.  The self
+            energies are not included.  The arrays hold the energies of the latest
+            evaluation of reciprocal space in which energies were requested.
+
+            Parameters
+            ----------
+                context : Context
+                    the Context in which the force is evaluated
+
+            Returns
+            -------
+            Tuple[DeviceArray, DeviceArray, List[int]]
+                the arrays of Coulomb and Lennard-Jones energies, and the slice whose
+                energies each column holds
+            """
+            coulombEnergies, ljEnergies, slotSlices = DeviceArray(), DeviceArray(), vectori()
+            self._getDeviceArraysInContext(context, coulombEnergies, ljEnergies, slotSlices)
+            return coulombEnergies, ljEnergies, list(slotSlices)
+
+        def addParticleParameterOffsets(self, parameter, particles, scales):
+            """
+            Add offsets of the same global parameter to the parameters of many particles at
+            once. This is much faster than calling :func:`addParticleParameterOffset` for
+            each particle.
+
+            Parameters
+            ----------
+                parameter : str
+                    the name of the global parameter
+                particles : numpy.ndarray
+                    a one-dimensional array with the index of each affected particle
+                scales : numpy.ndarray
+                    a two-dimensional array whose rows contain the charge, sigma, and
+                    epsilon scales of the offset of each particle
+
+            Returns
+            -------
+            int
+                the index of the first offset that was added. The others follow it in order
+
+            Raises
+            ------
+            ValueError
+                if the arrays do not have matching shapes
+            """
+            particles = np.ascontiguousarray(particles, dtype=np.intc)
+            scales = np.ascontiguousarray(scales, dtype=np.float64)
+            if particles.ndim != 1 or scales.shape != (particles.size, 3):
+                raise ValueError("the scales must be an array of shape (len(particles), 3)")
+            return self._addParticleParameterOffsets(parameter, particles, scales, particles.size)
+
+        def getParticleParameterOffsets(self):
+            """
+            Get all particle parameter offsets at once.
+
+            Returns
+            -------
+            Tuple[List[str], numpy.ndarray, numpy.ndarray]
+                the name of the global parameter of each offset, the index of its particle,
+                and an array whose rows contain its charge, sigma, and epsilon scales
+            """
+            numOffsets = self.getNumParticleParameterOffsets()
+            particles = np.empty(numOffsets, dtype=np.intc)
+            scales = np.empty((numOffsets, 3))
+            parameters = list(self._getParticleParameterOffsets(particles, scales))
+            return parameters, particles, scales
+
+        def addScalingParameters(self, parameters, subsets, includeCoulomb, includeLJ):
+            """
+            Add many scaling parameters at once. This is equivalent to calling
+            :func:`addScalingParameter` for each of them, in order.
+
+            Parameters
+            ----------
+                parameters : List[str]
+                    the name of the global parameter of each scaling parameter
+                subsets : numpy.ndarray
+                    a two-dimensional array whose rows contain the two particle subsets of
+                    each scaling parameter
+                includeCoulomb : numpy.ndarray
+                    whether each scaling parameter applies to Coulomb interactions
+                includeLJ : numpy.ndarray
+                    whether each scaling parameter applies to Lennard-Jones interactions
+
+            Raises
+            ------
+            ValueError
+                if the arrays do not have one entry per scaling parameter
+            """
+            parameters = list(parameters)
+            subsets = np.asarray(subsets)
+            count = len(parameters)
+            if subsets.shape != (count, 2) or np.size(includeCoulomb) != count or np.size(includeLJ) != count:
+                raise ValueError("the arrays must have one entry per scaling parameter")
+            settings = np.empty((count, 4), dtype=np.intc)
+            settings[:, :2] = subsets
+            settings[:, 2] = np.ravel(includeCoulomb)
+            settings[:, 3] = np.ravel(includeLJ)
+            self._addScalingParameters(parameters, settings)
+
+        def getScalingParameters(self):
+            """
+            Get all scaling parameters at once.
+
+            Returns
+            -------
+            Tuple[List[str], numpy.ndarray, numpy.ndarray, numpy.ndarray]
+                the name of the global parameter of each scaling parameter, an array whose
+                rows contain its two particle subsets, and whether it applies to Coulomb
+                and to Lennard-Jones interactions
+            """
+            settings = np.empty((self.getNumScalingParameters(), 4), dtype=np.intc)
+            parameters = list(self._getScalingParameters(settings))
+            return parameters, settings[:, :2].copy(), settings[:, 2] != 0, settings[:, 3] != 0
+        %}
+    }
   	/**
      * Add a scaling parameter to multiply a particular Coulomb slice. Its value will scale the
      * Coulomb interactions between particles of a subset 1 with those of another (or the same)
@@ -447,6 +1173,65 @@ public:
      *         the name of the parameter
      */
     void setScalingParameterDerivative(int index, const std::string& parameter);
+    /**
+     * Set the soft-core parameters of the Lennard-Jones interactions of a slice.  In a soft-core
+     * slice, the Lennard-Jones energy of each pair becomes lambda*4*epsilon*(1/s^2 - 1/s), with
+     * s = alpha*(1-lambda)^power + (r/sigma)^6, where lambda is the Lennard-Jones scaling
+     * parameter of the slice.  Coulomb interactions, exceptions, and the dispersion correction
+     * are not affected.  A zero alpha, which is the default, disables the soft core.
+     *
+     * Parameters
+     * ----------
+     *     subset1 : int
+     *         the index of a particle subset
+     *     subset2 : int
+     *         the index of a particle subset, which may be equal to subset1
+     *     alpha : float
+     *         the soft-core strength, which cannot be negative
+     *     power : float
+     *         the exponent of (1-lambda), which must be at least 1
+     */
+    void setSliceSoftCoreParameters(int subset1, int subset2, double alpha, double power);
+    /**
+     * Get the soft-core parameters of the Lennard-Jones interactions of a slice.
+     *
+     * Parameters
+     * ----------
+     *     subset1 : int
+     *         the index of a particle subset
+     *     subset2 : int
+     *         the index of a particle subset, which may be equal to subset1
+     *
+     * Returns
+     * -------
+     *     alpha : float
+     *         the soft-core strength
+     *     power : float
+     *         the exponent of (1-lambda)
+     */
+    void getSliceSoftCoreParameters(int subset1, int subset2, double& alpha, double& power) const;
+    /**
+     * Get the order of the B-spline interpolation between the particles and the PME grids,
+     * which is used for both PME and LJPME.
+     */
+    int getPMEInterpolationOrder() const;
+    /**
+     * Set the order of the B-spline interpolation between the particles and the PME grids,
+     * which is used for both PME and LJPME.  The default order is 5.  A lower order with a finer
+     * grid, or a higher order with a coarser grid, can reach the same accuracy at a different
+     * cost.  The grid dimensions derived from the Ewald error tolerance assume order 5, so they
+     * should be set with `setPMEParameters` and `setLJPMEParameters` when the order is changed.
+     *
+     * Parameters
+     * ----------
+     *     order : int
+     *         the interpolation order, which must be 4, 5 or 6
+     */
+    void setPMEInterpolationOrder(int order);
+    /**
+     * Get whether any slice uses soft-core Lennard-Jones interactions.
+     */
+    bool getUseSoftCore() const;
 	/**
      * Get whether to use CUDA Toolkit's cuFFT library when executing in the CUDA platform.
      * The default value is `False`.
@@ -463,27 +1248,201 @@ public:
      *         whether to use the cuFFT library
      */
     void setUseCuFFT(bool use);
-
-    /*
-     * Add methods for casting a Force to a SlicedNonbondedForce.
-    */
-
-    %extend {
-        static OpenMMLab::SlicedNonbondedForce& cast(OpenMM::Force& force) {
-            return dynamic_cast<OpenMMLab::SlicedNonbondedForce&>(force);
-        }
-
-        static bool isinstance(OpenMM::Force& force) {
+    /**
+     * Get whether the FFT library is chosen automatically when executing in the CUDA platform.
+     * The default value is `False`.
+     */
+    bool getUseFFTAutotuning() const;
+    /**
+     * Set whether to choose the FFT library automatically when executing in the CUDA platform.
+     * If enabled, both cuFFT and VkFFT are timed on the actual PME grids when a Context is
+     * created, and the faster one is used, regardless of setUseCuFFT().  The choice is kept
+     * for each device and grid, so that later Contexts skip the timing.  It is only stored on
+     * disk, to be reused by other processes, if the environment variable
+     * `OPENMMLAB_FFT_TUNING_FILE` names a file.  This choice has no effect when using other
+     * platforms.
+     *
+     * Parameters
+     * ----------
+     *     use : bool
+     *         whether to choose the FFT library automatically
+     */
+    void setUseFFTAutotuning(bool use);
+    /**
+     * Get whether the PME grid sizes are chosen by timing the FFTs when executing in the CUDA
+     * platform. The default value is `False`.
+     */
+    bool getUseTunedPmeGridSizes() const;
+    /**
+     * Set whether to choose the PME grid sizes by timing the FFTs when executing in the CUDA
+     * platform.  If enabled, the sizes required by the Ewald error tolerance are only lower
+     * bounds: every combination of sizes up to 10% larger whose prime factors are at most 7
+     * is timed with the FFT library in use, and the fastest one is used.  Larger grids only
+     * make the reciprocal space more accurate.  The choice is kept in the same table as the
+     * one made by setUseFFTAutotuning(), so that later Contexts skip the timing, and is only
+     * stored on disk if the environment variable `OPENMMLAB_FFT_TUNING_FILE` names a file.
+     * This choice has no effect when using other platforms.
+     *
+     * Parameters
+     * ----------
+     *     use : bool
+     *         whether to choose the PME grid sizes by timing the FFTs
+     */
+    void setUseTunedPmeGridSizes(bool use);
+    /**
+     * Get whether the PME convolution is applied by the FFT library when executing in the CUDA
+     * platform. The default value is `False`.
+     */
+    bool getUseFFTConvolution() const;
+    /**
+     * Set whether to let the FFT library apply the PME convolution between the forward and
+     * inverse transforms when executing in the CUDA platform with VkFFT, which saves one pass
+     * over the grids of all subsets.  This is only done in evaluations that need forces but
+     * neither the energy nor parameter derivatives.  This choice has no effect when using
+     * cuFFT or other platforms.
+     *
+     * Parameters
+     * ----------
+     *     use : bool
+     *         whether to fuse the PME convolution into the FFTs
+     */
+    void setUseFFTConvolution(bool use);
+    /**
+     * Get whether the PME charge grids and their FFTs are kept in single precision when executing
+     * in the CUDA platform with double precision. The default value is `False`.
+     */
+    bool getUseSinglePrecisionPmeGrids() const;
+    /**
+     * Set whether to keep the PME charge grids and their FFTs in single precision when executing
+     * in the CUDA platform with double precision, while the direct space and the accumulation of
+     * forces and energies are still done in double precision. This speeds up the reciprocal
+     * space calculation at the cost of its accuracy. This choice has no effect when using other
+     * platforms or other precision modes.
+     *
+     * Parameters
+     * ----------
+     *     use : bool
+     *         whether to keep the PME grids in single precision
+     */
+    void setUseSinglePrecisionPmeGrids(bool use);
+    /**
+     * Get whether the reciprocal space kernels are replayed from CUDA graphs when executing in
+     * the CUDA platform. The default value is `False`.
+     */
+    bool getUseCudaGraphs() const;
+    /**
+     * Set whether to capture the sequence of reciprocal space kernels into CUDA graphs and replay
+     * them at every step when executing in the CUDA platform, which reduces the launch overhead
+     * of small systems.  The graphs are captured again when the periodic box vectors change.
+     * This choice has no effect when profiling is enabled, when the FFTs are computed with
+     * VkFFT, or when using other platforms.
+     *
+     * Parameters
+     * ----------
+     *     use : bool
+     *         whether to replay the reciprocal space kernels from CUDA graphs
+     */
+    void setUseCudaGraphs(bool use);
+    /**
+     * Get whether the atoms are spread onto the PME grids without being sorted first when
+     * executing in the CUDA platform. The default value is `False`.
+     */
+    bool getUseSortFreePme() const;
+    /**
+     * Set whether to skip sorting the atoms by grid point before spreading them onto the PME
+     * grids when executing in the CUDA platform.  The atoms are then processed in the order of
+     * the context, which is kept spatially coherent by periodic reordering, so the result is the
+     * same and only the memory access pattern changes.  This saves the sort at every step, which
+     * is often faster for large systems.  This choice has no effect when using other platforms.
+     *
+     * Parameters
+     * ----------
+     *     use : bool
+     *         whether to skip sorting the atoms before spreading them
+     */
+    void setUseSortFreePme(bool use);
+    /**
+     * Get whether the PME reciprocal space is computed on the CPU when executing in the CUDA
+     * platform. The default value is `False`.
+     */
+    bool getUseCpuPme() const;
+    /**
+     * Set whether to compute the PME reciprocal space on the CPU when executing in the CUDA
+     * platform, concurrently with the direct space on the GPU.  The positions are downloaded
+     * and the forces uploaded through pinned memory, and the CPU calculation uses as many
+     * threads as the CPU platform, which can be set with the OPENMM_CPU_THREADS environment
+     * variable.  This can be faster on nodes with a modest GPU and many CPU cores.  This choice
+     * has no effect when using other platforms or with multiple GPUs.
+     *
+     * Parameters
+     * ----------
+     *     use : bool
+     *         whether to compute the PME reciprocal space on the CPU
+     */
+    void setUseCpuPme(bool use);
+    /**
+     * Get whether the derivatives with respect to the scaling parameters are only computed
+     * on evaluations that also compute the energy when executing in the CUDA platform. The
+     * default value is `False`.
+     */
+    bool getUseDerivativesOnDemand() const;
+    /**
+     * Set whether the derivatives with respect to the scaling parameters are only computed
+     * on evaluations that also compute the energy, such as `getState(getEnergy=True)` or
+     * :func:`getScalingParameterDerivativesInContext`, when executing in the CUDA platform.
+     * By default, they are accumulated at every evaluation.  Enable this when the derivatives
+     * are only read occasionally, but not when an integrator uses them in steps that do not
+     * compute the energy.  This choice has no effect when using other platforms.
+     *
+     * Parameters
+     * ----------
+     *     use : bool
+     *         whether to compute the derivatives only along with the energy
+     */
+    void setUseDerivativesOnDemand(bool use);
+    /**
+     * Get whether the direct space kernel reads the particle parameters in a compact form when
+     * executing in the CUDA platform. The default value is `False`.
+     */
+    bool getUseCompactParameters() const;
+    /**
+     * Set whether the direct space kernel reads the particle parameters in a compact form when
+     * executing in the CUDA platform with single or mixed precision.  The values of sigma and
+     * epsilon derived for each particle are then stored as a pair of half precision numbers, and
+     * the subset of each particle in the lowest bits of its charge, so that every particle takes
+     * 8 bytes rather than 16.  This speeds up large systems, in which the kernel is limited by
+     * memory bandwidth, at the cost of a relative error of about 1e-3 in the Lennard-Jones
+     * interactions.  The exceptions and the reciprocal space are not affected.  This choice has
+     * no effect in double precision or when using other platforms.
+     *
+     * Parameters
+     * ----------
+     *     use : bool
+     *         whether to read the particle parameters in a compact form
+     */
+    void setUseCompactParameters(bool use);
+
+    /*
+     * Add methods for casting a Force to a SlicedNonbondedForce.
+    */
+
+    %extend {
+        static OpenMMLab::SlicedNonbondedForce& cast(OpenMM::Force& force) {
+            return dynamic_cast<OpenMMLab::SlicedNonbondedForce&>(force);
+        }
+
+        static bool isinstance(OpenMM::Force& force) {
             return (dynamic_cast<OpenMMLab::SlicedNonbondedForce*>(&force) != NULL);
         }
     }
 };
 
 %clear double& alpha;
+%clear double& power;
 %clear int& nx;
 %clear int& ny;
 %clear int& nz;
-%clear std::string& parameter;
+%clear const std::string& parameter;
 %clear int& subset1;
 %clear int& subset2;
 %clear bool& includeLJ;
@@ -518,9 +1477,51 @@ public:
  *
  * In addition, you can call addTabulatedFunction() to define a new function based on tabulated values.  You specify the function by
  * creating a TabulatedFunction object.  That function can then appear in the expression.
+ *
+ * Finally, you can call addRadialBasisFunction() to define a radial basis function expansion over a subset
+ * of the collective variables.  It is a sum of the form :math:`f({\bf v}) = \sum_k w_k \phi(\epsilon \|{\bf v}-{\bf c}_k\|)`,
+ * where :math:`{\bf c}_k` and :math:`w_k` are the center and weight of the k-th basis function, :math:`\epsilon` is a shape
+ * parameter, and :math:`\phi(s)` is a Gaussian (:math:`e^{-s^2}`), a multiquadric (:math:`\sqrt{1+s^2}`), or a thin-plate
+ * spline (:math:`s^2 \ln s`).  The expansion is referred to by name in the energy expression, just like a collective
+ * variable, and is evaluated on the device by platforms that support it.
+ *
+ * A :class:`CustomSummation` can be added with addCustomSummation() in the same way.  It is evaluated at the
+ * values of a list of collective variables, one for each of its arguments, and referred to by name in the
+ * energy expression.  Platforms that support it evaluate the terms on the device, in the Context of this
+ * force, so that the summation needs no Context of its own.
+ *
+ * Every collective variable added with addCollectiveVariable() takes a force group of the inner
+ * Context and one evaluation of its own, which limits their number to 32.  Many cheap variables
+ * of the same form, such as the entries of a contact map, can instead be added together with
+ * addCollectiveVariableBatch().  The bonds of a CustomBondForce or CustomCompoundBondForce then
+ * define one variable each, and the whole batch takes a single force group and is evaluated in
+ * at most two passes, however many variables it contains.
+ *
+ * Collective variables built from the same atoms, such as several distances from the center of
+ * a group, can share the intermediate positions they depend on.  A particle added with
+ * addSharedCentroid() or addSharedParticle() exists only in the inner Context, where it comes
+ * after the particles of the System.  Its position is computed once per evaluation, before any
+ * collective variable, and the forces on it are distributed to the particles it depends on.
+ *
+ * A collective variable may itself be an ExtendedCustomCVForce, which is how hierarchical bias
+ * potentials are built.  Unless it has radial basis functions, custom summations, or batches of
+ * collective variables, or the outer force uses it as an argument of one of these, its own
+ * collective variables are moved into the inner Context of the outer force, under the name of
+ * the nested variable followed by a dot and their own names, and its energy expression is
+ * substituted into that of the outer force.  A whole hierarchy is then evaluated with a single
+ * inner Context and a single copy of the positions, however deep it is, as long as it has no more
+ * than 32 collective variables in total.  A variable of a nested force is evaluated at the largest
+ * of its own interval and those of the variables that contain it.
  */
+class CustomSummation;
+
 class ExtendedCustomCVForce : public OpenMM::Force {
 public:
+    enum RadialBasisFunctionType {
+        Gaussian = 0,
+        Multiquadric = 1,
+        ThinPlateSpline = 2
+    };
     /**
      * Create a ExtendedCustomCVForce.
      *
@@ -535,6 +1536,14 @@ public:
      * Get the number of collective variables that the interaction depends on.
      */
     int getNumCollectiveVariables() const;
+    /**
+     * Get the number of batches of collective variables that the interaction depends on.
+     */
+    int getNumCollectiveVariableBatches() const;
+    /**
+     * Get the number of particles shared by the collective variables.
+     */
+    int getNumSharedParticles() const;
     /**
      * Get the number of global parameters that the interaction depends on.
      */
@@ -548,6 +1557,14 @@ public:
      * Get the number of tabulated functions that have been defined.
      */
     int getNumTabulatedFunctions() const;
+    /**
+     * Get the number of radial basis function expansions that have been defined.
+     */
+    int getNumRadialBasisFunctions() const;
+    /**
+     * Get the number of custom summations that have been defined.
+     */
+    int getNumCustomSummations() const;
     /**
      * Get the algebraic expression that gives the energy of the system
      */
@@ -618,6 +1635,247 @@ public:
      *     the Force object
      */
     const Force& getCollectiveVariable(int index) const;
+    /**
+     * Set the number of steps between successive evaluations of a collective variable.  This
+     * is useful for expensive variables that change slowly.  At steps at which a variable is
+     * not due for evaluation, the value and the forces computed at its latest evaluation are
+     * reused, which amounts to holding its contribution constant over the interval.
+     *
+     * Parameters
+     * ----------
+     * index : int
+     *     the index of the collective variable
+     * interval : int
+     *     the number of steps between evaluations (1 by default, meaning that the variable
+     *     is evaluated at every step)
+     */
+    void setCollectiveVariableInterval(int index, int interval);
+    /**
+     * Get the number of steps between successive evaluations of a collective variable.
+     *
+     * Parameters
+     * ----------
+     * index : int
+     *     the index of the collective variable
+     *
+     * Returns
+     * -------
+     * int
+     *     the number of steps between evaluations
+     */
+    int getCollectiveVariableInterval(int index) const;
+    /**
+     * Set the platform on which a collective variable is evaluated.  By default, every
+     * variable is evaluated in the inner Context, which uses the platform of the Context
+     * containing this force.  On a GPU, a cheap variable such as a distance or an angle
+     * then costs kernel launches and a synchronization that take longer than the arithmetic.
+     * A variable placed on another platform, typically "CPU", is instead evaluated in a
+     * Context of that platform, in a separate thread that runs while the inner Context
+     * evaluates the other variables.  The positions are downloaded once per evaluation for
+     * all such variables, and their forces are added to those of the Context.  Their energy
+     * parameter derivatives are not computed.
+     *
+     * Parameters
+     * ----------
+     * index : int
+     *     the index of the collective variable
+     * platform : str
+     *     the name of the platform, or an empty string (the default) to evaluate the
+     *     variable in the inner Context
+     */
+    void setCollectiveVariablePlatform(int index, const std::string& platform);
+    /**
+     * Get the name of the platform on which a collective variable is evaluated, or an empty
+     * string if it is evaluated in the inner Context.
+     *
+     * Parameters
+     * ----------
+     * index : int
+     *     the index of the collective variable
+     *
+     * Returns
+     * -------
+     * str
+     *     the name of the platform
+     */
+    const std::string& getCollectiveVariablePlatform(int index) const;
+    /**
+     * Set whether the forces of the collective variables are stored in compressed form.  On
+     * the CUDA and OpenCL platforms, the forces of every collective variable are kept on the
+     * device between its evaluations, as 64 bit fixed point values, and the forces of all
+     * variables are read at every step to apply the chain rule.  In compressed form, they
+     * are stored as 32 bit floating point values, which halves the memory and the bandwidth
+     * this takes.  The chain rule sums are still accumulated in fixed point, so the only loss
+     * is the rounding of every stored force to a relative precision of about 1e-7.  Other
+     * platforms ignore this setting.
+     *
+     * Parameters
+     * ----------
+     * compressed : bool
+     *     whether to store the forces in compressed form (False by default)
+     */
+    void setUseCompressedForces(bool compressed);
+    /**
+     * Get whether the forces of the collective variables are stored in compressed form.
+     *
+     * Returns
+     * -------
+     * bool
+     *     whether the forces are stored in compressed form
+     */
+    bool getUseCompressedForces() const;
+    /**
+     * Set whether the derivatives of the energy with respect to global parameters are only
+     * computed on evaluations that also compute the energy, such as getState() with
+     * `getEnergy=True` or `getParameterDerivatives=True`.  By default, they are computed at
+     * every evaluation, which on the CUDA and OpenCL platforms reads the derivatives of every
+     * collective variable from the inner Context at every step.  Enable this when the
+     * derivatives are only read occasionally, but not when an integrator uses them in steps
+     * that do not compute the energy.  Other platforms ignore this setting.
+     *
+     * Parameters
+     * ----------
+     * onDemand : bool
+     *     whether to compute the derivatives on demand (False by default)
+     */
+    void setUseDerivativesOnDemand(bool onDemand);
+    /**
+     * Get whether the derivatives of the energy with respect to global parameters are only
+     * computed on evaluations that also compute the energy.
+     *
+     * Returns
+     * -------
+     * bool
+     *     whether the derivatives are computed on demand
+     */
+    bool getUseDerivativesOnDemand() const;
+    /**
+     * Set the number of steps whose collective variables and energy every Context records,
+     * so that they can be read in bulk with getCollectiveVariableHistory().  The first
+     * evaluation of every step is recorded, with no extra work other than evaluating the
+     * energy expression if the energy was not requested.  Once the history is full, every
+     * new step overwrites the oldest one.  Changes take effect when a Context is created or
+     * reinitialized.
+     *
+     * Parameters
+     * ----------
+     * size : int
+     *     the number of steps to keep, or 0 to record none (the default)
+     */
+    void setCollectiveVariableHistorySize(int size);
+    /**
+     * Get the number of steps whose collective variables and energy every Context records.
+     *
+     * Returns
+     * -------
+     * int
+     *     the number of steps
+     */
+    int getCollectiveVariableHistorySize() const;
+    /**
+     * Add a batch of collective variables that the force may depend on.  Every bond of the
+     * Force defines one variable, whose value is the energy of that bond alone.
+     *
+     * All variables of a batch are evaluated together at every step, regardless of the
+     * number of variables, and the batch counts as a single collective variable toward the
+     * limit of 32.  Variables of batches come after those added with addCollectiveVariable()
+     * in the values returned by getCollectiveVariableValues(), in the order of their batches.
+     *
+     * Parameters
+     * ----------
+     * names : list(str)
+     *     the names of the variables, one for each bond of the Force, as they will appear in
+     *     the energy expression
+     * variables : Force
+     *     a CustomBondForce or a CustomCompoundBondForce whose bonds define the variables
+     *
+     * Returns
+     * -------
+     * int
+     *     the index of the batch that was added
+     */
+    int addCollectiveVariableBatch(const std::vector<std::string>& names, OpenMM::Force* variables);
+    /**
+     * Get the names of the collective variables of a batch.
+     *
+     * Parameters
+     * ----------
+     * index : int
+     *     the index of the batch
+     *
+     * Returns
+     * -------
+     * list(str)
+     *     the names of the variables, one for each bond
+     */
+    const std::vector<std::string>& getCollectiveVariableBatchNames(int index) const;
+    /**
+     * Get the Force object whose bonds define a batch of collective variables.
+     *
+     * Parameters
+     * ----------
+     * index : int
+     *     the index of the batch to get
+     *
+     * Returns
+     * -------
+     * Force
+     *     the Force object
+     */
+    Force& getCollectiveVariableBatch(int index);
+    /**
+     * Add a particle shared by the collective variables, whose position is defined by a
+     * VirtualSite in terms of the particles of the System.  The Forces of the collective
+     * variables refer to it by the index N+k, where N is the number of particles of the System
+     * and k is the index returned by this method.  A LocalCoordinatesSite, for example, can
+     * place particles along the axes of a local frame of a group of atoms.
+     *
+     * Parameters
+     * ----------
+     * site : VirtualSite
+     *     the VirtualSite that defines the position of the particle.  It may only depend on
+     *     particles of the System.
+     *
+     * Returns
+     * -------
+     * int
+     *     the index of the shared particle that was added
+     */
+    int addSharedParticle(OpenMM::VirtualSite* site);
+    /**
+     * Add a particle shared by the collective variables, at the weighted centroid of a group
+     * of particles of the System, as with addSharedParticle().  The weights are normalized to
+     * sum to 1.  A group of more than three particles is represented by a LocalCoordinatesSite,
+     * whose axes are defined by the first three particles, so these must not be collinear.
+     *
+     * Parameters
+     * ----------
+     * particles : list(int)
+     *     the indices of the particles of the group
+     * weights : list(float)
+     *     the weights of the particles, or an empty list to weight them all equally
+     *
+     * Returns
+     * -------
+     * int
+     *     the index of the shared particle that was added
+     */
+    int addSharedCentroid(const std::vector<int>& particles, const std::vector<double>& weights=std::vector<double>());
+    /**
+     * Get the VirtualSite that defines the position of a particle shared by the collective
+     * variables.
+     *
+     * Parameters
+     * ----------
+     * index : int
+     *     the index of the shared particle
+     *
+     * Returns
+     * -------
+     * VirtualSite
+     *     the VirtualSite object
+     */
+    const OpenMM::VirtualSite& getSharedParticle(int index) const;
     /**
      * Add a new global parameter that the interaction may depend on.  The default value provided to
      * this method is the initial value of the parameter in newly created Contexts.  You can change
@@ -662,7 +1920,7 @@ public:
      */
 %apply const std::string& OUTPUT {const std::string& name};
     void setGlobalParameterName(int index, const std::string& name);
-%clear std::string& name;
+%clear const std::string& name;
     /**
      * Get the default value of a global parameter.
      *
@@ -777,53 +2035,445 @@ public:
      */
     const std::string& getTabulatedFunctionName(int index) const;
     /**
-     * Get the current values of the collective variables in a Context.
+     * Add a radial basis function expansion that may appear in the energy expression.
      *
      * Parameters
      * ----------
-     * context : Context
-     *     the Context
+     * name : str
+     *     the name of the expansion as it appears in expressions
+     * type : int
+     *     the type of radial basis function (Gaussian, Multiquadric, or ThinPlateSpline)
+     * shapeParameter : float
+     *     the shape parameter, which multiplies the distance to each center
+     * variables : list(str)
+     *     the names of the collective variables that define the space of the expansion
+     * centers : list(float)
+     *     the coordinates of the centers, flattened into a list of length
+     *     len(weights)*len(variables)
+     * weights : list(float)
+     *     the weights of the basis functions
      *
      * Returns
      * -------
-     * std::vector<double>
-     *     the values of the collective variables
+     * int
+     *     the index of the expansion that was added
      */
-%apply std::vector<double>& OUTPUT {std::vector<double>& values};
-    void getCollectiveVariableValues(OpenMM::Context& context, std::vector<double>& values) const;
-%clear std::vector<double>& values;
+    int addRadialBasisFunction(const std::string& name, RadialBasisFunctionType type, double shapeParameter,
+                               const std::vector<std::string>& variables, const std::vector<double>& centers,
+                               const std::vector<double>& weights);
     /**
-     * Get the inner Context used for evaluating collective variables.
-     *
-     * When you create a Context for a System that contains a ExtendedCustomCVForce, internally
-     * it creates a new System, adds the Forces that define the CVs to it, creates a new
-     * Context for that System, and uses it to evaluate the variables.  In most cases you
-     * can ignore all of this.  It is just an implementation detail.  However, there are
-     * a few cases where you need to directly access that internal Context.  For example,
-     * if you want to modify one of the Forces that defines a collective variable and
-     * call updateParametersInContext() on it, you need to pass that inner Context to it.
-     * This method returns a reference to it.
+     * Get the parameters of a radial basis function expansion.
      *
      * Parameters
      * ----------
-     * context : Context
-     *     the Context
+     * index : int
+     *     the index of the expansion
      *
      * Returns
      * -------
-     * Context
-     *     the inner Context used to evaluate the collective variables
+     * name : str
+     *     the name of the expansion as it appears in expressions
+     * type : int
+     *     the type of radial basis function
+     * shapeParameter : float
+     *     the shape parameter
+     * variables : list(str)
+     *     the names of the collective variables the expansion depends on
+     * centers : list(float)
+     *     the flattened coordinates of the centers
+     * weights : list(float)
+     *     the weights of the basis functions
      */
-    OpenMM::Context& getInnerContext(OpenMM::Context& context);
+%apply std::string& OUTPUT {std::string& name};
+%apply OpenMMLab::ExtendedCustomCVForce::RadialBasisFunctionType& OUTPUT {RadialBasisFunctionType& type};
+%apply double& OUTPUT {double& shapeParameter};
+%apply std::vector<std::string>& OUTPUT {std::vector<std::string>& variables};
+%apply std::vector<double>& OUTPUT {std::vector<double>& centers};
+%apply std::vector<double>& OUTPUT {std::vector<double>& weights};
+    void getRadialBasisFunctionParameters(int index, std::string& name, RadialBasisFunctionType& type, double& shapeParameter,
+                                          std::vector<std::string>& variables, std::vector<double>& centers,
+                                          std::vector<double>& weights) const;
+%clear std::string& name;
+%clear RadialBasisFunctionType& type;
+%clear double& shapeParameter;
+%clear std::vector<std::string>& variables;
+%clear std::vector<double>& centers;
+%clear std::vector<double>& weights;
     /**
-     * Update the tabulated function parameters in a Context to match those stored in this Force object.  This method
-     * provides an efficient method to update certain parameters in an existing Context without needing to reinitialize it.
-     * Simply call getTabulatedFunction(index).setFunctionParameters() to modify this object's parameters, then call
-     * updateParametersInContext() to copy them over to the Context.
+     * Set the parameters of a radial basis function expansion.  The name and the variables
+     * are fixed when the expansion is added, so only the remaining parameters can be changed.
      *
-     * This method is very limited.  The only information it updates is the parameters of tabulated functions.
-     * All other aspects of the Force (the energy expression, the set of collective variables, etc.) are unaffected and can
-     * only be changed by reinitializing the Context.
+     * Parameters
+     * ----------
+     * index : int
+     *     the index of the expansion
+     * type : int
+     *     the type of radial basis function
+     * shapeParameter : float
+     *     the shape parameter
+     * centers : list(float)
+     *     the flattened coordinates of the centers
+     * weights : list(float)
+     *     the weights of the basis functions
+     */
+    void setRadialBasisFunctionParameters(int index, RadialBasisFunctionType type, double shapeParameter,
+                                          const std::vector<double>& centers, const std::vector<double>& weights);
+    /**
+     * Add a CustomSummation that may appear in the energy expression.  The terms and overall
+     * parameters it has when a Context is created are copied to that Context.  To change
+     * them later, modify the summation and then call updateParametersInContext().
+     *
+     * Parameters
+     * ----------
+     * name : str
+     *     the name of the summation as it appears in expressions
+     * summation : CustomSummation
+     *     the summation, whose ownership is transferred to the force
+     * variables : list(str)
+     *     the names of the collective variables passed to the summation as arguments
+     *
+     * Returns
+     * -------
+     * int
+     *     the index of the summation that was added
+     */
+    int addCustomSummation(const std::string& name, CustomSummation* summation, const std::vector<std::string>& variables);
+    /**
+     * Get a reference to a custom summation that may appear in the energy expression.
+     *
+     * Parameters
+     * ----------
+     * index : int
+     *     the index of the summation to get
+     *
+     * Returns
+     * -------
+     * CustomSummation
+     *     the summation
+     */
+    CustomSummation& getCustomSummation(int index);
+    /**
+     * Get the name of a custom summation that may appear in the energy expression.
+     *
+     * Parameters
+     * ----------
+     * index : int
+     *     the index of the summation
+     *
+     * Returns
+     * -------
+     * str
+     *     the name of the summation as it appears in expressions
+     */
+    const std::string& getCustomSummationName(int index) const;
+    /**
+     * Get the names of the collective variables passed to a custom summation as arguments.
+     *
+     * Parameters
+     * ----------
+     * index : int
+     *     the index of the summation
+     *
+     * Returns
+     * -------
+     * list(str)
+     *     the names of the collective variables
+     */
+    const std::vector<std::string>& getCustomSummationVariables(int index) const;
+    /**
+     * Make every Context deposit terms in a custom summation by itself, as metadynamics does
+     * with its hills.  At the first evaluation of a step that is a positive multiple of the
+     * interval, a term is appended to the summation, whose per-term parameters are the values
+     * of the given expressions.  These may involve the collective variables, the global
+     * parameters, the radial basis functions, and the custom summations, which take their
+     * values before the deposition.  The new term contributes from the next evaluation on.
+     *
+     * The deposited terms belong to the Context, not to the CustomSummation, and follow its
+     * own terms.  They are kept by updateParametersInContext(), and are discarded when the
+     * Context is reinitialized.  Use getCustomSummationDepositedTerms() to retrieve them.
+     * Changes to the deposition take effect when a Context is created or reinitialized.
+     *
+     * Parameters
+     * ----------
+     * index : int
+     *     the index of the summation
+     * interval : int
+     *     the number of steps between depositions, or 0 for none
+     * parameters : list(str)
+     *     the expressions for the per-term parameters of a deposited term, one for each of
+     *     them and in the same order
+     */
+    void setCustomSummationDeposition(int index, int interval, const std::vector<std::string>& parameters);
+    /**
+     * Get the number of steps between the depositions of terms in a custom summation, or 0
+     * if terms are not deposited.
+     *
+     * Parameters
+     * ----------
+     * index : int
+     *     the index of the summation
+     */
+    int getCustomSummationDepositionInterval(int index) const;
+    /**
+     * Get the expressions for the per-term parameters of the terms deposited in a custom summation.
+     *
+     * Parameters
+     * ----------
+     * index : int
+     *     the index of the summation
+     */
+    const std::vector<std::string>& getCustomSummationDepositionParameters(int index) const;
+    /**
+     * Get the terms that a Context has deposited in a custom summation so far.
+     *
+     * Parameters
+     * ----------
+     * context : Context
+     *     the Context
+     * index : int
+     *     the index of the summation
+     *
+     * Returns
+     * -------
+     * list(list(float))
+     *     the per-term parameters of each deposited term, in the order of deposition
+     */
+%apply std::vector<std::vector<double>>& OUTPUT {std::vector<std::vector<double> >& terms};
+    void getCustomSummationDepositedTerms(OpenMM::Context& context, int index, std::vector<std::vector<double> >& terms) const;
+%clear std::vector<std::vector<double> >& terms;
+    /**
+     * Get the current values of the collective variables in a Context.  A variable whose
+     * evaluation interval has not elapsed keeps the value of its latest evaluation, which
+     * is the one the force is using.  The others are evaluated again, all of them in a
+     * single energy-only pass over the inner Context.
+     *
+     * Parameters
+     * ----------
+     * context : Context
+     *     the Context
+     *
+     * Returns
+     * -------
+     * std::vector<double>
+     *     the values of the collective variables
+     */
+%apply std::vector<double>& OUTPUT {std::vector<double>& values};
+    void getCollectiveVariableValues(OpenMM::Context& context, std::vector<double>& values) const;
+%clear std::vector<double>& values;
+    /**
+     * Evaluate the collective variables at a series of frames, such as those of a saved
+     * trajectory, without changing the state of a Context.  The positions of every frame are
+     * set directly in the inner Context and in those of the variables placed on other
+     * platforms, and every variable is evaluated regardless of its evaluation interval.  This
+     * avoids setting the positions of the Context itself, and the evaluations that would
+     * follow.  The values and forces the Context keeps for its simulation are not affected.
+     * The global parameters are those of the Context.
+     *
+     * Parameters
+     * ----------
+     * context : Context
+     *     the Context whose force to evaluate
+     * frames : list(list(Vec3))
+     *     the positions of the particles of the System at each frame
+     * boxVectors : list(list(Vec3))
+     *     the three periodic box vectors at each frame, or an empty list to use those of the
+     *     Context at all frames
+     *
+     * Returns
+     * -------
+     * list(list(float))
+     *     the values of the collective variables at each frame
+     */
+%apply std::vector<std::vector<double>>& OUTPUT {std::vector<std::vector<double> >& values};
+    void getCollectiveVariableValuesForFrames(OpenMM::Context& context, const std::vector<std::vector<OpenMM::Vec3> >& frames,
+                                              const std::vector<std::vector<OpenMM::Vec3> >& boxVectors,
+                                              std::vector<std::vector<double> >& values) const;
+%clear std::vector<std::vector<double> >& values;
+    /**
+     * Get the values of the collective variables and the energy of the force at the steps
+     * a Context has recorded since the latest call, up to the size of the history (see
+     * setCollectiveVariableHistorySize()), and remove them from the history.  Unlike
+     * getCollectiveVariableValues(), this evaluates nothing.
+     *
+     * Parameters
+     * ----------
+     * context : Context
+     *     the Context
+     *
+     * Returns
+     * -------
+     * list(int)
+     *     the step of each record, from the oldest to the newest
+     * list(list(float))
+     *     the values of the collective variables at each step
+     * list(float)
+     *     the energy of the force at each step
+     */
+%apply std::vector<long long>& OUTPUT {std::vector<long long>& steps};
+%apply std::vector<std::vector<double>>& OUTPUT {std::vector<std::vector<double> >& values};
+%apply std::vector<double>& OUTPUT {std::vector<double>& energies};
+    void getCollectiveVariableHistory(OpenMM::Context& context, std::vector<long long>& steps, std::vector<std::vector<double> >& values,
+                                      std::vector<double>& energies) const;
+%clear std::vector<long long>& steps;
+%clear std::vector<std::vector<double> >& values;
+%clear std::vector<double>& energies;
+    /**
+     * Get the inner Context used for evaluating collective variables.
+     *
+     * When you create a Context for a System that contains a ExtendedCustomCVForce, internally
+     * it creates a new System, adds the Forces that define the CVs to it, creates a new
+     * Context for that System, and uses it to evaluate the variables.  In most cases you
+     * can ignore all of this.  It is just an implementation detail.  However, there are
+     * a few cases where you need to directly access that internal Context.  For example,
+     * if you want to modify one of the Forces that defines a collective variable and
+     * call updateParametersInContext() on it, you need to pass that inner Context to it.
+     * This method returns a reference to it.  The collective variables of nested
+     * ExtendedCustomCVForces that have been merged into that of this force have no inner
+     * Context of their own.
+     *
+     * Parameters
+     * ----------
+     * context : Context
+     *     the Context
+     *
+     * Returns
+     * -------
+     * Context
+     *     the inner Context used to evaluate the collective variables
+     */
+    OpenMM::Context& getInnerContext(OpenMM::Context& context);
+    /**
+     * Get the time spent in each stage of the computation of this force in a Context, in
+     * milliseconds, accumulated since the Context was created or the times were last reset.
+     * The stages are copying the state to the inner Context ("copyState"), evaluating each
+     * collective variable ("cv:" followed by its name), evaluating the batches of collective
+     * variables ("batches"), evaluating the energy expression and its derivatives
+     * ("expression"), and applying the chain rule forces ("addForces").
+     * Profiling must be enabled by setting the environment variable OPENMMLAB_PROFILING to 1
+     * before the Context is created, and is supported by the CUDA and OpenCL platforms.
+     * On every platform, profiling also reports the times taken to create the inner Context
+     * ("init:innerContext"), to initialize the kernel ("init:kernel"), and to create the
+     * Contexts of the variables placed on other platforms ("init:placedContexts"), which
+     * overlaps the other two.  Otherwise, the returned dictionary is empty.
+     *
+     * Parameters
+     * ----------
+     * context : Context
+     *     the Context containing the ExtendedCustomCVForce
+     *
+     * Returns
+     * -------
+     * dict(str, float)
+     *     the accumulated time of each stage, in milliseconds
+     */
+    std::map<std::string, double> getStageTimesInContext(OpenMM::Context& context);
+    /**
+     * Reset the accumulated times returned by getStageTimesInContext() to zero.
+     *
+     * Parameters
+     * ----------
+     * context : Context
+     *     the Context containing the ExtendedCustomCVForce
+     */
+    void resetStageTimesInContext(OpenMM::Context& context);
+    /**
+     * Get counters of the work done to evaluate this force in a Context, accumulated since
+     * the Context was created or the counters were last reset.  Dividing them by the number
+     * of evaluations gives the cost of each evaluation.  The counters are "evaluations" (the
+     * number of times the force was evaluated), "copyStates" (the number of times the state
+     * was copied to the inner Context), "bytesCopied" (the bytes moved between the Context
+     * and the inner Context, and between host and device), "innerEvaluations" (the number
+     * of evaluations of collective variables by the inner Context), "expressionEvaluations"
+     * (the number of evaluations of the energy expression and of its derivatives), and
+     * "synchronizations" (the number of times the host waited for the device).  On the CUDA
+     * and OpenCL platforms, "deviceBytes" (the device memory held by the force for its own
+     * use) and "scratchBytes" (the device memory in the scratch pool shared by all forces of
+     * this plugin in the Context) are also reported.  They are not reset.
+     *
+     * Parameters
+     * ----------
+     * context : Context
+     *     the Context containing the ExtendedCustomCVForce
+     *
+     * Returns
+     * -------
+     * dict(str, int)
+     *     the value of each counter
+     */
+    std::map<std::string, long long> getCountersInContext(OpenMM::Context& context);
+    /**
+     * Reset the counters returned by getCountersInContext() to zero.
+     *
+     * Parameters
+     * ----------
+     * context : Context
+     *     the Context containing the ExtendedCustomCVForce
+     */
+    void resetCountersInContext(OpenMM::Context& context);
+    /**
+     * Get the results that the collective variables keep in a Context between evaluations,
+     * while their evaluation intervals have not elapsed.  Together with the state of the
+     * Context, they let another Context of the same System continue from the same point
+     * without evaluating the variables again.  Platforms that keep no results apart from
+     * forces return empty lists.
+     *
+     * Parameters
+     * ----------
+     * context : Context
+     *     the Context containing the ExtendedCustomCVForce
+     *
+     * Returns
+     * -------
+     * list(int)
+     *     the step at which each variable was last evaluated, or -1 if it keeps no results
+     * list(float)
+     *     the value of each variable
+     * list(list(float))
+     *     the derivatives of each variable with respect to the global parameters of the
+     *     inner Context
+     */
+%apply std::vector<long long>& OUTPUT {std::vector<long long>& steps};
+%apply std::vector<double>& OUTPUT {std::vector<double>& values};
+%apply std::vector<std::vector<double>>& OUTPUT {std::vector<std::vector<double> >& derivatives};
+    void getCollectiveVariableCacheInContext(OpenMM::Context& context, std::vector<long long>& steps, std::vector<double>& values,
+                                             std::vector<std::vector<double> >& derivatives);
+%clear std::vector<long long>& steps;
+%clear std::vector<double>& values;
+%clear std::vector<std::vector<double> >& derivatives;
+    /**
+     * Replace the results that the collective variables keep in a Context between
+     * evaluations, such as those obtained with getCollectiveVariableCacheInContext() from
+     * another Context of the same System.  The forces of the variables are not transferred,
+     * so a variable is evaluated again the next time its forces are needed.  On platforms
+     * that return no results, the results are discarded instead.
+     *
+     * Parameters
+     * ----------
+     * context : Context
+     *     the Context containing the ExtendedCustomCVForce
+     * steps : list(int)
+     *     the step at which each variable was evaluated, or -1 for a variable with no
+     *     results.  If empty, all results are discarded.
+     * values : list(float)
+     *     the value of each variable
+     * derivatives : list(list(float))
+     *     the derivatives of each variable with respect to the global parameters of the
+     *     inner Context
+     */
+    void setCollectiveVariableCacheInContext(OpenMM::Context& context, const std::vector<long long>& steps,
+                                             const std::vector<double>& values,
+                                             const std::vector<std::vector<double> >& derivatives);
+    /**
+     * Update the tabulated function parameters in a Context to match those stored in this Force object.  This method
+     * provides an efficient method to update certain parameters in an existing Context without needing to reinitialize it.
+     * Simply call getTabulatedFunction(index).setFunctionParameters() to modify this object's parameters, then call
+     * updateParametersInContext() to copy them over to the Context.
+     *
+     * This method is very limited.  The only information it updates is the parameters of tabulated functions,
+     * the parameters of radial basis function expansions (type, shape parameter, centers, and weights; the number
+     * of centers may change), and the evaluation intervals of collective variables.
+     * All other aspects of the Force (the energy expression, the set of collective variables, etc.) are unaffected and can
+     * only be changed by reinitializing the Context.
      */
     void updateParametersInContext(OpenMM::Context& context);
     /**
@@ -849,6 +2499,46 @@ public:
         static bool isinstance(OpenMM::Force& force) {
             return (dynamic_cast<OpenMMLab::ExtendedCustomCVForce*>(&force) != NULL);
         }
+
+        void _getDeviceArraysInContext(OpenMM::Context& context, OpenMMLab::DeviceArray& forces,
+                                       OpenMMLab::DeviceArray& atomIndices, std::vector<int>& variables) {
+            $self->getDeviceArraysInContext(context, forces, atomIndices, variables);
+        }
+
+        %pythoncode %{
+        def getDeviceArraysInContext(self, context):
+            """
+            Get the device arrays that hold the forces of the collective variables in a
+            Context, so that other libraries, such as PyTorch or JAX, can read them in
+            place.  This is only supported by the CUDA platform.
+
+            The forces array only holds the collective variables whose forces are stored
+            for all atoms, which excludes those that only act on a few atoms and those
+            evaluated in placed contexts.  Its shape is (len(variables), 3, number of
+            padded atoms), and it holds the forces computed the last time each variable
+            was evaluated.  Multiplying them by its scale gives kJ/mol/nm.  The Context
+            keeps the atoms in an order of its own, which changes from time to time, so
+            position j of the last dimension holds the force on atom atomIndices[j].  The
+            positions beyond the number of atoms are padding.
+
+            The values of the collective variables only exist on the host.  Use
+            :func:`getCollectiveVariableValues` to get them.
+
+            Parameters
+            ----------
+                context : Context
+                    the Context containing the ExtendedCustomCVForce
+
+            Returns
+            -------
+            Tuple[DeviceArray, DeviceArray, List[int]]
+                the forces, the index of the atom at each position of the forces, and the
+                index of the collective variable of each row of forces
+            """
+            forces, atomIndices, variables = DeviceArray(), DeviceArray(), vectori()
+            self._getDeviceArraysInContext(context, forces, atomIndices, variables)
+            return forces, atomIndices, list(variables)
+        %}
     }
 };
 
@@ -932,7 +2622,14 @@ public:
  *     platform : OpenMM::`Platform`
  *         The platform that will be used to evaluate the summation
  *     properties : Dict[str, str]
- *         A dictionary defining a set of values for platform-specific properties
+ *         A dictionary defining a set of values for platform-specific properties.
+ *         The property "Backend" can be "Context" (the default), "Kernel",
+ *         "Native", or "Auto", which switches between the native backend and a
+ *         device backend of the platform, whichever is faster for the current
+ *         number of terms, and the property "Precision" can be "single", "mixed", or
+ *         "double" with every backend and platform. Platforms with a fixed precision
+ *         ignore it, and the native backend evaluates terms with SIMD instructions in
+ *         single and mixed precision
  *
  * Examples
  * --------
@@ -1024,6 +2721,43 @@ public:
      *     the value of the derivative
      */
     double evaluateDerivative(const std::vector<double> &arguments, int which) const;
+    /**
+     * Evaluate the product of the Hessian matrix of the function and a vector. With
+     * the native backend, the second derivatives of the terms are computed analytically.
+     * The other backends take central differences of two gradients along the vector.
+     *
+     * Parameters
+     * ----------
+     *     arguments : List[float]
+     *         a vector of argument values
+     *     direction : List[float]
+     *         the vector to be multiplied by the Hessian
+     *
+     * Returns
+     * -------
+     * List[float]
+     *     the product of the Hessian and the vector
+     */
+    %apply std::vector<double>& OUTPUT {std::vector<double>& product};
+    void evaluateHessianProduct(const std::vector<double> &arguments, const std::vector<double> &direction, std::vector<double> &product) const;
+    %clear std::vector<double>& product;
+    /**
+     * Evaluate the diagonal of the Hessian matrix of the function, that is, the
+     * second derivatives of the function with respect to each of its arguments.
+     *
+     * Parameters
+     * ----------
+     *     arguments : List[float]
+     *         a vector of argument values
+     *
+     * Returns
+     * -------
+     * List[float]
+     *     the diagonal of the Hessian
+     */
+    %apply std::vector<double>& OUTPUT {std::vector<double>& diagonal};
+    void evaluateHessianDiagonal(const std::vector<double> &arguments, std::vector<double> &diagonal) const;
+    %clear std::vector<double>& diagonal;
     /**
      * Add a new term to the summation.
      *
@@ -1048,6 +2782,42 @@ public:
      *     if the passed vector has the wrong number of parameters
      */
     int addTerm(const std::vector<double> &parameters);
+    /**
+     * Declare that every term depends on only some of the argument points. This
+     * must be done before any terms are added, and cannot be combined with
+     * compact support, Gaussian bounds, or a grid. The expression then refers to
+     * the points of a term as p1, p2, etc., up to the number of points per term.
+     *
+     * Parameters
+     * ----------
+     *     numPoints : int
+     *         the number of argument points of every term, or 0 for all of them,
+     *         which is the default
+     */
+    void setPointsPerTerm(int numPoints);
+    /**
+     * Get the number of argument points of every term, or 0 if every term
+     * depends on all arguments.
+     */
+    int getPointsPerTerm() const;
+    /**
+     * Add a new term that depends on some of the argument points, if the number
+     * of points per term has been set with :func:`~CustomSummation.setPointsPerTerm`.
+     *
+     * Parameters
+     * ----------
+     *     parameters : List[float]
+     *         the parameters of the new term
+     *     points : List[int]
+     *         the indices of the argument points of the term, starting from 0,
+     *         where point i is made of arguments 3*i, 3*i+1, and 3*i+2
+     *
+     * Returns
+     * -------
+     * int
+     *     the index of the new term
+     */
+    int addTerm(const std::vector<double> &parameters, const std::vector<int> &points);
     /**
      * Get the number of terms in the summation.
      */
@@ -1088,26 +2858,116 @@ public:
      */
     void setTerm(int index, const std::vector<double> &parameters);
     /**
-     * Get the value of an overall parameter.
+     * Set the parameters and the argument points of a term.
      *
      * Parameters
      * ----------
-     *     name : str
-     *         the name of the parameter
+     *     index : int
+     *         the index of the term
+     *     parameters : List[float]
+     *         the new parameters for the term
+     *     points : List[int]
+     *         the new indices of the argument points of the term
+     */
+    void setTerm(int index, const std::vector<double> &parameters, const std::vector<int> &points);
+    /**
+     * Get the indices of the argument points of a term, which is empty if every
+     * term depends on all arguments.
+     *
+     * Parameters
+     * ----------
+     *     index : int
+     *         the index of the term
+     */
+    const std::vector<int> &getTermPoints(int index) const;
+    /**
+     * Merge new terms into existing ones that only differ from them in a weight
+     * parameter, such as hills deposited repeatedly at the same point. The weight
+     * of a new term whose other parameters match those of an existing term is
+     * added to that of the existing one instead of appending a new term. Two
+     * parameters match when they round to the same multiple of the tolerance, or
+     * when they are equal if the tolerance is zero.
+     *
+     * Parameters
+     * ----------
+     *     weightParameter : str
+     *         the name of the per-term parameter that is summed when terms are
+     *         merged, or an empty string to stop merging
+     *     tolerance : float
+     *         the resolution at which the other parameters are compared
+     */
+    void setCoalescing(const std::string &weightParameter, double tolerance = 0.0);
+    /**
+     * Get whether terms are merged and, if so, the weight parameter and the
+     * tolerance passed to :func:`~CustomSummation.setCoalescing`.
      *
      * Returns
      * -------
+     * bool
+     *     whether terms are merged
+     * str
+     *     the name of the weight parameter
      * float
-     *     the value of the parameter
+     *     the tolerance
      */
-    double getParameter(const std::string &name) const;
+%apply std::string& OUTPUT {std::string& weightParameter};
+%apply double& OUTPUT {double& tolerance};
+    bool getCoalescing(std::string& weightParameter, double& tolerance) const;
+%clear std::string& weightParameter;
+%clear double& tolerance;
     /**
-     * Set the value of an overall parameter.
+     * Remove a term from the summation. The last term is moved into the place
+     * of the removed one, so its index changes, while those of all other terms
+     * are preserved.
      *
      * .. note::
      *
-     *     This method will take effect immediately, with no need to
-     *     call :func:`~CustomSummation.update`.
+     *     This method does not take effect immediately. You must call
+     *     :func:`~CustomSummation.update` to turn it effective.
+     *
+     * Parameters
+     * ----------
+     *     index : int
+     *         the index of the term to remove
+     */
+    void removeTerm(int index);
+    /**
+     * Remove several terms from the summation. The terms are removed in
+     * decreasing order of index, each one as in
+     * :func:`~CustomSummation.removeTerm`.
+     *
+     * .. note::
+     *
+     *     This method does not take effect immediately. You must call
+     *     :func:`~CustomSummation.update` to turn it effective.
+     *
+     * Parameters
+     * ----------
+     *     indices : List[int]
+     *         the indices of the terms to remove, which must be distinct
+     */
+    void removeTerms(const std::vector<int> &indices);
+    /**
+     * Get the value of an overall parameter.
+     *
+     * Parameters
+     * ----------
+     *     name : str
+     *         the name of the parameter
+     *
+     * Returns
+     * -------
+     * float
+     *     the value of the parameter
+     */
+    double getParameter(const std::string &name) const;
+    /**
+     * Set the value of an overall parameter.
+     *
+     * .. note::
+     *
+     *     This method will take effect immediately, with no need to
+     *     call :func:`~CustomSummation.update`.
      *
      * Parameters
      * ----------
@@ -1122,6 +2982,769 @@ public:
      * existing ones.
     */
     void update();
+    /**
+     * Declare that the terms of the summation have compact support, that is, each
+     * term and its derivatives are exactly zero whenever the Euclidean distance
+     * between the arguments and a per-term center exceeds a per-term radius.
+     *
+     * The native backend uses this information to evaluate only the terms near the
+     * arguments. Other backends evaluate all terms, which gives the same result.
+     *
+     * Parameters
+     * ----------
+     *     centerParameters : List[str]
+     *         the names of the per-term parameters that contain the center
+     *         coordinates, one for each argument
+     *     radiusParameter : str
+     *         the name of the per-term parameter that contains the support radius
+     */
+    void setCompactSupport(const std::vector<std::string> &centerParameters, const std::string &radiusParameter);
+    /**
+     * Get whether the terms have compact support and, if so, the parameters passed to
+     * :func:`~CustomSummation.setCompactSupport`.
+     *
+     * Returns
+     * -------
+     * bool
+     *     whether the terms have compact support
+     * List[str]
+     *     the names of the per-term parameters that contain the center coordinates
+     * str
+     *     the name of the per-term parameter that contains the support radius
+     */
+%apply std::vector<std::string>& OUTPUT {std::vector<std::string>& centerParameters};
+%apply std::string& OUTPUT {std::string& radiusParameter};
+    bool getCompactSupport(std::vector<std::string>& centerParameters, std::string& radiusParameter) const;
+%clear std::vector<std::string>& centerParameters;
+%clear std::string& radiusParameter;
+    /**
+     * Declare that the terms of the summation are bounded by Gaussians, that is, the
+     * magnitude of each term never exceeds |height|*exp(-d^2/(2*width^2)), where d is
+     * the Euclidean distance between the arguments and a per-term center. This is the
+     * case, for instance, of the hills deposited in metadynamics.
+     *
+     * The native backend uses this information to skip the terms whose bound falls
+     * below the tolerance divided by an upper bound on the number of terms, so that the error in the
+     * value of the summation never exceeds the tolerance. Other backends evaluate all
+     * terms exactly.
+     *
+     * Parameters
+     * ----------
+     *     centerParameters : List[str]
+     *         the names of the per-term parameters that contain the center
+     *         coordinates, one for each argument
+     *     widthParameter : str
+     *         the name of the per-term parameter that contains the width
+     *     heightParameter : str
+     *         the name of the per-term parameter that contains the height
+     *     tolerance : float
+     *         the largest error allowed in the value of the summation
+     */
+    void setGaussianSupport(const std::vector<std::string> &centerParameters, const std::string &widthParameter,
+                            const std::string &heightParameter, double tolerance);
+    /**
+     * Get whether the terms are bounded by Gaussians and, if so, the parameters passed to
+     * :func:`~CustomSummation.setGaussianSupport`.
+     *
+     * Returns
+     * -------
+     * bool
+     *     whether the terms are bounded by Gaussians
+     * List[str]
+     *     the names of the per-term parameters that contain the center coordinates
+     * str
+     *     the name of the per-term parameter that contains the width
+     * str
+     *     the name of the per-term parameter that contains the height
+     * float
+     *     the largest error allowed in the value of the summation
+     */
+%apply std::vector<std::string>& OUTPUT {std::vector<std::string>& centerParameters};
+%apply std::string& OUTPUT {std::string& widthParameter};
+%apply std::string& OUTPUT {std::string& heightParameter};
+%apply double& OUTPUT {double& tolerance};
+    bool getGaussianSupport(std::vector<std::string>& centerParameters, std::string& widthParameter,
+                            std::string& heightParameter, double& tolerance) const;
+%clear std::vector<std::string>& centerParameters;
+%clear std::string& widthParameter;
+%clear std::string& heightParameter;
+%clear double& tolerance;
+    /**
+     * Tabulate the summation on a regular grid, which is only allowed for summations
+     * of up to three arguments. The native backend evaluates arguments inside the grid
+     * by cubic Hermite interpolation, at a cost that does not depend on the number of
+     * terms, and updates the grid incrementally when terms change. Arguments outside
+     * the grid are evaluated exactly, as are all arguments with other backends.
+     *
+     * Parameters
+     * ----------
+     *     minValues : List[float]
+     *         the smallest value of each argument covered by the grid
+     *     maxValues : List[float]
+     *         the largest value of each argument covered by the grid
+     *     numPoints : List[int]
+     *         the number of grid points along each argument, at least 2
+     */
+    void setGrid(const std::vector<double> &minValues, const std::vector<double> &maxValues, const std::vector<int> &numPoints);
+    /**
+     * Get whether the summation is tabulated on a grid and, if so, the parameters passed to
+     * :func:`~CustomSummation.setGrid`.
+     *
+     * Returns
+     * -------
+     * bool
+     *     whether the summation is tabulated on a grid
+     * List[float]
+     *     the smallest value of each argument covered by the grid
+     * List[float]
+     *     the largest value of each argument covered by the grid
+     * List[int]
+     *     the number of grid points along each argument
+     */
+%apply std::vector<double>& OUTPUT {std::vector<double>& minValues};
+%apply std::vector<double>& OUTPUT {std::vector<double>& maxValues};
+%apply std::vector<int>& OUTPUT {std::vector<int>& numPoints};
+    bool getGrid(std::vector<double>& minValues, std::vector<double>& maxValues, std::vector<int>& numPoints) const;
+%clear std::vector<double>& minValues;
+%clear std::vector<double>& maxValues;
+%clear std::vector<int>& numPoints;
+    /**
+     * Set the maximum number of distinct argument vectors for which the value and
+     * derivatives of the summation are kept in cache. The least recently used entries
+     * are discarded first.
+     *
+     * Parameters
+     * ----------
+     *     size : int
+     *         the maximum number of cache entries
+     */
+    void setCacheSize(int size);
+    /**
+     * Get the maximum number of distinct argument vectors for which the value and
+     * derivatives of the summation are kept in cache.
+     */
+    int getCacheSize() const;
+    /**
+     * Get the number of evaluation requests that have been satisfied by the cache.
+     */
+    long long getNumCacheHits() const;
+    /**
+     * Get the number of evaluation requests that have required a computation.
+     */
+    long long getNumCacheMisses() const;
+    /**
+     * Get the number of batches submitted by this thread with
+     * :func:`~CustomSummation.submitBatch` that have not been collected yet.
+     */
+    int getNumPendingBatches() const;
+    /**
+     * Get the number of points in the batch that the next call to
+     * :func:`~CustomSummation.collectBatch` will retrieve.
+     */
+    int getPendingBatchSize() const;
+
+    /*
+     * Add methods that exchange whole arrays with the summation through the buffer
+     * protocol, so that no Python object is created per element.
+    */
+
+    %extend {
+        void _setTerms(PyObject* parameters, int numTerms) {
+            Py_buffer view;
+            if (PyObject_GetBuffer(parameters, &view, PyBUF_C_CONTIGUOUS) != 0) {
+                PyErr_Clear();
+                throw OpenMM::OpenMMException("CustomSummation: the parameters must be a contiguous array");
+            }
+            Py_ssize_t size = numTerms*$self->getPerTermParameters().size()*sizeof(double);
+            bool valid = (view.len == size);
+            if (valid)
+                $self->setTerms((const double*) view.buf, numTerms);
+            PyBuffer_Release(&view);
+            if (!valid)
+                throw OpenMM::OpenMMException("CustomSummation: wrong size of the parameter array");
+        }
+
+        void _evaluateBatch(PyObject* arguments, int numPoints, PyObject* values, PyObject* gradients) {
+            Py_buffer views[3];
+            PyObject* objects[3] = {arguments, values, gradients};
+            int flags[3] = {PyBUF_C_CONTIGUOUS, PyBUF_C_CONTIGUOUS | PyBUF_WRITABLE, PyBUF_C_CONTIGUOUS | PyBUF_WRITABLE};
+            Py_ssize_t sizes[3] = {numPoints*$self->getNumArguments()*sizeof(double), numPoints*sizeof(double), numPoints*$self->getNumArguments()*sizeof(double)};
+            int numViews = 0;
+            bool valid = true;
+            while (valid && numViews < 3) {
+                if (PyObject_GetBuffer(objects[numViews], &views[numViews], flags[numViews]) != 0)
+                    valid = false;
+                else {
+                    valid = (views[numViews].len == sizes[numViews]);
+                    numViews++;
+                }
+            }
+            try {
+                if (valid) {
+                    SWIG_PYTHON_THREAD_BEGIN_ALLOW;
+                    $self->evaluateBatch((const double*) views[0].buf, numPoints, (double*) views[1].buf, (double*) views[2].buf);
+                }
+            }
+            catch (...) {
+                for (int i = 0; i < numViews; i++)
+                    PyBuffer_Release(&views[i]);
+                throw;
+            }
+            for (int i = 0; i < numViews; i++)
+                PyBuffer_Release(&views[i]);
+            if (!valid) {
+                PyErr_Clear();
+                throw OpenMM::OpenMMException("CustomSummation: invalid arrays passed to evaluateBatch");
+            }
+        }
+
+        void _submitBatch(PyObject* arguments, int numPoints) {
+            Py_buffer view;
+            if (PyObject_GetBuffer(arguments, &view, PyBUF_C_CONTIGUOUS) != 0) {
+                PyErr_Clear();
+                throw OpenMM::OpenMMException("CustomSummation: the arguments must be a contiguous array");
+            }
+            bool valid = (view.len == numPoints*$self->getNumArguments()*sizeof(double));
+            try {
+                if (valid)
+                    $self->submitBatch((const double*) view.buf, numPoints, true);
+            }
+            catch (...) {
+                PyBuffer_Release(&view);
+                throw;
+            }
+            PyBuffer_Release(&view);
+            if (!valid)
+                throw OpenMM::OpenMMException("CustomSummation: invalid array passed to submitBatch");
+        }
+
+        void _collectBatch(PyObject* values, PyObject* gradients) {
+            Py_buffer views[2];
+            PyObject* objects[2] = {values, gradients};
+            int numPoints = $self->getPendingBatchSize();
+            Py_ssize_t sizes[2] = {numPoints*sizeof(double), numPoints*$self->getNumArguments()*sizeof(double)};
+            int numViews = 0;
+            bool valid = true;
+            while (valid && numViews < 2) {
+                if (PyObject_GetBuffer(objects[numViews], &views[numViews], PyBUF_C_CONTIGUOUS | PyBUF_WRITABLE) != 0)
+                    valid = false;
+                else {
+                    valid = (views[numViews].len == sizes[numViews]);
+                    numViews++;
+                }
+            }
+            try {
+                if (valid) {
+                    SWIG_PYTHON_THREAD_BEGIN_ALLOW;
+                    $self->collectBatch((double*) views[0].buf, (double*) views[1].buf);
+                }
+            }
+            catch (...) {
+                for (int i = 0; i < numViews; i++)
+                    PyBuffer_Release(&views[i]);
+                throw;
+            }
+            for (int i = 0; i < numViews; i++)
+                PyBuffer_Release(&views[i]);
+            if (!valid) {
+                PyErr_Clear();
+                throw OpenMM::OpenMMException("CustomSummation: invalid arrays passed to collectBatch");
+            }
+        }
+
+        %pythoncode %{
+        def setTerms(self, parameters):
+            """
+            Replace all terms of the summation at once. This is much faster than calling
+            :func:`~CustomSummation.addTerm` for each term.
+
+            .. note::
+
+                This method does not take effect immediately. You must call
+                :func:`~CustomSummation.update` to turn it effective.
+
+            Parameters
+            ----------
+                parameters : numpy.ndarray
+                    a two-dimensional array whose rows contain the parameters of the
+                    terms, in the order given by
+                    :func:`~CustomSummation.getPerTermParameters`
+
+            Raises
+            ------
+            ValueError
+                if the array does not have one column per per-term parameter
+            """
+            parameters = np.ascontiguousarray(parameters, dtype=np.float64)
+            numParams = len(self.getPerTermParameters())
+            if parameters.ndim != 2 or parameters.shape[1] != numParams:
+                raise ValueError(f"the parameters must be an array of shape (numTerms, {numParams})")
+            self._setTerms(parameters, parameters.shape[0])
+
+        def evaluateBatch(self, arguments):
+            """
+            Evaluate the function and its derivatives at many points at once. All points
+            are evaluated in a single computation on the platform.
+
+            Parameters
+            ----------
+                arguments : numpy.ndarray
+                    a two-dimensional array whose rows contain the arguments of the
+                    points
+
+            Returns
+            -------
+            Tuple[numpy.ndarray, numpy.ndarray]
+                the values of the function at the points and an array with the same
+                shape as `arguments` which contains the derivatives of the function with
+                respect to the arguments at every point
+
+            Raises
+            ------
+            ValueError
+                if the array does not have one column per argument
+            """
+            arguments = np.ascontiguousarray(arguments, dtype=np.float64)
+            numArgs = self.getNumArguments()
+            if arguments.ndim != 2 or arguments.shape[1] != numArgs:
+                raise ValueError(f"the arguments must be an array of shape (numPoints, {numArgs})")
+            values = np.empty(arguments.shape[0])
+            gradients = np.empty(arguments.shape)
+            self._evaluateBatch(arguments, arguments.shape[0], values, gradients)
+            return values, gradients
+
+        def submitBatch(self, arguments):
+            """
+            Start evaluating the function and its derivatives at many points in the
+            background, and return immediately. This lets the caller prepare the next
+            batch while the platform is still computing the current one. The results
+            must be retrieved with :func:`~CustomSummation.collectBatch`, in the order
+            the batches were submitted, by the thread that submitted them. All batches
+            must be collected before the summation is modified.
+
+            Parameters
+            ----------
+                arguments : numpy.ndarray
+                    a two-dimensional array whose rows contain the arguments of the
+                    points. It is copied, so it can be reused right away.
+
+            Raises
+            ------
+            ValueError
+                if the array does not have one column per argument
+            """
+            arguments = np.ascontiguousarray(arguments, dtype=np.float64)
+            numArgs = self.getNumArguments()
+            if arguments.ndim != 2 or arguments.shape[1] != numArgs:
+                raise ValueError(f"the arguments must be an array of shape (numPoints, {numArgs})")
+            self._submitBatch(arguments, arguments.shape[0])
+
+        def collectBatch(self):
+            """
+            Wait for the oldest batch submitted with :func:`~CustomSummation.submitBatch`
+            to finish, and retrieve its results.
+
+            Returns
+            -------
+            Tuple[numpy.ndarray, numpy.ndarray]
+                the values of the function at the points of the batch and their
+                derivatives with respect to the arguments, as in
+                :func:`~CustomSummation.evaluateBatch`
+            """
+            numPoints = self.getPendingBatchSize()
+            values = np.empty(numPoints)
+            gradients = np.empty((numPoints, self.getNumArguments()))
+            self._collectBatch(values, gradients)
+            return values, gradients
+        %}
+    }
+};
+
+/**
+ * A group of independent summations that have the same expression and the same
+ * parameters, but different sets of terms, such as the bias potentials of several
+ * collective variables or walkers. Each summation is equivalent to a
+ * :class:`CustomSummation` and is evaluated at its own arguments, but the whole group
+ * shares a single inner context, so all summations are evaluated in a single
+ * computation.
+ *
+ * The terms are added with :func:`~CustomSummationGroup.addTerm` and modified with
+ * :func:`~CustomSummationGroup.setTerm`, and neither change takes effect until
+ * :func:`~CustomSummationGroup.update` is called. Changes to the overall parameters
+ * take effect immediately.
+ *
+ * Parameters
+ * ----------
+ *     numSummations : int
+ *         The number of summations in the group.
+ *     numArgs : int
+ *         The number of arguments of each summation.
+ *     expression : str
+ *         The algebraic expression that defines each term.
+ *     overallParameters : Dict[str, float]
+ *         A dictionary containing the names and default values of the parameters that
+ *         are shared by all terms of all summations
+ *     perTermParameters : List[str]
+ *         A list containing the names of the parameters that are unique to each term
+ *     platform : OpenMM::`Platform`
+ *         The platform that will be used to evaluate the summations
+ *     properties : Dict[str, str]
+ *         A dictionary defining a set of values for platform-specific properties
+ */
+class CustomSummationGroup {
+public:
+    CustomSummationGroup(
+        int numSummations,
+        int numArgs,
+        std::string expression,
+        std::map<std::string, double> overallParameters,
+        std::vector<std::string> perTermParameters,
+        OpenMM::Platform &platform,
+        std::map<std::string, std::string> properties = std::map<std::string, std::string>()
+    );
+    /**
+     * Get the number of summations in the group.
+     */
+    int getNumSummations() const;
+    /**
+     * Get the number of arguments of each summation.
+     */
+    int getNumArguments() const;
+    /**
+     * Get the expression for each term.
+     */
+    const std::string &getExpression() const;
+    /**
+     * Get a dictionary of the names and default values of the overall parameters.
+     */
+    const std::map<std::string, double> &getOverallParameters() const;
+    /**
+     * Get a list of the names of the per-term parameters.
+     */
+    const std::vector<std::string> &getPerTermParameters() const;
+    /**
+     * Add a new term to one of the summations.
+     *
+     * Parameters
+     * ----------
+     *     summation : int
+     *         the index of the summation
+     *     parameters : List[float]
+     *         the parameters of the new term
+     *
+     * Returns
+     * -------
+     * int
+     *     the index of the new term within its summation
+     */
+    int addTerm(int summation, const std::vector<double> &parameters);
+    /**
+     * Get the number of terms in one of the summations.
+     *
+     * Parameters
+     * ----------
+     *     summation : int
+     *         the index of the summation
+     */
+    int getNumTerms(int summation) const;
+    /**
+     * Get the parameters of a term.
+     *
+     * Parameters
+     * ----------
+     *     summation : int
+     *         the index of the summation
+     *     index : int
+     *         the index of the term within its summation
+     */
+    const std::vector<double> &getTerm(int summation, int index) const;
+    /**
+     * Set the parameters of a term.
+     *
+     * Parameters
+     * ----------
+     *     summation : int
+     *         the index of the summation
+     *     index : int
+     *         the index of the term within its summation
+     *     parameters : List[float]
+     *         the new parameters of the term
+     */
+    void setTerm(int summation, int index, const std::vector<double> &parameters);
+    /**
+     * Get the value of an overall parameter.
+     */
+    double getParameter(const std::string &name) const;
+    /**
+     * Set the value of an overall parameter, which is shared by all summations.
+     */
+    void setParameter(const std::string &name, double value);
+    /**
+     * Update the group after adding new terms or changing parameters of existing ones.
+     */
+    void update();
+    /**
+     * Evaluate all summations and their derivatives in a single computation.
+     *
+     * Parameters
+     * ----------
+     *     arguments : List[float]
+     *         the arguments of all summations, with those of summation k starting at
+     *         index k*getNumArguments()
+     *
+     * Returns
+     * -------
+     * Tuple[List[float], List[float]]
+     *     the value of each summation and its derivatives with respect to its arguments,
+     *     in the same layout as `arguments`
+     */
+    %apply std::vector<double>& OUTPUT {std::vector<double>& values};
+    %apply std::vector<double>& OUTPUT {std::vector<double>& gradients};
+    void evaluate(const std::vector<double> &arguments, std::vector<double> &values, std::vector<double> &gradients);
+    %clear std::vector<double>& values;
+    %clear std::vector<double>& gradients;
+};
+
+/**
+ * A store of the terms of a :class:`CustomSummation` in a file that several processes
+ * can share, such as the walkers of a multiple-walker metadynamics simulation running on
+ * the same node. Every walker appends the terms it deposits with
+ * :func:`~SharedTermStore.append` and periodically calls
+ * :func:`~SharedTermStore.synchronize` to add to its own summation the terms appended
+ * by all walkers since the previous synchronization.
+ *
+ * Parameters
+ * ----------
+ *     path : str
+ *         The path of the file, which is created if it does not exist yet.
+ *     numParameters : int
+ *         The number of per-term parameters, which must agree with that of an
+ *         existing file.
+ */
+class SharedTermStore {
+public:
+    SharedTermStore(const std::string &path, int numParameters);
+    /**
+     * Get the path of the file.
+     */
+    const std::string &getPath() const;
+    /**
+     * Get the number of per-term parameters.
+     */
+    int getNumParameters() const;
+    /**
+     * Append a term to the store.
+     *
+     * Parameters
+     * ----------
+     *     parameters : List[float]
+     *         the parameters of the term
+     */
+    void append(const std::vector<double> &parameters);
+    /**
+     * Get the current version of the store, which is the number of complete terms it
+     * contains.
+     */
+    int getVersion();
+    /**
+     * Get the version up to which the summation has been synchronized.
+     */
+    int getSynchronizedVersion() const;
+    /**
+     * Add to a summation the terms that have been appended to the store since the
+     * previous synchronization, and update the summation. The same summation must be
+     * passed to every call.
+     *
+     * Parameters
+     * ----------
+     *     summation : CustomSummation
+     *         the summation to which the terms are added
+     *
+     * Returns
+     * -------
+     * int
+     *     the number of terms that have been added
+     */
+    int synchronize(CustomSummation &summation);
+};
+
+
+/**
+ * Saves the state of a Context in a compact binary snapshot, and loads it into a Context of
+ * the same System without reinitializing it, such as when the replicas of a replica exchange
+ * simulation running on different nodes exchange their configurations.
+ *
+ * A snapshot holds the step count, the time, the periodic box vectors, the positions and
+ * velocities, and the global parameters of the Context, along with the lambda state selected
+ * in each :class:`SlicedNonbondedForce` and the values that the collective variables of each
+ * :class:`ExtendedCustomCVForce` keep while their evaluation intervals have not elapsed.
+ * The forces of the collective variables are not saved, so a variable whose cached value is
+ * loaded is evaluated again the next time its forces are needed.  Snapshots can only be
+ * loaded on machines with the same byte order as the one that saved them.
+ */
+class ContextSnapshot {
+public:
+    %extend {
+        /**
+         * Save a snapshot of a Context.
+         *
+         * Parameters
+         * ----------
+         *     context : Context
+         *         the Context to save
+         *
+         * Returns
+         * -------
+         * bytes
+         *     the snapshot
+         */
+        static PyObject* save(OpenMM::Context& context) {
+            std::string snapshot = OpenMMLab::ContextSnapshot::saveToString(context);
+            return PyBytes_FromStringAndSize(snapshot.data(), snapshot.size());
+        }
+
+        /**
+         * Load a snapshot into a Context, which must have been created for the same System
+         * as the one whose snapshot was saved.
+         *
+         * Parameters
+         * ----------
+         *     context : Context
+         *         the Context into which the snapshot is loaded
+         *     snapshot : bytes
+         *         the snapshot, or any other object that supports the buffer protocol
+         */
+        static void load(OpenMM::Context& context, PyObject* snapshot) {
+            Py_buffer view;
+            if (PyObject_GetBuffer(snapshot, &view, PyBUF_C_CONTIGUOUS) != 0) {
+                PyErr_Clear();
+                throw OpenMM::OpenMMException("ContextSnapshot: the snapshot must be a contiguous buffer");
+            }
+            std::string data((const char*) view.buf, view.len);
+            PyBuffer_Release(&view);
+            OpenMMLab::ContextSnapshot::loadFromString(context, data);
+        }
+    }
+};
+
+
+/**
+ * Fits the weights of a Gaussian radial basis function expansion of an
+ * :class:`ExtendedCustomCVForce` so that it interpolates the values given at its centers.
+ * The weights solve (K + lambda*I)*w = y, where K is the kernel matrix of the centers and
+ * lambda is an optional regularization. The Cholesky factor of the matrix is extended by
+ * one row whenever a center is added, so that refining a surrogate with n centers costs
+ * O(n^2) per center instead of O(n^3).
+ *
+ * Parameters
+ * ----------
+ *     numVariables : int
+ *         The number of variables the expansion depends on.
+ *     shapeParameter : float
+ *         The shape parameter e of the Gaussians exp(-e^2*|v-c_k|^2).
+ *     regularization : float
+ *         The value lambda added to the diagonal of the kernel matrix.
+ */
+class RadialBasisFunctionFitter {
+public:
+    RadialBasisFunctionFitter(int numVariables, double shapeParameter, double regularization = 0.0);
+    /**
+     * Get the number of variables the expansion depends on.
+     */
+    int getNumVariables() const;
+    /**
+     * Get the shape parameter of the Gaussians.
+     */
+    double getShapeParameter() const;
+    /**
+     * Get the value added to the diagonal of the kernel matrix.
+     */
+    double getRegularization() const;
+    /**
+     * Get the number of centers that have been added.
+     */
+    int getNumCenters() const;
+    /**
+     * Add a center and the value the expansion must take at it, and update the weights.
+     * An exception is raised if the new center nearly coincides with an existing one and
+     * there is no regularization.
+     *
+     * Parameters
+     * ----------
+     *     center : List[float]
+     *         the coordinates of the center
+     *     value : float
+     *         the value at the center
+     *
+     * Returns
+     * -------
+     * int
+     *     the index of the center that was added
+     */
+    int addCenter(const std::vector<double> &center, double value);
+    /**
+     * Change the value at a center, and update the weights.
+     *
+     * Parameters
+     * ----------
+     *     index : int
+     *         the index of the center
+     *     value : float
+     *         the new value at the center
+     */
+    void setValue(int index, double value);
+    /**
+     * Get the flattened coordinates of the centers.
+     */
+    const std::vector<double> &getCenters() const;
+    /**
+     * Get the values at the centers.
+     */
+    const std::vector<double> &getValues() const;
+    /**
+     * Get the fitted weights of the basis functions.
+     */
+    const std::vector<double> &getWeights() const;
+    /**
+     * Evaluate the fitted expansion at a point.
+     *
+     * Parameters
+     * ----------
+     *     point : List[float]
+     *         the coordinates of the point
+     */
+    double evaluate(const std::vector<double> &point) const;
+    /**
+     * Add the fitted expansion to an :class:`ExtendedCustomCVForce`.
+     *
+     * Parameters
+     * ----------
+     *     force : ExtendedCustomCVForce
+     *         the force to which the expansion is added
+     *     name : str
+     *         the name of the expansion as it appears in expressions
+     *     variables : List[str]
+     *         the names of the collective variables of the expansion
+     *
+     * Returns
+     * -------
+     * int
+     *     the index of the expansion in the force
+     */
+    int addRadialBasisFunction(ExtendedCustomCVForce &force, const std::string &name, const std::vector<std::string> &variables) const;
+    /**
+     * Replace the centers and weights of an expansion of an :class:`ExtendedCustomCVForce`
+     * with the fitted ones. Call :func:`~ExtendedCustomCVForce.updateParametersInContext`
+     * afterward to copy them to a Context.
+     *
+     * Parameters
+     * ----------
+     *     force : ExtendedCustomCVForce
+     *         the force that contains the expansion
+     *     index : int
+     *         the index of the expansion in the force
+     */
+    void updateRadialBasisFunction(ExtendedCustomCVForce &force, int index) const;
 };
 
 }
@@ -1,3 +1,4 @@
+import numpy as np
 import openmmlab as plugin
 import openmm as mm
 import pytest
@@ -93,3 +94,73 @@ def testSimpleSummation(platformName, precision):
     summation.setParameter("a", anew)
     ASSERT_EQUAL(summation.evaluate(newArgs), (2*(anew+b)+2*c+f+2*d+g)*x1+2*e+h)
     ASSERT_EQUAL(summation.evaluateDerivative(args, 0), 2*anew)
+
+
+@pytest.mark.parametrize('platformName, precision', CASES, ids=IDS)
+def testArrayInterface(platformName, precision):
+    platform = mm.Platform.getPlatformByName(platformName)
+    properties = {} if platformName == 'Reference' else {'Precision': precision}
+    summation = plugin.CustomSummation(
+        2, "a*(x1-cx)^2+(y1-cy)^2", {"a": 2.0}, ("cx", "cy"), platform, properties
+    )
+
+    # Set all terms at once and evaluate many points at once.
+    centers = np.random.rand(100, 2)
+    summation.setTerms(centers)
+    summation.update()
+    assert summation.getNumTerms() == 100
+    points = np.random.rand(20, 2)
+    values, gradients = summation.evaluateBatch(points)
+    assert values.shape == (20,)
+    assert gradients.shape == (20, 2)
+    for point, value, gradient in zip(points, values, gradients):
+        delta = point - centers
+        ASSERT_EQUAL(np.sum(2*delta[:, 0]**2 + delta[:, 1]**2), value, 1e-4)
+        ASSERT_EQUAL(np.sum(4*delta[:, 0]), gradient[0], 1e-4)
+        ASSERT_EQUAL(np.sum(2*delta[:, 1]), gradient[1], 1e-4)
+
+    # Pipeline the same points in two batches.
+    summation.submitBatch(points[:12])
+    summation.submitBatch(points[12:])
+    assert summation.getNumPendingBatches() == 2
+    for batch in (slice(0, 12), slice(12, 20)):
+        batchValues, batchGradients = summation.collectBatch()
+        assert np.allclose(values[batch], batchValues)
+        assert np.allclose(gradients[batch], batchGradients)
+    assert summation.getNumPendingBatches() == 0
+
+    # Replace the terms with fewer ones.
+    summation.setTerms(centers[:10])
+    summation.update()
+    assert summation.getNumTerms() == 10
+    delta = points[0] - centers[:10]
+    ASSERT_EQUAL(np.sum(2*delta[:, 0]**2 + delta[:, 1]**2), summation.evaluate(list(points[0])))
+
+    with pytest.raises(ValueError):
+        summation.setTerms(np.zeros((5, 3)))
+    with pytest.raises(ValueError):
+        summation.evaluateBatch(np.zeros(2))
+
+
+@pytest.mark.parametrize('platformName, precision', CASES, ids=IDS)
+def testSupportAndGrid(platformName, precision):
+    platform = mm.Platform.getPlatformByName(platformName)
+    properties = {} if platformName == 'Reference' else {'Precision': precision}
+    summation = plugin.CustomSummation(
+        2, "h*exp(-((x1-cx)^2+(y1-cy)^2)/(2*w^2))", {}, ("h", "cx", "cy", "w"), platform, properties
+    )
+
+    # The getters return whether the feature is enabled, followed by its settings.
+    assert not summation.getCompactSupport()[0]
+    assert not summation.getGaussianSupport()[0]
+    assert not summation.getGrid()[0]
+    summation.setCompactSupport(("cx", "cy"), "w")
+    enabled, centers, radius = summation.getCompactSupport()
+    assert enabled and tuple(centers) == ("cx", "cy") and radius == "w"
+    summation.setGaussianSupport(("cx", "cy"), "w", "h", 1e-6)
+    enabled, centers, width, height, tolerance = summation.getGaussianSupport()
+    assert enabled and tuple(centers) == ("cx", "cy") and (width, height) == ("w", "h")
+    ASSERT_EQUAL(1e-6, tolerance)
+    summation.setGrid((0.0, 0.0), (4.0, 2.0), (41, 21))
+    enabled, minValues, maxValues, numPoints = summation.getGrid()
+    assert enabled and tuple(maxValues) == (4.0, 2.0) and tuple(numPoints) == (41, 21)
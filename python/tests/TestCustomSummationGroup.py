@@ -0,0 +1,61 @@
+import openmmlab as plugin
+import openmm as mm
+import pytest
+from openmm import unit
+
+TOL = 1e-5
+
+CASES = [
+    ('Reference', ''),
+    ('CUDA', 'single'),
+    ('CUDA', 'mixed'),
+    ('CUDA', 'double'),
+    ('OpenCL', 'single'),
+    ('OpenCL', 'mixed'),
+    ('OpenCL', 'double'),
+]
+
+IDS = [''.join(case) for case in CASES]
+
+
+def value(x):
+    return x/x.unit if unit.is_quantity(x) else x
+
+
+def ASSERT_EQUAL(expected, found, tol=TOL):
+    exp = value(expected)
+    assert abs(exp - value(found))/max(abs(exp), 1.0) <= tol
+
+
+@pytest.mark.parametrize('platformName, precision', CASES, ids=IDS)
+def testGroupEvaluation(platformName, precision):
+    platform = mm.Platform.getPlatformByName(platformName)
+    properties = {} if platformName == 'Reference' else {'Precision': precision}
+    group = plugin.CustomSummationGroup(3, 2, "a*(x1-cx)^2+(y1-cy)^2", {"a": 2.0}, ("cx", "cy"), platform, properties)
+    assert group.getNumSummations() == 3
+    assert group.getNumArguments() == 2
+
+    # Summation k has k+1 terms centered at (k, i).
+    for k in range(3):
+        for i in range(k+1):
+            assert group.addTerm(k, [k, i]) == i
+    group.update()
+    arguments = [0.5, 0.2, 1.5, -0.3, 2.5, 0.7]
+    values, gradients = group.evaluate(arguments)
+    for k in range(3):
+        x, y = arguments[2*k:2*k+2]
+        assert group.getNumTerms(k) == k+1
+        ASSERT_EQUAL(sum(2*(x-k)**2 + (y-i)**2 for i in range(k+1)), values[k])
+        ASSERT_EQUAL(sum(4*(x-k) for i in range(k+1)), gradients[2*k])
+        ASSERT_EQUAL(sum(2*(y-i) for i in range(k+1)), gradients[2*k+1])
+
+    # Overall parameters take effect immediately, and terms only after updating.
+    group.setParameter("a", 1.0)
+    group.setTerm(0, 0, [1.0, 0.0])
+    values, gradients = group.evaluate(arguments)
+    ASSERT_EQUAL(0.5**2 + 0.2**2, values[0])
+    ASSERT_EQUAL(1.0, gradients[0])
+    group.update()
+    values, gradients = group.evaluate(arguments)
+    ASSERT_EQUAL(0.5**2 + 0.2**2, values[0])
+    ASSERT_EQUAL(-1.0, gradients[0])
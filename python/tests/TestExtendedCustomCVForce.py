@@ -234,3 +234,122 @@ def testReordering(platformName, precision):
     ASSERT_EQUAL_TOL(2*(r+1), state.getPotentialEnergy(), 1e-5)
     ASSERT_EQUAL_VEC(-delta*2/r, state.getForces()[5], 1e-5)
     ASSERT_EQUAL_VEC(delta*2/r, state.getForces()[10], 1e-5)
+
+
+@pytest.mark.parametrize('platformName, precision', cases, ids=ids)
+def testStageProfiling(platformName, precision, monkeypatch):
+    platform = mm.Platform.getPlatformByName(platformName)
+    properties = {} if platformName == 'Reference' else {'Precision': precision}
+    system = mm.System()
+    system.addParticle(1.0)
+    system.addParticle(1.0)
+    cv = plugin.ExtendedCustomCVForce("v1^2")
+    v1 = mm.CustomBondForce("r")
+    v1.addBond(0, 1)
+    cv.addCollectiveVariable("v1", v1)
+    system.addForce(cv)
+
+    # Profiling is requested when the Context is created.
+
+    monkeypatch.setenv('OPENMMLAB_PROFILING', '1')
+    integrator = mm.VerletIntegrator(1.0)
+    context = mm.Context(system, integrator, platform, properties)
+    monkeypatch.delenv('OPENMMLAB_PROFILING')
+    context.setPositions([mm.Vec3(0, 0, 0), mm.Vec3(1, 0, 0)])
+    context.getState(getForces=True)
+    times = cv.getStageTimesInContext(context)
+    ASSERT(isinstance(times, dict))
+    for stage in ['init:innerContext', 'init:kernel']:
+        ASSERT(times[stage] >= 0.0)
+    if platformName == 'Reference':
+        ASSERT(all(stage.startswith('init:') for stage in times))
+    else:
+        for stage in ['copyState', 'cv:v1', 'expression', 'addForces']:
+            ASSERT(times[stage] >= 0.0)
+    cv.resetStageTimesInContext(context)
+    ASSERT(cv.getStageTimesInContext(context) == {})
+
+
+@pytest.mark.parametrize('platformName, precision', cases, ids=ids)
+def testCounters(platformName, precision):
+    platform = mm.Platform.getPlatformByName(platformName)
+    properties = {} if platformName == 'Reference' else {'Precision': precision}
+    system = mm.System()
+    system.addParticle(1.0)
+    system.addParticle(1.0)
+    cv = plugin.ExtendedCustomCVForce("v1^2")
+    v1 = mm.CustomBondForce("r")
+    v1.addBond(0, 1)
+    cv.addCollectiveVariable("v1", v1)
+    system.addForce(cv)
+    integrator = mm.VerletIntegrator(1.0)
+    context = mm.Context(system, integrator, platform, properties)
+    context.setPositions([mm.Vec3(0, 0, 0), mm.Vec3(1, 0, 0)])
+    context.getState(getEnergy=True, getForces=True)
+    counters = cv.getCountersInContext(context)
+    ASSERT(isinstance(counters, dict))
+    ASSERT(counters['evaluations'] >= 1)
+    ASSERT(counters['innerEvaluations'] == counters['evaluations'])
+    cv.resetCountersInContext(context)
+    ASSERT(all(value == 0 for value in cv.getCountersInContext(context).values()))
+
+
+@pytest.mark.parametrize('platformName, precision', cases, ids=ids)
+def testCollectiveVariableCache(platformName, precision):
+    platform = mm.Platform.getPlatformByName(platformName)
+    properties = {} if platformName == 'Reference' else {'Precision': precision}
+    system = mm.System()
+    system.addParticle(1.0)
+    system.addParticle(1.0)
+    cv = plugin.ExtendedCustomCVForce("v1^2")
+    v1 = mm.CustomBondForce("r")
+    v1.addBond(0, 1)
+    cv.addCollectiveVariable("v1", v1)
+    cv.setCollectiveVariableInterval(0, 3)
+    system.addForce(cv)
+    contexts = [mm.Context(system, mm.VerletIntegrator(1.0), platform, properties) for _ in range(2)]
+    for context in contexts:
+        context.setPositions([mm.Vec3(0, 0, 0), mm.Vec3(1, 0, 0)])
+    energy = contexts[0].getState(getEnergy=True).getPotentialEnergy()
+
+    # The results of one Context can be loaded into another one of the same System.
+    steps, values, derivatives = cv.getCollectiveVariableCacheInContext(contexts[0])
+    ASSERT(len(steps) in (0, 1))
+    ASSERT(len(values) == len(steps) and len(derivatives) == len(steps))
+    cv.setCollectiveVariableCacheInContext(contexts[1], steps, values, derivatives)
+    ASSERT_EQUAL_TOL(energy, contexts[1].getState(getEnergy=True).getPotentialEnergy(), 1e-5)
+    if steps:
+        ASSERT_EQUAL_TOL(1.0, values[0], 1e-5)
+
+
+@pytest.mark.parametrize('platformName, precision', cases, ids=ids)
+def testCollectiveVariableBatch(platformName, precision):
+    platform = mm.Platform.getPlatformByName(platformName)
+    properties = {} if platformName == 'Reference' else {'Precision': precision}
+    system = mm.System()
+    system.addParticle(1.0)
+    system.addParticle(1.0)
+    system.addParticle(1.0)
+
+    # The variables of testCVs, defined by the bonds of a single force.
+
+    cv = plugin.ExtendedCustomCVForce("v1+3*v2")
+    system.addForce(cv)
+    bonds = mm.CustomBondForce("k*r")
+    bonds.addPerBondParameter("k")
+    bonds.addBond(0, 1, [2.0])
+    bonds.addBond(0, 2, [1.0])
+    ASSERT(cv.addCollectiveVariableBatch(["v1", "v2"], bonds) == 0)
+    ASSERT(cv.getNumCollectiveVariableBatches() == 1)
+    ASSERT(list(cv.getCollectiveVariableBatchNames(0)) == ["v1", "v2"])
+    integrator = mm.VerletIntegrator(1.0)
+    context = mm.Context(system, integrator, platform, properties)
+    context.setPositions([mm.Vec3(0, 0, 0), mm.Vec3(1.5, 0, 0), mm.Vec3(0, 0, 2.5)])
+    values = cv.getCollectiveVariableValues(context)
+    ASSERT_EQUAL_TOL(2*1.5, values[0], 1e-6)
+    ASSERT_EQUAL_TOL(2.5, values[1], 1e-6)
+    state = context.getState(getEnergy=True, getForces=True)
+    ASSERT_EQUAL_TOL(2*1.5+3*2.5, state.getPotentialEnergy(), 1e-6)
+    ASSERT_EQUAL_VEC(mm.Vec3(2.0, 0.0, 3.0), state.getForces()[0], 1e-6)
+    ASSERT_EQUAL_VEC(mm.Vec3(-2.0, 0.0, 0.0), state.getForces()[1], 1e-6)
+    ASSERT_EQUAL_VEC(mm.Vec3(0.0, 0.0, -3.0), state.getForces()[2], 1e-6)
@@ -156,6 +156,14 @@ def testLargeSystem(platformName, precision):
     assert nonbonded.getParticleSubset(0) == 0
     assert nonbonded.getParticleSubset(1) == 1
 
+    subsets = nonbonded.getParticleSubsets()
+    assert subsets.shape == (numParticles,)
+    assert subsets[1] == 1 and np.count_nonzero(subsets) == 1
+    nonbonded.setParticleSubsets(subsets)
+    assert np.array_equal(nonbonded.getParticleSubsets(), subsets)
+    with pytest.raises(ValueError):
+        nonbonded.setParticleSubsets(subsets[1:])
+
     system.addForce(nonbonded)
     integrator1 = mm.VerletIntegrator(0.01)
     integrator2 = mm.VerletIntegrator(0.01)
@@ -177,3 +185,38 @@ def testLargeSystem(platformName, precision):
         ASSERT_EQUAL_VEC(state.getVelocities()[i], referenceState.getVelocities()[i], tol)
         ASSERT_EQUAL_VEC(state.getForces()[i], referenceState.getForces()[i], tol)
     ASSERT_EQUAL_TOL(state.getPotentialEnergy(), referenceState.getPotentialEnergy(), tol)
+
+
+def testBulkAccessors():
+    numParticles = 10
+    force = plugin.SlicedNonbondedForce(3)
+    for i in range(numParticles):
+        force.addParticle(0.1*i, 0.3, 0.5)
+    force.setParticleSubsets(np.arange(numParticles) % 3)
+    force.addGlobalParameter("lambda", 1.0)
+    force.addGlobalParameter("mu", 1.0)
+
+    particles = np.array([1, 4, 7])
+    scales = np.array([[0.1, 0.2, 0.3], [0.4, 0.5, 0.6], [0.7, 0.8, 0.9]])
+    assert force.addParticleParameterOffsets("lambda", particles, scales) == 0
+    force.addParticleParameterOffset("mu", 2, 1.0, 0.0, 0.0)
+    assert force.addParticleParameterOffsets("mu", particles[:1], scales[:1]) == 4
+    parameters, offsetParticles, offsetScales = force.getParticleParameterOffsets()
+    assert parameters == ["lambda"]*3 + ["mu"]*2
+    assert np.array_equal(offsetParticles, [1, 4, 7, 2, 1])
+    assert np.allclose(offsetScales[:3], scales)
+    assert np.allclose(offsetScales[3], [1.0, 0.0, 0.0])
+    for i in range(3):
+        assert list(force.getParticleParameterOffset(i)[2:]) == pytest.approx(list(scales[i]))
+    with pytest.raises(ValueError):
+        force.addParticleParameterOffsets("lambda", particles, scales[:2])
+
+    force.addScalingParameters(["lambda", "mu"], [[0, 1], [2, 2]], [True, False], [True, True])
+    parameters, subsets, includeCoulomb, includeLJ = force.getScalingParameters()
+    assert parameters == ["lambda", "mu"]
+    assert np.array_equal(subsets, [[0, 1], [2, 2]])
+    assert list(includeCoulomb) == [True, False]
+    assert list(includeLJ) == [True, True]
+    assert list(force.getScalingParameter(1)) == ["mu", 2, 2, False, True]
+    with pytest.raises(ValueError):
+        force.addScalingParameters(["lambda"], [[0, 0], [1, 1]], [True], [True])
@@ -0,0 +1,169 @@
+/* -------------------------------------------------------------------------- *
+ *                             OpenMM Laboratory                              *
+ *                             =================                              *
+ *                                                                            *
+ * A plugin for testing low-level code implementation for OpenMM.             *
+ *                                                                            *
+ * Copyright (c) 2023 Charlles Abreu                                          *
+ * https://github.com/craabreu/openmm-lab                                     *
+ * -------------------------------------------------------------------------- */
+
+#include "CustomSummationProxy.h"
+#include "SerializationColumns.h"
+#include "CustomSummation.h"
+#include "openmm/serialization/SerializationNode.h"
+#include "openmm/OpenMMException.h"
+#include "openmm/Platform.h"
+#include <map>
+#include <string>
+#include <vector>
+
+using namespace OpenMMLab;
+using namespace OpenMM;
+using namespace std;
+
+CustomSummationProxy::CustomSummationProxy() : SerializationProxy("CustomSummation") {
+}
+
+/*
+ * Version 2 adds the argument points of the terms.
+ * Version 3 adds the merging of terms.
+ * Version 4 adds the Gaussian support.
+ * Version 5 adds the interpolation grid.
+ */
+void CustomSummationProxy::serialize(const void* object, SerializationNode& node) const {
+    node.setIntProperty("version", 5);
+    const CustomSummation& summation = *reinterpret_cast<const CustomSummation*>(object);
+    node.setIntProperty("numArgs", summation.getNumArguments());
+    node.setStringProperty("expression", summation.getExpression());
+    node.setStringProperty("platform", summation.getPlatform().getName());
+    node.setIntProperty("cacheSize", summation.getCacheSize());
+    SerializationNode& overallParams = node.createChildNode("OverallParameters");
+    for (auto& parameter : summation.getOverallParameters())
+        overallParams.createChildNode("Parameter").setStringProperty("name", parameter.first).setDoubleProperty("value", parameter.second);
+    SerializationNode& perTermParams = node.createChildNode("PerTermParameters");
+    for (const string& name : summation.getPerTermParameters())
+        perTermParams.createChildNode("Parameter").setStringProperty("name", name);
+    SerializationNode& properties = node.createChildNode("PlatformProperties");
+    for (auto& property : summation.getPlatformProperties())
+        properties.createChildNode("Property").setStringProperty("name", property.first).setStringProperty("value", property.second);
+
+    // The parameters of all terms are stored as a single column, term by term.
+
+    vector<double> values;
+    values.reserve(summation.getNumTerms()*summation.getPerTermParameters().size());
+    for (int i = 0; i < summation.getNumTerms(); i++) {
+        const vector<double>& term = summation.getTerm(i);
+        values.insert(values.end(), term.begin(), term.end());
+    }
+    SerializationNode& terms = node.createChildNode("Terms");
+    terms.setIntProperty("count", summation.getNumTerms()).setStringProperty("parameters", encodeColumn(values));
+    if (summation.getPointsPerTerm() > 0) {
+        vector<int> points;
+        points.reserve(summation.getNumTerms()*summation.getPointsPerTerm());
+        for (int i = 0; i < summation.getNumTerms(); i++) {
+            const vector<int>& termPoints = summation.getTermPoints(i);
+            points.insert(points.end(), termPoints.begin(), termPoints.end());
+        }
+        terms.setIntProperty("pointsPerTerm", summation.getPointsPerTerm()).setStringProperty("points", encodeColumn(points));
+    }
+    vector<string> centers;
+    string radius;
+    if (summation.getCompactSupport(centers, radius)) {
+        SerializationNode& support = node.createChildNode("CompactSupport");
+        support.setStringProperty("radius", radius);
+        for (const string& center : centers)
+            support.createChildNode("Center").setStringProperty("name", center);
+    }
+    string width, height;
+    double tolerance;
+    if (summation.getGaussianSupport(centers, width, height, tolerance)) {
+        SerializationNode& support = node.createChildNode("GaussianSupport");
+        support.setStringProperty("width", width);
+        support.setStringProperty("height", height);
+        support.setDoubleProperty("tolerance", tolerance);
+        for (const string& center : centers)
+            support.createChildNode("Center").setStringProperty("name", center);
+    }
+    string weight;
+    if (summation.getCoalescing(weight, tolerance))
+        node.createChildNode("Coalescing").setStringProperty("weight", weight).setDoubleProperty("tolerance", tolerance);
+    vector<double> minValues, maxValues;
+    vector<int> numPoints;
+    if (summation.getGrid(minValues, maxValues, numPoints)) {
+        SerializationNode& grid = node.createChildNode("Grid");
+        for (int i = 0; i < numPoints.size(); i++)
+            grid.createChildNode("Axis").setDoubleProperty("min", minValues[i]).setDoubleProperty("max", maxValues[i]).setIntProperty("points", numPoints[i]);
+    }
+}
+
+void* CustomSummationProxy::deserialize(const SerializationNode& node) const {
+    int version = node.getIntProperty("version");
+    if (version < 1 || version > 5)
+        throw OpenMMException("Unsupported version number");
+    map<string, double> overallParameters;
+    for (auto& parameter : node.getChildNode("OverallParameters").getChildren())
+        overallParameters[parameter.getStringProperty("name")] = parameter.getDoubleProperty("value");
+    vector<string> perTermParameters;
+    for (auto& parameter : node.getChildNode("PerTermParameters").getChildren())
+        perTermParameters.push_back(parameter.getStringProperty("name"));
+    map<string, string> properties;
+    for (auto& property : node.getChildNode("PlatformProperties").getChildren())
+        properties[property.getStringProperty("name")] = property.getStringProperty("value");
+    CustomSummation* summation = new CustomSummation(
+        node.getIntProperty("numArgs"),
+        node.getStringProperty("expression"),
+        overallParameters,
+        perTermParameters,
+        Platform::getPlatformByName(node.getStringProperty("platform")),
+        properties
+    );
+    try {
+        const SerializationNode& terms = node.getChildNode("Terms");
+        int numTerms = terms.getIntProperty("count");
+        int numParams = perTermParameters.size();
+        vector<double> values = decodeColumn<double>(terms, "parameters", numTerms*numParams);
+        int pointsPerTerm = (version >= 2 ? terms.getIntProperty("pointsPerTerm", 0) : 0);
+        if (pointsPerTerm > 0) {
+            summation->setPointsPerTerm(pointsPerTerm);
+            vector<int> points = decodeColumn<int>(terms, "points", numTerms*pointsPerTerm);
+            summation->setTerms(values.data(), points.data(), numTerms);
+        }
+        else
+            for (int i = 0; i < numTerms; i++)
+                summation->addTerm(vector<double>(values.begin()+i*numParams, values.begin()+(i+1)*numParams));
+        summation->update();
+        summation->setCacheSize(node.getIntProperty("cacheSize", summation->getCacheSize()));
+        for (auto& child : node.getChildren())
+            if (child.getName() == "CompactSupport") {
+                vector<string> centers;
+                for (auto& center : child.getChildren())
+                    centers.push_back(center.getStringProperty("name"));
+                summation->setCompactSupport(centers, child.getStringProperty("radius"));
+            }
+            else if (version >= 4 && child.getName() == "GaussianSupport") {
+                vector<string> centers;
+                for (auto& center : child.getChildren())
+                    centers.push_back(center.getStringProperty("name"));
+                summation->setGaussianSupport(centers, child.getStringProperty("width"), child.getStringProperty("height"),
+                                              child.getDoubleProperty("tolerance"));
+            }
+            else if (version >= 5 && child.getName() == "Grid") {
+                vector<double> minValues, maxValues;
+                vector<int> numPoints;
+                for (auto& axis : child.getChildren()) {
+                    minValues.push_back(axis.getDoubleProperty("min"));
+                    maxValues.push_back(axis.getDoubleProperty("max"));
+                    numPoints.push_back(axis.getIntProperty("points"));
+                }
+                summation->setGrid(minValues, maxValues, numPoints);
+            }
+            else if (child.getName() == "Coalescing")
+                summation->setCoalescing(child.getStringProperty("weight"), child.getDoubleProperty("tolerance"));
+    }
+    catch (...) {
+        delete summation;
+        throw;
+    }
+    return summation;
+}
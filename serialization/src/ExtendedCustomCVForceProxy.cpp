@@ -0,0 +1,236 @@
+/* -------------------------------------------------------------------------- *
+ *                             OpenMM Laboratory                              *
+ *                             =================                              *
+ *                                                                            *
+ * A plugin for testing low-level code implementation for OpenMM.             *
+ *                                                                            *
+ * Copyright (c) 2023 Charlles Abreu                                          *
+ * https://github.com/craabreu/openmm-lab                                     *
+ * -------------------------------------------------------------------------- */
+
+#include "ExtendedCustomCVForceProxy.h"
+#include "SerializationColumns.h"
+#include "CustomSummation.h"
+#include "ExtendedCustomCVForce.h"
+#include "openmm/serialization/SerializationNode.h"
+#include "openmm/Force.h"
+#include "openmm/OpenMMException.h"
+#include "openmm/TabulatedFunction.h"
+#include "openmm/VirtualSite.h"
+#include <string>
+#include <vector>
+
+using namespace OpenMMLab;
+using namespace OpenMM;
+using namespace std;
+
+/**
+ * Version 2 adds the custom summations, version 3 the batches of collective variables,
+ * version 4 the platforms of the collective variables, version 5 the compressed forces,
+ * version 6 the deposition of terms in custom summations, version 7 the size of the
+ * history of the collective variables, version 8 the derivatives on demand, and version 9
+ * the shared particles.
+ */
+
+static void serializeSharedParticle(const VirtualSite& site, SerializationNode& node) {
+    vector<double> weights[3];
+    if (const TwoParticleAverageSite* s = dynamic_cast<const TwoParticleAverageSite*>(&site)) {
+        node.setStringProperty("type", "TwoParticleAverage");
+        weights[0] = {s->getWeight(0), s->getWeight(1)};
+    }
+    else if (const ThreeParticleAverageSite* s = dynamic_cast<const ThreeParticleAverageSite*>(&site)) {
+        node.setStringProperty("type", "ThreeParticleAverage");
+        weights[0] = {s->getWeight(0), s->getWeight(1), s->getWeight(2)};
+    }
+    else if (const OutOfPlaneSite* s = dynamic_cast<const OutOfPlaneSite*>(&site)) {
+        node.setStringProperty("type", "OutOfPlane");
+        node.setDoubleProperty("w12", s->getWeight12()).setDoubleProperty("w13", s->getWeight13()).setDoubleProperty("wCross", s->getWeightCross());
+    }
+    else if (const LocalCoordinatesSite* s = dynamic_cast<const LocalCoordinatesSite*>(&site)) {
+        node.setStringProperty("type", "LocalCoordinates");
+        Vec3 position = s->getLocalPosition();
+        node.setDoubleProperty("x", position[0]).setDoubleProperty("y", position[1]).setDoubleProperty("z", position[2]);
+        weights[0] = s->getOriginWeights();
+        weights[1] = s->getXWeights();
+        weights[2] = s->getYWeights();
+    }
+    else
+        throw OpenMMException("ExtendedCustomCVForce: unsupported type of VirtualSite for a shared particle");
+    for (int i = 0; i < site.getNumParticles(); i++) {
+        SerializationNode& particle = node.createChildNode("Particle").setIntProperty("index", site.getParticle(i));
+        if (!weights[0].empty())
+            particle.setDoubleProperty("weight", weights[0][i]);
+        if (!weights[1].empty())
+            particle.setDoubleProperty("wx", weights[1][i]).setDoubleProperty("wy", weights[2][i]);
+    }
+}
+
+static VirtualSite* deserializeSharedParticle(const SerializationNode& node) {
+    vector<int> particles;
+    vector<double> weights, xWeights, yWeights;
+    for (auto& particle : node.getChildren()) {
+        particles.push_back(particle.getIntProperty("index"));
+        weights.push_back(particle.getDoubleProperty("weight", 0.0));
+        xWeights.push_back(particle.getDoubleProperty("wx", 0.0));
+        yWeights.push_back(particle.getDoubleProperty("wy", 0.0));
+    }
+    const string& type = node.getStringProperty("type");
+    if (type == "TwoParticleAverage" && particles.size() == 2)
+        return new TwoParticleAverageSite(particles[0], particles[1], weights[0], weights[1]);
+    if (type == "ThreeParticleAverage" && particles.size() == 3)
+        return new ThreeParticleAverageSite(particles[0], particles[1], particles[2], weights[0], weights[1], weights[2]);
+    if (type == "OutOfPlane" && particles.size() == 3)
+        return new OutOfPlaneSite(particles[0], particles[1], particles[2], node.getDoubleProperty("w12"), node.getDoubleProperty("w13"),
+                                  node.getDoubleProperty("wCross"));
+    if (type == "LocalCoordinates")
+        return new LocalCoordinatesSite(particles, weights, xWeights, yWeights,
+                                        Vec3(node.getDoubleProperty("x"), node.getDoubleProperty("y"), node.getDoubleProperty("z")));
+    throw OpenMMException("ExtendedCustomCVForce: invalid shared particle of type '"+type+"'");
+}
+
+ExtendedCustomCVForceProxy::ExtendedCustomCVForceProxy() : SerializationProxy("ExtendedCustomCVForce") {
+}
+
+void ExtendedCustomCVForceProxy::serialize(const void* object, SerializationNode& node) const {
+    node.setIntProperty("version", 9);
+    const ExtendedCustomCVForce& force = *reinterpret_cast<const ExtendedCustomCVForce*>(object);
+    node.setIntProperty("forceGroup", force.getForceGroup());
+    node.setStringProperty("name", force.getName());
+    node.setStringProperty("energy", force.getEnergyFunction());
+    node.setBoolProperty("compressedForces", force.getUseCompressedForces());
+    node.setBoolProperty("derivativesOnDemand", force.getUseDerivativesOnDemand());
+    node.setIntProperty("historySize", force.getCollectiveVariableHistorySize());
+    SerializationNode& variables = node.createChildNode("CollectiveVariables");
+    for (int i = 0; i < force.getNumCollectiveVariables(); i++) {
+        SerializationNode& variable = variables.createChildNode("Variable", &force.getCollectiveVariable(i));
+        variable.setStringProperty("name", force.getCollectiveVariableName(i));
+        variable.setIntProperty("interval", force.getCollectiveVariableInterval(i));
+        variable.setStringProperty("platform", force.getCollectiveVariablePlatform(i));
+    }
+    SerializationNode& globalParams = node.createChildNode("GlobalParameters");
+    for (int i = 0; i < force.getNumGlobalParameters(); i++)
+        globalParams.createChildNode("Parameter").setStringProperty("name", force.getGlobalParameterName(i)).setDoubleProperty("default", force.getGlobalParameterDefaultValue(i));
+    SerializationNode& energyDerivs = node.createChildNode("EnergyParameterDerivatives");
+    for (int i = 0; i < force.getNumEnergyParameterDerivatives(); i++)
+        energyDerivs.createChildNode("Parameter").setStringProperty("name", force.getEnergyParameterDerivativeName(i));
+    SerializationNode& functions = node.createChildNode("Functions");
+    for (int i = 0; i < force.getNumTabulatedFunctions(); i++)
+        functions.createChildNode("Function", &force.getTabulatedFunction(i)).setStringProperty("name", force.getTabulatedFunctionName(i));
+
+    // The centers and weights of a radial basis function can be numerous, so they are
+    // stored as columns.
+
+    SerializationNode& radialBasisFunctions = node.createChildNode("RadialBasisFunctions");
+    for (int i = 0; i < force.getNumRadialBasisFunctions(); i++) {
+        string name;
+        ExtendedCustomCVForce::RadialBasisFunctionType type;
+        double shapeParameter;
+        vector<string> rbfVariables;
+        vector<double> centers, weights;
+        force.getRadialBasisFunctionParameters(i, name, type, shapeParameter, rbfVariables, centers, weights);
+        SerializationNode& function = radialBasisFunctions.createChildNode("RadialBasisFunction");
+        function.setStringProperty("name", name).setIntProperty("type", (int) type).setDoubleProperty("shape", shapeParameter);
+        function.setIntProperty("numCenters", (int) weights.size());
+        function.setStringProperty("centers", encodeColumn(centers)).setStringProperty("weights", encodeColumn(weights));
+        for (string& variable : rbfVariables)
+            function.createChildNode("Variable").setStringProperty("name", variable);
+    }
+    SerializationNode& summations = node.createChildNode("CustomSummations");
+    for (int i = 0; i < force.getNumCustomSummations(); i++) {
+        SerializationNode& summation = summations.createChildNode("Summation");
+        summation.setStringProperty("name", force.getCustomSummationName(i));
+        summation.createChildNode("Function", &force.getCustomSummation(i));
+        SerializationNode& summationVariables = summation.createChildNode("Variables");
+        for (const string& variable : force.getCustomSummationVariables(i))
+            summationVariables.createChildNode("Variable").setStringProperty("name", variable);
+        SerializationNode& deposition = summation.createChildNode("Deposition");
+        deposition.setIntProperty("interval", force.getCustomSummationDepositionInterval(i));
+        for (const string& parameter : force.getCustomSummationDepositionParameters(i))
+            deposition.createChildNode("Parameter").setStringProperty("expression", parameter);
+    }
+    SerializationNode& batches = node.createChildNode("CollectiveVariableBatches");
+    for (int i = 0; i < force.getNumCollectiveVariableBatches(); i++) {
+        SerializationNode& batch = batches.createChildNode("Batch");
+        batch.createChildNode("Force", &force.getCollectiveVariableBatch(i));
+        SerializationNode& names = batch.createChildNode("Variables");
+        for (const string& name : force.getCollectiveVariableBatchNames(i))
+            names.createChildNode("Variable").setStringProperty("name", name);
+    }
+    SerializationNode& sharedParticles = node.createChildNode("SharedParticles");
+    for (int i = 0; i < force.getNumSharedParticles(); i++)
+        serializeSharedParticle(force.getSharedParticle(i), sharedParticles.createChildNode("Site"));
+}
+
+void* ExtendedCustomCVForceProxy::deserialize(const SerializationNode& node) const {
+    int version = node.getIntProperty("version");
+    if (version < 1 || version > 9)
+        throw OpenMMException("Unsupported version number");
+    ExtendedCustomCVForce* force = new ExtendedCustomCVForce(node.getStringProperty("energy"));
+    try {
+        force->setForceGroup(node.getIntProperty("forceGroup", 0));
+        force->setName(node.getStringProperty("name", force->getName()));
+        force->setUseCompressedForces(node.getBoolProperty("compressedForces", false));
+        force->setUseDerivativesOnDemand(node.getBoolProperty("derivativesOnDemand", false));
+        force->setCollectiveVariableHistorySize(node.getIntProperty("historySize", 0));
+        const SerializationNode& variables = node.getChildNode("CollectiveVariables");
+        for (auto& variable : variables.getChildren()) {
+            int index = force->addCollectiveVariable(variable.getStringProperty("name"), variable.decodeObject<Force>());
+            force->setCollectiveVariableInterval(index, variable.getIntProperty("interval", 1));
+            force->setCollectiveVariablePlatform(index, variable.getStringProperty("platform", ""));
+        }
+        const SerializationNode& globalParams = node.getChildNode("GlobalParameters");
+        for (auto& parameter : globalParams.getChildren())
+            force->addGlobalParameter(parameter.getStringProperty("name"), parameter.getDoubleProperty("default"));
+        const SerializationNode& energyDerivs = node.getChildNode("EnergyParameterDerivatives");
+        for (auto& parameter : energyDerivs.getChildren())
+            force->addEnergyParameterDerivative(parameter.getStringProperty("name"));
+        const SerializationNode& functions = node.getChildNode("Functions");
+        for (auto& function : functions.getChildren())
+            force->addTabulatedFunction(function.getStringProperty("name"), function.decodeObject<TabulatedFunction>());
+        const SerializationNode& radialBasisFunctions = node.getChildNode("RadialBasisFunctions");
+        for (auto& function : radialBasisFunctions.getChildren()) {
+            vector<string> rbfVariables;
+            for (auto& variable : function.getChildren())
+                rbfVariables.push_back(variable.getStringProperty("name"));
+            int numCenters = function.getIntProperty("numCenters");
+            vector<double> centers = decodeColumn<double>(function, "centers", numCenters*rbfVariables.size());
+            vector<double> weights = decodeColumn<double>(function, "weights", numCenters);
+            force->addRadialBasisFunction(function.getStringProperty("name"), (ExtendedCustomCVForce::RadialBasisFunctionType) function.getIntProperty("type"),
+                                          function.getDoubleProperty("shape"), rbfVariables, centers, weights);
+        }
+        if (version >= 2) {
+            const SerializationNode& summations = node.getChildNode("CustomSummations");
+            for (auto& summation : summations.getChildren()) {
+                vector<string> summationVariables;
+                for (auto& variable : summation.getChildNode("Variables").getChildren())
+                    summationVariables.push_back(variable.getStringProperty("name"));
+                int index = force->addCustomSummation(summation.getStringProperty("name"), summation.getChildNode("Function").decodeObject<CustomSummation>(),
+                                                      summationVariables);
+                if (version >= 6) {
+                    const SerializationNode& deposition = summation.getChildNode("Deposition");
+                    vector<string> parameters;
+                    for (auto& parameter : deposition.getChildren())
+                        parameters.push_back(parameter.getStringProperty("expression"));
+                    force->setCustomSummationDeposition(index, deposition.getIntProperty("interval"), parameters);
+                }
+            }
+        }
+        if (version >= 3) {
+            const SerializationNode& batches = node.getChildNode("CollectiveVariableBatches");
+            for (auto& batch : batches.getChildren()) {
+                vector<string> names;
+                for (auto& variable : batch.getChildNode("Variables").getChildren())
+                    names.push_back(variable.getStringProperty("name"));
+                force->addCollectiveVariableBatch(names, batch.getChildNode("Force").decodeObject<Force>());
+            }
+        }
+        if (version >= 9)
+            for (auto& site : node.getChildNode("SharedParticles").getChildren())
+                force->addSharedParticle(deserializeSharedParticle(site));
+    }
+    catch (...) {
+        delete force;
+        throw;
+    }
+    return force;
+}
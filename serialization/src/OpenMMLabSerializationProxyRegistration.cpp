@@ -17,6 +17,10 @@
 #include <cstdlib>
 #endif
 
+#include "CustomSummation.h"
+#include "CustomSummationProxy.h"
+#include "ExtendedCustomCVForce.h"
+#include "ExtendedCustomCVForceProxy.h"
 #include "SlicedNonbondedForce.h"
 #include "SlicedNonbondedForceProxy.h"
 #include "openmm/serialization/SerializationProxy.h"
@@ -38,4 +42,6 @@ using namespace OpenMM;
 
 extern "C" OPENMM_EXPORT_OPENMM_LAB void registerOpenMMLabSerializationProxies() {
     SerializationProxy::registerProxy(typeid(SlicedNonbondedForce), new SlicedNonbondedForceProxy());
+    SerializationProxy::registerProxy(typeid(ExtendedCustomCVForce), new ExtendedCustomCVForceProxy());
+    SerializationProxy::registerProxy(typeid(CustomSummation), new CustomSummationProxy());
 }
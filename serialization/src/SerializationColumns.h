@@ -0,0 +1,124 @@
+#ifndef OPENMMLAB_SERIALIZATIONCOLUMNS_H_
+#define OPENMMLAB_SERIALIZATIONCOLUMNS_H_
+
+/* -------------------------------------------------------------------------- *
+ *                             OpenMM Laboratory                              *
+ *                             =================                              *
+ *                                                                            *
+ * A plugin for testing low-level code implementation for OpenMM.             *
+ *                                                                            *
+ * Copyright (c) 2023 Charlles Abreu                                          *
+ * https://github.com/craabreu/openmm-lab                                     *
+ * -------------------------------------------------------------------------- */
+
+#include "openmm/serialization/SerializationNode.h"
+#include "openmm/OpenMMException.h"
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+namespace OpenMMLab {
+
+/**
+ * These functions store arrays of numbers as single properties of a SerializationNode,
+ * rather than as one node per value.  Each column is the little-endian binary image of an
+ * array of 32 bit integers or doubles, encoded in base64 so that it can be a property of an
+ * XML node.  Values therefore round-trip exactly, and the size of a document and the time
+ * to parse it only grow with the number of bytes of data.
+ */
+
+static const char base64Digits[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+inline bool hostIsLittleEndian() {
+    uint16_t value = 1;
+    unsigned char byte;
+    memcpy(&byte, &value, 1);
+    return (byte == 1);
+}
+
+template <class T>
+inline std::string encodeColumn(const std::vector<T>& values) {
+    std::vector<unsigned char> bytes(values.size()*sizeof(T));
+    if (values.size() > 0)
+        memcpy(bytes.data(), values.data(), bytes.size());
+    if (!hostIsLittleEndian())
+        for (size_t i = 0; i < bytes.size(); i += sizeof(T))
+            std::reverse(bytes.begin()+i, bytes.begin()+i+sizeof(T));
+    std::string text;
+    text.reserve(4*((bytes.size()+2)/3));
+    for (size_t i = 0; i < bytes.size(); i += 3) {
+        int remaining = std::min((size_t) 3, bytes.size()-i);
+        uint32_t group = bytes[i] << 16;
+        if (remaining > 1)
+            group |= bytes[i+1] << 8;
+        if (remaining > 2)
+            group |= bytes[i+2];
+        text += base64Digits[(group >> 18) & 63];
+        text += base64Digits[(group >> 12) & 63];
+        text += (remaining > 1 ? base64Digits[(group >> 6) & 63] : '=');
+        text += (remaining > 2 ? base64Digits[group & 63] : '=');
+    }
+    return text;
+}
+
+/**
+ * The value of every base64 digit, indexed by character, or -1 for characters that are
+ * not digits.
+ */
+struct Base64DigitValues {
+    int values[256];
+    Base64DigitValues() {
+        std::fill(values, values+256, -1);
+        for (int i = 0; i < 64; i++)
+            values[(unsigned char) base64Digits[i]] = i;
+    }
+};
+
+template <class T>
+inline std::vector<T> decodeColumn(const OpenMM::SerializationNode& node, const std::string& name, int count) {
+    // The length of the text determines the number of values, so it is checked before
+    // anything is decoded, and the bytes are then written straight into the values.
+
+    static const Base64DigitValues digitValues;
+    const std::string& text = node.getStringProperty(name);
+    size_t length = text.size();
+    while (length > 0 && text[length-1] == '=')
+        length--;
+    size_t numBytes = (count < 0 ? 0 : count*sizeof(T));
+    if (count < 0 || length != (8*numBytes+5)/6)
+        throw OpenMM::OpenMMException("Serialization: wrong number of values in column '"+name+"'");
+    std::vector<T> values(count);
+    unsigned char* bytes = reinterpret_cast<unsigned char*>(values.data());
+    size_t next = 0;
+    uint32_t group = 0;
+    int numDigits = 0;
+    for (size_t i = 0; i < length; i++) {
+        int value = digitValues.values[(unsigned char) text[i]];
+        if (value < 0)
+            throw OpenMM::OpenMMException("Serialization: invalid character in column '"+name+"'");
+        group = (group << 6) | value;
+        if (++numDigits == 4) {
+            bytes[next++] = (group >> 16) & 255;
+            bytes[next++] = (group >> 8) & 255;
+            bytes[next++] = group & 255;
+            group = 0;
+            numDigits = 0;
+        }
+    }
+    if (numDigits == 2)
+        bytes[next++] = (group >> 4) & 255;
+    else if (numDigits == 3) {
+        bytes[next++] = (group >> 10) & 255;
+        bytes[next++] = (group >> 2) & 255;
+    }
+    if (!hostIsLittleEndian())
+        for (size_t i = 0; i < numBytes; i += sizeof(T))
+            std::reverse(bytes+i, bytes+i+sizeof(T));
+    return values;
+}
+
+} // namespace OpenMMLab
+
+#endif /*OPENMMLAB_SERIALIZATIONCOLUMNS_H_*/
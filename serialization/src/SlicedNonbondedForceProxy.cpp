@@ -9,20 +9,33 @@
  * -------------------------------------------------------------------------- */
 
 #include "SlicedNonbondedForceProxy.h"
+#include "SerializationColumns.h"
 #include "SlicedNonbondedForce.h"
 #include "openmm/serialization/SerializationNode.h"
 #include "openmm/Force.h"
+#include "openmm/OpenMMException.h"
+#include <map>
 #include <sstream>
+#include <string>
+#include <vector>
 
 using namespace OpenMMLab;
 using namespace OpenMM;
 using namespace std;
 
+/**
+ * Version 2 stores the per-particle and per-exception data, and the offsets, as columns
+ * rather than as one node per entry, so the size of a document and the time to parse it
+ * carry no per-entry overhead.  Version 3 adds the soft-core parameters of the slices,
+ * version 4 the foreign sets of scaling parameter values, and version 5 the PME interpolation
+ * order.
+ */
+
 SlicedNonbondedForceProxy::SlicedNonbondedForceProxy() : SerializationProxy("SlicedNonbondedForce") {
 }
 
 void SlicedNonbondedForceProxy::serialize(const void* object, SerializationNode& node) const {
-    node.setIntProperty("version", 1);
+    node.setIntProperty("version", 5);
     const SlicedNonbondedForce& force = *reinterpret_cast<const SlicedNonbondedForce*>(object);
     node.setIntProperty("numSubsets", force.getNumSubsets());
     node.setIntProperty("forceGroup", force.getForceGroup());
@@ -49,44 +62,64 @@ void SlicedNonbondedForceProxy::serialize(const void* object, SerializationNode&
     node.setIntProperty("ljny", ny);
     node.setIntProperty("ljnz", nz);
     node.setIntProperty("recipForceGroup", force.getReciprocalSpaceForceGroup());
+    node.setIntProperty("pmeOrder", force.getPMEInterpolationOrder());
     SerializationNode& globalParams = node.createChildNode("GlobalParameters");
     for (int i = 0; i < force.getNumGlobalParameters(); i++)
         globalParams.createChildNode("Parameter").setStringProperty("name", force.getGlobalParameterName(i)).setDoubleProperty("default", force.getGlobalParameterDefaultValue(i));
-    SerializationNode& particleOffsets = node.createChildNode("ParticleOffsets");
-    for (int i = 0; i < force.getNumParticleParameterOffsets(); i++) {
-        int particle;
-        double chargeScale, sigmaScale, epsilonScale;
-        string parameter;
-        force.getParticleParameterOffset(i, parameter, particle, chargeScale, sigmaScale, epsilonScale);
-        particleOffsets.createChildNode("Offset").setStringProperty("parameter", parameter).setIntProperty("particle", particle).setDoubleProperty("q", chargeScale).setDoubleProperty("sig", sigmaScale).setDoubleProperty("eps", epsilonScale);
-    }
-    SerializationNode& exceptionOffsets = node.createChildNode("ExceptionOffsets");
-    for (int i = 0; i < force.getNumExceptionParameterOffsets(); i++) {
-        int exception;
-        double chargeProdScale, sigmaScale, epsilonScale;
-        string parameter;
-        force.getExceptionParameterOffset(i, parameter, exception, chargeProdScale, sigmaScale, epsilonScale);
-        exceptionOffsets.createChildNode("Offset").setStringProperty("parameter", parameter).setIntProperty("exception", exception).setDoubleProperty("q", chargeProdScale).setDoubleProperty("sig", sigmaScale).setDoubleProperty("eps", epsilonScale);
-    }
-    SerializationNode& particles = node.createChildNode("Particles");
-    for (int i = 0; i < force.getNumParticles(); i++) {
-        double charge, sigma, epsilon;
-        force.getParticleParameters(i, charge, sigma, epsilon);
-        particles.createChildNode("Particle").setDoubleProperty("q", charge).setDoubleProperty("sig", sigma).setDoubleProperty("eps", epsilon);
-    }
-    SerializationNode& exceptions = node.createChildNode("Exceptions");
-    for (int i = 0; i < force.getNumExceptions(); i++) {
-        int particle1, particle2;
-        double chargeProd, sigma, epsilon;
-        force.getExceptionParameters(i, particle1, particle2, chargeProd, sigma, epsilon);
-        exceptions.createChildNode("Exception").setIntProperty("p1", particle1).setIntProperty("p2", particle2).setDoubleProperty("q", chargeProd).setDoubleProperty("sig", sigma).setDoubleProperty("eps", epsilon);
-    }
-    SerializationNode& subsets = node.createChildNode("Subsets");
-    for (int i = 0; i < force.getNumParticles(); i++) {
-        int subset = force.getParticleSubset(i);
-        if (subset != 0)
-            subsets.createChildNode("Subset").setIntProperty("index", i).setIntProperty("subset", subset);
+    for (int kind = 0; kind < 2; kind++) {
+        // The parameter of each offset is stored as an index into a list of names.
+
+        int numOffsets = (kind == 0 ? force.getNumParticleParameterOffsets() : force.getNumExceptionParameterOffsets());
+        SerializationNode& offsets = node.createChildNode(kind == 0 ? "ParticleOffsets" : "ExceptionOffsets");
+        map<string, int> parameterIndex;
+        vector<int> parameters(numOffsets), indices(numOffsets);
+        vector<double> q(numOffsets), sig(numOffsets), eps(numOffsets);
+        for (int i = 0; i < numOffsets; i++) {
+            string parameter;
+            if (kind == 0)
+                force.getParticleParameterOffset(i, parameter, indices[i], q[i], sig[i], eps[i]);
+            else
+                force.getExceptionParameterOffset(i, parameter, indices[i], q[i], sig[i], eps[i]);
+            if (parameterIndex.find(parameter) == parameterIndex.end()) {
+                int index = parameterIndex.size();
+                parameterIndex[parameter] = index;
+                offsets.createChildNode("Parameter").setStringProperty("name", parameter);
+            }
+            parameters[i] = parameterIndex[parameter];
+        }
+        offsets.setIntProperty("count", numOffsets);
+        offsets.setStringProperty("parameter", encodeColumn(parameters));
+        offsets.setStringProperty(kind == 0 ? "particle" : "exception", encodeColumn(indices));
+        offsets.setStringProperty("q", encodeColumn(q));
+        offsets.setStringProperty("sig", encodeColumn(sig));
+        offsets.setStringProperty("eps", encodeColumn(eps));
     }
+    int numParticles = force.getNumParticles();
+    vector<double> charges(numParticles), sigmas(numParticles), epsilons(numParticles);
+    for (int i = 0; i < numParticles; i++)
+        force.getParticleParameters(i, charges[i], sigmas[i], epsilons[i]);
+    node.createChildNode("Particles").setIntProperty("count", numParticles).setStringProperty("q", encodeColumn(charges))
+            .setStringProperty("sig", encodeColumn(sigmas)).setStringProperty("eps", encodeColumn(epsilons));
+    int numExceptions = force.getNumExceptions();
+    vector<int> particles1(numExceptions), particles2(numExceptions);
+    vector<double> chargeProds(numExceptions);
+    sigmas.resize(numExceptions);
+    epsilons.resize(numExceptions);
+    for (int i = 0; i < numExceptions; i++)
+        force.getExceptionParameters(i, particles1[i], particles2[i], chargeProds[i], sigmas[i], epsilons[i]);
+    node.createChildNode("Exceptions").setIntProperty("count", numExceptions).setStringProperty("p1", encodeColumn(particles1))
+            .setStringProperty("p2", encodeColumn(particles2)).setStringProperty("q", encodeColumn(chargeProds))
+            .setStringProperty("sig", encodeColumn(sigmas)).setStringProperty("eps", encodeColumn(epsilons));
+
+    // The subsets are only stored if some particle is not in subset 0.
+
+    vector<int> subsets = force.getParticleSubsets();
+    bool hasSubsets = false;
+    for (int subset : subsets)
+        hasSubsets |= (subset != 0);
+    if (!hasSubsets)
+        subsets.clear();
+    node.createChildNode("Subsets").setIntProperty("count", (int) subsets.size()).setStringProperty("subset", encodeColumn(subsets));
     SerializationNode& scalingParameters = node.createChildNode("scalingParameters");
     for (int i = 0; i < force.getNumScalingParameters(); i++) {
         string parameter;
@@ -98,11 +131,25 @@ void SlicedNonbondedForceProxy::serialize(const void* object, SerializationNode&
     SerializationNode& scalingParameterDerivatives = node.createChildNode("scalingParameterDerivatives");
     for (int i = 0; i < force.getNumScalingParameterDerivatives(); i++)
         scalingParameterDerivatives.createChildNode("scalingParameterDerivative").setStringProperty("parameter", force.getScalingParameterDerivativeName(i));
+    SerializationNode& softCore = node.createChildNode("SoftCore");
+    for (int i = 0; i < force.getNumSubsets(); i++)
+        for (int j = i; j < force.getNumSubsets(); j++) {
+            double alpha, power;
+            force.getSliceSoftCoreParameters(i, j, alpha, power);
+            if (alpha != 0)
+                softCore.createChildNode("Slice").setIntProperty("subset1", i).setIntProperty("subset2", j).setDoubleProperty("alpha", alpha).setDoubleProperty("power", power);
+        }
+    SerializationNode& foreignSets = node.createChildNode("ForeignScalingParameterSets");
+    for (int i = 0; i < force.getNumForeignScalingParameterSets(); i++) {
+        SerializationNode& foreignSet = foreignSets.createChildNode("Set");
+        for (auto& value : force.getForeignScalingParameterSet(i))
+            foreignSet.createChildNode("Parameter").setStringProperty("name", value.first).setDoubleProperty("value", value.second);
+    }
 }
 
 void* SlicedNonbondedForceProxy::deserialize(const SerializationNode& node) const {
     int version = node.getIntProperty("version");
-    if (version != 1)
+    if (version < 1 || version > 5)
         throw OpenMMException("Unsupported version number");
     SlicedNonbondedForce* force = new SlicedNonbondedForce(node.getIntProperty("numSubsets"));
     try {
@@ -128,31 +175,101 @@ void* SlicedNonbondedForceProxy::deserialize(const SerializationNode& node) cons
         nz = node.getIntProperty("ljnz", 0);
         force->setLJPMEParameters(alpha, nx, ny, nz);
         force->setReciprocalSpaceForceGroup(node.getIntProperty("recipForceGroup", -1));
+        force->setPMEInterpolationOrder(node.getIntProperty("pmeOrder", 5));
         const SerializationNode& globalParams = node.getChildNode("GlobalParameters");
         for (auto& parameter : globalParams.getChildren())
             force->addGlobalParameter(parameter.getStringProperty("name"), parameter.getDoubleProperty("default"));
-        const SerializationNode& particleOffsets = node.getChildNode("ParticleOffsets");
-        for (auto& offset : particleOffsets.getChildren())
-            force->addParticleParameterOffset(offset.getStringProperty("parameter"), offset.getIntProperty("particle"), offset.getDoubleProperty("q"), offset.getDoubleProperty("sig"), offset.getDoubleProperty("eps"));
-        const SerializationNode& exceptionOffsets = node.getChildNode("ExceptionOffsets");
-        for (auto& offset : exceptionOffsets.getChildren())
-            force->addExceptionParameterOffset(offset.getStringProperty("parameter"), offset.getIntProperty("exception"), offset.getDoubleProperty("q"), offset.getDoubleProperty("sig"), offset.getDoubleProperty("eps"));
         force->setExceptionsUsePeriodicBoundaryConditions(node.getIntProperty("exceptionsUsePeriodic"));
-        const SerializationNode& particles = node.getChildNode("Particles");
-        for (auto& particle : particles.getChildren())
-            force->addParticle(particle.getDoubleProperty("q"), particle.getDoubleProperty("sig"), particle.getDoubleProperty("eps"));
-        const SerializationNode& exceptions = node.getChildNode("Exceptions");
-        for (auto& exception : exceptions.getChildren())
-            force->addException(exception.getIntProperty("p1"), exception.getIntProperty("p2"), exception.getDoubleProperty("q"), exception.getDoubleProperty("sig"), exception.getDoubleProperty("eps"));
-        const SerializationNode& subsets = node.getChildNode("Subsets");
-        for (auto& subset : subsets.getChildren())
-            force->setParticleSubset(subset.getIntProperty("index"), subset.getIntProperty("subset"));
+        if (version == 1) {
+            const SerializationNode& particleOffsets = node.getChildNode("ParticleOffsets");
+            for (auto& offset : particleOffsets.getChildren())
+                force->addParticleParameterOffset(offset.getStringProperty("parameter"), offset.getIntProperty("particle"), offset.getDoubleProperty("q"), offset.getDoubleProperty("sig"), offset.getDoubleProperty("eps"));
+            const SerializationNode& exceptionOffsets = node.getChildNode("ExceptionOffsets");
+            for (auto& offset : exceptionOffsets.getChildren())
+                force->addExceptionParameterOffset(offset.getStringProperty("parameter"), offset.getIntProperty("exception"), offset.getDoubleProperty("q"), offset.getDoubleProperty("sig"), offset.getDoubleProperty("eps"));
+            const SerializationNode& particles = node.getChildNode("Particles");
+            for (auto& particle : particles.getChildren())
+                force->addParticle(particle.getDoubleProperty("q"), particle.getDoubleProperty("sig"), particle.getDoubleProperty("eps"));
+            const SerializationNode& exceptions = node.getChildNode("Exceptions");
+            for (auto& exception : exceptions.getChildren())
+                force->addException(exception.getIntProperty("p1"), exception.getIntProperty("p2"), exception.getDoubleProperty("q"), exception.getDoubleProperty("sig"), exception.getDoubleProperty("eps"));
+            // The subsets are gathered into a dense array and set at once.
+
+            const SerializationNode& subsets = node.getChildNode("Subsets");
+            if (subsets.getChildren().size() > 0) {
+                vector<int> particleSubsets(force->getNumParticles(), 0);
+                for (auto& subset : subsets.getChildren()) {
+                    int index = subset.getIntProperty("index");
+                    if (index < 0 || index >= particleSubsets.size())
+                        throw OpenMMException("SlicedNonbondedForce: illegal particle index in subset");
+                    particleSubsets[index] = subset.getIntProperty("subset");
+                }
+                force->setParticleSubsets(particleSubsets);
+            }
+        }
+        else {
+            for (int kind = 0; kind < 2; kind++) {
+                const SerializationNode& offsets = node.getChildNode(kind == 0 ? "ParticleOffsets" : "ExceptionOffsets");
+                vector<string> names;
+                names.reserve(offsets.getChildren().size());
+                for (auto& parameter : offsets.getChildren())
+                    names.push_back(parameter.getStringProperty("name"));
+                int numOffsets = offsets.getIntProperty("count");
+                vector<int> parameters = decodeColumn<int>(offsets, "parameter", numOffsets);
+                vector<int> indices = decodeColumn<int>(offsets, kind == 0 ? "particle" : "exception", numOffsets);
+                vector<double> q = decodeColumn<double>(offsets, "q", numOffsets);
+                vector<double> sig = decodeColumn<double>(offsets, "sig", numOffsets);
+                vector<double> eps = decodeColumn<double>(offsets, "eps", numOffsets);
+                for (int i = 0; i < numOffsets; i++) {
+                    if (parameters[i] < 0 || parameters[i] >= names.size())
+                        throw OpenMMException("SlicedNonbondedForce: illegal parameter index in offset");
+                    if (kind == 0)
+                        force->addParticleParameterOffset(names[parameters[i]], indices[i], q[i], sig[i], eps[i]);
+                    else
+                        force->addExceptionParameterOffset(names[parameters[i]], indices[i], q[i], sig[i], eps[i]);
+                }
+            }
+            const SerializationNode& particles = node.getChildNode("Particles");
+            int numParticles = particles.getIntProperty("count");
+            vector<double> charges = decodeColumn<double>(particles, "q", numParticles);
+            vector<double> sigmas = decodeColumn<double>(particles, "sig", numParticles);
+            vector<double> epsilons = decodeColumn<double>(particles, "eps", numParticles);
+            for (int i = 0; i < numParticles; i++)
+                force->addParticle(charges[i], sigmas[i], epsilons[i]);
+            const SerializationNode& exceptions = node.getChildNode("Exceptions");
+            int numExceptions = exceptions.getIntProperty("count");
+            vector<int> particles1 = decodeColumn<int>(exceptions, "p1", numExceptions);
+            vector<int> particles2 = decodeColumn<int>(exceptions, "p2", numExceptions);
+            vector<double> chargeProds = decodeColumn<double>(exceptions, "q", numExceptions);
+            sigmas = decodeColumn<double>(exceptions, "sig", numExceptions);
+            epsilons = decodeColumn<double>(exceptions, "eps", numExceptions);
+            for (int i = 0; i < numExceptions; i++)
+                force->addException(particles1[i], particles2[i], chargeProds[i], sigmas[i], epsilons[i]);
+            const SerializationNode& subsets = node.getChildNode("Subsets");
+            int numSubsetEntries = subsets.getIntProperty("count");
+            if (numSubsetEntries > 0)
+                force->setParticleSubsets(decodeColumn<int>(subsets, "subset", numSubsetEntries));
+        }
         const SerializationNode& scalingParameters = node.getChildNode("scalingParameters");
         for (auto& param : scalingParameters.getChildren())
             force->addScalingParameter(param.getStringProperty("parameter"), param.getIntProperty("subset1"), param.getIntProperty("subset2"), param.getBoolProperty("includeCoulomb"), param.getBoolProperty("includeLJ"));
         const SerializationNode& scalingParameterDerivatives = node.getChildNode("scalingParameterDerivatives");
         for (auto& param : scalingParameterDerivatives.getChildren())
             force->addScalingParameterDerivative(param.getStringProperty("parameter"));
+        if (version >= 3) {
+            const SerializationNode& softCore = node.getChildNode("SoftCore");
+            for (auto& slice : softCore.getChildren())
+                force->setSliceSoftCoreParameters(slice.getIntProperty("subset1"), slice.getIntProperty("subset2"), slice.getDoubleProperty("alpha"), slice.getDoubleProperty("power"));
+        }
+        if (version >= 4) {
+            const SerializationNode& foreignSets = node.getChildNode("ForeignScalingParameterSets");
+            for (auto& foreignSet : foreignSets.getChildren()) {
+                map<string, double> values;
+                for (auto& value : foreignSet.getChildren())
+                    values[value.getStringProperty("name")] = value.getDoubleProperty("value");
+                force->addForeignScalingParameterSet(values);
+            }
+        }
     }
     catch (...) {
         delete force;
@@ -0,0 +1,116 @@
+/* -------------------------------------------------------------------------- *
+ *                             OpenMM Laboratory                              *
+ *                             =================                              *
+ *                                                                            *
+ * A plugin for testing low-level code implementation for OpenMM.             *
+ *                                                                            *
+ * Copyright (c) 2023 Charlles Abreu                                          *
+ * https://github.com/craabreu/openmm-lab                                     *
+ * -------------------------------------------------------------------------- */
+
+#include "CustomSummation.h"
+#include "openmm/Platform.h"
+#include "openmm/internal/AssertionUtilities.h"
+#include "openmm/serialization/XmlSerializer.h"
+#include <iostream>
+#include <sstream>
+
+using namespace OpenMMLab;
+using namespace OpenMM;
+using namespace std;
+
+void testSerialization() {
+    // Create a summation.
+
+    vector<string> perTermParameters = {"cx", "cy", "r"};
+    CustomSummation summation(
+        2,
+        "a*step(r-sqrt((x1-cx)^2+(y1-cy)^2))",
+        map<string, double>{{"a", 1.5}},
+        perTermParameters,
+        Platform::getPlatformByName("Reference"),
+        map<string, string>{{"Backend", "Native"}}
+    );
+    summation.addTerm(vector<double>{0.0, 0.0, 1.0});
+    summation.addTerm(vector<double>{1.0, 1.0/3.0, 0.5});
+    summation.addTerm(vector<double>{-1.0, 2.0, 0.25});
+    summation.update();
+    summation.setParameter("a", 2.5);
+    summation.setCacheSize(3);
+    summation.setCompactSupport(vector<string>{"cx", "cy"}, "r");
+    summation.setCoalescing("r", 0.01);
+
+    // Serialize and then deserialize it.
+
+    stringstream buffer;
+    XmlSerializer::serialize<CustomSummation>(&summation, "CustomSummation", buffer);
+    CustomSummation* copy = XmlSerializer::deserialize<CustomSummation>(buffer);
+
+    // Compare the two summations to see if they are identical.
+
+    CustomSummation& summation2 = *copy;
+    ASSERT_EQUAL(summation.getNumArguments(), summation2.getNumArguments());
+    ASSERT_EQUAL(summation.getExpression(), summation2.getExpression());
+    ASSERT(summation.getOverallParameters() == summation2.getOverallParameters());
+    ASSERT(summation.getPerTermParameters() == summation2.getPerTermParameters());
+    ASSERT(summation.getPlatformProperties() == summation2.getPlatformProperties());
+    ASSERT_EQUAL(summation.getPlatform().getName(), summation2.getPlatform().getName());
+    ASSERT_EQUAL(summation.getCacheSize(), summation2.getCacheSize());
+    ASSERT_EQUAL(summation.getNumTerms(), summation2.getNumTerms());
+    for (int i = 0; i < summation.getNumTerms(); i++)
+        ASSERT(summation.getTerm(i) == summation2.getTerm(i));
+    vector<string> centers;
+    string radius;
+    ASSERT(summation2.getCompactSupport(centers, radius));
+    ASSERT(centers == vector<string>({"cx", "cy"}));
+    ASSERT_EQUAL("r", radius);
+    string weight;
+    double tolerance;
+    ASSERT(summation2.getCoalescing(weight, tolerance));
+    ASSERT_EQUAL("r", weight);
+    ASSERT_EQUAL(0.01, tolerance);
+    vector<double> arguments = {0.9, 0.4};
+    ASSERT_EQUAL(summation.evaluate(arguments), summation2.evaluate(arguments));
+    delete copy;
+}
+
+void testSerializationOfTermPoints() {
+    CustomSummation summation(
+        9,
+        "k*distance(p1,p2)^2",
+        map<string, double>(),
+        vector<string>{"k"},
+        Platform::getPlatformByName("Reference"),
+        map<string, string>{{"Backend", "Native"}}
+    );
+    summation.setPointsPerTerm(2);
+    summation.addTerm(vector<double>{1.0}, vector<int>{0, 1});
+    summation.addTerm(vector<double>{0.5}, vector<int>{2, 0});
+    summation.update();
+    stringstream buffer;
+    XmlSerializer::serialize<CustomSummation>(&summation, "CustomSummation", buffer);
+    CustomSummation* copy = XmlSerializer::deserialize<CustomSummation>(buffer);
+    CustomSummation& summation2 = *copy;
+    ASSERT_EQUAL(summation.getPointsPerTerm(), summation2.getPointsPerTerm());
+    ASSERT_EQUAL(summation.getNumTerms(), summation2.getNumTerms());
+    for (int i = 0; i < summation.getNumTerms(); i++) {
+        ASSERT(summation.getTerm(i) == summation2.getTerm(i));
+        ASSERT(summation.getTermPoints(i) == summation2.getTermPoints(i));
+    }
+    vector<double> arguments = {0.9, 0.4, 0.1, -0.3, 0.2, 1.1, 0.5, 0.6, -0.7};
+    ASSERT_EQUAL(summation.evaluate(arguments), summation2.evaluate(arguments));
+    delete copy;
+}
+
+int main() {
+    try {
+        testSerialization();
+        testSerializationOfTermPoints();
+    }
+    catch(const exception& e) {
+        cout << "exception: " << e.what() << endl;
+        return 1;
+    }
+    cout << "Done" << endl;
+    return 0;
+}
@@ -0,0 +1,154 @@
+/* -------------------------------------------------------------------------- *
+ *                             OpenMM Laboratory                              *
+ *                             =================                              *
+ *                                                                            *
+ * A plugin for testing low-level code implementation for OpenMM.             *
+ *                                                                            *
+ * Copyright (c) 2023 Charlles Abreu                                          *
+ * https://github.com/craabreu/openmm-lab                                     *
+ * -------------------------------------------------------------------------- */
+
+#include "ExtendedCustomCVForce.h"
+#include "openmm/CustomBondForce.h"
+#include "openmm/CustomExternalForce.h"
+#include "openmm/VirtualSite.h"
+#include "openmm/internal/AssertionUtilities.h"
+#include "openmm/serialization/XmlSerializer.h"
+#include <iostream>
+#include <sstream>
+
+using namespace OpenMMLab;
+using namespace OpenMM;
+using namespace std;
+
+void testSerialization() {
+    // Create a Force.
+
+    ExtendedCustomCVForce force("2*v1+v2^2+rbf");
+    force.setForceGroup(3);
+    force.setName("custom name");
+    CustomBondForce* v1 = new CustomBondForce("r");
+    v1->addBond(0, 1);
+    force.addCollectiveVariable("v1", v1);
+    CustomExternalForce* v2 = new CustomExternalForce("x");
+    v2->addParticle(2);
+    force.addCollectiveVariable("v2", v2);
+    force.setCollectiveVariableInterval(1, 5);
+    force.setCollectiveVariablePlatform(0, "CPU");
+    force.setUseCompressedForces(true);
+    force.setUseDerivativesOnDemand(true);
+    force.setCollectiveVariableHistorySize(100);
+    force.addGlobalParameter("a", 1.5);
+    force.addGlobalParameter("b", -2.0);
+    force.addEnergyParameterDerivative("a");
+    force.addTabulatedFunction("f", new Continuous1DFunction({1.0, 2.0, 3.0}, 0.0, 2.0));
+    vector<string> variables = {"v1", "v2"};
+    vector<double> centers = {0.1, 0.2, 1.0/3.0, 0.4, 0.5, 0.6};
+    vector<double> weights = {1.0, -1.0/7.0, 0.25};
+    force.addRadialBasisFunction("rbf", ExtendedCustomCVForce::Multiquadric, 0.7, variables, centers, weights);
+    CustomSummation* summation = new CustomSummation(1, "a*(x1-b)^2", map<string, double>{{"a", 2.0}}, vector<string>{"b"},
+                                                     Platform::getPlatformByName("Reference"), map<string, string>{{"Backend", "Native"}});
+    summation->addTerm(vector<double>{0.5});
+    summation->addTerm(vector<double>{-0.25});
+    force.addCustomSummation("sum", summation, vector<string>{"v2"});
+    force.setCustomSummationDeposition(0, 10, vector<string>{"v2+v1"});
+    CustomBondForce* contacts = new CustomBondForce("step(0.5-r)");
+    contacts->addBond(0, 2);
+    contacts->addBond(1, 2);
+    force.addCollectiveVariableBatch(vector<string>{"c1", "c2"}, contacts);
+    force.addSharedCentroid(vector<int>{0, 1, 2, 3}, vector<double>{1.0, 2.0, 3.0, 4.0});
+    force.addSharedParticle(new OutOfPlaneSite(0, 1, 2, 0.5, 0.25, 0.125));
+
+    // Serialize and then deserialize it.
+
+    stringstream buffer;
+    XmlSerializer::serialize<ExtendedCustomCVForce>(&force, "Force", buffer);
+    ExtendedCustomCVForce* copy = XmlSerializer::deserialize<ExtendedCustomCVForce>(buffer);
+
+    // Compare the two forces to see if they are identical.
+
+    ExtendedCustomCVForce& force2 = *copy;
+    ASSERT_EQUAL(force.getForceGroup(), force2.getForceGroup());
+    ASSERT_EQUAL(force.getName(), force2.getName());
+    ASSERT_EQUAL(force.getEnergyFunction(), force2.getEnergyFunction());
+    ASSERT_EQUAL(force.getUseCompressedForces(), force2.getUseCompressedForces());
+    ASSERT_EQUAL(force.getUseDerivativesOnDemand(), force2.getUseDerivativesOnDemand());
+    ASSERT_EQUAL(force.getCollectiveVariableHistorySize(), force2.getCollectiveVariableHistorySize());
+    ASSERT_EQUAL(force.getNumCollectiveVariables(), force2.getNumCollectiveVariables());
+    for (int i = 0; i < force.getNumCollectiveVariables(); i++) {
+        ASSERT_EQUAL(force.getCollectiveVariableName(i), force2.getCollectiveVariableName(i));
+        ASSERT_EQUAL(force.getCollectiveVariableInterval(i), force2.getCollectiveVariableInterval(i));
+        ASSERT_EQUAL(force.getCollectiveVariablePlatform(i), force2.getCollectiveVariablePlatform(i));
+    }
+    ASSERT(dynamic_cast<CustomBondForce*>(&force2.getCollectiveVariable(0)) != NULL);
+    ASSERT_EQUAL(dynamic_cast<CustomBondForce&>(force2.getCollectiveVariable(0)).getEnergyFunction(), "r");
+    ASSERT(dynamic_cast<CustomExternalForce*>(&force2.getCollectiveVariable(1)) != NULL);
+    ASSERT_EQUAL(force.getNumGlobalParameters(), force2.getNumGlobalParameters());
+    for (int i = 0; i < force.getNumGlobalParameters(); i++) {
+        ASSERT_EQUAL(force.getGlobalParameterName(i), force2.getGlobalParameterName(i));
+        ASSERT_EQUAL(force.getGlobalParameterDefaultValue(i), force2.getGlobalParameterDefaultValue(i));
+    }
+    ASSERT_EQUAL(force.getNumEnergyParameterDerivatives(), force2.getNumEnergyParameterDerivatives());
+    for (int i = 0; i < force.getNumEnergyParameterDerivatives(); i++)
+        ASSERT_EQUAL(force.getEnergyParameterDerivativeName(i), force2.getEnergyParameterDerivativeName(i));
+    ASSERT_EQUAL(force.getNumTabulatedFunctions(), force2.getNumTabulatedFunctions());
+    ASSERT_EQUAL(force.getTabulatedFunctionName(0), force2.getTabulatedFunctionName(0));
+    ASSERT(dynamic_cast<const Continuous1DFunction*>(&force2.getTabulatedFunction(0)) != NULL);
+    ASSERT_EQUAL(force.getNumRadialBasisFunctions(), force2.getNumRadialBasisFunctions());
+    string name;
+    ExtendedCustomCVForce::RadialBasisFunctionType type;
+    double shapeParameter;
+    vector<string> variables2;
+    vector<double> centers2, weights2;
+    force2.getRadialBasisFunctionParameters(0, name, type, shapeParameter, variables2, centers2, weights2);
+    ASSERT_EQUAL("rbf", name);
+    ASSERT_EQUAL(ExtendedCustomCVForce::Multiquadric, type);
+    ASSERT_EQUAL(0.7, shapeParameter);
+    ASSERT(variables == variables2);
+    ASSERT(centers == centers2);
+    ASSERT(weights == weights2);
+    ASSERT_EQUAL(force.getNumCustomSummations(), force2.getNumCustomSummations());
+    ASSERT_EQUAL("sum", force2.getCustomSummationName(0));
+    ASSERT(force.getCustomSummationVariables(0) == force2.getCustomSummationVariables(0));
+    ASSERT_EQUAL(10, force2.getCustomSummationDepositionInterval(0));
+    ASSERT(force.getCustomSummationDepositionParameters(0) == force2.getCustomSummationDepositionParameters(0));
+    const CustomSummation& summation2 = force2.getCustomSummation(0);
+    ASSERT_EQUAL(summation->getExpression(), summation2.getExpression());
+    ASSERT(summation->getOverallParameters() == summation2.getOverallParameters());
+    ASSERT_EQUAL(summation->getNumTerms(), summation2.getNumTerms());
+    for (int i = 0; i < summation->getNumTerms(); i++)
+        ASSERT(summation->getTerm(i) == summation2.getTerm(i));
+    ASSERT_EQUAL(force.getNumCollectiveVariableBatches(), force2.getNumCollectiveVariableBatches());
+    ASSERT(force.getCollectiveVariableBatchNames(0) == force2.getCollectiveVariableBatchNames(0));
+    ASSERT(dynamic_cast<CustomBondForce*>(&force2.getCollectiveVariableBatch(0)) != NULL);
+    ASSERT_EQUAL(2, dynamic_cast<CustomBondForce&>(force2.getCollectiveVariableBatch(0)).getNumBonds());
+    ASSERT_EQUAL(force.getNumSharedParticles(), force2.getNumSharedParticles());
+    const LocalCoordinatesSite* centroid = dynamic_cast<const LocalCoordinatesSite*>(&force2.getSharedParticle(0));
+    ASSERT(centroid != NULL);
+    ASSERT_EQUAL(4, centroid->getNumParticles());
+    for (int i = 0; i < 4; i++)
+        ASSERT_EQUAL(i, centroid->getParticle(i));
+    ASSERT(dynamic_cast<const LocalCoordinatesSite&>(force.getSharedParticle(0)).getOriginWeights() == centroid->getOriginWeights());
+    ASSERT(dynamic_cast<const LocalCoordinatesSite&>(force.getSharedParticle(0)).getXWeights() == centroid->getXWeights());
+    ASSERT(dynamic_cast<const LocalCoordinatesSite&>(force.getSharedParticle(0)).getYWeights() == centroid->getYWeights());
+    ASSERT_EQUAL_VEC(Vec3(), centroid->getLocalPosition(), 0.0);
+    const OutOfPlaneSite* outOfPlane = dynamic_cast<const OutOfPlaneSite*>(&force2.getSharedParticle(1));
+    ASSERT(outOfPlane != NULL);
+    ASSERT_EQUAL(2, outOfPlane->getParticle(2));
+    ASSERT_EQUAL(0.5, outOfPlane->getWeight12());
+    ASSERT_EQUAL(0.25, outOfPlane->getWeight13());
+    ASSERT_EQUAL(0.125, outOfPlane->getWeightCross());
+    delete copy;
+}
+
+int main() {
+    try {
+        testSerialization();
+    }
+    catch(const exception& e) {
+        cout << "exception: " << e.what() << endl;
+        return 1;
+    }
+    cout << "Done" << endl;
+    return 0;
+}
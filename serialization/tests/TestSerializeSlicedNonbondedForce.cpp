@@ -12,6 +12,7 @@
 #include "openmm/NonbondedForce.h"
 #include "openmm/internal/AssertionUtilities.h"
 #include "openmm/serialization/XmlSerializer.h"
+#include <cmath>
 #include <iostream>
 #include <sstream>
 
@@ -40,6 +41,7 @@ void testSerialization() {
     double dalpha = 0.8;
     int dnx = 4, dny = 6, dnz = 7;
     force.setLJPMEParameters(dalpha, dnx, dny, dnz);
+    force.setPMEInterpolationOrder(6);
     force.addParticle(1, 0.1, 0.01);
     force.addParticle(0.5, 0.2, 0.02);
     force.addParticle(-0.5, 0.3, 0.03);
@@ -55,6 +57,9 @@ void testSerialization() {
     force.addScalingParameter("lambda", 0, 1, true, true);
     force.addScalingParameter("lambda", 1, 1, false, true);
     force.addScalingParameterDerivative("lambda");
+    force.setSliceSoftCoreParameters(1, 0, 0.5, 2.0);
+    force.addForeignScalingParameterSet({{"lambda", 0.25}});
+    force.addForeignScalingParameterSet({});
 
     // Serialize and then deserialize it.
 
@@ -95,6 +100,7 @@ void testSerialization() {
     ASSERT_EQUAL(dnx, dnx2);
     ASSERT_EQUAL(dny, dny2);
     ASSERT_EQUAL(dnz, dnz2);
+    ASSERT_EQUAL(force.getPMEInterpolationOrder(), force2.getPMEInterpolationOrder());
     for (int i = 0; i < force.getNumGlobalParameters(); i++) {
         ASSERT_EQUAL(force.getGlobalParameterName(i), force2.getGlobalParameterName(i));
         ASSERT_EQUAL(force.getGlobalParameterDefaultValue(i), force2.getGlobalParameterDefaultValue(i));
@@ -166,11 +172,138 @@ void testSerialization() {
     ASSERT_EQUAL(force.getNumScalingParameterDerivatives(), force2.getNumScalingParameterDerivatives());
     for (int i = 0; i < force.getNumScalingParameterDerivatives(); i++)
         ASSERT_EQUAL(force.getScalingParameterDerivativeName(i), force2.getScalingParameterDerivativeName(i))
+    for (int i = 0; i < force.getNumSubsets(); i++)
+        for (int j = 0; j < force.getNumSubsets(); j++) {
+            double alpha1, power1, alpha2, power2;
+            force.getSliceSoftCoreParameters(i, j, alpha1, power1);
+            force2.getSliceSoftCoreParameters(i, j, alpha2, power2);
+            ASSERT_EQUAL(alpha1, alpha2);
+            ASSERT_EQUAL(power1, power2);
+        }
+    ASSERT_EQUAL(force.getNumForeignScalingParameterSets(), force2.getNumForeignScalingParameterSets());
+    for (int i = 0; i < force.getNumForeignScalingParameterSets(); i++)
+        ASSERT(force.getForeignScalingParameterSet(i) == force2.getForeignScalingParameterSet(i));
+}
+
+void testLargeForce() {
+    // Every value must survive the columnar encoding exactly.
+
+    const int numParticles = 1000;
+    SlicedNonbondedForce force(4);
+    force.addGlobalParameter("lambda", 0.5);
+    force.addGlobalParameter("eta", 1.0);
+    for (int i = 0; i < numParticles; i++) {
+        force.addParticle(sin(i*0.37), 0.1+i*1e-4/3.0, 1.0/(i+1.0));
+        force.setParticleSubset(i, i%4);
+        if (i%3 == 0)
+            force.addParticleParameterOffset(i%2 == 0 ? "lambda" : "eta", i, 0.1*i, 0.0, -1.0/3.0);
+    }
+    for (int i = 1; i < numParticles; i++)
+        force.addException(i-1, i, cos(i*0.11), 0.3, 0.2*i);
+    force.addExceptionParameterOffset("eta", 7, 1.0/7.0, 0.5, 0.25);
+    stringstream buffer;
+    XmlSerializer::serialize<SlicedNonbondedForce>(&force, "Force", buffer);
+    SlicedNonbondedForce* copy = XmlSerializer::deserialize<SlicedNonbondedForce>(buffer);
+    ASSERT_EQUAL(force.getNumParticles(), copy->getNumParticles());
+    ASSERT_EQUAL(force.getNumExceptions(), copy->getNumExceptions());
+    ASSERT_EQUAL(force.getNumParticleParameterOffsets(), copy->getNumParticleParameterOffsets());
+    ASSERT_EQUAL(force.getNumExceptionParameterOffsets(), copy->getNumExceptionParameterOffsets());
+    for (int i = 0; i < numParticles; i++) {
+        double charge1, sigma1, epsilon1, charge2, sigma2, epsilon2;
+        force.getParticleParameters(i, charge1, sigma1, epsilon1);
+        copy->getParticleParameters(i, charge2, sigma2, epsilon2);
+        ASSERT_EQUAL(charge1, charge2);
+        ASSERT_EQUAL(sigma1, sigma2);
+        ASSERT_EQUAL(epsilon1, epsilon2);
+        ASSERT_EQUAL(force.getParticleSubset(i), copy->getParticleSubset(i));
+    }
+    for (int i = 0; i < force.getNumExceptions(); i++) {
+        int a1, b1, a2, b2;
+        double charge1, sigma1, epsilon1, charge2, sigma2, epsilon2;
+        force.getExceptionParameters(i, a1, b1, charge1, sigma1, epsilon1);
+        copy->getExceptionParameters(i, a2, b2, charge2, sigma2, epsilon2);
+        ASSERT_EQUAL(a1, a2);
+        ASSERT_EQUAL(b1, b2);
+        ASSERT_EQUAL(charge1, charge2);
+        ASSERT_EQUAL(sigma1, sigma2);
+        ASSERT_EQUAL(epsilon1, epsilon2);
+    }
+    for (int i = 0; i < force.getNumParticleParameterOffsets(); i++) {
+        int index1, index2;
+        string param1, param2;
+        double charge1, sigma1, epsilon1, charge2, sigma2, epsilon2;
+        force.getParticleParameterOffset(i, param1, index1, charge1, sigma1, epsilon1);
+        copy->getParticleParameterOffset(i, param2, index2, charge2, sigma2, epsilon2);
+        ASSERT_EQUAL(param1, param2);
+        ASSERT_EQUAL(index1, index2);
+        ASSERT_EQUAL(charge1, charge2);
+        ASSERT_EQUAL(sigma1, sigma2);
+        ASSERT_EQUAL(epsilon1, epsilon2);
+    }
+    delete copy;
+}
+
+void testVersion1() {
+    // Documents written with one node per entry can still be read.
+
+    string xml =
+        "<?xml version=\"1.0\" ?>\n"
+        "<Force cutoff=\"1\" dispersionCorrection=\"1\" ewaldTolerance=\"0.0005\" exceptionsUsePeriodic=\"0\" forceGroup=\"0\" "
+        "method=\"0\" numSubsets=\"2\" rfDielectric=\"78.3\" type=\"SlicedNonbondedForce\" version=\"1\">\n"
+        "<GlobalParameters><Parameter default=\"0.5\" name=\"lambda\"/></GlobalParameters>\n"
+        "<ParticleOffsets><Offset eps=\"0\" parameter=\"lambda\" particle=\"1\" q=\"0.25\" sig=\"0\"/></ParticleOffsets>\n"
+        "<ExceptionOffsets/>\n"
+        "<Particles><Particle eps=\"0.1\" q=\"1\" sig=\"0.3\"/><Particle eps=\"0.2\" q=\"-1\" sig=\"0.4\"/></Particles>\n"
+        "<Exceptions><Exception eps=\"0\" p1=\"0\" p2=\"1\" q=\"0\" sig=\"1\"/></Exceptions>\n"
+        "<Subsets><Subset index=\"1\" subset=\"1\"/></Subsets>\n"
+        "<scalingParameters><scalingParameter includeCoulomb=\"1\" includeLJ=\"0\" parameter=\"lambda\" subset1=\"0\" subset2=\"1\"/></scalingParameters>\n"
+        "<scalingParameterDerivatives/>\n"
+        "</Force>\n";
+    stringstream buffer(xml);
+    SlicedNonbondedForce* force = XmlSerializer::deserialize<SlicedNonbondedForce>(buffer);
+    ASSERT_EQUAL(2, force->getNumParticles());
+    ASSERT_EQUAL(1, force->getNumExceptions());
+    ASSERT_EQUAL(1, force->getNumParticleParameterOffsets());
+    ASSERT_EQUAL(1, force->getNumScalingParameters());
+    double charge, sigma, epsilon;
+    force->getParticleParameters(1, charge, sigma, epsilon);
+    ASSERT_EQUAL(-1.0, charge);
+    ASSERT_EQUAL(0.4, sigma);
+    ASSERT_EQUAL(0.2, epsilon);
+    ASSERT_EQUAL(0, force->getParticleSubset(0));
+    ASSERT_EQUAL(1, force->getParticleSubset(1));
+    delete force;
+}
+
+void testMalformedColumn() {
+    // A column whose length does not match the count of its node is rejected.
+
+    SlicedNonbondedForce force(2);
+    for (int i = 0; i < 5; i++)
+        force.addParticle(0.1*i, 0.3, 0.2);
+    stringstream buffer;
+    XmlSerializer::serialize<SlicedNonbondedForce>(&force, "Force", buffer);
+    string xml = buffer.str();
+    size_t position = xml.find("<Particles count=\"5\"");
+    ASSERT(position != string::npos);
+    xml.replace(position, 20, "<Particles count=\"4\"");
+    stringstream modified(xml);
+    bool threw = false;
+    try {
+        delete XmlSerializer::deserialize<SlicedNonbondedForce>(modified);
+    }
+    catch (const OpenMMException& e) {
+        threw = true;
+    }
+    ASSERT(threw);
 }
 
 int main() {
     try {
         testSerialization();
+        testLargeForce();
+        testVersion1();
+        testMalformedColumn();
     }
     catch(const exception& e) {
         cout << "exception: " << e.what() << endl;
@@ -0,0 +1,176 @@
+/* -------------------------------------------------------------------------- *
+                             OpenMM Laboratory                              *
+                             =================                              *
+                                                                            *
+ A plugin for testing low-level code implementation for OpenMM.             *
+                                                                            *
+ Copyright (c) 2023 Charlles Abreu                                          *
+ https://github.com/craabreu/openmm-lab                                     *
+ -------------------------------------------------------------------------- */
+
+#include "ContextSnapshot.h"
+#include "ExtendedCustomCVForce.h"
+#include "openmm/internal/AssertionUtilities.h"
+#include "openmm/Context.h"
+#include "openmm/CustomExternalForce.h"
+#include "openmm/System.h"
+#include "openmm/VerletIntegrator.h"
+#include <iostream>
+#include <string>
+#include <vector>
+
+using namespace OpenMMLab;
+using namespace OpenMM;
+using namespace std;
+
+System* createSnapshotSystem(ExtendedCustomCVForce*& cv) {
+    // The first variable is only evaluated every third step.
+
+    System* system = new System();
+    system->addParticle(1.0);
+    system->addParticle(2.0);
+    system->setDefaultPeriodicBoxVectors(Vec3(3, 0, 0), Vec3(0, 3, 0), Vec3(0, 0, 3));
+    cv = new ExtendedCustomCVForce("k*(x+y)");
+    cv->addGlobalParameter("k", 1.0);
+    CustomExternalForce* v1 = new CustomExternalForce("x");
+    v1->addParticle(0);
+    cv->addCollectiveVariable("x", v1);
+    CustomExternalForce* v2 = new CustomExternalForce("y");
+    v2->addParticle(1);
+    cv->addCollectiveVariable("y", v2);
+    cv->setCollectiveVariableInterval(0, 3);
+    system->addForce(cv);
+    return system;
+}
+
+void testSaveAndLoad() {
+    ExtendedCustomCVForce* cv;
+    System* system = createSnapshotSystem(cv);
+    VerletIntegrator integrator(0.1);
+    Context context(*system, integrator, platform);
+    context.setPositions(vector<Vec3>{Vec3(0, 0, 0), Vec3(1, 1, 1)});
+    context.setVelocities(vector<Vec3>{Vec3(1, 1, 0), Vec3(0, 1, 1)});
+    integrator.step(1);
+    context.setParameter("k", 2.0);
+    State saved = context.getState(State::Positions | State::Velocities | State::Energy);
+    string snapshot = ContextSnapshot::saveToString(context);
+
+    // Move on, and then go back to the snapshot.
+
+    integrator.step(3);
+    context.setParameter("k", 3.0);
+    context.setPeriodicBoxVectors(Vec3(4, 0, 0), Vec3(0, 4, 0), Vec3(0, 0, 4));
+    ContextSnapshot::loadFromString(context, snapshot);
+    State loaded = context.getState(State::Positions | State::Velocities | State::Energy);
+    ASSERT_EQUAL(saved.getStepCount(), loaded.getStepCount());
+    ASSERT_EQUAL(saved.getTime(), loaded.getTime());
+    ASSERT_EQUAL(2.0, context.getParameter("k"));
+    Vec3 a, b, c;
+    loaded.getPeriodicBoxVectors(a, b, c);
+    ASSERT_EQUAL_VEC(Vec3(3, 0, 0), a, 0);
+    ASSERT_EQUAL_VEC(Vec3(0, 3, 0), b, 0);
+    ASSERT_EQUAL_VEC(Vec3(0, 0, 3), c, 0);
+    for (int i = 0; i < 2; i++) {
+        ASSERT_EQUAL_VEC(saved.getPositions()[i], loaded.getPositions()[i], 0);
+        ASSERT_EQUAL_VEC(saved.getVelocities()[i], loaded.getVelocities()[i], 0);
+    }
+
+    // Platforms that keep the value of the first variable get it from the snapshot, and
+    // give the same energy as before without evaluating it again.  The others evaluate it
+    // at the loaded positions.
+
+    vector<long long> steps;
+    vector<double> values;
+    vector<vector<double> > derivatives;
+    cv->getCollectiveVariableCacheInContext(context, steps, values, derivatives);
+    cv->resetCountersInContext(context);
+    double energy = context.getState(State::Energy).getPotentialEnergy();
+    if (steps.empty())
+        ASSERT_EQUAL_TOL(2.0*(loaded.getPositions()[0][0]+loaded.getPositions()[1][1]), energy, 1e-5);
+    else {
+        ASSERT_EQUAL(2, steps.size());
+        ASSERT_EQUAL(0, steps[0]);
+        ASSERT_EQUAL_TOL(saved.getPotentialEnergy(), energy, 1e-5);
+        ASSERT_EQUAL(1, cv->getCountersInContext(context)["innerEvaluations"]);
+    }
+    delete system;
+}
+
+void testInvalidSnapshot() {
+    // A snapshot that cannot be read should leave the Context unchanged.
+
+    ExtendedCustomCVForce* cv;
+    System* system = createSnapshotSystem(cv);
+    VerletIntegrator integrator(0.1);
+    Context context(*system, integrator, platform);
+    context.setPositions(vector<Vec3>{Vec3(0, 0, 0), Vec3(1, 1, 1)});
+    string snapshot = ContextSnapshot::saveToString(context);
+    context.setPositions(vector<Vec3>{Vec3(1, 0, 0), Vec3(1, 2, 1)});
+    for (const string& invalid : {snapshot.substr(0, snapshot.size()/2), string("not a snapshot")}) {
+        bool threw = false;
+        try {
+            ContextSnapshot::loadFromString(context, invalid);
+        }
+        catch (const OpenMMException& e) {
+            threw = true;
+        }
+        ASSERT(threw);
+        ASSERT_EQUAL_VEC(Vec3(1, 2, 1), context.getState(State::Positions).getPositions()[1], 0);
+    }
+
+    // A snapshot of a System with a different number of particles should be rejected.
+
+    System other;
+    other.addParticle(1.0);
+    VerletIntegrator otherIntegrator(0.1);
+    Context otherContext(other, otherIntegrator, platform);
+    bool threw = false;
+    try {
+        ContextSnapshot::loadFromString(otherContext, snapshot);
+    }
+    catch (const OpenMMException& e) {
+        threw = true;
+    }
+    ASSERT(threw);
+
+    // So should a snapshot with parameters that the Context does not have, without moving
+    // any particle.
+
+    System renamed;
+    renamed.addParticle(1.0);
+    renamed.addParticle(2.0);
+    CustomExternalForce* external = new CustomExternalForce("c*x");
+    external->addGlobalParameter("c", 1.0);
+    external->addParticle(0);
+    renamed.addForce(external);
+    VerletIntegrator renamedIntegrator(0.1);
+    Context renamedContext(renamed, renamedIntegrator, platform);
+    renamedContext.setPositions(vector<Vec3>{Vec3(1, 0, 0), Vec3(1, 2, 1)});
+    threw = false;
+    try {
+        ContextSnapshot::loadFromString(renamedContext, snapshot);
+    }
+    catch (const OpenMMException& e) {
+        threw = true;
+    }
+    ASSERT(threw);
+    ASSERT_EQUAL_VEC(Vec3(1, 2, 1), renamedContext.getState(State::Positions).getPositions()[1], 0);
+    delete system;
+}
+
+void runPlatformTests();
+
+int main(int argc, char* argv[]) {
+    try {
+        initializeTests(argc, argv);
+        testSaveAndLoad();
+        testInvalidSnapshot();
+        runPlatformTests();
+    }
+    catch(const exception& e) {
+        cout << "exception: " << e.what() << endl;
+        return 1;
+    }
+    cout << "Done" << endl;
+    return 0;
+}
@@ -10,8 +10,12 @@
 
 #include "CustomSummation.h"
 #include "openmm/internal/AssertionUtilities.h"
+#include "sfmt/SFMT.h"
+#include <algorithm>
+#include <cmath>
 #include <iostream>
 #include <string>
+#include <thread>
 
 using namespace OpenMMLab;
 using namespace OpenMM;
@@ -71,6 +75,22 @@ void testSimpleSummation() {
     ASSERT_EQUAL(summation.evaluateDerivative(newArgs, 0), 2*a);
     ASSERT_EQUAL(summation.evaluate(newArgs), (2*(a+b)+c+f+d+g)*x1+e+h);
 
+    vector<double> derivatives;
+    double value = summation.evaluateWithDerivatives(vector<double>{x2, x1, y1, z1}, derivatives);
+    ASSERT_EQUAL(value, 2*a*x2+2*b*x1+(c+f)*y1+(d+g)*z1+e+h);
+    ASSERT_EQUAL(derivatives.size(), 4);
+    ASSERT_EQUAL(derivatives[0], 2*a);
+    ASSERT_EQUAL(derivatives[1], 2*b);
+    ASSERT_EQUAL(derivatives[2], c+f);
+    ASSERT_EQUAL(derivatives[3], d+g);
+
+    double gradient[4];
+    summation.evaluateGradient(args, gradient);
+    ASSERT_EQUAL(gradient[0], 2*a);
+    ASSERT_EQUAL(gradient[1], 2*b);
+    ASSERT_EQUAL(gradient[2], c+f);
+    ASSERT_EQUAL(gradient[3], d+g);
+
     delete[] args;
     delete[] derivOrder;
 }
@@ -109,11 +129,943 @@ void testCloning() {
     delete copy;
 }
 
+void testSharingBetweenClones() {
+    CustomSummation summation(1, "a*c*x1", map<string, double>{{"a", 1.0}}, vector<string>{"c"}, platform, properties);
+    summation.addTerm(vector<double>{2.0});
+    summation.update();
+    const double x = 1.5;
+    ASSERT_EQUAL_TOL(2.0*x, summation.evaluate(vector<double>{x}), 1e-5);
+
+    // The clone shares the evaluator of the original, including its cache.
+
+    CustomSummation *copy = summation.clone();
+    ASSERT_EQUAL_TOL(2.0*x, copy->evaluate(vector<double>{x}), 1e-5);
+    ASSERT_EQUAL(1, copy->getNumCacheHits());
+
+    // Modifying one of them must not affect the other.
+
+    summation.setParameter("a", 3.0);
+    ASSERT_EQUAL_TOL(6.0*x, summation.evaluate(vector<double>{x}), 1e-5);
+    ASSERT_EQUAL_TOL(2.0*x, copy->evaluate(vector<double>{x}), 1e-5);
+    copy->setTerm(0, vector<double>{5.0});
+    copy->update();
+    ASSERT_EQUAL_TOL(5.0*x, copy->evaluate(vector<double>{x}), 1e-5);
+    ASSERT_EQUAL_TOL(6.0*x, summation.evaluate(vector<double>{x}), 1e-5);
+
+    // Pending terms of the original become effective in the clone.
+
+    summation.addTerm(vector<double>{1.0});
+    CustomSummation *other = summation.clone();
+    ASSERT_EQUAL_TOL(9.0*x, other->evaluate(vector<double>{x}), 1e-5);
+    ASSERT_EQUAL_TOL(6.0*x, summation.evaluate(vector<double>{x}), 1e-5);
+    delete copy;
+    ASSERT_EQUAL_TOL(9.0*x, other->evaluate(vector<double>{x}), 1e-5);
+    delete other;
+}
+
+void testAppendingTerms() {
+    CustomSummation summation(1, "1/(c+x1^2)", map<string, double>(), vector<string>{"c"}, platform, properties);
+    const double x = 0.5;
+    double expected = 0.0;
+    for (int i = 0; i < 10; i++) {
+        double c = 1.0 + i;
+        summation.addTerm(vector<double>{c});
+        summation.update();
+        expected += 1/(c+x*x);
+        ASSERT_EQUAL_TOL(expected, summation.evaluate(vector<double>{x}), 1e-5);
+        ASSERT_EQUAL(summation.getNumTerms(), i+1);
+    }
+    summation.setTerm(3, vector<double>{0.5});
+    summation.setTerm(7, vector<double>{0.25});
+    summation.update();
+    expected += 1/(0.5+x*x) - 1/(4.0+x*x) + 1/(0.25+x*x) - 1/(8.0+x*x);
+    ASSERT_EQUAL_TOL(expected, summation.evaluate(vector<double>{x}), 1e-5);
+}
+
+void testCompactSupport() {
+    string expression = "w*step(1-s)*(1-s)^2; s=((x1-cx)^2+(y1-cy)^2)/r^2";
+    vector<string> perTermParameters = {"w", "cx", "cy", "r"};
+    CustomSummation summation(2, expression, map<string, double>(), perTermParameters, platform, properties);
+    map<string, string> nativeProperties = {{"Backend", "Native"}};
+    CustomSummation native(2, expression, map<string, double>(), perTermParameters, platform, nativeProperties);
+    native.setCompactSupport(vector<string>{"cx", "cy"}, "r");
+    OpenMM_SFMT::SFMT sfmt;
+    init_gen_rand(0, sfmt);
+    for (int i = 0; i < 200; i++) {
+        vector<double> parameters = {genrand_real2(sfmt), 10*genrand_real2(sfmt), 10*genrand_real2(sfmt), 0.2+genrand_real2(sfmt)};
+        summation.addTerm(parameters);
+        native.addTerm(parameters);
+    }
+    summation.update();
+    native.update();
+    for (int i = 0; i < 20; i++) {
+        vector<double> args = {10*genrand_real2(sfmt), 10*genrand_real2(sfmt)};
+        ASSERT_EQUAL_TOL(summation.evaluate(args), native.evaluate(args), 1e-5);
+        ASSERT_EQUAL_TOL(summation.evaluateDerivative(args, 0), native.evaluateDerivative(args, 0), 1e-5);
+        ASSERT_EQUAL_TOL(summation.evaluateDerivative(args, 1), native.evaluateDerivative(args, 1), 1e-5);
+    }
+}
+
+void testCompactSupportInManyDimensions() {
+    // Terms are appended in small batches, so that most of them are inserted into an
+    // existing tree, and some are then modified, which forces it to be rebuilt.
+
+    string expression = "w*step(1-s)*(1-s)^2; s=((x1-c1)^2+(y1-c2)^2+(z1-c3)^2+(x2-c4)^2+(y2-c5)^2)/r^2";
+    vector<string> perTermParameters = {"w", "c1", "c2", "c3", "c4", "c5", "r"};
+    vector<string> centers = {"c1", "c2", "c3", "c4", "c5"};
+    CustomSummation summation(5, expression, map<string, double>(), perTermParameters, platform, properties);
+    map<string, string> nativeProperties = {{"Backend", "Native"}};
+    CustomSummation native(5, expression, map<string, double>(), perTermParameters, platform, nativeProperties);
+    native.setCompactSupport(centers, "r");
+    OpenMM_SFMT::SFMT sfmt;
+    init_gen_rand(0, sfmt);
+    auto randomTerm = [&] () {
+        vector<double> parameters = {genrand_real2(sfmt)};
+        for (int i = 0; i < 5; i++)
+            parameters.push_back(4*genrand_real2(sfmt));
+        parameters.push_back(1.0+genrand_real2(sfmt));
+        return parameters;
+    };
+    auto compare = [&] () {
+        for (int i = 0; i < 10; i++) {
+            vector<double> args(5);
+            for (int j = 0; j < 5; j++)
+                args[j] = 4*genrand_real2(sfmt);
+            ASSERT_EQUAL_TOL(summation.evaluate(args), native.evaluate(args), 1e-5);
+            for (int j = 0; j < 5; j++)
+                ASSERT_EQUAL_TOL(summation.evaluateDerivative(args, j), native.evaluateDerivative(args, j), 1e-5);
+        }
+    };
+    for (int batch = 0; batch < 10; batch++) {
+        for (int i = 0; i < 30; i++) {
+            vector<double> parameters = randomTerm();
+            summation.addTerm(parameters);
+            native.addTerm(parameters);
+        }
+        summation.update();
+        native.update();
+        compare();
+    }
+    for (int term = 0; term < 300; term += 7) {
+        vector<double> parameters = randomTerm();
+        summation.setTerm(term, parameters);
+        native.setTerm(term, parameters);
+    }
+    summation.update();
+    native.update();
+    compare();
+}
+
+void testGaussianSupport() {
+    string expression = "h*exp(-((x1-cx)^2+(y1-cy)^2)/(2*w^2))";
+    vector<string> perTermParameters = {"h", "cx", "cy", "w"};
+    CustomSummation summation(2, expression, map<string, double>(), perTermParameters, platform, properties);
+    map<string, string> nativeProperties = {{"Backend", "Native"}};
+    CustomSummation native(2, expression, map<string, double>(), perTermParameters, platform, nativeProperties);
+    double tolerance = 1e-4;
+    native.setGaussianSupport(vector<string>{"cx", "cy"}, "w", "h", tolerance);
+    OpenMM_SFMT::SFMT sfmt;
+    init_gen_rand(0, sfmt);
+    for (int i = 0; i < 500; i++) {
+        vector<double> parameters = {genrand_real2(sfmt), 10*genrand_real2(sfmt), 10*genrand_real2(sfmt), 0.1+0.2*genrand_real2(sfmt)};
+        summation.addTerm(parameters);
+        native.addTerm(parameters);
+    }
+    summation.update();
+    native.update();
+    for (int i = 0; i < 20; i++) {
+        vector<double> args = {10*genrand_real2(sfmt), 10*genrand_real2(sfmt)};
+        ASSERT_EQUAL_TOL(summation.evaluate(args), native.evaluate(args), 2*tolerance);
+    }
+    vector<string> centers;
+    string width, height;
+    double storedTolerance;
+    ASSERT(native.getGaussianSupport(centers, width, height, storedTolerance));
+    ASSERT_EQUAL("w", width);
+    ASSERT_EQUAL("h", height);
+    ASSERT_EQUAL(tolerance, storedTolerance);
+}
+
+void testGrid() {
+    string expression = "s*h*exp(-((x1-cx)^2+(y1-cy)^2)/(2*w^2))";
+    map<string, double> overallParameters = {{"s", 1.0}};
+    vector<string> perTermParameters = {"h", "cx", "cy", "w"};
+    map<string, string> nativeProperties = {{"Backend", "Native"}};
+    CustomSummation exact(2, expression, overallParameters, perTermParameters, platform, nativeProperties);
+    CustomSummation gridded(2, expression, overallParameters, perTermParameters, platform, nativeProperties);
+    gridded.setGrid(vector<double>{0.0, 0.0}, vector<double>{4.0, 4.0}, vector<int>{161, 161});
+    OpenMM_SFMT::SFMT sfmt;
+    init_gen_rand(0, sfmt);
+    auto addTerms = [&] (int numTerms) {
+        for (int i = 0; i < numTerms; i++) {
+            vector<double> parameters = {genrand_real2(sfmt), 4*genrand_real2(sfmt), 4*genrand_real2(sfmt), 0.5+0.5*genrand_real2(sfmt)};
+            exact.addTerm(parameters);
+            gridded.addTerm(parameters);
+        }
+        exact.update();
+        gridded.update();
+    };
+    auto compare = [&] () {
+        for (int i = 0; i < 20; i++) {
+            vector<double> args = {5*genrand_real2(sfmt)-0.5, 5*genrand_real2(sfmt)-0.5};
+            vector<double> exactGradient, griddedGradient;
+            double exactValue = exact.evaluateWithDerivatives(args, exactGradient);
+            double griddedValue = gridded.evaluateWithDerivatives(args, griddedGradient);
+            ASSERT_EQUAL_TOL(exactValue, griddedValue, 1e-4);
+            ASSERT_EQUAL_TOL(exactGradient[0], griddedGradient[0], 1e-3);
+            ASSERT_EQUAL_TOL(exactGradient[1], griddedGradient[1], 1e-3);
+        }
+    };
+
+    // Terms added and modified after the grid is set must be added to it incrementally.
+
+    addTerms(50);
+    compare();
+    addTerms(50);
+    vector<double> parameters = {2.0, 1.0, 3.0, 0.7};
+    exact.setTerm(10, parameters);
+    gridded.setTerm(10, parameters);
+    exact.update();
+    gridded.update();
+    compare();
+
+    // Changing an overall parameter must refill the grid.
+
+    exact.setParameter("s", 2.5);
+    gridded.setParameter("s", 2.5);
+    compare();
+    vector<double> minValues, maxValues;
+    vector<int> numPoints;
+    ASSERT(gridded.getGrid(minValues, maxValues, numPoints));
+    ASSERT(numPoints == vector<int>({161, 161}));
+}
+
+void testRemovingTerms() {
+    CustomSummation summation(1, "1/(c+x1^2)", map<string, double>(), vector<string>{"c"}, platform, properties);
+    const double x = 0.5;
+    for (int i = 0; i < 10; i++)
+        summation.addTerm(vector<double>{1.0 + i});
+    summation.update();
+    summation.evaluate(vector<double>{x});
+
+    // Removing a term moves the last one into its place.
+
+    summation.removeTerm(3);
+    ASSERT_EQUAL(9, summation.getNumTerms());
+    ASSERT_EQUAL(10.0, summation.getTerm(3)[0]);
+    summation.removeTerms(vector<int>{0, 8, 5});
+    ASSERT_EQUAL(6, summation.getNumTerms());
+    summation.update();
+    double expected = 0.0;
+    for (int c : {2, 3, 5, 7, 8, 10})
+        expected += 1/(c+x*x);
+    ASSERT_EQUAL_TOL(expected, summation.evaluate(vector<double>{x}), 1e-5);
+
+    // An invalid index leaves all terms in place.
+
+    bool threw = false;
+    try {
+        summation.removeTerms(vector<int>{1, -1});
+    }
+    catch (const OpenMMException& e) {
+        threw = true;
+    }
+    ASSERT(threw);
+    ASSERT_EQUAL(6, summation.getNumTerms());
+    ASSERT_EQUAL(2.0, summation.getTerm(1)[0]);
+
+    // Terms added afterward are appended to the remaining ones.
+
+    summation.addTerm(vector<double>{0.5});
+    summation.update();
+    expected += 1/(0.5+x*x);
+    ASSERT_EQUAL_TOL(expected, summation.evaluate(vector<double>{x}), 1e-5);
+}
+
+void testSettingAllTerms() {
+    CustomSummation summation(1, "c*x1^2+d", map<string, double>(), vector<string>{"c", "d"}, platform, properties);
+    vector<double> parameters;
+    for (int i = 0; i < 20; i++) {
+        parameters.push_back(1.0 + i);
+        parameters.push_back(0.5*i);
+    }
+    summation.setTerms(parameters.data(), 20);
+    summation.update();
+    ASSERT_EQUAL(summation.getNumTerms(), 20);
+    ASSERT_EQUAL(summation.getTerm(7)[1], 3.5);
+    const double x = 0.7;
+    ASSERT_EQUAL_TOL(210.0*x*x+95.0, summation.evaluate(vector<double>{x}), 1e-5);
+
+    // Replacing the terms with fewer ones must remove the others.
+
+    summation.setTerms(parameters.data(), 5);
+    summation.update();
+    ASSERT_EQUAL(summation.getNumTerms(), 5);
+    ASSERT_EQUAL_TOL(15.0*x*x+5.0, summation.evaluate(vector<double>{x}), 1e-5);
+}
+
+void testArgumentCache() {
+    CustomSummation summation(1, "c*x1^2", map<string, double>(), vector<string>{"c"}, platform, properties);
+    summation.addTerm(vector<double>{1.0});
+    summation.update();
+    summation.setCacheSize(3);
+    ASSERT_EQUAL(summation.getCacheSize(), 3);
+    for (int i = 0; i < 3; i++) {
+        double x = i;
+        ASSERT_EQUAL_TOL(x*x, summation.evaluate(vector<double>{x}), 1e-5);
+    }
+    ASSERT_EQUAL(summation.getNumCacheMisses(), 3);
+    ASSERT_EQUAL(summation.getNumCacheHits(), 0);
+    for (int i = 2; i >= 0; i--) {
+        double x = i;
+        ASSERT_EQUAL_TOL(x*x, summation.evaluate(vector<double>{x}), 1e-5);
+        ASSERT_EQUAL_TOL(2*x, summation.evaluateDerivative(vector<double>{x}, 0), 1e-5);
+    }
+    ASSERT_EQUAL(summation.getNumCacheMisses(), 6);
+    ASSERT_EQUAL(summation.getNumCacheHits(), 3);
+    summation.evaluate(vector<double>{3.0});
+    summation.evaluate(vector<double>{2.0});
+    ASSERT_EQUAL(summation.getNumCacheMisses(), 8);
+    summation.evaluate(vector<double>{0.0});
+    ASSERT_EQUAL(summation.getNumCacheHits(), 4);
+    summation.setTerm(0, vector<double>{2.0});
+    summation.update();
+    ASSERT_EQUAL_TOL(2.0, summation.evaluate(vector<double>{1.0}), 1e-5);
+    ASSERT_EQUAL(summation.getNumCacheMisses(), 9);
+
+    // Arguments that were cached before the update must be recomputed.
+
+    double x = 2.0;
+    ASSERT_EQUAL_TOL(8.0, summation.evaluate(&x), 1e-5);
+    ASSERT_EQUAL(summation.getNumCacheMisses(), 10);
+}
+
+void testConcurrentEvaluation() {
+    const int numThreads = 4, numEvaluations = 20;
+    CustomSummation summation(2, "a*(x1-c)^2+y1", map<string, double>{{"a", 2.0}}, vector<string>{"c"}, platform, properties);
+    summation.addTerm(vector<double>{1.0});
+    summation.addTerm(vector<double>{-1.0});
+    summation.update();
+    vector<double> errors(numThreads, 0.0);
+    vector<thread> threads;
+    for (int t = 0; t < numThreads; t++)
+        threads.push_back(thread([&summation, &errors, t] () {
+            for (int i = 0; i < numEvaluations; i++) {
+                double x = 0.1*t + 0.01*i, y = -0.2*t;
+                vector<double> args = {x, y};
+                double value = summation.evaluate(args);
+                double derivative = summation.evaluateDerivative(args, 0);
+                double expectedValue = 2.0*((x-1)*(x-1)+(x+1)*(x+1)) + 2*y;
+                double expectedDerivative = 8.0*x;
+                errors[t] = max(errors[t], fabs(value-expectedValue)/max(fabs(expectedValue), 1.0));
+                errors[t] = max(errors[t], fabs(derivative-expectedDerivative)/max(fabs(expectedDerivative), 1.0));
+            }
+        }));
+    for (thread& t : threads)
+        t.join();
+    for (int t = 0; t < numThreads; t++)
+        ASSERT(errors[t] < 1e-5);
+}
+
+void testBatchEvaluation() {
+    const int numArgs = 4, numPoints = 5;
+    CustomSummation summation(
+        numArgs,
+        "a*exp(-((x1-c)^2+(y1-c)^2+(z1-c)^2)) + b*x2^2",
+        map<string, double>{{"a", 1.5}, {"b", 0.5}},
+        vector<string>{"c"},
+        platform,
+        properties
+    );
+    summation.addTerm(vector<double>{0.0});
+    summation.addTerm(vector<double>{1.0});
+    summation.update();
+    vector<double> args(numPoints*numArgs), values(numPoints), gradients(numPoints*numArgs);
+    for (int i = 0; i < numPoints*numArgs; i++)
+        args[i] = 0.1*i - 0.5;
+    for (int step = 0; step < 3; step++) {
+        if (step == 1) {
+            summation.addTerm(vector<double>{-1.0});
+            summation.update();
+        }
+        else if (step == 2) {
+            summation.setTerm(0, vector<double>{2.0});
+            summation.update();
+            summation.setParameter("a", 2.5);
+        }
+        summation.evaluateBatch(args.data(), numPoints, values.data(), gradients.data());
+        for (int k = 0; k < numPoints; k++) {
+            vector<double> point(args.begin() + k*numArgs, args.begin() + (k+1)*numArgs);
+            ASSERT_EQUAL_TOL(summation.evaluate(point), values[k], 1e-5);
+            for (int i = 0; i < numArgs; i++)
+                ASSERT_EQUAL_TOL(summation.evaluateDerivative(point, i), gradients[k*numArgs+i], 1e-5);
+        }
+    }
+    vector<double> valuesOnly(numPoints);
+    summation.evaluateBatch(args.data(), numPoints-2, valuesOnly.data());
+    for (int k = 0; k < numPoints-2; k++)
+        ASSERT_EQUAL_TOL(values[k], valuesOnly[k], 1e-5);
+}
+
+void testPipelinedBatches() {
+    const int numArgs = 2, numPoints = 6, numBatches = 4;
+    CustomSummation summation(
+        numArgs,
+        "a*exp(-(x1-c)^2) + x2^2",
+        map<string, double>{{"a", 1.5}},
+        vector<string>{"c"},
+        platform,
+        properties
+    );
+    summation.addTerm(vector<double>{0.0});
+    summation.addTerm(vector<double>{1.0});
+    summation.update();
+
+    // Submit every batch from the same array, which is overwritten right after each
+    // submission, and then collect them in order.
+
+    vector<double> args(numPoints*numArgs);
+    vector<vector<double>> allArgs;
+    for (int batch = 0; batch < numBatches; batch++) {
+        for (int i = 0; i < numPoints*numArgs; i++)
+            args[i] = 0.1*i - 0.3*batch;
+        allArgs.push_back(args);
+        summation.submitBatch(args.data(), numPoints, batch%2 == 0);
+    }
+    ASSERT_EQUAL(numBatches, summation.getNumPendingBatches());
+    vector<double> values(numPoints), gradients(numPoints*numArgs), expectedValues(numPoints), expectedGradients(numPoints*numArgs);
+    for (int batch = 0; batch < numBatches; batch++) {
+        ASSERT_EQUAL(numPoints, summation.getPendingBatchSize());
+        bool withGradients = (batch%2 == 0);
+        ASSERT_EQUAL(numPoints, summation.collectBatch(values.data(), withGradients ? gradients.data() : NULL));
+        summation.evaluateBatch(allArgs[batch].data(), numPoints, expectedValues.data(), expectedGradients.data());
+        for (int k = 0; k < numPoints; k++)
+            ASSERT_EQUAL_TOL(expectedValues[k], values[k], 1e-6);
+        if (withGradients)
+            for (int i = 0; i < numPoints*numArgs; i++)
+                ASSERT_EQUAL_TOL(expectedGradients[i], gradients[i], 1e-6);
+    }
+    ASSERT_EQUAL(0, summation.getNumPendingBatches());
+
+    // A synchronous evaluation waits for the pending batches, whose results are kept.
+
+    summation.submitBatch(args.data(), numPoints);
+    double value = summation.evaluate(vector<double>(args.begin(), args.begin()+numArgs));
+    ASSERT_EQUAL(1, summation.getNumPendingBatches());
+    summation.collectBatch(values.data(), gradients.data());
+    ASSERT_EQUAL_TOL(value, values[0], 1e-6);
+
+    // Collecting with no pending batch, or asking for gradients that were not computed,
+    // is an error.
+
+    bool threw = false;
+    try {
+        summation.collectBatch(values.data());
+    }
+    catch (OpenMMException& ex) {
+        threw = true;
+    }
+    ASSERT(threw);
+    summation.submitBatch(args.data(), numPoints, false);
+    threw = false;
+    try {
+        summation.collectBatch(values.data(), gradients.data());
+    }
+    catch (OpenMMException& ex) {
+        threw = true;
+    }
+    ASSERT(threw);
+    ASSERT_EQUAL(0, summation.getNumPendingBatches());
+}
+
+void testNativeBackend() {
+    const int numArgs = 12;
+    string expression = "a*distance(p1, p2) + b*angle(p1,p2,p3) + c*dihedral(p1,p2,p3,p4)"
+                        " + pointdistance(x1, y1, z1, (x2+x3)/2, (y2+y3)/2, (z2+z3)/2)^2";
+    map<string, double> overallParameters = {{"a", 1.5}};
+    vector<string> perTermParameters = {"b", "c"};
+    CustomSummation summation(numArgs, expression, overallParameters, perTermParameters, platform, properties);
+    map<string, string> nativeProperties = {{"Backend", "Native"}};
+    CustomSummation native(numArgs, expression, overallParameters, perTermParameters, platform, nativeProperties);
+    ASSERT_EQUAL(native.getPlatformProperties().at("Backend"), "Native");
+    nativeProperties["Precision"] = "single";
+    CustomSummation vectorized(numArgs, expression, overallParameters, perTermParameters, platform, nativeProperties);
+    for (CustomSummation* function : {&summation, &native, &vectorized}) {
+        function->addTerm(vector<double>{1.0, 2.0});
+        function->addTerm(vector<double>{-0.5, 3.0});
+        for (int i = 0; i < 9; i++)
+            function->addTerm(vector<double>{0.1*i, -0.2*i});
+        function->update();
+    }
+    vector<double> args = {0.1, 0.2, -0.3, 1.2, 0.1, 0.0, 1.5, 1.1, 0.2, 2.1, 1.3, 1.4};
+    for (int step = 0; step < 2; step++) {
+        if (step == 1)
+            for (CustomSummation* function : {&summation, &native, &vectorized}) {
+                function->setTerm(1, vector<double>{0.7, -1.0});
+                function->update();
+                function->setParameter("a", 2.0);
+            }
+        vector<double> derivatives;
+        double value = native.evaluateWithDerivatives(args, derivatives);
+        ASSERT_EQUAL_TOL(summation.evaluate(args), value, 1e-5);
+        ASSERT_EQUAL_TOL(value, native.evaluate(args), 1e-10);
+        ASSERT_EQUAL_TOL(value, vectorized.evaluate(args), 1e-4);
+        for (int i = 0; i < numArgs; i++) {
+            ASSERT_EQUAL_TOL(summation.evaluateDerivative(args, i), derivatives[i], 1e-5);
+            ASSERT_EQUAL_TOL(derivatives[i], native.evaluateDerivative(args, i), 1e-10);
+            ASSERT_EQUAL_TOL(derivatives[i], vectorized.evaluateDerivative(args, i), 1e-4);
+        }
+    }
+}
+
+void testSharedGeometry() {
+    // The distance and the dihedral are the same for all terms, and the native backend
+    // evaluates them only once per point. The distance appears twice in each term.
+
+    const int numArgs = 12;
+    string expression = "w*exp(-(distance(p1,p2)-r0)^2/(2*s^2)) + k*(1+cos(n*dihedral(p1,p2,p3,p4)-phase))"
+                        " + e*distance(p1,p2)";
+    map<string, double> overallParameters = {{"e", 0.3}};
+    vector<string> perTermParameters = {"w", "r0", "s", "k", "n", "phase"};
+    CustomSummation summation(numArgs, expression, overallParameters, perTermParameters, platform, properties);
+    map<string, string> nativeProperties = {{"Backend", "Native"}};
+    CustomSummation native(numArgs, expression, overallParameters, perTermParameters, platform, nativeProperties);
+    nativeProperties["Precision"] = "single";
+    CustomSummation vectorized(numArgs, expression, overallParameters, perTermParameters, platform, nativeProperties);
+    for (CustomSummation* function : {&summation, &native, &vectorized}) {
+        for (int i = 0; i < 20; i++)
+            function->addTerm(vector<double>{0.5+0.1*i, 0.8+0.05*i, 0.2+0.01*i, 0.1*i, (double) (1+i%3), 0.2*i});
+        function->update();
+    }
+    vector<double> args = {0.1, 0.2, -0.3, 1.2, 0.1, 0.0, 1.5, 1.1, 0.2, 2.1, 1.3, 1.4};
+    vector<double> derivatives;
+    double value = native.evaluateWithDerivatives(args, derivatives);
+    ASSERT_EQUAL_TOL(summation.evaluate(args), value, 1e-5);
+    ASSERT_EQUAL_TOL(value, vectorized.evaluate(args), 1e-4);
+    for (int i = 0; i < numArgs; i++) {
+        ASSERT_EQUAL_TOL(summation.evaluateDerivative(args, i), derivatives[i], 1e-5);
+        ASSERT_EQUAL_TOL(derivatives[i], vectorized.evaluateDerivative(args, i), 1e-4);
+    }
+}
+
+void testParameterInvariants() {
+    // The factors that only depend on sigma and a are the same for all terms, and must be
+    // recomputed when these parameters change.
+
+    const int numArgs = 2;
+    string expression = "h*exp(-((x1-cx)^2+(y1-cy)^2)/(2*sigma^2)) + a*sqrt(sigma)*cx";
+    map<string, double> overallParameters = {{"sigma", 0.5}, {"a", 1.0}};
+    vector<string> perTermParameters = {"h", "cx", "cy"};
+    map<string, string> nativeProperties = {{"Backend", "Native"}};
+    CustomSummation reference(numArgs, expression, overallParameters, perTermParameters, platform, properties);
+    vector<CustomSummation*> summations;
+    summations.push_back(new CustomSummation(numArgs, expression, overallParameters, perTermParameters, platform, nativeProperties));
+    if (platform.supportsKernels(vector<string>{"CalcCustomSummation"})) {
+        map<string, string> kernelProperties = properties;
+        kernelProperties["Backend"] = "Kernel";
+        summations.push_back(new CustomSummation(numArgs, expression, overallParameters, perTermParameters, platform, kernelProperties));
+    }
+    summations.push_back(&reference);
+    for (CustomSummation* function : summations) {
+        for (int i = 0; i < 10; i++)
+            function->addTerm(vector<double>{0.1*(i+1), 0.2*i, -0.1*i});
+        function->update();
+    }
+    vector<double> args = {0.3, -0.4};
+    for (int step = 0; step < 2; step++) {
+        if (step == 1)
+            for (CustomSummation* function : summations) {
+                function->setParameter("sigma", 0.8);
+                function->setParameter("a", -2.0);
+            }
+        for (CustomSummation* function : summations) {
+            ASSERT_EQUAL_TOL(reference.evaluate(args), function->evaluate(args), 1e-5);
+            for (int i = 0; i < numArgs; i++)
+                ASSERT_EQUAL_TOL(reference.evaluateDerivative(args, i), function->evaluateDerivative(args, i), 1e-5);
+        }
+    }
+    summations.pop_back();
+    for (CustomSummation* function : summations)
+        delete function;
+}
+
+void testKernelBackend() {
+    if (!platform.supportsKernels(vector<string>{"CalcCustomSummation"}))
+        return;
+    const int numArgs = 6;
+    string expression = "a*pointdistance(x1, y1, z1, x2, y2, z2) + b*exp(-c*(x1^2+y2^2))";
+    map<string, double> overallParameters = {{"a", 1.5}};
+    vector<string> perTermParameters = {"b", "c"};
+    map<string, string> kernelProperties = properties;
+    kernelProperties["Backend"] = "Kernel";
+    CustomSummation summation(numArgs, expression, overallParameters, perTermParameters, platform, kernelProperties);
+    map<string, string> nativeProperties = {{"Backend", "Native"}};
+    CustomSummation native(numArgs, expression, overallParameters, perTermParameters, platform, nativeProperties);
+    OpenMM_SFMT::SFMT sfmt;
+    init_gen_rand(0, sfmt);
+    vector<double> args = {0.1, 0.2, -0.3, 1.2, 0.1, 0.0};
+    for (int step = 0; step < 3; step++) {
+        // Terms are appended in every step, so that the array of parameters grows, and
+        // one of the existing terms is modified.
+
+        for (int i = 0; i < 300; i++) {
+            vector<double> parameters = {genrand_real2(sfmt), genrand_real2(sfmt)};
+            summation.addTerm(parameters);
+            native.addTerm(parameters);
+        }
+        summation.setTerm(step, vector<double>{0.7, -1.0});
+        native.setTerm(step, vector<double>{0.7, -1.0});
+        summation.setParameter("a", 1.0+step);
+        native.setParameter("a", 1.0+step);
+        summation.update();
+        native.update();
+        vector<double> derivatives;
+        double value = native.evaluateWithDerivatives(args, derivatives);
+        ASSERT_EQUAL_TOL(value, summation.evaluate(args), 1e-5);
+        for (int i = 0; i < numArgs; i++)
+            ASSERT_EQUAL_TOL(derivatives[i], summation.evaluateDerivative(args, i), 1e-5);
+    }
+
+    // Evaluate several points at once.
+
+    const int numPoints = 5;
+    vector<double> points(numPoints*numArgs);
+    for (double& x : points)
+        x = genrand_real2(sfmt);
+    vector<double> values(numPoints), gradients(numPoints*numArgs);
+    summation.evaluateBatch(points.data(), numPoints, values.data(), gradients.data());
+    for (int k = 0; k < numPoints; k++) {
+        vector<double> point(points.begin()+k*numArgs, points.begin()+(k+1)*numArgs);
+        vector<double> derivatives;
+        ASSERT_EQUAL_TOL(native.evaluateWithDerivatives(point, derivatives), values[k], 1e-5);
+        for (int i = 0; i < numArgs; i++)
+            ASSERT_EQUAL_TOL(derivatives[i], gradients[k*numArgs+i], 1e-5);
+    }
+
+    // Sums in fixed point do not depend on the order of the terms, while floating point
+    // sums are only close to them.
+
+    CustomSummation reversed(numArgs, expression, overallParameters, perTermParameters, platform, kernelProperties);
+    kernelProperties["Deterministic"] = "false";
+    CustomSummation nondeterministic(numArgs, expression, overallParameters, perTermParameters, platform, kernelProperties);
+    for (int term = summation.getNumTerms()-1; term >= 0; term--) {
+        reversed.addTerm(summation.getTerm(term));
+        nondeterministic.addTerm(summation.getTerm(term));
+    }
+    for (CustomSummation* function : {&reversed, &nondeterministic}) {
+        function->setParameter("a", summation.getParameter("a"));
+        function->update();
+    }
+    vector<double> derivatives, reversedDerivatives, nondeterministicDerivatives;
+    double value = summation.evaluateWithDerivatives(args, derivatives);
+    ASSERT_EQUAL(value, reversed.evaluateWithDerivatives(args, reversedDerivatives));
+    ASSERT_EQUAL_TOL(value, nondeterministic.evaluateWithDerivatives(args, nondeterministicDerivatives), 1e-5);
+    for (int i = 0; i < numArgs; i++) {
+        ASSERT_EQUAL(derivatives[i], reversedDerivatives[i]);
+        ASSERT_EQUAL_TOL(derivatives[i], nondeterministicDerivatives[i], 1e-5);
+    }
+}
+
+void testAutoBackend() {
+    // The summation grows past the size at which the backends are first timed and is
+    // timed again when its size doubles. Removing most of the terms takes it back to the
+    // native backend. It must agree with the native backend all along.
+
+    const int numArgs = 6;
+    string expression = "a*pointdistance(x1, y1, z1, x2, y2, z2) + b*exp(-c*(x1^2+y2^2))";
+    map<string, double> overallParameters = {{"a", 1.5}};
+    vector<string> perTermParameters = {"b", "c"};
+    map<string, string> autoProperties = properties;
+    autoProperties["Backend"] = "Auto";
+    CustomSummation summation(numArgs, expression, overallParameters, perTermParameters, platform, autoProperties);
+    map<string, string> nativeProperties = {{"Backend", "Native"}};
+    CustomSummation native(numArgs, expression, overallParameters, perTermParameters, platform, nativeProperties);
+    OpenMM_SFMT::SFMT sfmt;
+    init_gen_rand(0, sfmt);
+    vector<double> args = {0.1, 0.2, -0.3, 1.2, 0.1, 0.0};
+    for (int step = 0; step < 5; step++) {
+        if (step < 4)
+            for (int i = 0; i < 600; i++) {
+                vector<double> parameters = {genrand_real2(sfmt), genrand_real2(sfmt)};
+                summation.addTerm(parameters);
+                native.addTerm(parameters);
+            }
+        else {
+            vector<int> terms;
+            for (int i = 100; i < summation.getNumTerms(); i++)
+                terms.push_back(i);
+            summation.removeTerms(terms);
+            native.removeTerms(terms);
+        }
+        summation.setTerm(step, vector<double>{0.7, -1.0});
+        native.setTerm(step, vector<double>{0.7, -1.0});
+        summation.setParameter("a", 1.0+step);
+        native.setParameter("a", 1.0+step);
+        summation.update();
+        native.update();
+        vector<double> derivatives;
+        double value = native.evaluateWithDerivatives(args, derivatives);
+        ASSERT_EQUAL_TOL(value, summation.evaluate(args), 1e-5);
+        for (int i = 0; i < numArgs; i++)
+            ASSERT_EQUAL_TOL(derivatives[i], summation.evaluateDerivative(args, i), 1e-5);
+    }
+}
+
+void testTermPoints() {
+    // Every term is a harmonic bond between two of the five argument points. Points that
+    // belong to no term must have zero derivatives.
+
+    const int numArgs = 15;
+    string expression = "k*(distance(p1,p2)-r0)^2";
+    vector<string> perTermParameters = {"k", "r0"};
+    CustomSummation summation(numArgs, expression, map<string, double>(), perTermParameters, platform, properties);
+    map<string, string> nativeProperties = {{"Backend", "Native"}};
+    CustomSummation native(numArgs, expression, map<string, double>(), perTermParameters, platform, nativeProperties);
+    vector<vector<int>> bonds = {{0, 1}, {1, 2}, {3, 0}};
+    vector<vector<double>> parameters = {{1.0, 0.5}, {2.0, 1.0}, {0.5, 1.5}};
+    for (CustomSummation* function : {&summation, &native}) {
+        function->setPointsPerTerm(2);
+        ASSERT_EQUAL(2, function->getPointsPerTerm());
+
+        // A term must come with its points, which must exist.
+
+        bool threw = false;
+        try {
+            function->addTerm(vector<double>{1.0, 1.0}, vector<int>{0, 5});
+        }
+        catch (OpenMMException& ex) {
+            threw = true;
+        }
+        ASSERT(threw);
+        for (int i = 0; i < bonds.size(); i++)
+            function->addTerm(parameters[i], bonds[i]);
+        function->update();
+    }
+    ASSERT_EQUAL(3, summation.getTermPoints(2)[0]);
+    vector<double> args = {0.1, 0.2, -0.3, 1.2, 0.1, 0.0, 1.5, 1.1, 0.2, 2.1, 1.3, 1.4, 0.7, -0.6, 0.9};
+    for (int step = 0; step < 3; step++) {
+        if (step == 1) {
+            // A term is moved to other points.
+
+            bonds[1] = {2, 3};
+            parameters[1] = {1.5, 0.8};
+            summation.setTerm(1, parameters[1], bonds[1]);
+            native.setTerm(1, parameters[1], bonds[1]);
+        }
+        else if (step == 2) {
+            // Removing a term moves the last one into its place.
+
+            bonds[0] = bonds[2];
+            parameters[0] = parameters[2];
+            bonds.pop_back();
+            parameters.pop_back();
+            summation.removeTerm(0);
+            native.removeTerm(0);
+        }
+        summation.update();
+        native.update();
+        double expected = 0.0;
+        vector<double> expectedDerivatives(numArgs, 0.0);
+        for (int i = 0; i < bonds.size(); i++) {
+            double delta[3], r = 0.0;
+            for (int j = 0; j < 3; j++) {
+                delta[j] = args[3*bonds[i][1]+j]-args[3*bonds[i][0]+j];
+                r += delta[j]*delta[j];
+            }
+            r = sqrt(r);
+            double k = parameters[i][0], r0 = parameters[i][1];
+            expected += k*(r-r0)*(r-r0);
+            for (int j = 0; j < 3; j++) {
+                double force = 2*k*(r-r0)*delta[j]/r;
+                expectedDerivatives[3*bonds[i][1]+j] += force;
+                expectedDerivatives[3*bonds[i][0]+j] -= force;
+            }
+        }
+        for (CustomSummation* function : {&summation, &native}) {
+            vector<double> derivatives;
+            ASSERT_EQUAL_TOL(expected, function->evaluateWithDerivatives(args, derivatives), 1e-5);
+            for (int i = 0; i < numArgs; i++)
+                ASSERT_EQUAL_TOL(expectedDerivatives[i], derivatives[i], 1e-5);
+        }
+    }
+}
+
+void testCoalescing() {
+    // Hills deposited at the same center are merged into a single term whose height is
+    // the sum of theirs, which must not change the value of the summation.
+
+    string expression = "h*exp(-((x1-cx)^2+(y1-cy)^2)/(2*0.3^2))";
+    vector<string> perTermParameters = {"cx", "cy", "h"};
+    CustomSummation summation(2, expression, map<string, double>(), perTermParameters, platform, properties);
+    CustomSummation reference(2, expression, map<string, double>(), perTermParameters, platform, properties);
+    summation.setCoalescing("h", 0.01);
+    string weight;
+    double tolerance;
+    ASSERT(summation.getCoalescing(weight, tolerance));
+    ASSERT_EQUAL("h", weight);
+    ASSERT_EQUAL(0.01, tolerance);
+    ASSERT(!reference.getCoalescing(weight, tolerance));
+    vector<vector<double>> centers = {{0.0, 0.0}, {0.5, 0.2}, {-0.3, 0.8}};
+    for (int i = 0; i < 30; i++) {
+        vector<double> hill = {centers[i%3][0] + 1e-4*(i%2), centers[i%3][1], 0.1 + 0.01*i};
+        ASSERT_EQUAL(i%3, summation.addTerm(hill));
+        reference.addTerm(hill);
+    }
+    summation.update();
+    reference.update();
+    ASSERT_EQUAL(3, summation.getNumTerms());
+    ASSERT_EQUAL_TOL(1.0+0.01*135, summation.getTerm(0)[2], 1e-10);
+    vector<double> args = {0.2, 0.3};
+    ASSERT_EQUAL_TOL(reference.evaluate(args), summation.evaluate(args), 1e-4);
+
+    // Removing a term leaves room for a new one, and setTerms() merges the terms it is
+    // given.
+
+    summation.removeTerm(0);
+    ASSERT_EQUAL(2, summation.addTerm(vector<double>{0.0, 0.0, 1.0}));
+    ASSERT_EQUAL(2, summation.addTerm(vector<double>{0.0, 0.0, 1.0}));
+    ASSERT_EQUAL(3, summation.getNumTerms());
+    vector<double> parameters = {1.0, 1.0, 0.5, 1.0, 1.0, 0.5, 2.0, 0.0, 1.0};
+    summation.setTerms(parameters.data(), 3);
+    summation.update();
+    ASSERT_EQUAL(2, summation.getNumTerms());
+    ASSERT_EQUAL(1.0, summation.getTerm(0)[2]);
+    ASSERT_EQUAL(2.0, summation.getTerm(1)[0]);
+}
+
+void testPrecision() {
+    // Every precision is accepted by every platform and backend.
+
+    const int numArgs = 3;
+    string expression = "a*exp(-((x1-b)^2+(y1-c)^2+z1^2))";
+    map<string, double> overallParameters = {{"a", 1.5}};
+    vector<string> perTermParameters = {"b", "c"};
+    map<string, string> nativeProperties = {{"Backend", "Native"}};
+    CustomSummation reference(numArgs, expression, overallParameters, perTermParameters, platform, nativeProperties);
+    vector<double> args = {0.1, 0.2, -0.3};
+    for (int i = 0; i < 10; i++)
+        reference.addTerm(vector<double>{0.1*i, -0.2*i});
+    reference.update();
+    vector<double> expected;
+    double value = reference.evaluateWithDerivatives(args, expected);
+    for (string backend : {"Context", "Native"})
+        for (string precision : {"single", "mixed", "double", "Double"}) {
+            map<string, string> precisionProperties = properties;
+            precisionProperties["Backend"] = backend;
+            precisionProperties["Precision"] = precision;
+            CustomSummation summation(numArgs, expression, overallParameters, perTermParameters, platform, precisionProperties);
+            for (int i = 0; i < 10; i++)
+                summation.addTerm(vector<double>{0.1*i, -0.2*i});
+            summation.update();
+            vector<double> derivatives;
+            ASSERT_EQUAL_TOL(value, summation.evaluateWithDerivatives(args, derivatives), 1e-5);
+            for (int i = 0; i < numArgs; i++)
+                ASSERT_EQUAL_TOL(expected[i], derivatives[i], 1e-5);
+        }
+    map<string, string> invalidProperties = {{"Precision", "quadruple"}};
+    bool thrown = false;
+    try {
+        CustomSummation summation(numArgs, expression, overallParameters, perTermParameters, platform, invalidProperties);
+    }
+    catch (const OpenMMException& e) {
+        thrown = true;
+    }
+    ASSERT(thrown);
+}
+
+void testHessian() {
+    // The Hessian of each term is known analytically.
+
+    const double a = 0.8;
+    const vector<double> args = {0.3, -0.7, 1.1, 0.9};
+    const vector<double> direction = {0.5, -1.0, 2.0, 0.25};
+    string expression = "a*x1^2*y1 + b*sin(x1*z1) + c*x2^3";
+    vector<vector<double>> terms = {{1.0, 2.0}, {-0.5, 0.3}, {2.5, -1.0}};
+    vector<vector<double>> hessian(4, vector<double>(4, 0.0));
+    double x1 = args[0], y1 = args[1], z1 = args[2], x2 = args[3];
+    for (auto& term : terms) {
+        double b = term[0], c = term[1];
+        double s = sin(x1*z1), co = cos(x1*z1);
+        hessian[0][0] += 2*a*y1-b*z1*z1*s;
+        hessian[0][1] += 2*a*x1;
+        hessian[0][2] += b*co-b*x1*z1*s;
+        hessian[2][2] += -b*x1*x1*s;
+        hessian[3][3] += 6*c*x2;
+    }
+    for (int i = 0; i < 4; i++)
+        for (int j = 0; j < i; j++)
+            hessian[i][j] = hessian[j][i];
+    map<string, double> overallParameters = {{"a", a}};
+    vector<string> perTermParameters = {"b", "c"};
+    CustomSummation summation(4, expression, overallParameters, perTermParameters, platform, properties);
+    map<string, string> nativeProperties = {{"Backend", "Native"}};
+    CustomSummation native(4, expression, overallParameters, perTermParameters, platform, nativeProperties);
+    nativeProperties["Precision"] = "single";
+    CustomSummation vectorized(4, expression, overallParameters, perTermParameters, platform, nativeProperties);
+    for (CustomSummation* function : {&summation, &native, &vectorized}) {
+        for (auto& term : terms)
+            function->addTerm(term);
+        function->update();
+    }
+
+    // The native backend is analytic and always uses double precision, while the
+    // default one takes finite differences of gradients computed by the platform.
+
+    vector<double> expected(4, 0.0);
+    for (int i = 0; i < 4; i++)
+        for (int j = 0; j < 4; j++)
+            expected[i] += hessian[i][j]*direction[j];
+    for (auto& item : {pair<CustomSummation*, double>(&native, 1e-10), {&vectorized, 1e-10}, {&summation, 1e-2}}) {
+        CustomSummation& function = *item.first;
+        double tol = item.second;
+        vector<double> product, diagonal;
+        function.evaluateHessianProduct(args, direction, product);
+        function.evaluateHessianDiagonal(args, diagonal);
+        for (int i = 0; i < 4; i++) {
+            ASSERT_EQUAL_TOL(expected[i], product[i], tol);
+            ASSERT_EQUAL_TOL(hessian[i][i], diagonal[i], tol);
+        }
+        int derivOrder[4] = {1, 1, 0, 0};
+        ASSERT_EQUAL_TOL(hessian[0][1], function.evaluateDerivative(args.data(), derivOrder), tol);
+        derivOrder[1] = 0;
+        derivOrder[0] = 2;
+        ASSERT_EQUAL_TOL(hessian[0][0], function.evaluateDerivative(args.data(), derivOrder), tol);
+    }
+
+    // A Hessian evaluation must not leave stale values in the cache.
+
+    vector<double> derivatives;
+    double value = native.evaluateWithDerivatives(args, derivatives);
+    ASSERT_EQUAL_TOL(value, summation.evaluate(args), 1e-5);
+    ASSERT_EQUAL_TOL(derivatives[0], summation.evaluateDerivative(args, 0), 1e-5);
+}
+
 int main(int argc, char* argv[]) {
     try {
         initializeTests(argc, argv);
         testSimpleSummation();
         testCloning();
+        testSharingBetweenClones();
+        testAppendingTerms();
+        testSettingAllTerms();
+        testRemovingTerms();
+        testArgumentCache();
+        testCompactSupport();
+        testCompactSupportInManyDimensions();
+        testGaussianSupport();
+        testGrid();
+        testConcurrentEvaluation();
+        testBatchEvaluation();
+        testPipelinedBatches();
+        testNativeBackend();
+        testSharedGeometry();
+        testParameterInvariants();
+        testKernelBackend();
+        testAutoBackend();
+        testHessian();
+        testTermPoints();
+        testCoalescing();
+        testPrecision();
     }
     catch(const exception& e) {
         cout << "exception: " << e.what() << endl;
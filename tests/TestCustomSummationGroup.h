@@ -0,0 +1,91 @@
+/* -------------------------------------------------------------------------- *
+                             OpenMM Laboratory                              *
+                             =================                              *
+                                                                            *
+ A plugin for testing low-level code implementation for OpenMM.             *
+                                                                            *
+ Copyright (c) 2023 Charlles Abreu                                          *
+ https://github.com/craabreu/openmm-lab                                     *
+ -------------------------------------------------------------------------- */
+
+#include "CustomSummation.h"
+#include "CustomSummationGroup.h"
+#include "openmm/internal/AssertionUtilities.h"
+#include "sfmt/SFMT.h"
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+using namespace OpenMMLab;
+using namespace OpenMM;
+using namespace std;
+
+void testGroupEvaluation() {
+    // Every summation of the group must agree with an independent CustomSummation that
+    // has the same terms.
+
+    const int numSummations = 4, numArgs = 4;
+    string expression = "a*exp(-((x1-b)^2+(y1-c)^2+z1^2)) + b*x2*y1";
+    map<string, double> overallParameters = {{"a", 1.5}};
+    vector<string> perTermParameters = {"b", "c"};
+    CustomSummationGroup group(numSummations, numArgs, expression, overallParameters, perTermParameters, platform, properties);
+    ASSERT_EQUAL(group.getNumSummations(), numSummations);
+    ASSERT_EQUAL(group.getNumArguments(), numArgs);
+    ASSERT_EQUAL(group.getExpression(), expression);
+    map<string, string> nativeProperties = {{"Backend", "Native"}};
+    vector<unique_ptr<CustomSummation>> summations;
+    for (int k = 0; k < numSummations; k++)
+        summations.emplace_back(new CustomSummation(numArgs, expression, overallParameters, perTermParameters, platform, nativeProperties));
+    OpenMM_SFMT::SFMT sfmt;
+    init_gen_rand(0, sfmt);
+    vector<double> arguments(numSummations*numArgs);
+    for (double& x : arguments)
+        x = genrand_real2(sfmt);
+    for (int step = 0; step < 3; step++) {
+        // Summations get different numbers of terms, and the last one gets none in the
+        // first step.  Terms are added in every step, which eventually requires more
+        // slots, and an existing term is modified.
+
+        for (int k = 0; k < numSummations-(step == 0 ? 1 : 0); k++)
+            for (int i = 0; i < 2*k+step+1; i++) {
+                vector<double> parameters = {genrand_real2(sfmt), genrand_real2(sfmt)};
+                ASSERT_EQUAL(group.addTerm(k, parameters), summations[k]->addTerm(parameters));
+            }
+        group.setTerm(1, 0, vector<double>{0.7, -1.0+step});
+        summations[1]->setTerm(0, vector<double>{0.7, -1.0+step});
+        group.setParameter("a", 1.0+step);
+        ASSERT_EQUAL(group.getParameter("a"), 1.0+step);
+        group.update();
+        for (int k = 0; k < numSummations; k++) {
+            summations[k]->setParameter("a", 1.0+step);
+            summations[k]->update();
+            ASSERT_EQUAL(group.getNumTerms(k), summations[k]->getNumTerms());
+        }
+        vector<double> values, gradients;
+        group.evaluate(arguments, values, gradients);
+        for (int k = 0; k < numSummations; k++) {
+            vector<double> args(arguments.begin()+k*numArgs, arguments.begin()+(k+1)*numArgs);
+            vector<double> derivatives;
+            ASSERT_EQUAL_TOL(summations[k]->evaluateWithDerivatives(args, derivatives), values[k], 1e-5);
+            for (int i = 0; i < numArgs; i++)
+                ASSERT_EQUAL_TOL(derivatives[i], gradients[k*numArgs+i], 1e-5);
+        }
+    }
+}
+
+void runPlatformTests();
+
+int main(int argc, char* argv[]) {
+    try {
+        initializeTests(argc, argv);
+        testGroupEvaluation();
+        runPlatformTests();
+    }
+    catch(const exception& e) {
+        cout << "exception: " << e.what() << endl;
+        return 1;
+    }
+    cout << "Done" << endl;
+    return 0;
+}
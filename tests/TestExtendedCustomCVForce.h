@@ -15,6 +15,8 @@
 #include "openmm/internal/AssertionUtilities.h"
 #include "openmm/Context.h"
 #include "openmm/CustomBondForce.h"
+#include "openmm/CustomCentroidBondForce.h"
+#include "openmm/CustomCompoundBondForce.h"
 #include "openmm/CustomExternalForce.h"
 #include "openmm/CustomNonbondedForce.h"
 #include "openmm/System.h"
@@ -170,6 +172,420 @@ void testTabulatedFunction() {
     }
 }
 
+double computeRadialBasisFunction(ExtendedCustomCVForce::RadialBasisFunctionType type, double shape, const vector<double>& centers,
+                                  const vector<double>& weights, double x, double y, double& dfdx, double& dfdy) {
+    double value = 0;
+    dfdx = dfdy = 0;
+    for (int k = 0; k < weights.size(); k++) {
+        double dx = x-centers[2*k];
+        double dy = y-centers[2*k+1];
+        double s2 = shape*shape*(dx*dx+dy*dy);
+        double phi, dPhi;
+        if (type == ExtendedCustomCVForce::Gaussian) {
+            phi = exp(-s2);
+            dPhi = -2*shape*shape*phi;
+        }
+        else if (type == ExtendedCustomCVForce::Multiquadric) {
+            phi = sqrt(1+s2);
+            dPhi = shape*shape/phi;
+        }
+        else {
+            phi = 0.5*s2*log(s2);
+            dPhi = shape*shape*(log(s2)+1);
+        }
+        value += weights[k]*phi;
+        dfdx += weights[k]*dPhi*dx;
+        dfdy += weights[k]*dPhi*dy;
+    }
+    return value;
+}
+
+void testRadialBasisFunction() {
+    System system;
+    system.addParticle(1.0);
+    ExtendedCustomCVForce* cv = new ExtendedCustomCVForce("2*f+x");
+    CustomExternalForce* v1 = new CustomExternalForce("x");
+    v1->addParticle(0);
+    cv->addCollectiveVariable("x", v1);
+    CustomExternalForce* v2 = new CustomExternalForce("y");
+    v2->addParticle(0);
+    cv->addCollectiveVariable("y", v2);
+    OpenMM_SFMT::SFMT sfmt;
+    init_gen_rand(0, sfmt);
+    int numCenters = 50;
+    vector<double> centers, weights;
+    for (int k = 0; k < numCenters; k++) {
+        centers.push_back(2*genrand_real2(sfmt)-1);
+        centers.push_back(2*genrand_real2(sfmt)-1);
+        weights.push_back(genrand_real2(sfmt)-0.5);
+    }
+    vector<string> variables = {"x", "y"};
+    ExtendedCustomCVForce::RadialBasisFunctionType type = ExtendedCustomCVForce::Gaussian;
+    double shape = 1.5;
+    cv->addRadialBasisFunction("f", type, shape, variables, centers, weights);
+    ASSERT_EQUAL(1, cv->getNumRadialBasisFunctions());
+    system.addForce(cv);
+    VerletIntegrator integrator(0.01);
+    Context context(system, integrator, platform);
+    vector<Vec3> positions(1);
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 5; j++) {
+            double x = 2*genrand_real2(sfmt)-1;
+            double y = 2*genrand_real2(sfmt)-1;
+            positions[0] = Vec3(x, y, 0.5);
+            context.setPositions(positions);
+            State state = context.getState(State::Forces | State::Energy);
+            double dfdx, dfdy;
+            double f = computeRadialBasisFunction(type, shape, centers, weights, x, y, dfdx, dfdy);
+            ASSERT_EQUAL_TOL(2*f+x, state.getPotentialEnergy(), 1e-4);
+            ASSERT_EQUAL_VEC(Vec3(-2*dfdx-1, -2*dfdy, 0), state.getForces()[0], 1e-4);
+        }
+
+        // Change the type and the number of centers, call updateParametersInContext(),
+        // and see if it's still correct.
+
+        type = (i == 0 ? ExtendedCustomCVForce::Multiquadric : ExtendedCustomCVForce::ThinPlateSpline);
+        shape *= 0.5;
+        numCenters += 25;
+        for (int k = weights.size(); k < numCenters; k++) {
+            centers.push_back(2*genrand_real2(sfmt)-1);
+            centers.push_back(2*genrand_real2(sfmt)-1);
+            weights.push_back(genrand_real2(sfmt)-0.5);
+        }
+        cv->setRadialBasisFunctionParameters(0, type, shape, centers, weights);
+        cv->updateParametersInContext(context);
+    }
+}
+
+void testCustomSummation() {
+    System system;
+    system.addParticle(1.0);
+    ExtendedCustomCVForce* cv = new ExtendedCustomCVForce("2*g+x");
+    CustomExternalForce* v1 = new CustomExternalForce("x");
+    v1->addParticle(0);
+    cv->addCollectiveVariable("x", v1);
+    CustomExternalForce* v2 = new CustomExternalForce("y");
+    v2->addParticle(0);
+    cv->addCollectiveVariable("y", v2);
+    map<string, string> properties = {{"Backend", "Native"}};
+    CustomSummation* summation = new CustomSummation(2, "w*exp(-((x1-cx)^2+(y1-cy)^2)/s^2)", map<string, double>{{"s", 0.5}},
+                                                     vector<string>{"w", "cx", "cy"}, platform, properties);
+    OpenMM_SFMT::SFMT sfmt;
+    init_gen_rand(0, sfmt);
+    vector<vector<double> > terms;
+    for (int k = 0; k < 50; k++) {
+        terms.push_back({genrand_real2(sfmt)-0.5, 2*genrand_real2(sfmt)-1, 2*genrand_real2(sfmt)-1});
+        summation->addTerm(terms.back());
+    }
+    summation->update();
+    cv->addCustomSummation("g", summation, vector<string>{"y", "x"});
+    ASSERT_EQUAL(1, cv->getNumCustomSummations());
+    ASSERT_EQUAL("g", cv->getCustomSummationName(0));
+    system.addForce(cv);
+    VerletIntegrator integrator(0.01);
+    Context context(system, integrator, platform);
+    vector<Vec3> positions(1);
+    double s = 0.5;
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 5; j++) {
+            // The first argument of the summation is y and the second one is x.
+
+            double x = 2*genrand_real2(sfmt)-1;
+            double y = 2*genrand_real2(sfmt)-1;
+            positions[0] = Vec3(x, y, 0.5);
+            context.setPositions(positions);
+            State state = context.getState(State::Forces | State::Energy);
+            double g = 0, dgdx = 0, dgdy = 0;
+            for (auto& term : terms) {
+                double dy = y-term[1], dx = x-term[2];
+                double value = term[0]*exp(-(dx*dx+dy*dy)/(s*s));
+                g += value;
+                dgdx += -2*dx*value/(s*s);
+                dgdy += -2*dy*value/(s*s);
+            }
+            ASSERT_EQUAL_TOL(2*g+x, state.getPotentialEnergy(), 1e-4);
+            ASSERT_EQUAL_VEC(Vec3(-2*dgdx-1, -2*dgdy, 0), state.getForces()[0], 1e-4);
+        }
+
+        // Modify a term, add new ones, and change the overall parameter.  Then call
+        // updateParametersInContext() and see if it's still correct.
+
+        CustomSummation& function = cv->getCustomSummation(0);
+        terms[0] = {0.8, 0.1, -0.2};
+        function.setTerm(0, terms[0]);
+        for (int k = 0; k < 25; k++) {
+            terms.push_back({genrand_real2(sfmt)-0.5, 2*genrand_real2(sfmt)-1, 2*genrand_real2(sfmt)-1});
+            function.addTerm(terms.back());
+        }
+        s *= 1.5;
+        function.setParameter("s", s);
+        cv->updateParametersInContext(context);
+    }
+}
+
+void testCustomSummationDeposition() {
+    // Deposit well-tempered hills at the current value of a collective variable, with heights
+    // that depend on the bias before the deposition.
+
+    System system;
+    system.addParticle(1.0);
+    ExtendedCustomCVForce* cv = new ExtendedCustomCVForce("g");
+    cv->addGlobalParameter("height", 0.3);
+    CustomExternalForce* v = new CustomExternalForce("x");
+    v->addParticle(0);
+    cv->addCollectiveVariable("x", v);
+    map<string, string> properties = {{"Backend", "Native"}};
+    CustomSummation* summation = new CustomSummation(1, "h*exp(-(x1-c)^2/(2*s^2))", map<string, double>{{"s", 0.2}},
+                                                     vector<string>{"h", "c"}, platform, properties);
+    vector<vector<double> > ownTerms = {{0.5, 0.1}};
+    summation->addTerm(ownTerms[0]);
+    cv->addCustomSummation("g", summation, vector<string>{"x"});
+    cv->setCustomSummationDeposition(0, 5, vector<string>{"height*exp(-g)", "x"});
+    ASSERT_EQUAL(5, cv->getCustomSummationDepositionInterval(0));
+    ASSERT_EQUAL(2, cv->getCustomSummationDepositionParameters(0).size());
+    system.addForce(cv);
+    VerletIntegrator integrator(0.01);
+    Context context(system, integrator, platform);
+    OpenMM_SFMT::SFMT sfmt;
+    init_gen_rand(0, sfmt);
+    vector<vector<double> > deposited;
+    vector<Vec3> positions(1);
+    double s = 0.2;
+    auto computeBias = [&] (double x, double& g, double& dgdx) {
+        g = dgdx = 0;
+        for (auto* terms : {&ownTerms, &deposited})
+            for (auto& term : *terms) {
+                double value = term[0]*exp(-(x-term[1])*(x-term[1])/(2*s*s));
+                g += value;
+                dgdx += -(x-term[1])*value/(s*s);
+            }
+    };
+    for (int step = 1; step <= 16; step++) {
+        double x = genrand_real2(sfmt)-0.5;
+        positions[0] = Vec3(x, 0, 0);
+        context.setPositions(positions);
+        context.setStepCount(step);
+        double g, dgdx;
+        computeBias(x, g, dgdx);
+        State state = context.getState(State::Forces | State::Energy);
+        ASSERT_EQUAL_TOL(g, state.getPotentialEnergy(), 1e-4);
+        ASSERT_EQUAL_VEC(Vec3(-dgdx, 0, 0), state.getForces()[0], 1e-4);
+        if (step%5 == 0)
+            deposited.push_back({0.3*exp(-g), x});
+
+        // Evaluating the same step again includes the new term, but does not deposit another one.
+
+        computeBias(x, g, dgdx);
+        state = context.getState(State::Energy);
+        ASSERT_EQUAL_TOL(g, state.getPotentialEnergy(), 1e-4);
+        vector<vector<double> > terms;
+        cv->getCustomSummationDepositedTerms(context, 0, terms);
+        ASSERT_EQUAL(deposited.size(), terms.size());
+        for (int k = 0; k < terms.size(); k++) {
+            ASSERT_EQUAL_TOL(deposited[k][0], terms[k][0], 1e-4);
+            ASSERT_EQUAL_TOL(deposited[k][1], terms[k][1], 1e-4);
+        }
+    }
+
+    // The deposited terms survive an update of the terms of the summation.
+
+    ownTerms[0] = {-0.2, 0.3};
+    ownTerms.push_back({0.4, -0.1});
+    cv->getCustomSummation(0).setTerm(0, ownTerms[0]);
+    cv->getCustomSummation(0).addTerm(ownTerms[1]);
+    cv->updateParametersInContext(context);
+    double x = 0.15, g, dgdx;
+    positions[0] = Vec3(x, 0, 0);
+    context.setPositions(positions);
+    computeBias(x, g, dgdx);
+    State state = context.getState(State::Forces | State::Energy);
+    ASSERT_EQUAL_TOL(g, state.getPotentialEnergy(), 1e-4);
+    ASSERT_EQUAL_VEC(Vec3(-dgdx, 0, 0), state.getForces()[0], 1e-4);
+}
+
+void testCollectiveVariableHistory() {
+    System system;
+    system.addParticle(1.0);
+    ExtendedCustomCVForce* cv = new ExtendedCustomCVForce("3*x^2+y");
+    CustomExternalForce* v1 = new CustomExternalForce("x");
+    v1->addParticle(0);
+    cv->addCollectiveVariable("x", v1);
+    CustomExternalForce* v2 = new CustomExternalForce("y");
+    v2->addParticle(0);
+    cv->addCollectiveVariable("y", v2);
+    cv->setCollectiveVariableHistorySize(4);
+    ASSERT_EQUAL(4, cv->getCollectiveVariableHistorySize());
+    system.addForce(cv);
+    VerletIntegrator integrator(0.01);
+    Context context(system, integrator, platform);
+    vector<Vec3> positions(1);
+    for (int step = 0; step < 7; step++) {
+        // Only the first evaluation of a step is recorded, even if it does not compute the energy.
+
+        positions[0] = Vec3(0.1*step, -0.2*step, 0);
+        context.setPositions(positions);
+        context.setStepCount(step);
+        context.getState(State::Forces);
+        positions[0] = Vec3(1.0, 1.0, 0);
+        context.setPositions(positions);
+        context.getState(State::Energy);
+    }
+    long long innerEvaluations = cv->getCountersInContext(context)["innerEvaluations"];
+    vector<long long> steps;
+    vector<vector<double> > values;
+    vector<double> energies;
+    cv->getCollectiveVariableHistory(context, steps, values, energies);
+    ASSERT_EQUAL(innerEvaluations, cv->getCountersInContext(context)["innerEvaluations"]);
+    ASSERT_EQUAL(4, steps.size());
+    for (int i = 0; i < 4; i++) {
+        int step = i+3;
+        double x = 0.1*step, y = -0.2*step;
+        ASSERT_EQUAL(step, steps[i]);
+        ASSERT_EQUAL_TOL(x, values[i][0], 1e-5);
+        ASSERT_EQUAL_TOL(y, values[i][1], 1e-5);
+        ASSERT_EQUAL_TOL(3*x*x+y, energies[i], 1e-5);
+    }
+
+    // The records are removed once they are read.
+
+    cv->getCollectiveVariableHistory(context, steps, values, energies);
+    ASSERT_EQUAL(0, steps.size());
+    ASSERT_EQUAL(0, values.size());
+    ASSERT_EQUAL(0, energies.size());
+}
+
+void testFrames() {
+    // Evaluate the variables at a series of frames, one of which has an evaluation interval,
+    // and make sure the state of the Context is left alone.
+
+    System system;
+    system.addParticle(1.0);
+    system.addParticle(1.0);
+    system.setDefaultPeriodicBoxVectors(Vec3(3, 0, 0), Vec3(0, 3, 0), Vec3(0, 0, 3));
+    ExtendedCustomCVForce* cv = new ExtendedCustomCVForce("d+2*z");
+    CustomBondForce* distance = new CustomBondForce("r");
+    distance->addBond(0, 1);
+    distance->setUsesPeriodicBoundaryConditions(true);
+    cv->addCollectiveVariable("d", distance);
+    CustomExternalForce* height = new CustomExternalForce("z");
+    height->addParticle(1);
+    cv->addCollectiveVariable("z", height);
+    cv->setCollectiveVariableInterval(1, 10);
+    system.addForce(cv);
+    VerletIntegrator integrator(0.01);
+    Context context(system, integrator, platform);
+    vector<Vec3> positions = {Vec3(0, 0, 0), Vec3(0.5, 0, 0.2)};
+    context.setPositions(positions);
+    double energy = context.getState(State::Energy).getPotentialEnergy();
+    OpenMM_SFMT::SFMT sfmt;
+    init_gen_rand(0, sfmt);
+    vector<vector<Vec3> > frames, boxes;
+    for (int i = 0; i < 5; i++) {
+        frames.push_back({Vec3(genrand_real2(sfmt), 0, 0), Vec3(0, genrand_real2(sfmt), genrand_real2(sfmt))});
+        double size = 2.0+genrand_real2(sfmt);
+        boxes.push_back({Vec3(size, 0, 0), Vec3(0, size, 0), Vec3(0, 0, size)});
+    }
+    vector<vector<double> > values;
+    cv->getCollectiveVariableValuesForFrames(context, frames, boxes, values);
+    ASSERT_EQUAL(frames.size(), values.size());
+    for (int i = 0; i < frames.size(); i++) {
+        Vec3 delta = frames[i][1]-frames[i][0];
+        double size = boxes[i][0][0];
+        for (int j = 0; j < 3; j++)
+            delta[j] -= size*round(delta[j]/size);
+        ASSERT_EQUAL_TOL(sqrt(delta.dot(delta)), values[i][0], 1e-5);
+        ASSERT_EQUAL_TOL(frames[i][1][2], values[i][1], 1e-5);
+    }
+    cv->getCollectiveVariableValuesForFrames(context, frames, vector<vector<Vec3> >(), values);
+    for (int i = 0; i < frames.size(); i++)
+        ASSERT_EQUAL_TOL(frames[i][1][2], values[i][1], 1e-5);
+    ASSERT_EQUAL_TOL(energy, context.getState(State::Energy).getPotentialEnergy(), 1e-5);
+}
+
+void testEvaluationInterval() {
+    System system;
+    system.addParticle(1.0);
+    ExtendedCustomCVForce* cv = new ExtendedCustomCVForce("x+y");
+    CustomExternalForce* v1 = new CustomExternalForce("x");
+    v1->addParticle(0);
+    cv->addCollectiveVariable("x", v1);
+    CustomExternalForce* v2 = new CustomExternalForce("y");
+    v2->addParticle(0);
+    cv->addCollectiveVariable("y", v2);
+    cv->setCollectiveVariableInterval(0, 3);
+    ASSERT_EQUAL(3, cv->getCollectiveVariableInterval(0));
+    ASSERT_EQUAL(1, cv->getCollectiveVariableInterval(1));
+    system.addForce(cv);
+    VerletIntegrator integrator(0.1);
+    Context context(system, integrator, platform);
+    context.setPositions(vector<Vec3>(1, Vec3(0, 0, 0)));
+    context.setVelocities(vector<Vec3>(1, Vec3(1, 1, 0)));
+
+    // The first variable should only be updated every third step.
+
+    double lastX = 0;
+    for (int i = 0; i < 7; i++) {
+        State state = context.getState(State::Positions | State::Energy);
+        Vec3 position = state.getPositions()[0];
+        if (i%3 == 0)
+            lastX = position[0];
+        ASSERT_EQUAL_TOL(lastX+position[1], state.getPotentialEnergy(), 1e-5);
+        integrator.step(1);
+    }
+
+    // The second variable should follow changes of the positions made without steps.
+
+    Vec3 position = context.getState(State::Positions).getPositions()[0]+Vec3(0, 1, 0);
+    context.setPositions(vector<Vec3>(1, position));
+    ASSERT_EQUAL_TOL(lastX+position[1], context.getState(State::Energy).getPotentialEnergy(), 1e-5);
+
+    // The values of the variables should be those the force is using, and only the
+    // second one should be evaluated again.
+
+    cv->resetCountersInContext(context);
+    vector<double> values;
+    cv->getCollectiveVariableValues(context, values);
+    ASSERT_EQUAL(2, values.size());
+    ASSERT_EQUAL_TOL(lastX, values[0], 1e-5);
+    ASSERT_EQUAL_TOL(position[1], values[1], 1e-5);
+    ASSERT_EQUAL(1, cv->getCountersInContext(context)["innerEvaluations"]);
+}
+
+void testOverlappingLocalizedCVs() {
+    // Localized CVs sharing atoms, in a system large enough for them to use compact force arrays.
+
+    const int numParticles = 20;
+    System system;
+    for (int i = 0; i < numParticles; i++)
+        system.addParticle(1.0);
+    ExtendedCustomCVForce* cv = new ExtendedCustomCVForce("v1*v2");
+    CustomBondForce* v1 = new CustomBondForce("r");
+    v1->addBond(0, 1);
+    cv->addCollectiveVariable("v1", v1);
+    CustomBondForce* v2 = new CustomBondForce("r");
+    v2->addBond(0, 2);
+    cv->addCollectiveVariable("v2", v2);
+    system.addForce(cv);
+    OpenMM_SFMT::SFMT sfmt;
+    init_gen_rand(0, sfmt);
+    vector<Vec3> positions;
+    for (int i = 0; i < numParticles; i++)
+        positions.push_back(Vec3(genrand_real2(sfmt), genrand_real2(sfmt), genrand_real2(sfmt)));
+    VerletIntegrator integrator(0.01);
+    Context context(system, integrator, platform);
+    context.setPositions(positions);
+    State state = context.getState(State::Energy | State::Forces);
+    Vec3 d1 = positions[1]-positions[0];
+    Vec3 d2 = positions[2]-positions[0];
+    double r1 = sqrt(d1.dot(d1));
+    double r2 = sqrt(d2.dot(d2));
+    ASSERT_EQUAL_TOL(r1*r2, state.getPotentialEnergy(), 1e-5);
+    ASSERT_EQUAL_VEC(d1*(r2/r1)+d2*(r1/r2), state.getForces()[0], 1e-5);
+    ASSERT_EQUAL_VEC(-d1*(r2/r1), state.getForces()[1], 1e-5);
+    ASSERT_EQUAL_VEC(-d2*(r1/r2), state.getForces()[2], 1e-5);
+    ASSERT_EQUAL_VEC(Vec3(0, 0, 0), state.getForces()[3], 1e-5);
+}
+
 void testReordering() {
     // Create a larger system with a nonbonded force, since that will trigger atom
     // reordering on the GPU.
@@ -214,6 +630,416 @@ void testReordering() {
     ASSERT_EQUAL_VEC(delta*2/r, state.getForces()[10], 1e-5);
 }
 
+void testCounters() {
+    System system;
+    system.addParticle(1.0);
+    system.addParticle(1.0);
+    ExtendedCustomCVForce* cv = new ExtendedCustomCVForce("v1^2");
+    CustomBondForce* v1 = new CustomBondForce("r");
+    v1->addBond(0, 1);
+    cv->addCollectiveVariable("v1", v1);
+    system.addForce(cv);
+    VerletIntegrator integrator(1.0);
+    Context context(system, integrator, platform);
+    context.setPositions({Vec3(0, 0, 0), Vec3(1, 0, 0)});
+
+    // A platform may repeat an evaluation, for example after reordering atoms, so the
+    // counters are compared with the number of evaluations.
+
+    for (int i = 0; i < 3; i++)
+        context.getState(State::Energy | State::Forces);
+    map<string, long long> counters = cv->getCountersInContext(context);
+    long long evaluations = counters["evaluations"];
+    ASSERT(evaluations >= 3);
+    ASSERT_EQUAL(evaluations, counters["copyStates"]);
+    ASSERT_EQUAL(evaluations, counters["innerEvaluations"]);
+    ASSERT_EQUAL(2*evaluations, counters["expressionEvaluations"]);
+    ASSERT(counters["bytesCopied"] > 0);
+    ASSERT(counters["synchronizations"] >= 0);
+
+    // Platforms with device memory also report its size, which is not a counter.
+
+    if (counters.find("deviceBytes") != counters.end()) {
+        ASSERT(counters["deviceBytes"] > 0);
+        ASSERT(counters["scratchBytes"] >= 0);
+    }
+    cv->resetCountersInContext(context);
+    for (auto& counter : cv->getCountersInContext(context))
+        if (counter.first != "deviceBytes" && counter.first != "scratchBytes")
+            ASSERT_EQUAL(0, counter.second);
+}
+
+void testCompressedForces() {
+    // Storing the forces of the collective variables in compressed form should only round them.
+
+    const int numParticles = 50;
+    System system;
+    for (int i = 0; i < numParticles; i++)
+        system.addParticle(1.0);
+    OpenMM_SFMT::SFMT sfmt;
+    init_gen_rand(0, sfmt);
+    vector<Vec3> positions;
+    for (int i = 0; i < numParticles; i++)
+        positions.push_back(Vec3(genrand_real2(sfmt), genrand_real2(sfmt), genrand_real2(sfmt))*3);
+    State states[2];
+    for (int compressed = 0; compressed < 2; compressed++) {
+        System system2 = system;
+        ExtendedCustomCVForce* cv = new ExtendedCustomCVForce("v1*v2+0.5*v1^2");
+        CustomNonbondedForce* v1 = new CustomNonbondedForce("1/r");
+        for (int i = 0; i < numParticles; i++)
+            v1->addParticle();
+        CustomBondForce* v2 = new CustomBondForce("r^2");
+        v2->addBond(0, 1);
+        v2->addBond(2, 3);
+        cv->addCollectiveVariable("v1", v1);
+        cv->addCollectiveVariable("v2", v2);
+        cv->setUseCompressedForces(compressed);
+        ASSERT_EQUAL(compressed, cv->getUseCompressedForces());
+        system2.addForce(cv);
+        VerletIntegrator integrator(1.0);
+        Context context(system2, integrator, platform);
+        context.setPositions(positions);
+        states[compressed] = context.getState(State::Energy | State::Forces);
+    }
+    ASSERT_EQUAL_TOL(states[0].getPotentialEnergy(), states[1].getPotentialEnergy(), 1e-5);
+    for (int i = 0; i < numParticles; i++)
+        ASSERT_EQUAL_VEC(states[0].getForces()[i], states[1].getForces()[i], 1e-5);
+}
+
+void testDerivativesOnDemand() {
+    // Computing the parameter derivatives only along with the energy should not change them,
+    // even for a collective variable whose latest evaluation was in a step without energy.
+
+    System system;
+    for (int i = 0; i < 4; i++)
+        system.addParticle(1.0);
+    vector<Vec3> positions = {Vec3(0, 0, 0), Vec3(1.2, 0, 0), Vec3(0, 1.1, 0.3), Vec3(0.4, 0.2, 1.3)};
+    State states[2];
+    for (int onDemand = 0; onDemand < 2; onDemand++) {
+        System system2 = system;
+        ExtendedCustomCVForce* cv = new ExtendedCustomCVForce("g1*v1^2+v2");
+        CustomBondForce* v1 = new CustomBondForce("g2*r");
+        v1->addGlobalParameter("g2", 1.5);
+        v1->addEnergyParameterDerivative("g2");
+        v1->addBond(0, 1);
+        CustomBondForce* v2 = new CustomBondForce("g3*r^2");
+        v2->addGlobalParameter("g3", 0.5);
+        v2->addEnergyParameterDerivative("g3");
+        v2->addBond(2, 3);
+        cv->addCollectiveVariable("v1", v1);
+        cv->addCollectiveVariable("v2", v2);
+        cv->setCollectiveVariableInterval(1, 3);
+        cv->addGlobalParameter("g1", 0.8);
+        cv->addEnergyParameterDerivative("g1");
+        cv->setUseDerivativesOnDemand(onDemand);
+        ASSERT_EQUAL(onDemand, cv->getUseDerivativesOnDemand());
+        system2.addForce(cv);
+        VerletIntegrator integrator(0.01);
+        Context context(system2, integrator, platform);
+        context.setPositions(positions);
+        integrator.step(4);
+        states[onDemand] = context.getState(State::Energy | State::Forces | State::ParameterDerivatives);
+    }
+    ASSERT_EQUAL_TOL(states[0].getPotentialEnergy(), states[1].getPotentialEnergy(), 1e-5);
+    for (int i = 0; i < 4; i++)
+        ASSERT_EQUAL_VEC(states[0].getForces()[i], states[1].getForces()[i], 1e-5);
+    map<string, double> derivs0 = states[0].getEnergyParameterDerivatives();
+    map<string, double> derivs1 = states[1].getEnergyParameterDerivatives();
+    ASSERT_EQUAL(3, derivs1.size());
+    for (auto& deriv : derivs0)
+        ASSERT_EQUAL_TOL(deriv.second, derivs1.at(deriv.first), 1e-5);
+}
+
+void testSharedParticles() {
+    // Distances from a shared centroid should match those computed by CustomCentroidBondForce,
+    // for centroids of every size.
+
+    const int numParticles = 8;
+    System system;
+    for (int i = 0; i < numParticles; i++)
+        system.addParticle(1.0);
+    OpenMM_SFMT::SFMT sfmt;
+    init_gen_rand(0, sfmt);
+    vector<Vec3> positions;
+    for (int i = 0; i < numParticles; i++)
+        positions.push_back(Vec3(genrand_real2(sfmt), genrand_real2(sfmt), genrand_real2(sfmt))*2);
+    vector<vector<int> > groups = {{0}, {1, 2}, {0, 1, 2}, {0, 1, 2, 3, 4}};
+    vector<vector<double> > weights = {{}, {1.0, 3.0}, {}, {1.0, 2.0, 3.0, 4.0, 5.0}};
+    string energy = "0";
+    for (int i = 0; i < groups.size(); i++)
+        energy += "+"+to_string(i+1)+"*(d"+to_string(i)+"a-0.5)^2+e"+to_string(i)+"*d"+to_string(i)+"b";
+    State states[2];
+    vector<double> values[2];
+    for (int shared = 0; shared < 2; shared++) {
+        System system2 = system;
+        ExtendedCustomCVForce* cv = new ExtendedCustomCVForce(energy);
+        for (int i = 0; i < groups.size(); i++) {
+            string index = to_string(i);
+            cv->addGlobalParameter("e"+index, 0.1*(i+1));
+            if (shared) {
+                ASSERT_EQUAL(i, cv->addSharedCentroid(groups[i], weights[i]));
+                for (int j = 0; j < 2; j++) {
+                    CustomBondForce* distance = new CustomBondForce("r");
+                    distance->addBond(numParticles+i, 5+j);
+                    cv->addCollectiveVariable("d"+index+(j == 0 ? "a" : "b"), distance);
+                }
+            }
+            else
+                for (int j = 0; j < 2; j++) {
+                    CustomCentroidBondForce* distance = new CustomCentroidBondForce(2, "distance(g1,g2)");
+                    distance->addGroup(groups[i], weights[i].empty() ? vector<double>(groups[i].size(), 1.0) : weights[i]);
+                    distance->addGroup({5+j});
+                    distance->addBond({0, 1});
+                    cv->addCollectiveVariable("d"+index+(j == 0 ? "a" : "b"), distance);
+                }
+        }
+        ASSERT_EQUAL(shared ? (int) groups.size() : 0, cv->getNumSharedParticles());
+        system2.addForce(cv);
+        VerletIntegrator integrator(1.0);
+        Context context(system2, integrator, platform);
+        context.setPositions(positions);
+        states[shared] = context.getState(State::Energy | State::Forces);
+        cv->getCollectiveVariableValues(context, values[shared]);
+    }
+    ASSERT_EQUAL_TOL(states[0].getPotentialEnergy(), states[1].getPotentialEnergy(), 1e-5);
+    for (int i = 0; i < numParticles; i++)
+        ASSERT_EQUAL_VEC(states[0].getForces()[i], states[1].getForces()[i], 1e-5);
+    for (int i = 0; i < values[0].size(); i++)
+        ASSERT_EQUAL_TOL(values[0][i], values[1][i], 1e-5);
+}
+
+void testCollectiveVariableBatches() {
+    // Batches with more variables in total than the limit of 32 should give the same energy,
+    // forces, and parameter derivatives as plain forces with the same bonds.
+
+    const int numParticles = 10;
+    const int numBonds = 40;
+    const int numAngles = 3;
+    System system;
+    for (int i = 0; i < numParticles; i++)
+        system.addParticle(1.0);
+    string energy = "v";
+    vector<string> bondNames, angleNames;
+    for (int i = 0; i < numBonds; i++) {
+        bondNames.push_back("c"+to_string(i));
+        energy += "+c"+to_string(i)+"^2";
+    }
+    for (int i = 0; i < numAngles; i++) {
+        angleNames.push_back("s"+to_string(i));
+        energy += "+s"+to_string(i);
+    }
+    ExtendedCustomCVForce* cv = new ExtendedCustomCVForce(energy);
+    CustomExternalForce* v = new CustomExternalForce("x");
+    v->addParticle(0);
+    cv->addCollectiveVariable("v", v);
+    CustomBondForce* bonds = new CustomBondForce("a*r");
+    bonds->addGlobalParameter("a", 1.5);
+    bonds->addEnergyParameterDerivative("a");
+    CustomCompoundBondForce* angles = new CustomCompoundBondForce(3, "angle(p1,p2,p3)");
+    System expectedSystem;
+    for (int i = 0; i < numParticles; i++)
+        expectedSystem.addParticle(1.0);
+    CustomExternalForce* expectedV = new CustomExternalForce("x");
+    expectedV->addParticle(0);
+    CustomBondForce* expectedBonds = new CustomBondForce("(a*r)^2");
+    expectedBonds->addGlobalParameter("a", 1.5);
+    expectedBonds->addEnergyParameterDerivative("a");
+    CustomCompoundBondForce* expectedAngles = new CustomCompoundBondForce(3, "angle(p1,p2,p3)");
+    vector<pair<int, int> > pairs;
+    for (int i = 0; i < numBonds; i++) {
+        pairs.push_back(make_pair(i%numParticles, (i/numParticles+1+i)%numParticles));
+        bonds->addBond(pairs[i].first, pairs[i].second);
+        expectedBonds->addBond(pairs[i].first, pairs[i].second);
+    }
+    for (int i = 0; i < numAngles; i++) {
+        vector<int> particles = {i, i+3, i+6};
+        angles->addBond(particles);
+        expectedAngles->addBond(particles);
+    }
+    ASSERT_EQUAL(0, cv->addCollectiveVariableBatch(bondNames, bonds));
+    ASSERT_EQUAL(1, cv->addCollectiveVariableBatch(angleNames, angles));
+    ASSERT_EQUAL(2, cv->getNumCollectiveVariableBatches());
+    ASSERT(cv->getCollectiveVariableBatchNames(1) == angleNames);
+    system.addForce(cv);
+    expectedSystem.addForce(expectedV);
+    expectedSystem.addForce(expectedBonds);
+    expectedSystem.addForce(expectedAngles);
+    OpenMM_SFMT::SFMT sfmt;
+    init_gen_rand(0, sfmt);
+    vector<Vec3> positions;
+    for (int i = 0; i < numParticles; i++)
+        positions.push_back(Vec3(genrand_real2(sfmt), genrand_real2(sfmt), genrand_real2(sfmt))*3);
+    VerletIntegrator integrator1(0.01), integrator2(0.01);
+    Context context(system, integrator1, platform);
+    Context expectedContext(expectedSystem, integrator2, platform);
+    context.setPositions(positions);
+    expectedContext.setPositions(positions);
+    double a = 1.5;
+    for (int repeat = 0; repeat < 2; repeat++) {
+        int types = State::Energy | State::Forces | State::ParameterDerivatives;
+        State state = context.getState(types);
+        State expectedState = expectedContext.getState(types);
+        ASSERT_EQUAL_TOL(expectedState.getPotentialEnergy(), state.getPotentialEnergy(), 1e-5);
+        for (int i = 0; i < numParticles; i++)
+            ASSERT_EQUAL_VEC(expectedState.getForces()[i], state.getForces()[i], 1e-5);
+        ASSERT_EQUAL_TOL(expectedState.getEnergyParameterDerivatives().at("a"), state.getEnergyParameterDerivatives().at("a"), 1e-5);
+
+        // The variables of the batches should follow the other variables.
+
+        vector<double> values;
+        cv->getCollectiveVariableValues(context, values);
+        ASSERT_EQUAL(1+numBonds+numAngles, values.size());
+        ASSERT_EQUAL_TOL(positions[0][0], values[0], 1e-5);
+        for (int i = 0; i < numBonds; i++) {
+            Vec3 delta = positions[pairs[i].first]-positions[pairs[i].second];
+            ASSERT_EQUAL_TOL(a*sqrt(delta.dot(delta)), values[1+i], 1e-5);
+        }
+
+        // Changing a parameter should affect the batch.
+
+        a = 2.0;
+        context.setParameter("a", a);
+        expectedContext.setParameter("a", a);
+    }
+}
+
+void testNestedForces() {
+    // A hierarchy of nested forces is merged into a single inner Context, and should give the
+    // same results as a single force with the leaves as variables and the composed expression.
+    // The subexpression u is defined at two levels, which must not clash.
+
+    System system, expectedSystem;
+    for (int i = 0; i < 3; i++) {
+        system.addParticle(1.0);
+        expectedSystem.addParticle(1.0);
+    }
+    CustomBondForce* d = new CustomBondForce("r");
+    d->addBond(0, 1);
+    CustomExternalForce* s = new CustomExternalForce("x");
+    s->addParticle(2);
+    CustomExternalForce* t = new CustomExternalForce("y");
+    t->addParticle(0);
+    CustomExternalForce* e = new CustomExternalForce("z");
+    e->addParticle(1);
+    vector<double> table;
+    for (int i = 0; i < 20; i++)
+        table.push_back(sin(0.25*i));
+    ExtendedCustomCVForce* inner = new ExtendedCustomCVForce("k*u+t; u=d^2");
+    inner->addGlobalParameter("k", 2.0);
+    inner->addEnergyParameterDerivative("k");
+    inner->addCollectiveVariable("d", d);
+    inner->addCollectiveVariable("t", t);
+    ExtendedCustomCVForce* middle = new ExtendedCustomCVForce("f(s)*w");
+    middle->addTabulatedFunction("f", new Continuous1DFunction(table, -1.0, 4.0));
+    middle->addCollectiveVariable("s", s);
+    middle->addCollectiveVariable("w", inner);
+    ExtendedCustomCVForce* outer = new ExtendedCustomCVForce("u+2*m; u=e^2");
+    outer->addCollectiveVariable("m", middle);
+    outer->addCollectiveVariable("e", e);
+    system.addForce(outer);
+    ExtendedCustomCVForce* expected = new ExtendedCustomCVForce("u+2*f(s)*(k*d^2+t); u=e^2");
+    expected->addGlobalParameter("k", 2.0);
+    expected->addEnergyParameterDerivative("k");
+    expected->addTabulatedFunction("f", new Continuous1DFunction(table, -1.0, 4.0));
+    expected->addCollectiveVariable("d", new CustomBondForce(*d));
+    expected->addCollectiveVariable("t", new CustomExternalForce(*t));
+    expected->addCollectiveVariable("s", new CustomExternalForce(*s));
+    expected->addCollectiveVariable("e", new CustomExternalForce(*e));
+    expectedSystem.addForce(expected);
+    OpenMM_SFMT::SFMT sfmt;
+    init_gen_rand(0, sfmt);
+    vector<Vec3> positions;
+    for (int i = 0; i < 3; i++)
+        positions.push_back(Vec3(genrand_real2(sfmt), genrand_real2(sfmt), genrand_real2(sfmt))*3);
+    VerletIntegrator integrator1(0.01), integrator2(0.01);
+    Context context(system, integrator1, platform);
+    Context expectedContext(expectedSystem, integrator2, platform);
+    context.setPositions(positions);
+    expectedContext.setPositions(positions);
+    ASSERT_EQUAL(4, outer->getInnerContext(context).getSystem().getNumForces());
+    ASSERT_EQUAL_TOL(2.0, context.getParameter("k"), 1e-10);
+    for (int repeat = 0; repeat < 3; repeat++) {
+        int types = State::Energy | State::Forces | State::ParameterDerivatives;
+        State state = context.getState(types);
+        State expectedState = expectedContext.getState(types);
+        ASSERT_EQUAL_TOL(expectedState.getPotentialEnergy(), state.getPotentialEnergy(), 1e-5);
+        for (int i = 0; i < 3; i++)
+            ASSERT_EQUAL_VEC(expectedState.getForces()[i], state.getForces()[i], 1e-5);
+        ASSERT_EQUAL_TOL(expectedState.getEnergyParameterDerivatives().at("k"), state.getEnergyParameterDerivatives().at("k"), 1e-5);
+
+        // The values of the nested variables should be those of their expressions.
+
+        vector<double> values;
+        outer->getCollectiveVariableValues(context, values);
+        ASSERT_EQUAL(2, values.size());
+        ASSERT_EQUAL_TOL(positions[1][2], values[1], 1e-5);
+        ASSERT_EQUAL_TOL((expectedState.getPotentialEnergy()-values[1]*values[1])/2, values[0], 1e-5);
+
+        // Changing a parameter or a tabulated function of a nested force should be reflected.
+
+        if (repeat == 0) {
+            context.setParameter("k", 3.0);
+            expectedContext.setParameter("k", 3.0);
+        }
+        else {
+            for (int i = 0; i < table.size(); i++)
+                table[i] = cos(0.3*i);
+            dynamic_cast<Continuous1DFunction&>(middle->getTabulatedFunction(0)).setFunctionParameters(table, -1.0, 4.0);
+            dynamic_cast<Continuous1DFunction&>(expected->getTabulatedFunction(0)).setFunctionParameters(table, -1.0, 4.0);
+            outer->updateParametersInContext(context);
+            expected->updateParametersInContext(expectedContext);
+        }
+    }
+}
+
+void testPlacedVariables() {
+    // A collective variable placed on another platform should give the same results as when it
+    // is evaluated in the inner Context, and be left out of it.
+
+    System system;
+    for (int i = 0; i < 3; i++)
+        system.addParticle(1.0);
+    ExtendedCustomCVForce* cv = new ExtendedCustomCVForce("v1*v2+v2^2");
+    CustomBondForce* v1 = new CustomBondForce("r");
+    v1->addBond(0, 1);
+    cv->addCollectiveVariable("v1", v1);
+    CustomExternalForce* v2 = new CustomExternalForce("k*x");
+    v2->addGlobalParameter("k", 1.5);
+    v2->addParticle(2);
+    cv->addCollectiveVariable("v2", v2);
+    system.addForce(cv);
+    OpenMM_SFMT::SFMT sfmt;
+    init_gen_rand(0, sfmt);
+    vector<Vec3> positions;
+    for (int i = 0; i < 3; i++)
+        positions.push_back(Vec3(genrand_real2(sfmt), genrand_real2(sfmt), genrand_real2(sfmt))*3);
+    VerletIntegrator integrator1(0.01), integrator2(0.01);
+    Context context1(system, integrator1, platform);
+    cv->setCollectiveVariablePlatform(1, "Reference");
+    Context context2(system, integrator2, platform);
+    ASSERT_EQUAL(2, cv->getInnerContext(context1).getSystem().getNumForces());
+    ASSERT_EQUAL(1, cv->getInnerContext(context2).getSystem().getNumForces());
+    context1.setPositions(positions);
+    context2.setPositions(positions);
+    for (int repeat = 0; repeat < 2; repeat++) {
+        State state1 = context1.getState(State::Energy | State::Forces);
+        State state2 = context2.getState(State::Energy | State::Forces);
+        ASSERT_EQUAL_TOL(state1.getPotentialEnergy(), state2.getPotentialEnergy(), 1e-5);
+        for (int i = 0; i < 3; i++)
+            ASSERT_EQUAL_VEC(state1.getForces()[i], state2.getForces()[i], 1e-5);
+        vector<double> values1, values2;
+        cv->getCollectiveVariableValues(context1, values1);
+        cv->getCollectiveVariableValues(context2, values2);
+        for (int i = 0; i < 2; i++)
+            ASSERT_EQUAL_TOL(values1[i], values2[i], 1e-5);
+
+        // The global parameters of a placed variable should follow those of the Context.
+
+        context1.setParameter("k", 2.5);
+        context2.setParameter("k", 2.5);
+    }
+}
+
 void runPlatformTests();
 
 int main(int argc, char* argv[]) {
@@ -222,7 +1048,21 @@ int main(int argc, char* argv[]) {
         testCVs();
         testEnergyParameterDerivatives();
         testTabulatedFunction();
+        testRadialBasisFunction();
+        testCustomSummation();
+        testCustomSummationDeposition();
+        testCollectiveVariableHistory();
+        testFrames();
+        testEvaluationInterval();
+        testOverlappingLocalizedCVs();
         testReordering();
+        testCounters();
+        testCompressedForces();
+        testDerivativesOnDemand();
+        testSharedParticles();
+        testCollectiveVariableBatches();
+        testNestedForces();
+        testPlacedVariables();
         runPlatformTests();
     }
     catch(const exception& e) {
@@ -0,0 +1,119 @@
+/* -------------------------------------------------------------------------- *
+                             OpenMM Laboratory                              *
+                             =================                              *
+                                                                            *
+ A plugin for testing low-level code implementation for OpenMM.             *
+                                                                            *
+ Copyright (c) 2023 Charlles Abreu                                          *
+ https://github.com/craabreu/openmm-lab                                     *
+ -------------------------------------------------------------------------- */
+
+#include "ExtendedCustomCVForce.h"
+#include "RadialBasisFunctionFitter.h"
+#include "openmm/internal/AssertionUtilities.h"
+#include "openmm/Context.h"
+#include "openmm/CustomExternalForce.h"
+#include "openmm/System.h"
+#include "openmm/VerletIntegrator.h"
+#include "sfmt/SFMT.h"
+#include <cmath>
+#include <iostream>
+#include <vector>
+
+using namespace OpenMMLab;
+using namespace OpenMM;
+using namespace std;
+
+void testInterpolation() {
+    // Centers are added one at a time, and the expansion must interpolate the values at
+    // all centers after each addition.
+
+    RadialBasisFunctionFitter fitter(2, 1.5);
+    OpenMM_SFMT::SFMT sfmt;
+    init_gen_rand(0, sfmt);
+    vector<vector<double>> points;
+    for (int k = 0; k < 40; k++) {
+        vector<double> center = {2*genrand_real2(sfmt)-1, 2*genrand_real2(sfmt)-1};
+        ASSERT_EQUAL(k, fitter.addCenter(center, sin(3*center[0])*cos(2*center[1])));
+        points.push_back(center);
+        for (int j = 0; j <= k; j++)
+            ASSERT_EQUAL_TOL(fitter.getValues()[j], fitter.evaluate(points[j]), 1e-6);
+    }
+
+    // Changing a value refits the weights.
+
+    fitter.setValue(7, 2.0);
+    for (int j = 0; j < points.size(); j++)
+        ASSERT_EQUAL_TOL(fitter.getValues()[j], fitter.evaluate(points[j]), 1e-6);
+    ASSERT_EQUAL_TOL(2.0, fitter.evaluate(points[7]), 1e-6);
+
+    // A duplicate center makes the kernel matrix singular, unless there is a regularization.
+
+    bool thrown = false;
+    try {
+        fitter.addCenter(points[3], 0.0);
+    }
+    catch (const OpenMMException& e) {
+        thrown = true;
+    }
+    ASSERT(thrown);
+    ASSERT_EQUAL(40, fitter.getNumCenters());
+    RadialBasisFunctionFitter regularized(2, 1.5, 0.1);
+    regularized.addCenter(points[0], 1.0);
+    regularized.addCenter(points[0], 1.0);
+    ASSERT_EQUAL_TOL(2.0/2.1, regularized.evaluate(points[0]), 1e-6);
+}
+
+void testUpdateForce() {
+    // The fitted expansion is copied to a force, refined, and copied again to the Context.
+
+    System system;
+    system.addParticle(1.0);
+    ExtendedCustomCVForce* cv = new ExtendedCustomCVForce("f");
+    CustomExternalForce* v1 = new CustomExternalForce("x");
+    v1->addParticle(0);
+    cv->addCollectiveVariable("x", v1);
+    CustomExternalForce* v2 = new CustomExternalForce("y");
+    v2->addParticle(0);
+    cv->addCollectiveVariable("y", v2);
+    RadialBasisFunctionFitter fitter(2, 2.0, 1e-3);
+    OpenMM_SFMT::SFMT sfmt;
+    init_gen_rand(0, sfmt);
+    for (int k = 0; k < 20; k++)
+        fitter.addCenter(vector<double>{2*genrand_real2(sfmt)-1, 2*genrand_real2(sfmt)-1}, genrand_real2(sfmt));
+    int index = fitter.addRadialBasisFunction(*cv, "f", vector<string>{"x", "y"});
+    system.addForce(cv);
+    VerletIntegrator integrator(0.01);
+    Context context(system, integrator, platform);
+    vector<Vec3> positions(1);
+    for (int i = 0; i < 2; i++) {
+        for (int j = 0; j < 5; j++) {
+            vector<double> point = {2*genrand_real2(sfmt)-1, 2*genrand_real2(sfmt)-1};
+            positions[0] = Vec3(point[0], point[1], 0.0);
+            context.setPositions(positions);
+            State state = context.getState(State::Energy);
+            ASSERT_EQUAL_TOL(fitter.evaluate(point), state.getPotentialEnergy(), 1e-4);
+        }
+        for (int k = 0; k < 10; k++)
+            fitter.addCenter(vector<double>{2*genrand_real2(sfmt)-1, 2*genrand_real2(sfmt)-1}, genrand_real2(sfmt));
+        fitter.updateRadialBasisFunction(*cv, index);
+        cv->updateParametersInContext(context);
+    }
+}
+
+void runPlatformTests();
+
+int main(int argc, char* argv[]) {
+    try {
+        initializeTests(argc, argv);
+        testInterpolation();
+        testUpdateForce();
+        runPlatformTests();
+    }
+    catch(const exception& e) {
+        cout << "exception: " << e.what() << endl;
+        return 1;
+    }
+    cout << "Done" << endl;
+    return 0;
+}
@@ -0,0 +1,87 @@
+/* -------------------------------------------------------------------------- *
+                             OpenMM Laboratory                              *
+                             =================                              *
+                                                                            *
+ A plugin for testing low-level code implementation for OpenMM.             *
+                                                                            *
+ Copyright (c) 2023 Charlles Abreu                                          *
+ https://github.com/craabreu/openmm-lab                                     *
+ -------------------------------------------------------------------------- */
+
+#include "CustomSummation.h"
+#include "SharedTermStore.h"
+#include "openmm/internal/AssertionUtilities.h"
+#include <cmath>
+#include <cstdio>
+#include <iostream>
+#include <string>
+#include <vector>
+
+using namespace OpenMMLab;
+using namespace OpenMM;
+using namespace std;
+
+void testMultipleWalkers() {
+    // Two walkers share a store, each with its own summation.  The file name includes
+    // the platform name, so that the tests of different platforms can run at once.
+
+    string path = "TestSharedTermStore" + platform.getName() + ".bin";
+    remove(path.c_str());
+    string expression = "h*exp(-(x1-s)^2/2)";
+    CustomSummation summation1(1, expression, map<string, double>(), vector<string>{"h", "s"}, platform, properties);
+    CustomSummation summation2(1, expression, map<string, double>(), vector<string>{"h", "s"}, platform, properties);
+    {
+        SharedTermStore walker1(path, 2), walker2(path, 2);
+        ASSERT_EQUAL(walker1.getVersion(), 0);
+        walker1.append(vector<double>{1.0, 0.0});
+        walker2.append(vector<double>{2.0, 1.0});
+        walker1.append(vector<double>{0.5, -1.0});
+        ASSERT_EQUAL(walker2.getVersion(), 3);
+        ASSERT_EQUAL(walker1.synchronize(summation1), 3);
+        ASSERT_EQUAL(walker1.getSynchronizedVersion(), 3);
+        ASSERT_EQUAL(walker1.synchronize(summation1), 0);
+        ASSERT_EQUAL(summation1.getNumTerms(), 3);
+
+        // Only the new terms are added in later synchronizations.
+
+        walker2.append(vector<double>{1.5, 2.0});
+        ASSERT_EQUAL(walker2.synchronize(summation2), 4);
+        ASSERT_EQUAL(walker1.synchronize(summation1), 1);
+        ASSERT_EQUAL(summation1.getNumTerms(), 4);
+        vector<double> args = {0.3};
+        double expected = exp(-0.09/2)+2*exp(-0.49/2)+0.5*exp(-1.69/2)+1.5*exp(-2.89/2);
+        ASSERT_EQUAL_TOL(expected, summation1.evaluate(args), 1e-5);
+        ASSERT_EQUAL_TOL(expected, summation2.evaluate(args), 1e-5);
+    }
+
+    // A store that is opened again keeps its terms, and must have the same number of
+    // parameters.
+
+    SharedTermStore reopened(path, 2);
+    ASSERT_EQUAL(reopened.getVersion(), 4);
+    bool thrown = false;
+    try {
+        SharedTermStore invalid(path, 3);
+    }
+    catch (const OpenMMException& e) {
+        thrown = true;
+    }
+    ASSERT(thrown);
+    remove(path.c_str());
+}
+
+void runPlatformTests();
+
+int main(int argc, char* argv[]) {
+    try {
+        initializeTests(argc, argv);
+        testMultipleWalkers();
+        runPlatformTests();
+    }
+    catch(const exception& e) {
+        cout << "exception: " << e.what() << endl;
+        return 1;
+    }
+    cout << "Done" << endl;
+    return 0;
+}
@@ -11,6 +11,7 @@
 #include "SlicedNonbondedForce.h"
 #include "internal/AssertionUtilities.h"
 #include "openmm/NonbondedForce.h"
+#include "openmm/OpenMMException.h"
 #include "openmm/Context.h"
 #include "openmm/reference/ReferencePlatform.h"
 #include "openmm/HarmonicBondForce.h"
@@ -70,6 +71,68 @@ void testInstantiateFromNonbondedForce(NonbondedForce::NonbondedMethod method) {
     assertForcesAndEnergy(context, TOL);
 }
 
+void testParticleSubsets() {
+    SlicedNonbondedForce force(3);
+    for (int i = 0; i < 10; i++)
+        force.addParticle(0.0, 1.0, 0.0);
+    force.setParticleSubset(4, 2);
+    vector<int> subsets = force.getParticleSubsets();
+    ASSERT_EQUAL(10, subsets.size());
+    for (int i = 0; i < 10; i++)
+        ASSERT_EQUAL(i == 4 ? 2 : 0, subsets[i]);
+    for (int i = 0; i < 10; i++)
+        subsets[i] = i%3;
+    force.setParticleSubsets(subsets);
+    for (int i = 0; i < 10; i++)
+        ASSERT_EQUAL(i%3, force.getParticleSubset(i));
+
+    // Particles added later belong to subset 0.
+
+    force.addParticle(0.0, 1.0, 0.0);
+    ASSERT_EQUAL(0, force.getParticleSubset(10));
+    ASSERT_EQUAL(11, force.getParticleSubsets().size());
+    bool thrown = false;
+    try {
+        force.setParticleSubsets(subsets);
+    }
+    catch (const OpenMMException& e) {
+        thrown = true;
+    }
+    ASSERT(thrown);
+}
+
+void testBulkParameterOffsets() {
+    SlicedNonbondedForce force(2);
+    for (int i = 0; i < 10; i++)
+        force.addParticle(0.0, 1.0, 0.0);
+    force.addGlobalParameter("lambda", 1.0);
+    force.addParticleParameterOffset("lambda", 0, 1.0, 2.0, 3.0);
+    vector<int> particles = {3, 5, 9};
+    vector<double> chargeScales = {0.1, 0.2, 0.3}, sigmaScales = {0.4, 0.5, 0.6}, epsilonScales = {0.7, 0.8, 0.9};
+    ASSERT_EQUAL(1, force.addParticleParameterOffsets("lambda", particles, chargeScales, sigmaScales, epsilonScales));
+    ASSERT_EQUAL(4, force.getNumParticleParameterOffsets());
+    for (int i = 0; i < 3; i++) {
+        string parameter;
+        int particle;
+        double chargeScale, sigmaScale, epsilonScale;
+        force.getParticleParameterOffset(i+1, parameter, particle, chargeScale, sigmaScale, epsilonScale);
+        ASSERT_EQUAL("lambda", parameter);
+        ASSERT_EQUAL(particles[i], particle);
+        ASSERT_EQUAL(chargeScales[i], chargeScale);
+        ASSERT_EQUAL(sigmaScales[i], sigmaScale);
+        ASSERT_EQUAL(epsilonScales[i], epsilonScale);
+    }
+    bool thrown = false;
+    try {
+        force.addParticleParameterOffsets("lambda", particles, chargeScales, sigmaScales, vector<double>(2));
+    }
+    catch (const OpenMMException& e) {
+        thrown = true;
+    }
+    ASSERT(thrown);
+    ASSERT_EQUAL(4, force.getNumParticleParameterOffsets());
+}
+
 void testCoulomb() {
     System system;
     system.addParticle(1.0);
@@ -120,6 +183,51 @@ void testLJ() {
     assertEqualTo(4.0*eps*(pow(x, 12.0)-pow(x, 6.0)), state.getPotentialEnergy(), TOL);
 }
 
+void testSoftCore() {
+    // Two particles in different subsets interact through a soft-core slice, whose energy
+    // is lambda*4*eps*(1/s^2-1/s), with s = alpha*(1-lambda)^power+(r/sigma)^6.
+
+    System system;
+    system.addParticle(1.0);
+    system.addParticle(1.0);
+    VerletIntegrator integrator(0.01);
+    SlicedNonbondedForce* forceField = new SlicedNonbondedForce(2);
+    forceField->addParticle(0, 1.2, 1);
+    forceField->addParticle(0, 1.4, 2);
+    forceField->setParticleSubset(1, 1);
+    forceField->addGlobalParameter("lambda", 0.4);
+    forceField->addScalingParameter("lambda", 0, 1, false, true);
+    forceField->addScalingParameterDerivative("lambda");
+    const double alpha = 0.5, power = 2.0;
+    forceField->setSliceSoftCoreParameters(1, 0, alpha, power);
+    ASSERT(forceField->getUseSoftCore());
+    bool thrown = false;
+    try {
+        forceField->setSliceSoftCoreParameters(0, 1, -1.0, 1.0);
+    }
+    catch (const OpenMMException& e) {
+        thrown = true;
+    }
+    ASSERT(thrown);
+    system.addForce(forceField);
+    Context context(system, integrator, platform);
+    const double r = 1.1, sigma = 1.3, eps = SQRT_TWO;
+    vector<Vec3> positions = {Vec3(0, 0, 0), Vec3(r, 0, 0)};
+    context.setPositions(positions);
+    for (double lambda : {0.4, 1.0}) {
+        context.setParameter("lambda", lambda);
+        State state = context.getState(State::Forces | State::Energy | State::ParameterDerivatives);
+        double s = alpha*pow(1-lambda, power)+pow(r/sigma, 6.0);
+        double dEds = lambda*4*eps*(1/s-2/(s*s))/s;
+        double force = dEds*6*pow(r, 5.0)/pow(sigma, 6.0);
+        double derivative = 4*eps*(1/(s*s)-1/s) - dEds*alpha*power*pow(1-lambda, power-1);
+        assertEqualTo(lambda*4*eps*(1/(s*s)-1/s), state.getPotentialEnergy(), TOL);
+        assertEqualVec(Vec3(force, 0, 0), state.getForces()[0], TOL);
+        assertEqualVec(Vec3(-force, 0, 0), state.getForces()[1], TOL);
+        assertEqualTo(derivative, state.getEnergyParameterDerivatives().at("lambda"), TOL);
+    }
+}
+
 void testExclusionsAnd14() {
     System system;
     SlicedNonbondedForce* sliced = new SlicedNonbondedForce(1);
@@ -662,6 +770,27 @@ void testDispersionCorrection() {
     term2 /= (numParticles*(numParticles+1))/2;
     expected = 8*M_PI*numParticles*numParticles*(term1-term2)/(boxSize*boxSize*boxSize);
     assertEqualTo(expected, energy1-energy2, tol);
+
+    // Changing some of the particles back must update the correction as reinitializing does.
+
+    for (int i = 0; i < numParticles; i += 4)
+        sliced->setParticleParameters(i, 0, 1.1, 0.5);
+    sliced->updateParametersInContext(context);
+    double updated = context.getState(State::Energy).getPotentialEnergy();
+    context.reinitialize();
+    context.setPositions(positions);
+    assertEqualTo(context.getState(State::Energy).getPotentialEnergy(), updated, tol);
+
+    // Changes of fewer particles than there are classes update the correction incrementally,
+    // including when a new class is created.
+
+    sliced->setParticleParameters(1, 0, 1.2, 0.8);
+    sliced->setParticleParameters(3, 0, 1.0, 1.0);
+    sliced->updateParametersInContext(context);
+    updated = context.getState(State::Energy).getPotentialEnergy();
+    context.reinitialize();
+    context.setPositions(positions);
+    assertEqualTo(context.getState(State::Energy).getPotentialEnergy(), updated, tol);
 }
 
 void testChangingParameters() {
@@ -731,6 +860,56 @@ void testChangingParameters() {
     assertForcesAndEnergy(context, TOL);
 }
 
+void testExceptionOrder() {
+    // The exceptions are interleaved among the slices, so that the order in which they are
+    // computed differs from the order in which they were added.
+
+    const int numParticles = 30;
+    System system;
+    SlicedNonbondedForce* force = new SlicedNonbondedForce(3);
+    vector<Vec3> positions(numParticles);
+    for (int i = 0; i < numParticles; i++) {
+        system.addParticle(1.0);
+        force->addParticle((i%2 == 0 ? 0.5 : -0.5), 0.3, 0.4);
+        force->setParticleSubset(i, (i/2)%3);
+        positions[i] = Vec3(0.3*i, 0.1*(i%3), 0.2*(i%4));
+    }
+    for (int i = 0; i < numParticles-1; i++)
+        force->addException(i, i+1, 0.1*(i%5+1), 0.3, 0.2*(i%3+1));
+    force->addGlobalParameter("lambda", 0.0);
+    force->addScalingParameter("lambda", 0, 1, true, true);
+    force->addGlobalParameter("eta", 0.5);
+    force->addScalingParameter("eta", 1, 2, true, false);
+    system.addForce(force);
+    VerletIntegrator integrator1(0.001);
+    Context context1(system, integrator1, platform);
+    context1.setPositions(positions);
+    context1.getState(State::Energy);
+
+    // Move some particles to other subsets, so that the slices of the exceptions no longer
+    // match the order in which they were sorted, and compare with a new Context.
+
+    for (int i = 0; i < numParticles; i += 4)
+        force->setParticleSubset(i, (force->getParticleSubset(i)+1)%3);
+    force->updateParametersInContext(context1);
+    VerletIntegrator integrator2(0.001);
+    Context context2(system, integrator2, platform);
+    context2.setPositions(positions);
+    State state1 = context1.getState(State::Energy | State::Forces);
+    State state2 = context2.getState(State::Energy | State::Forces);
+    assertEnergy(state1, state2, TOL);
+    assertForces(state1, state2, TOL);
+
+    // Switch a slice back on.
+
+    context1.setParameter("lambda", 0.7);
+    context2.setParameter("lambda", 0.7);
+    state1 = context1.getState(State::Energy | State::Forces);
+    state2 = context2.getState(State::Energy | State::Forces);
+    assertEnergy(state1, state2, TOL);
+    assertForces(state1, state2, TOL);
+}
+
 void testSwitchingFunction(SlicedNonbondedForce::NonbondedMethod method) {
     System system;
     system.setDefaultPeriodicBoxVectors(Vec3(6, 0, 0), Vec3(0, 6, 0), Vec3(0, 0, 6));
@@ -900,6 +1079,91 @@ void testParameterOffsets() {
     assertEqualTo(energy, context.getState(State::Energy).getPotentialEnergy(), 1e-4);
 }
 
+void testExclusionParameterOffsets() {
+    // With PME, changing a global parameter updates the exclusions of the particles whose
+    // offsets depend on it, which must agree with a Context created with the new value.
+
+    const int numParticles = 12;
+    System system;
+    system.setDefaultPeriodicBoxVectors(Vec3(3, 0, 0), Vec3(0, 3, 0), Vec3(0, 0, 3));
+    SlicedNonbondedForce* force = new SlicedNonbondedForce(2);
+    force->setNonbondedMethod(SlicedNonbondedForce::PME);
+    force->setCutoffDistance(1.0);
+    vector<Vec3> positions(numParticles);
+    for (int i = 0; i < numParticles; i++) {
+        system.addParticle(1.0);
+        force->addParticle((i%2 == 0 ? 0.4 : -0.4), 0.3, 0.5);
+        force->setParticleSubset(i, i%2);
+        positions[i] = Vec3(0.25*i, 0.1*(i%3), 0.15*(i%4));
+    }
+    for (int i = 0; i < numParticles-1; i += 2)
+        force->addException(i, i+1, 0.0, 1.0, 0.0);
+    force->addException(1, 2, 0.2, 0.3, 0.4);
+    force->addGlobalParameter("p1", 0.0);
+    force->addGlobalParameter("p2", 1.0);
+    force->addParticleParameterOffset("p1", 0, 0.5, 0.0, 0.0);
+    force->addParticleParameterOffset("p1", 5, -0.3, 0.0, 0.0);
+    force->addParticleParameterOffset("p2", 8, 0.2, 0.0, 0.0);
+    system.addForce(force);
+    VerletIntegrator integrator1(0.001);
+    Context context1(system, integrator1, platform);
+    context1.setPositions(positions);
+    context1.getState(State::Energy);
+    context1.setParameter("p1", 0.8);
+    force->setGlobalParameterDefaultValue(0, 0.8);
+    VerletIntegrator integrator2(0.001);
+    Context context2(system, integrator2, platform);
+    context2.setPositions(positions);
+    State state1 = context1.getState(State::Energy | State::Forces);
+    State state2 = context2.getState(State::Energy | State::Forces);
+    assertEnergy(state1, state2, TOL);
+    assertForces(state1, state2, TOL);
+}
+
+void testSuccessiveParameterOffsetChanges() {
+    // Change the offset parameters one at a time, so that only some particles and exceptions
+    // are updated, and compare each result with a Context created with the same values.
+
+    System system;
+    for (int i = 0; i < 4; i++)
+        system.addParticle(1.0);
+    SlicedNonbondedForce* force = new SlicedNonbondedForce(2);
+    force->addParticle(0.0, 1.0, 0.5);
+    force->addParticle(1.0, 0.5, 0.6);
+    force->addParticle(-1.0, 2.0, 0.7);
+    force->addParticle(0.5, 2.0, 0.8);
+    force->setParticleSubset(2, 1);
+    force->setParticleSubset(3, 1);
+    force->addException(0, 3, 0.0, 1.0, 0.0);
+    force->addException(2, 3, 0.5, 1.0, 1.5);
+    force->addGlobalParameter("p1", 0.0);
+    force->addGlobalParameter("p2", 1.0);
+    force->addParticleParameterOffset("p1", 0, 3.0, 0.5, 0.5);
+    force->addParticleParameterOffset("p2", 0, -1.0, 0.2, 0.1);
+    force->addParticleParameterOffset("p2", 1, 1.0, 1.0, 2.0);
+    force->addExceptionParameterOffset("p1", 1, 0.5, 0.5, 1.5);
+    system.addForce(force);
+    vector<Vec3> positions(4);
+    for (int i = 0; i < 4; i++)
+        positions[i] = Vec3(i, 0.1*i, 0);
+    VerletIntegrator integrator1(0.001);
+    Context context1(system, integrator1, platform);
+    context1.setPositions(positions);
+    vector<pair<string, double>> changes = {{"p1", 0.5}, {"p2", 1.5}, {"p1", 0.2}, {"p2", 0.0}};
+    for (auto& change : changes) {
+        context1.getState(State::Energy);
+        context1.setParameter(change.first, change.second);
+        force->setGlobalParameterDefaultValue(change.first == "p1" ? 0 : 1, change.second);
+        VerletIntegrator integrator2(0.001);
+        Context context2(system, integrator2, platform);
+        context2.setPositions(positions);
+        State state1 = context1.getState(State::Energy | State::Forces);
+        State state2 = context2.getState(State::Energy | State::Forces);
+        assertEnergy(state1, state2, TOL);
+        assertForces(state1, state2, TOL);
+    }
+}
+
 void testEwaldExceptions() {
     // Create a minimal system using LJPME.
 
@@ -984,6 +1248,91 @@ void testDirectAndReciprocal() {
     assertEqualTo(e3, e4, 1e-4);
 }
 
+void testInterpolationOrder() {
+    // With fine grids, every interpolation order must converge to the same result.
+
+    const int numParticles = 50;
+    const double L = 3.0;
+    System system;
+    for (int i = 0; i < numParticles; i++)
+        system.addParticle(1.0);
+    system.setDefaultPeriodicBoxVectors(Vec3(L, 0, 0), Vec3(0, L, 0), Vec3(0, 0, L));
+    SlicedNonbondedForce* force = new SlicedNonbondedForce(2);
+    system.addForce(force);
+    force->setNonbondedMethod(SlicedNonbondedForce::LJPME);
+    force->setCutoffDistance(1.0);
+    force->setPMEParameters(3.0, 48, 48, 48);
+    force->setLJPMEParameters(2.5, 48, 48, 48);
+    OpenMM_SFMT::SFMT sfmt;
+    init_gen_rand(0, sfmt);
+    vector<Vec3> positions(numParticles);
+    for (int i = 0; i < numParticles; i++) {
+        force->addParticle(i%2 == 0 ? 0.5 : -0.5, 0.3, 1.0);
+        force->setParticleSubset(i, i%3 == 0 ? 1 : 0);
+        positions[i] = Vec3(L*genrand_real2(sfmt), L*genrand_real2(sfmt), L*genrand_real2(sfmt));
+    }
+    force->addGlobalParameter("lambda", 0.5);
+    force->addScalingParameter("lambda", 0, 1, true, true);
+    ASSERT_EQUAL(5, force->getPMEInterpolationOrder());
+    VerletIntegrator integrator(0.001);
+    Context context(system, integrator, platform);
+    context.setPositions(positions);
+    State state1 = context.getState(State::Energy | State::Forces);
+    for (int order : {4, 6}) {
+        force->setPMEInterpolationOrder(order);
+        ASSERT_EQUAL(order, force->getPMEInterpolationOrder());
+        context.reinitialize(true);
+        State state2 = context.getState(State::Energy | State::Forces);
+        assertEnergy(state1, state2, 1e-3);
+        assertForces(state1, state2, 1e-3);
+    }
+    bool thrown = false;
+    try {
+        force->setPMEInterpolationOrder(3);
+    }
+    catch (const OpenMMException& e) {
+        thrown = true;
+    }
+    ASSERT(thrown);
+}
+
+void testUnequalGridSizes() {
+    // A box with different edge lengths and grids with different numbers of points along
+    // each axis, so that mixing up the grid dimensions in any step of PME or LJPME changes
+    // the results.  The force is compared with a NonbondedForce using the same grids.
+
+    const int nx = 6, ny = 7, nz = 8;
+    const double spacing = 0.5;
+    NonbondedForce* force = new NonbondedForce();
+    force->setNonbondedMethod(NonbondedForce::LJPME);
+    force->setCutoffDistance(1.0);
+    force->setPMEParameters(3.0, 24, 32, 40);
+    force->setLJPMEParameters(2.5, 20, 28, 36);
+    OpenMM_SFMT::SFMT sfmt;
+    init_gen_rand(0, sfmt);
+    System system;
+    system.setDefaultPeriodicBoxVectors(Vec3(nx*spacing, 0, 0), Vec3(0, ny*spacing, 0), Vec3(0, 0, nz*spacing));
+    vector<Vec3> positions;
+    for (int i = 0; i < nx; i++)
+        for (int j = 0; j < ny; j++)
+            for (int k = 0; k < nz; k++) {
+                int index = system.addParticle(1.0);
+                force->addParticle(index%2 == 0 ? 0.5 : -0.5, 0.3, 0.5);
+                Vec3 jitter(genrand_real2(sfmt)-0.5, genrand_real2(sfmt)-0.5, genrand_real2(sfmt)-0.5);
+                positions.push_back(Vec3(i, j, k)*spacing+jitter*0.2);
+            }
+    SlicedNonbondedForce* sliced = new SlicedNonbondedForce(*force, 2);
+    for (int i = 0; i < system.getNumParticles(); i++)
+        sliced->setParticleSubset(i, i%3 == 0 ? 1 : 0);
+    sliced->setForceGroup(1);
+    system.addForce(force);
+    system.addForce(sliced);
+    VerletIntegrator integrator(0.001);
+    Context context(system, integrator, platform);
+    context.setPositions(positions);
+    assertForcesAndEnergy(context, TOL);
+}
+
 void testOpenMMLab(OpenMM_SFMT::SFMT& sfmt, NonbondedForce::NonbondedMethod method, bool exceptions, bool lj) {
     bool includeLJ = lj;
     bool includeCoulomb = !lj;
@@ -1293,6 +1642,345 @@ void testScalingParameterSeparation(OpenMM_SFMT::SFMT& sfmt, NonbondedForce::Non
     assertEqualTo(derivatives1["alpha"]+derivatives1["beta"], derivatives2["gamma"], tol);
 }
 
+void testSliceEnergies(OpenMM_SFMT::SFMT& sfmt, NonbondedForce::NonbondedMethod method, bool separateReciprocal) {
+    const int numParticles = 60;
+    const double L = 4.0;
+    double tol = (platform.getName() == "Reference" || platform.getPropertyDefaultValue("Precision") == string("double")) ? 1e-4 : 1e-3;
+
+    System system;
+    system.setDefaultPeriodicBoxVectors(Vec3(L, 0, 0), Vec3(0, L, 0), Vec3(0, 0, L));
+    SlicedNonbondedForce* force = new SlicedNonbondedForce(3);
+    force->setNonbondedMethod((SlicedNonbondedForce::NonbondedMethod) method);
+    force->setCutoffDistance(1.2);
+    force->setUseDispersionCorrection(true);
+    if (separateReciprocal)
+        force->setReciprocalSpaceForceGroup(1);
+    vector<Vec3> positions(numParticles);
+    for (int i = 0; i < numParticles; i++) {
+        system.addParticle(1.0);
+        force->addParticle(i%2 == 0 ? 0.5 : -0.5, 0.3, 0.5);
+        force->setParticleSubset(i, i%3);
+        Vec3 site(i%4+0.5, (i/4)%4+0.5, i/16+0.5);
+        positions[i] = site + Vec3(genrand_real2(sfmt), genrand_real2(sfmt), genrand_real2(sfmt))*0.2;
+    }
+    for (int i = 0; i < numParticles-1; i += 2)
+        force->addException(i, i+1, 0.1, 0.3, 0.2);
+    force->addGlobalParameter("lambdaCoulomb", 0.7);
+    force->addGlobalParameter("lambdaLJ", 0.4);
+    force->addGlobalParameter("gamma", 0.2);
+    force->addScalingParameter("lambdaCoulomb", 0, 1, true, false);
+    force->addScalingParameter("lambdaLJ", 0, 1, false, true);
+    force->addScalingParameter("gamma", 2, 2, true, true);
+    system.addForce(force);
+
+    // A bonded force in the same group must not leak into the slice energies.
+
+    HarmonicBondForce* bonds = new HarmonicBondForce();
+    bonds->addBond(0, 1, 0.1, 1000.0);
+    system.addForce(bonds);
+
+    VerletIntegrator integrator(0.001);
+    Context context(system, integrator, platform);
+    context.setPositions(positions);
+    vector<double> coulombEnergies, ljEnergies;
+    force->getSliceEnergiesInContext(context, coulombEnergies, ljEnergies);
+    ASSERT_EQUAL(force->getNumSlices(), coulombEnergies.size());
+    ASSERT_EQUAL(force->getNumSlices(), ljEnergies.size());
+
+    // The energy for any set of scaling parameters must be recovered from the slice energies.
+
+    double bondEnergy = context.getState(State::Energy, false, 1<<bonds->getForceGroup()).getPotentialEnergy();
+    vector<vector<double>> parameterSets = {{0.7, 0.4, 0.2}, {1.0, 0.0, 1.0}, {0.0, 0.5, 0.3}, {0.0, 0.0, 1.0}};
+
+    // So must the foreign energies, where a parameter missing from a set keeps its current value.
+
+    for (int k = 0; k < parameterSets.size(); k++) {
+        map<string, double> foreignSet = {{"lambdaCoulomb", parameterSets[k][0]}, {"lambdaLJ", parameterSets[k][1]}};
+        if (k > 0)
+            foreignSet["gamma"] = parameterSets[k][2];
+        force->addForeignScalingParameterSet(foreignSet);
+    }
+    vector<double> foreignEnergies;
+    force->getForeignEnergiesInContext(context, foreignEnergies);
+    ASSERT_EQUAL(parameterSets.size(), foreignEnergies.size());
+    for (int k = 0; k < parameterSets.size(); k++) {
+        vector<double>& values = parameterSets[k];
+        context.setParameter("lambdaCoulomb", values[0]);
+        context.setParameter("lambdaLJ", values[1]);
+        context.setParameter("gamma", values[2]);
+        double expected = 0.0;
+        for (int slice = 0; slice < force->getNumSlices(); slice++) {
+            double lambdaCoulomb = 1.0, lambdaLJ = 1.0;
+            if (slice == sliceIndex(0, 1)) {
+                lambdaCoulomb = values[0];
+                lambdaLJ = values[1];
+            }
+            else if (slice == sliceIndex(2, 2))
+                lambdaCoulomb = lambdaLJ = values[2];
+            expected += lambdaCoulomb*coulombEnergies[slice] + lambdaLJ*ljEnergies[slice];
+        }
+        double energy = context.getState(State::Energy).getPotentialEnergy()-bondEnergy;
+        ASSERT_EQUAL_TOL(expected, energy, tol);
+        ASSERT_EQUAL_TOL(energy, foreignEnergies[k], tol);
+    }
+}
+
+void testReplicaEnergies(OpenMM_SFMT::SFMT& sfmt) {
+    const int numParticles = 60;
+    const int numReplicas = 3;
+    const double L = 4.0;
+    double tol = (platform.getName() == "Reference" || platform.getPropertyDefaultValue("Precision") == string("double")) ? 1e-4 : 1e-3;
+
+    System system;
+    system.setDefaultPeriodicBoxVectors(Vec3(L, 0, 0), Vec3(0, L, 0), Vec3(0, 0, L));
+    SlicedNonbondedForce* force = new SlicedNonbondedForce(2);
+    force->setNonbondedMethod(SlicedNonbondedForce::PME);
+    force->setCutoffDistance(1.2);
+    vector<vector<Vec3>> positions(numReplicas, vector<Vec3>(numParticles));
+    for (int i = 0; i < numParticles; i++) {
+        system.addParticle(1.0);
+        force->addParticle(i%2 == 0 ? 0.5 : -0.5, 0.3, 0.5);
+        force->setParticleSubset(i, i < 4 ? 1 : 0);
+        Vec3 site(i%4+0.5, (i/4)%4+0.5, i/16+0.5);
+        for (int r = 0; r < numReplicas; r++)
+            positions[r][i] = site + Vec3(genrand_real2(sfmt), genrand_real2(sfmt), genrand_real2(sfmt))*0.2;
+    }
+    force->addGlobalParameter("lambdaCoulomb", 1.0);
+    force->addGlobalParameter("lambdaLJ", 1.0);
+    force->addScalingParameter("lambdaCoulomb", 0, 1, true, false);
+    force->addScalingParameter("lambdaLJ", 0, 1, false, true);
+    for (int r = 0; r < numReplicas; r++)
+        force->addForeignScalingParameterSet({{"lambdaCoulomb", 1.0-0.5*r}, {"lambdaLJ", 1.0-0.3*r}});
+    system.addForce(force);
+
+    VerletIntegrator integrator(0.001);
+    Context context(system, integrator, platform);
+    context.setPositions(positions[0]);
+    vector<vector<double>> energies;
+    force->getReplicaEnergiesInContext(context, positions, energies);
+    ASSERT_EQUAL(numReplicas, energies.size());
+
+    // The positions of the Context must be restored.
+
+    State state = context.getState(State::Positions);
+    for (int i = 0; i < numParticles; i++)
+        ASSERT_EQUAL_VEC(positions[0][i], state.getPositions()[i], 1e-6);
+
+    // Every replica must match the foreign energies computed at its own positions.
+
+    for (int r = 0; r < numReplicas; r++) {
+        context.setPositions(positions[r]);
+        vector<double> foreignEnergies;
+        force->getForeignEnergiesInContext(context, foreignEnergies);
+        ASSERT_EQUAL(numReplicas, energies[r].size());
+        for (int k = 0; k < numReplicas; k++)
+            ASSERT_EQUAL_TOL(foreignEnergies[k], energies[r][k], tol);
+    }
+}
+
+void testReducedForeignEnergies(OpenMM_SFMT::SFMT& sfmt) {
+    const int numParticles = 60;
+    const int numFrames = 3;
+    const int numSets = 4;
+    const double L = 4.0;
+    const double temperature = 300.0;
+    double tol = (platform.getName() == "Reference" || platform.getPropertyDefaultValue("Precision") == string("double")) ? 1e-4 : 1e-3;
+
+    System system;
+    system.setDefaultPeriodicBoxVectors(Vec3(L, 0, 0), Vec3(0, L, 0), Vec3(0, 0, L));
+    SlicedNonbondedForce* force = new SlicedNonbondedForce(2);
+    force->setNonbondedMethod(SlicedNonbondedForce::PME);
+    force->setCutoffDistance(1.2);
+    vector<vector<Vec3>> frames(numFrames, vector<Vec3>(numParticles));
+    vector<vector<Vec3>> boxVectors(numFrames);
+    for (int n = 0; n < numFrames; n++) {
+        double size = L*(1.0+0.02*n);
+        boxVectors[n] = {Vec3(size, 0, 0), Vec3(0, size, 0), Vec3(0, 0, size)};
+    }
+    for (int i = 0; i < numParticles; i++) {
+        system.addParticle(1.0);
+        force->addParticle(i%2 == 0 ? 0.5 : -0.5, 0.3, 0.5);
+        force->setParticleSubset(i, i < 4 ? 1 : 0);
+        Vec3 site(i%4+0.5, (i/4)%4+0.5, i/16+0.5);
+        for (int n = 0; n < numFrames; n++)
+            frames[n][i] = site + Vec3(genrand_real2(sfmt), genrand_real2(sfmt), genrand_real2(sfmt))*0.2;
+    }
+    force->addGlobalParameter("lambdaCoulomb", 1.0);
+    force->addGlobalParameter("lambdaLJ", 1.0);
+    force->addScalingParameter("lambdaCoulomb", 0, 1, true, false);
+    force->addScalingParameter("lambdaLJ", 0, 1, false, true);
+    for (int k = 0; k < numSets; k++)
+        force->addForeignScalingParameterSet({{"lambdaCoulomb", 1.0-0.3*k}, {"lambdaLJ", 1.0-0.2*k}});
+    system.addForce(force);
+
+    VerletIntegrator integrator(0.001);
+    Context context(system, integrator, platform);
+    context.setPositions(frames[0]);
+    vector<vector<double>> reducedEnergies;
+    force->getReducedForeignEnergiesInContext(context, frames, boxVectors, temperature, reducedEnergies);
+    ASSERT_EQUAL(numSets, reducedEnergies.size());
+
+    // The box vectors of the Context must be restored.
+
+    Vec3 a, b, c;
+    context.getState(State::Positions).getPeriodicBoxVectors(a, b, c);
+    ASSERT_EQUAL_VEC(Vec3(L, 0, 0), a, 1e-6);
+    ASSERT_EQUAL_VEC(Vec3(0, L, 0), b, 1e-6);
+    ASSERT_EQUAL_VEC(Vec3(0, 0, L), c, 1e-6);
+
+    // Every frame must match the foreign energies computed in its own box, divided by kT.
+
+    double kT = BOLTZ*temperature;
+    for (int n = 0; n < numFrames; n++) {
+        context.setPeriodicBoxVectors(boxVectors[n][0], boxVectors[n][1], boxVectors[n][2]);
+        context.setPositions(frames[n]);
+        vector<double> foreignEnergies;
+        force->getForeignEnergiesInContext(context, foreignEnergies);
+        for (int k = 0; k < numSets; k++) {
+            ASSERT_EQUAL(numFrames, reducedEnergies[k].size());
+            ASSERT_EQUAL_TOL(foreignEnergies[k]/kT, reducedEnergies[k][n], tol);
+        }
+    }
+}
+
+void testScalingParameterDerivatives(OpenMM_SFMT::SFMT& sfmt, NonbondedForce::NonbondedMethod method) {
+    const int numParticles = 60;
+    const double L = 4.0;
+    double tol = (platform.getName() == "Reference" || platform.getPropertyDefaultValue("Precision") == string("double")) ? 1e-4 : 1e-3;
+
+    System system;
+    system.setDefaultPeriodicBoxVectors(Vec3(L, 0, 0), Vec3(0, L, 0), Vec3(0, 0, L));
+    SlicedNonbondedForce* force = new SlicedNonbondedForce(3);
+    force->setNonbondedMethod((SlicedNonbondedForce::NonbondedMethod) method);
+    force->setCutoffDistance(1.2);
+    force->setUseDispersionCorrection(true);
+    vector<Vec3> positions(numParticles);
+    for (int i = 0; i < numParticles; i++) {
+        system.addParticle(1.0);
+        force->addParticle(i%2 == 0 ? 0.5 : -0.5, 0.3, 0.5);
+        force->setParticleSubset(i, i < 4 ? 0 : (i < 10 ? 1 : 2));
+        Vec3 site(i%4+0.5, (i/4)%4+0.5, i/16+0.5);
+        positions[i] = site + Vec3(genrand_real2(sfmt), genrand_real2(sfmt), genrand_real2(sfmt))*0.2;
+    }
+    force->addGlobalParameter("lambdaCoulomb", 0.7);
+    force->addGlobalParameter("lambdaLJ", 0.4);
+    force->addGlobalParameter("gamma", 0.2);
+    force->addScalingParameter("lambdaCoulomb", 0, 2, true, false);
+    force->addScalingParameter("lambdaLJ", 0, 2, false, true);
+    force->addScalingParameter("gamma", 1, 2, true, true);
+    force->addScalingParameterDerivative("lambdaCoulomb");
+    force->addScalingParameterDerivative("lambdaLJ");
+    system.addForce(force);
+
+    VerletIntegrator integrator(0.001);
+    Context context(system, integrator, platform);
+    context.setPositions(positions);
+
+    // The derivatives must match those of a full evaluation, which must not be disturbed.
+
+    map<string, double> derivatives = force->getScalingParameterDerivativesInContext(context);
+    State state = context.getState(State::Energy | State::ParameterDerivatives);
+    map<string, double> expected = state.getEnergyParameterDerivatives();
+    ASSERT_EQUAL(2, derivatives.size());
+    for (string name : {"lambdaCoulomb", "lambdaLJ"})
+        ASSERT_EQUAL_TOL(expected[name], derivatives[name], tol);
+    ASSERT_EQUAL_TOL(state.getPotentialEnergy(), context.getState(State::Energy).getPotentialEnergy(), tol);
+}
+
+void testZeroScalingParameters(OpenMM_SFMT::SFMT& sfmt, NonbondedForce::NonbondedMethod method) {
+    const int numParticles = 60;
+    const double L = 4.0;
+    double tol = (platform.getName() == "Reference" || platform.getPropertyDefaultValue("Precision") == string("double")) ? 1e-5 : 1e-4;
+
+    System system;
+    system.setDefaultPeriodicBoxVectors(Vec3(L, 0, 0), Vec3(0, L, 0), Vec3(0, 0, L));
+    SlicedNonbondedForce* force = new SlicedNonbondedForce(2);
+    force->setNonbondedMethod((SlicedNonbondedForce::NonbondedMethod) method);
+    force->setCutoffDistance(1.2);
+    vector<Vec3> positions(numParticles);
+    for (int i = 0; i < numParticles; i++) {
+        system.addParticle(1.0);
+        force->addParticle(i%2 == 0 ? 0.5 : -0.5, 0.3, 0.5);
+        force->setParticleSubset(i, i < 10 ? 0 : 1);
+        Vec3 site(i%4+0.5, (i/4)%4+0.5, i/16+0.5);
+        positions[i] = site + Vec3(genrand_real2(sfmt), genrand_real2(sfmt), genrand_real2(sfmt))*0.2;
+    }
+    force->addGlobalParameter("lambda", 0.0);
+    force->addScalingParameter("lambda", 0, 1, true, true);
+    system.addForce(force);
+
+    VerletIntegrator integrator(0.001);
+    Context context(system, integrator, platform);
+    context.setPositions(positions);
+
+    // A slice whose scaling parameters are zero may be skipped when energies are not needed,
+    // which must not change the forces.
+
+    State state1 = context.getState(State::Forces);
+    State state2 = context.getState(State::Forces | State::Energy);
+    assertForces(state1, state2, tol);
+    context.setParameter("lambda", 0.5);
+    State state3 = context.getState(State::Forces);
+    State state4 = context.getState(State::Forces | State::Energy);
+    assertForces(state3, state4, tol);
+}
+
+void testDerivativesOnDemand(OpenMM_SFMT::SFMT& sfmt, NonbondedForce::NonbondedMethod method) {
+    const int numParticles = 60;
+    const double L = 4.0;
+    double tol = (platform.getName() == "Reference" || platform.getPropertyDefaultValue("Precision") == string("double")) ? 1e-5 : 1e-4;
+
+    vector<Vec3> positions(numParticles);
+    for (int i = 0; i < numParticles; i++) {
+        Vec3 site(i%4+0.5, (i/4)%4+0.5, i/16+0.5);
+        positions[i] = site + Vec3(genrand_real2(sfmt), genrand_real2(sfmt), genrand_real2(sfmt))*0.2;
+    }
+    System systems[2];
+    SlicedNonbondedForce* forces[2];
+    for (int k = 0; k < 2; k++) {
+        System& system = systems[k];
+        system.setDefaultPeriodicBoxVectors(Vec3(L, 0, 0), Vec3(0, L, 0), Vec3(0, 0, L));
+        SlicedNonbondedForce* force = forces[k] = new SlicedNonbondedForce(2);
+        force->setNonbondedMethod((SlicedNonbondedForce::NonbondedMethod) method);
+        force->setCutoffDistance(1.2);
+        force->setUseDispersionCorrection(true);
+        for (int i = 0; i < numParticles; i++) {
+            system.addParticle(1.0);
+            force->addParticle(i%2 == 0 ? 0.5 : -0.5, 0.3, 0.5);
+            force->setParticleSubset(i, i < 10 ? 0 : 1);
+        }
+        force->addGlobalParameter("lambda", 0.0);
+        force->addScalingParameter("lambda", 0, 1, true, true);
+        force->addScalingParameterDerivative("lambda");
+        force->setUseDerivativesOnDemand(k == 1);
+        system.addForce(force);
+    }
+    ASSERT(forces[1]->getUseDerivativesOnDemand());
+
+    VerletIntegrator integrator1(0.001), integrator2(0.001);
+    Context context1(systems[0], integrator1, platform);
+    Context context2(systems[1], integrator2, platform);
+    context1.setPositions(positions);
+    context2.setPositions(positions);
+
+    // Skipping the derivatives in evaluations without the energy must not change the forces,
+    // and the derivatives must still be computed along with the energy, including those of a
+    // switched-off slice.
+
+    for (double lambda : {0.0, 0.5}) {
+        context1.setParameter("lambda", lambda);
+        context2.setParameter("lambda", lambda);
+        assertForces(context1.getState(State::Forces), context2.getState(State::Forces), tol);
+        State state1 = context1.getState(State::Energy | State::ParameterDerivatives);
+        State state2 = context2.getState(State::Energy | State::ParameterDerivatives);
+        ASSERT_EQUAL_TOL(state1.getPotentialEnergy(), state2.getPotentialEnergy(), tol);
+        double expected = state1.getEnergyParameterDerivatives().at("lambda");
+        ASSERT_EQUAL_TOL(expected, state2.getEnergyParameterDerivatives().at("lambda"), tol);
+        ASSERT_EQUAL_TOL(expected, forces[1]->getScalingParameterDerivativesInContext(context2).at("lambda"), tol);
+        assertForces(context1.getState(State::Forces), context2.getState(State::Forces), tol);
+    }
+}
+
 void runPlatformTests();
 
 int main(int argc, char* argv[]) {
@@ -1311,8 +1999,11 @@ int main(int argc, char* argv[]) {
         initializeTests(argc, argv);
         for (auto method : nonbondedMethods)
             testInstantiateFromNonbondedForce(method);
+        testParticleSubsets();
+        testBulkParameterOffsets();
         testCoulomb();
         testLJ();
+        testSoftCore();
         testExclusionsAnd14();
         testCutoff();
         testCutoff14();
@@ -1322,18 +2013,34 @@ int main(int argc, char* argv[]) {
         testLargeSystem();
         testDispersionCorrection();
         testChangingParameters();
+        testExceptionOrder();
         testSwitchingFunction(SlicedNonbondedForce::CutoffNonPeriodic);
         testSwitchingFunction(SlicedNonbondedForce::PME);
         testTwoForces();
         testParameterOffsets();
+        testExclusionParameterOffsets();
+        testSuccessiveParameterOffsetChanges();
         testEwaldExceptions();
         testDirectAndReciprocal();
+        testInterpolationOrder();
+        testUnequalGridSizes();
         for (auto method : nonbondedMethods)
             for (auto exceptions : booleanValues) {
                 for (auto lj : booleanValues)
                     testOpenMMLab(sfmt, method, exceptions, lj);
                 testScalingParameterSeparation(sfmt, method, exceptions);
             }
+        for (auto method : nonbondedMethods)
+            for (auto separateReciprocal : booleanValues)
+                testSliceEnergies(sfmt, method, separateReciprocal);
+        testReplicaEnergies(sfmt);
+        testReducedForeignEnergies(sfmt);
+        for (auto method : nonbondedMethods)
+            testScalingParameterDerivatives(sfmt, method);
+        for (auto method : nonbondedMethods)
+            testZeroScalingParameters(sfmt, method);
+        for (auto method : nonbondedMethods)
+            testDerivativesOnDemand(sfmt, method);
     }
     catch(const exception& e) {
         cout << "exception: " << e.what() << endl;